@@ -34,6 +34,7 @@ static void usage(void)
 	     "  format                   Format a new filesystem\n"
 	     "  show-super               Dump superblock information to stdout\n"
 	     "  set-option               Set a filesystem option\n"
+	     "  zstd-dict                Train and install a zstd compression dictionary\n"
 	     "\n"
 	     "Repair:\n"
 	     "  fsck                     Check an existing filesystem for errors\n"
@@ -48,6 +49,7 @@ static void usage(void)
 #endif
 	     "Commands for managing a running filesystem:\n"
 	     "  fs usage                 Show disk usage\n"
+	     "  fs counters              Show event counters\n"
 	     "\n"
 	     "Commands for managing devices within a running filesystem:\n"
 	     "  device add               Add a new device to an existing filesystem\n"
@@ -58,6 +60,7 @@ static void usage(void)
 	     "  device set-state         Mark a device as failed\n"
 	     "  device resize            Resize filesystem on a device\n"
 	     "  device resize-journal    Resize journal on a device\n"
+	     "  device stats             Show IO latency and throughput per device\n"
 	     "\n"
 	     "Commands for managing subvolumes and snapshots:\n"
 	     "  subvolume create         Create a new subvolume\n"
@@ -66,6 +69,9 @@ static void usage(void)
 	     "\n"
 	     "Commands for managing filesystem data:\n"
 	     "  data rereplicate         Rereplicate degraded data\n"
+	     "  data defrag              Rewrite fragmented files contiguously\n"
+	     "  data scrub               Verify checksums of all data, repairing bad copies\n"
+	     "  data dedupe              Share the data of identical extents\n"
 	     "  data job                 Kick off low level data jobs\n"
 	     "\n"
 	     "Encryption:\n"
@@ -84,9 +90,11 @@ static void usage(void)
 	     "  dump                     Dump filesystem metadata to a qcow2 image\n"
 	     "  list                     List filesystem metadata in textual form\n"
 	     "  list_journal             List contents of journal\n"
+	     "  trace                    Decode tracepoints recorded with BCACHEFS_TRACE=file\n"
 	     "\n"
 	     "Miscellaneous:\n"
-	     "  version                  Display the version of the invoked bcachefs tool\n");
+	     "  version                  Display the version of the invoked bcachefs tool\n"
+	     "  bench                    Benchmark checksum, encryption, erasure coding and the btree\n");
 }
 
 static char *full_cmd;
@@ -110,6 +118,8 @@ static int fs_cmds(int argc, char *argv[])
 		return fs_usage();
 	if (!strcmp(cmd, "usage"))
 		return cmd_fs_usage(argc, argv);
+	if (!strcmp(cmd, "counters"))
+		return cmd_fs_counters(argc, argv);
 
 	return 0;
 }
@@ -136,6 +146,8 @@ static int device_cmds(int argc, char *argv[])
 		return cmd_device_resize(argc, argv);
 	if (!strcmp(cmd, "resize-journal"))
 		return cmd_device_resize_journal(argc, argv);
+	if (!strcmp(cmd, "stats"))
+		return cmd_device_stats(argc, argv);
 
 	return 0;
 }
@@ -148,6 +160,12 @@ static int data_cmds(int argc, char *argv[])
 		return data_usage();
 	if (!strcmp(cmd, "rereplicate"))
 		return cmd_data_rereplicate(argc, argv);
+	if (!strcmp(cmd, "defrag"))
+		return cmd_data_defrag(argc, argv);
+	if (!strcmp(cmd, "scrub"))
+		return cmd_data_scrub(argc, argv);
+	if (!strcmp(cmd, "dedupe"))
+		return cmd_data_dedupe(argc, argv);
 	if (!strcmp(cmd, "job"))
 		return cmd_data_job(argc, argv);
 
@@ -198,10 +216,14 @@ int main(int argc, char *argv[])
 		return cmd_fsck(argc, argv);
 	if (!strcmp(cmd, "version"))
 		return cmd_version(argc, argv);
+	if (!strcmp(cmd, "bench"))
+		return cmd_bench(argc, argv);
 	if (!strcmp(cmd, "show-super"))
 		return cmd_show_super(argc, argv);
 	if (!strcmp(cmd, "set-option"))
 		return cmd_set_option(argc, argv);
+	if (!strcmp(cmd, "zstd-dict"))
+		return cmd_zstd_dict(argc, argv);
 
 	if (argc < 2) {
 		printf("%s: missing command\n", argv[0]);
@@ -238,6 +260,8 @@ int main(int argc, char *argv[])
 		return cmd_list(argc, argv);
 	if (!strcmp(cmd, "list_journal"))
 		return cmd_list_journal(argc, argv);
+	if (!strcmp(cmd, "trace"))
+		return cmd_trace(argc, argv);
 	if (!strcmp(cmd, "kill_btree_node"))
 		return cmd_kill_btree_node(argc, argv);
 
@@ -1,7 +1,11 @@
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <unistd.h>
@@ -11,10 +15,38 @@
 #include "cmds.h"
 #include "libbcachefs.h"
 
-static void propagate_recurse(int dirfd)
+/*
+ * Fallback for kernels without BCHFS_IOC_REINHERIT_ATTRS_RECURSIVE: walk the
+ * tree from userspace, a directory at a time per thread:
+ */
+struct propagate_state {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	DARRAY(char *)		dirs;
+	unsigned		nr_busy;
+};
+
+static void propagate_queue(struct propagate_state *s, char *path)
 {
-	DIR *dir = fdopendir(dirfd);
+	pthread_mutex_lock(&s->lock);
+	if (darray_push(&s->dirs, path))
+		die("insufficient memory");
+	pthread_cond_signal(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void propagate_dir(struct propagate_state *s, const char *path)
+{
+	int dirfd = open(path, O_RDONLY|O_DIRECTORY);
 	struct dirent *d;
+	DIR *dir;
+
+	if (dirfd < 0) {
+		fprintf(stderr, "error opening %s: %m\n", path);
+		return;
+	}
+
+	dir = fdopendir(dirfd);
 
 	while ((errno = 0), (d = readdir(dir))) {
 		if (!strcmp(d->d_name, ".") ||
@@ -24,33 +56,84 @@ static void propagate_recurse(int dirfd)
 		int ret = ioctl(dirfd, BCHFS_IOC_REINHERIT_ATTRS,
 			    d->d_name);
 		if (ret < 0) {
-			fprintf(stderr, "error propagating attributes to %s: %m\n",
-				d->d_name);
+			fprintf(stderr, "error propagating attributes to %s/%s: %m\n",
+				path, d->d_name);
 			continue;
 		}
 
 		if (!ret) /* did no work */
 			continue;
 
-		struct stat st = xfstatat(dirfd, d->d_name,
-					  AT_SYMLINK_NOFOLLOW);
-		if (!S_ISDIR(st.st_mode))
-			continue;
-
-		int fd = openat(dirfd, d->d_name, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "error opening %s: %m\n", d->d_name);
-			continue;
+		if (d->d_type == DT_UNKNOWN) {
+			struct stat st = xfstatat(dirfd, d->d_name,
+						  AT_SYMLINK_NOFOLLOW);
+			if (S_ISDIR(st.st_mode))
+				d->d_type = DT_DIR;
 		}
-		propagate_recurse(fd);
-		close(fd);
+
+		if (d->d_type == DT_DIR)
+			propagate_queue(s, mprintf("%s/%s", path, d->d_name));
 	}
 
 	if (errno)
 		die("readdir error: %m");
+	closedir(dir);
 }
 
-static void do_setattr(char *path, struct bch_opt_strs opts)
+static void *propagate_thread(void *arg)
+{
+	struct propagate_state *s = arg;
+	char *path;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		while (!s->dirs.nr && s->nr_busy)
+			pthread_cond_wait(&s->wait, &s->lock);
+
+		if (!s->dirs.nr)
+			break;
+
+		path = s->dirs.data[--s->dirs.nr];
+		s->nr_busy++;
+		pthread_mutex_unlock(&s->lock);
+
+		propagate_dir(s, path);
+		free(path);
+
+		pthread_mutex_lock(&s->lock);
+		s->nr_busy--;
+	}
+	/* wake up everyone else so they see we're done: */
+	pthread_cond_broadcast(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void propagate_parallel(const char *path, unsigned nr_threads)
+{
+	struct propagate_state s = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.wait	= PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *threads = xcalloc(nr_threads, sizeof(*threads));
+	unsigned i;
+
+	propagate_queue(&s, strdup(path));
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, propagate_thread, &s))
+			die("pthread_create error: %m");
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	darray_exit(&s.dirs);
+	free(threads);
+}
+
+static void do_setattr(char *path, struct bch_opt_strs opts,
+		       unsigned nr_threads)
 {
 	unsigned i;
 
@@ -74,8 +157,16 @@ static void do_setattr(char *path, struct bch_opt_strs opts)
 	if (dirfd < 0)
 		die("error opening %s: %m", path);
 
-	propagate_recurse(dirfd);
+	/* Let the kernel walk the dirents btree, if it can: */
+	int ret = ioctl(dirfd, BCHFS_IOC_REINHERIT_ATTRS_RECURSIVE);
 	close(dirfd);
+
+	if (ret >= 0)
+		return;
+	if (errno != ENOTTY && errno != EINVAL)
+		die("error propagating attributes under %s: %m", path);
+
+	propagate_parallel(path, nr_threads);
 }
 
 static void setattr_usage(void)
@@ -86,28 +177,45 @@ static void setattr_usage(void)
 	     "Options:");
 
 	bch2_opts_usage(OPT_INODE);
-	puts("  -h            Display this help and exit\n"
+	puts("  -j, --threads=#             Threads for propagating attributes to\n"
+	     "                              children, on kernels that can't do it\n"
+	     "                              themselves (default: number of CPUs)\n"
+	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
 int cmd_setattr(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
 	struct bch_opt_strs opts =
 		bch2_cmdline_opts_get(&argc, argv, OPT_INODE);
-	unsigned i;
-
-	for (i = 1; i < argc; i++)
-		if (argv[i][0] == '-') {
-			printf("invalid option %s\n", argv[i]);
+	unsigned i, nr_threads = get_nprocs();
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "j:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'j':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'h':
+			setattr_usage();
+			exit(EXIT_SUCCESS);
+		default:
 			setattr_usage();
 			exit(EXIT_FAILURE);
 		}
+	args_shift(optind);
 
-	if (argc <= 1)
+	if (!argc)
 		die("Please supply one or more files");
 
-	for (i = 1; i < argc; i++)
-		do_setattr(argv[i], opts);
+	for (i = 0; i < argc; i++)
+		do_setattr(argv[i], opts, nr_threads);
 	bch2_opt_strs_free(&opts);
 
 	return 0;
@@ -0,0 +1,625 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sodium/runtime.h>
+
+#include <crypto/aes.h>
+#include <crypto/ghash.h>
+#include <crypto/hash.h>
+#include <crypto/poly1305.h>
+#include <crypto/skcipher.h>
+#include <crypto/sha2.h>
+#include <linux/crypto.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <raid/raid.h>
+
+#include "cmds.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/darray.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - benchmark checksum, encryption and erasure coding implementations\n"
+	     "Usage: bcachefs bench [OPTION]... [test]...\n"
+	     "       bcachefs bench btree [OPTION]... <device> [test]...\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s size       Buffer size (default 1M)\n"
+	     "  -t seconds    Time to run each test for (default 1)\n"
+	     "  -l            List tests\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static void bench_csum(unsigned type, void *buf, size_t len)
+{
+	bch2_checksum(NULL, type, (struct nonce) {{ 0 }}, buf, len);
+}
+
+static void bench_crc32c(void *buf, size_t len)
+{
+	bench_csum(BCH_CSUM_crc32c, buf, len);
+}
+
+static void bench_crc64(void *buf, size_t len)
+{
+	bench_csum(BCH_CSUM_crc64, buf, len);
+}
+
+static void bench_xxhash(void *buf, size_t len)
+{
+	bench_csum(BCH_CSUM_xxhash, buf, len);
+}
+
+static void bench_xxh3(void *buf, size_t len)
+{
+	bench_csum(BCH_CSUM_xxh3, buf, len);
+}
+
+static void bench_xxh3_128(void *buf, size_t len)
+{
+	bench_csum(BCH_CSUM_xxh3_128, buf, len);
+}
+
+static void bench_chacha20(void *buf, size_t len)
+{
+	struct bch_key key = { 0 };
+	int ret = bch2_chacha_encrypt_key(&key, (struct nonce) {{ 0 }}, buf, len);
+
+	if (ret)
+		die("chacha20 error %i", ret);
+}
+
+static void bench_poly1305(void *buf, size_t len)
+{
+	static struct crypto_shash *tfm;
+	u8 key[POLY1305_KEY_SIZE] = { 1 }, digest[POLY1305_DIGEST_SIZE];
+
+	if (!tfm) {
+		tfm = crypto_alloc_shash("poly1305", 0, 0);
+		if (IS_ERR(tfm))
+			die("error allocating poly1305: %li", PTR_ERR(tfm));
+	}
+
+	SHASH_DESC_ON_STACK(desc, tfm);
+	desc->tfm = tfm;
+	crypto_shash_init(desc);
+	crypto_shash_update(desc, key, sizeof(key));
+	crypto_shash_update(desc, buf, len);
+	crypto_shash_final(desc, digest);
+}
+
+static void bench_aes256_ctr(void *buf, size_t len)
+{
+	static struct crypto_sync_skcipher *tfm;
+	u8 key[AES_KEYSIZE_256] = { 1 }, iv[AES_BLOCK_SIZE] = { 0 };
+	struct scatterlist sg;
+
+	if (!tfm) {
+		tfm = crypto_alloc_sync_skcipher("ctr(aes)", 0, 0);
+		if (IS_ERR(tfm))
+			die("error allocating ctr(aes): %li", PTR_ERR(tfm));
+		crypto_skcipher_setkey(&tfm->base, key, sizeof(key));
+	}
+
+	SYNC_SKCIPHER_REQUEST_ON_STACK(req, tfm);
+	sg_init_one(&sg, buf, len);
+	skcipher_request_set_sync_tfm(req, tfm);
+	skcipher_request_set_crypt(req, &sg, &sg, len, iv);
+	crypto_skcipher_encrypt(req);
+}
+
+static void bench_ghash(void *buf, size_t len)
+{
+	static struct crypto_shash *tfm;
+	u8 key[GHASH_BLOCK_SIZE] = { 1 }, digest[GHASH_DIGEST_SIZE];
+
+	if (!tfm) {
+		tfm = crypto_alloc_shash("ghash", 0, 0);
+		if (IS_ERR(tfm))
+			die("error allocating ghash: %li", PTR_ERR(tfm));
+		crypto_shash_setkey(tfm, key, sizeof(key));
+	}
+
+	SHASH_DESC_ON_STACK(desc, tfm);
+	desc->tfm = tfm;
+	crypto_shash_init(desc);
+	crypto_shash_update(desc, buf, len);
+	crypto_shash_final(desc, digest);
+}
+
+static void bench_sha256(void *buf, size_t len)
+{
+	static struct crypto_shash *tfm;
+	u8 digest[SHA256_DIGEST_SIZE];
+
+	if (!tfm) {
+		tfm = crypto_alloc_shash("sha256", 0, 0);
+		if (IS_ERR(tfm))
+			die("error allocating sha256: %li", PTR_ERR(tfm));
+	}
+
+	SHASH_DESC_ON_STACK(desc, tfm);
+	desc->tfm = tfm;
+	crypto_shash_init(desc);
+	crypto_shash_update(desc, buf, len);
+	crypto_shash_final(desc, digest);
+}
+
+/*
+ * Erasure coding: the buffer is split into BENCH_RAID_ND data blocks and
+ * BENCH_RAID_NP parity blocks, like a stripe with 6+2 redundancy; -s should be
+ * large enough to leave a few cachelines per block.
+ */
+#define BENCH_RAID_ND		6
+#define BENCH_RAID_NP		2
+
+static size_t bench_raid_setup(void *buf, size_t len, void **v)
+{
+	void *p = PTR_ALIGN(buf, 64);
+	size_t block = round_down((len - (p - buf)) /
+				  (BENCH_RAID_ND + BENCH_RAID_NP), 64);
+	unsigned i;
+
+	if (!block)
+		die("buffer too small for raid benchmark");
+
+	for (i = 0; i < BENCH_RAID_ND + BENCH_RAID_NP; i++)
+		v[i] = p + i * block;
+	return block;
+}
+
+static void bench_raid_gen(void *buf, size_t len)
+{
+	void *v[BENCH_RAID_ND + BENCH_RAID_NP];
+	size_t block = bench_raid_setup(buf, len, v);
+
+	raid_gen(BENCH_RAID_ND, BENCH_RAID_NP, block, v);
+}
+
+static void bench_raid_rec(void *buf, size_t len)
+{
+	void *v[BENCH_RAID_ND + BENCH_RAID_NP];
+	size_t block = bench_raid_setup(buf, len, v);
+	int ir[BENCH_RAID_NP] = { 0, 1 };
+
+	raid_rec(BENCH_RAID_NP, ir, BENCH_RAID_ND, BENCH_RAID_NP, block, v);
+}
+
+static const struct bench_test {
+	const char	*name;
+	void		(*fn)(void *, size_t);
+} bench_tests[] = {
+	{ "crc32c",	bench_crc32c	},
+	{ "crc64",	bench_crc64	},
+	{ "xxhash",	bench_xxhash	},
+	{ "xxh3",	bench_xxh3	},
+	{ "xxh3_128",	bench_xxh3_128	},
+	{ "chacha20",	bench_chacha20	},
+	{ "poly1305",	bench_poly1305	},
+	{ "aes256_ctr",	bench_aes256_ctr },
+	{ "ghash",	bench_ghash	},
+	{ "sha256",	bench_sha256	},
+	{ "raid_gen",	bench_raid_gen	},
+	{ "raid_rec",	bench_raid_rec	},
+};
+
+static const struct bench_test *bench_test_find(const char *name)
+{
+	const struct bench_test *t;
+
+	for (t = bench_tests; t < bench_tests + ARRAY_SIZE(bench_tests); t++)
+		if (!strcmp(t->name, name))
+			return t;
+	return NULL;
+}
+
+static u64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void bench_run(const struct bench_test *t, void *buf, size_t size,
+		      unsigned secs)
+{
+	u64 start = bench_now(), end = start + (u64) secs * NSEC_PER_SEC, now;
+	u64 bytes = 0;
+
+	/* Warm up: */
+	t->fn(buf, size);
+
+	do {
+		t->fn(buf, size);
+		bytes += size;
+	} while ((now = bench_now()) < end);
+
+	printf("%-12s %10.1f MB/sec\n", t->name,
+	       (double) bytes / (now - start) * NSEC_PER_SEC / (1 << 20));
+}
+
+static void bench_cpu_features(void)
+{
+	printf("cpu features:");
+#if defined(__x86_64__) || defined(__i386__)
+	if (sodium_runtime_has_sse2())
+		printf(" sse2");
+	if (sodium_runtime_has_ssse3())
+		printf(" ssse3");
+	if (sodium_runtime_has_sse41())
+		printf(" sse4.1");
+	if (sodium_runtime_has_pclmul())
+		printf(" pclmul");
+	if (sodium_runtime_has_avx2())
+		printf(" avx2");
+	if (sodium_runtime_has_avx512f())
+		printf(" avx512f");
+	if (sodium_runtime_has_aesni())
+		printf(" aes");
+	if (__builtin_cpu_supports("vaes"))
+		printf(" vaes");
+	if (__builtin_cpu_supports("vpclmulqdq"))
+		printf(" vpclmulqdq");
+#endif
+	if (sodium_runtime_has_neon())
+		printf(" neon");
+	printf("\n");
+}
+
+static void bench_btree_usage(void)
+{
+	puts("bcachefs bench btree - run the btree perf tests\n"
+	     "Usage: bcachefs bench btree [OPTION]... <device> [test]...\n"
+	     "\n"
+	     "Runs the in kernel btree perf tests against a filesystem, which may be\n"
+	     "an image file (e.g. on tmpfs). The tests insert and delete keys in the\n"
+	     "xattrs btree; only use a scratch filesystem.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n nr         Number of iterations per test (default 1M)\n"
+	     "  -j threads    Number of threads (default 1)\n"
+	     "  -w spec       Run a workload instead of the fixed tests; spec is a\n"
+	     "                comma separated list of:\n"
+	     "                  keys=N          keyspace size (default 1M)\n"
+	     "                  dist=(uniform|zipf|hotspot)\n"
+	     "                  hot=K:O         hotspot: O%% of ops to K%% of keys (20:80)\n"
+	     "                  val=MIN[-MAX]   value size in bytes (default 8)\n"
+	     "                  read=%%,write=%%,delete=%%,scan=%%\n"
+	     "                                  operation mix (default read=70,write=30)\n"
+	     "                  scan_len=N      keys per scan (default 100)\n"
+	     "                  snapshots=N     spread keys over a chain of N snapshots\n"
+	     "  -T file       Replay a trace: one \"(read|write|delete|scan) key\" per line;\n"
+	     "                workload options other than keys apply\n"
+	     "  -l            List tests\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+/* Run in this order: lookups and deletes want the inserted keys */
+static const char * const bench_btree_tests[] = {
+	"rand_insert",
+	"rand_insert_multi",
+	"rand_lookup",
+	"rand_lookup_many_paths",
+	"rand_mixed",
+	"rand_delete",
+	"seq_insert",
+	"seq_insert_bulk",
+	"seq_lookup",
+	"seq_overwrite",
+	"seq_delete",
+	"inode_unpack",
+	"inode_unpack_scalar",
+	NULL
+};
+
+static void bench_btree_run(struct bch_fs *c, const char *name,
+			    u64 nr, unsigned nr_threads)
+{
+	struct time_stats latency;
+	struct printbuf buf = PRINTBUF;
+	u64 time;
+	int ret;
+
+	bch2_time_stats_init(&latency);
+
+	ret = __bch2_btree_perf_test(c, name, nr, nr_threads, &time, &latency);
+	if (ret)
+		die("%s: error %s", name, bch2_err_str(ret));
+
+	printf("%-20s %12llu ops/sec %8llu nsec/op (%u threads)\n",
+	       name,
+	       div64_u64(nr * NSEC_PER_SEC, time ?: 1),
+	       div64_u64(time * nr_threads, nr ?: 1),
+	       nr_threads);
+
+	/* Per operation latencies, only recorded by the rand_* tests: */
+	if (latency.count) {
+		printbuf_indent_add(&buf, 2);
+		bch2_time_stats_to_text(&buf, &latency);
+		printf("  %s\n", buf.buf);
+	}
+
+	printbuf_exit(&buf);
+	bch2_time_stats_exit(&latency);
+}
+
+static u64 bench_spec_u64(const char *name, const char *v)
+{
+	u64 ret;
+
+	if (!v || bch2_strtou64_h(v, &ret))
+		die("invalid workload %s=%s", name, v ?: "");
+	return ret;
+}
+
+static void bench_workload_parse(struct bch_perf_workload *w, char *spec)
+{
+	char *opt, *v;
+	bool have_pct = false;
+	unsigned op;
+
+	w->nr_keys		= 1 << 20;
+	w->hot_keys_pct		= 20;
+	w->hot_ops_pct		= 80;
+	w->val_bytes_min	= 8;
+	w->val_bytes_max	= 8;
+	w->scan_len		= 100;
+
+	while ((opt = strsep(&spec, ","))) {
+		if (!*opt)
+			continue;
+
+		v = strchr(opt, '=');
+		if (v)
+			*v++ = '\0';
+
+		if (!strcmp(opt, "keys")) {
+			w->nr_keys = bench_spec_u64(opt, v);
+		} else if (!strcmp(opt, "dist")) {
+			w->dist = read_string_list_or_die(v ?: "",
+					bch2_perf_dists, "distribution");
+		} else if (!strcmp(opt, "hot")) {
+			if (!v || sscanf(v, "%u:%u", &w->hot_keys_pct,
+					 &w->hot_ops_pct) != 2)
+				die("invalid workload hot=%s", v ?: "");
+		} else if (!strcmp(opt, "val")) {
+			char *max = v ? strchr(v, '-') : NULL;
+
+			if (max)
+				*max++ = '\0';
+			w->val_bytes_min = bench_spec_u64(opt, v);
+			w->val_bytes_max = max
+				? bench_spec_u64(opt, max)
+				: w->val_bytes_min;
+		} else if (!strcmp(opt, "scan_len")) {
+			w->scan_len = bench_spec_u64(opt, v);
+		} else if (!strcmp(opt, "snapshots")) {
+			w->nr_snapshots = bench_spec_u64(opt, v);
+		} else {
+			for (op = 0; op < BCH_PERF_OP_NR; op++)
+				if (!strcmp(opt, bch2_perf_ops[op]))
+					break;
+			if (op == BCH_PERF_OP_NR)
+				die("unknown workload option %s", opt);
+
+			w->op_pct[op] = bench_spec_u64(opt, v);
+			have_pct = true;
+		}
+	}
+
+	if (!have_pct) {
+		w->op_pct[BCH_PERF_OP_read]	= 70;
+		w->op_pct[BCH_PERF_OP_write]	= 30;
+	}
+}
+
+static struct bch_perf_trace_op *bench_trace_read(const char *path, u64 *nr)
+{
+	DARRAY(struct bch_perf_trace_op) ops = { 0 };
+	FILE *f = fopen(path, "r");
+	char *line = NULL, op[16];
+	size_t n = 0;
+	u64 key;
+	unsigned i;
+
+	if (!f)
+		die("error opening %s: %m", path);
+
+	while (getline(&line, &n, f) != -1) {
+		if (sscanf(line, "%15s %llu", op, &key) != 2)
+			continue;
+
+		for (i = 0; i < BCH_PERF_OP_NR; i++)
+			if (!strcmp(op, bch2_perf_ops[i]))
+				break;
+		if (i == BCH_PERF_OP_NR)
+			die("%s: unknown operation %s", path, op);
+
+		if (darray_push(&ops, ((struct bch_perf_trace_op) {
+				.key	= key,
+				.op	= i,
+			})))
+			die("error allocating memory");
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!ops.nr)
+		die("%s: empty trace", path);
+
+	*nr = ops.nr;
+	return ops.data;
+}
+
+static void bench_workload_run(struct bch_fs *c, struct bch_perf_workload *w,
+			       u64 nr, unsigned nr_threads)
+{
+	struct time_stats latency[BCH_PERF_OP_NR];
+	struct printbuf buf = PRINTBUF;
+	unsigned op;
+	u64 time;
+	int ret;
+
+	for (op = 0; op < BCH_PERF_OP_NR; op++) {
+		bch2_time_stats_init(&latency[op]);
+		w->latency[op] = &latency[op];
+	}
+
+	ret = bch2_btree_perf_workload(c, w, nr, nr_threads, &time);
+	if (ret)
+		die("workload: error %s", bch2_err_str(ret));
+
+	if (w->trace)
+		nr = w->trace_nr;
+
+	printf("%-20s %12llu ops/sec %8llu nsec/op (%u threads)\n",
+	       w->trace ? "trace" : bch2_perf_dists[w->dist],
+	       div64_u64(nr * NSEC_PER_SEC, time ?: 1),
+	       div64_u64(time * nr_threads, nr ?: 1),
+	       nr_threads);
+
+	for (op = 0; op < BCH_PERF_OP_NR; op++) {
+		if (latency[op].count) {
+			printbuf_reset(&buf);
+			printbuf_indent_add(&buf, 2);
+			bch2_time_stats_to_text(&buf, &latency[op]);
+			printf("%s:\n  %s\n", bch2_perf_ops[op], buf.buf);
+		}
+		bch2_time_stats_exit(&latency[op]);
+		w->latency[op] = NULL;
+	}
+
+	printbuf_exit(&buf);
+}
+
+static int cmd_bench_btree(int argc, char *argv[])
+{
+	const char * const *t;
+	struct bch_perf_workload w = { 0 };
+	char *spec = NULL, *trace = NULL;
+	u64 nr = 1 << 20;
+	unsigned nr_threads = 1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:j:w:T:lh")) != -1)
+		switch (opt) {
+		case 'n':
+			if (bch2_strtou64_h(optarg, &nr) || !nr)
+				die("invalid number of iterations %s", optarg);
+			break;
+		case 'j':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'w':
+			spec = optarg;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'l':
+			for (t = bench_btree_tests; *t; t++)
+				puts(*t);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			bench_btree_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	char *dev = arg_pop();
+	if (!dev)
+		die("Please supply a device");
+
+	struct bch_fs *c = bch2_fs_open(&dev, 1, bch2_opts_empty());
+	if (IS_ERR(c))
+		die("error opening %s: %s", dev, bch2_err_str(PTR_ERR(c)));
+
+	if (spec || trace) {
+		if (argc)
+			die("tests can't be given with -w or -T");
+
+		bench_workload_parse(&w, spec ? strdup(spec) : NULL);
+		if (trace)
+			w.trace = bench_trace_read(trace, &w.trace_nr);
+
+		bench_workload_run(c, &w, nr, nr_threads);
+		free((void *) w.trace);
+	} else if (argc) {
+		for (i = 0; i < argc; i++)
+			bench_btree_run(c, argv[i], nr, nr_threads);
+	} else {
+		for (t = bench_btree_tests; *t; t++)
+			bench_btree_run(c, *t, nr, nr_threads);
+	}
+
+	bch2_fs_stop(c);
+	return 0;
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	const struct bench_test *t;
+	size_t size = 1 << 20;
+	unsigned secs = 1;
+	u64 v;
+	void *buf;
+	int opt, i;
+
+	if (argc > 1 && !strcmp(argv[1], "btree"))
+		return cmd_bench_btree(argc - 1, argv + 1);
+
+	while ((opt = getopt(argc, argv, "s:t:lh")) != -1)
+		switch (opt) {
+		case 's':
+			if (bch2_strtou64_h(optarg, &v) || !v)
+				die("invalid size %s", optarg);
+			size = v;
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &secs) || !secs)
+				die("invalid time %s", optarg);
+			break;
+		case 'l':
+			for (t = bench_tests; t < bench_tests + ARRAY_SIZE(bench_tests); t++)
+				puts(t->name);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	for (i = 0; i < argc; i++)
+		if (!bench_test_find(argv[i]))
+			die("unknown test %s", argv[i]);
+
+	buf = xmalloc(size);
+	get_random_bytes(buf, size);
+
+	bench_cpu_features();
+
+	for (t = bench_tests; t < bench_tests + ARRAY_SIZE(bench_tests); t++) {
+		bool run = !argc;
+
+		for (i = 0; i < argc; i++)
+			run |= !strcmp(argv[i], t->name);
+		if (run)
+			bench_run(t, buf, size, secs);
+	}
+
+	free(buf);
+	return 0;
+}
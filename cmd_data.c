@@ -1,7 +1,9 @@
 
 
+#include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "libbcachefs/btree_cache.h"
@@ -16,12 +18,49 @@ int data_usage(void)
 	     "\n"
 	     "Commands:\n"
 	     "  rereplicate                     Rereplicate degraded data\n"
+	     "  defrag                          Rewrite fragmented files contiguously\n"
+	     "  scrub                           Verify checksums, repairing bad copies\n"
+	     "  dedupe                          Share the data of identical extents\n"
 	     "  job                             Kick off low level data jobs\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	return 0;
 }
 
+static const char * const data_job_priorities[] = {
+	"low",
+	"normal",
+	"high",
+	NULL
+};
+
+#define DATA_JOB_LIMIT_OPTS						\
+	{ "rate",		required_argument,	NULL, 'R' },	\
+	{ "iops",		required_argument,	NULL, 'I' },	\
+	{ "priority",		required_argument,	NULL, 'P' }
+
+/* Options common to all data jobs; returns false if @opt isn't one of them */
+static bool data_job_limit_opt(struct bch_ioctl_data *op, int opt)
+{
+	switch (opt) {
+	case 'R':
+		if (kstrtouint(optarg, 10, &op->rate_mb) ||
+		    op->rate_mb > U32_MAX >> 11)
+			die("invalid rate %s", optarg);
+		return true;
+	case 'I':
+		if (kstrtouint(optarg, 10, &op->rate_iops))
+			die("invalid iops %s", optarg);
+		return true;
+	case 'P':
+		op->priority = read_string_list_or_die(optarg,
+					data_job_priorities, "priority");
+		return true;
+	}
+
+	return false;
+}
+
 static void data_rereplicate_usage(void)
 {
 	puts("bcachefs data rereplicate\n"
@@ -31,6 +70,10 @@ static void data_rereplicate_usage(void)
 	     "of any degraded data\n"
 	     "\n"
 	     "Options:\n"
+	     "      --rate=MB               Limit the job to MB/sec\n"
+	     "      --iops=nr               Limit the job to nr extents moved/sec\n"
+	     "      --priority=prio         Priority against other IO: low (default),\n"
+	     "                              normal or high\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	exit(EXIT_SUCCESS);
@@ -38,13 +81,29 @@ static void data_rereplicate_usage(void)
 
 int cmd_data_rereplicate(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		DATA_JOB_LIMIT_OPTS,
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_ioctl_data op = {
+		.op		= BCH_DATA_OP_REREPLICATE,
+		.start_btree	= 0,
+		.start_pos	= POS_MIN,
+		.end_btree	= BTREE_ID_NR,
+		.end_pos	= POS_MAX,
+	};
 	int opt;
 
-	while ((opt = getopt(argc, argv, "h")) != -1)
+	while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+		if (data_job_limit_opt(&op, opt))
+			continue;
+
 		switch (opt) {
 		case 'h':
 			data_rereplicate_usage();
 		}
+	}
 	args_shift(optind);
 
 	char *fs_path = arg_pop();
@@ -54,13 +113,257 @@ int cmd_data_rereplicate(int argc, char *argv[])
 	if (argc)
 		die("too many arguments");
 
-	return bchu_data(bcache_fs_open(fs_path), (struct bch_ioctl_data) {
-		.op		= BCH_DATA_OP_REREPLICATE,
-		.start_btree	= 0,
+	return bchu_data(bcache_fs_open(fs_path), op);
+}
+
+static void data_defrag_usage(void)
+{
+	puts("bcachefs data defrag\n"
+	     "Usage: bcachefs data defrag [OPTION]... <path>\n"
+	     "\n"
+	     "Rewrites files that are made up of many small extents, or are spread\n"
+	     "over many more buckets than they need, so that they are contiguous.\n"
+	     "If path is a file only that file is defragmented, otherwise every\n"
+	     "file in the filesystem (or in the given range of inodes) is checked\n"
+	     "\n"
+	     "Options:\n"
+	     "  -m, --min-extent=size       Rewrite files with a smaller average extent\n"
+	     "                              size (default 64k)\n"
+	     "  -r, --bucket-ratio=nr       Rewrite files spread over more than nr times\n"
+	     "                              the number of buckets they need (default 2)\n"
+	     "  -s, --start=inode           First inode to check\n"
+	     "  -e, --end=inode             Last inode to check\n"
+	     "      --rate=MB               Limit the job to MB/sec\n"
+	     "      --iops=nr               Limit the job to nr extents moved/sec\n"
+	     "      --priority=prio         Priority against other IO: low (default),\n"
+	     "                              normal or high\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_data_defrag(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "min-extent",		required_argument,	NULL, 'm' },
+		{ "bucket-ratio",	required_argument,	NULL, 'r' },
+		{ "start",		required_argument,	NULL, 's' },
+		{ "end",		required_argument,	NULL, 'e' },
+		DATA_JOB_LIMIT_OPTS,
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_ioctl_data op = {
+		.op		= BCH_DATA_OP_DEFRAG,
+		.start_btree	= BTREE_ID_extents,
 		.start_pos	= POS_MIN,
-		.end_btree	= BTREE_ID_NR,
+		.end_btree	= BTREE_ID_extents,
 		.end_pos	= POS_MAX,
-	});
+	};
+	u64 v;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "m:r:s:e:h",
+				  longopts, NULL)) != -1) {
+		if (data_job_limit_opt(&op, opt))
+			continue;
+
+		switch (opt) {
+		case 'm':
+			if (bch2_strtou64_h(optarg, &v) || v < 512 ||
+			    (v >> 9) > U32_MAX)
+				die("invalid extent size %s", optarg);
+			op.defrag.min_extent_sectors = v >> 9;
+			break;
+		case 'r':
+			if (kstrtoull(optarg, 10, &v) || !v || v > U32_MAX)
+				die("invalid bucket ratio %s", optarg);
+			op.defrag.max_bucket_ratio = v;
+			break;
+		case 's':
+			if (kstrtoull(optarg, 10, &v))
+				die("invalid inode %s", optarg);
+			op.start_pos.inode = v;
+			break;
+		case 'e':
+			if (kstrtoull(optarg, 10, &v))
+				die("invalid inode %s", optarg);
+			op.end_pos.inode = v;
+			break;
+		case 'h':
+			data_defrag_usage();
+		}
+	}
+	args_shift(optind);
+
+	char *path = arg_pop();
+	if (!path)
+		die("Please supply a file or filesystem");
+
+	if (argc)
+		die("too many arguments");
+
+	struct stat st = xstat(path);
+	if (S_ISREG(st.st_mode)) {
+		op.start_pos	= POS(st.st_ino, 0);
+		op.end_pos	= POS(st.st_ino, U64_MAX);
+	}
+
+	return bchu_data(bcache_fs_open(path), op);
+}
+
+static void data_scrub_usage(void)
+{
+	puts("bcachefs data scrub\n"
+	     "Usage: bcachefs data scrub [OPTION]... <filesystem|device>\n"
+	     "\n"
+	     "Reads all data, in on disk order, and verifies checksums; bad copies\n"
+	     "are rewritten from good replicas or erasure coding. Given a device,\n"
+	     "only data on that device is checked. A scrub of the whole filesystem\n"
+	     "picks up where it left off if it was interrupted\n"
+	     "\n"
+	     "Options:\n"
+	     "  -r, --restart               Start from the beginning, even if a previous\n"
+	     "                              scrub was interrupted\n"
+	     "      --rate=MB               Limit the job to MB/sec\n"
+	     "      --iops=nr               Limit the job to nr extents checked/sec\n"
+	     "      --priority=prio         Priority against other IO: low (default),\n"
+	     "                              normal or high\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_data_scrub(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "restart",		no_argument,		NULL, 'r' },
+		DATA_JOB_LIMIT_OPTS,
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_ioctl_data op = {
+		.op		= BCH_DATA_OP_SCRUB,
+		.start_pos	= POS_MIN,
+		.end_pos	= POS_MAX,
+	};
+	struct bchfs_handle fs;
+	struct stat st;
+	int opt, dev_idx;
+
+	while ((opt = getopt_long(argc, argv, "rh", longopts, NULL)) != -1) {
+		if (data_job_limit_opt(&op, opt))
+			continue;
+
+		switch (opt) {
+		case 'r':
+			op.flags |= BCH_DATA_SCRUB_RESTART;
+			break;
+		case 'h':
+			data_scrub_usage();
+		}
+	}
+	args_shift(optind);
+
+	char *path = arg_pop();
+	if (!path)
+		die("Please supply a filesystem or device");
+
+	if (argc)
+		die("too many arguments");
+
+	if (stat(path, &st))
+		die("error opening %s: %m", path);
+
+	if (S_ISDIR(st.st_mode)) {
+		fs = bcache_fs_open(path);
+	} else {
+		fs = bchu_fs_open_by_dev(path, &dev_idx);
+		op.start_pos	= POS(dev_idx, 0);
+		op.end_pos	= POS(dev_idx, U64_MAX);
+	}
+
+	return bchu_data(fs, op);
+}
+
+static void data_dedupe_usage(void)
+{
+	puts("bcachefs data dedupe\n"
+	     "Usage: bcachefs data dedupe [OPTION]... <filesystem>\n"
+	     "\n"
+	     "Finds extents with identical contents, by checksum (or by hashing\n"
+	     "them, if they don't have one) and then comparing them, and makes them\n"
+	     "share one copy of the data with reflink\n"
+	     "\n"
+	     "Options:\n"
+	     "  -m, --min-extent=size       Skip extents smaller than size (default 4k)\n"
+	     "  -s, --start=inode           First inode to check\n"
+	     "  -e, --end=inode             Last inode to check\n"
+	     "      --rate=MB               Limit the job to MB/sec\n"
+	     "      --iops=nr               Limit the job to nr extents read/sec\n"
+	     "      --priority=prio         Priority against other IO: low (default),\n"
+	     "                              normal or high\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_data_dedupe(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "min-extent",		required_argument,	NULL, 'm' },
+		{ "start",		required_argument,	NULL, 's' },
+		{ "end",		required_argument,	NULL, 'e' },
+		DATA_JOB_LIMIT_OPTS,
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_ioctl_data op = {
+		.op		= BCH_DATA_OP_DEDUPE,
+		.start_btree	= BTREE_ID_extents,
+		.start_pos	= POS_MIN,
+		.end_btree	= BTREE_ID_extents,
+		.end_pos	= POS_MAX,
+	};
+	u64 v;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "m:s:e:h",
+				  longopts, NULL)) != -1) {
+		if (data_job_limit_opt(&op, opt))
+			continue;
+
+		switch (opt) {
+		case 'm':
+			if (bch2_strtou64_h(optarg, &v) || v < 512 ||
+			    (v >> 9) > U32_MAX)
+				die("invalid extent size %s", optarg);
+			op.dedupe.min_extent_sectors = v >> 9;
+			break;
+		case 's':
+			if (kstrtoull(optarg, 10, &v))
+				die("invalid inode %s", optarg);
+			op.start_pos.inode = v;
+			break;
+		case 'e':
+			if (kstrtoull(optarg, 10, &v))
+				die("invalid inode %s", optarg);
+			op.end_pos.inode = v;
+			break;
+		case 'h':
+			data_dedupe_usage();
+		}
+	}
+	args_shift(optind);
+
+	char *fs_path = arg_pop();
+	if (!fs_path)
+		die("Please supply a filesystem");
+
+	if (argc)
+		die("too many arguments");
+
+	return bchu_data(bcache_fs_open(fs_path), op);
 }
 
 static void data_job_usage(void)
@@ -74,8 +377,12 @@ static void data_job_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -b btree                    btree to operate on\n"
-	     "  -s inode:offset       start position\n"
-	     "  -e inode:offset       end position\n"
+	     "  -s inode:offset             start position\n"
+	     "  -e inode:offset             end position\n"
+	     "      --rate=MB               Limit the job to MB/sec\n"
+	     "      --iops=nr               Limit the job to nr extents moved/sec\n"
+	     "      --priority=prio         Priority against other IO: low (default),\n"
+	     "                              normal or high\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	exit(EXIT_SUCCESS);
@@ -86,11 +393,18 @@ const char * const data_jobs[] = {
 	"rereplicate",
 	"migrate",
 	"rewrite_old_nodes",
+	"defrag",
+	"dedupe",
 	NULL
 };
 
 int cmd_data_job(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		DATA_JOB_LIMIT_OPTS,
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
 	struct bch_ioctl_data op = {
 		.start_btree	= 0,
 		.start_pos	= POS_MIN,
@@ -99,7 +413,10 @@ int cmd_data_job(int argc, char *argv[])
 	};
 	int opt;
 
-	while ((opt = getopt(argc, argv, "s:e:h")) != -1)
+	while ((opt = getopt_long(argc, argv, "b:s:e:h", longopts, NULL)) != -1) {
+		if (data_job_limit_opt(&op, opt))
+			continue;
+
 		switch (opt) {
 		case 'b':
 			op.start_btree = read_string_list_or_die(optarg,
@@ -109,12 +426,13 @@ int cmd_data_job(int argc, char *argv[])
 		case 's':
 			op.start_pos	= bpos_parse(optarg);
 			break;
-			op.end_pos	= bpos_parse(optarg);
 		case 'e':
+			op.end_pos	= bpos_parse(optarg);
 			break;
 		case 'h':
 			data_job_usage();
 		}
+	}
 	args_shift(optind);
 
 	char *job = arg_pop();
@@ -123,9 +441,6 @@ int cmd_data_job(int argc, char *argv[])
 
 	op.op = read_string_list_or_die(job, data_jobs, "bad job type");
 
-	if (op.op == BCH_DATA_OP_SCRUB)
-		die("scrub not implemented yet");
-
 	char *fs_path = arg_pop();
 	if (!fs_path)
 		fs_path = ".";
@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include "libbcachefs/bcachefs.h"
+#include "libbcachefs/darray.h"
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "libbcachefs/journal.h"
 #include "libbcachefs/super-io.h"
@@ -35,6 +36,7 @@ int device_usage(void)
             "  set-state               mark a device as failed\n"
             "  resize                  resize filesystem on a device\n"
             "  resize-journal          resize journal on a device\n"
+            "  stats                   show IO latency and throughput per device\n"
             "\n"
             "Report bugs to <linux-bcachefs@vger.kernel.org>");
        return 0;
@@ -292,7 +294,12 @@ static void device_evacuate_usage(void)
 	puts("bcachefs device evacuate - move data off of a given device\n"
 	     "Usage: bcachefs device evacuate [OPTION]... device\n"
 	     "\n"
+	     "An interrupted evacuate resumes where it left off, as long as the\n"
+	     "device has stayed read-only\n"
+	     "\n"
 	     "Options:\n"
+	     "  -r, --restart               Start over from the beginning, instead of\n"
+	     "                              resuming an interrupted evacuate\n"
 	     "  -h, --help                  Display this help and exit\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -300,10 +307,19 @@ static void device_evacuate_usage(void)
 
 int cmd_device_evacuate(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		{ "restart",		no_argument,		NULL, 'r' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned flags = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "h")) != -1)
+	while ((opt = getopt_long(argc, argv, "rh", longopts, NULL)) != -1)
 		switch (opt) {
+		case 'r':
+			flags |= BCH_DATA_MIGRATE_RESTART;
+			break;
 		case 'h':
 			device_evacuate_usage();
 			exit(EXIT_SUCCESS);
@@ -325,10 +341,22 @@ int cmd_device_evacuate(int argc, char *argv[])
 	if (u.state == BCH_MEMBER_STATE_rw) {
 		printf("Setting %s readonly\n", dev_path);
 		bchu_disk_set_state(fs, dev_idx, BCH_MEMBER_STATE_ro, 0);
+	} else if (!flags) {
+		struct bch_sb *sb = bchu_read_super(fs, -1);
+		struct bch_sb_field_migrate_cursor *cur =
+			bch2_sb_get_migrate_cursor(sb);
+
+		if (cur && le32_to_cpu(cur->dev) == dev_idx)
+			printf("Resuming evacuate of %s at %s:%llu:%llu\n",
+			       dev_path, bch2_btree_ids[cur->btree_id],
+			       le64_to_cpu(cur->inode),
+			       le64_to_cpu(cur->offset));
+		free(sb);
 	}
 
 	return bchu_data(fs, (struct bch_ioctl_data) {
 		.op		= BCH_DATA_OP_MIGRATE,
+		.flags		= flags,
 		.start_btree	= 0,
 		.start_pos	= POS_MIN,
 		.end_btree	= BTREE_ID_NR,
@@ -452,6 +480,9 @@ static void device_resize_usage(void)
 	puts("bcachefs device resize \n"
 	     "Usage: bcachefs device resize device [ size ]\n"
 	     "\n"
+	     "Shrinking moves data out of the buckets past the new size first;\n"
+	     "the journal must already fit within the new size.\n"
+	     "\n"
 	     "Options:\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -518,7 +549,7 @@ int cmd_device_resize(int argc, char *argv[])
 		u64 nbuckets = size / le16_to_cpu(m->bucket_size);
 
 		if (nbuckets < le64_to_cpu(m->nbuckets))
-			die("Shrinking not supported yet");
+			printf("shrinking: moving data off the end of %s first\n", dev);
 
 		printf("resizing %s to %llu buckets\n", dev, nbuckets);
 		bchu_disk_resize(fs, idx, nbuckets);
@@ -542,7 +573,7 @@ int cmd_device_resize(int argc, char *argv[])
 		u64 nbuckets = size / le16_to_cpu(resize->mi.bucket_size);
 
 		if (nbuckets < le64_to_cpu(resize->mi.nbuckets))
-			die("Shrinking not supported yet");
+			printf("shrinking: moving data off the end of %s first\n", dev);
 
 		printf("resizing %s to %llu buckets\n", dev, nbuckets);
 		int ret = bch2_dev_resize(c, resize, nbuckets);
@@ -654,3 +685,297 @@ int cmd_device_resize_journal(int argc, char *argv[])
 	}
 	return 0;
 }
+
+static void device_stats_usage(void)
+{
+	puts("bcachefs device stats - show IO latency and throughput per device\n"
+	     "Usage: bcachefs device stats [OPTION]... [filesystem]\n"
+	     "\n"
+	     "IO is broken out by direction and data type; latencies are from\n"
+	     "histograms kept by the filesystem, accurate to within ~6%.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -w, --watch[=seconds]       Keep polling (default every 2 seconds),\n"
+	     "                              showing rates and latencies over each interval\n"
+	     "  -H, --histogram             Also show the latency histograms\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+struct dev_io_stats {
+	u64			bytes[2][BCH_DATA_NR];
+	struct time_stats_hist	hist[2][BCH_DATA_NR];
+};
+
+static const char * const dev_io_rw[] = { "read", "write", NULL };
+
+static unsigned dev_io_hist_idx(u64 start)
+{
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		if (bch2_time_stats_hist_bucket_start(i) == start)
+			return i;
+	return TIME_STATS_HIST_NR - 1;
+}
+
+static void dev_io_stats_read(int sysfs_fd, unsigned dev, struct dev_io_stats *s)
+{
+	char *path, *buf, *p, *line;
+
+	memset(s, 0, sizeof(*s));
+
+	/* rw type nr bytes ... */
+	path = mprintf("dev-%u/io_latency_by_type", dev);
+	buf = read_file_str(sysfs_fd, path);
+	for (p = buf; p && (line = strsep(&p, "\n"));) {
+		char rw_str[16], type_str[32];
+		int rw, type;
+		u64 nr, bytes;
+
+		if (sscanf(line, "%15s %31s %llu %llu",
+			   rw_str, type_str, &nr, &bytes) != 4 ||
+		    (rw = match_string(dev_io_rw, -1, rw_str)) < 0 ||
+		    (type = match_string(bch2_data_types, -1, type_str)) < 0)
+			continue;
+
+		s->bytes[rw][type] = bytes;
+	}
+	free(buf);
+	free(path);
+
+	/* rw type start end count */
+	path = mprintf("dev-%u/io_latency_hist_by_type", dev);
+	buf = read_file_str(sysfs_fd, path);
+	for (p = buf; p && (line = strsep(&p, "\n"));) {
+		char rw_str[16], type_str[32];
+		int rw, type;
+		u64 start, end, nr;
+
+		if (sscanf(line, "%15s %31s %llu %llu %llu",
+			   rw_str, type_str, &start, &end, &nr) != 5 ||
+		    (rw = match_string(dev_io_rw, -1, rw_str)) < 0 ||
+		    (type = match_string(bch2_data_types, -1, type_str)) < 0)
+			continue;
+
+		s->hist[rw][type].buckets[dev_io_hist_idx(start)] += nr;
+	}
+	free(buf);
+	free(path);
+}
+
+static void dev_io_hist_to_text(struct printbuf *out, struct time_stats_hist *h)
+{
+	u64 most = 0;
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		most = max(most, h->buckets[i]);
+
+	printbuf_indent_add(out, 2);
+	for (i = 0; i < TIME_STATS_HIST_NR; i++) {
+		unsigned j, bar;
+
+		if (!h->buckets[i])
+			continue;
+
+		bch2_pr_time_units(out, bch2_time_stats_hist_bucket_start(i));
+		prt_tab_rjust(out);
+		prt_printf(out, "%llu", h->buckets[i]);
+		prt_tab_rjust(out);
+		prt_char(out, ' ');
+
+		bar = DIV_ROUND_UP(h->buckets[i] * 40, most);
+		for (j = 0; j < bar; j++)
+			prt_char(out, '#');
+		prt_newline(out);
+	}
+	printbuf_indent_sub(out, 2);
+}
+
+/*
+ * With @prev, rates and latencies are over the interval since @prev was read;
+ * without, since the device was added:
+ */
+static void dev_io_stats_to_text(struct printbuf *out, struct dev_name *dev,
+				 struct dev_io_stats *cur, struct dev_io_stats *prev,
+				 unsigned secs, bool histogram)
+{
+	static const struct { const char *name; u64 num, den; } quantiles[] = {
+		{ "p50",	1,	2	},
+		{ "p90",	9,	10	},
+		{ "p99",	99,	100	},
+		{ "p99.9",	999,	1000	},
+	};
+	struct time_stats_hist h;
+	unsigned rw, type, i, q;
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 8);
+	printbuf_tabstop_push(out, 12);
+	for (i = 0; i < 8; i++)
+		printbuf_tabstop_push(out, 10);
+
+	prt_printf(out, "%s (device %u):", dev->dev ?: "(offline)", dev->idx);
+	prt_newline(out);
+
+	prt_str(out, "rw");
+	prt_tab(out);
+	prt_str(out, "type");
+	prt_tab(out);
+	prt_str(out, prev ? "ios/s" : "ios");
+	prt_tab_rjust(out);
+	prt_str(out, prev ? "bytes/s" : "bytes");
+	prt_tab_rjust(out);
+	prt_str(out, "avg");
+	prt_tab_rjust(out);
+	for (q = 0; q < ARRAY_SIZE(quantiles); q++) {
+		prt_str(out, quantiles[q].name);
+		prt_tab_rjust(out);
+	}
+	prt_str(out, "max");
+	prt_tab_rjust(out);
+	if (prev) {
+		prt_str(out, "depth");
+		prt_tab_rjust(out);
+	}
+	prt_newline(out);
+
+	for (rw = 0; rw < 2; rw++)
+		for (type = 1; type < BCH_DATA_NR; type++) {
+			u64 nr = 0, bytes = cur->bytes[rw][type], total_ns = 0, max = 0;
+
+			h = cur->hist[rw][type];
+			if (prev) {
+				for (i = 0; i < TIME_STATS_HIST_NR; i++)
+					h.buckets[i] -= prev->hist[rw][type].buckets[i];
+				bytes -= prev->bytes[rw][type];
+			}
+
+			for (i = 0; i < TIME_STATS_HIST_NR; i++) {
+				u64 start = bch2_time_stats_hist_bucket_start(i);
+				u64 end = bch2_time_stats_hist_bucket_end(i);
+
+				if (!h.buckets[i])
+					continue;
+
+				nr	 += h.buckets[i];
+				total_ns += h.buckets[i] *
+					(end != U64_MAX ? start + (end - start) / 2 : start);
+				max	 = end != U64_MAX ? end : start;
+			}
+
+			if (!nr)
+				continue;
+
+			prt_str(out, dev_io_rw[rw]);
+			prt_tab(out);
+			prt_str(out, bch2_data_types[type]);
+			prt_tab(out);
+			prt_printf(out, "%llu", prev ? nr / secs : nr);
+			prt_tab_rjust(out);
+			prt_human_readable_u64(out, prev ? bytes / secs : bytes);
+			prt_tab_rjust(out);
+			bch2_pr_time_units(out, total_ns / nr);
+			prt_tab_rjust(out);
+			for (q = 0; q < ARRAY_SIZE(quantiles); q++) {
+				bch2_pr_time_units(out,
+					bch2_time_stats_hist_quantile(&h, nr,
+						quantiles[q].num, quantiles[q].den));
+				prt_tab_rjust(out);
+			}
+			bch2_pr_time_units(out, max);
+			prt_tab_rjust(out);
+			if (prev) {
+				/* Little's law: average number of IOs in flight */
+				u64 depth = total_ns * 100 / ((u64) secs * NSEC_PER_SEC);
+
+				prt_printf(out, "%llu.%02llu", depth / 100, depth % 100);
+				prt_tab_rjust(out);
+			}
+			prt_newline(out);
+
+			if (histogram)
+				dev_io_hist_to_text(out, &h);
+		}
+	prt_newline(out);
+}
+
+int cmd_device_stats(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "watch",		optional_argument,	NULL, 'w' },
+		{ "histogram",		no_argument,		NULL, 'H' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct printbuf buf = PRINTBUF;
+	struct dev_io_stats *cur, *prev;
+	struct bchfs_handle fs;
+	struct dev_name *dev;
+	dev_names devs;
+	bool histogram = false;
+	unsigned interval = 0, i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "w::Hh", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'w':
+			interval = 2;
+			if (optarg && (kstrtouint(optarg, 10, &interval) || !interval))
+				die("invalid interval %s", optarg);
+			break;
+		case 'H':
+			histogram = true;
+			break;
+		case 'h':
+			device_stats_usage();
+		}
+	args_shift(optind);
+
+	fs	= bcache_fs_open(argc ? argv[0] : ".");
+	devs	= bchu_fs_get_devices(fs);
+	cur	= xcalloc(devs.nr, sizeof(*cur));
+	prev	= xcalloc(devs.nr, sizeof(*prev));
+
+	i = 0;
+	darray_for_each(devs, dev)
+		dev_io_stats_read(fs.sysfs_fd, dev->idx, &cur[i++]);
+
+	if (!interval) {
+		i = 0;
+		darray_for_each(devs, dev)
+			dev_io_stats_to_text(&buf, dev, &cur[i++], NULL, 0, histogram);
+		fputs(buf.buf ?: "", stdout);
+		goto out;
+	}
+
+	while (1) {
+		swap(cur, prev);
+		sleep(interval);
+
+		printbuf_reset(&buf);
+		i = 0;
+		darray_for_each(devs, dev) {
+			dev_io_stats_read(fs.sysfs_fd, dev->idx, &cur[i]);
+			dev_io_stats_to_text(&buf, dev, &cur[i], &prev[i],
+					     interval, histogram);
+			i++;
+		}
+
+		fputs(buf.buf ?: "", stdout);
+		fflush(stdout);
+	}
+out:
+	darray_for_each(devs, dev) {
+		free(dev->dev);
+		free(dev->label);
+	}
+	darray_exit(&devs);
+	free(prev);
+	free(cur);
+	printbuf_exit(&buf);
+	bcache_fs_close(fs);
+	return 0;
+}
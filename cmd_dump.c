@@ -1,6 +1,8 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 
 #include "cmds.h"
@@ -20,27 +22,125 @@ static void dump_usage(void)
 	     "Usage: bcachefs dump [OPTION]... <devices>\n"
 	     "\n"
 	     "Options:\n"
-	     "  -o output     Output qcow2 image(s)\n"
+	     "  -o output     Output qcow2 image(s); - for standard output,\n"
+	     "                single device filesystems only\n"
 	     "  -f            Force; overwrite when needed\n"
 	     "  -j            Dump entire journal, not just dirty entries\n"
+	     "  -z            Compress clusters; ignored when writing to a pipe\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+static void dump_node_ptrs(struct bch_fs *c, ranges *data, struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		if (ptr->dev < c->sb.nr_devices)
+			range_add(&data[ptr->dev], ptr->offset << 9,
+				  btree_bytes(c));
+}
+
+/*
+ * Btree node ranges for every device are collected in one pass over the
+ * btrees, split up between threads a btree at a time. Only interior nodes are
+ * read: pointers to the leaves are in their parents.
+ */
+struct dump_btrees {
+	struct bch_fs		*c;
+	atomic_t		next_btree;
+	pthread_mutex_t		lock;
+	ranges			*data;
+	int			ret;
+};
+
+static void *dump_btrees_thread(void *arg)
+{
+	struct dump_btrees *d = arg;
+	struct bch_fs *c = d->c;
+	ranges *data = xcalloc(c->sb.nr_devices, sizeof(*data));
+	struct range *r;
+	unsigned i, id;
+	int ret = 0;
+
+	sched_thread_init();
+
+	while (!ret &&
+	       (id = atomic_inc_return(&d->next_btree) - 1) < BTREE_ID_NR) {
+		struct btree_trans trans;
+		struct btree_iter iter;
+		struct btree *b;
+
+		bch2_trans_init(&trans, c, 0, 0);
+
+		__for_each_btree_node(&trans, iter, id, POS_MIN, 0, 1,
+				      BTREE_ITER_PREFETCH, b, ret) {
+			struct btree_node_iter iter;
+			struct bkey u;
+			struct bkey_s_c k;
+
+			for_each_btree_node_key_unpack(b, k, &iter, &u)
+				dump_node_ptrs(c, data, k);
+		}
+
+		b = c->btree_roots[id].b;
+		if (!ret && !btree_node_fake(b))
+			dump_node_ptrs(c, data, bkey_i_to_s_c(&b->key));
+
+		bch2_trans_iter_exit(&trans, &iter);
+		bch2_trans_exit(&trans);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < c->sb.nr_devices; i++) {
+		darray_for_each(data[i], r)
+			range_add(&d->data[i], r->start, r->end - r->start);
+		darray_exit(&data[i]);
+	}
+	d->ret = d->ret ?: ret;
+	pthread_mutex_unlock(&d->lock);
+
+	free(data);
+	return NULL;
+}
+
+static ranges *dump_btree_ranges(struct bch_fs *c)
+{
+	struct dump_btrees d = {
+		.c	= c,
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.data	= xcalloc(c->sb.nr_devices, sizeof(ranges)),
+	};
+	unsigned i, nr_threads = min(get_nprocs(), BTREE_ID_NR);
+	pthread_t *threads = xcalloc(nr_threads, sizeof(*threads));
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, dump_btrees_thread, &d))
+			die("pthread_create error: %m");
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (d.ret)
+		die("error %s walking btree nodes", bch2_err_str(d.ret));
+
+	return d.data;
+}
+
 static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
-			    bool entire_journal)
+			    ranges *data, bool entire_journal, bool compress)
 {
 	struct bch_sb *sb = ca->disk_sb.sb;
-	ranges data = { 0 };
 	unsigned i;
-	int ret;
 
 	/* Superblock: */
-	range_add(&data, BCH_SB_LAYOUT_SECTOR << 9,
+	range_add(data, BCH_SB_LAYOUT_SECTOR << 9,
 		  sizeof(struct bch_sb_layout));
 
 	for (i = 0; i < sb->layout.nr_superblocks; i++)
-		range_add(&data,
+		range_add(data,
 			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
 			  vstruct_bytes(sb));
 
@@ -50,67 +150,48 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 		    ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
 			u64 bucket = ca->journal.buckets[i];
 
-			range_add(&data,
+			range_add(data,
 				  bucket_bytes(ca) * bucket,
 				  bucket_bytes(ca));
 		}
 
-	/* Btree: */
-	for (i = 0; i < BTREE_ID_NR; i++) {
-		const struct bch_extent_ptr *ptr;
-		struct bkey_ptrs_c ptrs;
-		struct btree_trans trans;
-		struct btree_iter iter;
-		struct btree *b;
-
-		bch2_trans_init(&trans, c, 0, 0);
-
-		__for_each_btree_node(&trans, iter, i, POS_MIN, 0, 1, 0, b, ret) {
-			struct btree_node_iter iter;
-			struct bkey u;
-			struct bkey_s_c k;
-
-			for_each_btree_node_key_unpack(b, k, &iter, &u) {
-				ptrs = bch2_bkey_ptrs_c(k);
-
-				bkey_for_each_ptr(ptrs, ptr)
-					if (ptr->dev == ca->dev_idx)
-						range_add(&data,
-							  ptr->offset << 9,
-							  btree_bytes(c));
-			}
-		}
-
-		if (ret)
-			die("error %s walking btree nodes", strerror(-ret));
-
-		b = c->btree_roots[i].b;
-		if (!btree_node_fake(b)) {
-			ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
+	qcow2_write_image(ca->disk_sb.bdev->bd_buffered_fd, fd, data,
+			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)),
+			  compress);
+	darray_exit(data);
+}
 
-			bkey_for_each_ptr(ptrs, ptr)
-				if (ptr->dev == ca->dev_idx)
-					range_add(&data,
-						  ptr->offset << 9,
-						  btree_bytes(c));
-		}
+struct dump_dev {
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+	int			fd;
+	ranges			*data;
+	bool			entire_journal;
+	bool			compress;
+	pthread_t		thread;
+};
+
+static void *dump_dev_thread(void *arg)
+{
+	struct dump_dev *d = arg;
 
-		bch2_trans_iter_exit(&trans, &iter);
-		bch2_trans_exit(&trans);
-	}
+	sched_thread_init();
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_buffered_fd, fd, &data,
-			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)));
-	darray_exit(&data);
+	dump_one_device(d->c, d->ca, d->fd, d->data,
+			d->entire_journal, d->compress);
+	close(d->fd);
+	return NULL;
 }
 
 int cmd_dump(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
 	struct bch_dev *ca;
+	struct dump_dev *devs;
+	ranges *data;
 	char *out = NULL;
-	unsigned i, nr_devices = 0;
-	bool force = false, entire_journal = false;
+	unsigned i, nr = 0, nr_devices = 0;
+	bool force = false, entire_journal = false, compress = false;
 	int fd, opt;
 
 	opt_set(opts, nochanges,	true);
@@ -119,7 +200,7 @@ int cmd_dump(int argc, char *argv[])
 	opt_set(opts, errors,		BCH_ON_ERROR_continue);
 	opt_set(opts, fix_errors,	FSCK_OPT_NO);
 
-	while ((opt = getopt(argc, argv, "o:fjvh")) != -1)
+	while ((opt = getopt(argc, argv, "o:fjzvh")) != -1)
 		switch (opt) {
 		case 'o':
 			out = optarg;
@@ -130,6 +211,9 @@ int cmd_dump(int argc, char *argv[])
 		case 'j':
 			entire_journal = true;
 			break;
+		case 'z':
+			compress = true;
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -156,6 +240,13 @@ int cmd_dump(int argc, char *argv[])
 
 	BUG_ON(!nr_devices);
 
+	if (!strcmp(out, "-") && nr_devices > 1)
+		die("Can only dump a single device to standard output");
+
+	data = dump_btree_ranges(c);
+	devs = xcalloc(nr_devices, sizeof(*devs));
+
+	/* Each device is dumped by its own thread: */
 	for_each_online_member(ca, c, i) {
 		int flags = O_WRONLY|O_CREAT|O_TRUNC;
 
@@ -165,16 +256,44 @@ int cmd_dump(int argc, char *argv[])
 		if (!c->devs[i])
 			continue;
 
-		char *path = nr_devices > 1
-			? mprintf("%s.%u.qcow2", out, i)
-			: mprintf("%s.qcow2", out);
-		fd = xopen(path, flags, 0600);
-		free(path);
+		if (!strcmp(out, "-")) {
+			fd = dup(STDOUT_FILENO);
+			if (fd < 0)
+				die("dup error: %m");
+		} else {
+			char *path = nr_devices > 1
+				? mprintf("%s.%u.qcow2", out, i)
+				: mprintf("%s.qcow2", out);
+			fd = xopen(path, flags, 0600);
+			free(path);
+		}
 
-		dump_one_device(c, ca, fd, entire_journal);
-		close(fd);
+		devs[nr] = (struct dump_dev) {
+			.c		= c,
+			.ca		= ca,
+			.fd		= fd,
+			.data		= &data[i],
+			.entire_journal	= entire_journal,
+			.compress	= compress,
+		};
+
+		percpu_ref_get(&ca->ref);
+		if (pthread_create(&devs[nr].thread, NULL,
+				   dump_dev_thread, &devs[nr]))
+			die("pthread_create error: %m");
+		nr++;
 	}
 
+	for (i = 0; i < nr; i++) {
+		pthread_join(devs[i].thread, NULL);
+		percpu_ref_put(&devs[i].ca->ref);
+	}
+	free(devs);
+
+	for (i = 0; i < c->sb.nr_devices; i++)
+		darray_exit(&data[i]);
+	free(data);
+
 	up_read(&c->gc_lock);
 
 	bch2_fs_stop(c);
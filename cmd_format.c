@@ -31,6 +31,7 @@
 #define OPTS						\
 x(0,	replicas,		required_argument)	\
 x(0,	encrypted,		no_argument)		\
+x(0,	encryption_type,	required_argument)	\
 x(0,	no_passphrase,		no_argument)		\
 x('L',	fs_label,		required_argument)	\
 x('U',	uuid,			required_argument)	\
@@ -39,6 +40,7 @@ x(0,	superblock_size,	required_argument)	\
 x(0,	bucket_size,		required_argument)	\
 x('l',	label,			required_argument)	\
 x(0,	discard,		no_argument)		\
+x(0,	secure_discard,		no_argument)		\
 x(0,	data_allowed,		required_argument)	\
 x(0,	durability,		required_argument)	\
 x(0,	version,		required_argument)	\
@@ -60,6 +62,8 @@ static void usage(void)
 	puts(
 	     "      --replicas=#            Sets both data and metadata replicas\n"
 	     "      --encrypted             Enable whole filesystem encryption (chacha20/poly1305)\n"
+	     "      --encryption_type=(chacha20_poly1305|aes256_gcm)\n"
+	     "                              Encryption algorithm; implies --encrypted\n"
 	     "      --no_passphrase         Don't encrypt master encryption key\n"
 	     "  -L, --fs_label=label\n"
 	     "  -U, --uuid=uuid\n"
@@ -70,6 +74,8 @@ static void usage(void)
 	bch2_opts_usage(OPT_DEVICE);
 
 	puts("  -l, --label=label           Disk label\n"
+	     "      --secure_discard        Securely discard the whole device before\n"
+	     "                              formatting, instead of a plain discard\n"
 	     "\n"
 	     "  -f, --force\n"
 	     "  -q, --quiet                 Only print errors\n"
@@ -142,6 +148,16 @@ int cmd_format(int argc, char *argv[])
 		case O_encrypted:
 			opts.encrypted = true;
 			break;
+		case O_encryption_type: {
+			int t = match_string(bch2_encryption_types, -1, optarg);
+
+			if (t <= BCH_ENCRYPTION_none)
+				die("invalid encryption type %s", optarg);
+
+			opts.encrypted		= true;
+			opts.encryption_type	= t;
+			break;
+		}
 		case O_no_passphrase:
 			no_passphrase = true;
 			break;
@@ -179,6 +195,9 @@ int cmd_format(int argc, char *argv[])
 		case O_discard:
 			dev_opts.discard = true;
 			break;
+		case O_secure_discard:
+			dev_opts.secure_discard = true;
+			break;
 		case O_data_allowed:
 			dev_opts.data_allowed =
 				read_flag_list_or_die(optarg,
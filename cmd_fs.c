@@ -1,4 +1,5 @@
 
+#include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 
@@ -275,6 +276,299 @@ static void fs_usage_to_text(struct printbuf *out, const char *path)
 	bcache_fs_close(fs);
 }
 
+/*
+ * Polling usage: BCH_IOCTL_FS_USAGE_COUNTERS returns every counter in a single
+ * ioctl, so we just keep the previous sample around and report what changed:
+ */
+struct usage_counters {
+	struct bchfs_handle		fs;
+	dev_names			devs;
+
+	/* for naming replicas counters: */
+	struct bch_ioctl_fs_usage	*u;
+	DARRAY(struct bch_replicas_usage *) replicas;
+
+	struct bch_ioctl_fs_usage_counters *cur, *prev;
+};
+
+static void usage_counters_get_replicas(struct usage_counters *w)
+{
+	struct bch_replicas_usage *r;
+
+	free(w->u);
+	w->u = bchu_fs_usage(w->fs);
+
+	w->replicas.nr = 0;
+	for_each_usage_replica(w->u, r)
+		darray_push(&w->replicas, r);
+}
+
+/*
+ * For kernels without BCH_IOCTL_FS_USAGE_COUNTERS: construct the same counters
+ * from the older ioctls.
+ */
+static struct bch_ioctl_fs_usage_counters *
+usage_counters_read_compat(struct usage_counters *w,
+			   struct bch_ioctl_fs_usage_counters *c)
+{
+	struct dev_name *dev;
+	unsigned i, j, nr_devices = 0;
+	u64 *d;
+
+	usage_counters_get_replicas(w);
+
+	darray_for_each(w->devs, dev)
+		nr_devices = max(nr_devices, dev->idx + 1);
+
+	c = xrealloc(c, sizeof(*c) + sizeof(u64) *
+		     bch_usage_counters_nr(w->replicas.nr, nr_devices));
+	memset(c, 0, sizeof(*c) + sizeof(u64) *
+	       bch_usage_counters_nr(w->replicas.nr, nr_devices));
+
+	c->nr		= bch_usage_counters_nr(w->replicas.nr, nr_devices);
+	c->nr_replicas	= w->replicas.nr;
+	c->nr_devices	= nr_devices;
+
+	c->counters[BCH_USAGE_COUNTER_capacity]		= w->u->capacity;
+	c->counters[BCH_USAGE_COUNTER_used]		= w->u->used;
+	c->counters[BCH_USAGE_COUNTER_online_reserved]	= w->u->online_reserved;
+
+	for (i = 0; i < BCH_REPLICAS_MAX; i++)
+		c->counters[BCH_USAGE_COUNTER_persistent_reserved + i] =
+			w->u->persistent_reserved[i];
+
+	for (i = 0; i < w->replicas.nr; i++)
+		c->counters[BCH_USAGE_COUNTER_replicas + i] =
+			w->replicas.data[i]->sectors;
+
+	darray_for_each(w->devs, dev) {
+		struct bch_ioctl_dev_usage u = bchu_dev_usage(w->fs, dev->idx);
+
+		d = c->counters + bch_usage_counters_nr(w->replicas.nr, dev->idx);
+		d[BCH_DEV_USAGE_COUNTER_nr_buckets]	= u.nr_buckets;
+		d[BCH_DEV_USAGE_COUNTER_buckets_ec]	= u.buckets_ec;
+
+		for (j = 0; j < BCH_DATA_NR; j++) {
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 0] = u.d[j].buckets;
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 1] = u.d[j].sectors;
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 2] = u.d[j].fragmented;
+		}
+	}
+
+	return c;
+}
+
+static void usage_counters_read(struct usage_counters *w)
+{
+	swap(w->cur, w->prev);
+
+	struct bch_ioctl_fs_usage_counters *c =
+		bchu_fs_usage_counters(w->fs, w->cur);
+
+	if (c) {
+		if (!w->u || w->replicas.nr != c->nr_replicas)
+			usage_counters_get_replicas(w);
+	} else {
+		c = usage_counters_read_compat(w, NULL);
+	}
+
+	w->cur = c;
+}
+
+static void usage_counters_init(struct usage_counters *w, const char *path)
+{
+	memset(w, 0, sizeof(*w));
+
+	w->fs	= bcache_fs_open(path);
+	w->devs	= bchu_fs_get_devices(w->fs);
+}
+
+static void usage_counters_exit(struct usage_counters *w)
+{
+	struct dev_name *dev;
+
+	darray_for_each(w->devs, dev) {
+		free(dev->dev);
+		free(dev->label);
+	}
+	darray_exit(&w->devs);
+	darray_exit(&w->replicas);
+	free(w->u);
+	free(w->cur);
+	free(w->prev);
+	bcache_fs_close(w->fs);
+}
+
+static void usage_counter_name(struct printbuf *out,
+			       struct usage_counters *w, unsigned idx)
+{
+	static const char * const dev_counter_names[] = {
+		"buckets", "sectors", "fragmented",
+	};
+	struct dev_name *dev;
+	unsigned i, nr_replicas = w->cur->nr_replicas;
+
+	switch (idx) {
+	case BCH_USAGE_COUNTER_capacity:
+		prt_str(out, "capacity");
+		return;
+	case BCH_USAGE_COUNTER_used:
+		prt_str(out, "used");
+		return;
+	case BCH_USAGE_COUNTER_online_reserved:
+		prt_str(out, "online_reserved");
+		return;
+	}
+
+	if (idx < BCH_USAGE_COUNTER_replicas) {
+		prt_printf(out, "persistent_reserved.%u",
+			   idx - BCH_USAGE_COUNTER_persistent_reserved);
+		return;
+	}
+
+	idx -= BCH_USAGE_COUNTER_replicas;
+	if (idx < nr_replicas) {
+		struct bch_replicas_usage *r;
+
+		/* replicas table changed since we got the entries: */
+		if (idx >= w->replicas.nr) {
+			prt_printf(out, "replicas.%u", idx);
+			return;
+		}
+
+		r = w->replicas.data[idx];
+		prt_printf(out, "replicas.%s.%u/%u.",
+			   bch2_data_types[r->r.data_type],
+			   r->r.nr_required, r->r.nr_devs);
+
+		for (i = 0; i < r->r.nr_devs; i++) {
+			dev = dev_idx_to_name(&w->devs, r->r.devs[i]);
+			if (i)
+				prt_char(out, ',');
+			if (dev && dev->dev)
+				prt_str(out, dev->dev);
+			else
+				prt_printf(out, "%u", r->r.devs[i]);
+		}
+		return;
+	}
+
+	idx -= nr_replicas;
+	i = idx / BCH_DEV_USAGE_COUNTERS;
+	idx %= BCH_DEV_USAGE_COUNTERS;
+
+	dev = dev_idx_to_name(&w->devs, i);
+	if (dev && dev->dev)
+		prt_printf(out, "dev.%s.", dev->dev);
+	else
+		prt_printf(out, "dev.%u.", i);
+
+	switch (idx) {
+	case BCH_DEV_USAGE_COUNTER_nr_buckets:
+		prt_str(out, "nr_buckets");
+		break;
+	case BCH_DEV_USAGE_COUNTER_buckets_ec:
+		prt_str(out, "buckets_ec");
+		break;
+	default:
+		idx -= BCH_DEV_USAGE_COUNTER_d;
+		prt_printf(out, "%s.%s",
+			   bch2_data_types[idx / 3],
+			   dev_counter_names[idx % 3]);
+	}
+}
+
+static bool usage_counter_changed(struct usage_counters *w, unsigned idx)
+{
+	return !w->prev ||
+		w->prev->nr_replicas	!= w->cur->nr_replicas ||
+		w->prev->nr_devices	!= w->cur->nr_devices ||
+		w->prev->counters[idx]	!= w->cur->counters[idx];
+}
+
+/* One line per sample: the first has every counter, later ones what changed */
+static void usage_counters_to_json(FILE *out, struct usage_counters *w)
+{
+	struct printbuf buf = PRINTBUF;
+	unsigned i;
+	bool first = true;
+
+	pr_uuid(&buf, w->fs.uuid.b);
+	fprintf(out, "{\"uuid\":\"%s\",\"seq\":%llu,\"counters\":{",
+		buf.buf, w->cur->seq);
+
+	for (i = 0; i < w->cur->nr; i++) {
+		if (!usage_counter_changed(w, i))
+			continue;
+
+		printbuf_reset(&buf);
+		usage_counter_name(&buf, w, i);
+
+		fputs(first ? "\"" : ",\"", out);
+		json_escape(out, buf.buf);
+		fprintf(out, "\":%llu", w->cur->counters[i]);
+		first = false;
+	}
+
+	fputs("}}\n", out);
+	fflush(out);
+	printbuf_exit(&buf);
+}
+
+static void usage_counters_changes_to_text(FILE *out, struct usage_counters *w)
+{
+	struct printbuf buf = PRINTBUF;
+	unsigned i;
+
+	for (i = 0; i < w->cur->nr; i++) {
+		if (!usage_counter_changed(w, i))
+			continue;
+
+		printbuf_reset(&buf);
+		usage_counter_name(&buf, w, i);
+
+		fprintf(out, "%s: %llu -> %llu\n", buf.buf,
+			w->prev->counters[i], w->cur->counters[i]);
+	}
+
+	fflush(out);
+	printbuf_exit(&buf);
+}
+
+static void fs_usage_watch(const char *path, unsigned interval,
+			   bool json, bool human_readable)
+{
+	struct usage_counters w;
+
+	usage_counters_init(&w, path);
+
+	while (1) {
+		usage_counters_read(&w);
+
+		if (json) {
+			usage_counters_to_json(stdout, &w);
+		} else if (!w.prev ||
+			   w.prev->nr_replicas != w.cur->nr_replicas ||
+			   w.prev->nr_devices != w.cur->nr_devices) {
+			struct printbuf buf = PRINTBUF;
+
+			buf.human_readable_units = human_readable;
+			fs_usage_to_text(&buf, path);
+			printf("%s", buf.buf);
+			fflush(stdout);
+			printbuf_exit(&buf);
+		} else {
+			usage_counters_changes_to_text(stdout, &w);
+		}
+
+		if (!interval)
+			break;
+		sleep(interval);
+	}
+
+	usage_counters_exit(&w);
+}
+
 int fs_usage(void)
 {
        puts("bcachefs fs - manage a running filesystem\n"
@@ -282,6 +576,18 @@ int fs_usage(void)
             "\n"
             "Commands:\n"
             "  usage                      show disk usage\n"
+            "  counters                   show event counters since mount\n"
+            "\n"
+            "Options for usage:\n"
+            "  -h, --human-readable       Print human readable sizes\n"
+            "  -j, --json                 Print counters as JSON\n"
+            "  -w, --watch[=seconds]      Keep polling, printing only the\n"
+            "                             counters that changed (default 2s)\n"
+            "\n"
+            "Options for counters:\n"
+            "  -a, --all                  Include counters that are zero\n"
+            "  -w, --watch[=seconds]      Keep polling, printing events/sec\n"
+            "                             of counters that changed (default 2s)\n"
             "\n"
             "Report bugs to <linux-bcachefs@vger.kernel.org>");
        return 0;
@@ -289,20 +595,48 @@ int fs_usage(void)
 
 int cmd_fs_usage(int argc, char *argv[])
 {
-	bool human_readable = false;
+	static const struct option longopts[] = {
+		{ "human-readable",	no_argument,		NULL, 'h' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "watch",		optional_argument,	NULL, 'w' },
+		{ NULL }
+	};
+	bool human_readable = false, json = false;
+	unsigned interval = 0;
 	struct printbuf buf = PRINTBUF;
 	char *fs;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "h")) != -1)
+	while ((opt = getopt_long(argc, argv, "hjw::", longopts, NULL)) != -1)
 		switch (opt) {
 		case 'h':
 			human_readable = true;
 			break;
+		case 'j':
+			json = true;
+			break;
+		case 'w':
+			interval = 2;
+			if (optarg && (kstrtouint(optarg, 10, &interval) || !interval))
+				die("invalid interval %s", optarg);
+			break;
+		default:
+			fs_usage();
+			exit(EXIT_FAILURE);
 		}
 	args_shift(optind);
 
-	if (!argc) {
+	if (interval) {
+		if (argc > 1)
+			die("--watch only supports a single filesystem");
+
+		fs_usage_watch(argc ? argv[0] : ".", interval, json, human_readable);
+	} else if (json) {
+		if (!argc)
+			fs_usage_watch(".", 0, true, false);
+		while ((fs = arg_pop()))
+			fs_usage_watch(fs, 0, true, false);
+	} else if (!argc) {
 		printbuf_reset(&buf);
 		buf.human_readable_units = human_readable;
 		fs_usage_to_text(&buf, ".");
@@ -319,3 +653,119 @@ int cmd_fs_usage(int argc, char *argv[])
 	printbuf_exit(&buf);
 	return 0;
 }
+
+/* fs counters: */
+
+struct fs_counter {
+	char			*name;
+	u64			v;
+};
+
+typedef DARRAY(struct fs_counter) fs_counters;
+
+/* counters_all is "name value" per line, in a fixed order: */
+static void fs_counters_read(int sysfs_fd, fs_counters *out)
+{
+	char *buf = read_file_str(sysfs_fd, "counters_all");
+	char *p = buf, *line;
+	struct fs_counter *i;
+
+	darray_for_each(*out, i)
+		free(i->name);
+	out->nr = 0;
+
+	while (p && (line = strsep(&p, "\n"))) {
+		char name[64];
+		u64 v;
+
+		if (sscanf(line, "%63s %llu", name, &v) != 2)
+			continue;
+
+		if (darray_push(out, ((struct fs_counter) {
+				.name	= strdup(name),
+				.v	= v,
+			})))
+			die("error allocating memory");
+	}
+
+	free(buf);
+}
+
+static void fs_counters_exit(fs_counters *c)
+{
+	struct fs_counter *i;
+
+	darray_for_each(*c, i)
+		free(i->name);
+	darray_exit(c);
+}
+
+int cmd_fs_counters(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "all",		no_argument,		NULL, 'a' },
+		{ "watch",		optional_argument,	NULL, 'w' },
+		{ NULL }
+	};
+	fs_counters cur = { 0 }, prev = { 0 }, tmp;
+	struct fs_counter *i;
+	struct bchfs_handle fs;
+	bool all = false;
+	unsigned interval = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "aw::", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'a':
+			all = true;
+			break;
+		case 'w':
+			interval = 2;
+			if (optarg && (kstrtouint(optarg, 10, &interval) || !interval))
+				die("invalid interval %s", optarg);
+			break;
+		default:
+			fs_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	fs = bcache_fs_open(argc ? argv[0] : ".");
+	fs_counters_read(fs.sysfs_fd, &cur);
+
+	if (!interval) {
+		darray_for_each(cur, i)
+			if (all || i->v)
+				printf("%-48s %llu\n", i->name, i->v);
+		goto out;
+	}
+
+	while (1) {
+		unsigned j;
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+
+		sleep(interval);
+		fs_counters_read(fs.sysfs_fd, &cur);
+
+		if (cur.nr != prev.nr)
+			die("counters changed");
+
+		printf("\n");
+		for (j = 0; j < cur.nr; j++) {
+			u64 d = cur.data[j].v - prev.data[j].v;
+
+			if (all || d)
+				printf("%-48s %llu/sec\n",
+				       cur.data[j].name, d / interval);
+		}
+		fflush(stdout);
+	}
+out:
+	fs_counters_exit(&cur);
+	fs_counters_exit(&prev);
+	bcache_fs_close(fs);
+	return 0;
+}
@@ -1,6 +1,11 @@
 
 #include <getopt.h>
+#include <linux/printbuf.h>
+#include <linux/six.h>
+#include <linux/slab.h>
+
 #include "cmds.h"
+#include "libbcachefs/counters.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs.h"
 #include "libbcachefs/super.h"
@@ -17,6 +22,9 @@ static void usage(void)
 	     "  -y                     Assume \"yes\" to all questions\n"
 	     "  -f                     Force checking even if filesystem is marked clean\n"
 	     " --reconstruct_alloc     Reconstruct the alloc btree\n"
+	     " --progress_json         Also report progress of each pass as JSON\n"
+	     " --quick                 Only check btrees written since the last fsck\n"
+	     "                         that found no errors, if shut down cleanly\n"
 	     "  -v                     Be verbose\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -26,6 +34,8 @@ int cmd_fsck(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
+		{ "progress_json",	no_argument,		NULL, 'j' },
+		{ "quick",		no_argument,		NULL, 'q' },
 		{ NULL }
 	};
 	struct bch_opts opts = bch2_opts_empty();
@@ -62,6 +72,14 @@ int cmd_fsck(int argc, char *argv[])
 		case 'R':
 			opt_set(opts, reconstruct_alloc, true);
 			break;
+		case 'j':
+			opt_set(opts, fsck_progress_json, true);
+			break;
+		case 'q':
+			/* recovery decides whether to run fsck: */
+			opt_set(opts, fsck, false);
+			opt_set(opts, fsck_quick, true);
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -102,6 +120,16 @@ int cmd_fsck(int argc, char *argv[])
 		ret |= 4;
 	}
 
+	if (opts.verbose) {
+		struct printbuf buf = PRINTBUF;
+
+		six_lock_contention_to_text(&buf);
+		slabinfo_to_text(&buf);
+		bch2_fs_counters_all_to_text(&buf, c);
+		fputs(buf.buf ?: "", stderr);
+		printbuf_exit(&buf);
+	}
+
 	bch2_fs_stop(c);
 	return ret;
 }
@@ -1,8 +1,11 @@
 #ifdef BCACHEFS_FUSE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -14,24 +17,42 @@
 
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/alloc_foreground.h"
+#include "libbcachefs/btree_cache.h"
 #include "libbcachefs/btree_iter.h"
+#include "libbcachefs/btree_key_cache.h"
+#include "libbcachefs/btree_update.h"
 #include "libbcachefs/buckets.h"
 #include "libbcachefs/dirent.h"
 #include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
 #include "libbcachefs/fs-common.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/reflink.h"
+#include "libbcachefs/subvolume.h"
 #include "libbcachefs/super.h"
 
 /* mode_to_type(): */
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/hash.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
+/*
+ * With -o threads, requests are handled on libfuse's worker threads, which
+ * need to be set up for the kernel shims (current, RCU) before calling into
+ * libbcachefs: every request handler gets the filesystem through this.
+ */
+static struct bch_fs *bf_req_fs(fuse_req_t req)
+{
+	sched_thread_init();
+	return fuse_req_userdata(req);
+}
+
 static inline u64 map_root_ino(u64 ino)
 {
 	return ino == 1 ? 4096 : ino;
@@ -61,6 +82,23 @@ static struct stat inode_to_stat(struct bch_fs *c,
 	};
 }
 
+/*
+ * How long the kernel may cache names, attributes and failed lookups: all
+ * changes to the filesystem go through the kernel, which updates its own
+ * caches for them, so by default they never expire.
+ */
+struct bf_timeouts {
+	double		entry;
+	double		attr;
+	double		negative;
+};
+
+static struct bf_timeouts bf_timeouts = {
+	.entry		= DBL_MAX,
+	.attr		= DBL_MAX,
+	.negative	= DBL_MAX,
+};
+
 static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 					      struct bch_inode_unpacked *bi)
 {
@@ -68,20 +106,212 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 		.ino		= unmap_root_ino(bi->bi_inum),
 		.generation	= bi->bi_generation,
 		.attr		= inode_to_stat(c, bi),
-		.attr_timeout	= DBL_MAX,
-		.entry_timeout	= DBL_MAX,
+		.attr_timeout	= bf_timeouts.attr,
+		.entry_timeout	= bf_timeouts.entry,
 	};
 }
 
+/*
+ * Open file table: open inodes get a cached copy of the unpacked inode, shared
+ * by all their open handles, so that read, write and getattr of an open file
+ * don't do an inode btree lookup. We're the only thing modifying the
+ * filesystem, so the cache is kept coherent by updating or invalidating it
+ * wherever we change an inode.
+ */
+#define BF_OPEN_HASH_BITS	8
+
+struct bf_open_inode {
+	struct list_head		hash;
+	u64				inum;
+	unsigned			ref;
+	/* bumped by every update, so a stale lookup doesn't fill the cache: */
+	unsigned			seq;
+	bool				valid;
+	struct bch_inode_unpacked	inode;
+
+	/* for directories, set by the first lookup: */
+	bool				hash_valid;
+	struct bch_hash_info		hash;
+};
+
+static struct list_head bf_open_hash[1 << BF_OPEN_HASH_BITS];
+static DEFINE_SPINLOCK(bf_open_lock);
+
+static void bf_open_table_init(void)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(bf_open_hash); i++)
+		INIT_LIST_HEAD(&bf_open_hash[i]);
+}
+
+static struct list_head *bf_open_bucket(u64 inum)
+{
+	return &bf_open_hash[hash_64(inum, BF_OPEN_HASH_BITS)];
+}
+
+static struct bf_open_inode *bf_open_find(u64 inum)
+{
+	struct bf_open_inode *oi;
+
+	list_for_each_entry(oi, bf_open_bucket(inum), hash)
+		if (oi->inum == inum)
+			return oi;
+	return NULL;
+}
+
+static struct bf_open_inode *bf_open_get(u64 inum)
+{
+	struct bf_open_inode *oi, *n = calloc(1, sizeof(*n));
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(inum);
+	if (!oi && n) {
+		oi = n;
+		n = NULL;
+		oi->inum = inum;
+		list_add(&oi->hash, bf_open_bucket(inum));
+	}
+	if (oi)
+		oi->ref++;
+	spin_unlock(&bf_open_lock);
+
+	free(n);
+	return oi;
+}
+
+static void bf_open_put(struct bf_open_inode *oi)
+{
+	spin_lock(&bf_open_lock);
+	if (!--oi->ref)
+		list_del(&oi->hash);
+	else
+		oi = NULL;
+	spin_unlock(&bf_open_lock);
+
+	free(oi);
+}
+
+/* @bi is the new inode, or NULL if we don't have it and have to reread it: */
+static void bf_inode_cache_update(u64 inum, struct bch_inode_unpacked *bi)
+{
+	struct bf_open_inode *oi;
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(inum);
+	if (oi) {
+		oi->seq++;
+		oi->valid = bi != NULL;
+		if (bi)
+			oi->inode = *bi;
+		else
+			oi->hash_valid = false;
+	}
+	spin_unlock(&bf_open_lock);
+}
+
+static int bf_inode_find(struct bch_fs *c, u64 inum,
+			 struct bch_inode_unpacked *bi)
+{
+	struct bf_open_inode *oi;
+	unsigned seq = 0;
+	int ret;
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(inum);
+	if (oi && oi->valid) {
+		*bi = oi->inode;
+		spin_unlock(&bf_open_lock);
+		return 0;
+	}
+	if (oi)
+		seq = oi->seq;
+	spin_unlock(&bf_open_lock);
+
+	ret = bch2_inode_find_by_inum(c, inum, bi);
+	if (ret || !oi)
+		return ret;
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(inum);
+	if (oi && oi->seq == seq) {
+		oi->inode = *bi;
+		oi->valid = true;
+	}
+	spin_unlock(&bf_open_lock);
+
+	return 0;
+}
+
+/*
+ * The directory's hash seed and type never change, so for an open directory
+ * the hash info is derived once and then reused by every lookup:
+ */
+static int bf_dir_hash_info(struct bch_fs *c, u64 dir,
+			    struct bch_hash_info *hash)
+{
+	struct bch_inode_unpacked bi;
+	struct bf_open_inode *oi;
+	int ret;
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(dir);
+	if (oi && oi->hash_valid) {
+		*hash = oi->hash;
+		spin_unlock(&bf_open_lock);
+		return 0;
+	}
+	spin_unlock(&bf_open_lock);
+
+	ret = bf_inode_find(c, dir, &bi);
+	if (ret)
+		return ret;
+
+	*hash = bch2_hash_info_init(c, &bi);
+
+	spin_lock(&bf_open_lock);
+	oi = bf_open_find(dir);
+	if (oi && oi->valid) {
+		oi->hash = *hash;
+		oi->hash_valid = true;
+	}
+	spin_unlock(&bf_open_lock);
+
+	return 0;
+}
+
+/* -o max_write, async_read etc., parsed by libfuse: */
+static struct fuse_conn_info_opts *bf_conn_opts;
+
 static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 {
+	struct bch_fs *c = arg;
+
+	/*
+	 * Large requests: a write of a whole number of blocks never needs a
+	 * read-modify-write on our side.
+	 */
+	conn->max_write = round_down(1U << 20, block_bytes(c));
+
+	conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ|
+				       FUSE_CAP_ASYNC_DIO|
+				       FUSE_CAP_PARALLEL_DIROPS);
+
 	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: activating writeback\n");
 		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ|
+				       FUSE_CAP_SPLICE_WRITE|
+				       FUSE_CAP_SPLICE_MOVE);
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
+
+	/* Mount options override the defaults above: */
+	if (bf_conn_opts)
+		fuse_apply_conn_info_opts(bf_conn_opts, conn);
 }
 
 static void bcachefs_fuse_destroy(void *arg)
@@ -94,8 +324,9 @@ static void bcachefs_fuse_destroy(void *arg)
 static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
+	struct bch_hash_info hash_info;
 	struct qstr qstr = QSTR(name);
 	u64 inum;
 	int ret;
@@ -105,25 +336,23 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	ret = bf_dir_hash_info(c, dir, &hash_info);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
 	}
 
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, &bi);
-
 	inum = bch2_dirent_lookup(c, dir, &hash_info, &qstr);
 	if (!inum) {
+		/* ino 0: a negative entry, cached for the negative timeout */
 		struct fuse_entry_param e = {
-			.attr_timeout	= DBL_MAX,
-			.entry_timeout	= DBL_MAX,
+			.entry_timeout	= bf_timeouts.negative,
 		};
 		fuse_reply_entry(req, &e);
 		return;
 	}
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret = bf_inode_find(c, inum, &bi);
 	if (ret)
 		goto err;
 
@@ -141,7 +370,7 @@ err:
 static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
 	struct stat attr;
 	int ret;
@@ -151,7 +380,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 
 	inum = map_root_ino(inum);
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret = bf_inode_find(c, inum, &bi);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -161,33 +390,30 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
 	attr = inode_to_stat(c, &bi);
-	fuse_reply_attr(req, &attr, DBL_MAX);
+	fuse_reply_attr(req, &attr, bf_timeouts.attr);
 }
 
-static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
-				  struct stat *attr, int to_set,
-				  struct fuse_file_info *fi)
+struct setattr_args {
+	u64			inum;
+	struct stat		*attr;
+	int			to_set;
+	struct bch_inode_unpacked inode_u;
+};
+
+static int setattr_trans(struct btree_trans *trans, void *_args)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = trans->c;
+	struct setattr_args *args = _args;
 	struct bch_inode_unpacked inode_u;
-	struct btree_trans trans;
 	struct btree_iter iter;
-	u64 now;
+	struct stat *attr = args->attr;
+	int to_set = args->to_set;
+	u64 now = bch2_current_time(c);
 	int ret;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setattr(%llu, %x)\n",
-		 inum, to_set);
-
-	inum = map_root_ino(inum);
-
-	bch2_trans_init(&trans, c, 0, 0);
-retry:
-	bch2_trans_begin(&trans);
-	now = bch2_current_time(c);
-
-	ret = bch2_inode_peek(&trans, &iter, &inode_u, inum, BTREE_ITER_INTENT);
+	ret = bch2_inode_peek(trans, &iter, &inode_u, args->inum, BTREE_ITER_INTENT);
 	if (ret)
-		goto err;
+		return ret;
 
 	if (to_set & FUSE_SET_ATTR_MODE)
 		inode_u.bi_mode	= attr->st_mode;
@@ -207,19 +433,41 @@ retry:
 		inode_u.bi_mtime = now;
 	/* TODO: CTIME? */
 
-	ret   = bch2_inode_write(&trans, &iter, &inode_u) ?:
-		bch2_trans_commit(&trans, NULL, NULL,
-				  BTREE_INSERT_NOFAIL);
-err:
-        bch2_trans_iter_exit(&trans, &iter);
-	if (ret == -EINTR)
-		goto retry;
+	ret = bch2_inode_write(trans, &iter, &inode_u);
+	bch2_trans_iter_exit(trans, &iter);
 
-	bch2_trans_exit(&trans);
+	args->inode_u = inode_u;
+	return ret;
+}
+
+static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
+				  struct stat *attr, int to_set,
+				  struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	struct setattr_args args = {
+		.attr	= attr,
+		.to_set	= to_set,
+	};
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setattr(%llu, %x)\n",
+		 inum, to_set);
 
+	args.inum = inum = map_root_ino(inum);
+
+	/*
+	 * Setattrs on different inodes from different fuse threads are
+	 * independent: commit them together:
+	 */
+	ret = bch2_trans_do_grouped(c, BTREE_ID_inodes, POS(0, inum),
+				    setattr_trans, &args, NULL,
+				    BTREE_INSERT_NOFAIL);
 	if (!ret) {
-		*attr = inode_to_stat(c, &inode_u);
-		fuse_reply_attr(req, attr, DBL_MAX);
+		bf_inode_cache_update(inum, &args.inode_u);
+
+		*attr = inode_to_stat(c, &args.inode_u);
+		fuse_reply_attr(req, attr, bf_timeouts.attr);
 	} else {
 		fuse_reply_err(req, -ret);
 	}
@@ -247,7 +495,7 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
 				const char *name, mode_t mode,
 				dev_t rdev)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -279,7 +527,7 @@ static void bcachefs_fuse_mkdir(fuse_req_t req, fuse_ino_t dir,
 static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(name);
 	int ret;
@@ -291,6 +539,8 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 	ret = bch2_trans_do(c, NULL, NULL, BTREE_INSERT_NOFAIL,
 			    bch2_unlink_trans(&trans, dir, &dir_u,
 					      &inode_u, &qstr));
+	if (!ret)
+		bf_inode_cache_update(inode_u.bi_inum, &inode_u);
 
 	fuse_reply_err(req, -ret);
 }
@@ -310,7 +560,7 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				 fuse_ino_t dst_dir, const char *dstname,
 				 unsigned flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dst_dir_u, src_dir_u;
 	struct bch_inode_unpacked src_inode_u, dst_inode_u;
 	struct qstr dst_name = QSTR(srcname);
@@ -332,6 +582,8 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				  &src_inode_u, &dst_inode_u,
 				  &src_name, &dst_name,
 				  BCH_RENAME));
+	if (!ret)
+		bf_inode_cache_update(src_inode_u.bi_inum, &src_inode_u);
 
 	fuse_reply_err(req, -ret);
 }
@@ -339,7 +591,7 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 			       fuse_ino_t newparent, const char *newname)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(newname);
 	int ret;
@@ -354,6 +606,8 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 					    inum, &dir_u, &inode_u, &qstr));
 
 	if (!ret) {
+		bf_inode_cache_update(inode_u.bi_inum, &inode_u);
+
 		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
 		fuse_reply_entry(req, &e);
 	} else {
@@ -364,6 +618,14 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
 			       struct fuse_file_info *fi)
 {
+	struct bf_open_inode *oi = bf_open_get(inum);
+
+	if (!oi) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fi->fh			= (uintptr_t) oi;
 	fi->direct_io		= false;
 	fi->keep_cache		= true;
 	fi->cache_readdir	= true;
@@ -371,6 +633,13 @@ static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
 	fuse_reply_open(req, fi);
 }
 
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	bf_open_put((void *) (uintptr_t) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
 static void userbio_init(struct bio *bio, struct bio_vec *bv,
 			 void *buf, size_t size)
 {
@@ -382,12 +651,25 @@ static void userbio_init(struct bio *bio, struct bio_vec *bv,
 }
 
 static int get_inode_io_opts(struct bch_fs *c, u64 inum,
-			     struct bch_io_opts *opts)
+			     struct bch_io_opts *opts, u64 *i_size)
 {
 	struct bch_inode_unpacked inode;
-	if (bch2_inode_find_by_inum(c, inum, &inode))
+	u32 snapshot;
+
+	/* Without i_size, the options alone are cached: */
+	if (!i_size)
+		return bch2_trans_do(c, NULL, NULL, 0,
+			bch2_subvolume_get_snapshot(&trans, BCACHEFS_ROOT_SUBVOL,
+						    &snapshot) ?:
+			bch2_inode_opts_get_cached(&trans, inum, snapshot, opts))
+			? -EINVAL : 0;
+
+	if (bf_inode_find(c, inum, &inode))
 		return -EINVAL;
 
+	if (i_size)
+		*i_size = inode.bi_size;
+
 	*opts = bch2_opts_to_inode_opts(c->opts);
 	bch2_io_opts_apply(opts, bch2_inode_opts_get(&inode));
 	return 0;
@@ -454,7 +736,7 @@ static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 	BUG_ON(aligned_offset & (block_bytes(c) - 1));
 
 	struct bch_io_opts io_opts;
-	if (get_inode_io_opts(c, inum, &io_opts))
+	if (get_inode_io_opts(c, inum, &io_opts, NULL))
 		return -ENOENT;
 
 	struct bch_read_bio rbio;
@@ -477,18 +759,206 @@ static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
+/*
+ * Per request type latencies and in flight counts, dumped on SIGUSR1 along with
+ * the btree node cache and key cache stats. read and write only cover
+ * submitting the IO; read_io and write_io time the IO until the reply.
+ */
+#define BF_OPS()		\
+	x(lookup)		\
+	x(getattr)		\
+	x(setattr)		\
+	x(readlink)		\
+	x(mknod)		\
+	x(mkdir)		\
+	x(unlink)		\
+	x(rmdir)		\
+	x(symlink)		\
+	x(rename)		\
+	x(link)			\
+	x(open)			\
+	x(read)			\
+	x(read_io)		\
+	x(write)		\
+	x(write_buf)		\
+	x(write_io)		\
+	x(release)		\
+	x(opendir)		\
+	x(readdir)		\
+	x(readdirplus)		\
+	x(releasedir)		\
+	x(statfs)		\
+	x(create)		\
+	x(fallocate)		\
+	x(copy_file_range)	\
+	x(lseek)
+
+enum bf_op {
+#define x(n)	BF_OP_##n,
+	BF_OPS()
+#undef x
+	BF_OP_NR
+};
+
+static const char * const bf_op_names[] = {
+#define x(n)	#n,
+	BF_OPS()
+#undef x
+	NULL
+};
+
+struct bf_op_stats {
+	struct time_stats	time;
+	atomic_t		in_flight;
+};
+
+static struct bf_op_stats bf_op_stats[BF_OP_NR];
+
+/* -o stats_file: where SIGUSR1 dumps the stats, instead of stdout */
+static const char *bf_stats_file;
+
+static void bf_op_stats_init(void)
+{
+	unsigned i;
+
+	for (i = 0; i < BF_OP_NR; i++)
+		bch2_time_stats_init(&bf_op_stats[i].time);
+}
+
+static u64 bf_op_start(enum bf_op op)
+{
+	atomic_inc(&bf_op_stats[op].in_flight);
+	return local_clock();
+}
+
+static void bf_op_done(enum bf_op op, u64 start)
+{
+	bch2_time_stats_update(&bf_op_stats[op].time, start);
+	atomic_dec(&bf_op_stats[op].in_flight);
+}
+
+static void bf_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	unsigned i;
+
+	for (i = 0; i < BF_OP_NR; i++) {
+		struct bf_op_stats *s = &bf_op_stats[i];
+
+		if (!s->time.count && !atomic_read(&s->in_flight))
+			continue;
+
+		prt_printf(out, "%s:", bf_op_names[i]);
+		prt_newline(out);
+		printbuf_indent_add(out, 2);
+		prt_printf(out, "in flight:\t\t%u", atomic_read(&s->in_flight));
+		prt_newline(out);
+		bch2_time_stats_to_text(out, &s->time);
+		printbuf_indent_sub(out, 2);
+	}
+
+	prt_printf(out, "btree cache:");
+	prt_newline(out);
+	printbuf_indent_add(out, 2);
+	bch2_btree_cache_to_text(out, c);
+	printbuf_indent_sub(out, 2);
+
+	prt_printf(out, "btree key cache:");
+	prt_newline(out);
+	printbuf_indent_add(out, 2);
+	bch2_btree_key_cache_to_text(out, &c->btree_key_cache);
+	printbuf_indent_sub(out, 2);
+}
+
+/* SIGUSR1 is blocked in every thread; this one waits for it: */
+static void *bf_stats_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+	sigset_t mask;
+	int sig;
+
+	sched_thread_init();
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+
+	while (!sigwait(&mask, &sig)) {
+		struct printbuf buf = PRINTBUF;
+		FILE *f = stdout;
+
+		bf_stats_to_text(&buf, c);
+
+		if (bf_stats_file) {
+			f = fopen(bf_stats_file, "w");
+			if (!f) {
+				fuse_log(FUSE_LOG_ERR, "error opening %s: %m\n",
+					 bf_stats_file);
+				printbuf_exit(&buf);
+				continue;
+			}
+		}
+
+		fputs(buf.buf ?: "", f);
+		if (f == stdout)
+			fflush(f);
+		else
+			fclose(f);
+
+		printbuf_exit(&buf);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads and writes complete the fuse request from the IO completion, instead
+ * of blocking the fuse thread until the IO is done: with a few threads, this
+ * is what lets us keep many IOs in flight.
+ */
+struct fuse_read_op {
+	fuse_req_t		req;
+	u64			start;
+	void			*buf;
+	size_t			pad_start;
+	size_t			size;
+	struct bio_vec		bv;
+	struct bch_read_bio	rbio;
+};
+
+static void bcachefs_fuse_read_async_endio(struct bio *bio)
+{
+	struct fuse_read_op *op = bio->bi_private;
+	int ret = -blk_status_to_errno(bio->bi_status);
+
+	if (likely(!ret)) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(op->size);
+
+		/* lets libfuse splice the pages, if the kernel supports it: */
+		bufv.buf[0].mem = op->buf + op->pad_start;
+		fuse_reply_data(op->req, &bufv, FUSE_BUF_SPLICE_MOVE);
+	} else {
+		fuse_reply_err(op->req, -ret);
+	}
+
+	bf_op_done(BF_OP_read_io, op->start);
+
+	free(op->buf);
+	free(op);
+}
+
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
+	struct bch_io_opts io_opts;
+	struct fuse_read_op *op;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	/* Check inode size. */
 	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_inode_find(c, inum, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
@@ -503,20 +973,32 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 
 	struct fuse_align_io align = align_io(c, size, offset);
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
-	if (!buf) {
+	if (get_inode_io_opts(c, inum, &io_opts, NULL)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	op = calloc(1, sizeof(*op));
+	if (op)
+		op->buf = aligned_alloc(PAGE_SIZE, align.size);
+	if (!op || !op->buf) {
+		free(op);
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
-	ret = read_aligned(c, inum, align.size, align.start, buf);
+	op->req		= req;
+	op->pad_start	= align.pad_start;
+	op->size	= size;
 
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
-		fuse_reply_err(req, -ret);
+	userbio_init(&op->rbio.bio, &op->bv, op->buf, align.size);
+	bio_set_op_attrs(&op->rbio.bio, REQ_OP_READ, REQ_SYNC);
+	op->rbio.bio.bi_iter.bi_sector	= align.start >> 9;
+	op->rbio.bio.bi_end_io		= bcachefs_fuse_read_async_endio;
+	op->rbio.bio.bi_private		= op;
 
-	free(buf);
+	op->start = bf_op_start(BF_OP_read_io);
+	bch2_read(c, rbio_init(&op->rbio.bio, io_opts), inum);
 }
 
 static int inode_update_times(struct bch_fs *c, fuse_ino_t inum)
@@ -555,6 +1037,34 @@ err:
 	return ret;
 }
 
+static int write_aligned_init(struct bch_fs *c, struct bch_write_op *op,
+			      struct bio_vec *bv, fuse_ino_t inum,
+			      struct bch_io_opts io_opts, void *buf,
+			      size_t aligned_size, off_t aligned_offset,
+			      off_t new_i_size)
+{
+	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+
+	bch2_write_op_init(op, c, io_opts); /* XXX reads from op?! */
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= io_opts.data_replicas;
+	op->target	= io_opts.foreground_target;
+	op->pos		= POS(inum, aligned_offset >> 9);
+	op->new_i_size	= new_i_size;
+
+	userbio_init(&op->wbio.bio, bv, buf, aligned_size);
+	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+
+	if (bch2_disk_reservation_get(c, &op->res, aligned_size >> 9,
+				      op->nr_replicas, 0)) {
+		/* XXX: use check_range_allocated like dio write path */
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
 static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 			 struct bch_io_opts io_opts, void *buf,
 			 size_t aligned_size, off_t aligned_offset,
@@ -563,29 +1073,16 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	struct bch_write_op	op = { 0 };
 	struct bio_vec		bv;
 	struct closure		cl;
-
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
-	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+	int			ret;
 
 	*written_out = 0;
 
 	closure_init_stack(&cl);
 
-	bch2_write_op_init(&op, c, io_opts); /* XXX reads from op?! */
-	op.write_point	= writepoint_hashed(0);
-	op.nr_replicas	= io_opts.data_replicas;
-	op.target	= io_opts.foreground_target;
-	op.pos		= POS(inum, aligned_offset >> 9);
-	op.new_i_size	= new_i_size;
-
-	userbio_init(&op.wbio.bio, &bv, buf, aligned_size);
-	bio_set_op_attrs(&op.wbio.bio, REQ_OP_WRITE, REQ_SYNC);
-
-	if (bch2_disk_reservation_get(c, &op.res, aligned_size >> 9,
-				      op.nr_replicas, 0)) {
-		/* XXX: use check_range_allocated like dio write path */
-		return -ENOSPC;
-	}
+	ret = write_aligned_init(c, &op, &bv, inum, io_opts, buf,
+				 aligned_size, aligned_offset, new_i_size);
+	if (ret)
+		return ret;
 
 	closure_call(&op.cl, bch2_write, NULL, &cl);
 	closure_sync(&cl);
@@ -596,41 +1093,149 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	return op.error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
-{
-	struct bch_fs *c	= fuse_req_userdata(req);
-	struct bch_io_opts	io_opts;
-	size_t			aligned_written;
-	int			ret = 0;
+struct fuse_write_op {
+	fuse_req_t		req;
+	struct bch_fs		*c;
+	fuse_ino_t		inum;
+	struct fuse_align_io	align;
+	size_t			size;
+	u64			start;
+	void			*bounce;
+	/* set if the data is in the request buffer, which we have to wait on: */
+	struct closure		*wait;
+	struct bio_vec		bv;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
-		 inum, size, offset);
+	/* Must be last: */
+	struct bch_write_op	op;
+};
 
-	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
+static void fuse_write_endio(struct bch_write_op *op)
+{
+	struct fuse_write_op *w = container_of(op, struct fuse_write_op, op);
+	struct closure *wait = w->wait;
+	size_t written = 0;
+	int ret = op->error;
 
-	if (get_inode_io_opts(c, inum, &io_opts)) {
-		ret = -ENOENT;
-		goto err;
+	if (!ret) {
+		/* Figure out how many unaligned bytes were written. */
+		written = align_fix_up_bytes(&w->align, op->written << 9);
+		BUG_ON(written > w->size);
 	}
 
-	/* Realign the data and read in start and end, if needed */
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
+		 written);
 
-	/* Read partial start data. */
-	if (align.pad_start) {
-		memset(aligned_buf, 0, block_bytes(c));
+	if (written > 0)
+		ret = 0;
 
-		ret = read_aligned(c, inum, block_bytes(c), align.start,
-				   aligned_buf);
-		if (ret)
-			goto err;
-	}
+	/* i_size, i_sectors, mtime and ctime were updated by the index update: */
+	bf_inode_cache_update(w->inum, NULL);
 
-	/*
+	if (!ret) {
+		BUG_ON(written == 0);
+		fuse_reply_write(w->req, written);
+	} else {
+		fuse_reply_err(w->req, -ret);
+	}
+
+	bf_op_done(BF_OP_write_io, w->start);
+
+	free(w->bounce);
+	free(w);
+
+	if (wait)
+		closure_put(wait);
+}
+
+/*
+ * Writes @size bytes from @bufv at @offset, and replies from the write
+ * completion: when the write is block aligned and the data is already in a
+ * suitably aligned buffer it's written directly (but then we have to wait,
+ * since the buffer belongs to libfuse), otherwise it's copied into an aligned
+ * buffer - straight from the pipe, if libfuse spliced the request to us.
+ */
+static void fuse_write_reply(fuse_req_t req, struct bch_fs *c,
+			     fuse_ino_t inum, struct fuse_bufvec *bufv,
+			     size_t size, off_t offset)
+{
+	struct fuse_buf		*src = &bufv->buf[bufv->idx];
+	struct bch_io_opts	io_opts;
+	struct fuse_write_op	*w;
+	struct fuse_bufvec	dst = FUSE_BUFVEC_INIT(size);
+	struct closure		cl, *wait = NULL;
+	void			*aligned_buf;
+	ssize_t			copied;
+	u64			i_size;
+	int			ret = 0;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	w->req		= req;
+	w->c		= c;
+	w->inum		= inum;
+	w->align	= align_io(c, size, offset);
+	w->size		= size;
+
+	struct fuse_align_io align = w->align;
+
+	if (get_inode_io_opts(c, inum, &io_opts, &i_size)) {
+		ret = -ENOENT;
+		goto err;
+	}
+
+	if (!align.pad_start &&
+	    !align.pad_end &&
+	    bufv->count - bufv->idx == 1 &&
+	    !(src->flags & FUSE_BUF_IS_FD) &&
+	    IS_ALIGNED((unsigned long) src->mem + bufv->off, block_bytes(c))) {
+		aligned_buf = src->mem + bufv->off;
+
+		closure_init_stack(&cl);
+		closure_get(&cl);
+		w->wait = wait = &cl;
+		goto write;
+	}
+
+	w->bounce = aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
+	if (!aligned_buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/*
+	 * A partial block write has to be done before the next one comes in,
+	 * which may read-modify-write the same block:
+	 */
+	if (align.pad_start || align.pad_end) {
+		closure_init_stack(&cl);
+		closure_get(&cl);
+		w->wait = wait = &cl;
+	}
+
+	/*
+	 * Realign the data and read in start and end, if needed: anything past
+	 * i_size is zeroes, and doesn't need reading - for appends, that's the
+	 * whole tail block.
+	 */
+
+	/* Read partial start data. */
+	if (align.pad_start) {
+		memset(aligned_buf, 0, block_bytes(c));
+
+		if (align.start >= i_size)
+			goto read_end;
+
+		ret = read_aligned(c, inum, block_bytes(c), align.start,
+				   aligned_buf);
+		if (ret)
+			goto err;
+	}
+read_end:
+	/*
 	 * Read partial end data. If the whole write fits in one block, the
 	 * start data and the end data are the same so this isn't needed.
 	 */
@@ -641,53 +1246,78 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 
 		memset(aligned_buf + buf_offset, 0, block_bytes(c));
 
+		if (offset + size >= i_size)
+			goto copy;
+
 		ret = read_aligned(c, inum, block_bytes(c), partial_end_start,
 				   aligned_buf + buf_offset);
 		if (ret)
 			goto err;
 	}
 
+copy:
 	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
+	dst.buf[0].mem = aligned_buf + align.pad_start;
 
-	/* Actually write. */
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start,
-			    offset + size, &aligned_written);
+	copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size) {
+		ret = copied < 0 ? copied : -EIO;
+		goto err;
+	}
+write:
+	ret = write_aligned_init(c, &w->op, &w->bv, inum, io_opts,
+				 aligned_buf, align.size, align.start,
+				 offset + size);
+	if (ret)
+		goto err;
 
-	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+	w->op.flags	|= BCH_WRITE_UPDATE_TIMES;
+	w->op.end_io	= fuse_write_endio;
+	w->start	= bf_op_start(BF_OP_write_io);
+	closure_call(&w->op.cl, bch2_write, NULL, NULL);
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	/* w may be freed by now */
+	if (wait)
+		closure_sync(wait);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+	free(w->bounce);
+	free(w);
+}
 
-	if (written > 0)
-		ret = 0;
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
 
-	/*
-	 * Update inode times.
-	 * TODO: Integrate with bch2_extent_update()
-	 */
-	if (!ret)
-		ret = inode_update_times(c, inum);
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+		 inum, size, offset);
 
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
-		return;
-	}
+	bufv.buf[0].mem = (void *) buf;
+	fuse_write_reply(req, c, inum, &bufv, size, offset);
+}
 
-err:
-	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	size_t size = fuse_buf_size(bufv);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_buf(%llu, %zd, %lld)\n",
+		 inum, size, offset);
+
+	fuse_write_reply(req, c, inum, bufv, size, offset);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 				  fuse_ino_t dir, const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	size_t link_len = strlen(link);
 	int ret;
@@ -702,7 +1332,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 		goto err;
 
 	struct bch_io_opts io_opts;
-	ret = get_inode_io_opts(c, new_inode.bi_inum, &io_opts);
+	ret = get_inode_io_opts(c, new_inode.bi_inum, &io_opts, NULL);
 	if (ret)
 		goto err;
 
@@ -742,7 +1372,7 @@ err:
 
 static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	char *buf = NULL;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readlink(%llu)\n", inum);
@@ -785,25 +1415,13 @@ err:
 static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
-static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
@@ -901,7 +1519,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 				  size_t size, off_t off,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
 	char *buf = calloc(size, 1);
 	struct fuse_dir_context ctx = {
@@ -943,30 +1561,168 @@ reply:
 	free(buf);
 }
 
-#if 0
-static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
-				      size_t size, off_t off,
-				      struct fuse_file_info *fi)
+/*
+ * Each open directory gets a readdir cursor, so that successive readdirplus
+ * calls continue from the batch of entries the previous call looked up, and
+ * holds the directory in the open file table, which caches its inode and hash
+ * info for lookups:
+ */
+struct bf_open_dir {
+	struct bch_readdir_cursor	cur;
+	struct bf_open_inode		*oi;
+};
+
+static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
 {
+	struct bf_open_dir *d = calloc(1, sizeof(*d));
+
+	if (!d) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	d->oi = bf_open_get(map_root_ino(inum));
+	if (!d->oi) {
+		free(d);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
 }
 
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bf_open_dir *d = (void *) (uintptr_t) fi->fh;
+
+	bf_open_put(d->oi);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+struct fuse_dirplus_context {
+	struct bch_fs		*c;
+	fuse_req_t		req;
+	char			*buf;
+	size_t			bufsize;
+};
+
+static int fuse_add_direntry_plus2(struct fuse_dirplus_context *ctx,
+				   const char *name,
+				   struct fuse_entry_param *e, off_t off)
+{
+	size_t len = fuse_add_direntry_plus(ctx->req, ctx->buf, ctx->bufsize,
+					    name, e, off);
+
+	if (len > ctx->bufsize)
+		return -1;
+
+	ctx->buf	+= len;
+	ctx->bufsize	-= len;
+
+	return 0;
+}
+
+static int fuse_filldir_plus(void *arg, struct bch_readdir_entry *d)
+{
+	struct fuse_dirplus_context *ctx = arg;
+	struct fuse_entry_param e = inode_to_entry(ctx->c, &d->inode);
+	char name[BCH_NAME_MAX + 1];
+
+	memcpy(name, d->name, d->name_len);
+	name[d->name_len] = '\0';
+
+	fuse_log(FUSE_LOG_DEBUG, "fuse_filldir_plus(name=%s inum=%llu pos=%llu)\n",
+		 name, e.ino, d->pos);
+
+	return fuse_add_direntry_plus2(ctx, name, &e, d->pos + 1);
+}
+
+static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
+				      size_t size, off_t off,
+				      struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	struct bf_open_dir *d = (void *) (uintptr_t) fi->fh;
+	struct bch_inode_unpacked bi;
+	char *buf = calloc(size, 1);
+	struct fuse_dirplus_context ctx = {
+		.c		= c,
+		.req		= req,
+		.buf		= buf,
+		.bufsize	= size,
+	};
+	subvol_inum inum;
+	int ret = 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, size=%zu, "
+		 "off=%lld)\n", dir, size, off);
+
+	inum = (subvol_inum) { BCACHEFS_ROOT_SUBVOL, map_root_ino(dir) };
+
+	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	if (off == 0) {
+		struct fuse_entry_param e = inode_to_entry(c, &bi);
+
+		if (fuse_add_direntry_plus2(&ctx, ".", &e, 1))
+			goto reply;
+		off = 1;
+	}
+
+	if (off == 1) {
+		subvol_inum parent_inum = {
+			BCACHEFS_ROOT_SUBVOL, bi.bi_dir ?: bi.bi_inum
+		};
+		struct bch_inode_unpacked parent;
+		/* ino 0: no lookup reference taken on the parent */
+		struct fuse_entry_param e = {
+			.attr.st_ino	= unmap_root_ino(parent_inum.inum),
+			.attr.st_mode	= S_IFDIR,
+		};
+
+		if (!bch2_inode_find_by_inum(c, parent_inum, &parent))
+			e.attr = inode_to_stat(c, &parent);
+
+		if (fuse_add_direntry_plus2(&ctx, "..", &e, 2))
+			goto reply;
+		off = 2;
+	}
+
+	ret = bch2_readdir_plus(c, inum, &d->cur, off, fuse_filldir_plus, &ctx);
+reply:
+	if (!ret) {
+		fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus reply %zd\n",
+					ctx.buf - buf);
+		fuse_reply_buf(req, buf, ctx.buf - buf);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+
+	free(buf);
 }
 
+#if 0
 static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync,
 				   struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
 	unsigned shift = c->block_bits;
 	struct statvfs statbuf = {
@@ -988,26 +1744,26 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, const char *value,
 				   size_t size, int flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 
 	fuse_reply_xattr(req, );
 }
 
 static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
 				      const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
@@ -1015,7 +1771,7 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 				 const char *name, mode_t mode,
 				 struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -1026,6 +1782,14 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
+	struct bf_open_inode *oi = bf_open_get(new_inode.bi_inum);
+	if (!oi) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	fi->fh = (uintptr_t) oi;
+
 	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
 	fuse_reply_create(req, &e, fi);
 	return;
@@ -1034,61 +1798,525 @@ err:
 
 }
 
-#if 0
-static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
-				    struct fuse_bufvec *bufv, off_t off,
-				    struct fuse_file_info *fi)
+static subvol_inum bf_inum(u64 inum)
+{
+	return (subvol_inum) { BCACHEFS_ROOT_SUBVOL, inum };
+}
+
+/*
+ * Zero the part of [start, end) that falls within the block containing start:
+ * punching only frees whole blocks.
+ */
+static int zero_partial_block(struct bch_fs *c, u64 inum,
+			      off_t start, off_t end, u64 i_size)
+{
+	struct bch_io_opts io_opts;
+	off_t block = round_down(start, block_bytes(c));
+	size_t written;
+	void *buf;
+	int ret;
+
+	end = min_t(off_t, end, block + block_bytes(c));
+	if (start >= end || start >= i_size)
+		return 0;
+
+	ret = get_inode_io_opts(c, inum, &io_opts, NULL);
+	if (ret)
+		return ret;
+
+	buf = aligned_alloc(PAGE_SIZE, block_bytes(c));
+	if (!buf)
+		return -ENOMEM;
+
+	ret = read_aligned(c, inum, block_bytes(c), block, buf);
+	if (!ret) {
+		memset(buf + (start - block), 0, end - start);
+		ret = write_aligned(c, inum, io_opts, buf, block_bytes(c),
+				    block, 0, &written);
+	}
+
+	free(buf);
+	return ret;
+}
+
+static int bf_fpunch(struct bch_fs *c, u64 inum, off_t start, off_t end,
+		     u64 i_size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	u64 block_start	= round_up(start, block_bytes(c));
+	u64 block_end	= round_down(end, block_bytes(c));
+	s64 i_sectors_delta = 0;
+	int ret = 0;
+
+	if (start & (block_bytes(c) - 1))
+		ret = zero_partial_block(c, inum, start, end, i_size);
+	if (!ret && block_start <= block_end && (end & (block_bytes(c) - 1)))
+		ret = zero_partial_block(c, inum, block_end, end, i_size);
+	if (ret)
+		return ret;
+
+	if (block_start >= block_end)
+		return 0;
+
+	return bch2_fpunch(c, bf_inum(inum), block_start >> 9,
+			   block_end >> 9, &i_sectors_delta);
+}
+
+/*
+ * Allocate [start, end) with reservations: like __bchfs_fallocate(), without
+ * the pagecache and quota handling.
+ */
+static int bf_freserve(struct bch_fs *c, u64 inum, bool zero,
+		       u64 start, u64 end, u64 new_i_size)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bch_io_opts io_opts;
+	struct bpos end_pos = POS(inum, end);
+	int ret;
+
+	ret = get_inode_io_opts(c, inum, &io_opts, NULL);
+	if (ret)
+		return ret;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 512);
+	bch2_trans_iter_init(&trans, &iter, BTREE_ID_extents,
+			     POS(inum, start),
+			     BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+
+	while (!ret && bkey_cmp(iter.pos, end_pos) < 0) {
+		s64 i_sectors_delta = 0;
+		struct disk_reservation disk_res = { 0 };
+		struct bkey_i_reservation reservation;
+		struct bkey_s_c k;
+		u32 snapshot;
+
+		bch2_trans_begin(&trans);
+
+		ret = bch2_subvolume_get_snapshot(&trans, BCACHEFS_ROOT_SUBVOL,
+						  &snapshot);
+		if (ret)
+			goto bkey_err;
+
+		bch2_btree_iter_set_snapshot(&iter, snapshot);
+
+		k = bch2_btree_iter_peek_slot(&iter);
+		if ((ret = bkey_err(k)))
+			goto bkey_err;
+
+		/* already reserved */
+		if (k.k->type == KEY_TYPE_reservation &&
+		    bkey_s_c_to_reservation(k).v->nr_replicas >=
+		    io_opts.data_replicas) {
+			bch2_btree_iter_advance(&iter);
+			continue;
+		}
+
+		if (bkey_extent_is_data(k.k) && !zero) {
+			bch2_btree_iter_advance(&iter);
+			continue;
+		}
+
+		bkey_reservation_init(&reservation.k_i);
+		reservation.k.type	= KEY_TYPE_reservation;
+		reservation.k.p		= k.k->p;
+		reservation.k.size	= k.k->size;
+
+		bch2_cut_front(iter.pos,	&reservation.k_i);
+		bch2_cut_back(end_pos,		&reservation.k_i);
+
+		reservation.v.nr_replicas = bch2_bkey_nr_ptrs_allocated(k);
+
+		if (reservation.v.nr_replicas < io_opts.data_replicas ||
+		    bch2_bkey_sectors_compressed(k)) {
+			ret = bch2_disk_reservation_get(c, &disk_res,
+						reservation.k.size,
+						io_opts.data_replicas, 0);
+			if (unlikely(ret))
+				goto bkey_err;
+
+			reservation.v.nr_replicas = disk_res.nr_replicas;
+		}
+
+		ret = bch2_extent_update(&trans, bf_inum(inum), &iter,
+					 &reservation.k_i, &disk_res, NULL,
+					 new_i_size, &i_sectors_delta,
+					 BCH_WRITE_CHECK_ENOSPC|
+					 BCH_WRITE_UPDATE_TIMES);
+bkey_err:
+		bch2_disk_reservation_put(c, &disk_res);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			ret = 0;
+	}
+
+	bch2_trans_iter_exit(&trans, &iter);
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static int bf_write_inode_size(struct bch_fs *c, u64 inum, u64 new_i_size)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bch_inode_unpacked inode_u;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	ret = bch2_inode_peek(&trans, &iter, &inode_u, bf_inum(inum),
+			      BTREE_ITER_INTENT);
+	if (ret)
+		goto err;
+
+	if (inode_u.bi_size < new_i_size) {
+		inode_u.bi_size = new_i_size;
+		ret   = bch2_inode_write(&trans, &iter, &inode_u) ?:
+			bch2_trans_commit(&trans, NULL, NULL,
+					  BTREE_INSERT_NOFAIL);
+	}
+err:
+	bch2_trans_iter_exit(&trans, &iter);
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	bch2_trans_exit(&trans);
+	return ret;
 }
 
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
+	struct bch_inode_unpacked bi;
+	off_t end = offset + length;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_fallocate(%llu, %x, %lld, %lld)\n",
+		 inum, mode, offset, length);
+
+	inum = map_root_ino(inum);
+
+	ret = bf_inode_find(c, inum, &bi);
+	if (ret)
+		goto err;
+
+	if (mode == (FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE)) {
+		ret = bf_fpunch(c, inum, offset, min_t(u64, end, bi.bi_size),
+				bi.bi_size);
+	} else if (!(mode & ~(FALLOC_FL_KEEP_SIZE|FALLOC_FL_ZERO_RANGE))) {
+		bool zero = mode & FALLOC_FL_ZERO_RANGE;
+		u64 block_start	= round_down(offset,	block_bytes(c));
+		u64 block_end	= round_up(end,		block_bytes(c));
+		u64 new_i_size	= mode & FALLOC_FL_KEEP_SIZE ? 0 : end;
+
+		if (zero) {
+			ret = bf_fpunch(c, inum, offset, end, bi.bi_size);
+			if (ret)
+				goto err;
+
+			block_start	= round_up(offset,	block_bytes(c));
+			block_end	= round_down(end,	block_bytes(c));
+		}
+
+		if (block_start < block_end)
+			ret = bf_freserve(c, inum, zero, block_start >> 9,
+					  block_end >> 9, new_i_size);
+
+		/* the reservation only covers whole blocks: */
+		if (!ret && new_i_size)
+			ret = bf_write_inode_size(c, inum, new_i_size);
+	} else {
+		ret = -EOPNOTSUPP;
+	}
+
+	bf_inode_cache_update(inum, NULL);
+err:
+	fuse_reply_err(req, -ret);
 }
-#endif
+
+/*
+ * Cloning is done with reflink, which works in whole blocks: anything else
+ * gets EOPNOTSUPP, and the kernel falls back to copying.
+ */
+static void bcachefs_fuse_copy_file_range(fuse_req_t req,
+					  fuse_ino_t inum_in, off_t off_in,
+					  struct fuse_file_info *fi_in,
+					  fuse_ino_t inum_out, off_t off_out,
+					  struct fuse_file_info *fi_out,
+					  size_t len, int flags)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	struct bch_inode_unpacked src, dst;
+	u64 aligned_len;
+	s64 i_sectors_delta = 0;
+	s64 ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_copy_file_range(%llu, %lld, %llu, %lld, %zu)\n",
+		 inum_in, off_in, inum_out, off_out, len);
+
+	inum_in		= map_root_ino(inum_in);
+	inum_out	= map_root_ino(inum_out);
+
+	ret =   bf_inode_find(c, inum_in, &src) ?:
+		bf_inode_find(c, inum_out, &dst);
+	if (ret)
+		goto err;
+
+	if (off_in >= src.bi_size) {
+		fuse_reply_write(req, 0);
+		return;
+	}
+
+	len = min_t(u64, len, src.bi_size - off_in);
+	aligned_len = round_up(len, block_bytes(c));
+
+	/*
+	 * An unaligned length is fine only if it ends at EOF in both files, so
+	 * the tail of the last block isn't visible:
+	 */
+	if ((off_in | off_out) & (block_bytes(c) - 1) ||
+	    (len != aligned_len &&
+	     (off_in + len < src.bi_size ||
+	      off_out + len < dst.bi_size)) ||
+	    (inum_in == inum_out &&
+	     off_out < off_in + aligned_len &&
+	     off_in < off_out + aligned_len)) {
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	ret = bch2_remap_range(c, bf_inum(inum_out), off_out >> 9,
+			       bf_inum(inum_in), off_in >> 9,
+			       aligned_len >> 9, off_out + len,
+			       &i_sectors_delta);
+	bf_inode_cache_update(inum_out, NULL);
+
+	if (ret < 0)
+		goto err;
+
+	ret = inode_update_times(c, inum_out);
+	if (ret)
+		goto err;
+
+	fuse_reply_write(req, len);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_lseek(fuse_req_t req, fuse_ino_t inum, off_t offset,
+				int whence, struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	struct bch_inode_unpacked bi;
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 next;
+	u32 snapshot;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_lseek(%llu, %lld, %i)\n",
+		 inum, offset, whence);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	inum = map_root_ino(inum);
+
+	ret = bf_inode_find(c, inum, &bi);
+	if (ret)
+		goto err;
+
+	if (offset >= bi.bi_size) {
+		ret = -ENXIO;
+		goto err;
+	}
+
+	next = whence == SEEK_DATA ? U64_MAX : bi.bi_size;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	ret = bch2_subvolume_get_snapshot(&trans, BCACHEFS_ROOT_SUBVOL,
+					  &snapshot);
+	if (ret)
+		goto out;
+
+	if (whence == SEEK_DATA) {
+		for_each_btree_key_upto_norestart(&trans, iter, BTREE_ID_extents,
+				   SPOS(inum, offset >> 9, snapshot),
+				   POS(inum, U64_MAX),
+				   0, k, ret)
+			if (bkey_extent_is_data(k.k)) {
+				next = max_t(u64, offset,
+					     bkey_start_offset(k.k) << 9);
+				break;
+			}
+	} else {
+		for_each_btree_key_norestart(&trans, iter, BTREE_ID_extents,
+				   SPOS(inum, offset >> 9, snapshot),
+				   BTREE_ITER_SLOTS, k, ret) {
+			if (k.k->p.inode != inum) {
+				break;
+			} else if (!bkey_extent_is_data(k.k)) {
+				next = max_t(u64, offset,
+					     bkey_start_offset(k.k) << 9);
+				break;
+			} else if (k.k->p.offset << 9 >= bi.bi_size) {
+				break;
+			}
+		}
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+out:
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	bch2_trans_exit(&trans);
+	if (ret)
+		goto err;
+
+	if (next >= bi.bi_size) {
+		if (whence == SEEK_DATA) {
+			ret = -ENXIO;
+			goto err;
+		}
+		next = bi.bi_size;
+	}
+
+	fuse_reply_lseek(req, next);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+#define BF_TIMED(_op, _params, _args)					\
+static void bcachefs_fuse_##_op##_timed _params				\
+{									\
+	u64 start = bf_op_start(BF_OP_##_op);				\
+									\
+	bcachefs_fuse_##_op _args;					\
+	bf_op_done(BF_OP_##_op, start);					\
+}
+
+BF_TIMED(lookup,	(fuse_req_t req, fuse_ino_t dir, const char *name),
+			(req, dir, name))
+BF_TIMED(getattr,	(fuse_req_t req, fuse_ino_t inum, struct fuse_file_info *fi),
+			(req, inum, fi))
+BF_TIMED(setattr,	(fuse_req_t req, fuse_ino_t inum, struct stat *attr,
+			 int to_set, struct fuse_file_info *fi),
+			(req, inum, attr, to_set, fi))
+BF_TIMED(readlink,	(fuse_req_t req, fuse_ino_t inum),
+			(req, inum))
+BF_TIMED(mknod,		(fuse_req_t req, fuse_ino_t dir, const char *name,
+			 mode_t mode, dev_t rdev),
+			(req, dir, name, mode, rdev))
+BF_TIMED(mkdir,		(fuse_req_t req, fuse_ino_t dir, const char *name,
+			 mode_t mode),
+			(req, dir, name, mode))
+BF_TIMED(unlink,	(fuse_req_t req, fuse_ino_t dir, const char *name),
+			(req, dir, name))
+BF_TIMED(rmdir,		(fuse_req_t req, fuse_ino_t dir, const char *name),
+			(req, dir, name))
+BF_TIMED(symlink,	(fuse_req_t req, const char *link, fuse_ino_t dir,
+			 const char *name),
+			(req, link, dir, name))
+BF_TIMED(rename,	(fuse_req_t req, fuse_ino_t src_dir, const char *srcname,
+			 fuse_ino_t dst_dir, const char *dstname, unsigned flags),
+			(req, src_dir, srcname, dst_dir, dstname, flags))
+BF_TIMED(link,		(fuse_req_t req, fuse_ino_t inum, fuse_ino_t newparent,
+			 const char *newname),
+			(req, inum, newparent, newname))
+BF_TIMED(open,		(fuse_req_t req, fuse_ino_t inum, struct fuse_file_info *fi),
+			(req, inum, fi))
+BF_TIMED(read,		(fuse_req_t req, fuse_ino_t inum, size_t size,
+			 off_t offset, struct fuse_file_info *fi),
+			(req, inum, size, offset, fi))
+BF_TIMED(write,		(fuse_req_t req, fuse_ino_t inum, const char *buf,
+			 size_t size, off_t offset, struct fuse_file_info *fi),
+			(req, inum, buf, size, offset, fi))
+BF_TIMED(write_buf,	(fuse_req_t req, fuse_ino_t inum, struct fuse_bufvec *bufv,
+			 off_t offset, struct fuse_file_info *fi),
+			(req, inum, bufv, offset, fi))
+BF_TIMED(release,	(fuse_req_t req, fuse_ino_t inum, struct fuse_file_info *fi),
+			(req, inum, fi))
+BF_TIMED(opendir,	(fuse_req_t req, fuse_ino_t inum, struct fuse_file_info *fi),
+			(req, inum, fi))
+BF_TIMED(readdir,	(fuse_req_t req, fuse_ino_t dir, size_t size, off_t off,
+			 struct fuse_file_info *fi),
+			(req, dir, size, off, fi))
+BF_TIMED(readdirplus,	(fuse_req_t req, fuse_ino_t dir, size_t size, off_t off,
+			 struct fuse_file_info *fi),
+			(req, dir, size, off, fi))
+BF_TIMED(releasedir,	(fuse_req_t req, fuse_ino_t inum, struct fuse_file_info *fi),
+			(req, inum, fi))
+BF_TIMED(statfs,	(fuse_req_t req, fuse_ino_t inum),
+			(req, inum))
+BF_TIMED(create,	(fuse_req_t req, fuse_ino_t dir, const char *name,
+			 mode_t mode, struct fuse_file_info *fi),
+			(req, dir, name, mode, fi))
+BF_TIMED(fallocate,	(fuse_req_t req, fuse_ino_t inum, int mode, off_t offset,
+			 off_t length, struct fuse_file_info *fi),
+			(req, inum, mode, offset, length, fi))
+BF_TIMED(copy_file_range, (fuse_req_t req, fuse_ino_t inum_in, off_t off_in,
+			 struct fuse_file_info *fi_in, fuse_ino_t inum_out,
+			 off_t off_out, struct fuse_file_info *fi_out,
+			 size_t len, int flags),
+			(req, inum_in, off_in, fi_in, inum_out, off_out,
+			 fi_out, len, flags))
+BF_TIMED(lseek,		(fuse_req_t req, fuse_ino_t inum, off_t offset,
+			 int whence, struct fuse_file_info *fi),
+			(req, inum, offset, whence, fi))
+
+#undef BF_TIMED
 
 static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.init		= bcachefs_fuse_init,
 	.destroy	= bcachefs_fuse_destroy,
-	.lookup		= bcachefs_fuse_lookup,
-	.getattr	= bcachefs_fuse_getattr,
-	.setattr	= bcachefs_fuse_setattr,
-	.readlink	= bcachefs_fuse_readlink,
-	.mknod		= bcachefs_fuse_mknod,
-	.mkdir		= bcachefs_fuse_mkdir,
-	.unlink		= bcachefs_fuse_unlink,
-	.rmdir		= bcachefs_fuse_rmdir,
-	.symlink	= bcachefs_fuse_symlink,
-	.rename		= bcachefs_fuse_rename,
-	.link		= bcachefs_fuse_link,
-	.open		= bcachefs_fuse_open,
-	.read		= bcachefs_fuse_read,
-	.write		= bcachefs_fuse_write,
+	.lookup		= bcachefs_fuse_lookup_timed,
+	.getattr	= bcachefs_fuse_getattr_timed,
+	.setattr	= bcachefs_fuse_setattr_timed,
+	.readlink	= bcachefs_fuse_readlink_timed,
+	.mknod		= bcachefs_fuse_mknod_timed,
+	.mkdir		= bcachefs_fuse_mkdir_timed,
+	.unlink		= bcachefs_fuse_unlink_timed,
+	.rmdir		= bcachefs_fuse_rmdir_timed,
+	.symlink	= bcachefs_fuse_symlink_timed,
+	.rename		= bcachefs_fuse_rename_timed,
+	.link		= bcachefs_fuse_link_timed,
+	.open		= bcachefs_fuse_open_timed,
+	.read		= bcachefs_fuse_read_timed,
+	.write		= bcachefs_fuse_write_timed,
 	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
+	.release	= bcachefs_fuse_release_timed,
 	//.fsync	= bcachefs_fuse_fsync,
-	//.opendir	= bcachefs_fuse_opendir,
-	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
-	//.releasedir	= bcachefs_fuse_releasedir,
+	.opendir	= bcachefs_fuse_opendir_timed,
+	.readdir	= bcachefs_fuse_readdir_timed,
+	.readdirplus	= bcachefs_fuse_readdirplus_timed,
+	.releasedir	= bcachefs_fuse_releasedir_timed,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
-	.statfs		= bcachefs_fuse_statfs,
+	.statfs		= bcachefs_fuse_statfs_timed,
 	//.setxattr	= bcachefs_fuse_setxattr,
 	//.getxattr	= bcachefs_fuse_getxattr,
 	//.listxattr	= bcachefs_fuse_listxattr,
 	//.removexattr	= bcachefs_fuse_removexattr,
-	.create		= bcachefs_fuse_create,
+	.create		= bcachefs_fuse_create_timed,
 
 	/* posix locks: */
 #if 0
 	.getlk		= bcachefs_fuse_getlk,
 	.setlk		= bcachefs_fuse_setlk,
 #endif
-	//.write_buf	= bcachefs_fuse_write_buf,
-	//.fallocate	= bcachefs_fuse_fallocate,
+	.write_buf	= bcachefs_fuse_write_buf_timed,
+	.fallocate	= bcachefs_fuse_fallocate_timed,
+	.copy_file_range = bcachefs_fuse_copy_file_range_timed,
+	.lseek		= bcachefs_fuse_lseek_timed,
 
 };
 
@@ -1100,6 +2328,9 @@ struct bf_context {
 	char            *devices_str;
 	char            **devices;
 	int             nr_devices;
+	unsigned	threads;
+	struct bf_timeouts timeouts;
+	char		*stats_file;
 };
 
 static void bf_context_free(struct bf_context *ctx)
@@ -1107,12 +2338,18 @@ static void bf_context_free(struct bf_context *ctx)
 	int i;
 
 	free(ctx->devices_str);
+	free(ctx->stats_file);
 	for (i = 0; i < ctx->nr_devices; ++i)
 		free(ctx->devices[i]);
 	free(ctx->devices);
 }
 
 static struct fuse_opt bf_opts[] = {
+	{ "threads=%u", offsetof(struct bf_context, threads), 0 },
+	{ "stats_file=%s", offsetof(struct bf_context, stats_file), 0 },
+	{ "entry_timeout=%lf", offsetof(struct bf_context, timeouts.entry), 0 },
+	{ "attr_timeout=%lf", offsetof(struct bf_context, timeouts.attr), 0 },
+	{ "negative_timeout=%lf", offsetof(struct bf_context, timeouts.negative), 0 },
 	FUSE_OPT_END
 };
 
@@ -1175,13 +2412,28 @@ static void usage(char *argv[])
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
 	printf("\n");
+	printf("    -o threads=N           handle requests on multiple threads, keeping\n"
+	       "                           up to N idle (default: single threaded)\n"
+	       "    -o stats_file=FILE     on SIGUSR1, write request and cache stats to\n"
+	       "                           FILE (default: stdout)\n"
+	       "    -o entry_timeout=T     cache names for T seconds (default: forever)\n"
+	       "    -o attr_timeout=T      cache attributes for T seconds (default: forever)\n"
+	       "    -o negative_timeout=T  cache failed lookups for T seconds\n"
+	       "                           (default: forever)\n"
+	       "    -o max_write=N         largest write request (default 1M)\n"
+	       "    -o max_readahead=N     largest readahead request\n"
+	       "    -o max_background=N    background requests in flight\n"
+	       "    -o [no_]writeback_cache, sync_read, no_splice_read,\n"
+	       "       no_splice_write, no_splice_move\n"
+	       "                           override the connection defaults\n");
+	printf("\n");
 }
 
 int cmd_fusemount(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct bch_opts bch_opts = bch2_opts_empty();
-	struct bf_context ctx = { 0 };
+	struct bf_context ctx = { .timeouts = bf_timeouts };
 	struct bch_fs *c = NULL;
 	int ret = 0, i;
 
@@ -1189,6 +2441,8 @@ int cmd_fusemount(int argc, char *argv[])
 	if (fuse_opt_parse(&args, &ctx, bf_opts, bf_opt_proc) < 0)
 		die("fuse_opt_parse err: %m");
 
+	bf_timeouts = ctx.timeouts;
+
 	struct fuse_cmdline_opts fuse_opts;
 	if (fuse_parse_cmdline(&args, &fuse_opts) < 0)
 		die("fuse_parse_cmdline err: %m");
@@ -1220,6 +2474,23 @@ int cmd_fusemount(int argc, char *argv[])
 		goto out;
 	}
 	tokenize_devices(&ctx);
+	bf_open_table_init();
+
+	bf_conn_opts = fuse_parse_conn_info_opts(&args);
+	if (!bf_conn_opts)
+		die("fuse_parse_conn_info_opts err: %m");
+
+	/*
+	 * Block SIGUSR1 before any threads are started, so that they all
+	 * inherit it and it's only seen by bf_stats_thread():
+	 */
+	sigset_t stats_sig;
+	sigemptyset(&stats_sig);
+	sigaddset(&stats_sig, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &stats_sig, NULL);
+
+	bf_op_stats_init();
+	bf_stats_file = ctx.stats_file;
 
 	/* Open bch */
 	printf("Opening bcachefs filesystem on:\n");
@@ -1249,7 +2520,22 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	/* after fuse_daemonize(), threads don't survive the fork: */
+	pthread_t stats_thread;
+	if (pthread_create(&stats_thread, NULL, bf_stats_thread, c))
+		die("pthread_create err: %m");
+	pthread_detach(stats_thread);
+
+	if (ctx.threads > 1 && !fuse_opts.singlethread) {
+		struct fuse_loop_config config = {
+			.clone_fd		= true,
+			.max_idle_threads	= ctx.threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &config);
+	} else {
+		ret = fuse_session_loop(se);
+	}
 
 	/* Cleanup */
 	fuse_session_unmount(se);
@@ -1257,6 +2543,7 @@ int cmd_fusemount(int argc, char *argv[])
 	fuse_session_destroy(se);
 
 out:
+	free(bf_conn_opts);
 	free(fuse_opts.mountpoint);
 	fuse_opt_free_args(&args);
 	bf_context_free(&ctx);
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -9,24 +10,65 @@
 
 static void unlock_usage(void)
 {
-	puts("bcachefs unlock - unlock an encrypted filesystem so it can be mounted\n"
-	     "Usage: bcachefs unlock [OPTION] device\n"
+	puts("bcachefs unlock - unlock encrypted filesystems so they can be mounted\n"
+	     "Usage: bcachefs unlock [OPTION] device...\n"
+	     "\n"
+	     "Each device is a member of a different filesystem; they're unlocked with\n"
+	     "the same passphrase.\n"
 	     "\n"
 	     "Options:\n"
-	     "  -c                     Check if a device is encrypted\n"
+	     "  -c                     Check if the devices are encrypted\n"
 	     "  -k (session|user|user_session)\n"
 	     "                         Keyring to add to (default: user)\n"
+	     "  -t seconds             Cache the key derived from the passphrase in the\n"
+	     "                         keyring for this long, so that unlocking other\n"
+	     "                         filesystems with the same passphrase is fast\n"
+	     "                         (default 0, no caching)\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+/*
+ * Filesystems with the same KDF parameters share a derived key (the salt is
+ * fixed), so we run the KDF once per distinct set of parameters - in parallel,
+ * when there's more than one:
+ */
+struct unlock_kdf {
+	struct bch_sb		*sb;
+	struct bch_sb_field_crypt *crypt;
+	const char		*passphrase;
+	int			keyring;
+	unsigned		ttl;
+	struct bch_key		key;
+	pthread_t		thread;
+};
+
+static bool kdf_params_eq(struct bch_sb_field_crypt *l,
+			  struct bch_sb_field_crypt *r)
+{
+	return  BCH_CRYPT_KDF_TYPE(l)	== BCH_CRYPT_KDF_TYPE(r) &&
+		BCH_KDF_SCRYPT_N(l)	== BCH_KDF_SCRYPT_N(r) &&
+		BCH_KDF_SCRYPT_R(l)	== BCH_KDF_SCRYPT_R(r) &&
+		BCH_KDF_SCRYPT_P(l)	== BCH_KDF_SCRYPT_P(r);
+}
+
+static void *unlock_kdf_thread(void *arg)
+{
+	struct unlock_kdf *k = arg;
+
+	k->key = derive_passphrase_cached(k->sb, k->passphrase,
+					  k->keyring, k->ttl);
+	return NULL;
+}
+
 int cmd_unlock(int argc, char *argv[])
 {
 	const char *keyring = "user";
 	bool check = false;
+	unsigned ttl = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "ck:h")) != -1)
+	while ((opt = getopt(argc, argv, "ck:t:h")) != -1)
 		switch (opt) {
 		case 'c':
 			check = true;
@@ -34,40 +76,92 @@ int cmd_unlock(int argc, char *argv[])
 		case 'k':
 			keyring = strdup(optarg);
 			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &ttl))
+				die("invalid timeout %s", optarg);
+			break;
 		case 'h':
 			unlock_usage();
 			exit(EXIT_SUCCESS);
 		}
 	args_shift(optind);
 
-	char *dev = arg_pop();
-	if (!dev)
+	if (!argc)
 		die("Please supply a device");
 
-	if (argc)
-		die("Too many arguments");
-
 	struct bch_opts opts = bch2_opts_empty();
 
 	opt_set(opts, noexcl, true);
 	opt_set(opts, nochanges, true);
 
-	struct bch_sb_handle sb;
-	int ret = bch2_read_super(dev, &opts, &sb);
-	if (ret)
-		die("Error opening %s: %s", dev, strerror(-ret));
+	unsigned i, j, nr = argc, nr_kdfs = 0;
+	struct bch_sb_handle *sbs = xcalloc(nr, sizeof(*sbs));
+	unsigned *sb_kdf = xcalloc(nr, sizeof(*sb_kdf));
+	struct unlock_kdf *kdfs = xcalloc(nr, sizeof(*kdfs));
+
+	for (i = 0; i < nr; i++) {
+		int ret = bch2_read_super(argv[i], &opts, &sbs[i]);
+		if (ret)
+			die("Error opening %s: %s", argv[i], strerror(-ret));
 
-	if (!bch2_sb_is_encrypted(sb.sb))
-		die("%s is not encrypted", dev);
+		if (!bch2_sb_is_encrypted(sbs[i].sb))
+			die("%s is not encrypted", argv[i]);
+	}
 
 	if (check)
 		exit(EXIT_SUCCESS);
 
 	char *passphrase = read_passphrase("Enter passphrase: ");
+	int keyring_id = bch2_keyring_parse(keyring);
+
+	for (i = 0; i < nr; i++) {
+		struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sbs[i].sb);
+
+		for (j = 0; j < nr_kdfs; j++)
+			if (kdf_params_eq(kdfs[j].crypt, crypt))
+				break;
+
+		if (j == nr_kdfs)
+			kdfs[nr_kdfs++] = (struct unlock_kdf) {
+				.sb		= sbs[i].sb,
+				.crypt		= crypt,
+				.passphrase	= passphrase,
+				.keyring	= keyring_id,
+				.ttl		= ttl,
+			};
+		sb_kdf[i] = j;
+	}
+
+	for (j = 0; j < nr_kdfs; j++)
+		if (pthread_create(&kdfs[j].thread, NULL, unlock_kdf_thread, &kdfs[j]))
+			die("pthread_create error: %m");
+
+	for (j = 0; j < nr_kdfs; j++)
+		pthread_join(kdfs[j].thread, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct bch_key *key = &kdfs[sb_kdf[i]].key;
+		struct bch_key derived;
+
+		/*
+		 * The key may have come from the cache, which was only checked
+		 * against the first filesystem with these KDF parameters:
+		 */
+		if (!bch2_passphrase_key_valid(sbs[i].sb, key)) {
+			derived = derive_passphrase(bch2_sb_get_crypt(sbs[i].sb),
+						    passphrase);
+			key = &derived;
+		}
 
-	bch2_add_key(sb.sb, "user", keyring, passphrase);
+		bch2_add_key_derived(sbs[i].sb, "user", keyring, key);
+		memzero_explicit(&derived, sizeof(derived));
+		bch2_free_super(&sbs[i]);
+	}
 
-	bch2_free_super(&sb);
+	memzero_explicit(kdfs, nr * sizeof(*kdfs));
+	free(kdfs);
+	free(sb_kdf);
+	free(sbs);
 	memzero_explicit(passphrase, strlen(passphrase));
 	free(passphrase);
 	return 0;
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,8 +18,59 @@
 #include "libbcachefs/extents.h"
 #include "libbcachefs/super.h"
 
+#define LIST_FORMATS()		\
+	x(text)			\
+	x(json)			\
+	x(binary)
+
+enum list_formats {
+#define x(n)	LIST_FORMAT_##n,
+	LIST_FORMATS()
+#undef x
+};
+
+static const char * const list_formats[] = {
+#define x(n)	#n,
+	LIST_FORMATS()
+#undef x
+	NULL
+};
+
+/*
+ * Binary output is a header, then each key unpacked - a struct bkey followed
+ * by the value, k->u64s u64s in all, in the same little endian layout as on
+ * disk:
+ */
+#define LIST_BINARY_MAGIC	"BCHKEYS1"
+
+struct list_binary_hdr {
+	char			magic[8];
+	__le32			version;
+	__le32			btree_id;
+};
+
+static void list_key_json(FILE *out, struct bch_fs *c, enum btree_id btree_id,
+			  struct bkey_s_c k, struct printbuf *buf)
+{
+	printbuf_reset(buf);
+	bch2_val_to_text(buf, c, k);
+
+	fprintf(out, "{\"btree\":\"%s\",\"type\":\"%s\","
+		"\"inode\":%llu,\"offset\":%llu,\"snapshot\":%u,"
+		"\"size\":%u,\"version\":%llu,\"u64s\":%u,\"val\":\"",
+		bch2_btree_ids[btree_id],
+		bch2_bkey_types[k.k->type],
+		k.k->p.inode, k.k->p.offset, k.k->p.snapshot,
+		k.k->size,
+		((u64) k.k->version.hi << 32)|k.k->version.lo,
+		k.k->u64s);
+	json_escape(out, buf->buf ?: "");
+	fputs("\"}\n", out);
+}
+
 static void list_keys(struct bch_fs *c, enum btree_id btree_id,
-		      struct bpos start, struct bpos end)
+		      struct bpos start, struct bpos end,
+		      FILE *out, int format)
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
@@ -26,6 +78,16 @@ static void list_keys(struct bch_fs *c, enum btree_id btree_id,
 	struct printbuf buf = PRINTBUF;
 	int ret;
 
+	if (format == LIST_FORMAT_binary) {
+		struct list_binary_hdr hdr = {
+			.magic		= LIST_BINARY_MAGIC,
+			.version	= cpu_to_le32(c->sb.version),
+			.btree_id	= cpu_to_le32(btree_id),
+		};
+
+		fwrite(&hdr, sizeof(hdr), 1, out);
+	}
+
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for_each_btree_key(&trans, iter, btree_id, start,
@@ -34,15 +96,98 @@ static void list_keys(struct bch_fs *c, enum btree_id btree_id,
 		if (bkey_cmp(k.k->p, end) > 0)
 			break;
 
-		printbuf_reset(&buf);
-		bch2_bkey_val_to_text(&buf, c, k);
-		puts(buf.buf);
+		switch (format) {
+		case LIST_FORMAT_text:
+			printbuf_reset(&buf);
+			bch2_bkey_val_to_text(&buf, c, k);
+			fputs(buf.buf, out);
+			putc('\n', out);
+			break;
+		case LIST_FORMAT_json:
+			list_key_json(out, c, btree_id, k, &buf);
+			break;
+		case LIST_FORMAT_binary:
+			fwrite(k.k, sizeof(*k.k), 1, out);
+			fwrite(k.v, bkey_val_bytes(k.k), 1, out);
+			break;
+		}
 	}
 	bch2_trans_iter_exit(&trans, &iter);
 
 	bch2_trans_exit(&trans);
 
 	printbuf_exit(&buf);
+
+	if (ferror(out))
+		die("error writing %s keys: %m", bch2_btree_ids[btree_id]);
+}
+
+/* With -o, each btree is listed by its own thread, into its own file: */
+struct list_keys_job {
+	struct bch_fs		*c;
+	enum btree_id		btree_id;
+	struct bpos		start;
+	struct bpos		end;
+	int			format;
+	FILE			*out;
+	pthread_t		thread;
+};
+
+static void *list_keys_thread(void *arg)
+{
+	struct list_keys_job *j = arg;
+
+	sched_thread_init();
+
+	list_keys(j->c, j->btree_id, j->start, j->end, j->out, j->format);
+
+	if (fclose(j->out))
+		die("error writing %s keys: %m", bch2_btree_ids[j->btree_id]);
+	return NULL;
+}
+
+static void list_keys_parallel(struct bch_fs *c,
+			       enum btree_id btree_id_start,
+			       enum btree_id btree_id_end,
+			       struct bpos start, struct bpos end,
+			       const char *output, int format)
+{
+	static const char * const ext[] = {
+		[LIST_FORMAT_text]	= "txt",
+		[LIST_FORMAT_json]	= "json",
+		[LIST_FORMAT_binary]	= "bin",
+	};
+	unsigned i, nr = btree_id_end - btree_id_start;
+	struct list_keys_job *jobs = xcalloc(nr, sizeof(*jobs));
+
+	for (i = 0; i < nr; i++) {
+		struct list_keys_job *j = &jobs[i];
+		char *path;
+
+		*j = (struct list_keys_job) {
+			.c		= c,
+			.btree_id	= btree_id_start + i,
+			.start		= start,
+			.end		= end,
+			.format		= format,
+		};
+
+		path = mprintf("%s.%s.%s", output, bch2_btree_ids[j->btree_id],
+			       ext[format]);
+		j->out = fopen(path, "w");
+		if (!j->out)
+			die("error opening %s: %m", path);
+		free(path);
+
+		setvbuf(j->out, NULL, _IOFBF, 1 << 20);
+
+		if (pthread_create(&j->thread, NULL, list_keys_thread, j))
+			die("pthread_create error: %m");
+	}
+
+	for (i = 0; i < nr; i++)
+		pthread_join(jobs[i].thread, NULL);
+	free(jobs);
 }
 
 static void list_btree_formats(struct bch_fs *c, enum btree_id btree_id, unsigned level,
@@ -289,6 +434,9 @@ static void list_keys_usage(void)
 	     "  -i inode                              List keys for a given inode number\n"
 	     "  -m (keys|formats|nodes|nodes_ondisk|nodes_keys)\n"
 	     "                                        List mode\n"
+	     "  -F (text|json|binary)                 Output format for keys mode\n"
+	     "  -o prefix                             Keys mode: list btrees in parallel,\n"
+	     "                                        each to prefix.<btree>.<format>\n"
 	     "  -f                                    Check (fsck) the filesystem first\n"
 	     "  -v                                    Verbose mode\n"
 	     "  -h                                    Display this help and exit\n"
@@ -324,14 +472,15 @@ int cmd_list(int argc, char *argv[])
 	unsigned level = 0;
 	struct bpos start = POS_MIN, end = POS_MAX;
 	u64 inum = 0;
-	int mode = 0, opt;
+	const char *output = NULL;
+	int mode = 0, format = LIST_FORMAT_text, opt;
 
 	opt_set(opts, nochanges,	true);
 	opt_set(opts, norecovery,	true);
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_continue);
 
-	while ((opt = getopt(argc, argv, "b:l:s:e:i:m:fvh")) != -1)
+	while ((opt = getopt(argc, argv, "b:l:s:e:i:m:F:o:fvh")) != -1)
 		switch (opt) {
 		case 'b':
 			btree_id_start = read_string_list_or_die(optarg,
@@ -358,6 +507,13 @@ int cmd_list(int argc, char *argv[])
 			mode = read_string_list_or_die(optarg,
 						list_modes, "list mode");
 			break;
+		case 'F':
+			format = read_string_list_or_die(optarg,
+						list_formats, "output format");
+			break;
+		case 'o':
+			output = optarg;
+			break;
 		case 'f':
 			opt_set(opts, fix_errors, FSCK_OPT_YES);
 			opt_set(opts, norecovery, false);
@@ -378,13 +534,25 @@ int cmd_list(int argc, char *argv[])
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
 
+	if ((format != LIST_FORMAT_text || output) &&
+	    mode != LIST_MODE_keys)
+		die("-F and -o are only supported in keys mode");
+
+	if (output) {
+		list_keys_parallel(c, btree_id_start, btree_id_end,
+				   start, end, output, format);
+		goto out;
+	}
+
+	if (format != LIST_FORMAT_text)
+		setvbuf(stdout, NULL, _IOFBF, 1 << 20);
 
 	for (btree_id = btree_id_start;
 	     btree_id < btree_id_end;
 	     btree_id++) {
 		switch (mode) {
 		case LIST_MODE_keys:
-			list_keys(c, btree_id, start, end);
+			list_keys(c, btree_id, start, end, stdout, format);
 			break;
 		case LIST_MODE_formats:
 			list_btree_formats(c, btree_id, level, start, end);
@@ -402,7 +570,7 @@ int cmd_list(int argc, char *argv[])
 			die("Invalid mode");
 		}
 	}
-
+out:
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -23,11 +23,122 @@ static void list_journal_usage(void)
 	     "Options:\n"
 	     "  -a            Read entire journal, not just dirty entries\n"
 	     "  -n            Number of journal entries to print, starting from the most recent\n"
+	     "  -S seq[-seq]  Only print journal entries in this range of sequence numbers\n"
+	     "  -b btree      Only print keys in this btree; may be given more than once\n"
+	     "  -s inode:offset\n"
+	     "                Only print keys at or after this position\n"
+	     "  -e inode:offset\n"
+	     "                Only print keys at or before this position\n"
+	     "  -t name       Only print transactions whose name contains this string\n"
+	     "  -F (text|json|binary)\n"
+	     "                Output format\n"
 	     "  -v            Verbose mode\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+#define LIST_JOURNAL_FORMATS()	\
+	x(text)			\
+	x(json)			\
+	x(binary)
+
+enum list_journal_formats {
+#define x(n)	LIST_JOURNAL_FORMAT_##n,
+	LIST_JOURNAL_FORMATS()
+#undef x
+};
+
+static const char * const list_journal_formats[] = {
+#define x(n)	#n,
+	LIST_JOURNAL_FORMATS()
+#undef x
+	NULL
+};
+
+/*
+ * Binary output is a header, then for each key a struct list_journal_binary_key
+ * followed by the key, k->k.u64s u64s in the same little endian layout as on
+ * disk. Only keys are output; the other journal entry types aren't:
+ */
+#define LIST_JOURNAL_BINARY_MAGIC	"BCHJRNL1"
+
+struct list_journal_binary_hdr {
+	char			magic[8];
+	__le32			version;
+	__le32			pad;
+};
+
+struct list_journal_binary_key {
+	__le64			seq;
+	__u8			entry_type;
+	__u8			btree_id;
+	__u8			level;
+	__u8			pad[5];
+};
+
+/*
+ * Filters are applied while walking the journal, before anything is formatted:
+ * a key that doesn't match is never printed to a buffer.
+ */
+struct journal_filter {
+	u64			seq_start;
+	u64			seq_end;
+	u64			btree_mask;
+	struct bpos		start;
+	struct bpos		end;
+	const char		*transaction;
+	int			format;
+};
+
+/* If we're filtering on keys, other entry types are skipped: */
+static bool journal_filter_keys(struct journal_filter *f)
+{
+	return ~f->btree_mask ||
+		bkey_cmp(f->start, POS_MIN) ||
+		bkey_cmp(f->end, SPOS_MAX) ||
+		f->transaction;
+}
+
+static bool entry_has_keys(struct jset_entry *entry)
+{
+	return entry->type == BCH_JSET_ENTRY_btree_keys ||
+		entry->type == BCH_JSET_ENTRY_btree_root ||
+		entry->type == BCH_JSET_ENTRY_overwrite;
+}
+
+static bool journal_key_matches(struct journal_filter *f,
+				struct jset_entry *entry,
+				struct bkey_i *k)
+{
+	return (f->btree_mask & (1ULL << entry->btree_id)) &&
+		bkey_cmp(k->k.p, f->start) >= 0 &&
+		bkey_cmp(k->k.p, f->end) <= 0;
+}
+
+struct journal_transaction {
+	const char		*name;
+	unsigned		len;
+	bool			printed;
+};
+
+static void journal_transaction_start(struct journal_transaction *t,
+				      struct jset_entry *entry)
+{
+	struct jset_entry_log *l = container_of(entry, struct jset_entry_log, entry);
+
+	t->name		= (const char *) l->d;
+	t->len		= strnlen(t->name, vstruct_bytes(entry) -
+				  offsetof(struct jset_entry_log, d));
+	t->printed	= false;
+}
+
+static bool journal_transaction_matches(struct journal_filter *f,
+					struct journal_transaction *t)
+{
+	return !f->transaction ||
+		memmem(t->name, t->len, f->transaction, strlen(f->transaction));
+}
+
 static void star_start_of_lines(char *buf)
 {
 	char *p = buf;
@@ -39,9 +150,181 @@ static void star_start_of_lines(char *buf)
 		p[1] = '*';
 }
 
+static void journal_key_json(struct bch_fs *c, struct journal_replay *p,
+			     struct journal_transaction *t,
+			     struct jset_entry *entry, struct bkey_i *k,
+			     struct printbuf *buf)
+{
+	char *name = strndup(t->name ?: "", t->len);
+
+	printbuf_reset(buf);
+	bch2_val_to_text(buf, c, bkey_i_to_s_c(k));
+
+	printf("{\"seq\":%llu,\"transaction\":\"", le64_to_cpu(p->j.seq));
+	json_escape(stdout, name);
+	printf("\",\"entry\":\"%s\",\"btree\":\"%s\",\"level\":%u,"
+	       "\"type\":\"%s\",\"inode\":%llu,\"offset\":%llu,\"snapshot\":%u,"
+	       "\"size\":%u,\"val\":\"",
+	       bch2_jset_entry_types[entry->type],
+	       bch2_btree_ids[entry->btree_id],
+	       entry->level,
+	       bch2_bkey_types[k->k.type],
+	       k->k.p.inode, k->k.p.offset, k->k.p.snapshot,
+	       k->k.size);
+	json_escape(stdout, buf->buf ?: "");
+	fputs("\"}\n", stdout);
+
+	free(name);
+}
+
+static void journal_key_binary(struct journal_replay *p,
+			       struct jset_entry *entry, struct bkey_i *k)
+{
+	struct list_journal_binary_key b = {
+		.seq		= p->j.seq,
+		.entry_type	= entry->type,
+		.btree_id	= entry->btree_id,
+		.level		= entry->level,
+	};
+
+	fwrite(&b, sizeof(b), 1, stdout);
+	fwrite(k, k->k.u64s * sizeof(u64), 1, stdout);
+}
+
+static void journal_replay_header_to_text(struct printbuf *buf,
+					  struct bch_fs *c,
+					  struct journal_replay *p,
+					  bool blacklisted)
+{
+	printbuf_reset(buf);
+
+	if (blacklisted)
+		prt_printf(buf, "blacklisted ");
+
+	prt_printf(buf,
+	       "journal entry       %llu\n"
+	       "  version         %u\n"
+	       "  last seq        %llu\n"
+	       "  flush           %u\n"
+	       "  written at      ",
+	       le64_to_cpu(p->j.seq),
+	       le32_to_cpu(p->j.version),
+	       le64_to_cpu(p->j.last_seq),
+	       !JSET_NO_FLUSH(&p->j));
+	bch2_journal_ptrs_to_text(buf, c, p);
+
+	if (blacklisted)
+		star_start_of_lines(buf->buf + strcspn(buf->buf, "\n"));
+	printf("%s\n", buf->buf);
+}
+
+static void list_journal_replay(struct bch_fs *c, struct journal_replay *p,
+				struct journal_filter *f, struct printbuf *buf)
+{
+	struct journal_transaction t = { NULL };
+	struct jset_entry *entry;
+	struct bkey_i *k;
+	bool filter_keys = journal_filter_keys(f);
+	bool blacklisted =
+		bch2_journal_seq_is_blacklisted(c,
+				le64_to_cpu(p->j.seq), false);
+	bool header_printed = false;
+
+	if (f->format == LIST_JOURNAL_FORMAT_text && !filter_keys) {
+		journal_replay_header_to_text(buf, c, p, blacklisted);
+		header_printed = true;
+	}
+
+	vstruct_for_each(&p->j, entry) {
+		/*
+		 * log entries denote the start of a new transaction
+		 * commit:
+		 */
+		if (entry->type == BCH_JSET_ENTRY_log && !entry->level)
+			journal_transaction_start(&t, entry);
+
+		if (!filter_keys && f->format == LIST_JOURNAL_FORMAT_text) {
+			printbuf_reset(buf);
+
+			if (entry->type == BCH_JSET_ENTRY_log && !entry->level)
+				prt_newline(buf);
+			printbuf_indent_add(buf, 4);
+			bch2_journal_entry_to_text(buf, c, entry);
+
+			if (blacklisted)
+				star_start_of_lines(buf->buf);
+			printf("%s\n", buf->buf);
+			continue;
+		}
+
+		if (!entry_has_keys(entry) ||
+		    !journal_transaction_matches(f, &t))
+			continue;
+
+		vstruct_for_each(entry, k) {
+			if (!journal_key_matches(f, entry, k))
+				continue;
+
+			switch (f->format) {
+			case LIST_JOURNAL_FORMAT_text:
+				if (!header_printed) {
+					journal_replay_header_to_text(buf, c, p, blacklisted);
+					header_printed = true;
+				}
+
+				if (t.name && !t.printed) {
+					printf("\n%s    log: %.*s\n",
+					       blacklisted ? "*" : "",
+					       t.len, t.name);
+					t.printed = true;
+				}
+
+				printbuf_reset(buf);
+				printbuf_indent_add(buf, 4);
+				prt_printf(buf, "%s: btree=%s l=%u ",
+					   bch2_jset_entry_types[entry->type],
+					   bch2_btree_ids[entry->btree_id],
+					   entry->level);
+				bch2_bkey_val_to_text(buf, c, bkey_i_to_s_c(k));
+
+				if (blacklisted)
+					star_start_of_lines(buf->buf);
+				printf("%s\n", buf->buf);
+				break;
+			case LIST_JOURNAL_FORMAT_json:
+				journal_key_json(c, p, &t, entry, k, buf);
+				break;
+			case LIST_JOURNAL_FORMAT_binary:
+				journal_key_binary(p, entry, k);
+				break;
+			}
+		}
+	}
+}
+
+static void seq_range_parse(char *arg, u64 *start, u64 *end)
+{
+	char *s = arg, *field = strsep(&s, "-");
+
+	if (kstrtoull(field, 10, start))
+		die("invalid sequence number %s", arg);
+
+	if (!s)
+		*end = *start;
+	else if (kstrtoull(s, 10, end) || *end < *start)
+		die("invalid sequence number range %s", arg);
+}
+
 int cmd_list_journal(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
+	struct journal_filter f = {
+		.seq_start	= 0,
+		.seq_end	= U64_MAX,
+		.start		= POS_MIN,
+		.end		= SPOS_MAX,
+		.format		= LIST_JOURNAL_FORMAT_text,
+	};
 	u32 nr_entries = U32_MAX;
 	int opt;
 
@@ -53,15 +336,37 @@ int cmd_list_journal(int argc, char *argv[])
 	opt_set(opts, keep_journal,	true);
 	opt_set(opts, read_journal_only,true);
 
-	while ((opt = getopt(argc, argv, "an:vh")) != -1)
+	while ((opt = getopt(argc, argv, "an:S:b:s:e:t:F:vh")) != -1)
 		switch (opt) {
 		case 'a':
 			opt_set(opts, read_entire_journal, true);
 			break;
 		case 'n':
-			nr_entries = kstrtouint(optarg, 10, &nr_entries);
+			if (kstrtouint(optarg, 10, &nr_entries))
+				die("invalid number of entries %s", optarg);
 			opt_set(opts, read_entire_journal, true);
 			break;
+		case 'S':
+			seq_range_parse(optarg, &f.seq_start, &f.seq_end);
+			opt_set(opts, read_entire_journal, true);
+			break;
+		case 'b':
+			f.btree_mask |= 1ULL << read_string_list_or_die(optarg,
+						bch2_btree_ids, "btree id");
+			break;
+		case 's':
+			f.start	= bpos_parse(optarg);
+			break;
+		case 'e':
+			f.end	= bpos_parse(optarg);
+			break;
+		case 't':
+			f.transaction = optarg;
+			break;
+		case 'F':
+			f.format = read_string_list_or_die(optarg,
+						list_journal_formats, "format");
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -71,6 +376,9 @@ int cmd_list_journal(int argc, char *argv[])
 		}
 	args_shift(optind);
 
+	if (!f.btree_mask)
+		f.btree_mask = ~0ULL;
+
 	if (!argc)
 		die("Please supply device(s) to open");
 
@@ -78,63 +386,41 @@ int cmd_list_journal(int argc, char *argv[])
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
 
-	struct journal_replay *p, **_p;
+	struct journal_replay **_p;
 	struct genradix_iter iter;
-	struct jset_entry *entry;
 	struct printbuf buf = PRINTBUF;
 
-	genradix_for_each(&c->journal_entries, iter, _p) {
-		p = *_p;
-		if (!p)
-			continue;
-
-		if (le64_to_cpu(p->j.seq) + nr_entries < atomic64_read(&c->journal.seq))
-			continue;
-
-		bool blacklisted =
-			bch2_journal_seq_is_blacklisted(c,
-					le64_to_cpu(p->j.seq), false);
-
-		if (blacklisted)
-			printf("blacklisted ");
-
-		printf("journal entry       %llu\n", le64_to_cpu(p->j.seq));
+	if (f.format == LIST_JOURNAL_FORMAT_binary) {
+		struct list_journal_binary_hdr hdr = {
+			.magic		= LIST_JOURNAL_BINARY_MAGIC,
+			.version	= cpu_to_le32(c->sb.version),
+		};
 
-		printbuf_reset(&buf);
+		fwrite(&hdr, sizeof(hdr), 1, stdout);
+	}
 
-		prt_printf(&buf,
-		       "  version         %u\n"
-		       "  last seq        %llu\n"
-		       "  flush           %u\n"
-		       "  written at      ",
-		       le32_to_cpu(p->j.version),
-		       le64_to_cpu(p->j.last_seq),
-		       !JSET_NO_FLUSH(&p->j));
-		bch2_journal_ptrs_to_text(&buf, c, p);
+	genradix_for_each(&c->journal_entries, iter, _p) {
+		struct journal_replay *p = *_p;
+		u64 seq;
 
-		if (blacklisted)
-			star_start_of_lines(buf.buf);
-		printf("%s\n", buf.buf);
+		if (!p)
+			continue;
 
-		vstruct_for_each(&p->j, entry) {
-			printbuf_reset(&buf);
+		seq = le64_to_cpu(p->j.seq);
 
-			/*
-			 * log entries denote the start of a new transaction
-			 * commit:
-			 */
-			if (entry->type == BCH_JSET_ENTRY_log && !entry->level)
-				prt_newline(&buf);
-			printbuf_indent_add(&buf, 4);
-			bch2_journal_entry_to_text(&buf, c, entry);
+		if (seq + nr_entries < atomic64_read(&c->journal.seq) ||
+		    seq < f.seq_start ||
+		    seq > f.seq_end)
+			continue;
 
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-		}
+		list_journal_replay(c, p, &f, &buf);
 	}
 
 	printbuf_exit(&buf);
+
+	if (fflush(stdout) || ferror(stdout))
+		die("error writing output: %m");
+
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -2,10 +2,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/xattr.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
@@ -124,8 +126,9 @@ static void update_inode(struct bch_fs *c,
 
 	bch2_inode_pack(c, &packed, inode);
 	packed.inode.k.p.snapshot = U32_MAX;
-	ret = bch2_btree_insert(c, BTREE_ID_inodes, &packed.inode.k_i,
-				NULL, NULL, 0);
+	/* with several threads copying, these get committed together: */
+	ret = bch2_btree_insert_grouped(c, BTREE_ID_inodes, &packed.inode.k_i,
+					NULL, 0);
 	if (ret)
 		die("error updating inode: %s", strerror(-ret));
 }
@@ -205,11 +208,18 @@ static void copy_times(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	dst->bi_ctime = timespec_to_bch2_time(c, src->st_ctim);
 }
 
-static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
-			char *src)
-{
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, dst);
+struct src_xattr {
+	const struct xattr_handler *handler;
+	char			*name;
+	void			*val;
+	size_t			size;
+};
+
+typedef DARRAY(struct src_xattr) src_xattrs;
 
+/* Read them all up front, so that setting them can be done in one transaction: */
+static void read_xattrs(src_xattrs *x, char *src)
+{
 	char attrs[XATTR_LIST_MAX];
 	ssize_t attrs_size = llistxattr(src, attrs, sizeof(attrs));
 	if (attrs_size < 0)
@@ -228,75 +238,299 @@ static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
 			die("error getting xattr val: %m");
 
 		const struct xattr_handler *h = xattr_resolve_name(&attr);
+		if (IS_ERR(h))
+			die("unsupported xattr %s on %s", attr, src);
+
+		struct src_xattr i = {
+			.handler	= h,
+			.name		= strdup(attr),
+			.val		= xmalloc(val_size ?: 1),
+			.size		= val_size,
+		};
+
+		memcpy(i.val, val, val_size);
+
+		if (!i.name || darray_push(x, i))
+			die("insufficient memory");
+	}
+}
+
+static void src_xattrs_exit(src_xattrs *x)
+{
+	struct src_xattr *i;
 
-		int ret = bch2_trans_do(c, NULL, NULL, 0,
-				bch2_xattr_set(&trans,
-					       (subvol_inum) { 1, dst->bi_inum },
-					       &hash_info, attr,
-					       val, val_size, h->flags, 0));
-		if (ret < 0)
-			die("error creating xattr: %s", strerror(-ret));
+	darray_for_each(*x, i) {
+		free(i->name);
+		free(i->val);
 	}
+	darray_exit(x);
+}
+
+/* Doesn't update the inode: the caller writes it (or just created it) */
+static int set_xattrs_trans(struct btree_trans *trans,
+			    struct bch_inode_unpacked *dst,
+			    src_xattrs *x)
+{
+	struct bch_hash_info hash_info = bch2_hash_info_init(trans->c, dst);
+	struct src_xattr *i;
+	int ret;
+
+	darray_for_each(*x, i) {
+		ret = __bch2_xattr_set(trans, (subvol_inum) { 1, dst->bi_inum },
+				       dst, &hash_info, i->name, i->val, i->size,
+				       i->handler->flags, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+struct set_xattrs_args {
+	struct bch_inode_unpacked	*dst;
+	src_xattrs			*x;
+};
+
+static int set_xattrs_grouped(struct btree_trans *trans, void *_args)
+{
+	struct set_xattrs_args *args = _args;
+
+	return set_xattrs_trans(trans, args->dst, args->x);
+}
+
+static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
+			char *src)
+{
+	src_xattrs x = { 0 };
+	struct set_xattrs_args args = { .dst = dst, .x = &x };
+
+	read_xattrs(&x, src);
+
+	int ret = bch2_trans_do_grouped(c, BTREE_ID_xattrs, POS(dst->bi_inum, 0),
+					set_xattrs_grouped, &args, NULL, 0);
+	if (ret < 0)
+		die("error creating xattr: %s", strerror(-ret));
+
+	src_xattrs_exit(&x);
+}
+
+static int create_file_trans(struct btree_trans *trans,
+			     struct bch_inode_unpacked *parent,
+			     struct bch_inode_unpacked *inode,
+			     struct qstr *name, struct stat *src,
+			     src_xattrs *x, bool write_inode)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_inode_buf *packed;
+	int ret;
+
+	ret   = bch2_create_trans(trans,
+				  (subvol_inum) { 1, parent->bi_inum }, parent,
+				  inode, name,
+				  src->st_uid, src->st_gid,
+				  src->st_mode, src->st_rdev, NULL, NULL,
+				  (subvol_inum) {}, 0) ?:
+		set_xattrs_trans(trans, inode, x);
+	if (ret)
+		return ret;
+
+	copy_times(c, inode, src);
+
+	if (!write_inode)
+		return 0;
+
+	packed = bch2_trans_kmalloc(trans, sizeof(*packed));
+	ret = PTR_ERR_OR_ZERO(packed);
+	if (ret)
+		return ret;
+
+	bch2_inode_pack(c, packed, inode);
+	packed->inode.k.p.snapshot = U32_MAX;
+	return __bch2_btree_insert(trans, BTREE_ID_inodes, &packed->inode.k_i);
+}
+
+/*
+ * Create a file with its xattrs and times, in one transaction instead of one
+ * for the create, one per xattr and one for the final inode update: when
+ * @done, there's nothing else to copy and the inode is written as well.
+ */
+static struct bch_inode_unpacked create_file_xattrs(struct bch_fs *c,
+					struct bch_inode_unpacked *parent,
+					const char *name, char *src_path,
+					struct stat *src, bool done)
+{
+	struct qstr qstr = QSTR(name);
+	struct bch_inode_unpacked new_inode;
+	src_xattrs x = { 0 };
+
+	read_xattrs(&x, src_path);
+
+	bch2_inode_init_early(c, &new_inode);
+
+	int ret = bch2_trans_do(c, NULL, NULL, 0,
+		create_file_trans(&trans, parent, &new_inode, &qstr, src,
+				  &x, done));
+	if (ret)
+		die("error creating %s: %s", name, strerror(-ret));
+
+	src_xattrs_exit(&x);
+	return new_inode;
 }
 
 #define WRITE_DATA_BUF	(1 << 20)
 
-static char buf[WRITE_DATA_BUF] __aligned(PAGE_SIZE);
+/*
+ * copy_data() keeps several writes in flight, from a ring of buffers: a buffer
+ * is only waited on when we come back around to it, so reading the next chunk
+ * of the source overlaps with writing the previous ones.
+ */
+struct write_data_buf {
+	struct closure		cl;
+	bool			in_flight;
+	void			*buf;
+	struct bio_vec		bv[WRITE_DATA_BUF / PAGE_SIZE];
+	struct bch_write_op	op;
+};
 
-static void write_data(struct bch_fs *c,
-		       struct bch_inode_unpacked *dst_inode,
-		       u64 dst_offset, void *buf, size_t len)
+struct write_data_ring {
+	unsigned		next;
+	struct write_data_buf	*bufs;
+};
+
+static unsigned nr_write_data_bufs = 8;
+
+static void write_data_wait(struct write_data_buf *w)
+{
+	if (!w->in_flight)
+		return;
+
+	closure_sync(&w->cl);
+	w->in_flight = false;
+
+	if (w->op.error)
+		die("error writing data: %s", bch2_err_str(w->op.error));
+}
+
+/* Wait for all of copy_data()'s writes: */
+static void write_data_flush(struct write_data_ring *ring)
+{
+	unsigned i;
+
+	for (i = 0; i < nr_write_data_bufs && ring->bufs; i++)
+		write_data_wait(&ring->bufs[i]);
+}
+
+static void write_data_ring_exit(struct write_data_ring *ring)
+{
+	unsigned i;
+
+	if (!ring->bufs)
+		return;
+
+	write_data_flush(ring);
+
+	for (i = 0; i < nr_write_data_bufs; i++)
+		free(ring->bufs[i].buf);
+	free(ring->bufs);
+	ring->bufs = NULL;
+}
+
+static void write_data_submit(struct bch_fs *c, struct write_data_buf *w,
+			      struct bch_inode_unpacked *dst_inode,
+			      u64 dst_offset, void *buf, size_t len)
 {
-	struct bch_write_op op;
-	struct bio_vec bv[WRITE_DATA_BUF / PAGE_SIZE];
-	struct closure cl;
+	struct bch_write_op *op = &w->op;
 
 	BUG_ON(dst_offset	& (block_bytes(c) - 1));
 	BUG_ON(len		& (block_bytes(c) - 1));
 	BUG_ON(len > WRITE_DATA_BUF);
+	BUG_ON(w->in_flight);
 
-	closure_init_stack(&cl);
+	closure_init_stack(&w->cl);
 
-	bio_init(&op.wbio.bio, NULL, bv, ARRAY_SIZE(bv), 0);
-	bch2_bio_map(&op.wbio.bio, buf, len);
+	bio_init(&op->wbio.bio, NULL, w->bv, ARRAY_SIZE(w->bv), 0);
+	bch2_bio_map(&op->wbio.bio, buf, len);
 
-	bch2_write_op_init(&op, c, bch2_opts_to_inode_opts(c->opts));
-	op.write_point	= writepoint_hashed(0);
-	op.nr_replicas	= 1;
-	op.subvol	= 1;
-	op.pos		= SPOS(dst_inode->bi_inum, dst_offset >> 9, U32_MAX);
+	bch2_write_op_init(op, c, bch2_opts_to_inode_opts(c->opts));
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= 1;
+	op->subvol	= 1;
+	op->pos		= SPOS(dst_inode->bi_inum, dst_offset >> 9, U32_MAX);
 
-	int ret = bch2_disk_reservation_get(c, &op.res, len >> 9,
+	int ret = bch2_disk_reservation_get(c, &op->res, len >> 9,
 					    c->opts.data_replicas, 0);
 	if (ret)
 		die("error reserving space in new filesystem: %s", strerror(-ret));
 
-	closure_call(&op.cl, bch2_write, NULL, &cl);
-	closure_sync(&cl);
+	w->in_flight = true;
+	closure_call(&op->cl, bch2_write, NULL, &w->cl);
 
 	dst_inode->bi_sectors += len >> 9;
 }
 
-static void copy_data(struct bch_fs *c,
+static void write_data(struct bch_fs *c,
+		       struct bch_inode_unpacked *dst_inode,
+		       u64 dst_offset, void *buf, size_t len)
+{
+	struct write_data_buf *w = xmalloc(sizeof(*w));
+
+	w->in_flight = false;
+	write_data_submit(c, w, dst_inode, dst_offset, buf, len);
+	write_data_wait(w);
+	free(w);
+}
+
+static void copy_data(struct bch_fs *c, struct write_data_ring *ring,
 		      struct bch_inode_unpacked *dst_inode,
 		      int src_fd, u64 start, u64 end)
 {
+	unsigned i;
+
+	if (!ring->bufs) {
+		ring->bufs = xcalloc(nr_write_data_bufs, sizeof(*ring->bufs));
+		for (i = 0; i < nr_write_data_bufs; i++) {
+			ring->bufs[i].buf = aligned_alloc(PAGE_SIZE, WRITE_DATA_BUF);
+			if (!ring->bufs[i].buf)
+				die("insufficient memory");
+		}
+	}
+
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		struct write_data_buf *w = &ring->bufs[ring->next];
+		unsigned len = min_t(u64, end - start, WRITE_DATA_BUF);
 		unsigned pad = round_up(len, block_bytes(c)) - len;
 
-		xpread(src_fd, buf, len, start);
-		memset(buf + len, 0, pad);
+		ring->next = (ring->next + 1) % nr_write_data_bufs;
+		write_data_wait(w);
+
+		xpread(src_fd, w->buf, len, start);
+		memset(w->buf + len, 0, pad);
 
-		write_data(c, dst_inode, start, buf, len + pad);
+		write_data_submit(c, w, dst_inode, start, w->buf, len + pad);
 		start += len;
 	}
 }
 
+/* Extents linked per transaction: */
+#define LINK_DATA_BATCH		32
+
+static int link_data_trans(struct btree_trans *trans,
+			   struct bkey_i_extent **k, unsigned nr)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = __bch2_btree_insert(trans, BTREE_ID_extents, &k[i]->k_i);
+	return ret;
+}
+
 static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		      u64 logical, u64 physical, u64 length)
 {
 	struct bch_dev *ca = c->devs[0];
+	__BKEY_PADDED(k, BKEY_EXTENT_VAL_U64s_MAX) k[LINK_DATA_BATCH];
+	struct bkey_i_extent *e[LINK_DATA_BATCH];
 
 	BUG_ON(logical	& (block_bytes(c) - 1));
 	BUG_ON(physical & (block_bytes(c) - 1));
@@ -309,67 +543,82 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	BUG_ON(physical + length > bucket_to_sector(ca, ca->mi.nbuckets));
 
 	while (length) {
-		struct bkey_i_extent *e;
-		__BKEY_PADDED(k, BKEY_EXTENT_VAL_U64s_MAX) k;
-		u64 b = sector_to_bucket(ca, physical);
 		struct disk_reservation res;
-		unsigned sectors;
+		unsigned nr, sectors, total = 0;
 		int ret;
 
-		sectors = min(ca->mi.bucket_size -
-			      (physical & (ca->mi.bucket_size - 1)),
-			      length);
-
-		e = bkey_extent_init(&k.k);
-		e->k.p.inode	= dst->bi_inum;
-		e->k.p.offset	= logical + sectors;
-		e->k.p.snapshot	= U32_MAX;
-		e->k.size	= sectors;
-		bch2_bkey_append_ptr(&e->k_i, (struct bch_extent_ptr) {
-					.offset = physical,
-					.dev = 0,
-					.gen = *bucket_gen(ca, b),
-				  });
-
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
+		for (nr = 0; nr < LINK_DATA_BATCH && length; nr++) {
+			u64 b = sector_to_bucket(ca, physical);
+
+			sectors = min(ca->mi.bucket_size -
+				      (physical & (ca->mi.bucket_size - 1)),
+				      length);
+
+			e[nr] = bkey_extent_init(&k[nr].k);
+			e[nr]->k.p.inode	= dst->bi_inum;
+			e[nr]->k.p.offset	= logical + sectors;
+			e[nr]->k.p.snapshot	= U32_MAX;
+			e[nr]->k.size		= sectors;
+			bch2_bkey_append_ptr(&e[nr]->k_i, (struct bch_extent_ptr) {
+						.offset = physical,
+						.dev = 0,
+						.gen = *bucket_gen(ca, b),
+					  });
+
+			total		+= sectors;
+			logical		+= sectors;
+			physical	+= sectors;
+			length		-= sectors;
+		}
+
+		ret = bch2_disk_reservation_get(c, &res, total, 1,
 						BCH_DISK_RESERVATION_NOFAIL);
 		if (ret)
 			die("error reserving space in new filesystem: %s",
 			    strerror(-ret));
 
-		ret = bch2_btree_insert(c, BTREE_ID_extents, &e->k_i,
-					&res, NULL, 0);
+		ret = bch2_trans_do(c, &res, NULL, 0,
+				    link_data_trans(&trans, e, nr));
 		if (ret)
 			die("btree insert error %s", strerror(-ret));
 
 		bch2_disk_reservation_put(c, &res);
 
-		dst->bi_sectors	+= sectors;
-		logical		+= sectors;
-		physical	+= sectors;
-		length		-= sectors;
+		dst->bi_sectors	+= total;
 	}
 }
 
 static void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		      char *src)
+		      int dirfd, const char *src)
 {
-	ssize_t ret = readlink(src, buf, sizeof(buf));
+	size_t size = round_up(PATH_MAX, block_bytes(c));
+	char *buf = aligned_alloc(PAGE_SIZE, size);
+
+	if (!buf)
+		die("insufficient memory");
+
+	memset(buf, 0, size);
+
+	ssize_t ret = readlinkat(dirfd, src, buf, size);
 	if (ret < 0)
 		die("readlink error: %m");
 
 	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+	free(buf);
 }
 
-static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
+static void copy_file(struct bch_fs *c, struct write_data_ring *ring,
+		      struct bch_inode_unpacked *dst,
 		      int src_fd, u64 src_size,
 		      char *src_path, ranges *extents)
 {
 	struct fiemap_iter iter;
 	struct fiemap_extent e;
+	u64 logical = 0, physical = 0, length = 0;
 
 	fiemap_for_each(src_fd, iter, e)
 		if (e.fe_flags & FIEMAP_EXTENT_UNKNOWN) {
+			fiemap_iter_exit(&iter);
 			fsync(src_fd);
 			break;
 		}
@@ -383,7 +632,7 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 				  FIEMAP_EXTENT_ENCODED|
 				  FIEMAP_EXTENT_NOT_ALIGNED|
 				  FIEMAP_EXTENT_DATA_INLINE)) {
-			copy_data(c, dst, src_fd, e.fe_logical,
+			copy_data(c, ring, dst, src_fd, e.fe_logical,
 				  min(src_size - e.fe_logical,
 				      e.fe_length));
 			continue;
@@ -394,7 +643,7 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		 * with bcachefs's potentially larger superblock:
 		 */
 		if (e.fe_physical < 1 << 20) {
-			copy_data(c, dst, src_fd, e.fe_logical,
+			copy_data(c, ring, dst, src_fd, e.fe_logical,
 				  min(src_size - e.fe_logical,
 				      e.fe_length));
 			continue;
@@ -403,34 +652,136 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		if ((e.fe_physical	& (block_bytes(c) - 1)))
 			die("Unaligned extent in %s - can't handle", src_path);
 
-		range_add(extents, e.fe_physical, e.fe_length);
-		link_data(c, dst, e.fe_logical, e.fe_physical, e.fe_length);
+		/* Merge runs that are contiguous on both sides: */
+		if (length &&
+		    logical + length == e.fe_logical &&
+		    physical + length == e.fe_physical) {
+			length += e.fe_length;
+			continue;
+		}
+
+		if (length) {
+			range_add(extents, physical, length);
+			link_data(c, dst, logical, physical, length);
+		}
+
+		logical		= e.fe_logical;
+		physical	= e.fe_physical;
+		length		= e.fe_length;
 	}
+
+	if (length) {
+		range_add(extents, physical, length);
+		link_data(c, dst, logical, physical, length);
+	}
+
+	/* the writes also update the inode, so finish them before we do: */
+	write_data_flush(ring);
 }
 
+/* hardlinks table entry for a file that's still being copied: */
+#define HARDLINK_IN_PROGRESS	U64_MAX
+
+/* A directory that's been created, and whose contents still need copying: */
+struct copy_dir_work {
+	char			*path;
+	struct bch_inode_unpacked inode;
+};
+
 struct copy_fs_state {
+	struct bch_fs		*c;
 	u64			bcachefs_inum;
 	dev_t			dev;
 
+	pthread_mutex_t		lock;
+	/* signalled when work is queued, a worker goes idle or a file is done: */
+	pthread_cond_t		wait;
+
+	DARRAY(struct copy_dir_work) dirs;
+	unsigned		nr_busy;
+
 	GENRADIX(u64)		hardlinks;
 	ranges			extents;
 };
 
-static void copy_dir(struct copy_fs_state *s,
-		     struct bch_fs *c,
+struct copy_fs_worker {
+	struct copy_fs_state	*s;
+	pthread_t		thread;
+	ranges			extents;
+	struct write_data_ring	ring;
+};
+
+static unsigned nr_copy_threads;
+
+static void copy_dir_queue(struct copy_fs_state *s, const char *path,
+			   struct bch_inode_unpacked *inode)
+{
+	struct copy_dir_work w = { .path = strdup(path), .inode = *inode };
+
+	pthread_mutex_lock(&s->lock);
+	if (!w.path || darray_push(&s->dirs, w))
+		die("insufficient memory");
+	/* not signal: hardlink_get() waits on this too */
+	pthread_cond_broadcast(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Returns the new inode number if another link to this file was already
+ * copied; otherwise, marks it as in progress and returns 0 - the caller then
+ * copies it, and publishes the new inode with hardlink_done():
+ */
+static u64 hardlink_get(struct copy_fs_state *s, ino_t ino)
+{
+	u64 *dst_inum, ret;
+
+	pthread_mutex_lock(&s->lock);
+	dst_inum = genradix_ptr_alloc(&s->hardlinks, ino, GFP_KERNEL);
+	if (!dst_inum)
+		die("insufficient memory");
+
+	/* links to it can't be created until the inode is written: */
+	while (*dst_inum == HARDLINK_IN_PROGRESS)
+		pthread_cond_wait(&s->wait, &s->lock);
+
+	ret = *dst_inum;
+	if (!ret)
+		*dst_inum = HARDLINK_IN_PROGRESS;
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+static void hardlink_done(struct copy_fs_state *s, ino_t ino, u64 inum)
+{
+	pthread_mutex_lock(&s->lock);
+	*genradix_ptr(&s->hardlinks, ino) = inum;
+	pthread_cond_broadcast(&s->wait);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Creates everything in a directory; subdirectories are queued, to be copied
+ * by whichever worker gets to them first. The worker that copies a directory
+ * owns its inode, and writes it out when it's done, since creating entries in
+ * it updates it.
+ */
+static void copy_dir(struct copy_fs_worker *worker,
 		     struct bch_inode_unpacked *dst,
-		     int src_fd, const char *src_path)
+		     const char *src_path)
 {
+	struct copy_fs_state *s = worker->s;
+	struct bch_fs *c = s->c;
+	int src_fd = xopen(src_path, O_RDONLY|O_NOATIME|O_DIRECTORY);
 	DIR *dir = fdopendir(src_fd);
 	struct dirent *d;
 
 	while ((errno = 0), (d = readdir(dir))) {
 		struct bch_inode_unpacked inode;
+		bool hardlinked, done;
+		u64 link_inum;
 		int fd;
 
-		if (fchdir(src_fd))
-			die("chdir error: %m");
-
 		struct stat stat =
 			xfstatat(src_fd, d->d_name, AT_SYMLINK_NOFOLLOW);
 
@@ -445,45 +796,41 @@ static void copy_dir(struct copy_fs_state *s,
 		if (stat.st_dev != s->dev)
 			die("%s does not have correct st_dev!", child_path);
 
-		u64 *dst_inum = S_ISREG(stat.st_mode)
-			? genradix_ptr_alloc(&s->hardlinks, stat.st_ino, GFP_KERNEL)
-			: NULL;
+		hardlinked = S_ISREG(stat.st_mode) && stat.st_nlink > 1;
+		link_inum = hardlinked ? hardlink_get(s, stat.st_ino) : 0;
 
-		if (dst_inum && *dst_inum) {
-			create_link(c, dst, d->d_name, *dst_inum, S_IFREG);
+		if (link_inum) {
+			create_link(c, dst, d->d_name, link_inum, S_IFREG);
 			goto next;
 		}
 
-		inode = create_file(c, dst, d->d_name,
-				    stat.st_uid, stat.st_gid,
-				    stat.st_mode, stat.st_rdev);
+		/* no data to copy, and the inode isn't updated later: */
+		done = !S_ISDIR(stat.st_mode) &&
+			!S_ISLNK(stat.st_mode) &&
+			!(S_ISREG(stat.st_mode) && stat.st_size);
 
-		if (dst_inum)
-			*dst_inum = inode.bi_inum;
-
-		copy_times(c, &inode, &stat);
-		copy_xattrs(c, &inode, d->d_name);
-
-		/* copy xattrs */
+		inode = create_file_xattrs(c, dst, d->d_name, child_path,
+					   &stat, done);
 
 		switch (mode_to_type(stat.st_mode)) {
 		case DT_DIR:
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_dir(s, c, &inode, fd, child_path);
-			close(fd);
-			break;
+			copy_dir_queue(s, child_path, &inode);
+			goto next;
 		case DT_REG:
+			if (done)
+				break;
+
 			inode.bi_size = stat.st_size;
 
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_file(c, &inode, fd, stat.st_size,
-				  child_path, &s->extents);
+			fd = xopenat(src_fd, d->d_name, O_RDONLY|O_NOATIME);
+			copy_file(c, &worker->ring, &inode, fd, stat.st_size,
+				  child_path, &worker->extents);
 			close(fd);
 			break;
 		case DT_LNK:
 			inode.bi_size = stat.st_size;
 
-			copy_link(c, &inode, d->d_name);
+			copy_link(c, &inode, src_fd, d->d_name);
 			break;
 		case DT_FIFO:
 		case DT_CHR:
@@ -496,13 +843,54 @@ static void copy_dir(struct copy_fs_state *s,
 			BUG();
 		}
 
-		update_inode(c, &inode);
+		if (!done)
+			update_inode(c, &inode);
+
+		if (hardlinked)
+			hardlink_done(s, stat.st_ino, inode.bi_inum);
 next:
 		free(child_path);
 	}
 
 	if (errno)
 		die("readdir error: %m");
+
+	closedir(dir);
+
+	update_inode(c, dst);
+}
+
+static void *copy_fs_thread(void *arg)
+{
+	struct copy_fs_worker *worker = arg;
+	struct copy_fs_state *s = worker->s;
+	struct copy_dir_work w;
+
+	sched_thread_init();
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		while (!s->dirs.nr && s->nr_busy)
+			pthread_cond_wait(&s->wait, &s->lock);
+
+		if (!s->dirs.nr)
+			break;
+
+		w = s->dirs.data[--s->dirs.nr];
+		s->nr_busy++;
+		pthread_mutex_unlock(&s->lock);
+
+		copy_dir(worker, &w.inode, w.path);
+		free(w.path);
+
+		pthread_mutex_lock(&s->lock);
+		if (!--s->nr_busy)
+			pthread_cond_broadcast(&s->wait);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	write_data_ring_exit(&worker->ring);
+	return NULL;
 }
 
 static ranges reserve_new_fs_space(const char *file_path, unsigned block_size,
@@ -583,26 +971,46 @@ static void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 	if (ret)
 		die("error looking up root directory: %s", strerror(-ret));
 
-	if (fchdir(src_fd))
-		die("chdir error: %m");
-
 	struct stat stat = xfstat(src_fd);
 	copy_times(c, &root_inode, &stat);
-	copy_xattrs(c, &root_inode, ".");
+	copy_xattrs(c, &root_inode, (char *) src_path);
 
 	struct copy_fs_state s = {
+		.c		= c,
 		.bcachefs_inum	= bcachefs_inum,
 		.dev		= stat.st_dev,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wait		= PTHREAD_COND_INITIALIZER,
 		.extents	= *extents,
 	};
+	unsigned i, nr_threads = nr_copy_threads ?: get_nprocs();
+	struct copy_fs_worker *workers = xcalloc(nr_threads, sizeof(*workers));
+	struct range *r;
 
 	/* now, copy: */
-	copy_dir(&s, c, &root_inode, src_fd, src_path);
+	copy_dir_queue(&s, src_path, &root_inode);
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].s = &s;
+		if (pthread_create(&workers[i].thread, NULL,
+				   copy_fs_thread, &workers[i]))
+			die("pthread_create error: %m");
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+
+		darray_for_each(workers[i].extents, r)
+			range_add(&s.extents, r->start, r->end - r->start);
+		darray_exit(&workers[i].extents);
+	}
+	free(workers);
 
 	reserve_old_fs_space(c, &root_inode, &s.extents);
 
 	update_inode(c, &root_inode);
 
+	darray_exit(&s.dirs);
 	darray_exit(&s.extents);
 	genradix_free(&s.hardlinks);
 }
@@ -640,6 +1048,10 @@ static void migrate_usage(void)
 	     "      --encrypted        Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase    Don't encrypt master encryption key\n"
 	     "  -F                     Force, even if metadata file already exists\n"
+	     "      --write_buffers=N  Number of 1MiB writes to keep in flight when\n"
+	     "                         copying data, per thread (default 8)\n"
+	     "      --threads=N        Number of threads copying the directory tree\n"
+	     "                         (default: number of CPUs)\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
@@ -647,6 +1059,8 @@ static void migrate_usage(void)
 static const struct option migrate_opts[] = {
 	{ "encrypted",		no_argument, NULL, 'e' },
 	{ "no_passphrase",	no_argument, NULL, 'p' },
+	{ "write_buffers",	required_argument, NULL, 'w' },
+	{ "threads",		required_argument, NULL, 't' },
 	{ NULL }
 };
 
@@ -768,6 +1182,16 @@ int cmd_migrate(int argc, char *argv[])
 		case 'p':
 			no_passphrase = true;
 			break;
+		case 'w':
+			if (kstrtouint(optarg, 10, &nr_write_data_bufs) ||
+			    !nr_write_data_bufs)
+				die("invalid number of write buffers %s", optarg);
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_copy_threads) ||
+			    !nr_copy_threads)
+				die("invalid number of threads %s", optarg);
+			break;
 		case 'F':
 			force = true;
 			break;
@@ -14,6 +14,7 @@
 
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/bcachefs_ioctl.h"
+#include "libbcachefs/darray.h"
 #include "cmds.h"
 #include "libbcachefs.h"
 #include "libbcachefs/opts.h"
@@ -33,10 +34,83 @@ int subvolume_usage(void)
 	return 0;
 }
 
+/*
+ * Paths are batched up into a single ioctl per run of paths on the same
+ * filesystem:
+ */
+struct subvolume_batch {
+	bool			create;
+	dev_t			dev;
+	struct bchfs_handle	fs;
+	DARRAY(struct bch_ioctl_subvolume) entries;
+};
+
+static void subvolume_batch_flush(struct subvolume_batch *b)
+{
+	struct bch_ioctl_subvolume_batch arg = {
+		.nr		= b->entries.nr,
+		.entries	= (unsigned long) b->entries.data,
+	};
+	struct bch_ioctl_subvolume *i;
+
+	if (!b->entries.nr)
+		return;
+
+	if (ioctl(b->fs.ioctl_fd, b->create
+		  ? BCH_IOCTL_SUBVOLUME_CREATE_BATCH
+		  : BCH_IOCTL_SUBVOLUME_DESTROY_BATCH, &arg)) {
+		if (errno != ENOTTY)
+			die("error %s %s: %m",
+			    b->create ? "creating" : "deleting",
+			    (char *) (unsigned long)
+			    b->entries.data[arg.nr_done].dst_ptr);
+
+		/* Kernel without the batch ioctls: */
+		darray_for_each(b->entries, i)
+			xioctl(b->fs.ioctl_fd, b->create
+			       ? BCH_IOCTL_SUBVOLUME_CREATE
+			       : BCH_IOCTL_SUBVOLUME_DESTROY, i);
+	}
+
+	bcache_fs_close(b->fs);
+	b->entries.nr = 0;
+}
+
+static void subvolume_batch_add(struct subvolume_batch *b, unsigned flags,
+				char *src, char *dst)
+{
+	char *dir = dirname(strdup(dst));
+	struct stat st = xstat(dir);
+
+	if (b->entries.nr && st.st_dev != b->dev)
+		subvolume_batch_flush(b);
+
+	if (!b->entries.nr) {
+		b->fs	= bcache_fs_open(dir);
+		b->dev	= st.st_dev;
+	}
+	free(dir);
+
+	if (darray_push(&b->entries, ((struct bch_ioctl_subvolume) {
+			.flags		= flags,
+			.dirfd		= AT_FDCWD,
+			.mode		= 0777,
+			.src_ptr	= (unsigned long) src,
+			.dst_ptr	= (unsigned long) dst,
+		})))
+		die("error allocating memory");
+}
+
+static void subvolume_batch_exit(struct subvolume_batch *b)
+{
+	subvolume_batch_flush(b);
+	darray_exit(&b->entries);
+}
+
 static void subvolume_create_usage(void)
 {
 	puts("bcachefs subvolume create - create a new subvolume\n"
-	     "Usage: bcachefs subvolume create [OPTION]... path\n"
+	     "Usage: bcachefs subvolume create [OPTION]... path...\n"
 	     "\n"
 	     "Options:\n"
 	     "  -h, --help                  Display this help and exit\n"
@@ -61,20 +135,11 @@ int cmd_subvolume_create(int argc, char *argv[])
 		}
 	args_shift(optind);
 
-	while ((path = arg_pop())) {
-		char *dir = dirname(strdup(path));
+	struct subvolume_batch b = { .create = true };
 
-		struct bchfs_handle fs = bcache_fs_open(dir);
-
-		struct bch_ioctl_subvolume i = {
-			.dirfd		= AT_FDCWD,
-			.mode		= 0777,
-			.dst_ptr	= (unsigned long)path,
-		};
-
-		xioctl(fs.ioctl_fd, BCH_IOCTL_SUBVOLUME_CREATE, &i);
-		bcache_fs_close(fs);
-	}
+	while ((path = arg_pop()))
+		subvolume_batch_add(&b, 0, NULL, path);
+	subvolume_batch_exit(&b);
 
 	return 0;
 }
@@ -82,7 +147,7 @@ int cmd_subvolume_create(int argc, char *argv[])
 static void subvolume_delete_usage(void)
 {
 	puts("bcachefs subvolume delete - delete an existing subvolume\n"
-	     "Usage: bcachefs subvolume delete [OPTION]... path\n"
+	     "Usage: bcachefs subvolume delete [OPTION]... path...\n"
 	     "\n"
 	     "Options:\n"
 	     "  -h, --help                  Display this help and exit\n"
@@ -107,20 +172,11 @@ int cmd_subvolume_delete(int argc, char *argv[])
 		}
 	args_shift(optind);
 
-	while ((path = arg_pop())) {
-		char *dir = dirname(strdup(path));
-
-		struct bchfs_handle fs = bcache_fs_open(dir);
+	struct subvolume_batch b = { .create = false };
 
-		struct bch_ioctl_subvolume i = {
-			.dirfd		= AT_FDCWD,
-			.mode		= 0777,
-			.dst_ptr	= (unsigned long)path,
-		};
-
-		xioctl(fs.ioctl_fd, BCH_IOCTL_SUBVOLUME_DESTROY, &i);
-		bcache_fs_close(fs);
-	}
+	while ((path = arg_pop()))
+		subvolume_batch_add(&b, 0, NULL, path);
+	subvolume_batch_exit(&b);
 
 	return 0;
 }
@@ -134,31 +190,75 @@ static void snapshot_create_usage(void)
 	     "if not specified the snapshot will be of the subvolme containing <dest>.\n"
 	     "Options:\n"
 	     "  -r                          Make snapshot read only\n"
+	     "  -f, --file=FILE             Create every snapshot listed in FILE (- for\n"
+	     "                              stdin), one \"[<source>] <dest>\" per line\n"
 	     "  -h, --help                  Display this help and exit\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
+static void snapshot_create_list(const char *list, unsigned flags)
+{
+	struct subvolume_batch b = { .create = true };
+	FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+	char *line = NULL;
+	size_t n = 0;
+
+	if (!f)
+		die("error opening %s: %m", list);
+
+	while (getline(&line, &n, f) != -1) {
+		char *src = strtok(line, " \t\n");
+		char *dst = strtok(NULL, " \t\n");
+
+		if (!src)
+			continue;
+		if (!dst)
+			swap(src, dst);
+
+		/* entries point into these strings until the batch is flushed: */
+		subvolume_batch_add(&b, flags, src ? strdup(src) : NULL, strdup(dst));
+	}
+
+	if (f != stdin)
+		fclose(f);
+	free(line);
+
+	subvolume_batch_exit(&b);
+}
+
 int cmd_subvolume_snapshot(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
+		{ "file",		required_argument,	NULL, 'f' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	unsigned flags = BCH_SUBVOL_SNAPSHOT_CREATE;
+	const char *list = NULL;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "rh", longopts, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "rf:h", longopts, NULL)) != -1)
 		switch (opt) {
 		case 'r':
 			flags |= BCH_SUBVOL_SNAPSHOT_RO;
 			break;
+		case 'f':
+			list = optarg;
+			break;
 		case 'h':
 			snapshot_create_usage();
 			exit(EXIT_SUCCESS);
 		}
 	args_shift(optind);
 
+	if (list) {
+		if (argc)
+			die("Too many arguments");
+		snapshot_create_list(list, flags);
+		return 0;
+	}
+
 	char *src = arg_pop();
 	char *dst = arg_pop();
 
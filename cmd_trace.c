@@ -0,0 +1,178 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+#include "libbcachefs/darray.h"
+#include "linux/sort.h"
+#include "linux/tracepoint.h"
+
+static void trace_usage(void)
+{
+	puts("bcachefs trace - decode a tracepoint dump\n"
+	     "Usage: bcachefs trace [OPTION]... <file>\n"
+	     "\n"
+	     "Any bcachefs command run with BCACHEFS_TRACE=file in the environment\n"
+	     "records tracepoints into per thread ring buffers, and writes them to\n"
+	     "file when it exits; BCACHEFS_TRACE_EVENTS=event,... records only\n"
+	     "some events, and BCACHEFS_TRACE_BUF=size sets the size of each\n"
+	     "buffer (default 1M).\n"
+	     "\n"
+	     "Options:\n"
+	     "  -e event,...  Only print these events\n"
+	     "  -t tid        Only print events from this thread\n"
+	     "  -l            List events\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+struct trace_record {
+	u64			time;
+	u32			tid;
+	struct trace_event	*event;
+	const void		*data;
+};
+
+static int trace_record_cmp(const void *_l, const void *_r)
+{
+	const struct trace_record *l = _l, *r = _r;
+
+	return cmp_int(l->time, r->time) ?: cmp_int(l->tid, r->tid);
+}
+
+int cmd_trace(int argc, char *argv[])
+{
+	DARRAY(struct trace_record) records = { 0 };
+	struct trace_event **events, *e;
+	struct trace_file_hdr *hdr;
+	struct trace_file_event *fe;
+	struct trace_record *r;
+	struct printbuf buf = PRINTBUF;
+	char *filter = NULL;
+	u32 filter_tid = 0;
+	void *p, *end;
+	size_t len;
+	unsigned i;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "e:t:lh")) != -1)
+		switch (opt) {
+		case 'e':
+			filter = optarg;
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &filter_tid))
+				die("invalid thread id %s", optarg);
+			break;
+		case 'l':
+			for (e = trace_event_first(); e; e = e->next)
+				puts(e->name);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			trace_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (argc != 1)
+		die("Please supply a trace file");
+
+	fd = xopen(argv[0], O_RDONLY);
+	len = xfstat(fd).st_size;
+	p = xmalloc(len);
+	xpread(fd, p, len, 0);
+	close(fd);
+	end = p + len;
+
+	hdr = p;
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TRACE_FILE_MAGIC, sizeof(hdr->magic)))
+		die("%s: not a trace file", argv[0]);
+	if (hdr->version != TRACE_FILE_VERSION)
+		die("%s: unknown version %u", argv[0], hdr->version);
+
+	/* Map event ids in the file to our events, by name: */
+	events = xcalloc(U16_MAX + 1, sizeof(*events));
+	fe = (void *) (hdr + 1);
+	if ((void *) (fe + hdr->nr_events) > end)
+		die("%s: truncated", argv[0]);
+
+	for (i = 0; i < hdr->nr_events; i++, fe++) {
+		fe->name[sizeof(fe->name) - 1] = '\0';
+
+		e = trace_event_find(fe->name);
+		if (!e)
+			fprintf(stderr, "unknown event %s\n", fe->name);
+		else if (e->size != fe->size)
+			fprintf(stderr, "event %s: size mismatch, trace from a different build?\n",
+				fe->name);
+		else if (fe->id <= U16_MAX)
+			events[fe->id] = e;
+	}
+
+	if (filter) {
+		for (e = trace_event_first(); e; e = e->next)
+			e->enabled = false;
+		if (trace_events_enable(filter))
+			die("invalid event list %s", filter);
+	}
+
+	p = fe;
+	while (p + sizeof(struct trace_file_buf) <= end) {
+		struct trace_file_buf *b = p;
+		void *b_end;
+
+		p += sizeof(*b);
+		b_end = p + b->bytes;
+		if (b_end > end)
+			die("%s: truncated", argv[0]);
+
+		while (p + sizeof(struct trace_entry) <= b_end) {
+			struct trace_entry *t = p;
+
+			if (t->len < sizeof(*t) || p + t->len > b_end)
+				die("%s: corrupt record", argv[0]);
+
+			e = events[t->event];
+			if (e &&
+			    (!filter || e->enabled) &&
+			    (!filter_tid || b->tid == filter_tid) &&
+			    darray_push(&records, ((struct trace_record) {
+					.time	= t->time,
+					.tid	= b->tid,
+					.event	= e,
+					.data	= t + 1,
+				})))
+				die("error allocating memory");
+
+			p += t->len;
+		}
+		p = b_end;
+	}
+
+	sort(records.data, records.nr, sizeof(records.data[0]),
+	     trace_record_cmp, NULL);
+
+	darray_for_each(records, r) {
+		u64 t = r->time - records.data[0].time;
+
+		printbuf_reset(&buf);
+		r->event->print(&buf, r->data);
+
+		printf("%8u %6llu.%06llu: %s: %s\n",
+		       r->tid,
+		       t / NSEC_PER_SEC,
+		       (t % NSEC_PER_SEC) / NSEC_PER_USEC,
+		       r->event->name, buf.buf);
+	}
+
+	printbuf_exit(&buf);
+	darray_exit(&records);
+	free(events);
+	free(hdr);
+	return 0;
+}
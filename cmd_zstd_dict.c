@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zdict.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/darray.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
+
+static void zstd_dict_usage(void)
+{
+	puts("bcachefs zstd-dict - train a zstd dictionary for small extents\n"
+	     "Usage: bcachefs zstd-dict [OPTION]... <devices>\n"
+	     "\n"
+	     "Samples existing extents on an unmounted filesystem, trains a zstd\n"
+	     "dictionary on them and stores it in the superblock; extents\n"
+	     "compressed with zstd then use it when the zstd_dict option is set.\n"
+	     "A filesystem has at most one dictionary, and it can't be replaced\n"
+	     "once installed.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s size       Dictionary size (default 16k)\n"
+	     "  -m size       Only sample extents up to this size (default 64k)\n"
+	     "  -n size       Total size of the samples (default 100 times the\n"
+	     "                dictionary size)\n"
+	     "  -o file       Write the dictionary to a file, instead of\n"
+	     "                installing it\n"
+	     "  -i file       Install the dictionary from a file, instead of\n"
+	     "                training one\n"
+	     "  -h            Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+struct zstd_dict_samples {
+	void			*buf;
+	size_t			used;
+	size_t			size;
+	DARRAY(size_t)		sizes;
+};
+
+static void sample_add(struct zstd_dict_samples *s, size_t len)
+{
+	if (darray_push(&s->sizes, len))
+		die("error allocating memory");
+	s->used += len;
+}
+
+/*
+ * Read the encoded extent directly from the device, and decompress it if
+ * needed: we only want the live part of the extent.
+ */
+static void sample_extent(struct bch_fs *c, struct zstd_dict_samples *s,
+			  struct bkey_s_c k)
+{
+	struct extent_ptr_decoded pick;
+	struct bch_dev *ca;
+	size_t live = k.k->size << 9;
+	size_t encoded;
+	void *buf, *dst = s->buf + s->used;
+
+	if (bch2_bkey_pick_read_device(c, k, NULL, &pick) <= 0)
+		return;
+
+	if (bch2_csum_type_is_encryption(pick.crc.csum_type))
+		return;
+
+	ca = bch_dev_bkey_exists(c, pick.ptr.dev);
+	if (!ca->disk_sb.bdev)
+		return;
+
+	encoded = pick.crc.compressed_size << 9;
+
+	if (!crc_is_compressed(pick.crc)) {
+		xpread(ca->disk_sb.bdev->bd_buffered_fd, dst, live,
+		       (pick.ptr.offset + pick.crc.offset) << 9);
+		sample_add(s, live);
+		return;
+	}
+
+	buf = xmalloc(encoded);
+	xpread(ca->disk_sb.bdev->bd_buffered_fd, buf, encoded,
+	       pick.ptr.offset << 9);
+
+	struct bio *src = bio_kmalloc(buf_pages(buf, encoded), GFP_KERNEL);
+	struct bio *bio = bio_kmalloc(buf_pages(dst, live), GFP_KERNEL);
+
+	bch2_bio_map(src, buf, encoded);
+	bch2_bio_map(bio, dst, live);
+
+	if (!bch2_bio_uncompress(c, src, bio, bio->bi_iter, pick.crc))
+		sample_add(s, live);
+
+	kfree(bio);
+	kfree(src);
+	free(buf);
+}
+
+static void sample_inline_data(struct zstd_dict_samples *s, struct bkey_s_c k)
+{
+	struct bkey_s_c_inline_data d = bkey_s_c_to_inline_data(k);
+	size_t len = bkey_val_bytes(d.k);
+
+	memcpy(s->buf + s->used, d.v->data, len);
+	sample_add(s, len);
+}
+
+static void zstd_dict_sample(struct bch_fs *c, struct zstd_dict_samples *s,
+			     size_t max_extent)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_extents, POS_MIN,
+			   BTREE_ITER_ALL_SNAPSHOTS|
+			   BTREE_ITER_PREFETCH, k, ret) {
+		size_t len = k.k->size << 9;
+
+		if (s->used + max_extent > s->size)
+			break;
+
+		if (len > max_extent)
+			continue;
+
+		if (k.k->type == KEY_TYPE_extent)
+			sample_extent(c, s, k);
+		else if (k.k->type == KEY_TYPE_inline_data)
+			sample_inline_data(s, k);
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+
+	bch2_trans_exit(&trans);
+
+	if (ret)
+		die("error walking extents: %s", bch2_err_str(ret));
+}
+
+static void *zstd_dict_train(char **devs, unsigned nr_devs,
+			     size_t dict_size, size_t max_extent,
+			     size_t samples_size, size_t *len)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct zstd_dict_samples s = { .size = samples_size };
+	void *dict;
+	size_t ret;
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+
+	struct bch_fs *c = bch2_fs_open(devs, nr_devs, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", devs[0], bch2_err_str(PTR_ERR(c)));
+
+	max_extent = min_t(size_t, max_extent, c->opts.encoded_extent_max);
+	s.buf = xmalloc(s.size);
+
+	zstd_dict_sample(c, &s, max_extent);
+	bch2_fs_stop(c);
+
+	printf("sampled %zu extents, %zu bytes\n", s.sizes.nr, s.used);
+
+	dict = xmalloc(dict_size);
+	ret = ZDICT_trainFromBuffer(dict, dict_size, s.buf,
+				    s.sizes.data, s.sizes.nr);
+	if (ZDICT_isError(ret))
+		die("error training dictionary: %s", ZDICT_getErrorName(ret));
+
+	darray_exit(&s.sizes);
+	free(s.buf);
+
+	*len = ret;
+	return dict;
+}
+
+static void zstd_dict_install(char **devs, unsigned nr_devs,
+			      void *dict, size_t len)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_sb_field_zstd_dict *d;
+	unsigned dict_id = ZDICT_getDictID(dict, len);
+
+	if (!dict_id)
+		die("not a zstd dictionary, or dictionary has no id");
+
+	opt_set(opts, nostart, true);
+
+	/*
+	 * bch2_fs_open(), not just reading the superblock, so that every member
+	 * device is updated:
+	 */
+	struct bch_fs *c = bch2_fs_open(devs, nr_devs, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", devs[0], bch2_err_str(PTR_ERR(c)));
+
+	mutex_lock(&c->sb_lock);
+	d = bch2_sb_get_zstd_dict(c->disk_sb.sb);
+	if (d && le32_to_cpu(d->dict_id) == dict_id) {
+		mutex_unlock(&c->sb_lock);
+		bch2_fs_stop(c);
+		printf("dictionary %u already installed\n", dict_id);
+		return;
+	}
+
+	/*
+	 * Extents already compressed with the old dictionary reference it by
+	 * id, and we only keep one - replacing it would make them unreadable:
+	 */
+	if (d)
+		die("filesystem already has dictionary %u; replacing it would make data compressed with it unreadable",
+		    le32_to_cpu(d->dict_id));
+
+	d = bch2_sb_resize_zstd_dict(&c->disk_sb,
+			DIV_ROUND_UP(sizeof(*d) + len, sizeof(u64)));
+	if (!d)
+		die("error resizing superblock: dictionary too big?");
+
+	d->dict_id	= cpu_to_le32(dict_id);
+	d->dict_len	= cpu_to_le32(len);
+	memcpy(d->data, dict, len);
+
+	c->disk_sb.sb->features[0] |= cpu_to_le64(1ULL << BCH_FEATURE_zstd_dict);
+	SET_BCH_SB_ZSTD_DICT(c->disk_sb.sb, true);
+
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+
+	bch2_fs_stop(c);
+
+	printf("installed dictionary %u, %zu bytes\n", dict_id, len);
+}
+
+int cmd_zstd_dict(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "size",		required_argument,	NULL, 's' },
+		{ "max-extent",		required_argument,	NULL, 'm' },
+		{ "samples",		required_argument,	NULL, 'n' },
+		{ "output",		required_argument,	NULL, 'o' },
+		{ "input",		required_argument,	NULL, 'i' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *output = NULL, *input = NULL;
+	u64 dict_size = 16 << 10, max_extent = 64 << 10, samples_size = 0;
+	void *dict;
+	size_t len;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:m:n:o:i:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			if (bch2_strtou64_h(optarg, &dict_size) || !dict_size)
+				die("invalid dictionary size %s", optarg);
+			break;
+		case 'm':
+			if (bch2_strtou64_h(optarg, &max_extent) || !max_extent)
+				die("invalid extent size %s", optarg);
+			break;
+		case 'n':
+			if (bch2_strtou64_h(optarg, &samples_size))
+				die("invalid samples size %s", optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'h':
+			zstd_dict_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (input) {
+		int fd = xopen(input, O_RDONLY);
+
+		len = xfstat(fd).st_size;
+		dict = xmalloc(len);
+		xpread(fd, dict, len, 0);
+		close(fd);
+	} else {
+		dict = zstd_dict_train(argv, argc, dict_size,
+				       max_extent,
+				       samples_size ?: dict_size * 100,
+				       &len);
+	}
+
+	if (output) {
+		int fd = xopen(output, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+		xpwrite(fd, dict, len, 0, "dictionary");
+		close(fd);
+	} else {
+		zstd_dict_install(argv, argc, dict, len);
+	}
+
+	free(dict);
+	return 0;
+}
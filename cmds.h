@@ -22,6 +22,7 @@ int cmd_stop(int argc, char *argv[]);
 
 int fs_usage(void);
 int cmd_fs_usage(int argc, char *argv[]);
+int cmd_fs_counters(int argc, char *argv[]);
 
 int device_usage(void);
 int cmd_device_add(int argc, char *argv[]);
@@ -32,9 +33,13 @@ int cmd_device_evacuate(int argc, char *argv[]);
 int cmd_device_set_state(int argc, char *argv[]);
 int cmd_device_resize(int argc, char *argv[]);
 int cmd_device_resize_journal(int argc, char *argv[]);
+int cmd_device_stats(int argc, char *argv[]);
 
 int data_usage(void);
 int cmd_data_rereplicate(int argc, char *argv[]);
+int cmd_data_defrag(int argc, char *argv[]);
+int cmd_data_scrub(int argc, char *argv[]);
+int cmd_data_dedupe(int argc, char *argv[]);
 int cmd_data_job(int argc, char *argv[]);
 
 int cmd_unlock(int argc, char *argv[]);
@@ -47,6 +52,8 @@ int cmd_dump(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
 int cmd_kill_btree_node(int argc, char *argv[]);
+int cmd_bench(int argc, char *argv[]);
+int cmd_trace(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
@@ -55,6 +62,8 @@ int cmd_version(int argc, char *argv[]);
 
 int cmd_setattr(int argc, char *argv[]);
 
+int cmd_zstd_dict(int argc, char *argv[]);
+
 int subvolume_usage(void);
 int cmd_subvolume_create(int argc, char *argv[]);
 int cmd_subvolume_delete(int argc, char *argv[]);
@@ -101,6 +101,72 @@ struct bch_key derive_passphrase(struct bch_sb_field_crypt *crypt,
 	return key;
 }
 
+/*
+ * The KDF salt is fixed, so the derived key depends only on the passphrase and
+ * the KDF parameters - filesystems sharing a passphrase share it too. With a
+ * nonzero @ttl we cache it in the keyring, as a user key
+ * "bcachefs-kdf:type:N:R:P" that times out after @ttl seconds, so unlocking
+ * them back to back only runs the KDF once.
+ *
+ * A cached key is only used if it decrypts @sb's key; otherwise we run the KDF,
+ * and cache the result if the passphrase was correct:
+ */
+struct bch_key derive_passphrase_cached(struct bch_sb *sb,
+					const char *passphrase,
+					int keyring, unsigned ttl)
+{
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
+	struct bch_key key;
+	key_serial_t id;
+
+	if (!crypt)
+		die("filesystem is not encrypted");
+
+	if (!ttl)
+		return derive_passphrase(crypt, passphrase);
+
+	char *description = mprintf("bcachefs-kdf:%llu:%llu:%llu:%llu",
+				    BCH_CRYPT_KDF_TYPE(crypt),
+				    BCH_KDF_SCRYPT_N(crypt),
+				    BCH_KDF_SCRYPT_R(crypt),
+				    BCH_KDF_SCRYPT_P(crypt));
+
+	id = keyctl_search(keyring, "user", description, 0);
+	if (id > 0 &&
+	    keyctl_read(id, (void *) &key, sizeof(key)) == sizeof(key) &&
+	    bch2_passphrase_key_valid(sb, &key))
+		goto out;
+
+	key = derive_passphrase(crypt, passphrase);
+
+	if (!bch2_passphrase_key_valid(sb, &key))
+		goto out;
+
+	/* Not fatal, the next unlock just runs the KDF again: */
+	id = add_key("user", description, &key, sizeof(key), keyring);
+	if (id < 0) {
+		fprintf(stderr, "error caching derived key: %m\n");
+	} else if (keyctl_set_timeout(id, ttl)) {
+		fprintf(stderr, "error setting derived key timeout: %m\n");
+		keyctl_invalidate(id);
+	}
+out:
+	free(description);
+	return key;
+}
+
+int bch2_keyring_parse(const char *keyring_str)
+{
+	if (!strcmp(keyring_str, "session"))
+		return KEY_SPEC_SESSION_KEYRING;
+	else if (!strcmp(keyring_str, "user"))
+		return KEY_SPEC_USER_KEYRING;
+	else if (!strcmp(keyring_str, "user_session"))
+		return KEY_SPEC_USER_SESSION_KEYRING;
+	else
+		die("unknown keyring %s", keyring_str);
+}
+
 bool bch2_sb_is_encrypted(struct bch_sb *sb)
 {
 	struct bch_sb_field_crypt *crypt;
@@ -109,9 +175,28 @@ bool bch2_sb_is_encrypted(struct bch_sb *sb)
 		bch2_key_is_encrypted(&crypt->key);
 }
 
-void bch2_passphrase_check(struct bch_sb *sb, const char *passphrase,
-			   struct bch_key *passphrase_key,
-			   struct bch_encrypted_key *sb_key)
+/* Returns true if @passphrase_key decrypts the superblock's encryption key: */
+bool bch2_passphrase_key_valid(struct bch_sb *sb, struct bch_key *passphrase_key)
+{
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
+	struct bch_encrypted_key sb_key;
+	bool ret;
+
+	if (!crypt || !bch2_key_is_encrypted(&crypt->key))
+		return false;
+
+	sb_key = crypt->key;
+	ret = !bch2_chacha_encrypt_key(passphrase_key, __bch2_sb_key_nonce(sb),
+				       &sb_key, sizeof(sb_key)) &&
+		!bch2_key_is_encrypted(&sb_key);
+
+	memzero_explicit(&sb_key, sizeof(sb_key));
+	return ret;
+}
+
+static void passphrase_key_check(struct bch_sb *sb,
+				 struct bch_key *passphrase_key,
+				 struct bch_encrypted_key *sb_key)
 {
 	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
 	if (!crypt)
@@ -122,8 +207,6 @@ void bch2_passphrase_check(struct bch_sb *sb, const char *passphrase,
 	if (!bch2_key_is_encrypted(sb_key))
 		die("filesystem does not have encryption key");
 
-	*passphrase_key = derive_passphrase(crypt, passphrase);
-
 	/* Check if the user supplied the correct passphrase: */
 	if (bch2_chacha_encrypt_key(passphrase_key, __bch2_sb_key_nonce(sb),
 				    sb_key, sizeof(*sb_key)))
@@ -133,27 +216,45 @@ void bch2_passphrase_check(struct bch_sb *sb, const char *passphrase,
 		die("incorrect passphrase");
 }
 
+void bch2_passphrase_check(struct bch_sb *sb, const char *passphrase,
+			   struct bch_key *passphrase_key,
+			   struct bch_encrypted_key *sb_key)
+{
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
+	if (!crypt)
+		die("filesystem is not encrypted");
+
+	*passphrase_key = derive_passphrase(crypt, passphrase);
+
+	passphrase_key_check(sb, passphrase_key, sb_key);
+}
+
 void bch2_add_key(struct bch_sb *sb,
 		  const char *type,
 		  const char *keyring_str,
 		  const char *passphrase)
 {
+	struct bch_sb_field_crypt *crypt = bch2_sb_get_crypt(sb);
 	struct bch_key passphrase_key;
-	struct bch_encrypted_key sb_key;
-	int keyring;
 
-	if (!strcmp(keyring_str, "session"))
-		keyring = KEY_SPEC_SESSION_KEYRING;
-	else if (!strcmp(keyring_str, "user"))
-		keyring = KEY_SPEC_USER_KEYRING;
-	else if (!strcmp(keyring_str, "user_session"))
-		keyring = KEY_SPEC_USER_SESSION_KEYRING;
-	else
-		die("unknown keyring %s", keyring_str);
+	if (!crypt)
+		die("filesystem is not encrypted");
 
-	bch2_passphrase_check(sb, passphrase,
-			      &passphrase_key,
-			      &sb_key);
+	passphrase_key = derive_passphrase(crypt, passphrase);
+	bch2_add_key_derived(sb, type, keyring_str, &passphrase_key);
+	memzero_explicit(&passphrase_key, sizeof(passphrase_key));
+}
+
+/* Like bch2_add_key(), with the key already derived from the passphrase: */
+void bch2_add_key_derived(struct bch_sb *sb,
+			  const char *type,
+			  const char *keyring_str,
+			  struct bch_key *passphrase_key)
+{
+	struct bch_encrypted_key sb_key;
+	int keyring = bch2_keyring_parse(keyring_str);
+
+	passphrase_key_check(sb, passphrase_key, &sb_key);
 
 	char uuid[40];
 	uuid_unparse_lower(sb->user_uuid.b, uuid);
@@ -162,13 +263,12 @@ void bch2_add_key(struct bch_sb *sb,
 
 	if (add_key(type,
 		    description,
-		    &passphrase_key, sizeof(passphrase_key),
+		    passphrase_key, sizeof(*passphrase_key),
 		    keyring) < 0)
 		die("add_key error: %m");
 
 	memzero_explicit(description, strlen(description));
 	free(description);
-	memzero_explicit(&passphrase_key, sizeof(passphrase_key));
 	memzero_explicit(&sb_key, sizeof(sb_key));
 }
 
@@ -12,10 +12,16 @@ char *read_passphrase(const char *);
 char *read_passphrase_twice(const char *);
 
 struct bch_key derive_passphrase(struct bch_sb_field_crypt *, const char *);
+struct bch_key derive_passphrase_cached(struct bch_sb *,
+					const char *, int, unsigned);
+int bch2_keyring_parse(const char *);
 bool bch2_sb_is_encrypted(struct bch_sb *);
+bool bch2_passphrase_key_valid(struct bch_sb *, struct bch_key *);
 void bch2_passphrase_check(struct bch_sb *, const char *,
 			   struct bch_key *, struct bch_encrypted_key *);
 void bch2_add_key(struct bch_sb *, const char *, const char *, const char *);
+void bch2_add_key_derived(struct bch_sb *, const char *, const char *,
+			  struct bch_key *);
 void bch_sb_crypt_init(struct bch_sb *sb, struct bch_sb_field_crypt *,
 		       const char *);
 
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Common values for the GHASH hash function
+ */
+
+#ifndef _CRYPTO_GHASH_H
+#define _CRYPTO_GHASH_H
+
+#include <linux/types.h>
+#include <linux/crypto.h>
+
+#define GHASH_BLOCK_SIZE	16
+#define GHASH_DIGEST_SIZE	16
+
+#endif
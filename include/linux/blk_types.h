@@ -41,6 +41,10 @@ struct block_device {
 	int			bd_fd;
 	int			bd_sync_fd;
 	int			bd_buffered_fd;
+	int			bd_uring_idx;
+	sector_t		bd_zone_sectors;
+	struct blkdev_aio	*bd_aio;
+	struct blkdev_nvme	*bd_nvme;
 };
 
 #define bdev_kobj(_bdev) (&((_bdev)->kobj))
@@ -112,6 +116,11 @@ struct bio {
 	struct bio_vec		bi_inline_vecs[0];
 };
 
+struct bio_list {
+	struct bio *head;
+	struct bio *tail;
+};
+
 #define BIO_RESET_BYTES		offsetof(struct bio, bi_max_vecs)
 
 /*
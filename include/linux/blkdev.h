@@ -10,9 +10,16 @@
 
 typedef unsigned fmode_t;
 
-struct bio;
 struct user_namespace;
 
+struct blk_plug {
+	struct bio_list		bios;
+	unsigned		nr;
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+
 #define MINORBITS	20
 #define MINORMASK	((1U << MINORBITS) - 1)
 
@@ -71,6 +78,19 @@ static inline void submit_bio(struct bio *bio)
 
 int blkdev_issue_discard(struct block_device *, sector_t, sector_t, gfp_t);
 
+/*
+ * Zoned devices: sectors per zone, or 0 for a conventional device; resetting
+ * a zone rewinds its write pointer so it can be written again.
+ */
+sector_t bdev_zone_sectors(struct block_device *);
+int blkdev_zone_mgmt(struct block_device *, enum req_opf,
+		     sector_t, sector_t, gfp_t);
+
+static inline bool bdev_is_zoned(struct block_device *bdev)
+{
+	return bdev_zone_sectors(bdev) != 0;
+}
+
 #define bdev_get_queue(bdev)		(&((bdev)->queue))
 
 #ifndef SECTOR_SHIFT
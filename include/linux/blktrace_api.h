@@ -0,0 +1,42 @@
+#ifndef __TOOLS_LINUX_BLKTRACE_API_H
+#define __TOOLS_LINUX_BLKTRACE_API_H
+
+#include <linux/blk_types.h>
+
+/* As the kernel's, minus readahead: at most 5 characters, and the nul */
+static inline void blk_fill_rwbs(char *rwbs, unsigned int op)
+{
+	int i = 0;
+
+	if (op & REQ_PREFLUSH)
+		rwbs[i++] = 'F';
+
+	switch (op & REQ_OP_MASK) {
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+		rwbs[i++] = 'W';
+		break;
+	case REQ_OP_DISCARD:
+		rwbs[i++] = 'D';
+		break;
+	case REQ_OP_FLUSH:
+		rwbs[i++] = 'F';
+		break;
+	case REQ_OP_READ:
+		rwbs[i++] = 'R';
+		break;
+	default:
+		rwbs[i++] = 'N';
+	}
+
+	if (op & REQ_FUA)
+		rwbs[i++] = 'F';
+	if (op & REQ_SYNC)
+		rwbs[i++] = 'S';
+	if (op & REQ_META)
+		rwbs[i++] = 'M';
+
+	rwbs[i] = '\0';
+}
+
+#endif /* __TOOLS_LINUX_BLKTRACE_API_H */
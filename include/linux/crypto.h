@@ -31,6 +31,7 @@ struct crypto_alg {
 
 	const char		*cra_name;
 	const struct crypto_type *cra_type;
+	int			cra_priority;
 
 	void *			(*alloc_tfm)(void);
 } CRYPTO_MINALIGN_ATTR;
@@ -132,8 +132,14 @@
 
 #define might_sleep()
 
-#define cpu_relax()		do {} while (0)
-#define cpu_relax_lowlatency()	do {} while (0)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()		asm volatile("yield" ::: "memory")
+#else
+#define cpu_relax()		barrier()
+#endif
+#define cpu_relax_lowlatency()	cpu_relax()
 
 #define panic(fmt, ...)					\
 do {							\
@@ -16,6 +16,9 @@ struct page;
 #define PAGE_SHIFT 12
 #endif
 
+#define HPAGE_SHIFT		21
+#define HPAGE_SIZE		(1UL << HPAGE_SHIFT)
+
 
 #define virt_to_page(p)							\
 	((struct page *) (((unsigned long) (p)) & PAGE_MASK))
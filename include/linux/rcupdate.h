@@ -9,7 +9,10 @@
 #define rcu_dereference_protected(p, c)	rcu_dereference(p)
 #define rcu_access_pointer(p)		READ_ONCE(p)
 
-#define kfree_rcu(ptr, rcu_head)	kfree(ptr) /* XXX */
+void __kfree_rcu(void *);
+
+#define kfree_rcu(ptr, rcu_head)	__kfree_rcu(ptr)
+#define kvfree_rcu(ptr, ...)		__kfree_rcu(ptr)
 
 #define RCU_INIT_POINTER(p, v)		WRITE_ONCE(p, v)
 
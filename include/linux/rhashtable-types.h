@@ -77,6 +77,10 @@ struct rhashtable_params {
  * @mutex: Mutex to protect current/future table swapping
  * @lock: Spin lock to protect walker list
  * @nelems: Number of elements in table
+ * @nr_resizes: Number of completed resizes
+ * @nr_rehash_lazy: Chains moved to the new table by inserts, not the worker
+ * @resize_time_total: Total time tables have spent being resized, in ns
+ * @resize_time_max: Longest resize, in ns
  */
 struct rhashtable {
 	struct bucket_table __rcu	*tbl;
@@ -88,6 +92,11 @@ struct rhashtable {
 	struct mutex                    mutex;
 	spinlock_t			lock;
 	atomic_t			nelems;
+
+	unsigned int			nr_resizes;
+	atomic_t			nr_rehash_lazy;
+	u64				resize_time_total;
+	u64				resize_time_max;
 };
 
 /**
@@ -84,6 +84,8 @@ struct bucket_table {
 	struct rcu_head		rcu;
 
 	struct bucket_table __rcu *future_tbl;
+	/* when this table was attached as a future_tbl: */
+	u64			resize_start;
 
 	struct rhash_lock_head __rcu *buckets[] ____cacheline_aligned_in_smp;
 };
@@ -262,6 +264,9 @@ void rhashtable_free_and_destroy(struct rhashtable *ht,
 				 void *arg);
 void rhashtable_destroy(struct rhashtable *ht);
 
+struct printbuf;
+void rhashtable_stats_to_text(struct printbuf *out, struct rhashtable *ht);
+
 struct rhash_lock_head __rcu **rht_bucket_nested(
 	const struct bucket_table *tbl, unsigned int hash);
 struct rhash_lock_head __rcu **__rht_bucket_nested(
@@ -7,6 +7,7 @@
 #include <linux/bug.h>
 #include <linux/completion.h>
 #include <linux/jiffies.h>
+#include <linux/rcupdate.h>
 #include <linux/rwsem.h>
 #include <linux/time64.h>
 
@@ -93,10 +94,15 @@ struct task_struct {
 	struct signal_struct	{
 		struct rw_semaphore exec_update_lock;
 	}			*signal, _signal;
+
+	/* lock owners are dereferenced under RCU by optimistic spinners: */
+	struct rcu_head		rcu;
 };
 
 extern __thread struct task_struct *current;
 
+void sched_thread_init(void);
+
 #define __set_task_state(tsk, state_value)		\
 	do { (tsk)->state = (state_value); } while (0)
 #define set_task_state(tsk, state_value)		\
@@ -1,6 +1,7 @@
 #ifndef __TOOLS_LINUX_SHRINKER_H
 #define __TOOLS_LINUX_SHRINKER_H
 
+#include <linux/compiler.h>
 #include <linux/list.h>
 #include <linux/types.h>
 
@@ -27,6 +28,14 @@ struct shrinker {
 int register_shrinker(struct shrinker *, const char *, ...);
 void unregister_shrinker(struct shrinker *);
 
-void run_shrinkers(gfp_t gfp_mask, bool);
+extern long shrinker_want_shrink;
+void __run_shrinkers(gfp_t gfp_mask, bool);
+
+static inline void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
+{
+	if ((gfp_mask & GFP_KERNEL) &&
+	    (allocation_failed || READ_ONCE(shrinker_want_shrink) > 0))
+		__run_shrinkers(gfp_mask, allocation_failed);
+}
 
 #endif /* __TOOLS_LINUX_SHRINKER_H */
@@ -219,4 +219,7 @@ struct six_lock_count {
 
 struct six_lock_count six_lock_counts(struct six_lock *);
 
+struct printbuf;
+void six_lock_contention_to_text(struct printbuf *);
+
 #endif /* _LINUX_SIX_H */
@@ -45,6 +45,17 @@ static inline void *krealloc(void *old, size_t size, gfp_t flags)
 {
 	void *new;
 
+	/*
+	 * Reuse the old allocation if it's big enough and suitably aligned -
+	 * unless we were asked to zero, since we don't know the old size:
+	 */
+	if (old && size && !(flags & __GFP_ZERO) &&
+	    malloc_usable_size(old) >= size &&
+	    IS_ALIGNED((unsigned long) old,
+		       max(sizeof(void *),
+			   min(rounddown_pow_of_two(size), (size_t) PAGE_SIZE))))
+		return old;
+
 	new = kmalloc(size, flags);
 	if (!new)
 		return NULL;
@@ -90,6 +101,26 @@ static inline void *krealloc_array(void *p, size_t new_n, size_t new_size, gfp_t
 #define kvzalloc(size, flags)		kzalloc(size, flags)
 #define kvfree(p)			kfree(p)
 
+/*
+ * Big allocations - bucket arrays and the like - are hugepage aligned, and we
+ * ask for them to be backed by transparent hugepages: gc and the allocator walk
+ * them from one end to the other, which with 4k pages is mostly TLB misses.
+ */
+static inline void *__page_alloc(size_t size)
+{
+	void *p;
+
+	if (size < HPAGE_SIZE)
+		return aligned_alloc(PAGE_SIZE, size);
+
+	if (posix_memalign(&p, HPAGE_SIZE, size))
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(p, size & ~(HPAGE_SIZE - 1), MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
 static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
 {
 	size_t size = PAGE_SIZE << order;
@@ -99,7 +130,7 @@ static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
 	do {
 		run_shrinkers(flags, i != 0);
 
-		p = aligned_alloc(PAGE_SIZE, size);
+		p = __page_alloc(size);
 		if (p && (flags & __GFP_ZERO))
 			memset(p, 0, size);
 	} while (!p && i++ < 10);
@@ -157,36 +188,28 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
-struct kmem_cache {
-	size_t		    obj_size;
-};
+#define SLAB_HWCACHE_ALIGN		(1UL << 13)
+#define SLAB_RECLAIM_ACCOUNT		(1UL << 17)
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
+struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
+				     unsigned long, void (*)(void *));
+void kmem_cache_destroy(struct kmem_cache *);
+int kmem_cache_shrink(struct kmem_cache *);
 
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	kfree(p);
-}
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
 
-static inline void kmem_cache_destroy(struct kmem_cache *p)
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
 {
-	kfree(p);
+	return kmem_cache_alloc(c, gfp|__GFP_ZERO);
 }
 
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
-{
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
-
-	p->obj_size = obj_size;
-	return p;
-}
+#define KMEM_CACHE(_struct, _flags)					\
+	kmem_cache_create(#_struct, sizeof(struct _struct),		\
+			  __alignof__(struct _struct), (_flags), NULL)
 
-#define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
+struct printbuf;
+void slabinfo_to_text(struct printbuf *);
 
 #define PAGE_KERNEL		0
 #define PAGE_KERNEL_EXEC	1
@@ -203,7 +226,7 @@ static inline void *__vmalloc(unsigned long size, gfp_t gfp_mask)
 	do {
 		run_shrinkers(gfp_mask, i != 0);
 
-		p = aligned_alloc(PAGE_SIZE, size);
+		p = __page_alloc(size);
 		if (p && gfp_mask & __GFP_ZERO)
 			memset(p, 0, size);
 	} while (!p && i++ < 10);
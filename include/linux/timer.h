@@ -2,11 +2,14 @@
 #define __TOOLS_LINUX_TIMER_H
 
 #include <string.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 struct timer_list {
+	struct list_head	entry;
 	unsigned long		expires;
 	void			(*function)(struct timer_list *timer);
+	unsigned		idx;
 	bool			pending;
 };
 
@@ -0,0 +1,29 @@
+#ifndef __TOOLS_LINUX_TOPOLOGY_H
+#define __TOOLS_LINUX_TOPOLOGY_H
+
+#include <linux/cpumask.h>
+
+#define NUMA_NO_NODE	(-1)
+
+/*
+ * NUMA nodes are read from sysfs, on first use (see linux/topology.c): without
+ * sysfs, or on a single node machine, there's one node and binding to it is a
+ * noop.
+ *
+ * Userspace memory is placed by first touch, so to get node local memory we
+ * place the threads: workqueue workers are bound to the node they serve, and
+ * each block device's completion thread to the node the device is attached
+ * to.
+ */
+unsigned num_online_nodes(void);
+int cpu_to_node(unsigned);
+
+static inline int numa_node_id(void)
+{
+	return cpu_to_node(raw_smp_processor_id());
+}
+
+struct task_struct;
+int set_cpus_allowed_node(struct task_struct *, int);
+
+#endif /* __TOOLS_LINUX_TOPOLOGY_H */
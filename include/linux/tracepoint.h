@@ -1,12 +1,93 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+/*
+ * Userspace tracepoints:
+ *
+ * TRACE_EVENT() and DEFINE_EVENT() declare an event that, when enabled, copies
+ * its TP_STRUCT__entry into a per thread ring buffer (see linux/tracepoint.c);
+ * the buffers are written out at exit and decoded with "bcachefs trace".
+ * Disabled events cost one predictable branch.
+ *
+ * The events are defined - the assign and print functions, and the struct
+ * trace_event - by trace/define_trace.h, in the file that defines
+ * CREATE_TRACE_POINTS.
+ */
+
+struct printbuf;
+
+struct trace_event {
+	const char		*name;
+	unsigned		size;
+	void			(*print)(struct printbuf *, const void *);
+
+	/* set at registration: */
+	unsigned		id;
+	bool			enabled;
+	struct trace_event	*next;
+};
+
+struct trace_event *trace_event_first(void);
+struct trace_event *trace_event_find(const char *);
+void trace_event_register(struct trace_event *);
+
+void *trace_event_reserve(struct trace_event *, unsigned);
+void trace_event_commit(void);
+
+int trace_events_enable(const char *);
+int trace_dump(const char *);
+
+/*
+ * Trace file format, written by trace_dump(): a header, nr_events event
+ * descriptors, then for each thread a trace_file_buf followed by that many
+ * bytes of trace_entry records, oldest first, each padded to
+ * TRACE_ENTRY_ALIGN.
+ */
+#define TRACE_FILE_MAGIC	"BCHTRACE"
+#define TRACE_FILE_VERSION	1
+#define TRACE_ENTRY_ALIGN	16
+
+struct trace_file_hdr {
+	char			magic[8];
+	__u32			version;
+	__u32			nr_events;
+};
+
+struct trace_file_event {
+	__u32			id;
+	__u32			size;
+	char			name[56];
+};
+
+struct trace_file_buf {
+	__u32			tid;
+	__u32			pad;
+	__u64			bytes;
+};
+
+struct trace_entry {
+	__u64			time;
+	__u16			event;	/* 0: padding */
+	__u16			len;	/* including this header */
+	__u32			pad;
+};
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
 #define TP_ARGS(args...)	args
 #define TP_CONDITION(args...)	args
 
+#define TP_STRUCT__entry(args...)	args
+#define TP_fast_assign(args...)		args
+#define TP_printk(fmt, args...)		fmt, ##args
+
+#define __field(type, item)		type	item;
+#define __array(type, item, len)	type	item[len];
+
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
 	static inline void trace_##name(proto)				\
 	{ }								\
@@ -49,14 +130,37 @@
 			PARAMS(void *__data, proto),			\
 			PARAMS(__data, args))
 
-#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
-#define DEFINE_EVENT(template, name, proto, args)		\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	struct trace_event_raw_##name {					\
+		tstruct							\
+	};								\
+	void trace_event_raw_event_##name(struct trace_event *, proto);
+
+#define DEFINE_EVENT(template, name, proto, args)			\
+	extern struct trace_event event_##name;				\
+	static inline bool						\
+	trace_##name##_enabled(void)					\
+	{								\
+		return unlikely(READ_ONCE(event_##name.enabled));	\
+	}								\
+	static inline void trace_##name(proto)				\
+	{								\
+		if (trace_##name##_enabled())				\
+			trace_event_raw_event_##template(&event_##name, args);\
+	}								\
+	static inline void trace_##name##_rcuidle(proto)		\
+	{								\
+		trace_##name(args);					\
+	}
+
 #define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
 #define DEFINE_EVENT_PRINT(template, name, proto, args, print)	\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
-#define TRACE_EVENT(name, proto, args, struct, assign, print)	\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)	\
+	DECLARE_EVENT_CLASS(name, PARAMS(proto), PARAMS(args),	\
+			    PARAMS(tstruct), PARAMS(assign),	\
+			    PARAMS(print))			\
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
 
 #endif /* __TOOLS_LINUX_TRACEPOINT_H */
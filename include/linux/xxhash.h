@@ -256,4 +256,101 @@ void xxh32_copy_state(struct xxh32_state *dst, const struct xxh32_state *src);
  */
 void xxh64_copy_state(struct xxh64_state *dst, const struct xxh64_state *src);
 
+/*-****************************
+ * XXH3
+ *****************************/
+
+/*
+ * XXH3 is the newer xxHash family: much faster than xxh64 on both short and
+ * long inputs, with 64 and 128 bit variants. Hash values are the same as
+ * upstream xxHash's XXH3_64bits_withSeed() and XXH3_128bits_withSeed().
+ */
+
+/**
+ * struct xxh128_hash - a 128 bit xxh3 hash value
+ */
+struct xxh128_hash {
+	uint64_t low64;
+	uint64_t high64;
+};
+
+/**
+ * xxh3_64() - calculate the 64-bit xxh3 hash of the input with a given seed.
+ *
+ * @input:  The data to hash.
+ * @length: The length of the data to hash.
+ * @seed:   The seed can be used to alter the result predictably.
+ *
+ * Return:  The 64-bit hash of the data.
+ */
+uint64_t xxh3_64(const void *input, size_t length, uint64_t seed);
+
+/**
+ * xxh3_128() - calculate the 128-bit xxh3 hash of the input with a given seed.
+ *
+ * @input:  The data to hash.
+ * @length: The length of the data to hash.
+ * @seed:   The seed can be used to alter the result predictably.
+ *
+ * Return:  The 128-bit hash of the data.
+ */
+struct xxh128_hash xxh3_128(const void *input, size_t length, uint64_t seed);
+
+#define XXH3_SECRET_SIZE	192
+#define XXH3_BUFFER_SIZE	256
+
+/**
+ * struct xxh3_state - private xxh3 state, do not use members directly
+ *
+ * The same state gives either the 64 or the 128 bit hash.
+ */
+struct xxh3_state {
+	uint64_t acc[8];
+	uint8_t secret[XXH3_SECRET_SIZE];
+	uint8_t buffer[XXH3_BUFFER_SIZE];
+	uint64_t total_len;
+	uint64_t seed;
+	uint32_t buffered;
+	uint32_t nr_stripes;
+};
+
+/**
+ * xxh3_reset() - reset the xxh3 state to start a new hashing operation
+ *
+ * @state: The xxh3 state to reset.
+ * @seed:  Initialize the hash state with this seed.
+ */
+void xxh3_reset(struct xxh3_state *state, uint64_t seed);
+
+/**
+ * xxh3_update() - hash the data given and update the xxh3 state
+ *
+ * @state:  The xxh3 state to update.
+ * @input:  The data to hash.
+ * @length: The length of the data to hash.
+ *
+ * Return:  Zero on success, otherwise an error code.
+ */
+int xxh3_update(struct xxh3_state *state, const void *input, size_t length);
+
+/**
+ * xxh3_64_digest() - produce the current 64-bit xxh3 hash
+ *
+ * @state: Produce the current xxh3 hash of this state.
+ *
+ * The state is not modified, so more data can be hashed afterwards.
+ *
+ * Return: The 64-bit xxh3 hash created from the input data.
+ */
+uint64_t xxh3_64_digest(const struct xxh3_state *state);
+
+/**
+ * xxh3_128_digest() - produce the current 128-bit xxh3 hash
+ *
+ * @state: Produce the current xxh3 hash of this state.
+ *
+ * Return: The 128-bit xxh3 hash created from the input data.
+ */
+struct xxh128_hash xxh3_128_digest(const struct xxh3_state *state);
+
 #endif /* XXHASH_H */
@@ -180,6 +180,58 @@ zstd_cctx *zstd_init_cctx(void *workspace, size_t workspace_size);
 size_t zstd_compress_cctx(zstd_cctx *cctx, void *dst, size_t dst_capacity,
 	const void *src, size_t src_size, const zstd_parameters *parameters);
 
+/* ======   Single-pass Dictionary Compression   ====== */
+
+/**
+ * struct zstd_custom_mem - custom memory allocation
+ * @customAlloc:  Allocation function, called with (opaque, size).
+ * @customFree:   Free function, called with (opaque, address).
+ * @opaque:       Passed to the functions above.
+ *
+ * See zstd_lib.h.
+ */
+typedef ZSTD_customMem zstd_custom_mem;
+
+typedef ZSTD_CDict zstd_cdict;
+
+/**
+ * zstd_create_cdict_byreference() - create a compression dictionary
+ * @dict:        The dictionary contents. Must outlive the returned dictionary.
+ * @dict_size:   The size of the dictionary.
+ * @cparams:     The compression parameters to be used with the dictionary.
+ * @custom_mem:  Allocator for the dictionary's tables.
+ *
+ * Return:       A digested dictionary or NULL on error.
+ */
+zstd_cdict *zstd_create_cdict_byreference(const void *dict, size_t dict_size,
+	zstd_compression_parameters cparams, zstd_custom_mem custom_mem);
+
+/**
+ * zstd_free_cdict() - free a compression dictionary
+ * @cdict:  The dictionary to free, may be NULL.
+ */
+void zstd_free_cdict(zstd_cdict *cdict);
+
+/**
+ * zstd_compress_using_cdict() - compress src into dst with a dictionary
+ * @cctx:         The context. Must have been initialized with zstd_init_cctx(),
+ *                with a workspace large enough for the dictionary's
+ *                compression parameters.
+ * @dst:          The buffer to compress src into.
+ * @dst_capacity: The size of the destination buffer.
+ * @src:          The data to compress.
+ * @src_size:     The size of the data to compress.
+ * @cdict:        The dictionary, determining the compression parameters.
+ *
+ * The dictionary ID is recorded in the frame header.
+ *
+ * Return:        The compressed size or an error, which can be checked using
+ *                zstd_is_error().
+ */
+size_t zstd_compress_using_cdict(zstd_cctx *cctx, void *dst,
+	size_t dst_capacity, const void *src, size_t src_size,
+	const zstd_cdict *cdict);
+
 /* ======   Single-pass Decompression   ====== */
 
 typedef ZSTD_DCtx zstd_dctx;
@@ -220,6 +272,43 @@ zstd_dctx *zstd_init_dctx(void *workspace, size_t workspace_size);
 size_t zstd_decompress_dctx(zstd_dctx *dctx, void *dst, size_t dst_capacity,
 	const void *src, size_t src_size);
 
+/* ======   Single-pass Dictionary Decompression   ====== */
+
+typedef ZSTD_DDict zstd_ddict;
+
+/**
+ * zstd_create_ddict_byreference() - create a decompression dictionary
+ * @dict:        The dictionary contents. Must outlive the returned dictionary.
+ * @dict_size:   The size of the dictionary.
+ * @custom_mem:  Allocator for the dictionary's tables.
+ *
+ * Return:       A digested dictionary or NULL on error.
+ */
+zstd_ddict *zstd_create_ddict_byreference(const void *dict, size_t dict_size,
+	zstd_custom_mem custom_mem);
+
+/**
+ * zstd_free_ddict() - free a decompression dictionary
+ * @ddict:  The dictionary to free, may be NULL.
+ */
+void zstd_free_ddict(zstd_ddict *ddict);
+
+/**
+ * zstd_decompress_using_ddict() - decompress src into dst with a dictionary
+ * @dctx:         The decompression context.
+ * @dst:          The buffer to decompress src into.
+ * @dst_capacity: The size of the destination buffer.
+ * @src:          The zstd compressed data to decompress.
+ * @src_size:     The exact size of the data to decompress.
+ * @ddict:        The dictionary the data was compressed with.
+ *
+ * Return:        The decompressed size or an error, which can be checked using
+ *                zstd_is_error().
+ */
+size_t zstd_decompress_using_ddict(zstd_dctx *dctx, void *dst,
+	size_t dst_capacity, const void *src, size_t src_size,
+	const zstd_ddict *ddict);
+
 /* ======   Streaming Buffers   ====== */
 
 /**
@@ -0,0 +1,59 @@
+/*
+ * Included at the end of a trace events header: if the including file defined
+ * CREATE_TRACE_POINTS, read the header a second time with the event macros
+ * redefined to emit the definitions - assign and print functions, and the
+ * struct trace_event for each event.
+ */
+
+#ifdef CREATE_TRACE_POINTS
+
+/* Prevent recursion */
+#undef CREATE_TRACE_POINTS
+
+#include <linux/printbuf.h>
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	void trace_event_raw_event_##name(struct trace_event *event, proto)\
+	{								\
+		struct trace_event_raw_##name *__entry =		\
+			trace_event_reserve(event, sizeof(*__entry));	\
+									\
+		if (!__entry)						\
+			return;						\
+		{ assign; }						\
+		trace_event_commit();					\
+	}								\
+									\
+	static void trace_event_print_##name(struct printbuf *out,	\
+					     const void *p)		\
+	{								\
+		const struct trace_event_raw_##name *__entry = p;	\
+									\
+		prt_printf(out, print);					\
+	}
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(_template, _name, proto, args)			\
+	struct trace_event event_##_name = {				\
+		.name	= #_name,					\
+		.size	= sizeof(struct trace_event_raw_##_template),	\
+		.print	= trace_event_print_##_template,			\
+	};								\
+									\
+	__attribute__((constructor(110)))				\
+	static void trace_event_register_##_name(void)			\
+	{								\
+		trace_event_register(&event_##_name);			\
+	}
+
+#undef TRACE_INCLUDE
+#undef __TRACE_INCLUDE
+#define __TRACE_INCLUDE(system) <trace/events/system.h>
+#define TRACE_INCLUDE(system) __TRACE_INCLUDE(system)
+
+#define TRACE_HEADER_MULTI_READ
+#include TRACE_INCLUDE(TRACE_SYSTEM)
+#undef TRACE_HEADER_MULTI_READ
+
+#endif /* CREATE_TRACE_POINTS */
@@ -2,6 +2,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -64,8 +65,85 @@ static u64 min_size(unsigned bucket_size)
 	return BCH_MIN_NR_NBUCKETS * bucket_size;
 }
 
+/* Block device queue limits, from sysfs: */
+struct dev_queue_hints {
+	bool		rotational;
+	bool		zoned;
+	u64		zone_size;		/* bytes */
+	u64		optimal_io_size;	/* bytes */
+	u64		discard_granularity;	/* bytes */
+};
+
+static u64 queue_attr_u64(int dirfd, const char *attr)
+{
+	return dirfd >= 0 && !faccessat(dirfd, attr, R_OK, 0)
+		? read_file_u64(dirfd, attr)
+		: 0;
+}
+
+static struct dev_queue_hints dev_queue_hints(int fd)
+{
+	struct dev_queue_hints h = { 0 };
+	struct stat statbuf = xfstat(fd);
+	char *path, *zoned;
+	int dirfd;
+
+	if (!S_ISBLK(statbuf.st_mode))
+		return h;
+
+	/* Partitions don't have a queue directory, their parent does: */
+	path = mprintf("/sys/dev/block/%u:%u/queue",
+		       major(statbuf.st_rdev), minor(statbuf.st_rdev));
+	dirfd = open(path, O_RDONLY|O_DIRECTORY);
+	free(path);
+
+	if (dirfd < 0) {
+		path = mprintf("/sys/dev/block/%u:%u/../queue",
+			       major(statbuf.st_rdev), minor(statbuf.st_rdev));
+		dirfd = open(path, O_RDONLY|O_DIRECTORY);
+		free(path);
+	}
+
+	if (dirfd < 0)
+		return h;
+
+	h.rotational		= queue_attr_u64(dirfd, "rotational");
+	h.optimal_io_size	= queue_attr_u64(dirfd, "optimal_io_size");
+	h.discard_granularity	= queue_attr_u64(dirfd, "discard_granularity");
+
+	if (!faccessat(dirfd, "zoned", R_OK, 0)) {
+		zoned = read_file_str(dirfd, "zoned");
+		h.zoned = zoned && strcmp(zoned, "none");
+		free(zoned);
+	}
+
+	if (h.zoned)
+		h.zone_size = queue_attr_u64(dirfd, "chunk_sectors") << 9;
+
+	close(dirfd);
+	return h;
+}
+
+/*
+ * Round a bucket size up to a multiple of what the device would like us to
+ * write in, if the device is big enough:
+ */
+static u64 bucket_size_align(struct dev_opts *dev, u64 bucket_size, u64 hint)
+{
+	u64 aligned;
+
+	if (!hint || !is_power_of_2(hint) || hint > (u32) U16_MAX << 9)
+		return bucket_size;
+
+	aligned = round_up(bucket_size, hint);
+
+	return dev->size >= min_size(aligned) ? aligned : bucket_size;
+}
+
 void bch2_pick_bucket_size(struct bch_opts opts, struct dev_opts *dev)
 {
+	struct dev_queue_hints h = dev_queue_hints(dev->fd);
+
 	if (!dev->size)
 		dev->size = get_size(dev->path, dev->fd);
 
@@ -93,11 +171,39 @@ void bch2_pick_bucket_size(struct bch_opts opts, struct dev_opts *dev)
 
 			/* max bucket size 1 mb */
 			dev->bucket_size = min(dev->bucket_size * scale, 1ULL << 20);
+
+			/* Spinning disks want big buckets, for fewer seeks: */
+			if (h.rotational &&
+			    dev->size >= min_size(1ULL << 20))
+				dev->bucket_size = max(dev->bucket_size, 1ULL << 20);
 		} else {
 			do {
 				dev->bucket_size /= 2;
 			} while (dev->size < min_size(dev->bucket_size));
 		}
+
+		/*
+		 * Flash wants buckets that are a multiple of its erase block
+		 * size, which is as close as we get to it via
+		 * discard_granularity or optimal_io_size - otherwise, reusing
+		 * a bucket means the device has to copy data:
+		 */
+		dev->bucket_size = bucket_size_align(dev, dev->bucket_size,
+						     h.discard_granularity);
+		dev->bucket_size = bucket_size_align(dev, dev->bucket_size,
+						     h.optimal_io_size);
+
+		/* Zoned devices: one bucket per zone, when zones are small enough */
+		if (h.zoned) {
+			if (h.zone_size &&
+			    h.zone_size <= (u32) U16_MAX << 9 &&
+			    dev->size >= min_size(h.zone_size))
+				dev->bucket_size = h.zone_size;
+			else
+				fprintf(stderr, "%s: zone size %llu too big for a bucket, "
+					"picking bucket size without it\n",
+					dev->path, h.zone_size);
+		}
 	}
 
 	dev->nbuckets = dev->size / dev->bucket_size;
@@ -142,6 +248,43 @@ static unsigned parse_target(struct bch_sb_handle *sb,
 	return 0;
 }
 
+struct format_dev_write {
+	struct dev_opts		*dev;
+	struct bch_sb		*sb;
+	pthread_t		thread;
+};
+
+static void *format_dev_write_thread(void *arg)
+{
+	struct format_dev_write *w = arg;
+	struct dev_opts *i = w->dev;
+
+	/*
+	 * If we're not creating a superblock at the default offset we're being
+	 * run from the migrate tool, and the rest of the device has data on it:
+	 */
+	if (i->sb_offset == BCH_SB_SECTOR) {
+		/* Zero start of disk */
+		static const char zeroes[BCH_SB_SECTOR << 9];
+
+		/*
+		 * Discarding up front means nothing on the device will need
+		 * discarding until it's been written to:
+		 */
+		if ((i->discard || i->secure_discard) &&
+		    !discard_device(i->path, i->fd, i->size, i->secure_discard))
+			fprintf(stderr, "%s: discard not supported\n", i->path);
+
+		xpwrite(i->fd, zeroes, BCH_SB_SECTOR << 9, 0,
+			"zeroing start of disk");
+	}
+
+	bch2_super_write(i->fd, w->sb);
+	close(i->fd);
+	kfree(w->sb);
+	return NULL;
+}
+
 struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			   struct bch_opts	fs_opts,
 			   struct format_opts	opts,
@@ -151,8 +294,9 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 	struct bch_sb_handle sb = { NULL };
 	struct dev_opts *i;
 	struct bch_sb_field_members *mi;
+	struct format_dev_write *w;
 	unsigned max_dev_block_size = 0;
-	unsigned opt_id;
+	unsigned opt_id, j;
 
 	for (i = devs; i < devs + nr_devs; i++)
 		max_dev_block_size = max(max_dev_block_size,
@@ -276,9 +420,23 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			bch2_sb_resize_crypt(&sb, sizeof(*crypt) / sizeof(u64));
 
 		bch_sb_crypt_init(sb.sb, crypt, opts.passphrase);
-		SET_BCH_SB_ENCRYPTION_TYPE(sb.sb, 1);
+		SET_BCH_SB_ENCRYPTION_TYPE(sb.sb, opts.encryption_type);
+
+		if (opts.encryption_type == BCH_ENCRYPTION_aes256_gcm)
+			sb.sb->features[0] |=
+				cpu_to_le64(1ULL << BCH_FEATURE_aes256_gcm);
 	}
 
+	if (BCH_SB_META_CSUM_TYPE(sb.sb) == BCH_CSUM_OPT_xxh3 ||
+	    BCH_SB_META_CSUM_TYPE(sb.sb) == BCH_CSUM_OPT_xxh3_128 ||
+	    BCH_SB_DATA_CSUM_TYPE(sb.sb) == BCH_CSUM_OPT_xxh3 ||
+	    BCH_SB_DATA_CSUM_TYPE(sb.sb) == BCH_CSUM_OPT_xxh3_128 ||
+	    BCH_SB_STR_HASH_TYPE(sb.sb)  == BCH_STR_HASH_OPT_xxh3)
+		sb.sb->features[0] |=
+			cpu_to_le64(1ULL << BCH_FEATURE_xxh3);
+
+	w = xcalloc(nr_devs, sizeof(*w));
+
 	for (i = devs; i < devs + nr_devs; i++) {
 		u64 size_sectors = i->size >> 9;
 
@@ -308,17 +466,22 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			l->sb_offset[l->nr_superblocks++] = cpu_to_le64(backup_sb);
 		}
 
-		if (i->sb_offset == BCH_SB_SECTOR) {
-			/* Zero start of disk */
-			static const char zeroes[BCH_SB_SECTOR << 9];
+		w[i - devs] = (struct format_dev_write) {
+			.dev	= i,
+			.sb	= kmemdup(sb.sb, vstruct_bytes(sb.sb), GFP_KERNEL),
+		};
+		if (!w[i - devs].sb)
+			die("insufficient memory");
+	}
 
-			xpwrite(i->fd, zeroes, BCH_SB_SECTOR << 9, 0,
-				"zeroing start of disk");
-		}
+	/* Devices are discarded and written in parallel: */
+	for (j = 0; j < nr_devs; j++)
+		if (pthread_create(&w[j].thread, NULL, format_dev_write_thread, &w[j]))
+			die("pthread_create error: %m");
 
-		bch2_super_write(i->fd, sb.sb);
-		close(i->fd);
-	}
+	for (j = 0; j < nr_devs; j++)
+		pthread_join(w[j].thread, NULL);
+	free(w);
 
 	return sb.sb;
 }
@@ -685,7 +848,8 @@ void bch2_opts_usage(unsigned opt_types)
 
 dev_names bchu_fs_get_devices(struct bchfs_handle fs)
 {
-	DIR *dir = fdopendir(fs.sysfs_fd);
+	/* our own fd, so that closedir() doesn't close fs.sysfs_fd: */
+	DIR *dir = fdopendir(xopenat(fs.sysfs_fd, ".", O_RDONLY|O_DIRECTORY));
 	struct dirent *d;
 	dev_names devs;
 
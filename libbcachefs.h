@@ -36,6 +36,7 @@ struct format_opts {
 	unsigned	version;
 	unsigned	superblock_size;
 	bool		encrypted;
+	unsigned	encryption_type;
 	char		*passphrase;
 };
 
@@ -44,6 +45,7 @@ static inline struct format_opts format_opts_default()
 	return (struct format_opts) {
 		.version		= bcachefs_metadata_version_current,
 		.superblock_size	= SUPERBLOCK_SIZE_DEFAULT,
+		.encryption_type	= BCH_ENCRYPTION_chacha20_poly1305,
 	};
 }
 
@@ -56,6 +58,7 @@ struct dev_opts {
 	unsigned	data_allowed;
 	unsigned	durability;
 	bool		discard;
+	bool		secure_discard;
 
 	u64		nbuckets;
 
@@ -171,6 +174,35 @@ static inline struct bch_ioctl_dev_usage bchu_dev_usage(struct bchfs_handle fs,
 	return i;
 }
 
+/*
+ * Returns NULL if the kernel doesn't have BCH_IOCTL_FS_USAGE_COUNTERS:
+ */
+static inline struct bch_ioctl_fs_usage_counters *
+bchu_fs_usage_counters(struct bchfs_handle fs,
+		       struct bch_ioctl_fs_usage_counters *u)
+{
+	unsigned nr = u ? u->nr : 256;
+
+	while (1) {
+		u = xrealloc(u, sizeof(*u) + sizeof(u64) * nr);
+		memset(u, 0, sizeof(*u));
+		u->nr = nr;
+
+		if (!ioctl(fs.ioctl_fd, BCH_IOCTL_FS_USAGE_COUNTERS, u))
+			return u;
+
+		if (errno == ENOTTY) {
+			free(u);
+			return NULL;
+		}
+
+		if (errno != ERANGE)
+			die("BCH_IOCTL_FS_USAGE_COUNTERS error: %m");
+
+		nr = u->nr;
+	}
+}
+
 static inline struct bch_sb *bchu_read_super(struct bchfs_handle fs, unsigned idx)
 {
 	size_t size = 4096;
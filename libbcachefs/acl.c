@@ -216,23 +216,33 @@ struct posix_acl *bch2_get_acl(struct inode *vinode, int type, bool rcu)
 {
 	struct bch_inode_info *inode = to_bch_ei(vinode);
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
-	struct bch_hash_info hash = bch2_hash_info_init(c, &inode->ei_inode);
 	struct btree_trans trans;
 	struct btree_iter iter = { NULL };
 	struct bkey_s_c_xattr xattr;
 	struct posix_acl *acl = NULL;
 	struct bkey_s_c k;
+	u8 inline_buf[BCH_INODE_XATTRS_INLINE_MAX];
 	int ret;
 
 	if (rcu)
 		return ERR_PTR(-ECHILD);
 
+	ret = bch2_xattr_get_inline(inode, "", 0, inline_buf,
+				    sizeof(inline_buf), acl_to_xattr_type(type));
+	if (ret != -EAGAIN) {
+		acl = ret >= 0	? bch2_acl_from_disk(inline_buf, ret)
+			: ret == -ENODATA ? NULL : ERR_PTR(ret);
+		if (!IS_ERR(acl))
+			set_cached_acl(&inode->v, type, acl);
+		return acl;
+	}
+
 	bch2_trans_init(&trans, c, 0, 0);
 retry:
 	bch2_trans_begin(&trans);
 
 	ret = bch2_hash_lookup(&trans, &iter, bch2_xattr_hash_desc,
-			&hash, inode_inum(inode),
+			&inode->ei_str_hash, inode_inum(inode),
 			&X_SEARCH(acl_to_xattr_type(type), "", 0),
 			0);
 	if (ret) {
@@ -281,12 +291,19 @@ int bch2_set_acl_trans(struct btree_trans *trans, subvol_inum inum,
 
 		ret = bch2_hash_set(trans, bch2_xattr_hash_desc, &hash_info,
 				    inum, &xattr->k_i, 0);
+		if (!ret)
+			bch2_inode_xattr_inline_set(inode_u, xattr->v.x_type, "", 0,
+					xattr_val(&xattr->v),
+					le16_to_cpu(xattr->v.x_val_len));
 	} else {
 		struct xattr_search_key search =
 			X_SEARCH(acl_to_xattr_type(type), "", 0);
 
 		ret = bch2_hash_delete(trans, bch2_xattr_hash_desc, &hash_info,
 				       inum, &search);
+		if (!ret || ret == -ENOENT)
+			bch2_inode_xattr_inline_set(inode_u, acl_to_xattr_type(type),
+						    "", 0, NULL, 0);
 	}
 
 	return ret == -ENOENT ? 0 : ret;
@@ -394,6 +411,10 @@ int bch2_acl_chmod(struct btree_trans *trans, subvol_inum inum,
 
 	new->k.p = iter.pos;
 	ret = bch2_trans_update(trans, &iter, &new->k_i, 0);
+	if (!ret)
+		bch2_inode_xattr_inline_set(inode, new->v.x_type, "", 0,
+					    xattr_val(&new->v),
+					    le16_to_cpu(new->v.x_val_len));
 	*new_acl = acl;
 	acl = NULL;
 err:
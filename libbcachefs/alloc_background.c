@@ -15,6 +15,8 @@
 #include "debug.h"
 #include "ec.h"
 #include "error.h"
+#include "io.h"
+#include "keylist.h"
 #include "lru.h"
 #include "recovery.h"
 #include "varint.h"
@@ -513,19 +515,120 @@ struct bkey_i_alloc_v4 *bch2_alloc_to_v4_mut(struct btree_trans *trans, struct b
 	return ret;
 }
 
-int bch2_alloc_read(struct bch_fs *c)
+/*
+ * Parallel walks of the alloc btree:
+ *
+ * Each device's buckets are split into up to ALLOC_WALK_RANGES_PER_DEV ranges,
+ * and each range is walked by its own work item, with its own btree_trans.
+ */
+#define ALLOC_WALK_RANGES_PER_DEV	8
+#define ALLOC_WALK_RANGE_MIN		(1ULL << 16)
+
+struct alloc_walk;
+
+struct alloc_walk_range {
+	struct work_struct	work;
+	struct alloc_walk	*w;
+	struct bpos		start;
+	struct bpos		end;
+};
+
+struct alloc_walk {
+	struct bch_fs		*c;
+	const char		*msg;
+	int			(*fn)(struct btree_trans *, struct bpos,
+				      struct bpos, atomic64_t *);
+
+	DARRAY(struct alloc_walk_range) ranges;
+	u64			nr;
+	atomic64_t		done;
+	atomic_t		nr_running;
+	wait_queue_head_t	wait;
+	int			ret;
+};
+
+static void alloc_walk_work(struct work_struct *work)
 {
+	struct alloc_walk_range *r =
+		container_of(work, struct alloc_walk_range, work);
+	struct alloc_walk *w = r->w;
 	struct btree_trans trans;
+	int ret;
+
+	bch2_trans_init(&trans, w->c, 0, 0);
+	ret = w->fn(&trans, r->start, r->end, &w->done);
+	bch2_trans_exit(&trans);
+
+	if (ret)
+		cmpxchg(&w->ret, 0, ret);
+
+	if (atomic_dec_and_test(&w->nr_running))
+		wake_up(&w->wait);
+}
+
+static int alloc_walk_add_dev(struct alloc_walk *w, struct bch_dev *ca)
+{
+	u64 start = ca->mi.first_bucket;
+	u64 nr = ca->mi.nbuckets - start;
+	unsigned i, nr_ranges = clamp_t(u64,
+			div64_u64(nr, ALLOC_WALK_RANGE_MIN),
+			1, ALLOC_WALK_RANGES_PER_DEV);
+
+	for (i = 0; i < nr_ranges; i++) {
+		struct alloc_walk_range r = {
+			.w	= w,
+			.start	= POS(ca->dev_idx, start + div_u64(nr * i, nr_ranges)),
+			.end	= POS(ca->dev_idx, start + div_u64(nr * (i + 1), nr_ranges)),
+		};
+		int ret = darray_push(&w->ranges, r);
+
+		if (ret)
+			return ret;
+	}
+
+	w->nr += nr;
+	return 0;
+}
+
+static int alloc_walk_run(struct alloc_walk *w)
+{
+	struct alloc_walk_range *r;
+
+	init_waitqueue_head(&w->wait);
+	atomic64_set(&w->done, 0);
+	atomic_set(&w->nr_running, w->ranges.nr);
+
+	darray_for_each(w->ranges, r) {
+		INIT_WORK(&r->work, alloc_walk_work);
+		queue_work(system_unbound_wq, &r->work);
+	}
+
+	while (!wait_event_timeout(w->wait, !atomic_read(&w->nr_running), 10 * HZ))
+		bch_info(w->c, "%s: %llu%% done", w->msg,
+			 div64_u64(atomic64_read(&w->done) * 100, max(w->nr, 1ULL)));
+
+	darray_exit(&w->ranges);
+	return w->ret;
+}
+
+static int bch2_alloc_read_range(struct btree_trans *trans,
+				 struct bpos start, struct bpos end,
+				 atomic64_t *done)
+{
+	struct bch_fs *c = trans->c;
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bch_alloc_v4 a;
 	struct bch_dev *ca;
 	int ret;
 
-	bch2_trans_init(&trans, c, 0, 0);
-
-	for_each_btree_key(&trans, iter, BTREE_ID_alloc, POS_MIN,
+	for_each_btree_key(trans, iter, BTREE_ID_alloc, start,
 			   BTREE_ITER_PREFETCH, k, ret) {
+		if (bpos_cmp(k.k->p, end) >= 0)
+			break;
+
+		atomic64_inc(done);
+
 		/*
 		 * Not a fsck error because this is checked/repaired by
 		 * bch2_check_alloc_key() which runs later:
@@ -537,11 +640,42 @@ int bch2_alloc_read(struct bch_fs *c)
 		bch2_alloc_to_v4(k, &a);
 
 		*bucket_gen(ca, k.k->p.offset) = a.gen;
+		bch2_copygc_candidate_update(ca, k.k->p.offset,
+					     (struct bch_alloc_v4) { .data_type = BCH_DATA_free }, a);
 	}
-	bch2_trans_iter_exit(&trans, &iter);
+	bch2_trans_iter_exit(trans, &iter);
 
-	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/*
+ * Each range only touches its own device's bucket gens, and copygc candidate
+ * bits are set atomically, so devices - and ranges within a device - can be
+ * read in parallel:
+ */
+int bch2_alloc_read(struct bch_fs *c)
+{
+	struct alloc_walk w = {
+		.c	= c,
+		.msg	= "reading alloc info",
+		.fn	= bch2_alloc_read_range,
+	};
+	struct bch_dev *ca;
+	unsigned i;
+	int ret = 0;
 
+	for_each_member_device(ca, c, i) {
+		ret = alloc_walk_add_dev(&w, ca);
+		if (ret) {
+			percpu_ref_put(&ca->ref);
+			darray_exit(&w.ranges);
+			goto err;
+		}
+	}
+
+	if (w.ranges.nr)
+		ret = alloc_walk_run(&w);
+err:
 	if (ret)
 		bch_err(c, "error reading alloc info: %s", bch2_err_str(ret));
 
@@ -687,7 +821,8 @@ int bch2_trans_mark_alloc(struct btree_trans *trans,
 static int bch2_check_alloc_key(struct btree_trans *trans,
 				struct btree_iter *alloc_iter,
 				struct btree_iter *discard_iter,
-				struct btree_iter *freespace_iter)
+				struct btree_iter *freespace_iter,
+				struct bpos end)
 {
 	struct bch_fs *c = trans->c;
 	struct bch_dev *ca;
@@ -700,7 +835,7 @@ static int bch2_check_alloc_key(struct btree_trans *trans,
 	alloc_k = bch2_dev_bucket_exists(c, alloc_iter->pos)
 		? bch2_btree_iter_peek_slot(alloc_iter)
 		: bch2_btree_iter_peek(alloc_iter);
-	if (!alloc_k.k)
+	if (!alloc_k.k || bpos_cmp(alloc_k.k->p, end) >= 0)
 		return 1;
 
 	ret = bkey_err(alloc_k);
@@ -843,36 +978,83 @@ delete:
 	goto out;
 }
 
-int bch2_check_alloc_info(struct bch_fs *c)
+static int bch2_check_alloc_range(struct btree_trans *trans,
+				  struct bpos start, struct bpos end,
+				  atomic64_t *done)
 {
-	struct btree_trans trans;
 	struct btree_iter iter, discard_iter, freespace_iter;
-	struct bkey_s_c k;
 	int ret = 0;
 
-	bch2_trans_init(&trans, c, 0, 0);
-
-	bch2_trans_iter_init(&trans, &iter, BTREE_ID_alloc, POS_MIN,
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, start,
 			     BTREE_ITER_PREFETCH);
-	bch2_trans_iter_init(&trans, &discard_iter, BTREE_ID_need_discard, POS_MIN,
+	bch2_trans_iter_init(trans, &discard_iter, BTREE_ID_need_discard, start,
 			     BTREE_ITER_PREFETCH);
-	bch2_trans_iter_init(&trans, &freespace_iter, BTREE_ID_freespace, POS_MIN,
+	bch2_trans_iter_init(trans, &freespace_iter, BTREE_ID_freespace, start,
 			     BTREE_ITER_PREFETCH);
 	while (1) {
-		ret = commit_do(&trans, NULL, NULL,
+		ret = commit_do(trans, NULL, NULL,
 				      BTREE_INSERT_NOFAIL|
 				      BTREE_INSERT_LAZY_RW,
-			bch2_check_alloc_key(&trans, &iter,
+			bch2_check_alloc_key(trans, &iter,
 					     &discard_iter,
-					     &freespace_iter));
+					     &freespace_iter,
+					     end));
 		if (ret)
 			break;
 
+		atomic64_inc(done);
 		bch2_btree_iter_advance(&iter);
 	}
-	bch2_trans_iter_exit(&trans, &freespace_iter);
-	bch2_trans_iter_exit(&trans, &discard_iter);
-	bch2_trans_iter_exit(&trans, &iter);
+	bch2_trans_iter_exit(trans, &freespace_iter);
+	bch2_trans_iter_exit(trans, &discard_iter);
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret < 0 ? ret : 0;
+}
+
+int bch2_check_alloc_info(struct bch_fs *c)
+{
+	struct alloc_walk w = {
+		.c	= c,
+		.msg	= "checking alloc info",
+		.fn	= bch2_check_alloc_range,
+	};
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_dev *ca;
+	unsigned i;
+	int ret = 0;
+
+	for_each_member_device(ca, c, i) {
+		ret = alloc_walk_add_dev(&w, ca);
+		if (ret) {
+			percpu_ref_put(&ca->ref);
+			darray_exit(&w.ranges);
+			return ret;
+		}
+	}
+
+	/*
+	 * The ranges have to cover the whole alloc btree, so that we also see
+	 * keys for nonexistent devices and buckets:
+	 */
+	if (!w.ranges.nr) {
+		struct alloc_walk_range r = { .w = &w };
+
+		ret = darray_push(&w.ranges, r);
+		if (ret)
+			return ret;
+	}
+
+	w.ranges.data[0].start = POS_MIN;
+	for (i = 0; i + 1 < w.ranges.nr; i++)
+		w.ranges.data[i].end = w.ranges.data[i + 1].start;
+	w.ranges.data[i].end = POS_MAX;
+
+	ret = alloc_walk_run(&w);
+
+	bch2_trans_init(&trans, c, 0, 0);
 
 	if (ret < 0)
 		goto err;
@@ -989,44 +1171,277 @@ int bch2_check_alloc_to_lru_refs(struct bch_fs *c)
 	return ret < 0 ? ret : 0;
 }
 
-static int bch2_discard_one_bucket(struct btree_trans *trans,
-				   struct btree_iter *need_discard_iter,
-				   struct bpos *discard_pos_done,
-				   u64 *seen,
-				   u64 *open,
-				   u64 *need_journal_commit,
-				   u64 *discarded)
+/*
+ * Discards are done in batches: we walk the need_discard btree and queue up
+ * buckets that are ready to be discarded - checked against their alloc keys -
+ * then issue one discard for each run of adjacent buckets, then clear
+ * need_discard on several buckets per transaction commit.
+ */
+#define DISCARD_BATCH_MAX	64
+#define DISCARD_COMMIT_MAX	8
+#define DISCARD_IDLE_MAX_WAIT	(10 * HZ)
+
+struct discard_bucket {
+	struct bpos		pos;
+	bool			inc_gen;
+	bool			skip;
+};
+
+struct discard_batch {
+	struct bpos		next;
+	unsigned		nr;
+	struct discard_bucket	b[DISCARD_BATCH_MAX];
+
+	u64			seen;
+	u64			open;
+	u64			need_journal_commit;
+	u64			discarded;
+};
+
+static int discard_bucket_queue(struct btree_trans *trans,
+				struct btree_iter *need_discard_iter,
+				struct bkey_s_c need_discard_k,
+				struct discard_batch *batch)
 {
 	struct bch_fs *c = trans->c;
-	struct bpos pos = need_discard_iter->pos;
-	struct btree_iter iter = { NULL };
+	struct bpos pos = need_discard_k.k->p;
+	struct btree_iter iter;
 	struct bkey_s_c k;
+	struct bch_alloc_v4 a;
 	struct bch_dev *ca;
-	struct bkey_i_alloc_v4 *a;
 	struct printbuf buf = PRINTBUF;
-	bool did_discard = false;
-	int ret = 0;
+	int ret;
+
+	if (batch->nr == DISCARD_BATCH_MAX) {
+		batch->next = pos;
+		return 1;
+	}
+
+	batch->seen++;
 
 	ca = bch_dev_bkey_exists(c, pos.inode);
 	if (!percpu_ref_tryget(&ca->io_ref)) {
 		bch2_btree_iter_set_pos(need_discard_iter, POS(pos.inode + 1, 0));
 		return 0;
 	}
+	percpu_ref_put(&ca->io_ref);
 
 	if (bch2_bucket_is_open_safe(c, pos.inode, pos.offset)) {
-		(*open)++;
-		goto out;
+		batch->open++;
+		return 0;
 	}
 
 	if (bch2_bucket_needs_journal_commit(&c->buckets_waiting_for_journal,
 			c->journal.flushed_seq_ondisk,
 			pos.inode, pos.offset)) {
-		(*need_journal_commit)++;
+		batch->need_journal_commit++;
+		return 0;
+	}
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, pos,
+			     BTREE_ITER_CACHED);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k);
+	if (ret)
 		goto out;
+
+	bch2_alloc_to_v4(k, &a);
+
+	/*
+	 * The bucket mustn't be discarded until the alloc key is checked - the
+	 * same checks discard_bucket_update() does before clearing
+	 * need_discard:
+	 */
+	if (!BCH_ALLOC_V4_NEED_INC_GEN(&a)) {
+		if (a.journal_seq > c->journal.flushed_seq_ondisk) {
+			batch->need_journal_commit++;
+			goto out;
+		}
+
+		if (bch2_trans_inconsistent_on(a.data_type != BCH_DATA_need_discard, trans,
+				"bucket incorrectly set in need_discard btree\n"
+				"%s",
+				(bch2_bkey_val_to_text(&buf, c, k), buf.buf)))
+			goto out;
+	}
+
+	batch->b[batch->nr++] = (struct discard_bucket) {
+		.pos		= pos,
+		.inc_gen	= BCH_ALLOC_V4_NEED_INC_GEN(&a),
+	};
+
+	if (!BCH_ALLOC_V4_NEED_INC_GEN(&a))
+		this_cpu_inc(c->counters[BCH_COUNTER_discard_queued]);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	printbuf_exit(&buf);
+	return ret;
+}
+
+static u64 discard_io_clock(struct bch_fs *c)
+{
+	return atomic64_read(&c->io_clock[READ].now) +
+	       atomic64_read(&c->io_clock[WRITE].now);
+}
+
+static bool discard_should_stop(struct bch_fs *c)
+{
+	return percpu_ref_is_dying(&c->writes);
+}
+
+static void discard_sleep(unsigned long delay)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_timeout(delay);
+}
+
+/*
+ * In discard_idle mode, hold off until there's been no foreground IO for a
+ * little while - but not indefinitely, since the allocator may be waiting on
+ * these buckets:
+ */
+static void discard_wait_idle(struct bch_fs *c)
+{
+	unsigned long start = jiffies;
+	u64 io = discard_io_clock(c), now;
+
+	while (c->opts.discard_idle &&
+	       time_before(jiffies, start + DISCARD_IDLE_MAX_WAIT) &&
+	       !discard_should_stop(c)) {
+		discard_sleep(HZ / 10);
+
+		now = discard_io_clock(c);
+		if (now == io)
+			break;
+		io = now;
 	}
+}
+
+static void discard_ratelimit(struct bch_fs *c, u64 bytes)
+{
+	struct bch_ratelimit *bw = &c->discard_bw_limit;
+	struct bch_ratelimit *iops = &c->discard_iops_limit;
+	u64 delay;
+
+	bw->rate	= c->opts.discard_max_bandwidth;
+	iops->rate	= c->opts.discard_max_iops;
+
+	while (!discard_should_stop(c)) {
+		delay = max(bw->rate	? bch2_ratelimit_delay(bw)   : 0,
+			    iops->rate	? bch2_ratelimit_delay(iops) : 0);
+		if (!delay)
+			break;
+
+		discard_sleep(delay);
+	}
+
+	if (bw->rate)
+		bch2_ratelimit_increment(bw, bytes);
+	if (iops->rate)
+		bch2_ratelimit_increment(iops, 1);
+}
+
+static int discard_issue_range(struct bch_fs *c, struct bch_dev *ca,
+			       u64 bucket, unsigned nr)
+{
+	int ret;
+
+	discard_ratelimit(c, (u64) nr * ca->mi.bucket_size << 9);
+	bch2_io_sched_wait(c, BCH_IO_CLASS_copygc);
+
+	/*
+	 * On zoned devices buckets are zones, and resetting replaces discard -
+	 * but unlike a discard, the reset has to succeed before the buckets
+	 * can be reused:
+	 */
+	if (bdev_is_zoned(ca->disk_sb.bdev)) {
+		ret = blkdev_zone_mgmt(ca->disk_sb.bdev, REQ_OP_ZONE_RESET,
+				       bucket * ca->mi.bucket_size,
+				       nr * ca->mi.bucket_size,
+				       GFP_KERNEL);
+		if (ret) {
+			bch_err_ratelimited(c, "%s: error resetting zones %llu-%llu: %s",
+					    ca->name, bucket, bucket + nr - 1,
+					    bch2_err_str(ret));
+			return ret;
+		}
+	} else {
+		blkdev_issue_discard(ca->disk_sb.bdev,
+				     bucket * ca->mi.bucket_size,
+				     nr * ca->mi.bucket_size,
+				     GFP_KERNEL);
+	}
+
+	this_cpu_inc(c->counters[BCH_COUNTER_discard_issued]);
+	this_cpu_add(c->counters[BCH_COUNTER_discard_coalesced], nr - 1);
+	return 0;
+}
+
+/*
+ * Issue discards for the queued buckets, coalescing adjacent buckets on the
+ * same device into a single discard.
+ *
+ * This works without any btree locks held because this is the only thread
+ * that removes items from the need_discard tree - and the buckets were checked
+ * against their alloc keys when they were queued.
+ *
+ * Buckets whose zones couldn't be reset, or whose device went offline, are
+ * marked to be skipped, so they stay in the need_discard btree and are retried
+ * later.
+ */
+static void discard_batch_issue(struct bch_fs *c, struct discard_batch *batch)
+{
+	struct discard_bucket *b = batch->b, *end = b + batch->nr, *run;
+	struct bch_dev *ca;
+	int ret;
+
+	if (c->opts.nochanges)
+		return;
+
+	discard_wait_idle(c);
+
+	while (b < end) {
+		if (b->inc_gen) {
+			b++;
+			continue;
+		}
+
+		run = b;
+		ca = bch_dev_bkey_exists(c, b->pos.inode);
+
+		while (++b < end &&
+		       b->pos.inode == run->pos.inode &&
+		       b->pos.offset == b[-1].pos.offset + 1 &&
+		       !b->inc_gen)
+			;
+
+		if (percpu_ref_tryget(&ca->io_ref)) {
+			ret = ca->mi.discard || bdev_is_zoned(ca->disk_sb.bdev)
+				? discard_issue_range(c, ca, run->pos.offset, b - run)
+				: 0;
+			percpu_ref_put(&ca->io_ref);
+		} else {
+			/* Device went offline: leave these for next time */
+			ret = -EIO;
+		}
+
+		if (ret)
+			for (; run < b; run++)
+				run->skip = true;
+	}
+}
+
+static int discard_bucket_update(struct btree_trans *trans,
+				 struct discard_bucket *b)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_i_alloc_v4 *a;
+	struct printbuf buf = PRINTBUF;
+	int ret;
 
-	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc,
-			     need_discard_iter->pos,
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, b->pos,
 			     BTREE_ITER_CACHED);
 	k = bch2_btree_iter_peek_slot(&iter);
 	ret = bkey_err(k);
@@ -1044,98 +1459,124 @@ static int bch2_discard_one_bucket(struct btree_trans *trans,
 		goto write;
 	}
 
+	/*
+	 * Checked when the bucket was queued, so this shouldn't happen - but
+	 * if it does, only this bucket is skipped, not the rest of the commit:
+	 */
 	if (bch2_trans_inconsistent_on(a->v.journal_seq > c->journal.flushed_seq_ondisk, trans,
 			"clearing need_discard but journal_seq %llu > flushed_seq %llu\n"
 			"%s",
 			a->v.journal_seq,
 			c->journal.flushed_seq_ondisk,
-			(bch2_bkey_val_to_text(&buf, c, k), buf.buf))) {
-		ret = -EIO;
-		goto out;
-	}
-
-	if (bch2_trans_inconsistent_on(a->v.data_type != BCH_DATA_need_discard, trans,
+			(bch2_bkey_val_to_text(&buf, c, k), buf.buf)) ||
+	    bch2_trans_inconsistent_on(a->v.data_type != BCH_DATA_need_discard, trans,
 			"bucket incorrectly set in need_discard btree\n"
 			"%s",
 			(bch2_bkey_val_to_text(&buf, c, k), buf.buf))) {
-		ret = -EIO;
+		b->skip = true;
 		goto out;
 	}
 
-	if (bkey_cmp(*discard_pos_done, iter.pos) &&
-	    ca->mi.discard && !c->opts.nochanges) {
-		/*
-		 * This works without any other locks because this is the only
-		 * thread that removes items from the need_discard tree
-		 */
-		bch2_trans_unlock(trans);
-		blkdev_issue_discard(ca->disk_sb.bdev,
-				     k.k->p.offset * ca->mi.bucket_size,
-				     ca->mi.bucket_size,
-				     GFP_KERNEL);
-
-		ret = bch2_trans_relock(trans);
-		if (ret)
-			goto out;
-	}
-
-	*discard_pos_done = iter.pos;
-	did_discard = true;
-
 	SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
 	a->v.data_type = alloc_data_type(a->v, a->v.data_type);
 write:
-	ret =   bch2_trans_update(trans, &iter, &a->k_i, 0) ?:
-		bch2_trans_commit(trans, NULL, NULL,
-				  BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL);
-	if (ret)
-		goto out;
-
-	if (did_discard) {
-		this_cpu_inc(c->counters[BCH_COUNTER_bucket_discard]);
-		(*discarded)++;
-	}
+	ret = bch2_trans_update(trans, &iter, &a->k_i, 0);
 out:
 	bch2_trans_iter_exit(trans, &iter);
-	percpu_ref_put(&ca->io_ref);
 	printbuf_exit(&buf);
 	return ret;
 }
 
+static int discard_buckets_update(struct btree_trans *trans,
+				  struct discard_bucket *b, unsigned nr)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i++)
+		if (!b[i].skip)
+			ret = discard_bucket_update(trans, b + i);
+	return ret;
+}
+
+/*
+ * Clear need_discard on the queued buckets, several buckets per transaction
+ * commit; counters are only incremented after a successful commit:
+ */
+static int discard_batch_update(struct btree_trans *trans,
+				struct discard_batch *batch)
+{
+	struct bch_fs *c = trans->c;
+	unsigned i, j, nr;
+	int ret = 0;
+
+	for (i = 0; i < batch->nr; i += nr) {
+		nr = min_t(unsigned, batch->nr - i, DISCARD_COMMIT_MAX);
+
+		ret = commit_do(trans, NULL, NULL,
+				BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL,
+				discard_buckets_update(trans, batch->b + i, nr));
+		if (ret)
+			break;
+
+		for (j = i; j < i + nr; j++)
+			if (!batch->b[j].inc_gen &&
+			    !batch->b[j].skip) {
+				this_cpu_inc(c->counters[BCH_COUNTER_bucket_discard]);
+				batch->discarded++;
+			}
+	}
+
+	return ret;
+}
+
 static void bch2_do_discards_work(struct work_struct *work)
 {
 	struct bch_fs *c = container_of(work, struct bch_fs, discard_work);
 	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	u64 seen = 0, open = 0, need_journal_commit = 0, discarded = 0;
-	struct bpos discard_pos_done = POS_MAX;
+	struct discard_batch *batch;
+	struct bpos pos = POS_MIN;
 	int ret;
 
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	bch2_trans_init(&trans, c, 0, 0);
 
-	/*
-	 * We're doing the commit in bch2_discard_one_bucket instead of using
-	 * for_each_btree_key_commit() so that we can increment counters after
-	 * successful commit:
-	 */
-	ret = for_each_btree_key2(&trans, iter,
-			BTREE_ID_need_discard, POS_MIN, 0, k,
-		bch2_discard_one_bucket(&trans, &iter, &discard_pos_done,
-					&seen,
-					&open,
-					&need_journal_commit,
-					&discarded));
+	do {
+		batch->nr = 0;
+
+		ret = for_each_btree_key2(&trans, iter,
+				BTREE_ID_need_discard, pos, 0, k,
+			discard_bucket_queue(&trans, &iter, k, batch));
+		if (ret < 0)
+			break;
+
+		pos = batch->next;
+
+		bch2_trans_unlock(&trans);
+		discard_batch_issue(c, batch);
+
+		ret = discard_batch_update(&trans, batch) ?: ret;
+	} while (ret > 0 && !discard_should_stop(c));
 
 	bch2_trans_exit(&trans);
+	ret = min(ret, 0);
 
-	if (need_journal_commit * 2 > seen)
+	if (batch->need_journal_commit * 2 > batch->seen)
 		bch2_journal_flush_async(&c->journal, NULL);
 
-	percpu_ref_put(&c->writes);
-
-	trace_discard_buckets(c, seen, open, need_journal_commit, discarded,
+	trace_discard_buckets(c, batch->seen, batch->open,
+			      batch->need_journal_commit, batch->discarded,
 			      bch2_err_str(ret));
+	kfree(batch);
+out:
+	percpu_ref_put(&c->writes);
 }
 
 void bch2_do_discards(struct bch_fs *c)
@@ -1145,21 +1586,52 @@ void bch2_do_discards(struct bch_fs *c)
 		percpu_ref_put(&c->writes);
 }
 
-static int invalidate_one_bucket(struct btree_trans *trans,
-				 struct btree_iter *lru_iter, struct bkey_s_c k,
-				 unsigned dev_idx, s64 *nr_to_invalidate)
+/*
+ * Buckets are invalidated in batches: one walk of the lru btree queues up to
+ * c->opts.invalidate_batch buckets, whose alloc key updates are then done in a
+ * single transaction commit.
+ */
+#define INVALIDATE_BATCH_MAX	8
+
+struct invalidate_bucket {
+	struct bpos		bucket;
+	u64			lru_idx;
+	unsigned		cached_sectors;
+	bool			skipped;
+};
+
+struct invalidate_batch {
+	struct bpos		next;
+	/* first live lru entry seen, for advancing the lru cursor: */
+	u64			first;
+	unsigned		nr;
+	unsigned		size;
+	struct invalidate_bucket b[INVALIDATE_BATCH_MAX];
+};
+
+static int invalidate_bucket_queue(struct btree_trans *trans,
+				   struct bkey_s_c k, unsigned dev_idx,
+				   s64 nr_to_invalidate,
+				   struct invalidate_batch *batch)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter alloc_iter = { NULL };
-	struct bkey_i_alloc_v4 *a;
-	struct bpos bucket;
 	struct printbuf buf = PRINTBUF;
-	unsigned cached_sectors;
 	int ret = 0;
 
-	if (*nr_to_invalidate <= 0 || k.k->p.inode != dev_idx)
+	if (k.k->p.inode != dev_idx)
+		return 1;
+
+	batch->first = min(batch->first, k.k->p.offset);
+
+	if (batch->nr >= nr_to_invalidate)
 		return 1;
 
+	/* Batch is full, but there's more to do: */
+	if (batch->nr == batch->size) {
+		batch->next = k.k->p;
+		return 2;
+	}
+
 	if (k.k->type != KEY_TYPE_lru) {
 		prt_printf(&buf, "non lru key in lru btree:\n  ");
 		bch2_bkey_val_to_text(&buf, c, k);
@@ -1174,18 +1646,35 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 		goto out;
 	}
 
-	bucket = POS(dev_idx, le64_to_cpu(bkey_s_c_to_lru(k).v->idx));
+	batch->b[batch->nr++] = (struct invalidate_bucket) {
+		.bucket		= POS(dev_idx, le64_to_cpu(bkey_s_c_to_lru(k).v->idx)),
+		.lru_idx	= k.k->p.offset,
+	};
+out:
+	printbuf_exit(&buf);
+	return ret;
+}
+
+static int invalidate_one_bucket(struct btree_trans *trans,
+				 struct invalidate_bucket *b)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter alloc_iter = { NULL };
+	struct bkey_i_alloc_v4 *a;
+	struct printbuf buf = PRINTBUF;
+	int ret = 0;
 
-	a = bch2_trans_start_alloc_update(trans, &alloc_iter, bucket);
+	b->skipped = true;
+
+	a = bch2_trans_start_alloc_update(trans, &alloc_iter, b->bucket);
 	ret = PTR_ERR_OR_ZERO(a);
 	if (ret)
 		goto out;
 
-	if (k.k->p.offset != alloc_lru_idx(a->v)) {
-		prt_printf(&buf, "alloc key does not point back to lru entry when invalidating bucket:\n  ");
+	if (b->lru_idx != alloc_lru_idx(a->v)) {
+		prt_printf(&buf, "alloc key does not point back to lru entry %llu when invalidating bucket:\n  ",
+			   b->lru_idx);
 		bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(&a->k_i));
-		prt_printf(&buf, "\n  ");
-		bch2_bkey_val_to_text(&buf, c, k);
 
 		if (!test_bit(BCH_FS_CHECK_LRUS_DONE, &c->flags)) {
 			bch_err(c, "%s", buf.buf);
@@ -1200,7 +1689,7 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	if (!a->v.cached_sectors)
 		bch_err(c, "invalidating empty bucket, confused");
 
-	cached_sectors = a->v.cached_sectors;
+	b->cached_sectors = a->v.cached_sectors;
 
 	SET_BCH_ALLOC_V4_NEED_INC_GEN(&a->v, false);
 	a->v.gen++;
@@ -1210,21 +1699,54 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	a->v.io_time[READ]	= atomic64_read(&c->io_clock[READ].now);
 	a->v.io_time[WRITE]	= atomic64_read(&c->io_clock[WRITE].now);
 
-	ret =   bch2_trans_update(trans, &alloc_iter, &a->k_i,
-				BTREE_TRIGGER_BUCKET_INVALIDATE) ?:
-		bch2_trans_commit(trans, NULL, NULL,
-				  BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL);
-	if (ret)
-		goto out;
-
-	trace_and_count(c, bucket_invalidate, c, bucket.inode, bucket.offset, cached_sectors);
-	--*nr_to_invalidate;
+	ret = bch2_trans_update(trans, &alloc_iter, &a->k_i,
+				BTREE_TRIGGER_BUCKET_INVALIDATE);
+	if (!ret)
+		b->skipped = false;
 out:
 	bch2_trans_iter_exit(trans, &alloc_iter);
 	printbuf_exit(&buf);
 	return ret;
 }
 
+static int invalidate_buckets(struct btree_trans *trans,
+			      struct invalidate_batch *batch)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < batch->nr && !ret; i++)
+		ret = invalidate_one_bucket(trans, batch->b + i);
+	return ret;
+}
+
+static int invalidate_batch_commit(struct btree_trans *trans,
+				   struct invalidate_batch *batch,
+				   s64 *nr_to_invalidate)
+{
+	struct bch_fs *c = trans->c;
+	struct invalidate_bucket *b;
+	u64 start_time = local_clock();
+	int ret;
+
+	ret = commit_do(trans, NULL, NULL,
+			BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL,
+			invalidate_buckets(trans, batch));
+	if (ret)
+		return ret;
+
+	for (b = batch->b; b < batch->b + batch->nr; b++)
+		if (!b->skipped) {
+			trace_and_count(c, bucket_invalidate, c,
+					b->bucket.inode, b->bucket.offset,
+					b->cached_sectors);
+			--*nr_to_invalidate;
+		}
+
+	bch2_time_stats_update(&c->times[BCH_TIME_bucket_invalidate], start_time);
+	return 0;
+}
+
 static void bch2_do_invalidates_work(struct work_struct *work)
 {
 	struct bch_fs *c = container_of(work, struct bch_fs, invalidate_work);
@@ -1232,6 +1754,7 @@ static void bch2_do_invalidates_work(struct work_struct *work)
 	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
+	struct invalidate_batch batch;
 	unsigned i;
 	int ret = 0;
 
@@ -1240,10 +1763,32 @@ static void bch2_do_invalidates_work(struct work_struct *work)
 	for_each_member_device(ca, c, i) {
 		s64 nr_to_invalidate =
 			should_invalidate_buckets(ca, bch2_dev_usage_read(ca));
+		u64 cursor = bch2_lru_cursor(c, ca->dev_idx);
+		struct bpos pos = POS(ca->dev_idx, cursor);
+
+		batch.size = clamp_t(unsigned, c->opts.invalidate_batch,
+				     1, INVALIDATE_BATCH_MAX);
+		batch.first = U64_MAX;
+
+		do {
+			batch.nr = 0;
+
+			ret = for_each_btree_key2(&trans, iter, BTREE_ID_lru,
+					pos, BTREE_ITER_INTENT, k,
+				invalidate_bucket_queue(&trans, k, ca->dev_idx,
+							nr_to_invalidate, &batch));
+			pos = batch.next;
+
+			if (ret >= 0 && batch.first != U64_MAX) {
+				bch2_lru_cursor_advance(c, ca->dev_idx,
+							cursor, batch.first);
+				cursor = max(cursor, batch.first);
+			}
 
-		ret = for_each_btree_key2(&trans, iter, BTREE_ID_lru,
-				POS(ca->dev_idx, 0), BTREE_ITER_INTENT, k,
-			invalidate_one_bucket(&trans, &iter, k, ca->dev_idx, &nr_to_invalidate));
+			if (ret >= 0 && batch.nr)
+				ret = invalidate_batch_commit(&trans, &batch,
+							      &nr_to_invalidate) ?: ret;
+		} while (ret == 2 && nr_to_invalidate > 0);
 
 		if (ret < 0) {
 			percpu_ref_put(&ca->ref);
@@ -1263,85 +1808,215 @@ void bch2_do_invalidates(struct bch_fs *c)
 }
 
 static int bucket_freespace_init(struct btree_trans *trans, struct btree_iter *iter,
-				 struct bkey_s_c k, struct bch_dev *ca)
+				 struct bkey_s_c k, struct bpos end, atomic64_t *done)
 {
 	struct bch_alloc_v4 a;
 
-	if (iter->pos.offset >= ca->mi.nbuckets)
+	if (bpos_cmp(iter->pos, end) >= 0)
 		return 1;
 
+	atomic64_inc(done);
 	bch2_alloc_to_v4(k, &a);
 	return bch2_bucket_do_index(trans, k, &a, true);
 }
 
-static int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca)
+static int bch2_freespace_init_range(struct btree_trans *trans,
+				     struct bpos start, struct bpos end,
+				     atomic64_t *done)
 {
-	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	struct bch_member *m;
 	int ret;
 
-	bch2_trans_init(&trans, c, 0, 0);
-
-	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_alloc,
-			POS(ca->dev_idx, ca->mi.first_bucket),
+	ret = for_each_btree_key_commit(trans, iter, BTREE_ID_alloc, start,
 			BTREE_ITER_SLOTS|BTREE_ITER_PREFETCH, k,
 			NULL, NULL, BTREE_INSERT_LAZY_RW,
-		bucket_freespace_init(&trans, &iter, k, ca));
+		bucket_freespace_init(trans, &iter, k, end, done));
 
-	bch2_trans_exit(&trans);
+	return ret < 0 ? ret : 0;
+}
 
-	if (ret < 0) {
-		bch_err(ca, "error initializing free space: %s", bch2_err_str(ret));
-		return ret;
+/*
+ * The freespace keys for a device are generated in order, so if none of them
+ * have been indexed yet - i.e. on a freshly formatted filesystem - they can be
+ * loaded with bch2_btree_bulk_insert() instead of a transaction commit for
+ * every bucket.
+ *
+ * That only works while buckets are just free or in use: a bucket that needs
+ * discarding goes in the need_discard btree, and a bucket with nonzero gen bits
+ * would sort out of order - devices where we find one are left to
+ * bch2_freespace_init_range():
+ */
+#define FREESPACE_BULK_KEYS	(1U << 16)
+
+static int freespace_bulk_key(struct bkey_s_c k, struct bch_dev *ca,
+			      struct keylist *keys, struct bkey_i *keys_end,
+			      struct bpos *pos, bool *fallback)
+{
+	struct bch_alloc_v4 a;
+
+	*pos = k.k->p;
+
+	if (k.k->p.offset >= ca->mi.nbuckets ||
+	    keys->top == keys_end)
+		return 1;
+
+	bch2_alloc_to_v4(k, &a);
+
+	if (a.data_type == BCH_DATA_need_discard ||
+	    (a.data_type == BCH_DATA_free && alloc_freespace_genbits(a))) {
+		*fallback = true;
+		return 1;
 	}
 
-	mutex_lock(&c->sb_lock);
-	m = bch2_sb_get_members(c->disk_sb.sb)->members + ca->dev_idx;
-	SET_BCH_MEMBER_FREESPACE_INITIALIZED(m, true);
-	mutex_unlock(&c->sb_lock);
+	if (a.data_type == BCH_DATA_free) {
+		bkey_init(&keys->top->k);
+		keys->top->k.type	= KEY_TYPE_set;
+		keys->top->k.p		= k.k->p;
+		bch2_key_resize(&keys->top->k, 1);
+		bch2_keylist_push(keys);
+	}
 
+	pos->offset++;
 	return 0;
 }
 
+/* Returns 1 if the device has to be initialized the slow way: */
+static int bch2_dev_freespace_init_bulk(struct bch_fs *c, struct bch_dev *ca,
+					struct keylist *keys,
+					struct bkey_i *keys_end)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bpos pos = POS(ca->dev_idx, ca->mi.first_bucket);
+	bool fallback = false;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	while (!ret && pos.offset < ca->mi.nbuckets) {
+		keys->top = keys->keys;
+
+		ret = for_each_btree_key2(&trans, iter, BTREE_ID_alloc, pos,
+				BTREE_ITER_SLOTS|BTREE_ITER_PREFETCH, k,
+			freespace_bulk_key(k, ca, keys, keys_end, &pos, &fallback));
+		bch2_trans_unlock(&trans);
+		if (ret < 0)
+			break;
+
+		ret = fallback;
+		if (!ret && !bch2_keylist_empty(keys))
+			ret = bch2_btree_bulk_insert(c, BTREE_ID_freespace, keys, 0);
+		if (ret == -EEXIST)
+			ret = 1;
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static int bch2_fs_freespace_init_bulk(struct bch_fs *c, unsigned long *done)
+{
+	struct keylist keys;
+	struct bch_dev *ca;
+	unsigned i;
+	int ret = 0;
+
+	if (!percpu_ref_tryget_live(&c->writes))
+		return 0;
+
+	keys.keys = kvmalloc_array(FREESPACE_BULK_KEYS, sizeof(struct bkey_i), GFP_KERNEL);
+	if (!keys.keys) {
+		percpu_ref_put(&c->writes);
+		return 0;
+	}
+
+	for_each_member_device(ca, c, i) {
+		if (ca->mi.freespace_initialized)
+			continue;
+
+		ret = bch2_dev_freespace_init_bulk(c, ca, &keys,
+					keys.keys + FREESPACE_BULK_KEYS);
+		if (ret < 0) {
+			percpu_ref_put(&ca->ref);
+			break;
+		}
+
+		if (!ret)
+			__set_bit(ca->dev_idx, done);
+		ret = 0;
+	}
+
+	kvfree(keys.keys);
+	percpu_ref_put(&c->writes);
+	return ret;
+}
+
 int bch2_fs_freespace_init(struct bch_fs *c)
 {
+	struct alloc_walk w = {
+		.c	= c,
+		.msg	= "initializing freespace",
+		.fn	= bch2_freespace_init_range,
+	};
+	struct bch_member *m;
 	struct bch_dev *ca;
+	unsigned long bulk_done[BITS_TO_LONGS(BCH_SB_MEMBERS_MAX)] = { 0 };
+	bool need_init = false;
 	unsigned i;
 	int ret = 0;
-	bool doing_init = false;
 
 	/*
 	 * We can crash during the device add path, so we need to check this on
 	 * every mount:
 	 */
 
+	for_each_member_device(ca, c, i)
+		need_init |= !ca->mi.freespace_initialized;
+
+	if (!need_init)
+		return 0;
+
+	bch_info(c, "initializing freespace");
+
+	ret = bch2_fs_freespace_init_bulk(c, bulk_done);
+	if (ret) {
+		bch_err(c, "error initializing free space: %s", bch2_err_str(ret));
+		return ret;
+	}
+
 	for_each_member_device(ca, c, i) {
-		if (ca->mi.freespace_initialized)
+		if (ca->mi.freespace_initialized ||
+		    test_bit(ca->dev_idx, bulk_done))
 			continue;
 
-		if (!doing_init) {
-			bch_info(c, "initializing freespace");
-			doing_init = true;
-		}
-
-		ret = bch2_dev_freespace_init(c, ca);
+		ret = alloc_walk_add_dev(&w, ca);
 		if (ret) {
 			percpu_ref_put(&ca->ref);
+			darray_exit(&w.ranges);
 			return ret;
 		}
 	}
 
-	if (doing_init) {
-		mutex_lock(&c->sb_lock);
-		bch2_write_super(c);
-		mutex_unlock(&c->sb_lock);
+	if (w.ranges.nr) {
+		ret = alloc_walk_run(&w);
+		if (ret) {
+			bch_err(c, "error initializing free space: %s", bch2_err_str(ret));
+			return ret;
+		}
+	}
 
-		bch_verbose(c, "done initializing freespace");
+	mutex_lock(&c->sb_lock);
+	for_each_member_device(ca, c, i) {
+		m = bch2_sb_get_members(c->disk_sb.sb)->members + ca->dev_idx;
+		SET_BCH_MEMBER_FREESPACE_INITIALIZED(m, true);
 	}
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
 
-	return ret;
+	bch_verbose(c, "done initializing freespace");
+	return 0;
 }
 
 /* Bucket IO clocks: */
@@ -1513,6 +2188,8 @@ void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 		bch2_open_bucket_put(c, ob);
 	}
 
+	bch2_dev_alloc_cache_drain(c, ca);
+
 	bch2_ec_stop_dev(c, ca);
 
 	/*
@@ -1547,5 +2224,7 @@ void bch2_fs_allocator_background_init(struct bch_fs *c)
 {
 	spin_lock_init(&c->freelist_lock);
 	INIT_WORK(&c->discard_work, bch2_do_discards_work);
+	bch2_ratelimit_reset(&c->discard_bw_limit);
+	bch2_ratelimit_reset(&c->discard_iops_limit);
 	INIT_WORK(&c->invalidate_work, bch2_do_invalidates_work);
 }
@@ -206,6 +206,12 @@ static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *
 		return NULL;
 	}
 
+	if (unlikely(READ_ONCE(ca->shrink_nbuckets) &&
+		     bucket >= READ_ONCE(ca->shrink_nbuckets))) {
+		(*skipped_nouse)++;
+		return NULL;
+	}
+
 	if (bch2_bucket_is_open(c, ca->dev_idx, bucket)) {
 		(*skipped_open)++;
 		return NULL;
@@ -485,6 +491,116 @@ static struct open_bucket *bch2_bucket_alloc_freelist(struct btree_trans *trans,
 	return ob ?: ERR_PTR(ret);
 }
 
+/*
+ * Per cpu allocation caches:
+ *
+ * On a cache miss, foreground (RESERVE_none) allocations claim a few more
+ * buckets from the freespace btree while they're there, and stash the open
+ * buckets in a per cpu cache on the device, so that concurrent writers don't
+ * all have to walk the freespace btree and take freelist_lock for every
+ * bucket. Cached buckets are open, so they're already accounted for in
+ * ca->nr_open_buckets; they're given back when the device runs low on free
+ * buckets.
+ */
+static struct open_bucket *bch2_dev_alloc_cache_get(struct bch_fs *c,
+						    struct bch_dev *ca)
+{
+	struct bch_dev_alloc_cache *cache = this_cpu_ptr(ca->alloc_cache);
+	struct open_bucket *ob = NULL;
+
+	spin_lock(&cache->lock);
+	if (cache->nr) {
+		ob = c->open_buckets + cache->ob[--cache->nr];
+		cache->hit++;
+	} else {
+		cache->miss++;
+	}
+	spin_unlock(&cache->lock);
+
+	return ob;
+}
+
+static bool bch2_dev_alloc_cache_add(struct bch_fs *c, struct bch_dev *ca,
+				     struct open_bucket *ob)
+{
+	struct bch_dev_alloc_cache *cache = this_cpu_ptr(ca->alloc_cache);
+	bool ret = false;
+
+	spin_lock(&cache->lock);
+	if (cache->nr < ARRAY_SIZE(cache->ob)) {
+		cache->ob[cache->nr++] = ob - c->open_buckets;
+		ret = true;
+	}
+	spin_unlock(&cache->lock);
+
+	return ret;
+}
+
+static bool bch2_dev_alloc_cache_should_refill(struct bch_fs *c, u64 avail)
+{
+	return c->open_buckets_nr_free > OPEN_BUCKETS_COUNT * 3 / 4 &&
+		avail > BCH_DEV_ALLOC_CACHE_NR * num_online_cpus() * 2;
+}
+
+static void bch2_dev_alloc_cache_refill(struct btree_trans *trans,
+					struct bch_dev *ca,
+					u64 *cur_bucket,
+					u64 *buckets_seen,
+					u64 *skipped_open,
+					u64 *skipped_need_journal_commit,
+					u64 *skipped_nouse)
+{
+	struct bch_fs *c = trans->c;
+	struct open_bucket *ob;
+	unsigned i;
+
+	for (i = 0; i < BCH_DEV_ALLOC_CACHE_NR; i++) {
+		(*cur_bucket)++;
+
+		ob = bch2_bucket_alloc_freelist(trans, ca, RESERVE_none,
+						cur_bucket,
+						buckets_seen,
+						skipped_open,
+						skipped_need_journal_commit,
+						skipped_nouse,
+						NULL);
+		if (IS_ERR_OR_NULL(ob))
+			break;
+
+		if (!bch2_dev_alloc_cache_add(c, ca, ob)) {
+			bch2_open_bucket_put(c, ob);
+			break;
+		}
+	}
+}
+
+unsigned bch2_dev_alloc_cache_drain(struct bch_fs *c, struct bch_dev *ca)
+{
+	struct bch_dev_alloc_cache *cache;
+	struct open_bucket *ob;
+	unsigned cpu, nr = 0;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(ca->alloc_cache, cpu);
+
+		while (1) {
+			spin_lock(&cache->lock);
+			ob = cache->nr
+				? c->open_buckets + cache->ob[--cache->nr]
+				: NULL;
+			spin_unlock(&cache->lock);
+
+			if (!ob)
+				break;
+
+			bch2_open_bucket_put(c, ob);
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
 /**
  * bch_bucket_alloc - allocate a single bucket from a specific device
  *
@@ -522,6 +638,9 @@ again:
 		bch2_do_invalidates(c);
 
 	if (!avail) {
+		if (bch2_dev_alloc_cache_drain(c, ca))
+			goto again;
+
 		if (cl && !waiting) {
 			closure_wait(&c->freelist_wait, cl);
 			waiting = true;
@@ -532,7 +651,7 @@ again:
 			c->blocked_allocate = local_clock();
 
 		ob = ERR_PTR(-BCH_ERR_freelist_empty);
-		goto err;
+		goto out;
 	}
 
 	if (waiting)
@@ -544,6 +663,12 @@ again:
 			return ob;
 	}
 
+	if (likely(freespace_initialized)) {
+		ob = bch2_dev_alloc_cache_get(c, ca);
+		if (ob)
+			goto out;
+	}
+
 	ob = likely(ca->mi.freespace_initialized)
 		? bch2_bucket_alloc_freelist(trans, ca, reserve,
 					&cur_bucket,
@@ -560,6 +685,17 @@ again:
 					&skipped_nouse,
 					cl);
 
+	if (!IS_ERR_OR_NULL(ob) &&
+	    freespace_initialized &&
+	    reserve == RESERVE_none &&
+	    bch2_dev_alloc_cache_should_refill(c, avail))
+		bch2_dev_alloc_cache_refill(trans, ca,
+					&cur_bucket,
+					&buckets_seen,
+					&skipped_open,
+					&skipped_need_journal_commit,
+					&skipped_nouse);
+
 	if (skipped_need_journal_commit * 2 > avail)
 		bch2_journal_flush_async(&c->journal, NULL);
 
@@ -570,7 +706,7 @@ again:
 
 	if (!freespace_initialized)
 		ca->bucket_alloc_trans_early_cursor = cur_bucket;
-err:
+out:
 	if (!ob)
 		ob = ERR_PTR(-BCH_ERR_no_buckets_found);
 
@@ -616,6 +752,57 @@ static int __dev_stripe_cmp(struct dev_stripe_state *stripe,
 
 #define dev_stripe_cmp(l, r) __dev_stripe_cmp(stripe, l, r)
 
+static inline u64 dev_free_space_inv(struct bch_dev *ca)
+{
+	u64 free_space = dev_buckets_available(ca, RESERVE_none);
+
+	return free_space
+		? div64_u64(1ULL << 48, free_space)
+		: 1ULL << 48;
+}
+
+/*
+ * With the latency policy, a device's position in the stripe is pushed back
+ * by one allocation's worth for every quarter of write latency it has over
+ * the fastest device, and for every DEV_ALLOC_INFLIGHT_UNIT writes it
+ * currently has in flight:
+ */
+#define DEV_ALLOC_INFLIGHT_UNIT		8
+#define DEV_ALLOC_LOAD_MAX		64
+
+static void dev_alloc_list_latency_sort(struct bch_fs *c,
+					struct dev_stripe_state *stripe,
+					struct dev_alloc_list *devs)
+{
+	u64 key[BCH_SB_MEMBERS_MAX];
+	u64 min_latency = U64_MAX;
+	unsigned i;
+
+	for (i = 0; i < devs->nr; i++) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, devs->devs[i]);
+
+		min_latency = min_t(u64, min_latency,
+			max_t(u64, atomic64_read(&ca->cur_latency[WRITE]), 1));
+	}
+
+	for (i = 0; i < devs->nr; i++) {
+		unsigned dev = devs->devs[i];
+		struct bch_dev *ca = bch_dev_bkey_exists(c, dev);
+		u64 latency = max_t(u64, atomic64_read(&ca->cur_latency[WRITE]), 1);
+		u64 load = div64_u64(latency * 4, min_latency) - 4 +
+			atomic_read(&ca->writes_in_flight) / DEV_ALLOC_INFLIGHT_UNIT;
+		u64 v = stripe->next_alloc[dev];
+		u64 penalty = min_t(u64, load, DEV_ALLOC_LOAD_MAX) *
+			dev_free_space_inv(ca);
+
+		key[dev] = v + penalty >= v ? v + penalty : U64_MAX;
+	}
+
+#define dev_key_cmp(l, r)	(((key[l]) > (key[r])) - ((key[l]) < (key[r])))
+	bubble_sort(devs->devs, devs->nr, dev_key_cmp);
+#undef dev_key_cmp
+}
+
 struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *c,
 					  struct dev_stripe_state *stripe,
 					  struct bch_devs_mask *devs)
@@ -626,7 +813,11 @@ struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *c,
 	for_each_set_bit(i, devs->d, BCH_SB_MEMBERS_MAX)
 		ret.devs[ret.nr++] = i;
 
-	bubble_sort(ret.devs, ret.nr, dev_stripe_cmp);
+	if (c->opts.write_alloc_policy == BCH_WRITE_ALLOC_latency &&
+	    ret.nr > 1)
+		dev_alloc_list_latency_sort(c, stripe, &ret);
+	else
+		bubble_sort(ret.devs, ret.nr, dev_stripe_cmp);
 	return ret;
 }
 
@@ -634,10 +825,7 @@ void bch2_dev_stripe_increment(struct bch_dev *ca,
 			       struct dev_stripe_state *stripe)
 {
 	u64 *v = stripe->next_alloc + ca->dev_idx;
-	u64 free_space = dev_buckets_available(ca, RESERVE_none);
-	u64 free_space_inv = free_space
-		? div64_u64(1ULL << 48, free_space)
-		: 1ULL << 48;
+	u64 free_space_inv = dev_free_space_inv(ca);
 	u64 scale = *v / 4;
 
 	if (*v + free_space_inv >= *v)
@@ -969,6 +1157,39 @@ void bch2_open_buckets_stop_dev(struct bch_fs *c, struct bch_dev *ca,
 	*obs = ptrs;
 }
 
+static void writepoint_stop_ec_flushing(struct bch_fs *c, struct write_point *wp)
+{
+	struct open_buckets ptrs = { .nr = 0 };
+	struct open_bucket *ob;
+	unsigned i;
+
+	mutex_lock(&wp->lock);
+	open_bucket_for_each(c, &wp->ptrs, ob, i)
+		if (ob->ec && READ_ONCE(ob->ec->flushing))
+			bch2_open_bucket_put(c, ob);
+		else
+			ob_push(c, &ptrs, ob);
+	wp->ptrs = ptrs;
+	mutex_unlock(&wp->lock);
+}
+
+/*
+ * Drop the data buckets of stripes that ec_stripe_flush_work() decided to
+ * flush from all write points, so that the stripes can be created:
+ */
+void bch2_writepoints_stop_ec_flushing(struct bch_fs *c)
+{
+	struct write_point *wp;
+
+	for (wp = c->write_points;
+	     wp < c->write_points + c->write_points_nr;
+	     wp++)
+		writepoint_stop_ec_flushing(c, wp);
+
+	writepoint_stop_ec_flushing(c, &c->rebalance_write_point);
+	writepoint_stop_ec_flushing(c, &c->copygc_write_point);
+}
+
 void bch2_writepoint_stop(struct bch_fs *c, struct bch_dev *ca,
 			  struct write_point *wp)
 {
@@ -1366,6 +1587,8 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 void bch2_open_buckets_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct open_bucket *ob;
+	struct bch_dev *ca;
+	unsigned i, cpu;
 
 	for (ob = c->open_buckets;
 	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets);
@@ -1380,4 +1603,23 @@ void bch2_open_buckets_to_text(struct printbuf *out, struct bch_fs *c)
 		}
 		spin_unlock(&ob->lock);
 	}
+
+	for_each_member_device(ca, c, i) {
+		u64 nr = 0, hit = 0, miss = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct bch_dev_alloc_cache *cache =
+				per_cpu_ptr(ca->alloc_cache, cpu);
+
+			nr	+= READ_ONCE(cache->nr);
+			hit	+= READ_ONCE(cache->hit);
+			miss	+= READ_ONCE(cache->miss);
+		}
+
+		prt_printf(out, "dev %u alloc cache: %llu buckets, hit %llu miss %llu",
+			   i, nr, hit, miss);
+		if (hit + miss)
+			prt_printf(out, " (%llu%% hit)", div64_u64(hit * 100, hit + miss));
+		prt_newline(out);
+	}
 }
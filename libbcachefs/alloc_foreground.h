@@ -161,6 +161,7 @@ void bch2_alloc_sectors_done(struct bch_fs *, struct write_point *);
 void bch2_open_buckets_stop_dev(struct bch_fs *, struct bch_dev *,
 				struct open_buckets *);
 
+void bch2_writepoints_stop_ec_flushing(struct bch_fs *);
 void bch2_writepoint_stop(struct bch_fs *, struct bch_dev *,
 			  struct write_point *);
 
@@ -176,6 +177,8 @@ static inline struct write_point_specifier writepoint_ptr(struct write_point *wp
 
 void bch2_fs_allocator_foreground_init(struct bch_fs *);
 
+unsigned bch2_dev_alloc_cache_drain(struct bch_fs *, struct bch_dev *);
+
 void bch2_open_buckets_to_text(struct printbuf *, struct bch_fs *);
 
 #endif /* _BCACHEFS_ALLOC_FOREGROUND_H */
@@ -57,6 +57,21 @@ struct open_bucket {
 
 #define OPEN_BUCKET_LIST_MAX	15
 
+/*
+ * Per cpu cache of open buckets on a device, claimed from the freespace btree
+ * ahead of time:
+ */
+#define BCH_DEV_ALLOC_CACHE_NR	4
+
+struct bch_dev_alloc_cache {
+	spinlock_t		lock;
+	u8			nr;
+	open_bucket_idx_t	ob[BCH_DEV_ALLOC_CACHE_NR];
+
+	u64			hit;
+	u64			miss;
+};
+
 struct open_buckets {
 	open_bucket_idx_t	nr;
 	open_bucket_idx_t	v[OPEN_BUCKET_LIST_MAX];
@@ -735,6 +735,7 @@ missing:
 
 static int check_extent_to_backpointers(struct btree_trans *trans,
 					struct btree_iter *iter,
+					struct bpos end,
 					struct bpos bucket_start,
 					struct bpos bucket_end)
 {
@@ -752,6 +753,10 @@ static int check_extent_to_backpointers(struct btree_trans *trans,
 	if (!k.k)
 		return 0;
 
+	/* Past the end of the range this pass is walking: */
+	if (bpos_cmp(k.k->p, end) > 0)
+		return 1;
+
 	ptrs = bch2_bkey_ptrs_c(k);
 	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
 		struct bpos bucket_pos;
@@ -880,46 +885,49 @@ int bch2_get_btree_in_memory_pos(struct btree_trans *trans,
 	return ret;
 }
 
+/*
+ * Check the keys in @start-@end of btree @btree_id against the backpointers
+ * for the buckets in @bucket_start-@bucket_end; the root is checked by the range
+ * that ends the btree:
+ */
 static int bch2_check_extents_to_backpointers_pass(struct btree_trans *trans,
+						   enum btree_id btree_id,
+						   struct bpos start,
+						   struct bpos end,
 						   struct bpos bucket_start,
 						   struct bpos bucket_end)
 {
 	struct btree_iter iter;
-	enum btree_id btree_id;
+	unsigned depth = btree_type_has_ptrs(btree_id) ? 0 : 1;
 	int ret = 0;
 
-	for (btree_id = 0; btree_id < BTREE_ID_NR; btree_id++) {
-		unsigned depth = btree_type_has_ptrs(btree_id) ? 0 : 1;
-
-		bch2_trans_node_iter_init(trans, &iter, btree_id, POS_MIN, 0,
-					  depth,
-					  BTREE_ITER_ALL_LEVELS|
-					  BTREE_ITER_PREFETCH);
-
-		do {
-			ret = commit_do(trans, NULL, NULL,
-					BTREE_INSERT_LAZY_RW|
-					BTREE_INSERT_NOFAIL,
-					check_extent_to_backpointers(trans, &iter,
-								bucket_start, bucket_end));
-			if (ret)
-				break;
-		} while (!bch2_btree_iter_advance(&iter));
-
-		bch2_trans_iter_exit(trans, &iter);
-
-		if (ret)
-			break;
+	bch2_trans_node_iter_init(trans, &iter, btree_id, start, 0,
+				  depth,
+				  BTREE_ITER_ALL_LEVELS|
+				  BTREE_ITER_PREFETCH);
 
+	do {
 		ret = commit_do(trans, NULL, NULL,
 				BTREE_INSERT_LAZY_RW|
 				BTREE_INSERT_NOFAIL,
-				check_btree_root_to_backpointers(trans, btree_id,
+				check_extent_to_backpointers(trans, &iter, end,
 							bucket_start, bucket_end));
 		if (ret)
 			break;
-	}
-	return ret;
+	} while (!bch2_btree_iter_advance(&iter));
+
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (ret > 0)
+		ret = 0;
+	if (ret || bpos_cmp(end, SPOS_MAX))
+		return ret;
+
+	return commit_do(trans, NULL, NULL,
+			 BTREE_INSERT_LAZY_RW|
+			 BTREE_INSERT_NOFAIL,
+			 check_btree_root_to_backpointers(trans, btree_id,
+						bucket_start, bucket_end));
 }
 
 int bch2_get_alloc_in_memory_pos(struct btree_trans *trans,
@@ -970,13 +978,148 @@ int bch2_get_alloc_in_memory_pos(struct btree_trans *trans,
 	return ret;
 }
 
+/*
+ * Both directions of the check are split up and run on a pool of workers,
+ * each with its own btree_trans. Each pass is limited to what fits in memory
+ * of the btree being looked up into (alloc info, or extents); the btree being
+ * walked is split into ranges on leaf node boundaries, a few per worker, so
+ * that each pass walks it only once between all the workers:
+ */
+#define BACKPOINTERS_WORKERS_MAX	16
+#define BACKPOINTERS_CHUNKS_PER_WORKER	4
+
+struct bp_range {
+	enum btree_id		btree;
+	struct bpos		start;
+	struct bpos		end;
+};
+
+struct bp_check_work {
+	struct bch_fs		*c;
+	DARRAY(struct bp_range)	ranges;
+	atomic_t		next;
+	int			ret;
+
+	/* for checking extents to backpointers: */
+	struct bpos		bucket_start;
+	struct bpos		bucket_end;
+
+	/* for checking backpointers to extents: */
+	struct bbpos		start;
+	struct bbpos		end;
+};
+
+struct bp_check_worker {
+	struct closure		cl;
+	struct bp_check_work	*w;
+};
+
+static unsigned backpointers_nr_workers(void)
+{
+	return clamp_t(unsigned, num_online_cpus(), 1, BACKPOINTERS_WORKERS_MAX);
+}
+
+static void bp_check_run(struct bp_check_work *w, closure_fn *fn)
+{
+	struct bp_check_worker workers[BACKPOINTERS_WORKERS_MAX];
+	struct closure cl;
+	unsigned i, nr = min_t(size_t, backpointers_nr_workers(), w->ranges.nr);
+
+	closure_init_stack(&cl);
+	for (i = 0; i < nr; i++) {
+		workers[i].w = w;
+		closure_call(&workers[i].cl, fn, system_unbound_wq, &cl);
+	}
+	closure_sync(&cl);
+}
+
+static void bch2_check_extents_to_backpointers_worker(struct closure *cl)
+{
+	struct bp_check_worker *worker = container_of(cl, struct bp_check_worker, cl);
+	struct bp_check_work *w = worker->w;
+	struct btree_trans trans;
+	unsigned i;
+	int ret;
+
+	bch2_trans_init(&trans, w->c, 0, 0);
+
+	while (!READ_ONCE(w->ret) &&
+	       (i = atomic_inc_return(&w->next) - 1) < w->ranges.nr) {
+		struct bp_range *r = w->ranges.data + i;
+
+		ret = bch2_check_extents_to_backpointers_pass(&trans,
+					r->btree, r->start, r->end,
+					w->bucket_start, w->bucket_end);
+		if (ret)
+			cmpxchg(&w->ret, 0, ret);
+	}
+
+	bch2_trans_exit(&trans);
+	closure_return(cl);
+}
+
+/*
+ * Split @btree_id into ranges on leaf node boundaries, a few per worker:
+ */
+static int bp_btree_ranges(struct btree_trans *trans, enum btree_id btree_id,
+			   struct bp_check_work *w)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	DARRAY(struct bpos) leaves;
+	struct bpos start = POS_MIN;
+	unsigned i, nr_chunks = backpointers_nr_workers() *
+		BACKPOINTERS_CHUNKS_PER_WORKER;
+	int ret = 0;
+
+	darray_init(&leaves);
+
+	bch2_trans_node_iter_init(trans, &iter, btree_id, POS_MIN, 0, 1, 0);
+	do {
+		k = __bch2_btree_iter_peek_and_restart(trans, &iter, 0);
+		ret = bkey_err(k);
+		if (!k.k || ret)
+			break;
+
+		ret = darray_push(&leaves, k.k->p);
+		if (ret)
+			break;
+	} while (bch2_btree_iter_advance(&iter));
+	bch2_trans_iter_exit(trans, &iter);
+
+	for (i = 1; !ret && i < nr_chunks; i++) {
+		struct bpos *end = leaves.data + div_u64((u64) leaves.nr * i, nr_chunks);
+
+		if (end < leaves.data + leaves.nr &&
+		    bpos_cmp(*end, start) >= 0 &&
+		    bpos_cmp(*end, SPOS_MAX)) {
+			ret = darray_push(&w->ranges, ((struct bp_range) { btree_id, start, *end }));
+			start = bpos_successor(*end);
+		}
+	}
+
+	if (!ret)
+		ret = darray_push(&w->ranges, ((struct bp_range) { btree_id, start, SPOS_MAX }));
+
+	darray_exit(&leaves);
+	return ret;
+}
+
 int bch2_check_extents_to_backpointers(struct bch_fs *c)
 {
 	struct btree_trans trans;
+	struct bp_check_work w = { .c = c };
 	struct bpos start = POS_MIN, end;
-	int ret;
+	enum btree_id btree_id;
+	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
+
+	for (btree_id = 0; btree_id < BTREE_ID_NR && !ret; btree_id++)
+		ret = bp_btree_ranges(&trans, btree_id, &w);
+	if (ret)
+		goto err;
+
 	while (1) {
 		ret = bch2_get_alloc_in_memory_pos(&trans, start, &end);
 		if (ret)
@@ -999,14 +1142,22 @@ int bch2_check_extents_to_backpointers(struct bch_fs *c)
 			printbuf_exit(&buf);
 		}
 
-		ret = bch2_check_extents_to_backpointers_pass(&trans, start, end);
+		w.bucket_start	= start;
+		w.bucket_end	= end;
+		w.ret		= 0;
+		atomic_set(&w.next, 0);
+
+		bch2_trans_unlock(&trans);
+		bp_check_run(&w, bch2_check_extents_to_backpointers_worker);
+		ret = w.ret;
 		if (ret || !bpos_cmp(end, SPOS_MAX))
 			break;
 
 		start = bpos_successor(end);
 	}
+err:
 	bch2_trans_exit(&trans);
-
+	darray_exit(&w.ranges);
 	return ret;
 }
 
@@ -1055,6 +1206,8 @@ fsck_err:
 }
 
 static int bch2_check_backpointers_to_extents_pass(struct btree_trans *trans,
+						   struct bpos bucket_start,
+						   struct bpos bucket_end,
 						   struct bbpos start,
 						   struct bbpos end)
 {
@@ -1062,10 +1215,13 @@ static int bch2_check_backpointers_to_extents_pass(struct btree_trans *trans,
 	struct bkey_s_c k;
 	int ret = 0;
 
-	for_each_btree_key(trans, iter, BTREE_ID_alloc, POS_MIN,
+	for_each_btree_key(trans, iter, BTREE_ID_alloc, bucket_start,
 			   BTREE_ITER_PREFETCH, k, ret) {
 		u64 bp_offset = 0;
 
+		if (bpos_cmp(iter.pos, bucket_end) > 0)
+			break;
+
 		while (!(ret = commit_do(trans, NULL, NULL,
 					 BTREE_INSERT_LAZY_RW|
 					 BTREE_INSERT_NOFAIL,
@@ -1080,13 +1236,42 @@ static int bch2_check_backpointers_to_extents_pass(struct btree_trans *trans,
 	return ret < 0 ? ret : 0;
 }
 
+static void bch2_check_backpointers_to_extents_worker(struct closure *cl)
+{
+	struct bp_check_worker *worker = container_of(cl, struct bp_check_worker, cl);
+	struct bp_check_work *w = worker->w;
+	struct btree_trans trans;
+	unsigned i;
+	int ret;
+
+	bch2_trans_init(&trans, w->c, 0, 0);
+
+	while (!READ_ONCE(w->ret) &&
+	       (i = atomic_inc_return(&w->next) - 1) < w->ranges.nr) {
+		struct bp_range *r = w->ranges.data + i;
+
+		ret = bch2_check_backpointers_to_extents_pass(&trans,
+					r->start, r->end, w->start, w->end);
+		if (ret)
+			cmpxchg(&w->ret, 0, ret);
+	}
+
+	bch2_trans_exit(&trans);
+	closure_return(cl);
+}
+
 int bch2_check_backpointers_to_extents(struct bch_fs *c)
 {
 	struct btree_trans trans;
+	struct bp_check_work w = { .c = c };
 	struct bbpos start = (struct bbpos) { .btree = 0, .pos = POS_MIN, }, end;
 	int ret;
 
 	bch2_trans_init(&trans, c, 0, 0);
+	ret = bp_btree_ranges(&trans, BTREE_ID_alloc, &w);
+	if (ret)
+		goto err;
+
 	while (1) {
 		ret = bch2_get_btree_in_memory_pos(&trans,
 						   (1U << BTREE_ID_extents)|
@@ -1115,13 +1300,22 @@ int bch2_check_backpointers_to_extents(struct bch_fs *c)
 			printbuf_exit(&buf);
 		}
 
-		ret = bch2_check_backpointers_to_extents_pass(&trans, start, end);
+		w.start	= start;
+		w.end	= end;
+		w.ret	= 0;
+		atomic_set(&w.next, 0);
+
+		bch2_trans_unlock(&trans);
+		bp_check_run(&w, bch2_check_backpointers_to_extents_worker);
+		ret = w.ret;
 		if (ret || !bbpos_cmp(end, BBPOS_MAX))
 			break;
 
 		start = bbpos_successor(end);
 	}
+err:
 	bch2_trans_exit(&trans);
+	darray_exit(&w.ranges);
 
 	return ret;
 }
@@ -218,6 +218,10 @@ do {									\
 	trace_##_name(__VA_ARGS__);					\
 } while (0)
 
+/* Non persistent counters, see BCH_FS_COUNTERS(): */
+#define count_event(_c, _name)						\
+	this_cpu_inc((_c)->fs_counters[BCH_FS_COUNTER_##_name])
+
 #define bch2_fs_init_fault(name)					\
 	dynamic_fault("bcachefs:bch_fs_init:" name)
 #define bch2_meta_read_fault(name)					\
@@ -344,8 +348,15 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(journal_noflush_write)		\
 	x(journal_flush_seq)			\
 	x(blocked_journal)			\
+	x(blocked_journal_reclaim)		\
 	x(blocked_allocate)			\
-	x(blocked_allocate_open_bucket)
+	x(blocked_allocate_open_bucket)		\
+	x(bucket_invalidate)			\
+	x(copygc_select)			\
+	x(recovery_journal_read)		\
+	x(recovery_journal_keys_sort)		\
+	x(recovery_alloc_read)			\
+	x(recovery_journal_replay)
 
 enum bch_time_stats {
 #define x(name) BCH_TIME_##name,
@@ -354,15 +365,40 @@ enum bch_time_stats {
 	BCH_TIME_STAT_NR
 };
 
+/*
+ * Hot path events that are cheap to count but not worth keeping in the
+ * superblock (those are BCH_PERSISTENT_COUNTERS()): percpu, zeroed at mount.
+ */
+#define BCH_FS_COUNTERS()			\
+	x(trans_begin)				\
+	x(trans_restart)			\
+	x(key_cache_hit)			\
+	x(key_cache_fill)			\
+	x(btree_node_prefetch)			\
+	x(write_bounce_alloc)			\
+	x(bounce_pages_mempool)			\
+	x(bounce_pages_refill)			\
+	x(bounce_pages_contig)
+
+enum bch_fs_counters {
+#define x(name) BCH_FS_COUNTER_##name,
+	BCH_FS_COUNTERS()
+#undef x
+	BCH_FS_COUNTER_NR
+};
+
 #include "alloc_types.h"
 #include "btree_types.h"
 #include "buckets_types.h"
 #include "buckets_waiting_for_journal_types.h"
 #include "clock_types.h"
+#include "dirent_types.h"
 #include "ec_types.h"
+#include "io_types.h"
 #include "journal_types.h"
 #include "keylist_types.h"
 #include "quota_types.h"
+#include "read_cache_types.h"
 #include "rebalance_types.h"
 #include "replicas_types.h"
 #include "subvolume_types.h"
@@ -413,7 +449,8 @@ struct gc_pos {
 struct reflink_gc {
 	u64		offset;
 	u32		size;
-	u32		refcount;
+	/* atomic: initial gc marks btrees from several threads at once */
+	atomic_t	refcount;
 };
 
 typedef GENRADIX(struct reflink_gc) reflink_gc_table;
@@ -457,9 +494,11 @@ struct bch_dev {
 	 * Or rcu_read_lock(), but only for ptr_stale():
 	 */
 	struct bucket_array __rcu *buckets_gc;
+	GENRADIX(u32)		gc_bucket_stripes;
 	struct bucket_gens __rcu *bucket_gens;
 	u8			*oldest_gen;
 	unsigned long		*buckets_nouse;
+	struct copygc_candidates *copygc_candidates;
 	struct rw_semaphore	bucket_lock;
 
 	struct bch_dev_usage		*usage_base;
@@ -468,7 +507,11 @@ struct bch_dev {
 
 	/* Allocator: */
 	u64			new_fs_bucket_idx;
+	/* nonzero while shrinking: don't allocate buckets past this */
+	u64			shrink_nbuckets;
 	u64			bucket_alloc_trans_early_cursor;
+	/* no live lru entries for this device below this: see lru.c */
+	atomic64_t		lru_cursor;
 
 	unsigned		nr_open_buckets;
 	unsigned		nr_btree_reserve;
@@ -476,6 +519,8 @@ struct bch_dev {
 	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT];
 	open_bucket_idx_t	open_buckets_partial_nr;
 
+	struct bch_dev_alloc_cache __percpu *alloc_cache;
+
 	size_t			inc_gen_needs_gc;
 	size_t			inc_gen_really_needs_gc;
 	size_t			buckets_waiting_on_journal;
@@ -483,18 +528,22 @@ struct bch_dev {
 	atomic64_t		rebalance_work;
 
 	struct journal_device	journal;
-	u64			prev_journal_sector;
 
 	struct work_struct	io_error_work;
 
 	/* The rest of this all shows up in sysfs */
 	atomic64_t		cur_latency[2];
 	struct time_stats	io_latency[2];
+	/* by data type, [rw][bch_data_type]: */
+	struct time_stats	io_latency_by_type[2][BCH_DATA_NR];
 
 #define CONGESTED_MAX		1024
 	atomic_t		congested;
 	u64			congested_last;
 
+	atomic_t		writes_in_flight;
+	atomic_t		reads_in_flight;
+
 	struct io_count __percpu *io_done;
 };
 
@@ -520,6 +569,7 @@ enum {
 	BCH_FS_FSCK_DONE,
 	BCH_FS_INITIAL_GC_UNFIXED,	/* kill when we enumerate fsck errors */
 	BCH_FS_NEED_ANOTHER_GC,
+	BCH_FS_GC_PARALLEL,		/* journal keys can't be inserted */
 
 	BCH_FS_HAVE_DELETED_SNAPSHOTS,
 
@@ -536,16 +586,37 @@ struct btree_debug {
 
 #define BCH_TRANSACTIONS_NR 128
 
+/*
+ * Restart reasons are the transaction_restart_* errcodes, which are
+ * contiguous: index 0 is transaction_restart itself.
+ */
+#define BCH_TRANS_RESTART_NR						\
+	(BCH_ERR_transaction_restart_nested - BCH_ERR_transaction_restart + 1)
+
 struct btree_transaction_stats {
 	struct mutex		lock;
 	struct time_stats       lock_hold_times;
 	unsigned		nr_max_paths;
 	unsigned		max_mem;
 	char			*max_paths_text;
+
+	/* per restart reason: number of restarts, and time thrown away */
+	atomic64_t		restarts[BCH_TRANS_RESTART_NR];
+	atomic64_t		restart_wasted_ns[BCH_TRANS_RESTART_NR];
+};
+
+struct inode_alloc_range {
+	u64			pos;
+	u64			end;
 };
 
 struct bch_fs_pcpu {
 	u64			sectors_available;
+
+	/* Cached buffers, see compress.c: */
+	void			*compression_bounce[2];
+	void			*compress_workspace[BCH_COMPRESSION_TYPE_NR];
+	void			*decompress_workspace;
 };
 
 struct journal_seq_blacklist_table {
@@ -577,17 +648,41 @@ struct journal_keys {
 	size_t			size;
 };
 
+/*
+ * Per cpu cache of the path arrays and memory of the last transaction to exit,
+ * so that short transactions don't have to allocate. @mem holds its size in
+ * its first word while it's cached:
+ */
 struct btree_path_buf {
 	struct btree_path	*path;
+	void			*mem;
 };
 
 #define REPLICAS_DELTA_LIST_MAX	(1U << 16)
 
+/*
+ * Ancestors are always at higher ids than their descendents: is_ancestor has a
+ * bit for each of the next SNAPSHOT_ANCESTOR_BITMAP ids above a node, and skip
+ * is a jump pointer to an ancestor further up, so bch2_snapshot_is_ancestor()
+ * doesn't have to walk parent pointers one at a time:
+ */
+#define SNAPSHOT_ANCESTOR_BITMAP	128
+
 struct snapshot_t {
 	u32			parent;
 	u32			children[2];
 	u32			subvol; /* Nonzero only if a subvolume points to this node: */
 	u32			equiv;
+	u32			depth;
+	u32			skip;
+	unsigned long		is_ancestor[BITS_TO_LONGS(SNAPSHOT_ANCESTOR_BITMAP)];
+};
+
+/* Indexed by U32_MAX - snapshot ID, since IDs are allocated downwards: */
+struct snapshot_table {
+	struct rcu_head		rcu;
+	size_t			nr;
+	struct snapshot_t	s[];
 };
 
 typedef struct {
@@ -598,6 +693,25 @@ typedef struct {
 #define BCACHEFS_ROOT_SUBVOL_INUM					\
 	((subvol_inum) { BCACHEFS_ROOT_SUBVOL,	BCACHEFS_ROOT_INO })
 
+/*
+ * Progress of the current fsck pass: the fraction done is estimated from which
+ * leaf node of the btree being walked we've reached, since keys per inode
+ * number vary too much for positions to be useful on their own:
+ */
+struct fsck_progress {
+	const char		*pass;
+	u64			start_time;
+	unsigned long		last_report;
+	/* per cpu, so that threads checking keys don't share a cacheline: */
+	u64 __percpu		*nr_keys;
+
+	spinlock_t		lock;
+	enum btree_id		btree;
+	struct bpos		pos;
+	/* end positions of the leaf nodes in @btree: */
+	DARRAY(struct bpos)	leaves;
+};
+
 struct bch_fs {
 	struct closure		cl;
 
@@ -626,6 +740,7 @@ struct bch_fs {
 
 	struct bch_replicas_cpu replicas;
 	struct bch_replicas_cpu replicas_gc;
+	struct bch_replicas_hash *replicas_hash;
 	struct mutex		replicas_gc_lock;
 	mempool_t		replicas_delta_pool;
 
@@ -637,6 +752,8 @@ struct bch_fs {
 	struct bch_disk_groups_cpu __rcu *disk_groups;
 
 	struct bch_opts		opts;
+	struct bch_io_opts_cache io_opts_cache;
+	struct bch_extent_hole_cache extent_hole_cache;
 
 	/* Updated by bch2_sb_update():*/
 	struct {
@@ -669,9 +786,15 @@ struct bch_fs {
 	struct closure		sb_write;
 	struct mutex		sb_lock;
 
+	/* Coalesced superblock writes, see bch2_write_super_async(): */
+	u64			sb_write_seq;
+	u64			sb_written_seq;
+	int			sb_write_ret;
+	struct delayed_work	sb_write_work;
+	wait_queue_head_t	sb_write_wait;
+
 	/* snapshot.c: */
-	GENRADIX(struct snapshot_t) snapshots;
-	struct bch_snapshot_table __rcu *snapshot_table;
+	struct snapshot_table __rcu *snapshots;
 	struct mutex		snapshot_table_lock;
 	struct work_struct	snapshot_delete_work;
 	struct work_struct	snapshot_wait_for_pagecache_and_delete_work;
@@ -720,8 +843,22 @@ struct bch_fs {
 	struct btree_key_cache	btree_key_cache;
 	unsigned		btree_key_cache_btrees;
 
+	/* btree_update_leaf.c: bch2_btree_insert_grouped() */
+	spinlock_t		btree_group_commit_lock;
+	struct list_head	btree_group_commit_pending;
+	bool			btree_group_commit_leader;
+	wait_queue_head_t	btree_group_commit_wait;
+
+	/* btree_io.c: bch2_btree_node_compact_defer() */
+	spinlock_t		btree_compact_lock;
+	unsigned		btree_compact_nr;
+	struct btree_compact_entry btree_compact_queue[BTREE_COMPACT_QUEUE];
+	struct work_struct	btree_compact_work;
+
 	struct workqueue_struct	*btree_update_wq;
 	struct workqueue_struct	*btree_io_complete_wq;
+	/* btree node read completions: validate, sort, build aux trees */
+	struct workqueue_struct	*btree_read_complete_wq;
 	/* copygc needs its own workqueue for index updates.. */
 	struct workqueue_struct	*copygc_wq;
 
@@ -784,6 +921,8 @@ struct bch_fs {
 
 	struct buckets_waiting_for_journal buckets_waiting_for_journal;
 	struct work_struct	discard_work;
+	struct bch_ratelimit	discard_bw_limit;
+	struct bch_ratelimit	discard_iops_limit;
 	struct work_struct	invalidate_work;
 
 	/* GARBAGE COLLECTION */
@@ -793,6 +932,7 @@ struct bch_fs {
 
 	enum btree_id		gc_gens_btree;
 	struct bpos		gc_gens_pos;
+	u64			gc_gens_start_time;
 
 	/*
 	 * Tracks GC's progress - everything in the range [ZERO_KEY..gc_cur_pos]
@@ -819,16 +959,28 @@ struct bch_fs {
 	struct bio_set		bio_write;
 	struct mutex		bio_bounce_pages_lock;
 	mempool_t		bio_bounce_pages;
+	struct bch_bounce_page_cache __percpu *bounce_page_cache;
 	struct rhashtable	promote_table;
+	struct bch_promote_filter promote_filter;
+	struct bch_io_sched	io_sched;
+	struct bch_read_cache	read_cache;
+	struct bch_dirent_neg_cache dirent_neg_cache;
 
 	mempool_t		compression_bounce[2];
 	mempool_t		compress_workspace[BCH_COMPRESSION_TYPE_NR];
 	mempool_t		decompress_workspace;
 	ZSTD_parameters		zstd_params;
+	ZSTD_parameters		zstd_params_fast;
+	void			*zstd_dict;
+	u32			zstd_dict_id;
+	ZSTD_CDict		*zstd_cdict;
+	ZSTD_DDict		*zstd_ddict;
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
 	struct crypto_shash	*poly1305;
+	struct crypto_sync_skcipher *aes256_ctr;
+	struct crypto_shash	*ghash;
 
 	atomic64_t		key_version;
 
@@ -864,6 +1016,7 @@ struct bch_fs {
 	struct mutex		ec_stripe_new_lock;
 
 	struct work_struct	ec_stripe_create_work;
+	struct delayed_work	ec_stripe_flush_work;
 	u64			ec_stripe_hint;
 
 	struct bio_set		ec_bioset;
@@ -871,6 +1024,9 @@ struct bch_fs {
 	struct work_struct	ec_stripe_delete_work;
 	struct llist_head	ec_stripe_delete_list;
 
+	struct mutex		ec_recov_cache_lock;
+	struct ec_recov_cache_entry ec_recov_cache[EC_RECOV_CACHE_NR];
+
 	/* REFLINK */
 	u64			reflink_hint;
 	reflink_gc_table	reflink_gc_table;
@@ -891,8 +1047,21 @@ struct bch_fs {
 	struct mutex		fsck_error_lock;
 	bool			fsck_alloc_err;
 
+	/*
+	 * For fsck_quick: btrees written to since mount, and whether the
+	 * fsck_checkpoint superblock section is still valid, see
+	 * bch2_fsck_checkpoint_read()
+	 */
+	unsigned long		btrees_written;
+	bool			fsck_checkpoint_valid;
+	/* btrees fsck needs to check, all of them unless fsck_quick: */
+	unsigned long		fsck_btrees;
+
+	struct fsck_progress	fsck_progress;
+
 	/* QUOTAS */
 	struct bch_memquota_type quotas[QTYP_NR];
+	struct bch_quota_pcpu __percpu *quota_pcpu;
 
 	/* DEBUG JUNK */
 	struct dentry		*fs_debug_dir;
@@ -904,6 +1073,14 @@ struct bch_fs {
 
 	u64			*unused_inode_hints;
 	unsigned		inode_shard_bits;
+	/*
+	 * When not sharding inode numbers: per cpu ranges handed out from
+	 * @inode_alloc_cursor, which is seeded from the highest inode number in
+	 * use the first time it's needed:
+	 */
+	struct inode_alloc_range *inode_alloc_ranges;
+	atomic64_t		inode_alloc_cursor;
+	bool			inode_alloc_cursor_seeded;
 
 	/*
 	 * A btree node on disk could have too many bsets for an iterator to fit
@@ -923,6 +1100,12 @@ struct bch_fs {
 
 	u64			counters_on_mount[BCH_COUNTER_NR];
 	u64 __percpu		*counters;
+	u64 __percpu		*fs_counters;
+
+	/* counters_rate: values and time as of the last read */
+	struct mutex		counters_rate_lock;
+	u64			counters_rate_time;
+	u64			counters_rate_last[BCH_COUNTER_NR + BCH_FS_COUNTER_NR];
 
 	unsigned		btree_gc_periodic:1;
 	unsigned		copy_gc_enabled:1;
@@ -932,6 +1115,10 @@ struct bch_fs {
 
 	const char              *btree_transaction_fns[BCH_TRANSACTIONS_NR];
 	struct btree_transaction_stats btree_transaction_stats[BCH_TRANSACTIONS_NR];
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	/* time spent blocked on six locks, indexed by six_lock_type: */
+	struct time_stats	btree_lock_wait_times[BTREE_ID_NR][BTREE_MAX_DEPTH][3];
+#endif
 };
 
 static inline void bch2_set_ra_pages(struct bch_fs *c, unsigned ra_pages)
@@ -717,6 +717,24 @@ struct bch_inode_v2 {
 	__u8			fields[0];
 } __attribute__((packed, aligned(8)));
 
+/*
+ * Small xattrs may also be cached after the varint fields of an inode_v2: a
+ * BCH_INODE_XATTRS_INLINE_MAGIC byte, the size of the entries that follow, then
+ * the entries. When present it has every xattr the inode has, so ACL and
+ * security label lookups don't need the xattrs btree; the xattrs btree is
+ * still authoritative, and versions that don't know about the cache drop it
+ * when they rewrite the inode:
+ */
+#define BCH_INODE_XATTRS_INLINE_MAGIC	0xa7
+#define BCH_INODE_XATTRS_INLINE_MAX	128
+
+struct bch_inode_xattr_inline {
+	__u8			x_type;
+	__u8			x_name_len;
+	__u8			x_val_len;
+	char			x_name[];
+} __attribute__((packed));
+
 struct bch_inode_generation {
 	struct bch_val		v;
 
@@ -753,7 +771,9 @@ struct bch_inode_generation {
 	x(bi_dir,			64)	\
 	x(bi_dir_offset,		64)	\
 	x(bi_subvol,			32)	\
-	x(bi_parent_subvol,		32)
+	x(bi_parent_subvol,		32)	\
+	x(bi_zstd_dict,			8)	\
+	x(bi_promote_min_reads,		8)
 
 /* subset of BCH_INODE_FIELDS */
 #define BCH_INODE_OPTS()			\
@@ -765,7 +785,9 @@ struct bch_inode_generation {
 	x(promote_target,		16)	\
 	x(foreground_target,		16)	\
 	x(background_target,		16)	\
-	x(erasure_code,			16)
+	x(erasure_code,			16)	\
+	x(zstd_dict,			8)	\
+	x(promote_min_reads,		8)
 
 enum inode_opt_id {
 #define x(name, ...)				\
@@ -1102,7 +1124,12 @@ struct bch_sb_field {
 	x(replicas,	7)			\
 	x(journal_seq_blacklist, 8)		\
 	x(journal_v2,	9)			\
-	x(counters,	10)
+	x(counters,	10)			\
+	x(zstd_dict,	11)			\
+	x(fsck_checkpoint, 12)			\
+	x(migrate_cursor, 13)			\
+	x(scrub_cursor,	14)			\
+	x(btree_cache_hot, 15)
 
 enum bch_sb_field_type {
 #define x(f, nr)	BCH_SB_FIELD_##f = nr,
@@ -1412,7 +1439,31 @@ struct bch_sb_field_disk_groups {
 	x(trans_traverse_all,				71)	\
 	x(transaction_commit,				72)	\
 	x(write_super,					73)	\
-	x(trans_restart_would_deadlock_recursion_limit,	74)
+	x(trans_restart_would_deadlock_recursion_limit,	74)	\
+	x(compression_bounce_wait,			75)	\
+	x(compression_workspace_wait,			76)	\
+	x(compression_skip_incompressible,		77)	\
+	x(compression_fast,				78)	\
+	x(btree_node_cache_hit,				79)	\
+	x(btree_node_cache_miss,			80)	\
+	x(btree_node_cache_ghost_hit,			81)	\
+	x(discard_queued,				82)	\
+	x(discard_coalesced,				83)	\
+	x(discard_issued,				84)	\
+	x(read_cache_hit,				85)	\
+	x(read_cache_miss,				86)	\
+	x(inode_alloc_range_refill,			87)	\
+	x(inode_alloc_collision,			88)	\
+	x(promote_accepted,				89)	\
+	x(promote_rejected,				90)	\
+	x(btree_node_read_hedge,			91)	\
+	x(btree_node_read_hedge_won,			92)	\
+	x(btree_node_compact_background,		93)	\
+	x(btree_node_split_async,			94)	\
+	x(lru_cursor_advance,				95)	\
+	x(lru_cursor_lower,				96)	\
+	x(scrub_error,					97)	\
+	x(scrub_repaired,				98)
 
 enum bch_persistent_counters {
 #define x(t, n, ...) BCH_COUNTER_##t,
@@ -1426,6 +1477,79 @@ struct bch_sb_field_counters {
 	__le64			d[0];
 };
 
+/*
+ * Trained zstd dictionary, used when the zstd_dict option is set: the
+ * dictionary ID in the zstd frame header tells us which extents need it.
+ */
+struct bch_sb_field_zstd_dict {
+	struct bch_sb_field	field;
+	__le32			dict_id;
+	__le32			dict_len;
+	__u8			data[];
+};
+
+/*
+ * Btrees written to since the last fsck that completed without errors, as a
+ * bitmap of btree ids, for the fsck_quick option: only meaningful if
+ * @journal_seq matches the clean section, i.e. the last shutdown was clean and
+ * done by a version that updates this field. Zero @journal_seq means invalid.
+ */
+struct bch_sb_field_fsck_checkpoint {
+	struct bch_sb_field	field;
+	__le64			journal_seq;
+	__le64			btrees_written;
+};
+
+/*
+ * Position a device evacuate (BCH_DATA_OP_MIGRATE) had reached: all data before
+ * @btree_id:@inode:@offset:@snapshot has been moved off of @dev, as long as @dev
+ * hasn't been made read-write since.
+ */
+struct bch_sb_field_migrate_cursor {
+	struct bch_sb_field	field;
+	__le32			dev;
+	__u8			btree_id;
+	__u8			pad[3];
+	__le64			inode;
+	__le64			offset;
+	__le32			snapshot;
+	__le32			pad2;
+};
+
+/*
+ * Position a scrub (BCH_DATA_OP_SCRUB) had reached: every bucket before
+ * @dev:@bucket has been checked, in the pass started at @time (seconds since
+ * the epoch).
+ */
+struct bch_sb_field_scrub_cursor {
+	struct bch_sb_field	field;
+	__le32			dev;
+	__le32			pad;
+	__le64			bucket;
+	__le64			time;
+};
+
+/*
+ * Btree nodes that were hot in the btree node cache, saved periodically and on
+ * shutdown, and read back in after mount so that we don't start with a cold
+ * cache. Nodes are identified by position, not by pointer - to be found via
+ * their parent - so that a stale entry costs at most a wasted read. Sorted by
+ * btree, then level (highest first), then position.
+ */
+struct bch_btree_cache_hot_node {
+	__u8			btree_id;
+	__u8			level;
+	__u8			pad[2];
+	__le32			snapshot;
+	__le64			inode;
+	__le64			offset;
+};
+
+struct bch_sb_field_btree_cache_hot {
+	struct bch_sb_field	field;
+	struct bch_btree_cache_hot_node nodes[0];
+};
+
 /*
  * On clean shutdown, store btree roots and current journal sequence number in
  * the superblock:
@@ -1578,7 +1702,7 @@ struct bch_sb {
  * BCH_SB_128_BIT_MACS	- 128 bit macs instead of 80
  * BCH_SB_ENCRYPTION_TYPE - if nonzero encryption is enabled; overrides
  *			   DATA/META_CSUM_TYPE. Also indicates encryption
- *			   algorithm in use, if/when we get more than one
+ *			   algorithm in use, enum bch_encryption_type
  */
 
 LE16_BITMASK(BCH_SB_BLOCK_SIZE,		struct bch_sb, block_size, 0, 16);
@@ -1643,6 +1767,10 @@ LE64_BITMASK(BCH_SB_JOURNAL_FLUSH_DISABLED,struct bch_sb, flags[3], 62, 63);
 LE64_BITMASK(BCH_SB_JOURNAL_RECLAIM_DELAY,struct bch_sb, flags[4], 0, 32);
 /* Obsolete, always enabled: */
 LE64_BITMASK(BCH_SB_JOURNAL_TRANSACTION_NAMES,struct bch_sb, flags[4], 32, 33);
+LE64_BITMASK(BCH_SB_ZSTD_DICT,		struct bch_sb, flags[4], 33, 34);
+LE64_BITMASK(BCH_SB_COMPRESSION_ADAPTIVE,struct bch_sb, flags[4], 34, 35);
+LE64_BITMASK(BCH_SB_PROMOTE_MIN_READS,	struct bch_sb, flags[4], 35, 43);
+LE64_BITMASK(BCH_SB_JOURNAL_COMPRESSION_TYPE,struct bch_sb, flags[4], 43, 47);
 
 /*
  * Features:
@@ -1652,6 +1780,10 @@ LE64_BITMASK(BCH_SB_JOURNAL_TRANSACTION_NAMES,struct bch_sb, flags[4], 32, 33);
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_siphash
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * zstd_dict:			gates BCH_SB_FIELD_zstd_dict
+ * xxh3:			gates BCH_CSUM_xxh3, BCH_CSUM_xxh3_128, BCH_STR_HASH_xxh3
+ * aes256_gcm:			gates BCH_ENCRYPTION_aes256_gcm
+ * journal_compression:		gates JSET_COMPRESSION_TYPE
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -1672,7 +1804,11 @@ LE64_BITMASK(BCH_SB_JOURNAL_TRANSACTION_NAMES,struct bch_sb, flags[4], 32, 33);
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
 	x(alloc_v2,			17)	\
-	x(extents_across_btree_nodes,	18)
+	x(extents_across_btree_nodes,	18)	\
+	x(zstd_dict,			19)	\
+	x(xxh3,				20)	\
+	x(aes256_gcm,			21)	\
+	x(journal_compression,		22)
 
 #define BCH_SB_FEATURES_ALWAYS				\
 	((1ULL << BCH_FEATURE_new_extent_overwrite)|	\
@@ -1730,7 +1866,8 @@ enum bch_error_actions {
 	x(crc32c,		0)	\
 	x(crc64,		1)	\
 	x(siphash_old,		2)	\
-	x(siphash,		3)
+	x(siphash,		3)	\
+	x(xxh3,			4)
 
 enum bch_str_hash_type {
 #define x(t, n) BCH_STR_HASH_##t = n,
@@ -1742,7 +1879,8 @@ enum bch_str_hash_type {
 #define BCH_STR_HASH_OPTS()		\
 	x(crc32c,		0)	\
 	x(crc64,		1)	\
-	x(siphash,		2)
+	x(siphash,		2)	\
+	x(xxh3,			3)
 
 enum bch_str_hash_opts {
 #define x(t, n) BCH_STR_HASH_OPT_##t = n,
@@ -1759,7 +1897,11 @@ enum bch_str_hash_opts {
 	x(chacha20_poly1305_128,	4)	\
 	x(crc32c,			5)	\
 	x(crc64,			6)	\
-	x(xxhash,			7)
+	x(xxhash,			7)	\
+	x(xxh3,				8)	\
+	x(xxh3_128,			9)	\
+	x(aes256_gcm_80,		10)	\
+	x(aes256_gcm_128,		11)
 
 enum bch_csum_type {
 #define x(t, n) BCH_CSUM_##t = n,
@@ -1775,8 +1917,12 @@ static const unsigned bch_crc_bytes[] = {
 	[BCH_CSUM_crc64_nonzero]		= 8,
 	[BCH_CSUM_crc64]			= 8,
 	[BCH_CSUM_xxhash]			= 8,
+	[BCH_CSUM_xxh3]				= 8,
+	[BCH_CSUM_xxh3_128]			= 16,
 	[BCH_CSUM_chacha20_poly1305_80]		= 10,
 	[BCH_CSUM_chacha20_poly1305_128]	= 16,
+	[BCH_CSUM_aes256_gcm_80]		= 10,
+	[BCH_CSUM_aes256_gcm_128]		= 16,
 };
 
 static inline _Bool bch2_csum_type_is_encryption(enum bch_csum_type type)
@@ -1784,17 +1930,46 @@ static inline _Bool bch2_csum_type_is_encryption(enum bch_csum_type type)
 	switch (type) {
 	case BCH_CSUM_chacha20_poly1305_80:
 	case BCH_CSUM_chacha20_poly1305_128:
+	case BCH_CSUM_aes256_gcm_80:
+	case BCH_CSUM_aes256_gcm_128:
 		return true;
 	default:
 		return false;
 	}
 }
 
+static inline _Bool bch2_csum_type_is_aes(enum bch_csum_type type)
+{
+	return type == BCH_CSUM_aes256_gcm_80 ||
+		type == BCH_CSUM_aes256_gcm_128;
+}
+
+/*
+ * Values of BCH_SB_ENCRYPTION_TYPE:
+ *
+ * aes256_gcm is AES-256 in counter mode, with a GHASH MAC masked by the
+ * keystream block at the MAC nonce - GCM, with our own nonces as the counter
+ * block; both use the same key, from the crypt superblock field.
+ */
+#define BCH_ENCRYPTION_TYPES()		\
+	x(none,			0)	\
+	x(chacha20_poly1305,	1)	\
+	x(aes256_gcm,		2)
+
+enum bch_encryption_type {
+#define x(t, n) BCH_ENCRYPTION_##t = n,
+	BCH_ENCRYPTION_TYPES()
+#undef x
+	BCH_ENCRYPTION_NR
+};
+
 #define BCH_CSUM_OPTS()			\
 	x(none,			0)	\
 	x(crc32c,		1)	\
 	x(crc64,		2)	\
-	x(xxhash,		3)
+	x(xxhash,		3)	\
+	x(xxh3,			4)	\
+	x(xxh3_128,		5)
 
 enum bch_csum_opts {
 #define x(t, n) BCH_CSUM_OPT_##t = n,
@@ -2005,6 +2180,18 @@ struct jset {
 LE32_BITMASK(JSET_CSUM_TYPE,	struct jset, flags, 0, 4);
 LE32_BITMASK(JSET_BIG_ENDIAN,	struct jset, flags, 4, 5);
 LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
+LE32_BITMASK(JSET_COMPRESSION_TYPE,struct jset, flags, 6, 10);
+
+/*
+ * If JSET_COMPRESSION_TYPE is set, the entries in a jset are compressed (before
+ * encryption and checksumming): d[] is a jset_compressed, and jset->u64s is the
+ * size of that. The compressed data has the same format as compressed extents.
+ */
+struct jset_compressed {
+	__le32			u64s;	/* uncompressed size of d[] */
+	__le32			bytes;	/* size of data[] */
+	__u8			data[];
+} __attribute__((packed, aligned(8)));
 
 #define BCH_JOURNAL_BUCKETS_MIN		8
 
@@ -80,10 +80,15 @@ struct bch_ioctl_incremental {
 
 #define BCH_IOCTL_SUBVOLUME_CREATE _IOW(0xbc,	16,  struct bch_ioctl_subvolume)
 #define BCH_IOCTL_SUBVOLUME_DESTROY _IOW(0xbc,	17,  struct bch_ioctl_subvolume)
+#define BCH_IOCTL_FS_USAGE_COUNTERS _IOWR(0xbc, 18, struct bch_ioctl_fs_usage_counters)
+#define BCH_IOCTL_SUBVOLUME_CREATE_BATCH _IOWR(0xbc, 19, struct bch_ioctl_subvolume_batch)
+#define BCH_IOCTL_SUBVOLUME_DESTROY_BATCH _IOWR(0xbc, 20, struct bch_ioctl_subvolume_batch)
 
 /* ioctl below act on a particular file, not the filesystem as a whole: */
 
 #define BCHFS_IOC_REINHERIT_ATTRS	_IOR(0xbc, 64, const char __user *)
+#define BCHFS_IOC_REINHERIT_ATTRS_RECURSIVE _IO(0xbc, 65)
+#define BCHFS_IOC_CREATE_BATCH		_IOWR(0xbc, 66, struct bch_ioctl_create_batch)
 
 /*
  * BCH_IOCTL_QUERY_UUID: get filesystem UUID
@@ -178,7 +183,20 @@ enum bch_data_ops {
 	BCH_DATA_OP_REREPLICATE		= 1,
 	BCH_DATA_OP_MIGRATE		= 2,
 	BCH_DATA_OP_REWRITE_OLD_NODES	= 3,
-	BCH_DATA_OP_NR			= 4,
+	BCH_DATA_OP_DEFRAG		= 4,
+	BCH_DATA_OP_DEDUPE		= 5,
+	BCH_DATA_OP_NR			= 6,
+};
+
+/*
+ * Data job priorities: jobs are scheduled against foreground IO as the scrub,
+ * rebalance or copygc IO class respectively:
+ */
+enum bch_data_job_priority {
+	BCH_DATA_JOB_PRIO_LOW		= 0,
+	BCH_DATA_JOB_PRIO_NORMAL	= 1,
+	BCH_DATA_JOB_PRIO_HIGH		= 2,
+	BCH_DATA_JOB_PRIO_NR		= 3,
 };
 
 /*
@@ -189,7 +207,28 @@ enum bch_data_ops {
  * Reading from the file descriptor returns a struct bch_ioctl_data_event,
  * indicating current progress, and closing the file descriptor will stop the
  * job. The file descriptor is O_CLOEXEC.
+ *
+ * Jobs are independent, and several may run at the same time. Each job may be
+ * limited to @rate_mb MB/sec and @rate_iops extents (or btree nodes) moved per
+ * second, 0 meaning unlimited, and is scheduled against other IO according to
+ * @priority, an enum bch_data_job_priority.
+ *
+ * BCH_DATA_OP_MIGRATE periodically records its position in the superblock, and
+ * resumes from there if restarted on the same (still read-only) device, unless
+ * BCH_DATA_MIGRATE_RESTART is passed in @flags.
+ *
+ * BCH_DATA_OP_SCRUB reads and verifies the checksums of user data in buckets
+ * @start_pos to @end_pos (device:bucket), repairing bad copies, then checks
+ * erasure coded stripes. A scrub of the whole filesystem records its position
+ * the same way, and resumes unless BCH_DATA_SCRUB_RESTART is passed.
+ *
+ * BCH_DATA_OP_DEDUPE finds extents in inodes @start_pos.inode to
+ * @end_pos.inode with identical contents, and turns them into reflink pointers
+ * to a single copy.
  */
+#define BCH_DATA_MIGRATE_RESTART	(1 << 0)
+#define BCH_DATA_SCRUB_RESTART		(1 << 0)
+
 struct bch_ioctl_data {
 	__u16			op;
 	__u8			start_btree;
@@ -205,9 +244,26 @@ struct bch_ioctl_data {
 		__u32		pad;
 	}			migrate;
 	struct {
-		__u64		pad[8];
-	};
+		/* files with a smaller average extent size are rewritten: */
+		__u32		min_extent_sectors;
+		/*
+		 * as are files spread over more than this many times the
+		 * number of buckets they'd need:
+		 */
+		__u32		max_bucket_ratio;
+	}			defrag;
+	struct {
+		/* smaller extents aren't deduplicated: */
+		__u32		min_extent_sectors;
+		__u32		pad;
+	}			dedupe;
 	};
+
+	__u32			rate_mb;
+	__u32			rate_iops;
+	__u8			priority;
+	__u8			pad8[7];
+	__u64			pad[5];
 } __attribute__((packed, aligned(8)));
 
 enum bch_data_event {
@@ -295,6 +351,63 @@ struct bch_ioctl_dev_usage {
 	}			d[BCH_DATA_NR];
 };
 
+/*
+ * BCH_IOCTL_FS_USAGE_COUNTERS: query all usage counters in one call
+ *
+ * Returns the same counters as BCH_IOCTL_FS_USAGE and BCH_IOCTL_DEV_USAGE for
+ * every device, as a flat array of u64s, for cheaply polling usage: callers
+ * compare against the previous sample to see what changed.
+ *
+ * @nr		- in: number of counters allocated; out: number of counters
+ *		  returned
+ * @seq		- journal sequence number the counters were read at
+ * @nr_replicas	- number of replicas counters; these are in the same order
+ *		  as the entries returned by BCH_IOCTL_FS_USAGE, as long as
+ *		  @nr_replicas doesn't change
+ * @nr_devices	- number of device slots, including slots for devices that
+ *		  aren't members, which read as zero
+ *
+ * Counters are laid out as BCH_USAGE_COUNTER_*, followed by @nr_replicas
+ * replicas counters, followed by BCH_DEV_USAGE_COUNTERS counters for each
+ * device slot.
+ *
+ * Returns -ERANGE if @nr was too small; @nr is then set to the number of
+ * counters required.
+ */
+enum bch_usage_counter {
+	BCH_USAGE_COUNTER_capacity,
+	BCH_USAGE_COUNTER_used,
+	BCH_USAGE_COUNTER_online_reserved,
+	BCH_USAGE_COUNTER_persistent_reserved,
+	BCH_USAGE_COUNTER_replicas = BCH_USAGE_COUNTER_persistent_reserved +
+		BCH_REPLICAS_MAX,
+};
+
+#define BCH_DEV_USAGE_COUNTERS	(2 + 3 * BCH_DATA_NR)
+
+enum bch_dev_usage_counter {
+	BCH_DEV_USAGE_COUNTER_nr_buckets,
+	BCH_DEV_USAGE_COUNTER_buckets_ec,
+	/* then buckets, sectors, fragmented for each data type */
+	BCH_DEV_USAGE_COUNTER_d,
+};
+
+struct bch_ioctl_fs_usage_counters {
+	__u32			flags;
+	__u32			nr;
+	__u64			seq;
+	__u32			nr_replicas;
+	__u32			nr_devices;
+	__u64			counters[0];
+};
+
+static inline unsigned
+bch_usage_counters_nr(unsigned nr_replicas, unsigned nr_devices)
+{
+	return BCH_USAGE_COUNTER_replicas + nr_replicas +
+		nr_devices * BCH_DEV_USAGE_COUNTERS;
+}
+
 /*
  * BCH_IOCTL_READ_SUPER: read filesystem superblock
  *
@@ -365,4 +478,50 @@ struct bch_ioctl_subvolume {
 #define BCH_SUBVOL_SNAPSHOT_CREATE	(1U << 0)
 #define BCH_SUBVOL_SNAPSHOT_RO		(1U << 1)
 
+/*
+ * BCH_IOCTL_SUBVOLUME_CREATE_BATCH, BCH_IOCTL_SUBVOLUME_DESTROY_BATCH: create
+ * or destroy several subvolumes/snapshots with one ioctl
+ *
+ * @entries points to @nr struct bch_ioctl_subvolume, which are processed in
+ * order; processing stops at the first error, and @nr_done is set to the
+ * number of entries that succeeded.
+ */
+struct bch_ioctl_subvolume_batch {
+	__u32			flags;
+	__u32			nr;
+	__u32			nr_done;
+	__u32			pad;
+	__u64			entries;
+};
+
+/*
+ * BCHFS_IOC_CREATE_BATCH: create several files, directories or special files
+ * in the directory the ioctl is called on
+ *
+ * @entries points to @nr struct bch_ioctl_create_entry: @mode includes the file
+ * type (S_IFREG, S_IFDIR, S_IFCHR, S_IFBLK, S_IFIFO or S_IFSOCK - not symlinks)
+ * and is masked by the umask, @rdev is as for mknod(2), and @name_ptr points
+ * to a name of @name_len bytes, not nul terminated.
+ *
+ * Entries are created in order, many per transaction; processing stops at the
+ * first error, and @nr_done is set to the number of entries that were created.
+ * Directories with a default ACL aren't supported (-EOPNOTSUPP): new files
+ * there need their own ACLs, and should be created the normal way.
+ */
+struct bch_ioctl_create_entry {
+	__u32			mode;
+	__u32			rdev;
+	__u32			name_len;
+	__u32			pad;
+	__u64			name_ptr;
+};
+
+struct bch_ioctl_create_batch {
+	__u32			flags;
+	__u32			nr;
+	__u32			nr_done;
+	__u32			pad;
+	__u64			entries;
+};
+
 #endif /* _BCACHEFS_IOCTL_H */
@@ -313,6 +313,61 @@ struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 
 	return out;
 }
+
+/*
+ * Address of the 8 byte load that gets bits [byte * 8, byte * 8 + 64) of the
+ * key, counting from the least significant end:
+ */
+static unsigned bkey_unpack_byte(const struct bkey_format *format, unsigned byte)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return byte;
+#else
+	return format->key_u64s * 8 - 8 - byte;
+#endif
+}
+
+int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
+{
+	struct bkey_unpack_table *t = _out;
+	unsigned i, byte, end, bit = format->key_u64s * 64 - high_bit_offset;
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++) {
+		struct bkey_unpack_field *f = &t->f[i];
+		unsigned bits = format->bits_per_field[i];
+
+		/* fields are packed starting from the high end of the key: */
+		bit -= bits;
+
+		memset(f, 0, sizeof(*f));
+		f->offset = le64_to_cpu(format->field_offset[i]);
+
+		if (!bits) {
+			/* still does a load, but it's masked off: */
+			f->byte = bkey_unpack_byte(format, 0);
+			continue;
+		}
+
+		/* don't read past the end of the key: */
+		byte		= min(bit / 8, format->key_u64s * 8U - 8);
+		f->mask		= ~0ULL >> (64 - bits);
+		f->byte		= bkey_unpack_byte(format, byte);
+		f->shift	= bit - byte * 8;
+
+		if (f->shift + bits > 64) {
+			/*
+			 * The rest of the field, starting at bit byte * 8 + 64,
+			 * from a second load ending at the end of the field:
+			 */
+			end = DIV_ROUND_UP(bit + bits, 8) - 8;
+
+			f->hi_byte	= bkey_unpack_byte(format, end);
+			f->hi_shift	= (byte + 8 - end) * 8;
+		}
+	}
+
+	return sizeof(*t);
+}
 #endif
 
 /**
@@ -677,6 +732,34 @@ const char *bch2_bkey_format_validate(struct bkey_format *f)
 	return NULL;
 }
 
+/*
+ * Formats from before BCH_COMPAT_bformat_overflow_done could have fields that
+ * don't fit in the current unpacked format, and must be rewritten:
+ */
+bool bch2_bkey_format_needs_redo(const struct bkey_format *f)
+{
+	unsigned i;
+
+	for (i = 0; i < f->nr_fields; i++) {
+		unsigned unpacked_bits = bch2_bkey_format_current.bits_per_field[i];
+		u64 unpacked_mask = ~((~0ULL << 1) << (unpacked_bits - 1));
+		u64 field_offset = le64_to_cpu(f->field_offset[i]);
+
+		if (f->bits_per_field[i] > unpacked_bits)
+			return true;
+
+		if ((f->bits_per_field[i] == unpacked_bits) && field_offset)
+			return true;
+
+		if (((field_offset + ((1ULL << f->bits_per_field[i]) - 1)) &
+		     unpacked_mask) <
+		    field_offset)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Most significant differing bit
  * Bits are indexed from 0 - return is [0, nr_key_bits)
@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_BKEY_H
 #define _BCACHEFS_BKEY_H
 
+#include <asm/unaligned.h>
 #include <linux/bug.h>
 #include "bcachefs_format.h"
 
@@ -98,6 +99,7 @@ void bch2_bkey_format_add_key(struct bkey_format_state *, const struct bkey *);
 void bch2_bkey_format_add_pos(struct bkey_format_state *, struct bpos);
 struct bkey_format bch2_bkey_format_done(struct bkey_format_state *);
 const char *bch2_bkey_format_validate(struct bkey_format *);
+bool bch2_bkey_format_needs_redo(const struct bkey_format *);
 
 __pure
 unsigned bch2_bkey_greatest_differing_bit(const struct btree *,
@@ -371,8 +373,43 @@ int bch2_compile_bkey_format(const struct bkey_format *, void *);
 
 #else
 
-static inline int bch2_compile_bkey_format(const struct bkey_format *format,
-					  void *out) { return 0; }
+/*
+ * Without a code generator for this architecture, bch2_compile_bkey_format()
+ * instead precomputes where each field of the format lives, so that unpacking
+ * a field is a load, a shift and a mask instead of walking the format bit by
+ * bit:
+ */
+struct bkey_unpack_field {
+	u64			offset;
+	u64			mask;
+	u8			byte;		/* load offset of the field */
+	u8			shift;
+	/* only for fields too wide to get with a single unaligned load: */
+	u8			hi_byte;
+	u8			hi_shift;
+};
+
+struct bkey_unpack_table {
+	struct bkey_unpack_field f[BKEY_NR_FIELDS];
+};
+
+int bch2_compile_bkey_format(const struct bkey_format *, void *);
+
+static __always_inline u64 bkey_unpack_field(const struct bkey_unpack_table *t,
+					     enum bch_bkey_fields nr,
+					     const struct bkey_packed *k)
+{
+	const struct bkey_unpack_field *f = &t->f[nr];
+	const u8 *p = (const u8 *) k->_data;
+	u64 v = get_unaligned((u64 *) (p + f->byte)) >> f->shift;
+
+	/* shift is never 0 here: */
+	if (unlikely(f->hi_shift))
+		v |= ((get_unaligned((u64 *) (p + f->hi_byte)) >> f->hi_shift) << 1)
+			<< (63 - f->shift);
+
+	return (v & f->mask) + f->offset;
+}
 
 #endif
 
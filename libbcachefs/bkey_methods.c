@@ -123,6 +123,44 @@ const struct bkey_ops bch2_bkey_ops[] = {
 #undef x
 };
 
+/*
+ * Key types that make up nearly all of the extents, alloc, inodes and dirents
+ * btrees: for these, bkey_ops_call() switches on the type and calls the method
+ * directly, instead of an indirect call through bch2_bkey_ops[] - which is
+ * expensive with retpolines, and these are called for every key we validate
+ * or run triggers on.
+ */
+#define BCH_BKEY_TYPES_DIRECT(x, ...)					\
+	x(btree_ptr_v2,	__VA_ARGS__)					\
+	x(extent,	__VA_ARGS__)					\
+	x(alloc_v4,	__VA_ARGS__)					\
+	x(inode,	__VA_ARGS__)					\
+	x(inode_v2,	__VA_ARGS__)					\
+	x(dirent,	__VA_ARGS__)
+
+#define bkey_ops_direct_case(name, _method, _default, ...)		\
+	case KEY_TYPE_##name:						\
+		_ret = bch2_bkey_ops_##name._method			\
+			? bch2_bkey_ops_##name._method(__VA_ARGS__)	\
+			: _default;					\
+		break;
+
+#define bkey_ops_call(_type, _method, _default, ...)			\
+({									\
+	unsigned _t = (_type);						\
+	typeof(_default) _ret;						\
+									\
+	switch (_t) {							\
+	BCH_BKEY_TYPES_DIRECT(bkey_ops_direct_case,			\
+			      _method, _default, __VA_ARGS__)		\
+	default:							\
+		_ret = bch2_bkey_ops[_t]._method			\
+			? bch2_bkey_ops[_t]._method(__VA_ARGS__)	\
+			: _default;					\
+	}								\
+	_ret;								\
+})
+
 int bch2_bkey_val_invalid(struct bch_fs *c, struct bkey_s_c k,
 			  int rw, struct printbuf *err)
 {
@@ -131,7 +169,7 @@ int bch2_bkey_val_invalid(struct bch_fs *c, struct bkey_s_c k,
 		return -EINVAL;
 	}
 
-	return bch2_bkey_ops[k.k->type].key_invalid(c, k, rw, err);
+	return bkey_ops_call(k.k->type, key_invalid, 0, c, k, rw, err);
 }
 
 static unsigned bch2_key_types_allowed[] = {
@@ -359,18 +397,31 @@ void bch2_bkey_swab_val(struct bkey_s k)
 
 bool bch2_bkey_normalize(struct bch_fs *c, struct bkey_s k)
 {
-	const struct bkey_ops *ops = &bch2_bkey_ops[k.k->type];
-
-	return ops->key_normalize
-		? ops->key_normalize(c, k)
-		: false;
+	return bkey_ops_call(k.k->type, key_normalize, false, c, k);
 }
 
 bool bch2_bkey_merge(struct bch_fs *c, struct bkey_s l, struct bkey_s_c r)
 {
-	const struct bkey_ops *ops = &bch2_bkey_ops[l.k->type];
+	return bch2_bkey_maybe_mergable(l.k, r.k) &&
+		bkey_ops_call(l.k->type, key_merge, false, c, l, r);
+}
 
-	return bch2_bkey_maybe_mergable(l.k, r.k) && ops->key_merge(c, l, r);
+int bch2_mark_key(struct btree_trans *trans,
+		  struct bkey_s_c old,
+		  struct bkey_s_c new,
+		  unsigned flags)
+{
+	return bkey_ops_call(old.k->type ?: new.k->type, atomic_trigger, 0,
+			     trans, old, new, flags);
+}
+
+int bch2_trans_mark_key(struct btree_trans *trans,
+			enum btree_id btree_id, unsigned level,
+			struct bkey_s_c old, struct bkey_i *new,
+			unsigned flags)
+{
+	return bkey_ops_call(old.k->type ?: new->k.type, trans_trigger, 0,
+			     trans, btree_id, level, old, new, flags);
 }
 
 static const struct old_bkey_type {
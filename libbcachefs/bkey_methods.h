@@ -68,17 +68,7 @@ static inline bool bch2_bkey_maybe_mergable(const struct bkey *l, const struct b
 
 bool bch2_bkey_merge(struct bch_fs *, struct bkey_s, struct bkey_s_c);
 
-static inline int bch2_mark_key(struct btree_trans *trans,
-		  struct bkey_s_c old,
-		  struct bkey_s_c new,
-		  unsigned flags)
-{
-	const struct bkey_ops *ops = &bch2_bkey_ops[old.k->type ?: new.k->type];
-
-	return ops->atomic_trigger
-		? ops->atomic_trigger(trans, old, new, flags)
-		: 0;
-}
+int bch2_mark_key(struct btree_trans *, struct bkey_s_c, struct bkey_s_c, unsigned);
 
 enum btree_update_flags {
 	__BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE,
@@ -116,17 +106,8 @@ enum btree_update_flags {
 	 (1U << KEY_TYPE_inode_v2)|		\
 	 (1U << KEY_TYPE_snapshot))
 
-static inline int bch2_trans_mark_key(struct btree_trans *trans,
-				      enum btree_id btree_id, unsigned level,
-				      struct bkey_s_c old, struct bkey_i *new,
-				      unsigned flags)
-{
-	const struct bkey_ops *ops = &bch2_bkey_ops[old.k->type ?: new->k.type];
-
-	return ops->trans_trigger
-		? ops->trans_trigger(trans, btree_id, level, old, new, flags)
-		: 0;
-}
+int bch2_trans_mark_key(struct btree_trans *, enum btree_id, unsigned,
+			struct bkey_s_c, struct bkey_i *, unsigned);
 
 static inline int bch2_trans_mark_old(struct btree_trans *trans,
 				      enum btree_id btree_id, unsigned level,
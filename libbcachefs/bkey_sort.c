@@ -9,9 +9,61 @@ typedef int (*sort_cmp_fn)(struct btree *,
 			   struct bkey_packed *,
 			   struct bkey_packed *);
 
+/* Below this many runs, keeping data[] sorted beats the loser tree: */
+#define SORT_ITER_SIFT_MAX	4
+
 static inline bool sort_iter_end(struct sort_iter *iter)
 {
-	return !iter->used;
+	return !iter->used ||
+		(iter->tree &&
+		 iter->data[iter->tree[0]].k == iter->data[iter->tree[0]].end);
+}
+
+/* Loser tree: exhausted runs compare greater than everything else */
+static inline bool sort_iter_tree_lt(struct sort_iter *iter, sort_cmp_fn cmp,
+				     unsigned l, unsigned r)
+{
+	struct sort_iter_set *ls = iter->data + l, *rs = iter->data + r;
+	int c;
+
+	if (ls->k == ls->end)
+		return false;
+	if (rs->k == rs->end)
+		return true;
+
+	c = cmp(iter->b, ls->k, rs->k);
+	return c < 0 || (!c && l < r);
+}
+
+static unsigned sort_iter_tree_build(struct sort_iter *iter, sort_cmp_fn cmp,
+				     unsigned node)
+{
+	unsigned l, r;
+
+	if (node >= iter->used)
+		return node - iter->used;
+
+	l = sort_iter_tree_build(iter, cmp, node * 2);
+	r = sort_iter_tree_build(iter, cmp, node * 2 + 1);
+
+	if (sort_iter_tree_lt(iter, cmp, r, l))
+		swap(l, r);
+
+	iter->tree[node] = r;
+	return l;
+}
+
+/* Replay the matches on the path from the winner's leaf back to the root: */
+static inline void sort_iter_tree_replay(struct sort_iter *iter, sort_cmp_fn cmp)
+{
+	unsigned winner = iter->tree[0];
+	unsigned node = (iter->used + winner) >> 1;
+
+	for (; node; node >>= 1)
+		if (sort_iter_tree_lt(iter, cmp, iter->tree[node], winner))
+			swap(iter->tree[node], winner);
+
+	iter->tree[0] = winner;
 }
 
 static inline void sort_iter_sift(struct sort_iter *iter, unsigned from,
@@ -30,26 +82,40 @@ static inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
 {
 	unsigned i = iter->used;
 
+	if (iter->tree && iter->used > SORT_ITER_SIFT_MAX) {
+		iter->tree[0] = sort_iter_tree_build(iter, cmp, 1);
+		return;
+	}
+
+	iter->tree = NULL;
+
 	while (i--)
 		sort_iter_sift(iter, i, cmp);
 }
 
+static inline struct sort_iter_set *sort_iter_top(struct sort_iter *iter)
+{
+	return iter->data + (iter->tree ? iter->tree[0] : 0);
+}
+
 static inline struct bkey_packed *sort_iter_peek(struct sort_iter *iter)
 {
-	return !sort_iter_end(iter) ? iter->data->k : NULL;
+	return !sort_iter_end(iter) ? sort_iter_top(iter)->k : NULL;
 }
 
 static inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	struct sort_iter_set *i = iter->data;
+	struct sort_iter_set *i = sort_iter_top(iter);
 
-	BUG_ON(!iter->used);
+	BUG_ON(sort_iter_end(iter));
 
 	i->k = bkey_next(i->k);
 
 	BUG_ON(i->k > i->end);
 
-	if (i->k == i->end)
+	if (iter->tree)
+		sort_iter_tree_replay(iter, cmp);
+	else if (i->k == i->end)
 		array_remove_item(iter->data, iter->used, 0);
 	else
 		sort_iter_sift(iter, 0, cmp);
@@ -77,40 +143,39 @@ static inline int key_sort_fix_overlapping_cmp(struct btree *b,
 		cmp_int((unsigned long) l, (unsigned long) r);
 }
 
-static inline bool should_drop_next_key(struct sort_iter *iter)
-{
-	/*
-	 * key_sort_cmp() ensures that when keys compare equal the older key
-	 * comes first; so if l->k compares equal to r->k then l->k is older
-	 * and should be dropped.
-	 */
-	return iter->used >= 2 &&
-		!bch2_bkey_cmp_packed(iter->b,
-				 iter->data[0].k,
-				 iter->data[1].k);
-}
-
 struct btree_nr_keys
 bch2_key_sort_fix_overlapping(struct bch_fs *c, struct bset *dst,
 			      struct sort_iter *iter)
 {
 	struct bkey_packed *out = dst->start;
-	struct bkey_packed *k;
+	struct bkey_packed *k, *prev = NULL;
 	struct btree_nr_keys nr;
 
 	memset(&nr, 0, sizeof(nr));
 
 	sort_iter_sort(iter, key_sort_fix_overlapping_cmp);
 
-	while ((k = sort_iter_peek(iter))) {
-		if (!bkey_deleted(k) &&
-		    !should_drop_next_key(iter)) {
-			bkey_copy(out, k);
+	/*
+	 * key_sort_fix_overlapping_cmp() ensures that when keys compare equal
+	 * the older key comes first; so a key is only emitted once we've seen
+	 * that the next key doesn't compare equal, i.e. doesn't overwrite it:
+	 */
+	while ((k = sort_iter_next(iter, key_sort_fix_overlapping_cmp))) {
+		if (prev &&
+		    !bkey_deleted(prev) &&
+		    bch2_bkey_cmp_packed(iter->b, prev, k)) {
+			bkey_copy(out, prev);
 			btree_keys_account_key_add(&nr, 0, out);
 			out = bkey_next(out);
 		}
 
-		sort_iter_advance(iter, key_sort_fix_overlapping_cmp);
+		prev = k;
+	}
+
+	if (prev && !bkey_deleted(prev)) {
+		bkey_copy(out, prev);
+		btree_keys_account_key_add(&nr, 0, out);
+		out = bkey_next(out);
 	}
 
 	dst->u64s = cpu_to_le16((u64 *) out - dst->_data);
@@ -2,10 +2,17 @@
 #ifndef _BCACHEFS_BKEY_SORT_H
 #define _BCACHEFS_BKEY_SORT_H
 
+/*
+ * Merges sorted runs of keys: with a handful of runs by keeping data[] sorted,
+ * and with more, if the iterator was initialized with sort_iter_init_nr(), with
+ * a loser tree (tree[1..used - 1] are the losers of each match, tree[0] the
+ * overall winner).
+ */
 struct sort_iter {
 	struct btree		*b;
 	unsigned		used;
 	unsigned		size;
+	u16			*tree;
 
 	struct sort_iter_set {
 		struct bkey_packed *k, *end;
@@ -17,6 +24,22 @@ static inline void sort_iter_init(struct sort_iter *iter, struct btree *b)
 	iter->b = b;
 	iter->used = 0;
 	iter->size = ARRAY_SIZE(iter->data);
+	iter->tree = NULL;
+}
+
+/* Size of a sort_iter for @nr runs, allocated by the caller: */
+static inline size_t sort_iter_bytes(unsigned nr)
+{
+	return sizeof(struct sort_iter) +
+		nr * (sizeof(struct sort_iter_set) + sizeof(u16));
+}
+
+static inline void sort_iter_init_nr(struct sort_iter *iter, struct btree *b,
+				     unsigned nr)
+{
+	sort_iter_init(iter, b);
+	iter->size = nr;
+	iter->tree = (void *) &iter->data[nr];
 }
 
 static inline void sort_iter_add(struct sort_iter *iter,
@@ -17,6 +17,15 @@
 #include <linux/random.h>
 #include <linux/prefetch.h>
 
+/*
+ * The vectorized aux tree search is userspace only: in the kernel it would
+ * need kernel_fpu_begin() around every lookup, which costs more than it saves.
+ */
+#if defined(CONFIG_X86_64) && !defined(__KERNEL__)
+#define HAVE_BSET_SEARCH_TREE_AVX2
+#include <immintrin.h>
+#endif
+
 /* hack.. */
 #include "alloc_types.h"
 #include <trace/events/bcachefs.h>
@@ -1118,6 +1127,123 @@ static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
 #endif
 }
 
+#ifdef HAVE_BSET_SEARCH_TREE_AVX2
+
+static __always_inline u32 bkey_float_u32(const struct bkey_float *f)
+{
+	return get_unaligned((u32 *) f);
+}
+
+/*
+ * Compare the search key against eight bkey_floats at once: returns a bitmask
+ * of nodes where the search key's mantissa is greater, and in @slow a bitmask
+ * of nodes that need the full key comparison (failed bfloats, or equal
+ * mantissas with bits dropped off the end of the key).
+ */
+__attribute__((target("avx2")))
+static __always_inline unsigned bfloat_cmp8_avx2(__m256i v,
+				const struct bkey_packed *packed_search,
+				__m256i key_bits_start,
+				unsigned *slow)
+{
+	__m256i exponent = _mm256_and_si256(v, _mm256_set1_epi32(0xff));
+	__m256i mantissa = _mm256_srli_epi32(v, 16);
+	__m256i failed	 = _mm256_cmpeq_epi32(exponent, _mm256_set1_epi32(BFLOAT_FAILED));
+	__m256i r;
+
+	/*
+	 * bkey_mantissa(), eight at a time: a mantissa is at most 16 bits
+	 * starting at bit 0-7 of byte exponent >> 3, so a 32 bit load suffices:
+	 */
+	r = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+			(const int *) packed_search->_data,
+			_mm256_srli_epi32(exponent, 3),
+			_mm256_xor_si256(failed, _mm256_set1_epi32(-1)), 1);
+	r = _mm256_srlv_epi32(r, _mm256_and_si256(exponent, _mm256_set1_epi32(7)));
+	r = _mm256_and_si256(r, _mm256_set1_epi32(0xffff));
+
+	*slow = _mm256_movemask_ps(_mm256_castsi256_ps(
+		_mm256_or_si256(failed,
+			_mm256_and_si256(_mm256_cmpeq_epi32(r, mantissa),
+				_mm256_cmpgt_epi32(exponent, key_bits_start)))));
+
+	return _mm256_movemask_ps(_mm256_castsi256_ps(
+		_mm256_cmpgt_epi32(r, mantissa)));
+}
+
+/*
+ * Descend four levels of the tree at a time: the subtree of depth four below
+ * @n is 1 + 2 + 4 + 8 nodes, with each level contiguous in the eytzinger
+ * layout - that's effectively a 16-ary node. All fifteen comparisons are done
+ * up front, so the loads don't depend on each other, and then we pick the path
+ * through the subtree from the resulting bitmask.
+ *
+ * Returns the node to continue the scalar descent from, or sets @ret if we hit
+ * an exact match in the slowpath.
+ */
+__attribute__((target("avx2")))
+static unsigned bset_search_tree_avx2(const struct btree *b,
+				const struct bset_tree *t,
+				const struct bpos *search,
+				const struct bkey_packed *packed_search,
+				struct bkey_packed **ret)
+{
+	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
+	__m256i key_bits_start =
+		_mm256_set1_epi32(b->format.key_u64s * 64 - b->nr_key_bits);
+	unsigned n = 1;
+
+	while ((n << 3) + 8 <= t->size) {
+		struct bkey_float *f = base->f;
+		unsigned gt, slow, slow_hi, d, p = 0;
+		__m256i lo, hi;
+
+		if (likely(n << 4 < t->size))
+			prefetch(&base->f[n << 4]);
+
+		lo = _mm256_setr_epi32(bkey_float_u32(&f[n]),
+				       bkey_float_u32(&f[n * 2]),
+				       bkey_float_u32(&f[n * 2 + 1]),
+				       bkey_float_u32(&f[n * 4]),
+				       bkey_float_u32(&f[n * 4 + 1]),
+				       bkey_float_u32(&f[n * 4 + 2]),
+				       bkey_float_u32(&f[n * 4 + 3]),
+				       BFLOAT_FAILED);
+		hi = _mm256_loadu_si256((const __m256i *) &f[n * 8]);
+
+		gt    = bfloat_cmp8_avx2(lo, packed_search, key_bits_start, &slow) & 0x7f;
+		gt   |= bfloat_cmp8_avx2(hi, packed_search, key_bits_start, &slow_hi) << 7;
+		slow &= 0x7f;
+		slow |= slow_hi << 7;
+
+		/* node at depth d, position p in the subtree is bit 2^d - 1 + p: */
+		for (d = 0; d < 4; d++) {
+			unsigned bit = (1U << d) - 1 + p;
+
+			if (unlikely(slow & (1U << bit))) {
+				unsigned j = (n << d) + p;
+				struct bkey_packed *k = tree_to_bkey(b, t, j);
+				int cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
+
+				if (!cmp) {
+					*ret = k;
+					return j;
+				}
+
+				p = p * 2 + (cmp < 0);
+			} else {
+				p = p * 2 + ((gt >> bit) & 1);
+			}
+		}
+
+		n = (n << 4) + p;
+	}
+
+	return n;
+}
+
+#endif
+
 __flatten
 static struct bkey_packed *bset_search_tree(const struct btree *b,
 				const struct bset_tree *t,
@@ -1130,7 +1256,16 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 	unsigned inorder, n = 1, l, r;
 	int cmp;
 
-	do {
+#ifdef HAVE_BSET_SEARCH_TREE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		k = NULL;
+		n = bset_search_tree_avx2(b, t, search, packed_search, &k);
+		if (k)
+			return k;
+	}
+#endif
+
+	while (n < t->size) {
 		if (likely(n << 4 < t->size))
 			prefetch(&base->f[n << 4]);
 
@@ -1153,7 +1288,7 @@ slowpath:
 			return k;
 
 		n = n * 2 + (cmp < 0);
-	} while (n < t->size);
+	}
 
 	inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
 
@@ -1566,6 +1701,29 @@ void bch2_btree_keys_stats(struct btree *b, struct bset_stats *stats)
 	}
 }
 
+/*
+ * Rough estimate of how much slower lookups in @b are than in a freshly
+ * written node - one bset, no failed bkey floats and every key packed - as a
+ * percentage: each extra bset is another search, and failed floats and
+ * unpacked keys each fall back to a full key comparison.
+ */
+unsigned bch2_btree_node_lookup_cost(struct btree *b)
+{
+	struct bset_stats stats;
+	unsigned nr_keys = b->nr.packed_keys + b->nr.unpacked_keys;
+	unsigned cost = (b->nsets - 1) * 100;
+
+	memset(&stats, 0, sizeof(stats));
+	bch2_btree_keys_stats(b, &stats);
+
+	if (stats.floats)
+		cost += stats.failed * 100 / stats.floats;
+	if (nr_keys)
+		cost += b->nr.unpacked_keys * 100 / nr_keys;
+
+	return cost;
+}
+
 void bch2_bfloat_to_text(struct printbuf *out, struct btree *b,
 			 struct bkey_packed *k)
 {
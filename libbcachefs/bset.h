@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_BSET_H
 #define _BCACHEFS_BSET_H
 
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
@@ -213,19 +214,32 @@ __bkey_unpack_key_format_checked(const struct btree *b,
 			       const struct bkey_packed *src)
 {
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-	{
-		compiled_unpack_fn unpack_fn = b->aux_data;
-		unpack_fn(dst, src);
+	compiled_unpack_fn unpack_fn = b->aux_data;
 
-		if (bch2_expensive_debug_checks) {
-			struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
-
-			BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
-		}
-	}
+	unpack_fn(dst, src);
 #else
-	*dst = __bch2_bkey_unpack_key(&b->format, src);
+	const struct bkey_unpack_table *t = b->aux_data;
+	struct bkey out;
+
+	/* unpack to the stack first, so stores to dst can't alias t or src: */
+	out.u64s		= BKEY_U64s + src->u64s - b->format.key_u64s;
+	out.format		= KEY_FORMAT_CURRENT;
+	out.needs_whiteout	= src->needs_whiteout;
+	out.type		= src->type;
+	out.pad[0]		= 0;
+	out.p.inode		= bkey_unpack_field(t, BKEY_FIELD_INODE, src);
+	out.p.offset		= bkey_unpack_field(t, BKEY_FIELD_OFFSET, src);
+	out.p.snapshot		= bkey_unpack_field(t, BKEY_FIELD_SNAPSHOT, src);
+	out.size		= bkey_unpack_field(t, BKEY_FIELD_SIZE, src);
+	out.version.hi		= bkey_unpack_field(t, BKEY_FIELD_VERSION_HI, src);
+	out.version.lo		= bkey_unpack_field(t, BKEY_FIELD_VERSION_LO, src);
+	*dst = out;
 #endif
+	if (bch2_expensive_debug_checks) {
+		struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
+
+		BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
+	}
 }
 
 static inline struct bkey
@@ -266,7 +280,13 @@ bkey_unpack_pos_format_checked(const struct btree *b,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 	return bkey_unpack_key_format_checked(b, src).p;
 #else
-	return __bkey_unpack_pos(&b->format, src);
+	const struct bkey_unpack_table *t = b->aux_data;
+
+	return (struct bpos) {
+		.inode		= bkey_unpack_field(t, BKEY_FIELD_INODE, src),
+		.offset		= bkey_unpack_field(t, BKEY_FIELD_OFFSET, src),
+		.snapshot	= bkey_unpack_field(t, BKEY_FIELD_SNAPSHOT, src),
+	};
 #endif
 }
 
@@ -317,6 +337,26 @@ static inline bool bset_has_rw_aux_tree(struct bset_tree *t)
 	return bset_aux_tree_type(t) == BSET_RW_AUX_TREE;
 }
 
+/* Snapshot summaries, see struct btree: */
+
+static inline u64 btree_snapshot_bloom_bit(u32 snapshot)
+{
+	return 1ULL << hash_32(snapshot, 6);
+}
+
+/* A summary that matches everything, for nodes we haven't summarized: */
+static inline void btree_node_snapshot_summary_reset(struct btree *b)
+{
+	b->snapshot_max		= U32_MAX;
+	b->snapshot_bloom	= ~0ULL;
+}
+
+static inline void btree_node_snapshot_summary_add(struct btree *b, u32 snapshot)
+{
+	b->snapshot_max		= max(b->snapshot_max, snapshot);
+	b->snapshot_bloom	|= btree_snapshot_bloom_bit(snapshot);
+}
+
 static inline void bch2_bset_set_no_aux_tree(struct btree *b,
 					    struct bset_tree *t)
 {
@@ -579,6 +619,7 @@ struct bset_stats {
 };
 
 void bch2_btree_keys_stats(struct btree *, struct bset_stats *);
+unsigned bch2_btree_node_lookup_cost(struct btree *);
 void bch2_bfloat_to_text(struct printbuf *, struct btree *,
 			 struct bkey_packed *);
 
@@ -9,9 +9,12 @@
 #include "debug.h"
 #include "errcode.h"
 #include "error.h"
+#include "super-io.h"
 
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
+#include <linux/sort.h>
+#include <linux/topology.h>
 #include <trace/events/bcachefs.h>
 
 const char * const bch2_btree_node_flags[] = {
@@ -107,9 +110,17 @@ static int btree_node_data_alloc(struct bch_fs *c, struct btree *b, gfp_t gfp)
 		return -ENOMEM;
 	}
 
+	b->data_node = numa_node_id();
 	return 0;
 }
 
+static void btree_node_swap_data(struct btree *b, struct btree *b2)
+{
+	swap(b->data,		b2->data);
+	swap(b->aux_data,	b2->aux_data);
+	swap(b->data_node,	b2->data_node);
+}
+
 static struct btree *__btree_node_mem_alloc(struct bch_fs *c, gfp_t gfp)
 {
 	struct btree *b = kzalloc(sizeof(struct btree), gfp);
@@ -146,22 +157,49 @@ struct btree *__bch2_btree_node_mem_alloc(struct bch_fs *c)
 
 /* Btree in memory cache - hash table */
 
+static inline atomic_t *btree_cache_nr(struct btree_cache *bc, struct btree *b)
+{
+	return b->c.level ? &bc->nr_interior : &bc->nr_leaf;
+}
+
 void bch2_btree_node_hash_remove(struct btree_cache *bc, struct btree *b)
 {
 	int ret = rhashtable_remove_fast(&bc->table, &b->hash, bch_btree_cache_params);
 	BUG_ON(ret);
 
+	atomic_dec(btree_cache_nr(bc, b));
+
 	/* Cause future lookups for this node to fail: */
 	b->hash_val = 0;
 }
 
 int __bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b)
 {
+	int ret;
+
 	BUG_ON(b->hash_val);
 	b->hash_val = btree_ptr_hash_val(&b->key);
 
-	return rhashtable_lookup_insert_fast(&bc->table, &b->hash,
-					     bch_btree_cache_params);
+	ret = rhashtable_lookup_insert_fast(&bc->table, &b->hash,
+					    bch_btree_cache_params);
+	if (!ret)
+		atomic_inc(btree_cache_nr(bc, b));
+	return ret;
+}
+
+/*
+ * Interior nodes are pinned, as long as they take up no more than a quarter of
+ * the cache: with every interior node cached, a lookup on a cold leaf costs at
+ * most one IO. Only once they've gone over their budget do they compete with
+ * leaf nodes for reclaim:
+ */
+#define BTREE_CACHE_INTERIOR_RESERVE_DIV	4
+
+static bool btree_node_pinned(struct btree_cache *bc, struct btree *b)
+{
+	return b->c.level &&
+		atomic_read(&bc->nr_interior) <=
+		bc->used / BTREE_CACHE_INTERIOR_RESERVE_DIV;
 }
 
 int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
@@ -181,6 +219,28 @@ int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 	return ret;
 }
 
+static void btree_cache_ghost_add(struct btree_cache *bc, u64 hash_val)
+{
+	lockdep_assert_held(&bc->lock);
+
+	bc->ghost[bc->ghost_idx++ % ARRAY_SIZE(bc->ghost)] = hash_val;
+}
+
+static bool btree_cache_ghost_hit(struct btree_cache *bc, u64 hash_val)
+{
+	unsigned i;
+
+	lockdep_assert_held(&bc->lock);
+
+	for (i = 0; i < ARRAY_SIZE(bc->ghost); i++)
+		if (bc->ghost[i] == hash_val) {
+			bc->ghost[i] = 0;
+			return true;
+		}
+
+	return false;
+}
+
 __flatten
 static inline struct btree *btree_cache_find(struct btree_cache *bc,
 				     const struct bkey_i *k)
@@ -327,15 +387,25 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 		}
 	}
 restart:
+	/*
+	 * CLOCK, with 2Q style handling of nodes that have only been touched
+	 * once: new nodes go in at the hand without the accessed bit set (the
+	 * lookup that read them in doesn't count), so nodes read once by scans
+	 * are the first to go, and a node has to be touched again to survive a
+	 * pass of the hand:
+	 */
 	list_for_each_entry_safe(b, t, &bc->live, list) {
 		touched++;
 
-		if (btree_node_accessed(b)) {
+		if (btree_node_pinned(bc, b)) {
+			/* interior node, within its budget: leave it */
+		} else if (btree_node_accessed(b)) {
 			clear_btree_node_accessed(b);
 		} else if (!btree_node_reclaim(c, b)) {
 			freed++;
 			btree_node_data_free(c, b);
 
+			btree_cache_ghost_add(bc, b->hash_val);
 			bch2_btree_node_hash_remove(bc, b);
 			six_unlock_write(&b->c.lock);
 			six_unlock_intent(&b->c.lock);
@@ -393,6 +463,191 @@ static void bch2_btree_cache_shrinker_to_text(struct printbuf *out, struct shrin
 	bch2_btree_cache_to_text(out, c);
 }
 
+/*
+ * Hot nodes: every BTREE_CACHE_HOT_SAVE_INTERVAL while we're read-write, and
+ * on clean shutdown, the positions of the cached interior nodes and of the
+ * leaves that have been accessed since the shrinker last passed them are saved
+ * in the superblock; after mount they're read back in, highest level first, by
+ * finding each one in its parent and prefetching it.
+ */
+#define BTREE_CACHE_HOT_MAX		128
+#define BTREE_CACHE_HOT_SAVE_INTERVAL	(10 * 60 * HZ)
+
+static int btree_cache_hot_cmp(const void *_l, const void *_r)
+{
+	const struct bch_btree_cache_hot_node *l = _l, *r = _r;
+
+	return  cmp_int(l->btree_id, r->btree_id) ?:
+		cmp_int(r->level, l->level) ?:
+		cmp_int(le64_to_cpu(l->inode), le64_to_cpu(r->inode)) ?:
+		cmp_int(le64_to_cpu(l->offset), le64_to_cpu(r->offset)) ?:
+		cmp_int(le32_to_cpu(l->snapshot), le32_to_cpu(r->snapshot));
+}
+
+/* Updates the superblock field, and writes it out if @write: */
+void bch2_btree_cache_hot_save(struct bch_fs *c, bool write)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct bch_sb_field_btree_cache_hot *hot;
+	struct bch_btree_cache_hot_node *nodes;
+	struct btree *b;
+	unsigned pass, nr = 0;
+
+	nodes = kmalloc_array(BTREE_CACHE_HOT_MAX, sizeof(*nodes), GFP_KERNEL);
+	if (!nodes)
+		return;
+
+	mutex_lock(&bc->lock);
+	/* Interior nodes first: */
+	for (pass = 0; pass < 2; pass++)
+		list_for_each_entry(b, &bc->live, list) {
+			if (nr == BTREE_CACHE_HOT_MAX)
+				goto done;
+
+			if (!b->hash_val ||
+			    (pass == 0 && !b->c.level) ||
+			    (pass == 1 && (b->c.level || !btree_node_accessed(b))))
+				continue;
+
+			nodes[nr++] = (struct bch_btree_cache_hot_node) {
+				.btree_id	= b->c.btree_id,
+				.level		= b->c.level,
+				.snapshot	= cpu_to_le32(b->key.k.p.snapshot),
+				.inode		= cpu_to_le64(b->key.k.p.inode),
+				.offset		= cpu_to_le64(b->key.k.p.offset),
+			};
+		}
+done:
+	mutex_unlock(&bc->lock);
+
+	sort(nodes, nr, sizeof(nodes[0]), btree_cache_hot_cmp, NULL);
+
+	mutex_lock(&c->sb_lock);
+	hot = bch2_sb_resize_btree_cache_hot(&c->disk_sb,
+			(sizeof(*hot) + nr * sizeof(*nodes)) / sizeof(u64));
+	if (hot) {
+		memcpy(hot->nodes, nodes, nr * sizeof(*nodes));
+		if (write)
+			bch2_write_super_async(c);
+	}
+	mutex_unlock(&c->sb_lock);
+
+	kfree(nodes);
+}
+
+static void btree_cache_hot_save_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work), struct bch_fs,
+					btree_cache.hot_save_work);
+
+	bch2_btree_cache_hot_save(c, true);
+	queue_delayed_work(system_long_wq, &c->btree_cache.hot_save_work,
+			   BTREE_CACHE_HOT_SAVE_INTERVAL);
+}
+
+void bch2_btree_cache_hot_save_start(struct bch_fs *c)
+{
+	queue_delayed_work(system_long_wq, &c->btree_cache.hot_save_work,
+			   BTREE_CACHE_HOT_SAVE_INTERVAL);
+}
+
+void bch2_btree_cache_hot_save_stop(struct bch_fs *c)
+{
+	cancel_delayed_work_sync(&c->btree_cache.hot_save_work);
+}
+
+static int btree_cache_warm_one(struct btree_trans *trans,
+				struct bch_btree_cache_hot_node *n)
+{
+	struct bch_fs *c = trans->c;
+	struct bpos pos = SPOS(le64_to_cpu(n->inode),
+			       le64_to_cpu(n->offset),
+			       le32_to_cpu(n->snapshot));
+	struct btree_iter iter;
+	struct btree_node_iter node_iter;
+	struct bkey_packed *k;
+	struct bkey_buf tmp;
+	struct btree *b;
+	int ret;
+
+	bch2_bkey_buf_init(&tmp);
+	bch2_trans_node_iter_init(trans, &iter, n->btree_id, pos, 0, n->level + 1, 0);
+
+	b = bch2_btree_iter_peek_node(&iter);
+	ret = PTR_ERR_OR_ZERO(b);
+	/* If the btree has gotten shallower, this node may be the root now: */
+	if (ret || !b || b->c.level != n->level + 1)
+		goto out;
+
+	bch2_btree_node_iter_init(&node_iter, b, &pos);
+	k = bch2_btree_node_iter_peek(&node_iter, b);
+	if (!k)
+		goto out;
+
+	bch2_bkey_buf_unpack(&tmp, c, b, k);
+	ret = bch2_btree_node_prefetch(c, trans, iter.path, tmp.k,
+				       n->btree_id, n->level);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	bch2_bkey_buf_exit(&tmp, c);
+	return ret;
+}
+
+static void btree_cache_warm_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, btree_cache.warm_work);
+	struct bch_sb_field_btree_cache_hot *hot;
+	struct bch_btree_cache_hot_node *nodes = NULL, *n;
+	struct btree_trans trans;
+	unsigned nr = 0;
+	int ret = 0;
+
+	mutex_lock(&c->sb_lock);
+	hot = bch2_sb_get_btree_cache_hot(c->disk_sb.sb);
+	if (hot) {
+		nr = (vstruct_bytes(&hot->field) - sizeof(*hot)) / sizeof(*nodes);
+		nodes = kmemdup(hot->nodes, nr * sizeof(*nodes), GFP_KERNEL);
+	}
+	mutex_unlock(&c->sb_lock);
+
+	if (!nodes)
+		return;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (n = nodes; n < nodes + nr && !ret; n++) {
+		if (test_bit(BCH_FS_STOPPING, &c->flags))
+			break;
+
+		if (n->btree_id >= BTREE_ID_NR ||
+		    n->level + 1 >= BTREE_MAX_DEPTH)
+			continue;
+
+		ret = lockrestart_do(&trans, btree_cache_warm_one(&trans, n));
+	}
+
+	bch2_trans_exit(&trans);
+	kfree(nodes);
+
+	if (ret)
+		bch_err(c, "error warming btree node cache: %s", bch2_err_str(ret));
+}
+
+/*
+ * Called once we've started - fsck reads everything anyway, so it doesn't
+ * bother:
+ */
+void bch2_btree_cache_warm(struct bch_fs *c)
+{
+	if (!c->opts.fsck)
+		queue_work(system_long_wq, &c->btree_cache.warm_work);
+}
+
+void bch2_btree_cache_warm_stop(struct bch_fs *c)
+{
+	cancel_work_sync(&c->btree_cache.warm_work);
+}
+
 void bch2_fs_btree_cache_exit(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
@@ -491,6 +746,8 @@ void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed_pcpu);
 	INIT_LIST_HEAD(&bc->freed_nonpcpu);
+	INIT_DELAYED_WORK(&bc->hot_save_work, btree_cache_hot_save_work);
+	INIT_WORK(&bc->warm_work, btree_cache_warm_work);
 }
 
 /*
@@ -547,6 +804,11 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 
+	list_for_each_entry_reverse(b, &bc->live, list)
+		if (!btree_node_pinned(bc, b) &&
+		    !btree_node_reclaim(c, b))
+			return b;
+
 	list_for_each_entry_reverse(b, &bc->live, list)
 		if (!btree_node_reclaim(c, b))
 			return b;
@@ -573,7 +835,8 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c, bool pcpu_read_locks)
 		: &bc->freed_nonpcpu;
 	struct btree *b, *b2;
 	u64 start_time = local_clock();
-	unsigned flags;
+	int node = numa_node_id();
+	unsigned flags, pass;
 
 	flags = memalloc_nofs_save();
 	mutex_lock(&bc->lock);
@@ -606,17 +869,19 @@ got_node:
 
 	/*
 	 * btree_free() doesn't free memory; it sticks the node on the end of
-	 * the list. Check if there's any freed nodes there:
+	 * the list. Check if there's any freed nodes there - preferring memory
+	 * on our own NUMA node, then any:
 	 */
-	list_for_each_entry(b2, &bc->freeable, list)
-		if (!btree_node_reclaim(c, b2)) {
-			swap(b->data, b2->data);
-			swap(b->aux_data, b2->aux_data);
-			btree_node_to_freedlist(bc, b2);
-			six_unlock_write(&b2->c.lock);
-			six_unlock_intent(&b2->c.lock);
-			goto got_mem;
-		}
+	for (pass = 0; pass < 2; pass++)
+		list_for_each_entry(b2, &bc->freeable, list)
+			if ((pass || b2->data_node == node) &&
+			    !btree_node_reclaim(c, b2)) {
+				btree_node_swap_data(b, b2);
+				btree_node_to_freedlist(bc, b2);
+				six_unlock_write(&b2->c.lock);
+				six_unlock_intent(&b2->c.lock);
+				goto got_mem;
+			}
 
 	mutex_unlock(&bc->lock);
 
@@ -638,6 +903,7 @@ out:
 	b->sib_u64s[0]		= 0;
 	b->sib_u64s[1]		= 0;
 	b->whiteout_u64s	= 0;
+	btree_node_snapshot_summary_reset(b);
 	bch2_btree_keys_init(b);
 	set_btree_node_accessed(b);
 
@@ -655,8 +921,7 @@ err:
 		bch2_btree_node_hash_remove(bc, b2);
 
 		if (b) {
-			swap(b->data, b2->data);
-			swap(b->aux_data, b2->aux_data);
+			btree_node_swap_data(b, b2);
 			btree_node_to_freedlist(bc, b2);
 			six_unlock_write(&b2->c.lock);
 			six_unlock_intent(&b2->c.lock);
@@ -727,8 +992,20 @@ static noinline struct btree *bch2_btree_node_fill(struct bch_fs *c,
 		return NULL;
 	}
 
+	mutex_lock(&bc->lock);
+	if (btree_cache_ghost_hit(bc, b->hash_val)) {
+		set_btree_node_accessed(b);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_cache_ghost_hit]);
+	}
+	mutex_unlock(&bc->lock);
+
 	set_btree_node_read_in_flight(b);
 
+	if (!sync) {
+		set_btree_node_readahead(b);
+		atomic64_inc(&bc->readahead);
+	}
+
 	six_unlock_write(&b->c.lock);
 	seq = b->c.lock.state.seq;
 	six_unlock_intent(&b->c.lock);
@@ -816,6 +1093,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 	struct bset_tree *t;
+	bool first_use = false;
 	int ret;
 
 	EBUG_ON(level >= BTREE_MAX_DEPTH);
@@ -848,6 +1126,10 @@ retry:
 
 		if (IS_ERR(b))
 			return b;
+
+		atomic64_inc(&bc->read_sync);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_cache_miss]);
+		first_use = true;
 	} else {
 lock_node:
 		/*
@@ -897,6 +1179,17 @@ lock_node:
 			trace_and_count(c, trans_restart_btree_node_reused, trans, trace_ip, path);
 			return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
 		}
+
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_cache_hit]);
+	}
+
+	if (unlikely(btree_node_readahead(b))) {
+		clear_btree_node_readahead(b);
+		atomic64_inc(&bc->readahead_hit);
+		first_use = true;
+
+		if (btree_node_read_in_flight(b))
+			atomic64_inc(&bc->readahead_wait);
 	}
 
 	if (unlikely(btree_node_read_in_flight(b))) {
@@ -934,8 +1227,13 @@ lock_node:
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
+	/*
+	 * The lookup that brought a node in doesn't count as an access, and
+	 * neither do lookups from bulk walkers - see bch2_btree_cache_scan():
+	 *
+	 * avoid atomic set bit if it's not needed:
+	 */
+	if (!first_use && !path->cold && !btree_node_accessed(b))
 		set_btree_node_accessed(b);
 
 	if (unlikely(btree_node_read_error(b))) {
@@ -1051,6 +1349,8 @@ int bch2_btree_node_prefetch(struct bch_fs *c,
 	if (b)
 		return 0;
 
+	count_event(c, btree_node_prefetch);
+
 	b = bch2_btree_node_fill(c, trans, path, k, btree_id,
 				 level, SIX_LOCK_read, false);
 	return PTR_ERR_OR_ZERO(b);
@@ -1143,7 +1443,31 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 
 void bch2_btree_cache_to_text(struct printbuf *out, struct bch_fs *c)
 {
+	u64 hit, miss, ghost;
+
 	prt_printf(out, "nr nodes:\t\t%u\n", c->btree_cache.used);
 	prt_printf(out, "nr dirty:\t\t%u\n", atomic_read(&c->btree_cache.dirty));
+	prt_printf(out, "nr interior:\t\t%u (pinned up to %u)\n",
+		   atomic_read(&c->btree_cache.nr_interior),
+		   c->btree_cache.used / BTREE_CACHE_INTERIOR_RESERVE_DIV);
+	prt_printf(out, "nr leaf:\t\t%u\n", atomic_read(&c->btree_cache.nr_leaf));
 	prt_printf(out, "cannibalize lock:\t%p\n", c->btree_cache.alloc_lock);
+	prt_printf(out, "readahead:\t\t%llu\n", atomic64_read(&c->btree_cache.readahead));
+	prt_printf(out, "readahead hit:\t\t%llu\n", atomic64_read(&c->btree_cache.readahead_hit));
+	prt_printf(out, "readahead wait:\t\t%llu\n", atomic64_read(&c->btree_cache.readahead_wait));
+	prt_printf(out, "sync reads:\t\t%llu\n", atomic64_read(&c->btree_cache.read_sync));
+
+	hit	= percpu_u64_get(c->counters + BCH_COUNTER_btree_node_cache_hit);
+	miss	= percpu_u64_get(c->counters + BCH_COUNTER_btree_node_cache_miss);
+	ghost	= percpu_u64_get(c->counters + BCH_COUNTER_btree_node_cache_ghost_hit);
+
+	prt_printf(out, "hit:\t\t\t%llu\n", hit);
+	prt_printf(out, "miss:\t\t\t%llu\n", miss);
+	prt_printf(out, "hit ratio:\t\t%llu%%\n", div64_u64(hit * 100, max_t(u64, hit + miss, 1)));
+	prt_printf(out, "ghost hit:\t\t%llu\n", ghost);
+
+	if (c->btree_cache.table_init_done) {
+		prt_printf(out, "\nhash table:\n");
+		rhashtable_stats_to_text(out, &c->btree_cache.table);
+	}
 }
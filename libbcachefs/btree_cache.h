@@ -34,6 +34,12 @@ int bch2_btree_node_prefetch(struct bch_fs *, struct btree_trans *, struct btree
 
 void bch2_btree_node_evict(struct btree_trans *, const struct bkey_i *);
 
+void bch2_btree_cache_hot_save(struct bch_fs *, bool);
+void bch2_btree_cache_hot_save_start(struct bch_fs *);
+void bch2_btree_cache_hot_save_stop(struct bch_fs *);
+void bch2_btree_cache_warm(struct bch_fs *);
+void bch2_btree_cache_warm_stop(struct bch_fs *);
+
 void bch2_fs_btree_cache_exit(struct bch_fs *);
 int bch2_fs_btree_cache_init(struct bch_fs *);
 void bch2_fs_btree_cache_init_early(struct btree_cache *);
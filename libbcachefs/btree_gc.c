@@ -35,6 +35,7 @@
 #include <linux/preempt.h>
 #include <linux/rcupdate.h>
 #include <linux/sched/task.h>
+#include <linux/sort.h>
 #include <trace/events/bcachefs.h>
 
 #define DROP_THIS_NODE		10
@@ -582,8 +583,10 @@ static int bch2_check_fix_ptrs(struct btree_trans *trans, enum btree_id btree_id
 				(printbuf_reset(&buf),
 				 bch2_bkey_val_to_text(&buf, c, *k), buf.buf))) {
 			if (!p.ptr.cached) {
+				bucket_lock(g);
 				g->gen_valid		= true;
 				g->gen			= p.ptr.gen;
+				bucket_unlock(g);
 			} else {
 				do_update = true;
 			}
@@ -598,11 +601,13 @@ static int bch2_check_fix_ptrs(struct btree_trans *trans, enum btree_id btree_id
 				(printbuf_reset(&buf),
 				 bch2_bkey_val_to_text(&buf, c, *k), buf.buf))) {
 			if (!p.ptr.cached) {
+				bucket_lock(g);
 				g->gen_valid		= true;
 				g->gen			= p.ptr.gen;
 				g->data_type		= 0;
 				g->dirty_sectors	= 0;
 				g->cached_sectors	= 0;
+				bucket_unlock(g);
 				set_bit(BCH_FS_NEED_ANOTHER_GC, &c->flags);
 			} else {
 				do_update = true;
@@ -643,7 +648,9 @@ static int bch2_check_fix_ptrs(struct btree_trans *trans, enum btree_id btree_id
 				(printbuf_reset(&buf),
 				 bch2_bkey_val_to_text(&buf, c, *k), buf.buf))) {
 			if (data_type == BCH_DATA_btree) {
+				bucket_lock(g);
 				g->data_type	= data_type;
+				bucket_unlock(g);
 				set_bit(BCH_FS_NEED_ANOTHER_GC, &c->flags);
 			} else {
 				do_update = true;
@@ -803,15 +810,22 @@ static int bch2_gc_mark_key(struct btree_trans *trans, enum btree_id btree_id,
 		if (fsck_err_on(k->k->version.lo > atomic64_read(&c->key_version), c,
 				"key version number higher than recorded: %llu > %llu",
 				k->k->version.lo,
-				atomic64_read(&c->key_version)))
-			atomic64_set(&c->key_version, k->k->version.lo);
+				atomic64_read(&c->key_version))) {
+			/* gc may be marking other btrees concurrently: */
+			u64 v = atomic64_read(&c->key_version), old;
+
+			while (v < k->k->version.lo &&
+			       (old = atomic64_cmpxchg(&c->key_version, v,
+						       k->k->version.lo)) != v)
+				v = old;
+		}
 	}
 
 	ret = commit_do(trans, NULL, NULL, 0,
 			bch2_mark_key(trans, old, *k, flags));
 fsck_err:
 err:
-	if (ret)
+	if (ret && ret != -BCH_ERR_need_serial_gc)
 		bch_err(c, "error from %s(): %s", __func__, bch2_err_str(ret));
 	return ret;
 }
@@ -896,14 +910,116 @@ static int bch2_gc_btree(struct btree_trans *trans, enum btree_id btree_id,
 	return ret;
 }
 
+struct gc_btree_work {
+	enum btree_id		btree;
+	unsigned		level;
+	struct bkey_i		*k;
+};
+
+/*
+ * Initial gc marks btrees in parallel: the keys in each btree root are marked
+ * up front, and the subtrees under each root are queued up here to be marked by
+ * a pool of workers, each with its own btree_trans.
+ *
+ * Accounting needs no merging here: gc usage is percpu, and gc bucket marks
+ * are updated with the bucket locked, so marks from different workers are
+ * summed up as usual by bch2_gc_done().
+ */
+struct gc_btrees_parallel {
+	struct bch_fs		*c;
+	unsigned		target_depth;
+	DARRAY(struct gc_btree_work) work;
+	atomic_t		next;
+	int			ret;
+};
+
+#define GC_BTREE_WORKERS_MAX	16
+
+struct gc_btree_worker {
+	struct closure		cl;
+	struct gc_btrees_parallel *p;
+};
+
+static int bch2_gc_btree_init_recurse(struct btree_trans *, struct btree *,
+				      unsigned, struct gc_btrees_parallel *);
+
+static int bch2_gc_btree_init_child(struct btree_trans *trans,
+				    enum btree_id btree_id, unsigned level,
+				    struct bkey_i *k, unsigned target_depth)
+{
+	struct bch_fs *c = trans->c;
+	struct btree *child;
+	struct printbuf buf = PRINTBUF;
+	int ret;
+
+	child = bch2_btree_node_get_noiter(trans, k, btree_id, level, false);
+	ret = PTR_ERR_OR_ZERO(child);
+
+	if (ret == -EIO) {
+		bch2_topology_error(c);
+
+		if (__fsck_err(c,
+			  FSCK_CAN_FIX|
+			  FSCK_CAN_IGNORE|
+			  FSCK_NO_RATELIMIT,
+			  "Unreadable btree node at btree %s level %u:\n"
+			  "  %s",
+			  bch2_btree_ids[btree_id],
+			  level,
+			  (printbuf_reset(&buf),
+			   bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(k)), buf.buf)) &&
+		    !test_bit(BCH_FS_TOPOLOGY_REPAIR_DONE, &c->flags)) {
+			ret = -BCH_ERR_need_topology_repair;
+			bch_info(c, "Halting mark and sweep to start topology repair pass");
+			goto fsck_err;
+		} else {
+			/* Continue marking when opted to not
+			 * fix the error: */
+			ret = 0;
+			set_bit(BCH_FS_INITIAL_GC_UNFIXED, &c->flags);
+			goto fsck_err;
+		}
+	} else if (ret) {
+		bch_err(c, "%s: error getting btree node: %s",
+			__func__, bch2_err_str(ret));
+		goto fsck_err;
+	}
+
+	ret = bch2_gc_btree_init_recurse(trans, child, target_depth, NULL);
+	six_unlock_read(&child->c.lock);
+fsck_err:
+	printbuf_exit(&buf);
+	return ret;
+}
+
+static int gc_btree_work_add(struct gc_btrees_parallel *p,
+			     enum btree_id btree, unsigned level,
+			     struct bkey_i *k)
+{
+	struct gc_btree_work w = {
+		.btree	= btree,
+		.level	= level,
+		.k	= kmalloc(bkey_bytes(&k->k), GFP_KERNEL),
+	};
+
+	if (!w.k || darray_push(&p->work, w)) {
+		kfree(w.k);
+		bch_err(p->c, "%s: error allocating memory", __func__);
+		return -ENOMEM;
+	}
+
+	bkey_copy(w.k, k);
+	return 0;
+}
+
 static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b,
-				      unsigned target_depth)
+				      unsigned target_depth,
+				      struct gc_btrees_parallel *p)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_and_journal_iter iter;
 	struct bkey_s_c k;
 	struct bkey_buf cur, prev;
-	struct printbuf buf = PRINTBUF;
 	int ret = 0;
 
 	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
@@ -918,8 +1034,9 @@ static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b
 		ret = bch2_gc_mark_key(trans, b->c.btree_id, b->c.level,
 				       false, &k, true);
 		if (ret) {
-			bch_err(c, "%s: error from bch2_gc_mark_key: %s",
-				__func__, bch2_err_str(ret));
+			if (ret != -BCH_ERR_need_serial_gc)
+				bch_err(c, "%s: error from bch2_gc_mark_key: %s",
+					__func__, bch2_err_str(ret));
 			goto fsck_err;
 		}
 
@@ -944,50 +1061,15 @@ static int bch2_gc_btree_init_recurse(struct btree_trans *trans, struct btree *b
 		bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
 
 		while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
-			struct btree *child;
-
 			bch2_bkey_buf_reassemble(&cur, c, k);
 			bch2_btree_and_journal_iter_advance(&iter);
 
-			child = bch2_btree_node_get_noiter(trans, cur.k,
-						b->c.btree_id, b->c.level - 1,
-						false);
-			ret = PTR_ERR_OR_ZERO(child);
-
-			if (ret == -EIO) {
-				bch2_topology_error(c);
-
-				if (__fsck_err(c,
-					  FSCK_CAN_FIX|
-					  FSCK_CAN_IGNORE|
-					  FSCK_NO_RATELIMIT,
-					  "Unreadable btree node at btree %s level %u:\n"
-					  "  %s",
-					  bch2_btree_ids[b->c.btree_id],
-					  b->c.level - 1,
-					  (printbuf_reset(&buf),
-					   bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(cur.k)), buf.buf)) &&
-				    !test_bit(BCH_FS_TOPOLOGY_REPAIR_DONE, &c->flags)) {
-					ret = -BCH_ERR_need_topology_repair;
-					bch_info(c, "Halting mark and sweep to start topology repair pass");
-					goto fsck_err;
-				} else {
-					/* Continue marking when opted to not
-					 * fix the error: */
-					ret = 0;
-					set_bit(BCH_FS_INITIAL_GC_UNFIXED, &c->flags);
-					continue;
-				}
-			} else if (ret) {
-				bch_err(c, "%s: error getting btree node: %s",
-					__func__, bch2_err_str(ret));
-				break;
-			}
-
-			ret = bch2_gc_btree_init_recurse(trans, child,
-							 target_depth);
-			six_unlock_read(&child->c.lock);
-
+			ret = p
+				? gc_btree_work_add(p, b->c.btree_id,
+						    b->c.level - 1, cur.k)
+				: bch2_gc_btree_init_child(trans, b->c.btree_id,
+						b->c.level - 1, cur.k,
+						target_depth);
 			if (ret)
 				break;
 		}
@@ -996,13 +1078,17 @@ fsck_err:
 	bch2_bkey_buf_exit(&cur, c);
 	bch2_bkey_buf_exit(&prev, c);
 	bch2_btree_and_journal_iter_exit(&iter);
-	printbuf_exit(&buf);
 	return ret;
 }
 
+/*
+ * With @p, only the keys in the root are marked, and the subtrees under the
+ * root are queued up for gc workers:
+ */
 static int bch2_gc_btree_init(struct btree_trans *trans,
 			      enum btree_id btree_id,
-			      bool metadata_only)
+			      bool metadata_only,
+			      struct gc_btrees_parallel *p)
 {
 	struct bch_fs *c = trans->c;
 	struct btree *b;
@@ -1035,7 +1121,7 @@ static int bch2_gc_btree_init(struct btree_trans *trans,
 	}
 
 	if (b->c.level >= target_depth)
-		ret = bch2_gc_btree_init_recurse(trans, b, target_depth);
+		ret = bch2_gc_btree_init_recurse(trans, b, target_depth, p);
 
 	if (!ret) {
 		struct bkey_s_c k = bkey_i_to_s_c(&b->key);
@@ -1046,43 +1132,128 @@ static int bch2_gc_btree_init(struct btree_trans *trans,
 fsck_err:
 	six_unlock_read(&b->c.lock);
 
-	if (ret < 0)
+	if (ret < 0 && ret != -BCH_ERR_need_serial_gc)
 		bch_err(c, "error from %s(): %s", __func__, bch2_err_str(ret));
 	printbuf_exit(&buf);
 	return ret;
 }
 
+static void bch2_gc_btree_worker(struct closure *cl)
+{
+	struct gc_btree_worker *w = container_of(cl, struct gc_btree_worker, cl);
+	struct gc_btrees_parallel *p = w->p;
+	struct btree_trans trans;
+	unsigned i;
+	int ret;
+
+	bch2_trans_init(&trans, p->c, 0, 0);
+	trans.is_initial_gc = true;
+
+	while (!READ_ONCE(p->ret) &&
+	       (i = atomic_inc_return(&p->next) - 1) < p->work.nr) {
+		struct gc_btree_work *work = p->work.data + i;
+
+		ret = bch2_gc_btree_init_child(&trans, work->btree, work->level,
+					       work->k, p->target_depth);
+		if (ret)
+			cmpxchg(&p->ret, 0, ret);
+	}
+
+	bch2_trans_exit(&trans);
+	closure_return(cl);
+}
+
+static int bch2_gc_btrees_parallel(struct bch_fs *c, enum btree_id *ids,
+				   bool metadata_only)
+{
+	struct gc_btrees_parallel p = {
+		.c		= c,
+		.target_depth	= metadata_only ? 1 : 0,
+	};
+	struct gc_btree_worker w[GC_BTREE_WORKERS_MAX];
+	struct btree_trans trans;
+	struct gc_btree_work *work;
+	struct closure cl;
+	unsigned i, nr_workers = min_t(unsigned, num_online_cpus(),
+				       GC_BTREE_WORKERS_MAX);
+	int ret = 0;
+
+	set_bit(BCH_FS_GC_PARALLEL, &c->flags);
+
+	bch2_trans_init(&trans, c, 0, 0);
+	trans.is_initial_gc = true;
+
+	/*
+	 * Marking extents checks stripe pointers against gc_stripes, so the
+	 * stripes btree - first in gc order - is marked before everything else:
+	 */
+	BUG_ON(ids[0] != BTREE_ID_stripes);
+
+	ret = bch2_gc_btree_init(&trans, ids[0], metadata_only, NULL);
+
+	for (i = 1; i < BTREE_ID_NR && !ret; i++)
+		ret = bch2_gc_btree_init(&trans, ids[i], metadata_only, &p);
+
+	bch2_trans_exit(&trans);
+
+	if (!ret && p.work.nr) {
+		closure_init_stack(&cl);
+
+		for (i = 0; i < min_t(size_t, nr_workers, p.work.nr); i++) {
+			w[i].p = &p;
+			closure_call(&w[i].cl, bch2_gc_btree_worker,
+				     system_unbound_wq, &cl);
+		}
+		closure_sync(&cl);
+
+		ret = p.ret;
+	}
+
+	darray_for_each(p.work, work)
+		kfree(work->k);
+	darray_exit(&p.work);
+
+	clear_bit(BCH_FS_GC_PARALLEL, &c->flags);
+	return ret;
+}
+
 static inline int btree_id_gc_phase_cmp(enum btree_id l, enum btree_id r)
 {
 	return  (int) btree_id_to_gc_phase(l) -
 		(int) btree_id_to_gc_phase(r);
 }
 
-static int bch2_gc_btrees(struct bch_fs *c, bool initial, bool metadata_only)
+static int bch2_gc_btrees(struct bch_fs *c, bool initial, bool metadata_only,
+			  bool parallel)
 {
 	struct btree_trans trans;
 	enum btree_id ids[BTREE_ID_NR];
 	unsigned i;
 	int ret = 0;
 
+	for (i = 0; i < BTREE_ID_NR; i++)
+		ids[i] = i;
+	bubble_sort(ids, BTREE_ID_NR, btree_id_gc_phase_cmp);
+
+	if (initial && parallel) {
+		ret = bch2_gc_btrees_parallel(c, ids, metadata_only);
+		goto out;
+	}
+
 	bch2_trans_init(&trans, c, 0, 0);
 
 	if (initial)
 		trans.is_initial_gc = true;
 
-	for (i = 0; i < BTREE_ID_NR; i++)
-		ids[i] = i;
-	bubble_sort(ids, BTREE_ID_NR, btree_id_gc_phase_cmp);
-
 	for (i = 0; i < BTREE_ID_NR && !ret; i++)
 		ret = initial
-			? bch2_gc_btree_init(&trans, ids[i], metadata_only)
+			? bch2_gc_btree_init(&trans, ids[i], metadata_only, NULL)
 			: bch2_gc_btree(&trans, ids[i], initial, metadata_only);
 
-	if (ret < 0)
-		bch_err(c, "error from %s(): %s", __func__, bch2_err_str(ret));
-
 	bch2_trans_exit(&trans);
+out:
+	if (ret < 0 && ret != -BCH_ERR_need_serial_gc)
+		bch_err(c, "error from %s(): %s", __func__, bch2_err_str(ret));
 	return ret;
 }
 
@@ -1175,6 +1346,7 @@ static void bch2_gc_free(struct bch_fs *c)
 			sizeof(struct bucket_array) +
 			ca->mi.nbuckets * sizeof(struct bucket));
 		ca->buckets_gc = NULL;
+		genradix_free(&ca->gc_bucket_stripes);
 
 		free_percpu(ca->usage_gc);
 		ca->usage_gc = NULL;
@@ -1338,9 +1510,10 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	struct bch_dev *ca = bch_dev_bkey_exists(c, iter->pos.inode);
-	struct bucket gc, *b;
+	struct bucket *b;
 	struct bkey_i_alloc_v4 *a;
-	struct bch_alloc_v4 old, new;
+	struct bch_alloc_v4 old, new, gc;
+	u32 stripe;
 	enum bch_data_type type;
 	int ret;
 
@@ -1352,6 +1525,7 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 
 	percpu_down_read(&c->mark_lock);
 	b = gc_bucket(ca, iter->pos.offset);
+	stripe = gc_bucket_stripe(ca, iter->pos.offset);
 
 	/*
 	 * b->data_type doesn't yet include need_discard & need_gc_gen states -
@@ -1359,7 +1533,7 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 	 */
 	type = __alloc_data_type(b->dirty_sectors,
 				 b->cached_sectors,
-				 b->stripe,
+				 stripe,
 				 old,
 				 b->data_type);
 	if (b->data_type != type) {
@@ -1373,7 +1547,14 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 		preempt_enable();
 	}
 
-	gc = *b;
+	gc = (struct bch_alloc_v4) {
+		.gen			= b->gen,
+		.data_type		= b->data_type,
+		.dirty_sectors		= b->dirty_sectors,
+		.cached_sectors		= b->cached_sectors,
+		.stripe_redundancy	= b->stripe_redundancy,
+		.stripe			= stripe,
+	};
 	percpu_up_read(&c->mark_lock);
 
 	if (metadata_only &&
@@ -1497,11 +1678,17 @@ static int bch2_gc_alloc_start(struct bch_fs *c, bool metadata_only)
 		    (a.data_type == BCH_DATA_user ||
 		     a.data_type == BCH_DATA_cached ||
 		     a.data_type == BCH_DATA_parity)) {
+			if (a.stripe) {
+				ret = gc_bucket_stripe_prealloc(ca, k.k->p.offset);
+				if (ret)
+					break;
+			}
+
 			g->data_type		= a.data_type;
 			g->dirty_sectors	= a.dirty_sectors;
 			g->cached_sectors	= a.cached_sectors;
-			g->stripe		= a.stripe;
 			g->stripe_redundancy	= a.stripe_redundancy;
+			gc_bucket_stripe_set(ca, k.k->p.offset, a.stripe);
 		}
 	}
 	bch2_trans_iter_exit(&trans, &iter);
@@ -1561,12 +1748,12 @@ static int bch2_gc_write_reflink_key(struct btree_trans *trans,
 		return -EINVAL;
 	}
 
-	if (fsck_err_on(r->refcount != le64_to_cpu(*refcount), c,
+	if (fsck_err_on(atomic_read(&r->refcount) != le64_to_cpu(*refcount), c,
 			"reflink key has wrong refcount:\n"
 			"  %s\n"
 			"  should be %u",
 			(bch2_bkey_val_to_text(&buf, c, k), buf.buf),
-			r->refcount)) {
+			atomic_read(&r->refcount))) {
 		struct bkey_i *new;
 
 		new = bch2_trans_kmalloc(trans, bkey_bytes(k.k));
@@ -1576,10 +1763,10 @@ static int bch2_gc_write_reflink_key(struct btree_trans *trans,
 
 		bkey_reassemble(new, k);
 
-		if (!r->refcount)
+		if (!atomic_read(&r->refcount))
 			new->k.type = KEY_TYPE_deleted;
 		else
-			*bkey_refcount(new) = cpu_to_le64(r->refcount);
+			*bkey_refcount(new) = cpu_to_le64(atomic_read(&r->refcount));
 
 		ret = bch2_trans_update(trans, iter, new, 0);
 	}
@@ -1643,7 +1830,7 @@ static int bch2_gc_reflink_start(struct bch_fs *c,
 
 		r->offset	= k.k->p.offset;
 		r->size		= k.k->size;
-		r->refcount	= 0;
+		atomic_set(&r->refcount, 0);
 	}
 	bch2_trans_iter_exit(&trans, &iter);
 
@@ -1657,7 +1844,7 @@ static void bch2_gc_reflink_reset(struct bch_fs *c, bool metadata_only)
 	struct reflink_gc *r;
 
 	genradix_for_each(&c->reflink_gc_table, iter, r)
-		r->refcount = 0;
+		atomic_set(&r->refcount, 0);
 }
 
 static int bch2_gc_write_stripes_key(struct btree_trans *trans,
@@ -1756,6 +1943,7 @@ static void bch2_gc_stripes_reset(struct bch_fs *c, bool metadata_only)
 int bch2_gc(struct bch_fs *c, bool initial, bool metadata_only)
 {
 	unsigned iter = 0;
+	bool parallel = !c->opts.reconstruct_alloc;
 	int ret;
 
 	lockdep_assert_held(&c->state_lock);
@@ -1763,7 +1951,7 @@ int bch2_gc(struct bch_fs *c, bool initial, bool metadata_only)
 	down_write(&c->gc_lock);
 
 	bch2_btree_interior_updates_flush(c);
-
+start:
 	ret   = bch2_gc_start(c, metadata_only) ?:
 		bch2_gc_alloc_start(c, metadata_only) ?:
 		bch2_gc_reflink_start(c, metadata_only);
@@ -1786,7 +1974,23 @@ again:
 		set_bit(BCH_FS_TOPOLOGY_REPAIR_DONE, &c->flags);
 	}
 
-	ret = bch2_gc_btrees(c, initial, metadata_only);
+	ret = bch2_gc_btrees(c, initial, metadata_only, parallel);
+
+	if (ret == -BCH_ERR_need_serial_gc) {
+		/*
+		 * Repairs insert into the journal keys, which can't be done
+		 * while gc is walking btrees in parallel: start over, serially.
+		 */
+		bch_info(c, "Restarting mark and sweep serially to repair errors");
+		parallel = false;
+
+		percpu_down_write(&c->mark_lock);
+		bch2_gc_free(c);
+		percpu_up_write(&c->mark_lock);
+
+		bch2_flush_fsck_errs(c);
+		goto start;
+	}
 
 	if (ret == -BCH_ERR_need_topology_repair &&
 	    !test_bit(BCH_FS_TOPOLOGY_REPAIR_DONE, &c->flags) &&
@@ -1924,38 +2128,153 @@ static int bch2_alloc_write_oldest_gen(struct btree_trans *trans, struct btree_i
 	return bch2_trans_update(trans, iter, &a_mut->k_i, 0);
 }
 
-int bch2_gc_gens(struct bch_fs *c)
+/*
+ * Recomputing oldest_gen is done incrementally by the gc thread: a pass over
+ * every pointer is split up into runs of GC_GENS_KEYS_PER_RUN keys, resuming
+ * from c->gc_gens_btree/c->gc_gens_pos, and ca->oldest_gen is kept around
+ * between runs until the pass is done and oldest_gen is written out.
+ *
+ * Runs are spaced GC_GENS_RUN_DELAY apart, except when buckets are waiting on
+ * gens gc to be allocated again.
+ */
+#define GC_GENS_KEYS_PER_RUN	(1U << 16)
+#define GC_GENS_RUN_DELAY	(HZ / 10)
+
+static int gc_btree_gens_key_budget(struct btree_trans *trans,
+				    struct btree_iter *iter,
+				    struct bkey_s_c k, u64 *nr_keys)
 {
-	struct btree_trans trans;
+	struct bch_fs *c = trans->c;
+
+	c->gc_gens_pos = iter->pos;
+
+	if (!*nr_keys)
+		return 1;
+	--*nr_keys;
+
+	return gc_btree_gens_key(trans, iter, k);
+}
+
+static int bch2_alloc_write_oldest_gen_dev(struct btree_trans *trans,
+					   struct btree_iter *iter,
+					   struct bkey_s_c k, unsigned dev)
+{
+	return iter->pos.inode == dev
+		? bch2_alloc_write_oldest_gen(trans, iter, k)
+		: 1;
+}
+
+static u64 dev_need_gc_gens(struct bch_dev *ca)
+{
+	return bch2_dev_usage_read(ca).d[BCH_DATA_need_gc_gens].buckets;
+}
+
+static bool bch2_gc_gens_urgent(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	for_each_member_device(ca, c, i)
+		if (dev_need_gc_gens(ca)) {
+			percpu_ref_put(&ca->ref);
+			return true;
+		}
+
+	return false;
+}
+
+struct gc_gens_dev {
+	u64		need_gc_gens;
+	unsigned	dev;
+};
+
+static int gc_gens_dev_cmp(const void *_l, const void *_r)
+{
+	const struct gc_gens_dev *l = _l, *r = _r;
+
+	return cmp_int(r->need_gc_gens, l->need_gc_gens);
+}
+
+/*
+ * Devices with the most buckets waiting on gens gc get their new oldest_gen
+ * written first:
+ */
+static int bch2_gc_gens_write_alloc(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct gc_gens_dev devs[BCH_SB_MEMBERS_MAX];
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bch_dev *ca;
-	u64 b, start_time = local_clock();
+	unsigned i, nr = 0;
+	int ret = 0;
+
+	for_each_member_device(ca, c, i)
+		devs[nr++] = (struct gc_gens_dev) {
+			.need_gc_gens	= dev_need_gc_gens(ca),
+			.dev		= ca->dev_idx,
+		};
+
+	sort(devs, nr, sizeof(devs[0]), gc_gens_dev_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		ret = for_each_btree_key_commit(trans, iter, BTREE_ID_alloc,
+				POS(devs[i].dev, 0),
+				BTREE_ITER_PREFETCH,
+				k,
+				NULL, NULL,
+				BTREE_INSERT_NOFAIL,
+			bch2_alloc_write_oldest_gen_dev(trans, &iter, k, devs[i].dev));
+		if (ret < 0)
+			break;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+static void bch2_gc_gens_free(struct bch_fs *c)
+{
+	struct bch_dev *ca;
 	unsigned i;
-	int ret;
 
-	/*
-	 * Ideally we would be using state_lock and not gc_lock here, but that
-	 * introduces a deadlock in the RO path - we currently take the state
-	 * lock at the start of going RO, thus the gc thread may get stuck:
-	 */
-	if (!mutex_trylock(&c->gc_gens_lock))
-		return 0;
+	for_each_member_device(ca, c, i) {
+		kvfree(ca->oldest_gen);
+		ca->oldest_gen = NULL;
+	}
+}
 
-	trace_and_count(c, gc_gens_start, c);
-	down_read(&c->gc_lock);
-	bch2_trans_init(&trans, c, 0, 0);
+static bool bch2_gc_gens_in_progress(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	for_each_member_device(ca, c, i)
+		if (!ca->oldest_gen) {
+			percpu_ref_put(&ca->ref);
+			return false;
+		}
+
+	return true;
+}
+
+static int bch2_gc_gens_pass_start(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	u64 b;
+	unsigned i;
+
+	/* Devices may have been added or resized since the last run: */
+	bch2_gc_gens_free(c);
 
 	for_each_member_device(ca, c, i) {
 		struct bucket_gens *gens;
 
-		BUG_ON(ca->oldest_gen);
-
 		ca->oldest_gen = kvmalloc(ca->mi.nbuckets, GFP_KERNEL);
 		if (!ca->oldest_gen) {
 			percpu_ref_put(&ca->ref);
-			ret = -ENOMEM;
-			goto err;
+			bch2_gc_gens_free(c);
+			return -ENOMEM;
 		}
 
 		gens = bucket_gens(ca);
@@ -1965,49 +2284,80 @@ int bch2_gc_gens(struct bch_fs *c)
 			ca->oldest_gen[b] = gens->b[b];
 	}
 
-	for (i = 0; i < BTREE_ID_NR; i++)
-		if (btree_type_has_ptrs(i)) {
-			struct btree_iter iter;
-			struct bkey_s_c k;
-
-			c->gc_gens_btree = i;
-			c->gc_gens_pos = POS_MIN;
-			ret = for_each_btree_key_commit(&trans, iter, i,
-					POS_MIN,
-					BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
-					k,
-					NULL, NULL,
-					BTREE_INSERT_NOFAIL,
-				gc_btree_gens_key(&trans, &iter, k));
-			if (ret) {
-				bch_err(c, "error recalculating oldest_gen: %s", bch2_err_str(ret));
-				goto err;
-			}
-		}
+	c->gc_gens_btree	= 0;
+	c->gc_gens_pos		= POS_MIN;
+	c->gc_gens_start_time	= local_clock();
+
+	trace_and_count(c, gc_gens_start, c);
+	return 0;
+}
+
+/*
+ * Returns 1 if the pass isn't finished yet because @nr_keys ran out, 0 when
+ * the pass is done:
+ */
+static int __bch2_gc_gens(struct bch_fs *c, u64 nr_keys)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret = 0;
 
-	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_alloc,
-			POS_MIN,
-			BTREE_ITER_PREFETCH,
-			k,
-			NULL, NULL,
-			BTREE_INSERT_NOFAIL,
-		bch2_alloc_write_oldest_gen(&trans, &iter, k));
+	/*
+	 * Ideally we would be using state_lock and not gc_lock here, but that
+	 * introduces a deadlock in the RO path - we currently take the state
+	 * lock at the start of going RO, thus the gc thread may get stuck:
+	 */
+	if (!mutex_trylock(&c->gc_gens_lock))
+		return 0;
+
+	down_read(&c->gc_lock);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	if (!bch2_gc_gens_in_progress(c)) {
+		ret = bch2_gc_gens_pass_start(c);
+		if (ret)
+			goto err;
+	}
+
+	for (; c->gc_gens_btree < BTREE_ID_NR; c->gc_gens_btree++) {
+		if (!btree_type_has_ptrs(c->gc_gens_btree))
+			continue;
+
+		ret = for_each_btree_key_commit(&trans, iter, c->gc_gens_btree,
+				c->gc_gens_pos,
+				BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
+				k,
+				NULL, NULL,
+				BTREE_INSERT_NOFAIL,
+			gc_btree_gens_key_budget(&trans, &iter, k, &nr_keys));
+		if (ret)
+			goto err;
+
+		c->gc_gens_pos = POS_MIN;
+	}
+
+	ret = bch2_gc_gens_write_alloc(&trans);
 	if (ret) {
 		bch_err(c, "error writing oldest_gen: %s", bch2_err_str(ret));
 		goto err;
 	}
 
+	bch2_gc_gens_free(c);
+
 	c->gc_gens_btree	= 0;
 	c->gc_gens_pos		= POS_MIN;
 
 	c->gc_count++;
 
-	bch2_time_stats_update(&c->times[BCH_TIME_btree_gc], start_time);
+	bch2_time_stats_update(&c->times[BCH_TIME_btree_gc], c->gc_gens_start_time);
 	trace_and_count(c, gc_gens_end, c);
 err:
-	for_each_member_device(ca, c, i) {
-		kvfree(ca->oldest_gen);
-		ca->oldest_gen = NULL;
+	if (ret < 0) {
+		if (c->gc_gens_btree < BTREE_ID_NR)
+			bch_err(c, "error recalculating oldest_gen: %s", bch2_err_str(ret));
+		/* start over on the next run: */
+		bch2_gc_gens_free(c);
 	}
 
 	bch2_trans_exit(&trans);
@@ -2016,12 +2366,18 @@ err:
 	return ret;
 }
 
+int bch2_gc_gens(struct bch_fs *c)
+{
+	return __bch2_gc_gens(c, U64_MAX);
+}
+
 static int bch2_gc_thread(void *arg)
 {
 	struct bch_fs *c = arg;
 	struct io_clock *clock = &c->io_clock[WRITE];
 	unsigned long last = atomic64_read(&clock->now);
 	unsigned last_kick = atomic_read(&c->kick_gc);
+	bool gens_in_progress = false;
 	int ret;
 
 	set_freezable();
@@ -2038,6 +2394,12 @@ static int bch2_gc_thread(void *arg)
 			if (atomic_read(&c->kick_gc) != last_kick)
 				break;
 
+			if (gens_in_progress) {
+				if (!bch2_gc_gens_urgent(c))
+					schedule_timeout(GC_GENS_RUN_DELAY);
+				break;
+			}
+
 			if (c->btree_gc_periodic) {
 				unsigned long next = last + c->capacity / 16;
 
@@ -2062,10 +2424,11 @@ static int bch2_gc_thread(void *arg)
 #if 0
 		ret = bch2_gc(c, false, false);
 #else
-		ret = bch2_gc_gens(c);
+		ret = __bch2_gc_gens(c, GC_GENS_KEYS_PER_RUN);
 #endif
 		if (ret < 0)
 			bch_err(c, "btree gc failed: %s", bch2_err_str(ret));
+		gens_in_progress = ret > 0;
 
 		debug_check_no_locks_held();
 	}
@@ -450,6 +450,149 @@ void bch2_btree_build_aux_trees(struct btree *b)
 				t == bset_tree_last(b));
 }
 
+/*
+ * Compute the snapshot summary of a leaf node from scratch: this walks every
+ * key in every bset, including overwritten keys, so it's a superset. After
+ * that inserts add to it and nothing removes from it, so it only needs
+ * recomputing when the node is read or rewritten:
+ */
+void bch2_btree_node_snapshot_summary(struct btree *b)
+{
+	struct bset_tree *t;
+	struct bkey_packed *k;
+
+	btree_node_snapshot_summary_reset(b);
+
+	if (b->c.level || !btree_type_has_snapshots(b->c.btree_id))
+		return;
+
+	b->snapshot_max		= 0;
+	b->snapshot_bloom	= 0;
+
+	for_each_bset(b, t)
+		bset_tree_for_each_key(b, t, k)
+			btree_node_snapshot_summary_add(b,
+					bkey_unpack_pos(b, k).snapshot);
+}
+
+/*
+ * Background compaction:
+ *
+ * Compacting whiteouts on insert puts the cost on whichever committer happens
+ * to trigger it; for leaf nodes with room to spare we instead queue the node
+ * and compact it from a worker, which runs for at most BTREE_COMPACT_BUDGET_NS
+ * before requeueing itself. Nodes that are close to full, or that don't fit in
+ * the queue, are still compacted inline.
+ */
+#define BTREE_COMPACT_BUDGET_NS		NSEC_PER_MSEC
+
+static bool btree_compact_queue_work(struct bch_fs *c)
+{
+	if (!percpu_ref_tryget_live(&c->writes))
+		return false;
+
+	if (!queue_work(c->btree_update_wq, &c->btree_compact_work))
+		percpu_ref_put(&c->writes);
+	return true;
+}
+
+bool bch2_btree_node_compact_defer(struct bch_fs *c, struct btree *b)
+{
+	bool ret = false;
+
+	if (b->c.level ||
+	    bch_btree_keys_u64s_remaining(c, b) < btree_bytes(c) / sizeof(u64) / 8)
+		return false;
+
+	if (test_and_set_bit(BTREE_NODE_compact_queued, &b->flags))
+		return true;
+
+	spin_lock(&c->btree_compact_lock);
+	if (c->btree_compact_nr < BTREE_COMPACT_QUEUE) {
+		c->btree_compact_queue[c->btree_compact_nr++] =
+			(struct btree_compact_entry) {
+				.btree_id	= b->c.btree_id,
+				.level		= b->c.level,
+				.pos		= b->key.k.p,
+				.seq		= b->data->keys.seq,
+			};
+		ret = true;
+	}
+	spin_unlock(&c->btree_compact_lock);
+
+	if (ret)
+		btree_compact_queue_work(c);
+	else
+		clear_bit(BTREE_NODE_compact_queued, &b->flags);
+
+	return ret;
+}
+
+static int btree_node_compact_trans(struct btree_trans *trans,
+				    struct btree_compact_entry *e)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct btree *b;
+	int ret;
+
+	bch2_trans_node_iter_init(trans, &iter, e->btree_id, e->pos,
+				  e->level + 1, e->level, 0);
+	b = bch2_btree_iter_peek_node(&iter);
+	ret = PTR_ERR_OR_ZERO(b);
+	if (ret || !b || b->data->keys.seq != e->seq)
+		goto out;
+
+	ret = bch2_btree_node_lock_write(trans, iter.path, &b->c);
+	if (ret)
+		goto out;
+
+	if (test_and_clear_bit(BTREE_NODE_compact_queued, &b->flags) &&
+	    (bch2_maybe_compact_whiteouts(c, b) |
+	     (b->nsets == MAX_BSETS && btree_node_compact(c, b)))) {
+		bch2_btree_build_aux_trees(b);
+		bch2_trans_node_reinit_iter(trans, b);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_compact_background]);
+	}
+
+	bch2_btree_node_unlock_write(trans, iter.path, b);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+void bch2_btree_node_compact_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, btree_compact_work);
+	struct btree_trans trans;
+	struct btree_compact_entry e;
+	u64 start = local_clock();
+	bool more;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	while (1) {
+		spin_lock(&c->btree_compact_lock);
+		more = c->btree_compact_nr != 0;
+		if (more)
+			e = c->btree_compact_queue[--c->btree_compact_nr];
+		spin_unlock(&c->btree_compact_lock);
+
+		if (!more)
+			break;
+
+		lockrestart_do(&trans, btree_node_compact_trans(&trans, &e));
+
+		if (local_clock() - start > BTREE_COMPACT_BUDGET_NS) {
+			btree_compact_queue_work(c);
+			break;
+		}
+	}
+
+	bch2_trans_exit(&trans);
+	percpu_ref_put(&c->writes);
+}
+
 /*
  * @bch_btree_init_next - initialize a new (unwritten) bset that can then be
  * inserted into
@@ -665,7 +808,7 @@ static int validate_bset(struct bch_fs *c, struct bch_dev *ca,
 			 version, c->sb.version_min)) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->version_min = cpu_to_le16(version);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
@@ -675,7 +818,7 @@ static int validate_bset(struct bch_fs *c, struct bch_dev *ca,
 			 version, c->sb.version)) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->version = cpu_to_le16(version);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
@@ -781,8 +924,14 @@ static int bset_key_invalid(struct bch_fs *c, struct btree *b,
 		(rw == WRITE ? bch2_bkey_val_invalid(c, k, READ, err) : 0);
 }
 
+/*
+ * @trusted: the bset's checksum matched and it was written by the current
+ * version, so skip the (expensive) per key invalid checks - the structural
+ * checks are still done:
+ */
 static int validate_bset_keys(struct bch_fs *c, struct btree *b,
-			 struct bset *i, int write, bool have_retry)
+			 struct bset *i, int write, bool have_retry,
+			 bool trusted)
 {
 	unsigned version = le16_to_cpu(i->version);
 	struct bkey_packed *k, *prev = NULL;
@@ -821,7 +970,8 @@ static int validate_bset_keys(struct bch_fs *c, struct btree *b,
 		u = __bkey_disassemble(b, k, &tmp);
 
 		printbuf_reset(&buf);
-		if (bset_key_invalid(c, b, u.s_c, updated_range, write, &buf)) {
+		if (!trusted &&
+		    bset_key_invalid(c, b, u.s_c, updated_range, write, &buf)) {
 			printbuf_reset(&buf);
 			prt_printf(&buf, "invalid bkey:  ");
 			bset_key_invalid(c, b, u.s_c, updated_range, write, &buf);
@@ -868,6 +1018,79 @@ fsck_err:
 	return ret;
 }
 
+/*
+ * Bset headers aren't encrypted, so before validating anything we can walk the
+ * bsets in a node we just read and checksum them together with
+ * bch2_checksum_bufs(). This is only a cache: bch2_btree_node_read_done() still
+ * does all the validation, and checksums any bset we didn't find here itself.
+ */
+#define BTREE_NODE_CSUMS_MAX	8
+
+struct btree_node_csums {
+	unsigned		nr;
+	unsigned		offset[BTREE_NODE_CSUMS_MAX];
+	struct bch_csum_buf	bufs[BTREE_NODE_CSUMS_MAX];
+};
+
+static void btree_node_csums_get(struct bch_fs *c, struct btree *b,
+				 unsigned end, struct btree_node_csums *csums)
+{
+	unsigned type = BSET_CSUM_TYPE(&b->data->keys);
+	unsigned offset = 0;
+
+	csums->nr = 0;
+
+	if (!bch2_checksum_type_valid(c, type))
+		return;
+
+	while (offset < end && csums->nr < BTREE_NODE_CSUMS_MAX) {
+		struct btree_node_entry *bne = (void *) b->data + (offset << 9);
+		struct bset *i;
+		const void *start, *vend;
+		unsigned sectors;
+
+		if (!offset) {
+			i	= &b->data->keys;
+			start	= (void *) b->data + sizeof(b->data->csum);
+			vend	= vstruct_end(b->data);
+			sectors	= vstruct_sectors(b->data, c->block_bits);
+		} else {
+			i	= &bne->keys;
+			if (i->seq != b->data->keys.seq)
+				break;
+
+			start	= (void *) bne + sizeof(bne->csum);
+			vend	= vstruct_end(bne);
+			sectors	= vstruct_sectors(bne, c->block_bits);
+		}
+
+		if (BSET_CSUM_TYPE(i) != type ||
+		    offset + sectors > end)
+			break;
+
+		csums->offset[csums->nr] = offset;
+		csums->bufs[csums->nr++] = (struct bch_csum_buf) {
+			.nonce	= btree_nonce(i, offset << 9),
+			.data	= start,
+			.len	= vend - start,
+		};
+		offset += sectors;
+	}
+
+	bch2_checksum_bufs(c, type, csums->bufs, csums->nr);
+}
+
+static struct bch_csum_buf *btree_node_csum_find(struct btree_node_csums *csums,
+						 unsigned offset)
+{
+	unsigned i;
+
+	for (i = 0; i < csums->nr; i++)
+		if (csums->offset[i] == offset)
+			return &csums->bufs[i];
+	return NULL;
+}
+
 int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			      struct btree *b, bool have_retry)
 {
@@ -877,7 +1100,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	struct bkey_packed *k;
 	struct bch_extent_ptr *ptr;
 	struct bset *i;
-	bool used_mempool, blacklisted;
+	struct btree_node_csums csums;
+	bool used_mempool, blacklisted, bad_csum, trusted, node_trusted = true;
 	bool updated_range = b->key.k.type == KEY_TYPE_btree_ptr_v2 &&
 		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
 	unsigned u64s;
@@ -891,8 +1115,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	b->written = 0;
 
 	iter = mempool_alloc(&c->fill_iter, GFP_NOIO);
-	sort_iter_init(iter, b);
-	iter->size = (btree_blocks(c) + 1) * 2;
+	sort_iter_init_nr(iter, b, (btree_blocks(c) + 1) * 2);
 
 	if (bch2_meta_read_fault("btree"))
 		btree_err(BTREE_ERR_MUST_RETRY, c, ca, b, NULL,
@@ -917,10 +1140,13 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			     b->data->keys.seq, bp->seq);
 	}
 
+	btree_node_csums_get(c, b, ptr_written ?: btree_sectors(c), &csums);
+
 	while (b->written < (ptr_written ?: btree_sectors(c))) {
 		unsigned sectors;
 		struct nonce nonce;
 		struct bch_csum csum;
+		struct bch_csum_buf *pre = btree_node_csum_find(&csums, b->written);
 		bool first = !b->written;
 
 		if (!b->written) {
@@ -932,9 +1158,11 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				     BSET_CSUM_TYPE(i));
 
 			nonce = btree_nonce(i, b->written << 9);
-			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, b->data);
+			csum = pre ? pre->csum
+				: csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, b->data);
+			bad_csum = bch2_crc_cmp(csum, b->data->csum);
 
-			btree_err_on(bch2_crc_cmp(csum, b->data->csum),
+			btree_err_on(bad_csum,
 				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
 				     "invalid checksum");
 
@@ -962,9 +1190,11 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				     BSET_CSUM_TYPE(i));
 
 			nonce = btree_nonce(i, b->written << 9);
-			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+			csum = pre ? pre->csum
+				: csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+			bad_csum = bch2_crc_cmp(csum, bne->csum);
 
-			btree_err_on(bch2_crc_cmp(csum, bne->csum),
+			btree_err_on(bad_csum,
 				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
 				     "invalid checksum");
 
@@ -987,7 +1217,13 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		if (!b->written)
 			btree_node_set_format(b, b->data->format);
 
-		ret = validate_bset_keys(c, b, i, READ, have_retry);
+		trusted = c->opts.btree_read_trusted &&
+			BSET_CSUM_TYPE(i) != BCH_CSUM_none &&
+			!bad_csum &&
+			le16_to_cpu(i->version) == bcachefs_metadata_version_current;
+		node_trusted &= trusted;
+
+		ret = validate_bset_keys(c, b, i, READ, have_retry, trusted);
 		if (ret)
 			goto fsck_err;
 
@@ -1077,7 +1313,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 		printbuf_reset(&buf);
 
-		if (bch2_bkey_val_invalid(c, u.s_c, READ, &buf) ||
+		if ((!node_trusted &&
+		     bch2_bkey_val_invalid(c, u.s_c, READ, &buf)) ||
 		    (bch2_inject_invalid_keys &&
 		     !bversion_cmp(u.k->version, MAX_VERSION))) {
 			printbuf_reset(&buf);
@@ -1108,6 +1345,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	}
 
 	bch2_bset_build_aux_tree(b, b->set, false);
+	bch2_btree_node_snapshot_summary(b);
 
 	set_needs_whiteout(btree_bset_first(b), true);
 
@@ -1136,6 +1374,181 @@ fsck_err:
 	goto out;
 }
 
+/*
+ * Hedged reads:
+ *
+ * If a read of a replicated btree node hasn't completed after twice the
+ * device's recent ~p94 btree read latency, we issue a second read to another
+ * replica, into a separate buffer, and use whichever completes first; the
+ * other read is left to complete and its buffer freed then. If the second read
+ * wins, its buffer is swapped into b->data.
+ *
+ * A read that fails doesn't win while the other read is still in flight, so
+ * that an error on one replica is masked by the other.
+ */
+struct btree_read_hedge {
+	struct bch_fs		*c;
+	struct btree		*b;
+	struct delayed_work	work;
+	/* primary bio, hedge bio once issued, and work while pending: */
+	atomic_t		ref;
+	atomic_t		in_flight;
+	atomic_t		done;
+	u64			start_time;
+	struct btree_read_bio	*primary;
+	/* hedge read's buffer; after the hedge wins, the original b->data: */
+	void			*buf;
+};
+
+#define BTREE_READ_HEDGE_DEFAULT_NS	(20 * NSEC_PER_MSEC)
+
+static void btree_read_hedge_put(struct bch_fs *c, struct btree_read_hedge *h)
+{
+	if (atomic_dec_and_test(&h->ref)) {
+		if (h->buf)
+			kvpfree(h->buf, btree_bytes(c));
+		kfree(h);
+	}
+}
+
+static unsigned long btree_read_hedge_delay(struct bch_dev *ca)
+{
+	u64 ns = ca->io_latency_by_type[READ][BCH_DATA_btree]
+		.quantiles.entries[QUANTILE_LAST].m * 2;
+
+	return max(1UL, nsecs_to_jiffies(ns ?: BTREE_READ_HEDGE_DEFAULT_NS));
+}
+
+/*
+ * Returns true if @rb completed first and should go on to btree_node_read_work;
+ * otherwise @rb lost to the other read and has been freed:
+ */
+static bool btree_read_hedge_complete(struct btree_read_bio *rb)
+{
+	struct btree_read_hedge *h = rb->hedge;
+	struct bch_fs *c = rb->c;
+	int remaining = atomic_dec_return(&h->in_flight);
+
+	if ((!rb->bio.bi_status || !remaining) &&
+	    !atomic_cmpxchg(&h->done, 0, 1)) {
+		if (rb != h->primary) {
+			swap(rb->b->data, h->buf);
+			rb->start_time = h->start_time;
+			this_cpu_inc(c->counters[BCH_COUNTER_btree_node_read_hedge_won]);
+		}
+
+		if (cancel_delayed_work(&h->work))
+			btree_read_hedge_put(c, h);
+		return true;
+	}
+
+	if (rb->have_ioref)
+		percpu_ref_put(&bch_dev_bkey_exists(c, rb->pick.ptr.dev)->io_ref);
+	bio_put(&rb->bio);
+	btree_read_hedge_put(c, h);
+	return false;
+}
+
+static void btree_node_read_work(struct work_struct *);
+static void btree_node_read_endio(struct bio *);
+
+static void btree_read_hedge_work(struct work_struct *work)
+{
+	struct btree_read_hedge *h =
+		container_of(to_delayed_work(work), struct btree_read_hedge, work);
+	struct bch_fs *c = h->c;
+	struct btree *b = h->b;
+	struct bch_io_failures failed = { .nr = 0 };
+	struct extent_ptr_decoded pick;
+	struct btree_read_bio *rb;
+	struct bch_dev *ca;
+	struct bio *bio;
+
+	if (atomic_read(&h->done))
+		goto out;
+
+	bch2_mark_io_failure(&failed, &h->primary->pick);
+
+	if (bch2_bkey_pick_read_device(c, bkey_i_to_s_c(&b->key),
+				       &failed, &pick) <= 0)
+		goto out;
+
+	ca = bch_dev_bkey_exists(c, pick.ptr.dev);
+	if (!bch2_dev_get_ioref(ca, READ))
+		goto out;
+
+	h->buf = kvpmalloc(btree_bytes(c), GFP_NOIO);
+	if (!h->buf) {
+		percpu_ref_put(&ca->io_ref);
+		goto out;
+	}
+
+	bio = bio_alloc_bioset(NULL,
+			       buf_pages(h->buf, btree_bytes(c)),
+			       REQ_OP_READ|REQ_SYNC|REQ_META,
+			       GFP_NOIO,
+			       &c->btree_bio);
+	rb = container_of(bio, struct btree_read_bio, bio);
+	rb->c			= c;
+	rb->b			= b;
+	rb->ra			= NULL;
+	rb->hedge		= h;
+	rb->start_time		= local_clock();
+	rb->have_ioref		= true;
+	rb->pick		= pick;
+	INIT_WORK(&rb->work, btree_node_read_work);
+	bio->bi_iter.bi_sector	= pick.ptr.offset;
+	bio->bi_end_io		= btree_node_read_endio;
+	bio_set_dev(bio, ca->disk_sb.bdev);
+	bch2_bio_map(bio, h->buf, btree_bytes(c));
+
+	/* Pairs with the atomic_dec_return() in btree_read_hedge_complete(): */
+	atomic_inc(&h->in_flight);
+	if (atomic_read(&h->done)) {
+		/* The primary read completed while we were allocating: */
+		atomic_dec(&h->in_flight);
+		percpu_ref_put(&ca->io_ref);
+		bio_put(bio);
+		goto out;
+	}
+
+	this_cpu_inc(c->counters[BCH_COUNTER_btree_node_read_hedge]);
+	this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_btree],
+		     bio_sectors(bio));
+	/* our ref is now owned by the hedge bio: */
+	submit_bio(bio);
+	return;
+out:
+	btree_read_hedge_put(c, h);
+}
+
+static void btree_read_hedge_start(struct bch_fs *c, struct btree_read_bio *rb,
+				   struct bch_dev *ca)
+{
+	struct btree_read_hedge *h;
+
+	if (!c->opts.btree_read_hedge ||
+	    !rb->have_ioref ||
+	    bch2_bkey_nr_ptrs(bkey_i_to_s_c(&rb->b->key)) < 2)
+		return;
+
+	h = kzalloc(sizeof(*h), GFP_NOIO);
+	if (!h)
+		return;
+
+	h->c		= c;
+	h->b		= rb->b;
+	h->start_time	= rb->start_time;
+	h->primary	= rb;
+	atomic_set(&h->ref, 2);
+	atomic_set(&h->in_flight, 1);
+	INIT_DELAYED_WORK(&h->work, btree_read_hedge_work);
+	rb->hedge	= h;
+
+	queue_delayed_work(c->btree_read_complete_wq, &h->work,
+			   btree_read_hedge_delay(ca));
+}
+
 static void btree_node_read_work(struct work_struct *work)
 {
 	struct btree_read_bio *rb =
@@ -1198,6 +1611,8 @@ start:
 
 	bch2_time_stats_update(&c->times[BCH_TIME_btree_node_read],
 			       rb->start_time);
+	if (rb->hedge)
+		btree_read_hedge_put(c, rb->hedge);
 	bio_put(&rb->bio);
 	printbuf_exit(&buf);
 
@@ -1216,10 +1631,13 @@ static void btree_node_read_endio(struct bio *bio)
 
 	if (rb->have_ioref) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, rb->pick.ptr.dev);
-		bch2_latency_acct(ca, rb->start_time, READ);
+		bch2_latency_acct(ca, rb->start_time, READ, BCH_DATA_btree);
 	}
 
-	queue_work(c->io_complete_wq, &rb->work);
+	if (rb->hedge && !btree_read_hedge_complete(rb))
+		return;
+
+	queue_work(c->btree_read_complete_wq, &rb->work);
 }
 
 struct btree_node_read_all {
@@ -1403,7 +1821,7 @@ static void btree_node_read_all_replicas_endio(struct bio *bio)
 
 	if (rb->have_ioref) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, rb->pick.ptr.dev);
-		bch2_latency_acct(ca, rb->start_time, READ);
+		bch2_latency_acct(ca, rb->start_time, READ, BCH_DATA_btree);
 	}
 
 	ra->err[rb->idx] = bio->bi_status;
@@ -1449,6 +1867,7 @@ static int btree_node_read_all_replicas(struct bch_fs *c, struct btree *b, bool
 		rb->c			= c;
 		rb->b			= b;
 		rb->ra			= ra;
+		rb->hedge		= NULL;
 		rb->start_time		= local_clock();
 		rb->have_ioref		= bch2_dev_get_ioref(ca, READ);
 		rb->idx			= i;
@@ -1476,7 +1895,7 @@ static int btree_node_read_all_replicas(struct bch_fs *c, struct btree *b, bool
 		btree_node_read_all_replicas_done(&ra->cl);
 	} else {
 		continue_at(&ra->cl, btree_node_read_all_replicas_done,
-			    c->io_complete_wq);
+			    c->btree_read_complete_wq);
 	}
 
 	return 0;
@@ -1528,6 +1947,7 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 	rb->c			= c;
 	rb->b			= b;
 	rb->ra			= NULL;
+	rb->hedge		= NULL;
 	rb->start_time		= local_clock();
 	rb->have_ioref		= bch2_dev_get_ioref(ca, READ);
 	rb->pick		= pick;
@@ -1536,12 +1956,21 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 	bio->bi_end_io		= btree_node_read_endio;
 	bch2_bio_map(bio, b->data, btree_bytes(c));
 
+	btree_read_hedge_start(c, rb, ca);
+
 	if (rb->have_ioref) {
 		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_btree],
 			     bio_sectors(bio));
 		bio_set_dev(bio, ca->disk_sb.bdev);
 
-		if (sync) {
+		if (rb->hedge) {
+			/* completion may come from either read: */
+			submit_bio(bio);
+
+			if (sync)
+				wait_on_bit_io(&b->flags, BTREE_NODE_read_in_flight,
+					       TASK_UNINTERRUPTIBLE);
+		} else if (sync) {
 			submit_bio_wait(bio);
 
 			btree_node_read_work(&rb->work);
@@ -1554,7 +1983,7 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 		if (sync)
 			btree_node_read_work(&rb->work);
 		else
-			queue_work(c->io_complete_wq, &rb->work);
+			queue_work(c->btree_read_complete_wq, &rb->work);
 	}
 }
 
@@ -1721,8 +2150,10 @@ static void btree_node_write_endio(struct bio *bio)
 	struct bch_dev *ca		= bch_dev_bkey_exists(c, wbio->dev);
 	unsigned long flags;
 
-	if (wbio->have_ioref)
-		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+	if (wbio->have_ioref) {
+		bch2_latency_acct(ca, wbio->submit_time, WRITE, BCH_DATA_btree);
+		atomic_dec(&ca->writes_in_flight);
+	}
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "btree write error: %s",
 			       bch2_blk_status_to_str(bio->bi_status)) ||
@@ -1762,7 +2193,7 @@ static int validate_bset_for_write(struct bch_fs *c, struct btree *b,
 	if (ret)
 		return ret;
 
-	ret = validate_bset_keys(c, b, i, WRITE, false) ?:
+	ret = validate_bset_keys(c, b, i, WRITE, false, false) ?:
 		validate_bset(c, NULL, b, i, b->written, sectors, WRITE, false);
 	if (ret) {
 		bch2_inconsistent_error(c);
@@ -2023,6 +2454,10 @@ do_write:
 	atomic64_inc(&c->btree_writes_nr);
 	atomic64_add(sectors_to_write, &c->btree_writes_sectors);
 
+	bch2_io_sched_mark(c, current == c->journal.reclaim_thread
+			   ? BCH_IO_CLASS_journal_reclaim
+			   : BCH_IO_CLASS_btree);
+
 	INIT_WORK(&wbio->work, btree_write_submit);
 	queue_work(c->io_complete_wq, &wbio->work);
 	return;
@@ -34,10 +34,13 @@ static inline unsigned btree_ptr_sectors_written(struct bkey_i *k)
 		: 0;
 }
 
+struct btree_read_hedge;
+
 struct btree_read_bio {
 	struct bch_fs		*c;
 	struct btree		*b;
 	struct btree_node_read_all *ra;
+	struct btree_read_hedge	*hedge;
 	u64			start_time;
 	unsigned		have_ioref:1;
 	unsigned		idx:7;
@@ -79,17 +82,26 @@ static inline bool should_compact_bset_lazy(struct btree *b,
 	return dead_u64s > 64 && dead_u64s * 3 > total_u64s;
 }
 
-static inline bool bch2_maybe_compact_whiteouts(struct bch_fs *c, struct btree *b)
+static inline bool bch2_btree_node_want_compact(struct btree *b)
 {
 	struct bset_tree *t;
 
 	for_each_bset(b, t)
 		if (should_compact_bset_lazy(b, t))
-			return bch2_compact_whiteouts(c, b, COMPACT_LAZY);
+			return true;
 
 	return false;
 }
 
+static inline bool bch2_maybe_compact_whiteouts(struct bch_fs *c, struct btree *b)
+{
+	return bch2_btree_node_want_compact(b) &&
+		bch2_compact_whiteouts(c, b, COMPACT_LAZY);
+}
+
+bool bch2_btree_node_compact_defer(struct bch_fs *, struct btree *);
+void bch2_btree_node_compact_work(struct work_struct *);
+
 static inline struct nonce btree_nonce(struct bset *i, unsigned offset)
 {
 	return (struct nonce) {{
@@ -114,7 +126,8 @@ static inline int bset_encrypt(struct bch_fs *c, struct bset *i, unsigned offset
 		if (ret)
 			return ret;
 
-		nonce = nonce_add(nonce, round_up(bytes, CHACHA_BLOCK_SIZE));
+		nonce = nonce_add(BSET_CSUM_TYPE(i), nonce,
+				  round_up(bytes, CHACHA_BLOCK_SIZE));
 	}
 
 	return bch2_encrypt(c, BSET_CSUM_TYPE(i), nonce, i->_data,
@@ -126,6 +139,7 @@ void bch2_btree_sort_into(struct bch_fs *, struct btree *, struct btree *);
 void bch2_btree_node_drop_keys_outside_node(struct btree *);
 
 void bch2_btree_build_aux_trees(struct btree *);
+void bch2_btree_node_snapshot_summary(struct btree *);
 void bch2_btree_init_next(struct btree_trans *, struct btree *);
 
 int bch2_btree_node_read_done(struct bch_fs *, struct bch_dev *,
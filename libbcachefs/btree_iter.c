@@ -15,13 +15,13 @@
 #include "recovery.h"
 #include "replicas.h"
 #include "subvolume.h"
+#include "super.h"
 
 #include <linux/prandom.h>
 #include <linux/prefetch.h>
 #include <trace/events/bcachefs.h>
 
 static void btree_trans_verify_sorted(struct btree_trans *);
-inline void bch2_btree_path_check_sort(struct btree_trans *, struct btree_path *, int);
 
 static inline void btree_path_list_remove(struct btree_trans *, struct btree_path *);
 static inline void btree_path_list_add(struct btree_trans *, struct btree_path *,
@@ -710,8 +710,13 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 
 	EBUG_ON(path->nodes_locked);
 
+	/*
+	 * Lockless: roots are published with rcu_assign_pointer(), and root
+	 * nodes can't be freed until they've been replaced, so locking the node
+	 * and then checking it's still the root is enough:
+	 */
 	while (1) {
-		b = READ_ONCE(*rootp);
+		b = rcu_dereference_raw(*rootp);
 		path->level = READ_ONCE(b->c.level);
 
 		if (unlikely(path->level < depth_want)) {
@@ -756,23 +761,63 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 	}
 }
 
+/*
+ * How many leaf nodes to have in flight when scanning: enough to cover the
+ * device's read latency at the rate the scan is going through leaf nodes.
+ *
+ * @k is the leaf we're about to go down to.
+ */
+static unsigned btree_path_readahead(struct bch_fs *c, struct btree_path *path,
+				     const struct bkey_i *k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	const struct bch_extent_ptr *ptr;
+	unsigned max = c->opts.btree_readahead;
+	u32 now = local_clock() >> 10;
+	u32 interval = now - path->readahead_time;
+	u64 latency = U64_MAX;
+
+	path->readahead_time = now;
+
+	/* Not scanning, or just started - we don't know the rate yet: */
+	if (interval > NSEC_PER_SEC >> 10) {
+		path->readahead_interval = 0;
+		return test_bit(BCH_FS_STARTED, &c->flags) ? min(2U, max) : max;
+	}
+
+	path->readahead_interval = path->readahead_interval
+		? ewma_add(path->readahead_interval, interval, 2)
+		: interval;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		latency = min_t(u64, latency,
+			atomic64_read(&bch_dev_bkey_exists(c, ptr->dev)->cur_latency[READ]));
+
+	if (latency == U64_MAX)
+		return min(2U, max);
+
+	return clamp_t(u64, div_u64(latency >> 10, max(path->readahead_interval, 1U)) + 1,
+		       min(2U, max), max);
+}
+
 noinline
-static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *path)
+static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *path,
+			       const struct bkey_i *next)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_path_level *l = path_l(path);
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	unsigned nr = path->level > 1
+		? !test_bit(BCH_FS_STARTED, &c->flags)
+		: btree_path_readahead(c, path, next);
 	bool was_locked = btree_node_locked(path, path->level);
 	int ret = 0;
 
 	bch2_bkey_buf_init(&tmp);
 
-	while (nr && !ret) {
+	while (nr-- && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
 			break;
 
@@ -807,7 +852,7 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 
 	bch2_bkey_buf_init(&tmp);
 
-	while (nr && !ret) {
+	while (nr-- && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
 			break;
 
@@ -901,7 +946,7 @@ static __always_inline int btree_path_down(struct btree_trans *trans,
 				 bch2_btree_node_iter_peek(&l->iter, l->b));
 
 		if (flags & BTREE_ITER_PREFETCH) {
-			ret = btree_path_prefetch(trans, path);
+			ret = btree_path_prefetch(trans, path, tmp.k);
 			if (ret)
 				goto err;
 		}
@@ -950,7 +995,7 @@ retry_all:
 	trans_for_each_path(trans, path)
 		path->should_be_locked = false;
 
-	btree_trans_verify_sorted(trans);
+	btree_trans_sort_paths(trans);
 
 	bch2_trans_unlock(trans);
 	cond_resched();
@@ -1167,8 +1212,6 @@ static void btree_path_copy(struct btree_trans *trans, struct btree_path *dst,
 		if (btree_node_locked(dst, i))
 			six_lock_increment(&dst->l[i].b->c.lock,
 					   __btree_lock_want(dst, i));
-
-	bch2_btree_path_check_sort(trans, dst, 0);
 }
 
 static struct btree_path *btree_path_clone(struct btree_trans *trans, struct btree_path *src,
@@ -1193,7 +1236,6 @@ bch2_btree_path_make_mut(struct btree_trans *trans,
 #ifdef CONFIG_BCACHEFS_DEBUG
 		path->ip_allocated = ip;
 #endif
-		btree_trans_verify_sorted(trans);
 	}
 
 	path->should_be_locked = false;
@@ -1217,8 +1259,7 @@ bch2_btree_path_set_pos(struct btree_trans *trans,
 	path = bch2_btree_path_make_mut(trans, path, intent, ip);
 
 	path->pos = new_pos;
-
-	bch2_btree_path_check_sort(trans, path, cmp);
+	trans->paths_sorted = false;
 
 	if (unlikely(path->cached)) {
 		btree_node_unlock(trans, path, 0);
@@ -1300,6 +1341,8 @@ void bch2_path_put(struct btree_trans *trans, struct btree_path *path, bool inte
 	if (!__btree_path_put(path, intent))
 		return;
 
+	btree_trans_sort_paths(trans);
+
 	dup = path->preserve
 		? have_path_at_pos(trans, path)
 		: have_node_at_pos(trans, path);
@@ -1391,11 +1434,11 @@ void bch2_btree_path_to_text(struct printbuf *out, struct btree_path *path)
 
 void bch2_trans_paths_to_text(struct printbuf *out, struct btree_trans *trans)
 {
-	struct btree_path *path;
 	unsigned idx;
 
-	trans_for_each_path_inorder(trans, path, idx)
-		bch2_btree_path_to_text(out, path);
+	/* not trans_for_each_path_inorder: we're called when they're out of order */
+	for (idx = 0; idx < trans->nr_sorted; idx++)
+		bch2_btree_path_to_text(out, trans->paths + trans->sorted[idx]);
 }
 
 noinline __cold
@@ -1472,10 +1515,10 @@ struct btree_path *bch2_path_get(struct btree_trans *trans,
 	struct btree_path *path, *path_pos = NULL;
 	bool cached = flags & BTREE_ITER_CACHED;
 	bool intent = flags & BTREE_ITER_INTENT;
+	bool cold = flags & BTREE_ITER_COLD;
 	int i;
 
 	BUG_ON(trans->restarted);
-	btree_trans_verify_sorted(trans);
 	bch2_trans_verify_locks(trans);
 
 	trans_for_each_path_inorder(trans, path, i) {
@@ -1495,6 +1538,8 @@ struct btree_path *bch2_path_get(struct btree_trans *trans,
 	    path_pos->level	== level) {
 		__btree_path_get(path_pos, intent);
 		path = bch2_btree_path_set_pos(trans, path_pos, pos, intent, ip);
+		/* a shared path is only cold if every user wants it to be: */
+		path->cold &= cold;
 	} else {
 		path = btree_path_alloc(trans, path_pos);
 		path_pos = NULL;
@@ -1503,17 +1548,19 @@ struct btree_path *bch2_path_get(struct btree_trans *trans,
 		path->pos			= pos;
 		path->btree_id			= btree_id;
 		path->cached			= cached;
+		path->cold			= cold;
 		path->uptodate			= BTREE_ITER_NEED_TRAVERSE;
 		path->should_be_locked		= false;
 		path->level			= level;
 		path->locks_want		= locks_want;
 		path->nodes_locked		= 0;
+		path->readahead_time		= 0;
+		path->readahead_interval	= 0;
 		for (i = 0; i < ARRAY_SIZE(path->l); i++)
 			path->l[i].b		= ERR_PTR(-BCH_ERR_no_btree_node_init);
 #ifdef CONFIG_BCACHEFS_DEBUG
 		path->ip_allocated		= ip;
 #endif
-		btree_trans_verify_sorted(trans);
 	}
 
 	if (!(flags & BTREE_ITER_NOPRESERVE))
@@ -1855,6 +1902,54 @@ struct bkey_s_c btree_trans_peek_key_cache(struct btree_iter *iter, struct bpos
 	return err ? bkey_s_c_err(err) : ret;
 }
 
+/*
+ * Keys visible in iter->snapshot are in iter->snapshot or one of its
+ * ancestors, which always have higher IDs; a node whose snapshot summary
+ * rules all of those out has nothing for a BTREE_ITER_FILTER_SNAPSHOTS
+ * iterator, and can be skipped without looking at its keys:
+ */
+static noinline u64 btree_iter_snapshot_bloom(struct btree_iter *iter)
+{
+	struct bch_fs *c = iter->trans->c;
+	u32 id = iter->snapshot;
+	u64 bloom = 0;
+	unsigned nr = 0;
+
+	while (id && nr++ < 64) {
+		bloom |= btree_snapshot_bloom_bit(id);
+		id = bch2_snapshot_parent(c, id);
+	}
+
+	if (id || !bloom)
+		bloom = ~0ULL;
+
+	return iter->snapshot_bloom = bloom;
+}
+
+static inline bool btree_iter_node_has_visible(struct btree_iter *iter,
+					       struct btree *b)
+{
+	if (b->snapshot_max < iter->snapshot)
+		return false;
+
+	if (b->snapshot_bloom == ~0ULL)
+		return true;
+
+	return b->snapshot_bloom &
+		(iter->snapshot_bloom ?: btree_iter_snapshot_bloom(iter));
+}
+
+static inline struct bkey_s_c btree_iter_level_peek_all(struct btree_iter *iter,
+						struct btree_path_level *l)
+{
+	if ((iter->flags & BTREE_ITER_FILTER_SNAPSHOTS) &&
+	    !l->b->c.level &&
+	    !btree_iter_node_has_visible(iter, l->b))
+		return bkey_s_c_null;
+
+	return btree_path_level_peek_all(iter->trans->c, l, &iter->k);
+}
+
 static struct bkey_s_c __bch2_btree_iter_peek(struct btree_iter *iter, struct bpos search_key)
 {
 	struct btree_trans *trans = iter->trans;
@@ -1891,7 +1986,7 @@ static struct bkey_s_c __bch2_btree_iter_peek(struct btree_iter *iter, struct bp
 
 		btree_path_set_should_be_locked(iter->path);
 
-		k = btree_path_level_peek_all(trans->c, l, &iter->k);
+		k = btree_iter_level_peek_all(iter, l);
 
 		if (unlikely(iter->flags & BTREE_ITER_WITH_KEY_CACHE) &&
 		    k.k &&
@@ -2223,7 +2318,10 @@ struct bkey_s_c bch2_btree_iter_peek_prev(struct btree_iter *iter)
 			goto out_no_locked;
 		}
 
-		k = btree_path_level_peek(trans, iter->path,
+		k = (iter->flags & BTREE_ITER_FILTER_SNAPSHOTS) &&
+			!btree_iter_node_has_visible(iter, iter->path->l[0].b)
+			? bkey_s_c_null
+			: btree_path_level_peek(trans, iter->path,
 					  &iter->path->l[0], &iter->k);
 		if (!k.k ||
 		    ((iter->flags & BTREE_ITER_IS_EXTENTS)
@@ -2232,7 +2330,7 @@ struct bkey_s_c bch2_btree_iter_peek_prev(struct btree_iter *iter)
 			k = btree_path_level_prev(trans, iter->path,
 						  &iter->path->l[0], &iter->k);
 
-		bch2_btree_path_check_sort(trans, iter->path, 0);
+		trans->paths_sorted = false;
 
 		if (likely(k.k)) {
 			if (iter->flags & BTREE_ITER_FILTER_SNAPSHOTS) {
@@ -2464,6 +2562,78 @@ struct bkey_s_c bch2_btree_iter_prev_slot(struct btree_iter *iter)
 	return bch2_btree_iter_peek_slot(iter);
 }
 
+/*
+ * Multiget: for a set of point lookups, sorted by position, in one btree.
+ *
+ * Walks the level 1 nodes covering @pos and starts reads for every leaf that
+ * isn't in the btree node cache, so that the reads are in flight together
+ * instead of being issued one at a time as the lookups get to them; the
+ * lookups themselves are then done by for_each_btree_key_multiget(), with a
+ * single iterator so that each lookup only re-traverses from the first node
+ * that doesn't cover the new position.
+ */
+int bch2_btree_multiget_prefetch(struct btree_trans *trans,
+				 enum btree_id btree_id,
+				 const struct bpos *pos, unsigned nr,
+				 unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct btree_node_iter node_iter;
+	struct bkey_packed *k;
+	struct bkey_buf tmp;
+	struct btree *b;
+	unsigned i = 0;
+	int ret = 0;
+
+	/*
+	 * Lookups that go through the key cache usually don't touch leaf
+	 * nodes, and before journal replay finishes the leaf pointers might be
+	 * overwritten by keys in the journal:
+	 */
+	if (!nr ||
+	    (flags & BTREE_ITER_CACHED) ||
+	    !test_bit(JOURNAL_REPLAY_DONE, &c->journal.flags))
+		return 0;
+
+	bch2_bkey_buf_init(&tmp);
+	bch2_trans_node_iter_init(trans, &iter, btree_id, pos[0], 0, 1, 0);
+
+	while (i < nr) {
+		bch2_btree_iter_set_pos(&iter, pos[i]);
+
+		b = bch2_btree_iter_peek_node(&iter);
+		ret = PTR_ERR_OR_ZERO(b);
+		/* no interior nodes, btree is a single leaf: */
+		if (ret || !b)
+			break;
+
+		while (i < nr && bpos_cmp(pos[i], b->key.k.p) <= 0) {
+			struct bpos search = pos[i];
+
+			bch2_btree_node_iter_init(&node_iter, b, &search);
+			k = bch2_btree_node_iter_peek(&node_iter, b);
+			if (!k)
+				goto out;
+
+			bch2_bkey_buf_unpack(&tmp, c, b, k);
+
+			ret = bch2_btree_node_prefetch(c, trans, iter.path, tmp.k,
+						       btree_id, 0);
+			if (ret)
+				goto out;
+
+			/* skip the rest of the lookups in this leaf: */
+			while (i < nr && bpos_cmp(pos[i], tmp.k->k.p) <= 0)
+				i++;
+		}
+	}
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	bch2_bkey_buf_exit(&tmp, c);
+	return ret;
+}
+
 /* new transactional stuff: */
 
 static inline void btree_path_verify_sorted_ref(struct btree_trans *trans,
@@ -2493,7 +2663,9 @@ static void btree_trans_verify_sorted(struct btree_trans *trans)
 	if (!bch2_debug_check_iterators)
 		return;
 
-	trans_for_each_path_inorder(trans, path, i) {
+	for (i = 0; i < trans->nr_sorted; i++) {
+		path = trans->paths + trans->sorted[i];
+
 		if (prev && btree_path_cmp(prev, path) > 0) {
 			bch2_dump_trans_paths_updates(trans);
 			panic("trans paths out of order!\n");
@@ -2503,43 +2675,49 @@ static void btree_trans_verify_sorted(struct btree_trans *trans)
 #endif
 }
 
-static inline void btree_path_swap(struct btree_trans *trans,
-				   struct btree_path *l, struct btree_path *r)
+/*
+ * trans->sorted is sorted lazily: changing a path's position just clears
+ * trans->paths_sorted, and we re-sort before anything that needs the paths in
+ * order (bch2_path_get(), bch2_path_put(), traverse_all).
+ *
+ * Paths are almost always nearly sorted - most transactions only move one or
+ * two paths between lookups - so a cocktail shaker sort is a single pass in
+ * the common case, instead of bubbling each path as it moves and walking the
+ * whole list again to verify it.
+ */
+void __bch2_btree_trans_sort_paths(struct btree_trans *trans)
 {
-	swap(l->sorted_idx, r->sorted_idx);
-	swap(trans->sorted[l->sorted_idx],
-	     trans->sorted[r->sorted_idx]);
+	int i, l = 0, r = trans->nr_sorted, inc = 1;
+	bool swapped;
 
-	btree_path_verify_sorted_ref(trans, l);
-	btree_path_verify_sorted_ref(trans, r);
-}
-
-inline void bch2_btree_path_check_sort(struct btree_trans *trans, struct btree_path *path,
-				       int cmp)
-{
-	struct btree_path *n;
+	btree_trans_verify_sorted_refs(trans);
 
-	if (cmp <= 0) {
-		n = prev_btree_path(trans, path);
-		if (n && btree_path_cmp(n, path) > 0) {
-			do {
-				btree_path_swap(trans, n, path);
-				n = prev_btree_path(trans, path);
-			} while (n && btree_path_cmp(n, path) > 0);
+	if (trans->paths_sorted)
+		goto out;
 
-			goto out;
+	do {
+		swapped = false;
+
+		for (i = inc > 0 ? l : r - 2;
+		     i + 1 < r && i >= l;
+		     i += inc) {
+			if (btree_path_cmp(trans->paths + trans->sorted[i],
+					   trans->paths + trans->sorted[i + 1]) > 0) {
+				swap(trans->sorted[i], trans->sorted[i + 1]);
+				trans->paths[trans->sorted[i]].sorted_idx = i;
+				trans->paths[trans->sorted[i + 1]].sorted_idx = i + 1;
+				swapped = true;
+			}
 		}
-	}
 
-	if (cmp >= 0) {
-		n = next_btree_path(trans, path);
-		if (n && btree_path_cmp(path, n) > 0) {
-			do {
-				btree_path_swap(trans, path, n);
-				n = next_btree_path(trans, path);
-			} while (n && btree_path_cmp(path, n) > 0);
-		}
-	}
+		if (inc > 0)
+			--r;
+		else
+			l++;
+		inc = -inc;
+	} while (swapped);
+
+	trans->paths_sorted = true;
 out:
 	btree_trans_verify_sorted(trans);
 }
@@ -2639,6 +2817,7 @@ static inline void __bch2_trans_iter_init(struct btree_trans *trans,
 	iter->min_depth	= depth;
 	iter->flags	= flags;
 	iter->snapshot	= pos.snapshot;
+	iter->snapshot_bloom = 0;
 	iter->pos	= pos;
 	iter->k.type	= KEY_TYPE_deleted;
 	iter->k.p	= pos;
@@ -2696,40 +2875,103 @@ void bch2_trans_copy_iter(struct btree_iter *dst, struct btree_iter *src)
 	dst->key_cache_path = NULL;
 }
 
+/*
+ * Transaction memory is a bump allocator over a list of chunks: when the
+ * current chunk is full we start a new one, twice the size, instead of
+ * reallocating - which would invalidate every pointer handed out so far, and
+ * need a transaction restart. Full chunks are freed, and the first chunk
+ * resized to what the previous attempt used, in bch2_trans_begin().
+ */
+static void btree_trans_mem_free(struct bch_fs *c, void *p, unsigned bytes)
+{
+	if (bytes == BTREE_TRANS_MEM_MAX)
+		mempool_free(p, &c->btree_trans_mem_pool);
+	else
+		kfree(p);
+}
+
+static void btree_trans_mem_reset(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_trans_mem_chunk *i;
+	unsigned new_bytes;
+	void *new_mem;
+
+	darray_for_each(trans->mem_old, i)
+		btree_trans_mem_free(c, i->p, i->bytes);
+	trans->mem_old.nr	= 0;
+	trans->mem_old_bytes	= 0;
+	trans->mem_top		= 0;
+
+	if (likely(trans->mem_max <= trans->mem_bytes))
+		return;
+
+	new_bytes = roundup_pow_of_two(min(trans->mem_max, BTREE_TRANS_MEM_MAX));
+	if (new_bytes <= trans->mem_bytes)
+		return;
+
+	new_mem = kmalloc(new_bytes, GFP_NOFS|__GFP_NOWARN);
+	if (!new_mem && trans->mem_bytes != BTREE_TRANS_MEM_MAX) {
+		new_mem = mempool_alloc(&c->btree_trans_mem_pool, GFP_KERNEL);
+		new_bytes = BTREE_TRANS_MEM_MAX;
+	}
+
+	if (new_mem) {
+		if (trans->mem)
+			btree_trans_mem_free(c, trans->mem, trans->mem_bytes);
+		trans->mem		= new_mem;
+		trans->mem_bytes	= new_bytes;
+	}
+}
+
 void *__bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
 {
-	unsigned new_top = trans->mem_top + size;
-	size_t old_bytes = trans->mem_bytes;
-	size_t new_bytes = roundup_pow_of_two(new_top);
+	unsigned new_bytes = roundup_pow_of_two(max_t(size_t, size,
+				min(trans->mem_bytes * 2, BTREE_TRANS_MEM_MAX)));
 	void *new_mem;
 	void *p;
 
-	trans->mem_max = max(trans->mem_max, new_top);
+	trans->mem_max = max_t(size_t, trans->mem_max,
+			       trans->mem_old_bytes + trans->mem_top + size);
 
-	WARN_ON_ONCE(new_bytes > BTREE_TRANS_MEM_MAX);
+	WARN_ON_ONCE(size > BTREE_TRANS_MEM_MAX);
 
-	new_mem = krealloc(trans->mem, new_bytes, GFP_NOFS);
-	if (!new_mem && new_bytes <= BTREE_TRANS_MEM_MAX) {
+	new_mem = kmalloc(new_bytes, GFP_NOFS|__GFP_NOWARN);
+	if (!new_mem && !trans->mem_bytes && new_bytes <= BTREE_TRANS_MEM_MAX) {
+		/* Nothing to keep alive, so the mempool can't deadlock: */
 		new_mem = mempool_alloc(&trans->c->btree_trans_mem_pool, GFP_KERNEL);
 		new_bytes = BTREE_TRANS_MEM_MAX;
-		kfree(trans->mem);
 	}
 
 	if (!new_mem)
-		return ERR_PTR(-ENOMEM);
-
-	trans->mem = new_mem;
-	trans->mem_bytes = new_bytes;
+		goto restart;
 
-	if (old_bytes) {
-		trace_and_count(trans->c, trans_restart_mem_realloced, trans, _RET_IP_, new_bytes);
-		return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_mem_realloced));
+	if (trans->mem_bytes &&
+	    darray_push(&trans->mem_old, ((struct btree_trans_mem_chunk) {
+			.p	= trans->mem,
+			.bytes	= trans->mem_bytes }))) {
+		btree_trans_mem_free(trans->c, new_mem, new_bytes);
+		goto restart;
 	}
 
-	p = trans->mem + trans->mem_top;
-	trans->mem_top += size;
+	trans->mem_old_bytes	+= trans->mem_top;
+	trans->mem		= new_mem;
+	trans->mem_bytes	= new_bytes;
+	trans->mem_top		= size;
+
+	p = trans->mem;
 	memset(p, 0, size);
 	return p;
+restart:
+	/*
+	 * Out of memory: restart, and bch2_trans_begin() will free the old
+	 * chunks and size the first one from mem_max:
+	 */
+	if (!trans->mem_bytes)
+		return ERR_PTR(-ENOMEM);
+
+	trace_and_count(trans->c, trans_restart_mem_realloced, trans, _RET_IP_, new_bytes);
+	return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_mem_realloced));
 }
 
 /**
@@ -2740,14 +2982,74 @@ void *__bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
  * may return BCH_ERR_transaction_restart when the trylock fails. When this
  * occurs bch2_trans_begin() should be called and the transaction retried.
  */
+/*
+ * The time since the previous bch2_trans_begin() was spent on an attempt that
+ * has now been thrown away:
+ */
+static noinline void bch2_trans_restart_account(struct btree_trans *trans)
+{
+	struct btree_transaction_stats *s = btree_trans_stats(trans);
+	unsigned reason = trans->restarted - BCH_ERR_transaction_restart;
+
+	if (!s)
+		return;
+
+	if (reason >= BCH_TRANS_RESTART_NR)
+		reason = 0;
+
+	atomic64_inc(&s->restarts[reason]);
+	atomic64_add(ktime_get_ns() - trans->last_begin_time,
+		     &s->restart_wasted_ns[reason]);
+}
+
+void bch2_trans_restart_stats_to_text(struct printbuf *out,
+				      struct btree_transaction_stats *s)
+{
+	u64 nr = 0, wasted = 0;
+	unsigned i;
+
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++) {
+		nr	+= atomic64_read(&s->restarts[i]);
+		wasted	+= atomic64_read(&s->restart_wasted_ns[i]);
+	}
+
+	prt_printf(out, "restarts:");
+	prt_tab(out);
+	prt_printf(out, "%llu", nr);
+	prt_tab(out);
+	bch2_pr_time_units(out, wasted);
+	prt_newline(out);
+
+	printbuf_indent_add(out, 2);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++) {
+		nr = atomic64_read(&s->restarts[i]);
+		if (!nr)
+			continue;
+
+		prt_printf(out, "%s:",
+			   bch2_err_str(BCH_ERR_transaction_restart + i));
+		prt_tab(out);
+		prt_printf(out, "%llu", nr);
+		prt_tab(out);
+		bch2_pr_time_units(out, atomic64_read(&s->restart_wasted_ns[i]));
+		prt_newline(out);
+	}
+	printbuf_indent_sub(out, 2);
+}
+
 u32 bch2_trans_begin(struct btree_trans *trans)
 {
 	struct btree_path *path;
 
+	count_event(trans->c, trans_begin);
+
+	if (trans->restarted)
+		bch2_trans_restart_account(trans);
+
 	bch2_trans_reset_updates(trans);
 
 	trans->restart_count++;
-	trans->mem_top			= 0;
+	btree_trans_mem_reset(trans);
 
 	if (trans->fs_usage_deltas) {
 		trans->fs_usage_deltas->used = 0;
@@ -2811,9 +3113,7 @@ static void bch2_trans_alloc_paths(struct btree_trans *trans, struct bch_fs *c)
 
 	BUG_ON(trans->used_mempool);
 
-#ifdef __KERNEL__
-	p = this_cpu_xchg(c->btree_paths_bufs->path , NULL);
-#endif
+	p = this_cpu_xchg(c->btree_paths_bufs->path, NULL);
 	if (!p)
 		p = mempool_alloc(&trans->c->btree_paths_pool, GFP_NOFS);
 
@@ -2821,6 +3121,47 @@ static void bch2_trans_alloc_paths(struct btree_trans *trans, struct bch_fs *c)
 	trans->updates		= p; p += updates_bytes;
 }
 
+#define BTREE_TRANS_MEM_CACHE_MIN	64
+
+static void bch2_trans_alloc_mem(struct btree_trans *trans, struct bch_fs *c,
+				 unsigned bytes)
+{
+	void *p = this_cpu_xchg(c->btree_paths_bufs->mem, NULL);
+
+	if (p) {
+		unsigned cached_bytes = *((unsigned *) p);
+
+		if (cached_bytes >= bytes) {
+			trans->mem		= p;
+			trans->mem_bytes	= cached_bytes;
+			return;
+		}
+
+		kfree(p);
+	}
+
+	trans->mem = kmalloc(bytes, GFP_KERNEL);
+
+	if (!unlikely(trans->mem)) {
+		trans->mem = mempool_alloc(&c->btree_trans_mem_pool, GFP_KERNEL);
+		trans->mem_bytes = BTREE_TRANS_MEM_MAX;
+	} else {
+		trans->mem_bytes = bytes;
+	}
+}
+
+/* Mempool allocations are BTREE_TRANS_MEM_MAX, and those go back to the pool: */
+static void bch2_trans_free_mem(struct btree_trans *trans, struct bch_fs *c)
+{
+	if (trans->mem_bytes >= BTREE_TRANS_MEM_CACHE_MIN &&
+	    trans->mem_bytes < BTREE_TRANS_MEM_MAX) {
+		*((unsigned *) trans->mem) = trans->mem_bytes;
+		kfree(this_cpu_xchg(c->btree_paths_bufs->mem, trans->mem));
+	} else if (trans->mem) {
+		btree_trans_mem_free(c, trans->mem, trans->mem_bytes);
+	}
+}
+
 static inline unsigned bch2_trans_get_fn_idx(struct btree_trans *trans, struct bch_fs *c,
 					const char *fn)
 {
@@ -2857,17 +3198,7 @@ void __bch2_trans_init(struct btree_trans *trans, struct bch_fs *c, const char *
 
 	s = btree_trans_stats(trans);
 	if (s) {
-		unsigned expected_mem_bytes = roundup_pow_of_two(s->max_mem);
-
-		trans->mem = kmalloc(expected_mem_bytes, GFP_KERNEL);
-
-		if (!unlikely(trans->mem)) {
-			trans->mem = mempool_alloc(&c->btree_trans_mem_pool, GFP_KERNEL);
-			trans->mem_bytes = BTREE_TRANS_MEM_MAX;
-		} else {
-			trans->mem_bytes = expected_mem_bytes;
-		}
-
+		bch2_trans_alloc_mem(trans, c, roundup_pow_of_two(s->max_mem));
 		trans->nr_max_paths = s->nr_max_paths;
 	}
 
@@ -2936,6 +3267,7 @@ void bch2_trans_exit(struct btree_trans *trans)
 	bch2_journal_preres_put(&c->journal, &trans->journal_preres);
 
 	kfree(trans->extra_journal_entries.data);
+	darray_exit(&trans->snapshot_updates);
 
 	if (trans->fs_usage_deltas) {
 		if (trans->fs_usage_deltas->size + sizeof(trans->fs_usage_deltas) ==
@@ -2946,17 +3278,13 @@ void bch2_trans_exit(struct btree_trans *trans)
 			kfree(trans->fs_usage_deltas);
 	}
 
-	if (trans->mem_bytes == BTREE_TRANS_MEM_MAX)
-		mempool_free(trans->mem, &c->btree_trans_mem_pool);
-	else
-		kfree(trans->mem);
+	trans->mem_max = 0;
+	btree_trans_mem_reset(trans);
+	darray_exit(&trans->mem_old);
+
+	bch2_trans_free_mem(trans, c);
 
-#ifdef __KERNEL__
-	/*
-	 * Userspace doesn't have a real percpu implementation:
-	 */
 	trans->paths = this_cpu_xchg(c->btree_paths_bufs->path, trans->paths);
-#endif
 
 	if (trans->paths)
 		mempool_free(trans->paths, &c->btree_paths_pool);
@@ -3037,6 +3365,16 @@ void bch2_btree_trans_to_text(struct printbuf *out, struct btree_trans *trans)
 
 void bch2_fs_btree_iter_exit(struct bch_fs *c)
 {
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(c->btree_transaction_stats); i++)
+		bch2_time_stats_exit(&c->btree_transaction_stats[i].lock_hold_times);
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	for (i = 0; i < sizeof(c->btree_lock_wait_times) /
+	     sizeof(struct time_stats); i++)
+		bch2_time_stats_exit(&c->btree_lock_wait_times[0][0][0] + i);
+#endif
+
 	if (c->btree_trans_barrier_initialized)
 		cleanup_srcu_struct(&c->btree_trans_barrier);
 	mempool_exit(&c->btree_trans_mem_pool);
@@ -3048,8 +3386,15 @@ int bch2_fs_btree_iter_init(struct bch_fs *c)
 	unsigned i, nr = BTREE_ITER_MAX;
 	int ret;
 
-	for (i = 0; i < ARRAY_SIZE(c->btree_transaction_stats); i++)
+	for (i = 0; i < ARRAY_SIZE(c->btree_transaction_stats); i++) {
 		mutex_init(&c->btree_transaction_stats[i].lock);
+		bch2_time_stats_init(&c->btree_transaction_stats[i].lock_hold_times);
+	}
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	for (i = 0; i < sizeof(c->btree_lock_wait_times) /
+	     sizeof(struct time_stats); i++)
+		bch2_time_stats_init(&c->btree_lock_wait_times[0][0][0] + i);
+#endif
 
 	INIT_LIST_HEAD(&c->btree_trans_list);
 	mutex_init(&c->btree_trans_lock);
@@ -72,7 +72,15 @@ __trans_next_path(struct btree_trans *trans, unsigned idx)
 	return &trans->paths[idx];
 }
 
-void bch2_btree_path_check_sort(struct btree_trans *, struct btree_path *, int);
+void __bch2_btree_trans_sort_paths(struct btree_trans *);
+
+static inline void btree_trans_sort_paths(struct btree_trans *trans)
+{
+	if (!IS_ENABLED(CONFIG_BCACHEFS_DEBUG) &&
+	    trans->paths_sorted)
+		return;
+	__bch2_btree_trans_sort_paths(trans);
+}
 
 #define trans_for_each_path_from(_trans, _path, _start)			\
 	for (_path = __trans_next_path((_trans), _start);		\
@@ -102,8 +110,8 @@ static inline struct btree_path *prev_btree_path(struct btree_trans *trans, stru
 }
 
 #define trans_for_each_path_inorder(_trans, _path, _i)			\
-	for (_i = 0;							\
-	     ((_path) = (_trans)->paths + trans->sorted[_i]), (_i) < (_trans)->nr_sorted;\
+	for (btree_trans_sort_paths(_trans), _i = 0;			\
+	     ((_path) = (_trans)->paths + (_trans)->sorted[_i]), (_i) < (_trans)->nr_sorted;\
 	     _i++)
 
 static inline bool __path_has_node(const struct btree_path *path,
@@ -187,6 +195,7 @@ static inline int btree_trans_restart_nounlock(struct btree_trans *trans, int er
 	BUG_ON(!bch2_err_matches(err, BCH_ERR_transaction_restart));
 
 	trans->restarted = err;
+	count_event(trans->c, trans_restart);
 	return -err;
 }
 
@@ -275,6 +284,7 @@ static inline void bch2_btree_iter_set_snapshot(struct btree_iter *iter, u32 sna
 	struct bpos pos = iter->pos;
 
 	iter->snapshot = snapshot;
+	iter->snapshot_bloom = 0;
 	pos.snapshot = snapshot;
 	bch2_btree_iter_set_pos(iter, pos);
 }
@@ -311,6 +321,8 @@ static inline void *bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
 }
 
 u32 bch2_trans_begin(struct btree_trans *);
+void bch2_trans_restart_stats_to_text(struct printbuf *,
+				      struct btree_transaction_stats *);
 
 static inline struct btree *
 __btree_iter_peek_node_and_restart(struct btree_trans *trans, struct btree_iter *iter)
@@ -470,6 +482,36 @@ __bch2_btree_iter_peek_and_restart(struct btree_trans *trans,
 	_ret;								\
 })
 
+#define for_each_btree_key2_upto(_trans, _iter, _btree_id,		\
+			    _start, _end, _flags, _k, _do)		\
+({									\
+	int _ret = 0;							\
+									\
+	bch2_trans_iter_init((_trans), &(_iter), (_btree_id),		\
+			     (_start), (_flags));			\
+									\
+	while (1) {							\
+		u32 _restart_count = bch2_trans_begin(_trans);		\
+		(_k) = bch2_btree_iter_peek_upto_type(&(_iter), _end, (_flags));\
+		if (!(_k).k) {						\
+			_ret = 0;					\
+			break;						\
+		}							\
+									\
+		_ret = bkey_err(_k) ?: (_do);				\
+		if (bch2_err_matches(_ret, BCH_ERR_transaction_restart))\
+			continue;					\
+		if (_ret)						\
+			break;						\
+		bch2_trans_verify_not_restarted(_trans, _restart_count);\
+		if (!bch2_btree_iter_advance(&(_iter)))			\
+			break;						\
+	}								\
+									\
+	bch2_trans_iter_exit((_trans), &(_iter));			\
+	_ret;								\
+})
+
 #define for_each_btree_key_reverse(_trans, _iter, _btree_id,		\
 				   _start, _flags, _k, _do)		\
 ({									\
@@ -500,6 +542,47 @@ __bch2_btree_iter_peek_and_restart(struct btree_trans *trans,
 	_ret;								\
 })
 
+int bch2_btree_multiget_prefetch(struct btree_trans *, enum btree_id,
+				 const struct bpos *, unsigned, unsigned);
+
+/*
+ * Point lookups of @_nr positions in @_pos, which must be sorted: _do is
+ * evaluated for each, with @_i the index of the position and @_k the key at
+ * it (as with bch2_btree_iter_peek_slot())
+ */
+#define for_each_btree_key_multiget(_trans, _iter, _btree_id,		\
+				    _pos, _nr, _flags, _i, _k, _do)	\
+({									\
+	int _ret = 0;							\
+									\
+	bch2_trans_iter_init((_trans), &(_iter), (_btree_id),		\
+			     (_nr) ? (_pos)[0] : POS_MIN, (_flags));	\
+									\
+	_ret = lockrestart_do(_trans,					\
+		bch2_btree_multiget_prefetch((_trans), (_btree_id),	\
+					     (_pos), (_nr), (_flags)));	\
+									\
+	for ((_i) = 0; !_ret && (_i) < (_nr);) {			\
+		u32 _restart_count = bch2_trans_begin(_trans);		\
+									\
+		bch2_btree_iter_set_pos(&(_iter), (_pos)[_i]);		\
+		(_k) = bch2_btree_iter_peek_slot(&(_iter));		\
+									\
+		_ret = bkey_err(_k) ?: (_do);				\
+		if (bch2_err_matches(_ret, BCH_ERR_transaction_restart)) {\
+			_ret = 0;					\
+			continue;					\
+		}							\
+		if (_ret)						\
+			break;						\
+		bch2_trans_verify_not_restarted(_trans, _restart_count);\
+		(_i)++;							\
+	}								\
+									\
+	bch2_trans_iter_exit((_trans), &(_iter));			\
+	_ret;								\
+})
+
 #define for_each_btree_key_commit(_trans, _iter, _btree_id,		\
 				  _start, _iter_flags, _k,		\
 				  _disk_res, _journal_seq, _commit_flags,\
@@ -508,6 +591,15 @@ __bch2_btree_iter_peek_and_restart(struct btree_trans *trans,
 			    (_do) ?: bch2_trans_commit(_trans, (_disk_res),\
 					(_journal_seq), (_commit_flags)))
 
+#define for_each_btree_key_upto_commit(_trans, _iter, _btree_id,	\
+				  _start, _end, _iter_flags, _k,	\
+				  _disk_res, _journal_seq, _commit_flags,\
+				  _do)					\
+	for_each_btree_key2_upto(_trans, _iter, _btree_id, _start, _end,\
+			    _iter_flags, _k,				\
+			    (_do) ?: bch2_trans_commit(_trans, (_disk_res),\
+					(_journal_seq), (_commit_flags)))
+
 #define for_each_btree_key(_trans, _iter, _btree_id,			\
 			   _start, _flags, _k, _ret)			\
 	for (bch2_trans_iter_init((_trans), &(_iter), (_btree_id),	\
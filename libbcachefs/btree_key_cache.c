@@ -74,25 +74,54 @@ static void bkey_cached_evict(struct btree_key_cache *c,
 {
 	BUG_ON(rhashtable_remove_fast(&c->table, &ck->hash,
 				      bch2_btree_key_cache_params));
+	atomic_long_dec(&c->btrees[ck->key.btree_id].nr_keys);
 	memset(&ck->key, ~0, sizeof(ck->key));
 
 	atomic_long_dec(&c->nr_keys);
 }
 
+static inline bool btree_key_cache_btree_over(struct btree_key_cache *c,
+					      enum btree_id btree_id)
+{
+	struct btree_key_cache_btree *b = &c->btrees[btree_id];
+
+	return b->max_keys &&
+		atomic_long_read(&b->nr_keys) > b->max_keys;
+}
+
+static bool btree_key_cache_any_over(struct btree_key_cache *c)
+{
+	unsigned i;
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		if (btree_key_cache_btree_over(c, i))
+			return true;
+	return false;
+}
+
+static inline struct btree_key_cache_shard *
+bkey_cached_shard(struct btree_key_cache *bc)
+{
+	return &bc->shards[raw_smp_processor_id() % ARRAY_SIZE(bc->shards)];
+}
+
 static void bkey_cached_free(struct btree_key_cache *bc,
 			     struct bkey_cached *ck)
 {
 	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
+	struct btree_key_cache_shard *s = bkey_cached_shard(bc);
 
 	BUG_ON(test_bit(BKEY_CACHED_DIRTY, &ck->flags));
 
 	ck->btree_trans_barrier_seq =
 		start_poll_synchronize_srcu(&c->btree_trans_barrier);
 
+	spin_lock(&s->lock);
 	if (ck->c.lock.readers)
-		list_move_tail(&ck->list, &bc->freed_pcpu);
+		list_move_tail(&ck->list, &s->freed_pcpu);
 	else
-		list_move_tail(&ck->list, &bc->freed_nonpcpu);
+		list_move_tail(&ck->list, &s->freed_nonpcpu);
+	spin_unlock(&s->lock);
 	atomic_long_inc(&bc->nr_freed);
 
 	kfree(ck->k);
@@ -106,6 +135,7 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 static void bkey_cached_move_to_freelist(struct btree_key_cache *bc,
 					 struct bkey_cached *ck)
 {
+	struct btree_key_cache_shard *s;
 	struct btree_key_cache_freelist *f;
 	bool freed = false;
 
@@ -122,24 +152,26 @@ static void bkey_cached_move_to_freelist(struct btree_key_cache *bc,
 		preempt_enable();
 
 		if (!freed) {
-			mutex_lock(&bc->lock);
+			s = bkey_cached_shard(bc);
+			spin_lock(&s->lock);
 			preempt_disable();
 			f = this_cpu_ptr(bc->pcpu_freed);
 
 			while (f->nr > ARRAY_SIZE(f->objs) / 2) {
 				struct bkey_cached *ck2 = f->objs[--f->nr];
 
-				list_move_tail(&ck2->list, &bc->freed_nonpcpu);
+				list_move_tail(&ck2->list, &s->freed_nonpcpu);
 			}
 			preempt_enable();
 
-			list_move_tail(&ck->list, &bc->freed_nonpcpu);
-			mutex_unlock(&bc->lock);
+			list_move_tail(&ck->list, &s->freed_nonpcpu);
+			spin_unlock(&s->lock);
 		}
 	} else {
-		mutex_lock(&bc->lock);
-		list_move_tail(&ck->list, &bc->freed_pcpu);
-		mutex_unlock(&bc->lock);
+		s = bkey_cached_shard(bc);
+		spin_lock(&s->lock);
+		list_move_tail(&ck->list, &s->freed_pcpu);
+		spin_unlock(&s->lock);
 	}
 }
 
@@ -170,6 +202,7 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path)
 	struct bch_fs *c = trans->c;
 	struct btree_key_cache *bc = &c->btree_key_cache;
 	struct bkey_cached *ck = NULL;
+	struct btree_key_cache_shard *s = bkey_cached_shard(bc);
 	struct btree_key_cache_freelist *f;
 	bool pcpu_readers = btree_uses_pcpu_readers(path->btree_id);
 
@@ -181,28 +214,28 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path)
 		preempt_enable();
 
 		if (!ck) {
-			mutex_lock(&bc->lock);
+			spin_lock(&s->lock);
 			preempt_disable();
 			f = this_cpu_ptr(bc->pcpu_freed);
 
-			while (!list_empty(&bc->freed_nonpcpu) &&
+			while (!list_empty(&s->freed_nonpcpu) &&
 			       f->nr < ARRAY_SIZE(f->objs) / 2) {
-				ck = list_last_entry(&bc->freed_nonpcpu, struct bkey_cached, list);
+				ck = list_last_entry(&s->freed_nonpcpu, struct bkey_cached, list);
 				list_del_init(&ck->list);
 				f->objs[f->nr++] = ck;
 			}
 
 			ck = f->nr ? f->objs[--f->nr] : NULL;
 			preempt_enable();
-			mutex_unlock(&bc->lock);
+			spin_unlock(&s->lock);
 		}
 	} else {
-		mutex_lock(&bc->lock);
-		if (!list_empty(&bc->freed_pcpu)) {
-			ck = list_last_entry(&bc->freed_pcpu, struct bkey_cached, list);
+		spin_lock(&s->lock);
+		if (!list_empty(&s->freed_pcpu)) {
+			ck = list_last_entry(&s->freed_pcpu, struct bkey_cached, list);
 			list_del_init(&ck->list);
 		}
-		mutex_unlock(&bc->lock);
+		spin_unlock(&s->lock);
 	}
 
 	if (ck) {
@@ -320,6 +353,10 @@ btree_key_cache_create(struct btree_trans *trans, struct btree_path *path)
 	}
 
 	atomic_long_inc(&bc->nr_keys);
+	atomic_long_inc(&bc->btrees[path->btree_id].nr_keys);
+
+	if (unlikely(btree_key_cache_btree_over(bc, path->btree_id)))
+		queue_work(system_unbound_wq, &bc->trim_work);
 
 	six_unlock_write(&ck->c.lock);
 
@@ -337,6 +374,9 @@ static int btree_key_cache_fill(struct btree_trans *trans,
 	struct bkey u;
 	int ret;
 
+	count_event(trans->c, key_cache_fill);
+	this_cpu_inc(trans->c->btree_key_cache.stats->fills[ck->key.btree_id]);
+
 	path = bch2_path_get(trans, ck->key.btree_id,
 			     ck->key.pos, 0, 0, 0, _THIS_IP_);
 	ret = bch2_btree_path_traverse(trans, path, 0);
@@ -525,6 +565,9 @@ fill:
 	if (!ck->valid)
 		return bch2_btree_path_traverse_cached_slowpath(trans, path, flags);
 
+	count_event(c, key_cache_hit);
+	this_cpu_inc(c->btree_key_cache.stats->hits[path->btree_id]);
+
 	if (!test_bit(BKEY_CACHED_ACCESSED, &ck->flags))
 		set_bit(BKEY_CACHED_ACCESSED, &ck->flags);
 
@@ -747,63 +790,78 @@ void bch2_btree_key_cache_drop(struct btree_trans *trans,
 	ck->valid = false;
 }
 
+/*
+ * Newest freed entries are at the end of the list - once we hit one that's too
+ * new to be freed, we can bail out:
+ */
+static size_t bkey_cached_freelist_take(struct bch_fs *c, struct list_head *list,
+					struct list_head *dst, size_t nr)
+{
+	struct bkey_cached *ck, *t;
+	size_t taken = 0;
+
+	list_for_each_entry_safe(ck, t, list, list) {
+		if (taken >= nr ||
+		    !poll_state_synchronize_srcu(&c->btree_trans_barrier,
+						 ck->btree_trans_barrier_seq))
+			break;
+
+		list_move_tail(&ck->list, dst);
+		taken++;
+	}
+
+	return taken;
+}
+
 static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
 					   struct shrink_control *sc)
 {
 	struct bch_fs *c = container_of(shrink, struct bch_fs,
 					btree_key_cache.shrink);
 	struct btree_key_cache *bc = &c->btree_key_cache;
+	struct btree_key_cache_shard *s;
 	struct bucket_table *tbl;
 	struct bkey_cached *ck, *t;
+	LIST_HEAD(items);
 	size_t scanned = 0, freed = 0, nr = sc->nr_to_scan;
 	unsigned start, flags;
 	int srcu_idx;
 
-	/* Return -1 if we can't do anything right now */
-	if (sc->gfp_mask & __GFP_FS)
-		mutex_lock(&bc->lock);
-	else if (!mutex_trylock(&bc->lock))
-		return -1;
-
 	srcu_idx = srcu_read_lock(&c->btree_trans_barrier);
 	flags = memalloc_nofs_save();
 
-	/*
-	 * Newest freed entries are at the end of the list - once we hit one
-	 * that's too new to be freed, we can bail out:
-	 */
-	list_for_each_entry_safe(ck, t, &bc->freed_nonpcpu, list) {
-		if (!poll_state_synchronize_srcu(&c->btree_trans_barrier,
-						 ck->btree_trans_barrier_seq))
-			break;
+	/* Shrink the freelists shard by shard: */
+	for (s = bc->shards;
+	     s < bc->shards + ARRAY_SIZE(bc->shards) && scanned < nr;
+	     s++) {
+		spin_lock(&s->lock);
+		scanned += bkey_cached_freelist_take(c, &s->freed_nonpcpu,
+						     &items, nr - scanned);
+		scanned += bkey_cached_freelist_take(c, &s->freed_pcpu,
+						     &items, nr - scanned);
+		spin_unlock(&s->lock);
+	}
 
+	list_for_each_entry_safe(ck, t, &items, list) {
 		list_del(&ck->list);
 		six_lock_pcpu_free(&ck->c.lock);
 		kmem_cache_free(bch2_key_cache, ck);
 		atomic_long_dec(&bc->nr_freed);
-		scanned++;
 		freed++;
 	}
 
 	if (scanned >= nr)
 		goto out;
 
-	list_for_each_entry_safe(ck, t, &bc->freed_pcpu, list) {
-		if (!poll_state_synchronize_srcu(&c->btree_trans_barrier,
-						 ck->btree_trans_barrier_seq))
-			break;
-
-		list_del(&ck->list);
-		six_lock_pcpu_free(&ck->c.lock);
-		kmem_cache_free(bch2_key_cache, ck);
-		atomic_long_dec(&bc->nr_freed);
-		scanned++;
-		freed++;
+	/* Return -1 if we can't do anything right now */
+	if (sc->gfp_mask & __GFP_FS)
+		mutex_lock(&bc->lock);
+	else if (!mutex_trylock(&bc->lock)) {
+		memalloc_nofs_restore(flags);
+		srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
+		return freed ?: -1;
 	}
 
-	if (scanned >= nr)
-		goto out;
-
 	rcu_read_lock();
 	tbl = rht_dereference_rcu(bc->table.tbl, &bc->table);
 	if (bc->shrink_iter >= tbl->size)
@@ -842,14 +900,86 @@ next:
 	} while (scanned < nr && bc->shrink_iter != start);
 
 	rcu_read_unlock();
+	mutex_unlock(&bc->lock);
 out:
 	memalloc_nofs_restore(flags);
 	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
-	mutex_unlock(&bc->lock);
 
 	return freed;
 }
 
+/*
+ * Bring btrees that are over their max_keys back under it. This walks the table
+ * with its own clock hand, the same way the shrinker does, but only looks at
+ * keys of btrees that are over their limit - so those btrees give up their
+ * coldest clean keys, and other btrees' accessed bits are left alone:
+ */
+#define BTREE_KEY_CACHE_TRIM_BATCH	(1U << 14)
+
+static void bch2_btree_key_cache_trim_work(struct work_struct *work)
+{
+	struct btree_key_cache *bc =
+		container_of(work, struct btree_key_cache, trim_work);
+	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
+	struct bucket_table *tbl;
+	struct bkey_cached *ck;
+	size_t scanned = 0;
+	unsigned start, laps = 0;
+	int srcu_idx;
+
+	srcu_idx = srcu_read_lock(&c->btree_trans_barrier);
+	mutex_lock(&bc->lock);
+
+	rcu_read_lock();
+	tbl = rht_dereference_rcu(bc->table.tbl, &bc->table);
+	if (bc->trim_iter >= tbl->size)
+		bc->trim_iter = 0;
+	start = bc->trim_iter;
+
+	do {
+		struct rhash_head *pos, *next;
+
+		pos = rht_ptr_rcu(rht_bucket(tbl, bc->trim_iter));
+
+		while (!rht_is_a_nulls(pos)) {
+			next = rht_dereference_bucket_rcu(pos->next, tbl, bc->trim_iter);
+			ck = container_of(pos, struct bkey_cached, hash);
+
+			if (test_bit(BKEY_CACHED_DIRTY, &ck->flags) ||
+			    !btree_key_cache_btree_over(bc, ck->key.btree_id))
+				goto next;
+
+			if (test_bit(BKEY_CACHED_ACCESSED, &ck->flags))
+				clear_bit(BKEY_CACHED_ACCESSED, &ck->flags);
+			else if (bkey_cached_lock_for_evict(ck)) {
+				bkey_cached_evict(bc, ck);
+				bkey_cached_free(bc, ck);
+			}
+
+			scanned++;
+next:
+			pos = next;
+		}
+
+		bc->trim_iter++;
+		if (bc->trim_iter >= tbl->size)
+			bc->trim_iter = 0;
+
+		/* A full lap may only have cleared accessed bits, so allow two: */
+		if (bc->trim_iter == start && ++laps == 2)
+			break;
+	} while (scanned < BTREE_KEY_CACHE_TRIM_BATCH &&
+		 btree_key_cache_any_over(bc));
+
+	rcu_read_unlock();
+	mutex_unlock(&bc->lock);
+	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
+
+	if (scanned >= BTREE_KEY_CACHE_TRIM_BATCH &&
+	    btree_key_cache_any_over(bc))
+		queue_work(system_unbound_wq, &bc->trim_work);
+}
+
 static unsigned long bch2_btree_key_cache_count(struct shrinker *shrink,
 					    struct shrink_control *sc)
 {
@@ -868,12 +998,15 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 	struct bucket_table *tbl;
 	struct bkey_cached *ck, *n;
 	struct rhash_head *pos;
+	LIST_HEAD(items);
 	unsigned i;
 	int cpu;
 
 	if (bc->shrink.list.next)
 		unregister_shrinker(&bc->shrink);
 
+	cancel_work_sync(&bc->trim_work);
+
 	mutex_lock(&bc->lock);
 
 	rcu_read_lock();
@@ -882,23 +1015,27 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 		for (i = 0; i < tbl->size; i++)
 			rht_for_each_entry_rcu(ck, pos, tbl, i, hash) {
 				bkey_cached_evict(bc, ck);
-				list_add(&ck->list, &bc->freed_nonpcpu);
+				list_add(&ck->list, &items);
 			}
 	rcu_read_unlock();
 
-	for_each_possible_cpu(cpu) {
-		struct btree_key_cache_freelist *f =
-			per_cpu_ptr(bc->pcpu_freed, cpu);
+	if (bc->pcpu_freed)
+		for_each_possible_cpu(cpu) {
+			struct btree_key_cache_freelist *f =
+				per_cpu_ptr(bc->pcpu_freed, cpu);
 
-		for (i = 0; i < f->nr; i++) {
-			ck = f->objs[i];
-			list_add(&ck->list, &bc->freed_nonpcpu);
+			for (i = 0; i < f->nr; i++) {
+				ck = f->objs[i];
+				list_add(&ck->list, &items);
+			}
 		}
-	}
 
-	list_splice(&bc->freed_pcpu, &bc->freed_nonpcpu);
+	for (i = 0; i < ARRAY_SIZE(bc->shards); i++) {
+		list_splice_init(&bc->shards[i].freed_pcpu, &items);
+		list_splice_init(&bc->shards[i].freed_nonpcpu, &items);
+	}
 
-	list_for_each_entry_safe(ck, n, &bc->freed_nonpcpu, list) {
+	list_for_each_entry_safe(ck, n, &items, list) {
 		cond_resched();
 
 		bch2_journal_pin_drop(&c->journal, &ck->journal);
@@ -920,14 +1057,22 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
 
+	free_percpu(bc->stats);
 	free_percpu(bc->pcpu_freed);
 }
 
 void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *c)
 {
+	unsigned i;
+
 	mutex_init(&c->lock);
-	INIT_LIST_HEAD(&c->freed_pcpu);
-	INIT_LIST_HEAD(&c->freed_nonpcpu);
+	INIT_WORK(&c->trim_work, bch2_btree_key_cache_trim_work);
+
+	for (i = 0; i < ARRAY_SIZE(c->shards); i++) {
+		spin_lock_init(&c->shards[i].lock);
+		INIT_LIST_HEAD(&c->shards[i].freed_pcpu);
+		INIT_LIST_HEAD(&c->shards[i].freed_nonpcpu);
+	}
 }
 
 static void bch2_btree_key_cache_shrinker_to_text(struct printbuf *out, struct shrinker *shrink)
@@ -947,6 +1092,10 @@ int bch2_fs_btree_key_cache_init(struct btree_key_cache *bc)
 	if (!bc->pcpu_freed)
 		return -ENOMEM;
 
+	bc->stats = alloc_percpu(struct btree_key_cache_stats);
+	if (!bc->stats)
+		return -ENOMEM;
+
 	ret = rhashtable_init(&bc->table, &bch2_btree_key_cache_params);
 	if (ret)
 		return ret;
@@ -965,6 +1114,42 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	prt_printf(out, "nr_freed:\t%zu\n",	atomic_long_read(&c->nr_freed));
 	prt_printf(out, "nr_keys:\t%lu\n",	atomic_long_read(&c->nr_keys));
 	prt_printf(out, "nr_dirty:\t%lu\n",	atomic_long_read(&c->nr_dirty));
+
+	if (c->stats) {
+		struct btree_key_cache_stats s = { 0 };
+		unsigned i;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct btree_key_cache_stats *p = per_cpu_ptr(c->stats, cpu);
+
+			for (i = 0; i < BTREE_ID_NR; i++) {
+				s.hits[i]	+= p->hits[i];
+				s.fills[i]	+= p->fills[i];
+			}
+		}
+
+		prt_printf(out, "\nper btree:\tkeys\tmax\thits\tfills\thit rate\n");
+
+		for (i = 0; i < BTREE_ID_NR; i++) {
+			u64 lookups = s.hits[i] + s.fills[i];
+
+			if (!lookups && !atomic_long_read(&c->btrees[i].nr_keys))
+				continue;
+
+			prt_printf(out, "%s:\t%lu\t%lu\t%llu\t%llu\t%llu%%\n",
+				   bch2_btree_ids[i],
+				   atomic_long_read(&c->btrees[i].nr_keys),
+				   c->btrees[i].max_keys,
+				   s.hits[i], s.fills[i],
+				   lookups ? div64_u64(s.hits[i] * 100, lookups) : 0);
+		}
+	}
+
+	if (c->table_init_done) {
+		prt_printf(out, "\nhash table:\n");
+		rhashtable_stats_to_text(out, &c->table);
+	}
 }
 
 void bch2_btree_key_cache_exit(void)
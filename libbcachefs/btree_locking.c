@@ -342,6 +342,21 @@ int bch2_six_check_for_deadlock(struct six_lock *lock, void *p)
 	return bch2_check_for_deadlock(trans, NULL);
 }
 
+/*
+ * Only the slowpath gets here, after a trylock failed: this is the time we
+ * were blocked, by btree, level and lock type - i.e. where contention is:
+ */
+void bch2_btree_lock_wait_time_update(struct btree_trans *trans,
+				      struct btree_bkey_cached_common *b,
+				      enum six_lock_type type, u64 start_time)
+{
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	if (b->btree_id < BTREE_ID_NR && b->level < BTREE_MAX_DEPTH)
+		bch2_time_stats_update(&trans->c->btree_lock_wait_times
+				       [b->btree_id][b->level][type], start_time);
+#endif
+}
+
 int __bch2_btree_node_lock_write(struct btree_trans *trans, struct btree_path *path,
 				 struct btree_bkey_cached_common *b,
 				 bool lock_may_not_fail)
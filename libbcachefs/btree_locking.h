@@ -188,11 +188,18 @@ int bch2_six_check_for_deadlock(struct six_lock *lock, void *p);
 
 /* lock: */
 
+void bch2_btree_lock_wait_time_update(struct btree_trans *,
+				      struct btree_bkey_cached_common *,
+				      enum six_lock_type, u64);
+
 static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 					 struct btree_bkey_cached_common *b,
 					 enum six_lock_type type,
 					 bool lock_may_not_fail)
 {
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	u64 start_time = local_clock();
+#endif
 	int ret;
 
 	trans->lock_may_not_fail = lock_may_not_fail;
@@ -203,6 +210,9 @@ static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 				   bch2_six_check_for_deadlock, trans);
 	WRITE_ONCE(trans->locking, NULL);
 	WRITE_ONCE(trans->locking_wait.start_time, 0);
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	bch2_btree_lock_wait_time_update(trans, b, type, start_time);
+#endif
 	return ret;
 }
 
@@ -10,6 +10,7 @@
 #include "buckets_types.h"
 #include "darray.h"
 #include "journal_types.h"
+#include "subvolume_types.h"
 
 struct open_bucket;
 struct btree_update;
@@ -82,6 +83,8 @@ struct btree {
 
 	struct btree_node	*data;
 	void			*aux_data;
+	/* NUMA node data and aux_data were allocated - first touched - on: */
+	int			data_node;
 
 	/*
 	 * Sets of sorted keys - the real btree node - plus a binary search tree
@@ -98,6 +101,15 @@ struct btree {
 	u8			byte_order;
 	u8			unpack_fn_len;
 
+	/*
+	 * Leaf nodes of btrees with snapshots: a superset of the snapshot IDs
+	 * of the keys in the node - the highest, and a bloom filter - so that
+	 * BTREE_ITER_FILTER_SNAPSHOTS iterators can skip nodes with nothing
+	 * visible in their snapshot:
+	 */
+	u32			snapshot_max;
+	u64			snapshot_bloom;
+
 	struct btree_write	writes[2];
 
 	/* Key/pointer for this btree node */
@@ -135,6 +147,8 @@ struct btree {
 	struct list_head	list;
 };
 
+#define BTREE_CACHE_GHOST_NR	256
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -161,6 +175,9 @@ struct btree_cache {
 	unsigned		used;
 	unsigned		reserve;
 	atomic_t		dirty;
+	/* Hashed nodes, by interior (level > 0) vs. leaf: */
+	atomic_t		nr_interior;
+	atomic_t		nr_leaf;
 	struct shrinker		shrink;
 
 	/*
@@ -171,6 +188,28 @@ struct btree_cache {
 	 */
 	struct task_struct	*alloc_lock;
 	struct closure_waitlist	alloc_wait;
+
+	/* Readahead by scanning iterators (BTREE_ITER_PREFETCH): */
+	atomic64_t		readahead;
+	/* readahead nodes that were then used: */
+	atomic64_t		readahead_hit;
+	/* ... where the read hadn't completed yet: */
+	atomic64_t		readahead_wait;
+	/* nodes read synchronously, on lookup: */
+	atomic64_t		read_sync;
+
+	/*
+	 * Hash values of the nodes most recently evicted by the shrinker (the
+	 * 2Q "A1out" list): a node that's read back in while it's still here
+	 * was evicted too early, and comes back in as if it had already been
+	 * accessed twice. Protected by @lock:
+	 */
+	u64			ghost[BTREE_CACHE_GHOST_NR];
+	unsigned		ghost_idx;
+
+	/* BCH_SB_FIELD_btree_cache_hot: see bch2_btree_cache_hot_save() */
+	struct delayed_work	hot_save_work;
+	struct work_struct	warm_work;
 };
 
 struct btree_node_iter {
@@ -207,6 +246,12 @@ struct btree_node_iter {
 #define BTREE_ITER_ALL_SNAPSHOTS	(1 << 11)
 #define BTREE_ITER_FILTER_SNAPSHOTS	(1 << 12)
 #define BTREE_ITER_NOPRESERVE		(1 << 13)
+/*
+ * For bulk walkers (fsck, data moves, etc.) that will touch each node once:
+ * nodes they bring in are left at the cold end of the btree node cache, and
+ * nodes they touch aren't promoted:
+ */
+#define BTREE_ITER_COLD			(1 << 14)
 
 enum btree_path_uptodate {
 	BTREE_ITER_UPTODATE		= 0,
@@ -226,6 +271,7 @@ struct btree_path {
 	enum btree_id		btree_id:4;
 	bool			cached:1;
 	bool			preserve:1;
+	bool			cold:1;
 	enum btree_path_uptodate uptodate:2;
 	/*
 	 * When true, failing to relock this path will cause the transaction to
@@ -236,6 +282,14 @@ struct btree_path {
 				locks_want:4;
 	u8			nodes_locked;
 
+	/*
+	 * For sizing the readahead window when scanning: when we last went
+	 * down to a leaf, and the average time between leaves, in units of
+	 * ~1 us:
+	 */
+	u32			readahead_time;
+	u32			readahead_interval;
+
 	struct btree_path_level {
 		struct btree	*b;
 		struct btree_node_iter iter;
@@ -276,6 +330,8 @@ struct btree_iter {
 
 	/* When we're filtering by snapshot, the snapshot ID we're looking for: */
 	unsigned		snapshot;
+	/* btree_snapshot_bloom_bit() of each ancestor of @snapshot, 0 if unset: */
+	u64			snapshot_bloom;
 
 	struct bpos		pos;
 	struct bpos		pos_after_commit;
@@ -298,19 +354,52 @@ struct btree_key_cache_freelist {
 	unsigned		nr;
 };
 
+/*
+ * The global pools behind the percpu freelists are sharded by CPU, so that
+ * refilling/draining a percpu freelist doesn't contend on a single lock:
+ */
+#define BTREE_KEY_CACHE_SHARDS		8
+
+struct btree_key_cache_shard {
+	spinlock_t		lock;
+	struct list_head	freed_pcpu;
+	struct list_head	freed_nonpcpu;
+} ____cacheline_aligned;
+
+/*
+ * Per btree key cache policy and accounting: max_keys is a soft limit - when a
+ * btree goes over it, trim_work evicts that btree's coldest clean keys until
+ * it's back under (0 for no limit):
+ */
+struct btree_key_cache_btree {
+	atomic_long_t		nr_keys;
+	unsigned long		max_keys;
+};
+
+struct btree_key_cache_stats {
+	u64			hits[BTREE_ID_NR];
+	u64			fills[BTREE_ID_NR];
+};
+
 struct btree_key_cache {
+	/* Protects the shrinker's walk of @table: */
 	struct mutex		lock;
 	struct rhashtable	table;
 	bool			table_init_done;
-	struct list_head	freed_pcpu;
-	struct list_head	freed_nonpcpu;
+	struct btree_key_cache_shard shards[BTREE_KEY_CACHE_SHARDS];
 	struct shrinker		shrink;
 	unsigned		shrink_iter;
+	/* Trims btrees over their max_keys, with its own clock hand: */
+	struct work_struct	trim_work;
+	unsigned		trim_iter;
 	struct btree_key_cache_freelist __percpu *pcpu_freed;
 
 	atomic_long_t		nr_freed;
 	atomic_long_t		nr_keys;
 	atomic_long_t		nr_dirty;
+
+	struct btree_key_cache_btree btrees[BTREE_ID_NR];
+	struct btree_key_cache_stats __percpu *stats;
 };
 
 struct bkey_cached_key {
@@ -374,6 +463,16 @@ struct btree_insert_entry {
 #define BTREE_ITER_MAX		32
 #endif
 
+/* Nodes queued for whiteout compaction, see bch2_btree_node_compact_defer(): */
+#define BTREE_COMPACT_QUEUE	64
+
+struct btree_compact_entry {
+	enum btree_id		btree_id;
+	unsigned		level;
+	struct bpos		pos;
+	__le64			seq;
+};
+
 struct btree_trans_commit_hook;
 typedef int (btree_trans_commit_hook_fn)(struct btree_trans *, struct btree_trans_commit_hook *);
 
@@ -384,6 +483,11 @@ struct btree_trans_commit_hook {
 
 #define BTREE_TRANS_MEM_MAX	(1U << 16)
 
+struct btree_trans_mem_chunk {
+	void			*p;
+	unsigned		bytes;
+};
+
 #define BTREE_TRANS_MAX_LOCK_HOLD_TIME_NS	10000
 
 struct btree_trans {
@@ -406,6 +510,7 @@ struct btree_trans {
 	u8			traverse_all_idx;
 	bool			used_mempool:1;
 	bool			in_traverse_all:1;
+	bool			paths_sorted:1;
 	bool			memory_allocation_failure:1;
 	bool			is_initial_gc:1;
 	enum bch_errcode	restarted:16;
@@ -425,6 +530,13 @@ struct btree_trans {
 	unsigned		mem_max;
 	unsigned		mem_bytes;
 	void			*mem;
+	/*
+	 * Chunks we've filled and moved on from, kept until bch2_trans_begin()
+	 * since there may still be pointers into them; mem_old_bytes is how
+	 * much of them was used:
+	 */
+	unsigned		mem_old_bytes;
+	DARRAY(struct btree_trans_mem_chunk) mem_old;
 
 	u8			sorted[BTREE_ITER_MAX];
 	struct btree_path	*paths;
@@ -433,6 +545,8 @@ struct btree_trans {
 	/* update path: */
 	struct btree_trans_commit_hook *hooks;
 	DARRAY(u64)		extra_journal_entries;
+	/* from the snapshot triggers, published all at once at commit: */
+	DARRAY(struct snapshot_t_update) snapshot_updates;
 	struct journal_entry_pin *journal_pin;
 
 	struct journal_res	journal_res;
@@ -461,7 +575,10 @@ struct btree_trans {
 	x(dying)							\
 	x(fake)								\
 	x(need_rewrite)							\
-	x(never_write)
+	x(never_write)							\
+	x(readahead)							\
+	x(compact_queued)						\
+	x(split_queued)
 
 enum btree_flags {
 #define x(flag)	BTREE_NODE_##flag,
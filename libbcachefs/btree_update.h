@@ -59,6 +59,13 @@ int __bch2_btree_insert(struct btree_trans *, enum btree_id, struct bkey_i *);
 int bch2_btree_insert(struct bch_fs *, enum btree_id, struct bkey_i *,
 		     struct disk_reservation *, u64 *, int flags);
 
+typedef int (*btree_group_update_fn)(struct btree_trans *, void *);
+
+int bch2_trans_do_grouped(struct bch_fs *, enum btree_id, struct bpos,
+			  btree_group_update_fn, void *, u64 *, int flags);
+int bch2_btree_insert_grouped(struct bch_fs *, enum btree_id, struct bkey_i *,
+			      u64 *, int flags);
+
 int bch2_btree_delete_range_trans(struct btree_trans *, enum btree_id,
 				  struct bpos, struct bpos, unsigned, u64 *);
 int bch2_btree_delete_range(struct bch_fs *, enum btree_id,
@@ -67,6 +74,7 @@ int bch2_btree_delete_range(struct bch_fs *, enum btree_id,
 int bch2_btree_node_rewrite(struct btree_trans *, struct btree_iter *,
 			    struct btree *, unsigned);
 void bch2_btree_node_rewrite_async(struct bch_fs *, struct btree *);
+void bch2_btree_node_split_async(struct bch_fs *, struct btree *);
 int bch2_btree_node_update_key(struct btree_trans *, struct btree_iter *,
 			       struct btree *, struct bkey_i *, bool);
 int bch2_btree_node_update_key_get_iter(struct btree_trans *,
@@ -356,6 +356,7 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as,
 	SET_BTREE_NODE_NEW_EXTENT_OVERWRITE(b->data, true);
 
 	bch2_btree_build_aux_trees(b);
+	bch2_btree_node_snapshot_summary(b);
 
 	ret = bch2_btree_node_hash_insert(&c->btree_cache, b, level, as->btree_id);
 	BUG_ON(ret);
@@ -429,6 +430,7 @@ static struct btree *__btree_root_alloc(struct btree_update *as,
 
 	btree_node_set_format(b, b->data->format);
 	bch2_btree_build_aux_trees(b);
+	bch2_btree_node_snapshot_summary(b);
 	six_unlock_write(&b->c.lock);
 
 	return b;
@@ -1045,9 +1047,14 @@ static void bch2_btree_update_done(struct btree_update *as, struct btree_trans *
 			       start_time);
 }
 
+/*
+ * @extra is a number of additional nodes to reserve at @level, for the bulk
+ * loader - as many as fit in BTREE_RESERVE_MAX:
+ */
 static struct btree_update *
-bch2_btree_update_start(struct btree_trans *trans, struct btree_path *path,
-			unsigned level, bool split, unsigned flags)
+__bch2_btree_update_start(struct btree_trans *trans, struct btree_path *path,
+			  unsigned level, bool split, unsigned extra,
+			  unsigned flags)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_update *as;
@@ -1087,6 +1094,8 @@ bch2_btree_update_start(struct btree_trans *trans, struct btree_path *path,
 		split = true;
 	}
 
+	nr_nodes[!!level] += min(extra, BTREE_RESERVE_MAX - nr_nodes[0] - nr_nodes[1]);
+
 	if (flags & BTREE_INSERT_GC_LOCK_HELD)
 		lockdep_assert_held(&c->gc_lock);
 	else if (!down_read_trylock(&c->gc_lock)) {
@@ -1194,6 +1203,13 @@ err:
 	return ERR_PTR(ret);
 }
 
+static struct btree_update *
+bch2_btree_update_start(struct btree_trans *trans, struct btree_path *path,
+			unsigned level, bool split, unsigned flags)
+{
+	return __bch2_btree_update_start(trans, path, level, split, 0, flags);
+}
+
 /* Btree root updates: */
 
 static void bch2_btree_set_root_inmem(struct bch_fs *c, struct btree *b)
@@ -1208,7 +1224,11 @@ static void bch2_btree_set_root_inmem(struct bch_fs *c, struct btree *b)
 	       (b->c.level < btree_node_root(c, b)->c.level ||
 		!btree_node_dying(btree_node_root(c, b))));
 
-	btree_node_root(c, b) = b;
+	/*
+	 * Readers don't take btree_root_lock, see btree_path_lock_root(): order
+	 * initializing the node before publishing it:
+	 */
+	rcu_assign_pointer(btree_node_root(c, b), b);
 	mutex_unlock(&c->btree_root_lock);
 
 	bch2_recalc_btree_reserve(c);
@@ -1371,7 +1391,14 @@ static struct btree *__btree_split_node(struct btree_update *as,
 
 		if (n == vstruct_last(set1))
 			break;
-		if (k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
+		/*
+		 * Bulk loads only ever append, so there's no point leaving room
+		 * in n1: fill it up to the split threshold, and n2 gets the
+		 * rest:
+		 */
+		if (as->bulk_load
+		    ? k->_data - set1->_data >= BTREE_SPLIT_THRESHOLD(as->c)
+		    : k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
 			break;
 
 		if (bkey_packed(k))
@@ -1526,7 +1553,9 @@ static int btree_split(struct btree_update *as, struct btree_trans *trans,
 		n2 = __btree_split_node(as, trans, n1);
 
 		bch2_btree_build_aux_trees(n2);
+		bch2_btree_node_snapshot_summary(n2);
 		bch2_btree_build_aux_trees(n1);
+		bch2_btree_node_snapshot_summary(n1);
 		six_unlock_write(&n2->c.lock);
 		six_unlock_write(&n1->c.lock);
 
@@ -1572,6 +1601,7 @@ static int btree_split(struct btree_update *as, struct btree_trans *trans,
 		trace_and_count(c, btree_node_compact, c, b);
 
 		bch2_btree_build_aux_trees(n1);
+		bch2_btree_node_snapshot_summary(n1);
 		six_unlock_write(&n1->c.lock);
 
 		path1 = get_unlocked_mut_path(trans, path->btree_id, n1->c.level, n1->key.k.p);
@@ -1776,6 +1806,339 @@ int bch2_btree_split_leaf(struct btree_trans *trans,
 	return ret;
 }
 
+/* Bulk loading: */
+
+/*
+ * Pick the keys, starting at @start, for one leaf of a bulk insert covering
+ * [@min_key, @max_key] - after the keys of @old if it's non NULL: first with a
+ * format covering every key that could possibly go in the leaf, then with a
+ * format for just the ones that fit, which can only make them smaller.
+ *
+ * Returns the first key that didn't fit, and the last one that did in @last:
+ */
+static struct bkey_i *bulk_insert_leaf_keys(struct bch_fs *c,
+					    struct btree *old,
+					    struct bpos min_key,
+					    struct bpos max_key,
+					    struct bkey_i *start,
+					    struct bkey_i *end,
+					    struct bkey_format *f,
+					    struct bkey_i **last)
+{
+	struct bkey_format_state s;
+	struct bkey_i *k, *stop;
+	size_t u64s, nr = 0;
+
+	bch2_bkey_format_init(&s);
+	bch2_bkey_format_add_pos(&s, min_key);
+	bch2_bkey_format_add_pos(&s, max_key);
+	if (old)
+		__bch2_btree_calc_format(&s, old);
+
+	/* Every packed key is at least one u64, so don't look any further: */
+	for (k = start;
+	     k != end &&
+	     bpos_cmp(k->k.p, max_key) <= 0 &&
+	     nr < btree_max_u64s(c);
+	     k = bkey_next(k), nr++)
+		bch2_bkey_format_add_key(&s, &k->k);
+	stop = k;
+
+	*f = bch2_bkey_format_done(&s);
+	u64s = old ? btree_node_u64s_with_format(old, f) : 0;
+	*last = NULL;
+
+	for (k = start; k != stop; k = bkey_next(k)) {
+		size_t k_u64s = f->key_u64s + bkey_val_u64s(&k->k);
+
+		if (u64s + k_u64s >= btree_max_u64s(c))
+			break;
+		u64s += k_u64s;
+		*last = k;
+	}
+
+	return k;
+}
+
+static struct bkey_format bulk_insert_leaf_format(struct btree *old,
+						  struct bpos min_key,
+						  struct bpos max_key,
+						  struct bkey_i *start,
+						  struct bkey_i *stop)
+{
+	struct bkey_format_state s;
+	struct bkey_i *k;
+
+	bch2_bkey_format_init(&s);
+	bch2_bkey_format_add_pos(&s, min_key);
+	bch2_bkey_format_add_pos(&s, max_key);
+	if (old)
+		__bch2_btree_calc_format(&s, old);
+
+	for (k = start; k != stop; k = bkey_next(k))
+		bch2_bkey_format_add_key(&s, &k->k);
+
+	return bch2_bkey_format_done(&s);
+}
+
+/*
+ * Replace the leaf containing @*start - which must not have any keys at or
+ * after @*start - with as many full leaves as the btree_update reserve allows:
+ * the first one has the old leaf's keys, and the last one gets the rest of the
+ * old leaf's range, so no empty leaves are ever written.
+ *
+ * The parent node is updated the same way as for a split, except that
+ * as->bulk_load makes interior node splits fill the lower node up to the split
+ * threshold instead of splitting 3/5 - so, like the leaves, interior nodes end
+ * up packed the way a bottom up build would pack them.
+ *
+ * The new keys are written out with the new nodes and made visible by the
+ * update to the parent node; they never go through the journal.
+ */
+static int __bch2_btree_bulk_insert(struct btree_trans *trans,
+				    enum btree_id btree,
+				    struct bkey_i **start,
+				    struct bkey_i *end,
+				    unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_update *as = NULL;
+	struct btree_iter iter;
+	struct btree_path *path, *paths[BTREE_BULK_INSERT_LEAVES] = { NULL };
+	struct btree *b, *parent, *n[BTREE_BULK_INSERT_LEAVES], *root = NULL;
+	struct bkey_format f;
+	struct bkey_s_c old;
+	struct bkey_i *k, *stop, *last_k;
+	struct bkey_packed *out;
+	struct bset *i;
+	struct bpos min_key, pivot;
+	unsigned nr_leaves, nr = 0, l;
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, btree, bkey_start_pos(&(*start)->k),
+			     BTREE_ITER_INTENT|
+			     BTREE_ITER_ALL_SNAPSHOTS);
+	old = bch2_btree_iter_peek(&iter);
+	ret = bkey_err(old);
+	if (ret)
+		goto err;
+
+	if (old.k) {
+		ret = -EEXIST;
+		goto err;
+	}
+
+	bch2_btree_iter_set_pos(&iter, (*start)->k.p);
+	ret = bch2_btree_iter_traverse(&iter);
+	if (ret)
+		goto err;
+
+	path	= iter.path;
+	b	= path->l[0].b;
+	parent	= btree_node_parent(path, b);
+
+	as = __bch2_btree_update_start(trans, path, 0, true,
+				       BTREE_BULK_INSERT_LEAVES - 2, flags);
+	ret = PTR_ERR_OR_ZERO(as);
+	if (ret) {
+		as = NULL;
+		goto err;
+	}
+
+	as->bulk_load = true;
+	nr_leaves = min_t(unsigned, as->prealloc_nodes[0].nr,
+			  BTREE_BULK_INSERT_LEAVES);
+
+	bch2_btree_interior_update_will_free_node(as, b);
+
+	k	= *start;
+	min_key	= b->data->min_key;
+
+	while (nr < nr_leaves) {
+		struct btree *old_b = !nr ? b : NULL;
+		struct btree *n_b;
+		bool last;
+
+		stop = bulk_insert_leaf_keys(c, old_b, min_key, b->data->max_key,
+					     k, end, &f, &last_k);
+
+		last = nr + 1 == nr_leaves ||
+			stop == end ||
+			bpos_cmp(stop->k.p, b->data->max_key) > 0;
+
+		if (last)
+			pivot = b->data->max_key;
+		else if (last_k)
+			pivot = last_k->k.p;
+		else
+			/* Old leaf was already full: */
+			pivot = bpos_predecessor(k->k.p);
+
+		if (c->sb.version < bcachefs_metadata_version_snapshot &&
+		    !last)
+			pivot.snapshot = U32_MAX;
+
+		f = bulk_insert_leaf_format(old_b, min_key, pivot, k, stop);
+
+		if (old_b) {
+			n_b = __bch2_btree_node_alloc_replacement(as, trans, b, f);
+		} else {
+			n_b = bch2_btree_node_alloc(as, trans, 0);
+			SET_BTREE_NODE_SEQ(n_b->data, BTREE_NODE_SEQ(b->data));
+			btree_set_min(n_b, min_key);
+			n_b->data->format = f;
+			btree_node_set_format(n_b, f);
+		}
+		btree_set_max(n_b, pivot);
+
+		i = btree_bset_first(n_b);
+		out = vstruct_last(i);
+
+		for (; k != stop; k = bkey_next(k)) {
+			BUG_ON(!bch2_bkey_pack(out, k, &n_b->format));
+			btree_keys_account_key_add(&n_b->nr, 0, out);
+			out = bkey_next(out);
+		}
+
+		i->u64s = cpu_to_le16((u64 *) out - i->_data);
+		set_btree_bset_end(n_b, n_b->set);
+
+		btree_node_reset_sib_u64s(n_b);
+		bch2_verify_btree_nr_keys(n_b);
+
+		bch2_btree_build_aux_trees(n_b);
+		bch2_btree_node_snapshot_summary(n_b);
+		six_unlock_write(&n_b->c.lock);
+
+		paths[nr] = get_unlocked_mut_path(trans, btree, 0, n_b->key.k.p);
+		six_lock_increment(&n_b->c.lock, SIX_LOCK_intent);
+		mark_btree_node_locked(trans, paths[nr], 0, SIX_LOCK_intent);
+		bch2_btree_path_level_init(trans, paths[nr], n_b);
+		bch2_btree_update_add_new_node(as, n_b);
+
+		n[nr++] = n_b;
+
+		if (last)
+			break;
+
+		min_key = bpos_successor(pivot);
+	}
+
+	if (parent || nr > 1)
+		for (l = 0; l < nr; l++)
+			bch2_keylist_add(&as->parent_keys, &n[l]->key);
+
+	if (!parent && nr > 1) {
+		struct btree_path *root_path = paths[nr - 1];
+
+		/* Depth increases, make a new root */
+		root = __btree_root_alloc(as, trans, 1);
+
+		root_path->locks_want++;
+		BUG_ON(btree_node_locked(root_path, root->c.level));
+		six_lock_increment(&root->c.lock, SIX_LOCK_intent);
+		mark_btree_node_locked(trans, root_path, root->c.level, SIX_LOCK_intent);
+		bch2_btree_path_level_init(trans, root_path, root);
+
+		root->sib_u64s[0] = U16_MAX;
+		root->sib_u64s[1] = U16_MAX;
+
+		bch2_btree_update_add_new_node(as, root);
+
+		btree_split_insert_keys(as, trans, path, root, &as->parent_keys);
+	}
+
+	if (parent) {
+		ret = bch2_btree_insert_node(as, trans, path, parent, &as->parent_keys, flags);
+		if (ret) {
+			while (nr)
+				bch2_btree_node_free_never_used(as, trans, n[--nr]);
+			goto err;
+		}
+	} else {
+		bch2_btree_set_root(as, trans, path, root ?: n[0]);
+	}
+
+	if (root) {
+		bch2_btree_update_get_open_buckets(as, root);
+		bch2_btree_node_write(c, root, SIX_LOCK_intent, 0);
+	}
+	for (l = nr; l-- > 0;) {
+		bch2_btree_update_get_open_buckets(as, n[l]);
+		bch2_btree_node_write(c, n[l], SIX_LOCK_intent, 0);
+	}
+
+	bch2_btree_node_free_inmem(trans, path, b);
+
+	if (root)
+		bch2_trans_node_add(trans, root);
+	for (l = nr; l-- > 0;)
+		bch2_trans_node_add(trans, n[l]);
+
+	if (root)
+		six_unlock_intent(&root->c.lock);
+	for (l = nr; l-- > 0;)
+		six_unlock_intent(&n[l]->c.lock);
+
+	bch2_btree_update_done(as, trans);
+	as = NULL;
+
+	*start = k;
+err:
+	if (as)
+		bch2_btree_update_free(as, trans);
+	for (l = BTREE_BULK_INSERT_LEAVES; l-- > 0;)
+		if (paths[l]) {
+			__bch2_btree_path_unlock(trans, paths[l]);
+			bch2_path_put(trans, paths[l], true);
+		}
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/**
+ * bch2_btree_bulk_insert - load sorted keys into a btree, bypassing the journal
+ *
+ * @keys must be sorted, and must all sort after any key already in @btree:
+ * they're packed into full leaf nodes that are written out directly, and the
+ * interior nodes are built by the same pointer updates splits use. Only the
+ * pointers to the new nodes are journalled, so this is many times faster than
+ * inserting the keys with transaction commits - but triggers aren't run, so
+ * keys that have them can't be loaded this way.
+ *
+ * Returns -EEXIST if @btree already has keys at or after the first key, and
+ * -EINVAL if @keys isn't sorted or has keys with triggers.
+ */
+int bch2_btree_bulk_insert(struct bch_fs *c, enum btree_id btree,
+			   struct keylist *keys, unsigned flags)
+{
+	struct btree_trans trans;
+	struct bkey_i *k, *prev = NULL;
+	int ret = 0;
+
+	for_each_keylist_key(keys, k) {
+		const struct bkey_ops *ops = &bch2_bkey_ops[k->k.type];
+
+		if (bkey_deleted(&k->k) ||
+		    ops->trans_trigger ||
+		    ops->atomic_trigger ||
+		    (prev && bpos_cmp(bkey_start_pos(&k->k), prev->k.p) < 0) ||
+		    (prev && bpos_cmp(k->k.p, prev->k.p) <= 0))
+			return -EINVAL;
+		prev = k;
+	}
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	k = keys->keys;
+	while (!ret && k != keys->top)
+		ret = lockrestart_do(&trans,
+			__bch2_btree_bulk_insert(&trans, btree, &k, keys->top, flags));
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
 int __bch2_foreground_maybe_merge(struct btree_trans *trans,
 				  struct btree_path *path,
 				  unsigned level,
@@ -1903,6 +2266,7 @@ int __bch2_foreground_maybe_merge(struct btree_trans *trans,
 	bch2_btree_sort_into(c, n, next);
 
 	bch2_btree_build_aux_trees(n);
+	bch2_btree_node_snapshot_summary(n);
 	six_unlock_write(&n->c.lock);
 
 	bch2_btree_update_add_new_node(as, n);
@@ -1982,6 +2346,7 @@ int bch2_btree_node_rewrite(struct btree_trans *trans,
 	bch2_btree_update_add_new_node(as, n);
 
 	bch2_btree_build_aux_trees(n);
+	bch2_btree_node_snapshot_summary(n);
 	six_unlock_write(&n->c.lock);
 
 	new_path = get_unlocked_mut_path(trans, iter->btree_id, n->c.level, n->key.k.p);
@@ -2089,6 +2454,80 @@ void bch2_btree_node_rewrite_async(struct bch_fs *c, struct btree *b)
 	queue_work(c->btree_interior_update_worker, &a->work);
 }
 
+static int async_btree_node_split_trans(struct btree_trans *trans,
+					struct async_btree_rewrite *a)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct btree *b;
+	int ret;
+
+	bch2_trans_node_iter_init(trans, &iter, a->btree_id, a->pos,
+				  a->level + 1, a->level, 0);
+	b = bch2_btree_iter_peek_node(&iter);
+	ret = PTR_ERR_OR_ZERO(b);
+	if (ret)
+		goto out;
+
+	if (!b || b->data->keys.seq != a->seq)
+		goto out;
+
+	clear_btree_node_split_queued(b);
+
+	/* Deletions may have brought it back under the threshold: */
+	if (b->nr.live_u64s <= BTREE_SPLIT_THRESHOLD(c))
+		goto out;
+
+	ret = bch2_btree_split_leaf(trans, iter.path, BTREE_INSERT_NOFAIL);
+	if (!ret)
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_split_async]);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+static void async_btree_node_split_work(struct work_struct *work)
+{
+	struct async_btree_rewrite *a =
+		container_of(work, struct async_btree_rewrite, work);
+	struct bch_fs *c = a->c;
+
+	bch2_trans_do(c, NULL, NULL, 0,
+		      async_btree_node_split_trans(&trans, a));
+	percpu_ref_put(&c->writes);
+	kfree(a);
+}
+
+/*
+ * Called with @b write locked, from the insert path: queues a split of @b,
+ * which will happen after the current transaction drops its locks:
+ */
+void bch2_btree_node_split_async(struct bch_fs *c, struct btree *b)
+{
+	struct async_btree_rewrite *a;
+
+	if (!percpu_ref_tryget_live(&c->writes))
+		return;
+
+	a = kmalloc(sizeof(*a), GFP_NOWAIT);
+	if (!a) {
+		percpu_ref_put(&c->writes);
+		return;
+	}
+
+	set_btree_node_split_queued(b);
+
+	a->c		= c;
+	a->btree_id	= b->c.btree_id;
+	a->level	= b->c.level;
+	a->pos		= b->key.k.p;
+	a->seq		= b->data->keys.seq;
+
+	INIT_WORK(&a->work, async_btree_node_split_work);
+	queue_work(c->btree_interior_update_worker, &a->work);
+}
+
 static int __bch2_btree_node_update_key(struct btree_trans *trans,
 					struct btree_iter *iter,
 					struct btree *b, struct btree *new_hash,
@@ -2132,7 +2571,7 @@ static int __bch2_btree_node_update_key(struct btree_trans *trans,
 
 		btree_path_set_level_up(trans, iter2.path);
 
-		bch2_btree_path_check_sort(trans, iter2.path, 0);
+		trans->paths_sorted = false;
 
 		ret   = bch2_btree_iter_traverse(&iter2) ?:
 			bch2_trans_update(trans, &iter2, new_key, BTREE_TRIGGER_NORUN);
@@ -2310,6 +2749,7 @@ void bch2_btree_root_alloc(struct bch_fs *c, enum btree_id id)
 
 	bch2_bset_init_first(b, &b->data->keys);
 	bch2_btree_build_aux_trees(b);
+	bch2_btree_node_snapshot_summary(b);
 
 	b->data->flags = 0;
 	btree_set_min(b, POS_MIN);
@@ -12,6 +12,12 @@ bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *,
 
 #define BTREE_UPDATE_NODES_MAX		((BTREE_MAX_DEPTH - 2) * 2 + GC_MERGE_NODES)
 
+/*
+ * Most leaves bch2_btree_bulk_insert() will create with one btree_update: at
+ * most BTREE_RESERVE_MAX, less what an update may need for interior nodes:
+ */
+#define BTREE_BULK_INSERT_LEAVES	6
+
 #define BTREE_UPDATE_JOURNAL_RES	(BTREE_UPDATE_NODES_MAX * (BKEY_BTREE_PTR_U64s_MAX + 1))
 
 /*
@@ -50,6 +56,7 @@ struct btree_update {
 
 	unsigned			nodes_written:1;
 	unsigned			took_gc_lock:1;
+	unsigned			bulk_load:1;
 
 	enum btree_id			btree_id;
 	unsigned			update_level;
@@ -110,11 +117,13 @@ struct btree_update {
 	/* Only here to reduce stack usage on recursive splits: */
 	struct keylist			parent_keys;
 	/*
-	 * Enough room for btree_split's keys without realloc - btree node
-	 * pointers never have crc/compression info, so we only need to acount
-	 * for the pointers for three keys
+	 * Enough room for btree_split's and bch2_btree_bulk_insert()'s keys
+	 * without realloc - btree node pointers never have crc/compression
+	 * info, so we only need to acount for the pointers for
+	 * BTREE_BULK_INSERT_LEAVES keys
 	 */
-	u64				inline_keys[BKEY_BTREE_PTR_U64s_MAX * 3];
+	u64				inline_keys[BKEY_BTREE_PTR_U64s_MAX *
+						    BTREE_BULK_INSERT_LEAVES];
 };
 
 struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *,
@@ -124,6 +133,9 @@ struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *,
 
 int bch2_btree_split_leaf(struct btree_trans *, struct btree_path *, unsigned);
 
+int bch2_btree_bulk_insert(struct bch_fs *, enum btree_id,
+			   struct keylist *, unsigned);
+
 int __bch2_foreground_maybe_merge(struct btree_trans *, struct btree_path *,
 				  unsigned, unsigned, enum btree_node_sibling);
 
@@ -244,6 +256,22 @@ static inline size_t bch_btree_keys_u64s_remaining(struct bch_fs *c,
 	return remaining;
 }
 
+/*
+ * Leaf nodes past BTREE_SPLIT_THRESHOLD with less than an eighth of the node
+ * free are split by bch2_btree_node_split_async(), so that the insert that
+ * would have overflowed them doesn't have to:
+ */
+static inline bool bch2_btree_node_want_split_async(struct bch_fs *c,
+						    struct btree *b)
+{
+	return c->opts.btree_split_async &&
+		!b->c.level &&
+		b->nr.live_u64s > BTREE_SPLIT_THRESHOLD(c) &&
+		!btree_node_split_queued(b) &&
+		__bch_btree_u64s_remaining(c, b,
+			btree_bkey_last(b, bset_tree_last(b))) < btree_max_u64s(c) / 8;
+}
+
 #define BTREE_WRITE_SET_U64s_BITS	9
 
 static inline unsigned btree_write_set_buffer(struct btree *b)
@@ -13,6 +13,7 @@
 #include "errcode.h"
 #include "error.h"
 #include "extent_update.h"
+#include "extents.h"
 #include "journal.h"
 #include "journal_reclaim.h"
 #include "keylist.h"
@@ -97,6 +98,8 @@ bool bch2_btree_bset_insert_key(struct btree_trans *trans,
 	EBUG_ON(insert->k.u64s >
 		bch_btree_keys_u64s_remaining(trans->c, b));
 
+	btree_node_snapshot_summary_add(b, insert->k.p.snapshot);
+
 	k = bch2_btree_node_iter_peek_all(node_iter, b);
 	if (k && bkey_cmp_left_packed(b, k, &insert->k.p))
 		k = NULL;
@@ -227,6 +230,10 @@ static void btree_insert_key_leaf(struct btree_trans *trans,
 					&insert_l(insert)->iter, insert->k)))
 		return;
 
+	if (insert->btree_id == BTREE_ID_extents &&
+	    bkey_extent_is_data(&insert->k->k))
+		bch2_extent_hole_cache_invalidate(c, insert->k->k.p.inode);
+
 	i->journal_seq = cpu_to_le64(max(trans->journal_res.seq,
 					 le64_to_cpu(i->journal_seq)));
 
@@ -243,8 +250,13 @@ static void btree_insert_key_leaf(struct btree_trans *trans,
 	if (b->sib_u64s[1] != U16_MAX && live_u64s_added < 0)
 		b->sib_u64s[1] = max(0, (int) b->sib_u64s[1] + live_u64s_added);
 
+	if (unlikely(bch2_btree_node_want_split_async(c, b)))
+		bch2_btree_node_split_async(c, b);
+
 	if (u64s_added > live_u64s_added &&
-	    bch2_maybe_compact_whiteouts(c, b))
+	    bch2_btree_node_want_compact(b) &&
+	    !bch2_btree_node_compact_defer(c, b) &&
+	    bch2_compact_whiteouts(c, b, COMPACT_LAZY))
 		bch2_trans_node_reinit_iter(trans, b);
 }
 
@@ -684,6 +696,11 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 			return ret;
 	}
 
+	/* while the snapshots btree is still write locked: */
+	ret = bch2_snapshot_updates_publish(trans);
+	if (ret)
+		return ret;
+
 	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
 		trans_for_each_update(trans, i) {
 			struct journal *j = &c->journal;
@@ -912,13 +929,17 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (ret)
 			trace_and_count(c, trans_restart_journal_res_get, trans, trace_ip);
 		break;
-	case BTREE_INSERT_NEED_JOURNAL_RECLAIM:
+	case BTREE_INSERT_NEED_JOURNAL_RECLAIM: {
+		u64 start_time = local_clock();
+
 		bch2_trans_unlock(trans);
 
 		trace_and_count(c, trans_blocked_journal_reclaim, trans, trace_ip);
 
 		wait_event_freezable(c->journal.reclaim_wait,
 				     (ret = journal_reclaim_wait_done(c)));
+		bch2_time_stats_update(&c->times[BCH_TIME_blocked_journal_reclaim],
+				       start_time);
 		if (ret < 0)
 			break;
 
@@ -926,6 +947,7 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (ret)
 			trace_and_count(c, trans_restart_journal_reclaim, trans, trace_ip);
 		break;
+	}
 	default:
 		BUG_ON(ret >= 0);
 		break;
@@ -1032,6 +1054,10 @@ int __bch2_trans_commit(struct btree_trans *trans)
 
 		BUG_ON(!btree_node_intent_locked(i->path, i->level));
 
+		/* for fsck_quick: */
+		if (unlikely(!test_bit(i->btree_id, &c->btrees_written)))
+			set_bit(i->btree_id, &c->btrees_written);
+
 		if (i->key_cache_already_flushed)
 			continue;
 
@@ -1073,6 +1099,16 @@ out:
 	if (likely(!(trans->flags & BTREE_INSERT_NOCHECK_RW)))
 		percpu_ref_put(&c->writes);
 out_reset:
+	/*
+	 * Triggers run outside of a commit, i.e. by gc, are published here; on
+	 * error, their updates are dropped:
+	 */
+	if (unlikely(trans->snapshot_updates.nr)) {
+		if (!ret)
+			ret = bch2_snapshot_updates_publish(trans);
+		trans->snapshot_updates.nr = 0;
+	}
+
 	bch2_trans_reset_updates(trans);
 
 	if (trans->fs_usage_deltas) {
@@ -1132,7 +1168,7 @@ static inline int check_pos_snapshot_overwritten(struct btree_trans *trans,
 {
 	if (!btree_type_has_snapshots(id) ||
 	    pos.snapshot == U32_MAX ||
-	    !snapshot_t(trans->c, pos.snapshot)->children[0])
+	    !bch2_snapshot_internal_node(trans->c, pos.snapshot))
 		return 0;
 
 	return __check_pos_snapshot_overwritten(trans, id, pos);
@@ -1591,6 +1627,184 @@ int bch2_btree_insert(struct bch_fs *c, enum btree_id id,
 			     __bch2_btree_insert(&trans, id, k));
 }
 
+/* Group commit: */
+
+#define BTREE_GROUP_COMMIT_MAX		16
+
+struct btree_group_update {
+	struct list_head	list;
+	enum btree_id		btree_id;
+	struct bpos		pos;
+	btree_group_update_fn	fn;
+	void			*arg;
+	int			flags;
+	u64			journal_seq;
+	int			ret;
+	bool			done;
+};
+
+static int btree_group_commit_updates(struct btree_trans *trans,
+				      struct list_head *batch)
+{
+	struct btree_group_update *u;
+	int ret = 0;
+
+	list_for_each_entry(u, batch, list) {
+		ret = u->fn(trans, u->arg);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+static bool btree_group_batch_has(struct list_head *batch,
+				  struct btree_group_update *u)
+{
+	struct btree_group_update *i;
+
+	list_for_each_entry(i, batch, list)
+		if (i->btree_id == u->btree_id &&
+		    !bpos_cmp(i->pos, u->pos))
+			return true;
+	return false;
+}
+
+/*
+ * Commit a batch of independent updates with a single transaction - so the
+ * leaf write locks and the journal reservation are taken once for the whole
+ * batch. If that fails, commit them one at a time, so that each update gets
+ * its own error:
+ */
+static void btree_group_commit(struct bch_fs *c, struct list_head *batch)
+{
+	struct btree_group_update *u, *n;
+	int flags = list_first_entry(batch, struct btree_group_update, list)->flags;
+	u64 journal_seq = 0;
+	int ret;
+
+	ret = bch2_trans_do(c, NULL, &journal_seq, flags,
+			    btree_group_commit_updates(&trans, batch));
+
+	list_for_each_entry_safe(u, n, batch, list) {
+		if (!ret) {
+			u->journal_seq = journal_seq;
+		} else {
+			u->journal_seq = 0;
+			u->ret = bch2_trans_do(c, NULL, &u->journal_seq, u->flags,
+					       u->fn(&trans, u->arg));
+		}
+
+		/* @u is on the waiter's stack, and may go away once it's done: */
+		list_del(&u->list);
+		smp_store_release(&u->done, true);
+	}
+}
+
+/**
+ * bch2_trans_do_grouped - run a small update, combined with concurrent updates
+ * @c:			pointer to struct bch_fs
+ * @id:			btree of the key @fn updates
+ * @pos:		position of the key @fn updates
+ * @fn:			does the update in the transaction it's passed, as
+ *			with bch2_trans_do(): it may be run more than once
+ * @arg:		passed to @fn
+ * @journal_seq:	if non NULL, set to the journal sequence number the
+ *			update was committed in
+ * @flags:		BTREE_INSERT flags
+ *
+ * For small updates that are independent of each other, e.g. inode updates
+ * from different threads: if another thread is already committing, this
+ * update is queued, and it'll be committed along with every other update that's
+ * queued up in the meantime with the same @flags, in one transaction.
+ *
+ * @id and @pos identify the key @fn does its read-modify-write on: updates to
+ * the same key are never put in the same batch, since iterators don't see
+ * other updates in the transaction by default, and the second update would
+ * overwrite the first.
+ */
+int bch2_trans_do_grouped(struct bch_fs *c, enum btree_id id, struct bpos pos,
+			  btree_group_update_fn fn, void *arg,
+			  u64 *journal_seq, int flags)
+{
+	struct btree_group_update u = {
+		.btree_id	= id,
+		.pos		= pos,
+		.fn		= fn,
+		.arg		= arg,
+		.flags		= flags,
+	};
+
+	spin_lock(&c->btree_group_commit_lock);
+	list_add_tail(&u.list, &c->btree_group_commit_pending);
+
+	while (!u.done) {
+		struct btree_group_update *i, *n;
+		LIST_HEAD(batch);
+		unsigned nr = 0;
+
+		if (c->btree_group_commit_leader) {
+			spin_unlock(&c->btree_group_commit_lock);
+			wait_event(c->btree_group_commit_wait,
+				   smp_load_acquire(&u.done) ||
+				   !READ_ONCE(c->btree_group_commit_leader));
+			spin_lock(&c->btree_group_commit_lock);
+			continue;
+		}
+
+		c->btree_group_commit_leader = true;
+
+		list_for_each_entry_safe(i, n, &c->btree_group_commit_pending, list) {
+			if (i->flags != flags ||
+			    btree_group_batch_has(&batch, i))
+				continue;
+
+			list_move_tail(&i->list, &batch);
+			if (++nr == BTREE_GROUP_COMMIT_MAX)
+				break;
+		}
+		spin_unlock(&c->btree_group_commit_lock);
+
+		btree_group_commit(c, &batch);
+
+		spin_lock(&c->btree_group_commit_lock);
+		c->btree_group_commit_leader = false;
+		wake_up(&c->btree_group_commit_wait);
+	}
+	spin_unlock(&c->btree_group_commit_lock);
+
+	if (journal_seq)
+		*journal_seq = u.journal_seq;
+	return u.ret;
+}
+
+struct btree_insert_grouped {
+	enum btree_id		btree_id;
+	struct bkey_i		*k;
+};
+
+static int btree_insert_grouped_fn(struct btree_trans *trans, void *_arg)
+{
+	struct btree_insert_grouped *arg = _arg;
+
+	return __bch2_btree_insert(trans, arg->btree_id, arg->k);
+}
+
+/**
+ * bch2_btree_insert_grouped - insert a key, combined with concurrent inserts
+ *
+ * As bch2_trans_do_grouped(), for updates that don't depend on anything else
+ * in the btree: the key is inserted as is.
+ */
+int bch2_btree_insert_grouped(struct bch_fs *c, enum btree_id id,
+			      struct bkey_i *k, u64 *journal_seq, int flags)
+{
+	struct btree_insert_grouped arg = { .btree_id = id, .k = k };
+
+	return bch2_trans_do_grouped(c, id, k->k.p, btree_insert_grouped_fn,
+				     &arg, journal_seq, flags);
+}
+
 int bch2_btree_delete_extent_at(struct btree_trans *trans, struct btree_iter *iter,
 				unsigned len, unsigned update_flags)
 {
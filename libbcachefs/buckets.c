@@ -338,14 +338,15 @@ static void bch2_dev_usage_update_m(struct bch_fs *c, struct bch_dev *ca,
 		.data_type	= old.data_type,
 		.dirty_sectors	= old.dirty_sectors,
 		.cached_sectors	= old.cached_sectors,
-		.stripe		= old.stripe,
+		/* only used for buckets_ec, so the stripe index isn't needed: */
+		.stripe		= old.striped,
 	};
 	struct bch_alloc_v4 new_a = {
 		.gen		= new.gen,
 		.data_type	= new.data_type,
 		.dirty_sectors	= new.dirty_sectors,
 		.cached_sectors	= new.cached_sectors,
-		.stripe		= new.stripe,
+		.stripe		= new.striped,
 	};
 
 	bch2_dev_usage_update(c, ca, old_a, new_a, journal_seq, gc);
@@ -544,10 +545,21 @@ int bch2_mark_alloc(struct btree_trans *trans,
 		}
 	}
 
+	if (gc && new_a.stripe) {
+		ret = gc_bucket_stripe_prealloc(ca, new.k->p.offset);
+		if (ret) {
+			bch_err(c, "error allocating memory for gc bucket stripe");
+			return ret;
+		}
+	}
+
 	percpu_down_read(&c->mark_lock);
 	if (!gc && new_a.gen != old_a.gen)
 		*bucket_gen(ca, new.k->p.offset) = new_a.gen;
 
+	if (!gc)
+		bch2_copygc_candidate_update(ca, new.k->p.offset, old_a, new_a);
+
 	bch2_dev_usage_update(c, ca, old_a, new_a, journal_seq, gc);
 
 	if (gc) {
@@ -558,10 +570,10 @@ int bch2_mark_alloc(struct btree_trans *trans,
 		g->gen_valid		= 1;
 		g->gen			= new_a.gen;
 		g->data_type		= new_a.data_type;
-		g->stripe		= new_a.stripe;
 		g->stripe_redundancy	= new_a.stripe_redundancy;
 		g->dirty_sectors	= new_a.dirty_sectors;
 		g->cached_sectors	= new_a.cached_sectors;
+		gc_bucket_stripe_set(ca, new.k->p.offset, new_a.stripe);
 
 		bucket_unlock(g);
 	}
@@ -737,7 +749,7 @@ static int check_bucket_ref(struct bch_fs *c,
 		goto err;
 	}
 
-	if ((unsigned) (bucket_sectors + sectors) > U32_MAX) {
+	if ((unsigned) (bucket_sectors + sectors) > U16_MAX) {
 		bch2_fsck_err(c, FSCK_CAN_IGNORE|FSCK_NEED_FSCK,
 			"bucket %u:%zu gen %u data type %s sector count overflow: %u + %lli > U16_MAX\n"
 			"while marking %s",
@@ -768,20 +780,29 @@ static int mark_stripe_bucket(struct btree_trans *trans,
 	s64 sectors = parity ? le16_to_cpu(s->sectors) : 0;
 	const struct bch_extent_ptr *ptr = s->ptrs + ptr_idx;
 	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+	size_t b = PTR_BUCKET_NR(ca, ptr);
 	struct bucket old, new, *g;
 	struct printbuf buf = PRINTBUF;
+	u32 stripe;
 	int ret = 0;
 
 	BUG_ON(!(flags & BTREE_TRIGGER_GC));
 
 	/* * XXX doesn't handle deletion */
 
+	ret = gc_bucket_stripe_prealloc(ca, b);
+	if (ret) {
+		bch_err(c, "error allocating memory for gc bucket stripe");
+		return ret;
+	}
+
 	percpu_down_read(&c->mark_lock);
 	buf.atomic++;
-	g = PTR_GC_BUCKET(ca, ptr);
+	g = gc_bucket(ca, b);
+	stripe = gc_bucket_stripe(ca, b);
 
 	if (g->dirty_sectors ||
-	    (g->stripe && g->stripe != k.k->p.offset)) {
+	    (stripe && stripe != k.k->p.offset)) {
 		bch2_fs_inconsistent(c,
 			      "bucket %u:%zu gen %u: multiple stripes using same bucket\n%s",
 			      ptr->dev, PTR_BUCKET_NR(ca, ptr), g->gen,
@@ -803,8 +824,8 @@ static int mark_stripe_bucket(struct btree_trans *trans,
 		g->data_type = data_type;
 	g->dirty_sectors += sectors;
 
-	g->stripe		= k.k->p.offset;
 	g->stripe_redundancy	= s->nr_redundant;
+	gc_bucket_stripe_set(ca, b, k.k->p.offset);
 	new = *g;
 err:
 	bucket_unlock(g);
@@ -849,6 +870,7 @@ static int bch2_mark_pointer(struct btree_trans *trans,
 	struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
 	struct bucket old, new, *g;
 	u8 bucket_data_type;
+	u32 dirty_sectors, cached_sectors;
 	int ret = 0;
 
 	BUG_ON(!(flags & BTREE_TRIGGER_GC));
@@ -858,14 +880,19 @@ static int bch2_mark_pointer(struct btree_trans *trans,
 	bucket_lock(g);
 	old = *g;
 
-	bucket_data_type = g->data_type;
+	bucket_data_type	= g->data_type;
+	dirty_sectors		= g->dirty_sectors;
+	cached_sectors		= g->cached_sectors;
 	ret = __mark_pointer(trans, k, &p.ptr, sectors,
 			     data_type, g->gen,
 			     &bucket_data_type,
-			     &g->dirty_sectors,
-			     &g->cached_sectors);
-	if (!ret)
-		g->data_type = bucket_data_type;
+			     &dirty_sectors,
+			     &cached_sectors);
+	if (!ret) {
+		g->data_type		= bucket_data_type;
+		g->dirty_sectors	= dirty_sectors;
+		g->cached_sectors	= cached_sectors;
+	}
 
 	new = *g;
 	bucket_unlock(g);
@@ -1123,6 +1150,10 @@ int bch2_mark_inode(struct btree_trans *trans,
 		v->bi_journal_seq = cpu_to_le64(journal_seq);
 	}
 
+	if (!(flags & BTREE_TRIGGER_GC) &&
+	    bch2_inode_opts_changed(old, new))
+		bch2_inode_opts_cache_invalidate(c, new.k->p.offset);
+
 	if (flags & BTREE_TRIGGER_GC) {
 		percpu_down_read(&c->mark_lock);
 		preempt_disable();
@@ -1176,7 +1207,7 @@ static s64 __bch2_mark_reflink_p(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	struct reflink_gc *r;
-	int add = !(flags & BTREE_TRIGGER_OVERWRITE) ? 1 : -1;
+	int add = !(flags & BTREE_TRIGGER_OVERWRITE) ? 1 : -1, refcount;
 	u64 next_idx = end;
 	s64 ret = 0;
 	struct printbuf buf = PRINTBUF;
@@ -1189,9 +1220,9 @@ static s64 __bch2_mark_reflink_p(struct btree_trans *trans,
 	if (*idx < next_idx)
 		goto not_found;
 
-	BUG_ON((s64) r->refcount + add < 0);
+	refcount = atomic_add_return(add, &r->refcount);
+	BUG_ON(refcount < 0);
 
-	r->refcount += add;
 	*idx = r->offset;
 	return 0;
 not_found:
@@ -1989,7 +2020,14 @@ out:
 	return 0;
 
 recalculate:
-	mutex_lock(&c->sectors_available_lock);
+	if (flags & BCH_DISK_RESERVATION_NOWAIT) {
+		if (!mutex_trylock(&c->sectors_available_lock)) {
+			percpu_up_read(&c->mark_lock);
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&c->sectors_available_lock);
+	}
 
 	percpu_u64_set(&c->pcpu->sectors_available, 0);
 	sectors_available = avail_factor(__bch2_fs_usage_read_short(c).free);
@@ -2026,11 +2064,15 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 {
 	struct bucket_gens *bucket_gens = NULL, *old_bucket_gens = NULL;
 	unsigned long *buckets_nouse = NULL;
+	struct copygc_candidates *copygc_candidates = NULL;
 	bool resize = ca->bucket_gens != NULL;
+	unsigned i;
 	int ret = -ENOMEM;
 
 	if (!(bucket_gens	= kvpmalloc(sizeof(struct bucket_gens) + nbuckets,
 					    GFP_KERNEL|__GFP_ZERO)) ||
+	    !(copygc_candidates	= kvpmalloc(copygc_candidates_bytes(nbuckets),
+					    GFP_KERNEL|__GFP_ZERO)) ||
 	    (c->opts.buckets_nouse &&
 	     !(buckets_nouse	= kvpmalloc(BITS_TO_LONGS(nbuckets) *
 					    sizeof(unsigned long),
@@ -2039,6 +2081,7 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 
 	bucket_gens->first_bucket = ca->mi.first_bucket;
 	bucket_gens->nbuckets	= nbuckets;
+	copygc_candidates->nbuckets = nbuckets;
 
 	bch2_copygc_stop(c);
 
@@ -2060,12 +2103,18 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 			memcpy(buckets_nouse,
 			       ca->buckets_nouse,
 			       BITS_TO_LONGS(n) * sizeof(unsigned long));
+		if (ca->copygc_candidates)
+			for (i = 0; i < COPYGC_FRAG_LEVELS; i++)
+				memcpy(copygc_candidates_level(copygc_candidates, i),
+				       copygc_candidates_level(ca->copygc_candidates, i),
+				       BITS_TO_LONGS(n) * sizeof(unsigned long));
 	}
 
 	rcu_assign_pointer(ca->bucket_gens, bucket_gens);
 	bucket_gens	= old_bucket_gens;
 
 	swap(ca->buckets_nouse, buckets_nouse);
+	swap(ca->copygc_candidates, copygc_candidates);
 
 	nbuckets = ca->mi.nbuckets;
 
@@ -2079,6 +2128,9 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 err:
 	kvpfree(buckets_nouse,
 		BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
+	if (copygc_candidates)
+		kvpfree(copygc_candidates,
+			copygc_candidates_bytes(copygc_candidates->nbuckets));
 	if (bucket_gens)
 		call_rcu(&bucket_gens->rcu, bucket_gens_free_rcu);
 
@@ -2091,6 +2143,9 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 
 	kvpfree(ca->buckets_nouse,
 		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
+	if (ca->copygc_candidates)
+		kvpfree(ca->copygc_candidates,
+			copygc_candidates_bytes(ca->copygc_candidates->nbuckets));
 	kvpfree(rcu_dereference_protected(ca->bucket_gens, 1),
 		sizeof(struct bucket_gens) + ca->mi.nbuckets);
 
@@ -44,6 +44,35 @@ static inline struct bucket *gc_bucket(struct bch_dev *ca, size_t b)
 	return buckets->b + b;
 }
 
+static inline u32 gc_bucket_stripe(struct bch_dev *ca, size_t b)
+{
+	u32 *s = gc_bucket(ca, b)->striped
+		? genradix_ptr(&ca->gc_bucket_stripes, b)
+		: NULL;
+
+	return s ? *s : 0;
+}
+
+static inline int gc_bucket_stripe_prealloc(struct bch_dev *ca, size_t b)
+{
+	return genradix_ptr_alloc(&ca->gc_bucket_stripes, b, GFP_KERNEL)
+		? 0 : -ENOMEM;
+}
+
+/*
+ * Caller holds bucket_lock(), and if @stripe is nonzero must have called
+ * gc_bucket_stripe_prealloc():
+ */
+static inline void gc_bucket_stripe_set(struct bch_dev *ca, size_t b, u32 stripe)
+{
+	u32 *s = genradix_ptr(&ca->gc_bucket_stripes, b);
+
+	BUG_ON(stripe && !s);
+	if (s)
+		*s = stripe;
+	gc_bucket(ca, b)->striped = stripe != 0;
+}
+
 static inline struct bucket_gens *bucket_gens(struct bch_dev *ca)
 {
 	return rcu_dereference_check(ca->bucket_gens,
@@ -61,6 +90,45 @@ static inline u8 *bucket_gen(struct bch_dev *ca, size_t b)
 	return gens->b + b;
 }
 
+static inline size_t copygc_candidates_bytes(size_t nbuckets)
+{
+	return sizeof(struct copygc_candidates) +
+		COPYGC_FRAG_LEVELS * BITS_TO_LONGS(nbuckets) * sizeof(unsigned long);
+}
+
+static inline unsigned long *copygc_candidates_level(struct copygc_candidates *g,
+						     unsigned level)
+{
+	return g->d + level * BITS_TO_LONGS(g->nbuckets);
+}
+
+static inline int copygc_frag_level(struct bch_dev *ca, struct bch_alloc_v4 a)
+{
+	if ((a.data_type != BCH_DATA_btree &&
+	     a.data_type != BCH_DATA_user) ||
+	    a.dirty_sectors >= ca->mi.bucket_size)
+		return -1;
+
+	return a.dirty_sectors * COPYGC_FRAG_LEVELS / ca->mi.bucket_size;
+}
+
+static inline void bch2_copygc_candidate_update(struct bch_dev *ca, u64 b,
+						struct bch_alloc_v4 old,
+						struct bch_alloc_v4 new)
+{
+	struct copygc_candidates *g = ca->copygc_candidates;
+	int old_level = copygc_frag_level(ca, old);
+	int new_level = copygc_frag_level(ca, new);
+
+	if (old_level == new_level || !g || b >= g->nbuckets)
+		return;
+
+	if (old_level >= 0)
+		clear_bit(b, copygc_candidates_level(g, old_level));
+	if (new_level >= 0)
+		set_bit(b, copygc_candidates_level(g, new_level));
+}
+
 static inline size_t PTR_BUCKET_NR(const struct bch_dev *ca,
 				   const struct bch_extent_ptr *ptr)
 {
@@ -258,6 +326,8 @@ static inline void bch2_disk_reservation_put(struct bch_fs *c,
 }
 
 #define BCH_DISK_RESERVATION_NOFAIL		(1 << 0)
+/* Return -EAGAIN instead of blocking: */
+#define BCH_DISK_RESERVATION_NOWAIT		(1 << 1)
 
 int bch2_disk_reservation_add(struct bch_fs *,
 			      struct disk_reservation *,
@@ -7,15 +7,21 @@
 
 #define BUCKET_JOURNAL_SEQ_BITS		16
 
+/*
+ * In memory bucket state, for gc: there's one of these for every bucket, so it's
+ * kept small. Sector counts are bounded by the bucket size, which is 16 bits;
+ * the stripe index is kept in bch_dev->gc_bucket_stripes, since only a small
+ * fraction of buckets are in a stripe.
+ */
 struct bucket {
 	u8			lock;
 	u8			gen_valid:1;
-	u8			data_type:7;
+	u8			striped:1;
+	u8			data_type:6;
 	u8			gen;
 	u8			stripe_redundancy;
-	u32			stripe;
-	u32			dirty_sectors;
-	u32			cached_sectors;
+	u16			dirty_sectors;
+	u16			cached_sectors;
 };
 
 struct bucket_array {
@@ -100,4 +106,15 @@ struct copygc_heap_entry {
 
 typedef HEAP(struct copygc_heap_entry) copygc_heap;
 
+/*
+ * Buckets copygc may want to evacuate, one bitmap per range of how full they
+ * are, so that copygc can find the emptiest without walking the alloc btree:
+ */
+#define COPYGC_FRAG_LEVELS	16
+
+struct copygc_candidates {
+	size_t			nbuckets;
+	unsigned long		d[];
+};
+
 #endif /* _BUCKETS_TYPES_H */
@@ -2,8 +2,18 @@
 
 #include "bcachefs.h"
 #include "buckets_waiting_for_journal.h"
+#include <linux/hash.h>
 #include <linux/random.h>
 
+/* Number of slots of the old table moved to the new table per insert: */
+#define BUCKET_TABLE_MIGRATE_NR	16
+
+static inline struct buckets_waiting_for_journal_shard *
+bucket_shard(struct buckets_waiting_for_journal *b, u64 dev_bucket)
+{
+	return b->s + hash_64(dev_bucket, BUCKETS_WAITING_FOR_JOURNAL_SHARDS_BITS);
+}
+
 static inline struct bucket_hashed *
 bucket_hash(struct buckets_waiting_for_journal_table *t,
 	    unsigned hash_seed_idx, u64 dev_bucket)
@@ -25,30 +35,89 @@ static void bucket_table_init(struct buckets_waiting_for_journal_table *t, size_
 	memset(t->d, 0, sizeof(t->d[0]) * size);
 }
 
-bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
-				      u64 flushed_seq,
-				      unsigned dev, u64 bucket)
+static struct buckets_waiting_for_journal_table *bucket_table_alloc(size_t size)
 {
-	struct buckets_waiting_for_journal_table *t;
-	u64 dev_bucket = (u64) dev << 56 | bucket;
-	bool ret = false;
-	unsigned i;
+	struct buckets_waiting_for_journal_table *t =
+		kvmalloc(sizeof(*t) + sizeof(t->d[0]) * size, GFP_KERNEL);
+
+	if (t)
+		bucket_table_init(t, size);
+	return t;
+}
+
+/*
+ * A resize or rehash never needs a table more than twice the size of the
+ * current one:
+ */
+static int bucket_shard_prealloc(struct buckets_waiting_for_journal_shard *s)
+{
+	struct buckets_waiting_for_journal_table *t =
+		rcu_dereference_protected(s->t, lockdep_is_held(&s->lock));
+	size_t size = t->size * 2;
+
+	if (s->spare && s->spare->size >= size)
+		return 0;
+
+	kvfree(s->spare);
+	s->spare = bucket_table_alloc(size);
+	return s->spare ? 0 : -ENOMEM;
+}
+
+static struct buckets_waiting_for_journal_table *
+bucket_shard_spare(struct buckets_waiting_for_journal_shard *s, size_t size)
+{
+	struct buckets_waiting_for_journal_table *n = s->spare;
 
-	mutex_lock(&b->lock);
-	t = b->t;
+	BUG_ON(n && n->size < size);
+
+	s->spare = NULL;
+	if (n)
+		bucket_table_init(n, size);
+	return n;
+}
+
+static bool bucket_table_lookup(struct buckets_waiting_for_journal_table *t,
+				u64 dev_bucket, u64 *journal_seq)
+{
+	unsigned i;
 
 	for (i = 0; i < ARRAY_SIZE(t->hash_seeds); i++) {
 		struct bucket_hashed *h = bucket_hash(t, i, dev_bucket);
 
 		if (h->dev_bucket == dev_bucket) {
-			ret = h->journal_seq > flushed_seq;
-			break;
+			*journal_seq = h->journal_seq;
+			return true;
 		}
 	}
 
-	mutex_unlock(&b->lock);
+	return false;
+}
 
-	return ret;
+bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
+				      u64 flushed_seq,
+				      unsigned dev, u64 bucket)
+{
+	u64 dev_bucket = (u64) dev << 56 | bucket;
+	struct buckets_waiting_for_journal_shard *s = bucket_shard(b, dev_bucket);
+	struct buckets_waiting_for_journal_table *t, *old;
+	u64 journal_seq;
+	unsigned seq;
+	bool found;
+
+	rcu_read_lock();
+	do {
+		seq	= read_seqcount_begin(&s->seq);
+		t	= rcu_dereference(s->t);
+		old	= rcu_dereference(s->old);
+
+		journal_seq = 0;
+		found = bucket_table_lookup(t, dev_bucket, &journal_seq);
+		if (!found && old)
+			bucket_table_lookup(old, dev_bucket, &journal_seq);
+	} while (read_seqcount_retry(&s->seq, seq));
+	rcu_read_unlock();
+
+	return journal_seq > flushed_seq;
 }
 
 static bool bucket_table_insert(struct buckets_waiting_for_journal_table *t,
@@ -86,59 +155,182 @@ static bool bucket_table_insert(struct buckets_waiting_for_journal_table *t,
 	return false;
 }
 
-int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
-					 u64 flushed_seq,
-					 unsigned dev, u64 bucket,
-					 u64 journal_seq)
+/*
+ * Entries in the new table are always newer than entries for the same bucket
+ * in the old table, so when copying from the old table we mustn't overwrite:
+ */
+static bool bucket_table_insert_old(struct buckets_waiting_for_journal_table *t,
+				    struct bucket_hashed *new,
+				    u64 flushed_seq)
 {
-	struct buckets_waiting_for_journal_table *t, *n;
-	struct bucket_hashed tmp, new = {
-		.dev_bucket	= (u64) dev << 56 | bucket,
-		.journal_seq	= journal_seq,
-	};
-	size_t i, new_size, nr_elements = 1, nr_rehashes = 0;
-	int ret = 0;
+	u64 journal_seq;
 
-	mutex_lock(&b->lock);
+	return bucket_table_lookup(t, new->dev_bucket, &journal_seq) ||
+		bucket_table_insert(t, new, flushed_seq);
+}
 
-	if (likely(bucket_table_insert(b->t, &new, flushed_seq)))
-		goto out;
+static void bucket_shard_set(struct buckets_waiting_for_journal_shard *s,
+			     struct buckets_waiting_for_journal_table *t,
+			     struct buckets_waiting_for_journal_table *old)
+{
+	struct buckets_waiting_for_journal_table *old_t =
+		rcu_dereference_protected(s->t, lockdep_is_held(&s->lock));
+	struct buckets_waiting_for_journal_table *old_old =
+		rcu_dereference_protected(s->old, lockdep_is_held(&s->lock));
+
+	rcu_assign_pointer(s->t, t);
+	rcu_assign_pointer(s->old, old);
+	s->old_pos = 0;
+
+	if (old_t != t && old_t != old)
+		kvfree_rcu(old_t, rcu);
+	if (old_old && old_old != old)
+		kvfree_rcu(old_old, rcu);
+}
 
-	t = b->t;
-	for (i = 0; i < t->size; i++)
-		nr_elements += t->d[i].journal_seq > flushed_seq;
+/*
+ * Slow path, for when the new table fills up before the old one has been
+ * emptied: rehash everything into a single table.
+ */
+static int bucket_shard_rehash(struct buckets_waiting_for_journal_shard *s,
+			       u64 flushed_seq,
+			       struct bucket_hashed *extra, unsigned nr_extra)
+{
+	struct buckets_waiting_for_journal_table *src[2] = {
+		rcu_dereference_protected(s->t,   lockdep_is_held(&s->lock)),
+		rcu_dereference_protected(s->old, lockdep_is_held(&s->lock)),
+	};
+	struct buckets_waiting_for_journal_table *t = src[0], *n;
+	struct bucket_hashed tmp;
+	size_t i, j, new_size, nr_elements = nr_extra, nr_rehashes = 0;
 
-	new_size = nr_elements < t->size / 3 ? t->size : t->size * 2;
+	for (j = 0; j < ARRAY_SIZE(src) && src[j]; j++)
+		for (i = 0; i < src[j]->size; i++)
+			nr_elements += src[j]->d[i].journal_seq > flushed_seq;
 
-	n = kvmalloc(sizeof(*n) + sizeof(n->d[0]) * new_size, GFP_KERNEL);
-	if (!n) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	new_size = nr_elements < t->size / 3 ? t->size : t->size * 2;
 
+	n = bucket_shard_spare(s, new_size);
+	if (!n)
+		return -ENOMEM;
 retry_rehash:
 	nr_rehashes++;
 	bucket_table_init(n, new_size);
 
-	tmp = new;
-	BUG_ON(!bucket_table_insert(n, &tmp, flushed_seq));
+	/* extra entries are newest, then the current table, then the old: */
+	for (i = 0; i < nr_extra; i++) {
+		tmp = extra[i];
+		if (!bucket_table_insert_old(n, &tmp, flushed_seq))
+			goto retry_rehash;
+	}
+
+	for (j = 0; j < ARRAY_SIZE(src) && src[j]; j++)
+		for (i = 0; i < src[j]->size; i++) {
+			if (src[j]->d[i].journal_seq <= flushed_seq)
+				continue;
+
+			tmp = src[j]->d[i];
+			if (!bucket_table_insert_old(n, &tmp, flushed_seq))
+				goto retry_rehash;
+		}
+
+	bucket_shard_set(s, n, NULL);
+
+	pr_debug("took %zu rehashes, table at %zu/%zu elements",
+		 nr_rehashes, nr_elements, n->size);
+	return 0;
+}
 
-	for (i = 0; i < t->size; i++) {
-		if (t->d[i].journal_seq <= flushed_seq)
+/*
+ * Move the next few entries from the old table to the current one; on failure
+ * @homeless is an entry that's no longer in either table.
+ */
+static bool bucket_shard_migrate(struct buckets_waiting_for_journal_shard *s,
+				 u64 flushed_seq,
+				 struct bucket_hashed *homeless)
+{
+	struct buckets_waiting_for_journal_table *t =
+		rcu_dereference_protected(s->t, lockdep_is_held(&s->lock));
+	struct buckets_waiting_for_journal_table *old =
+		rcu_dereference_protected(s->old, lockdep_is_held(&s->lock));
+	size_t end = min(old->size, s->old_pos + BUCKET_TABLE_MIGRATE_NR);
+
+	for (; s->old_pos < end; s->old_pos++) {
+		if (old->d[s->old_pos].journal_seq <= flushed_seq)
 			continue;
 
-		tmp = t->d[i];
-		if (!bucket_table_insert(n, &tmp, flushed_seq))
-			goto retry_rehash;
+		*homeless = old->d[s->old_pos];
+		if (!bucket_table_insert_old(t, homeless, flushed_seq))
+			return false;
 	}
 
-	b->t = n;
-	kvfree(t);
+	if (s->old_pos == old->size)
+		bucket_shard_set(s, t, NULL);
+	return true;
+}
 
-	pr_debug("took %zu rehashes, table at %zu/%zu elements",
-		 nr_rehashes, nr_elements, b->t->size);
-out:
-	mutex_unlock(&b->lock);
+static int bucket_shard_insert(struct buckets_waiting_for_journal_shard *s,
+			       u64 flushed_seq,
+			       struct bucket_hashed *new)
+{
+	struct buckets_waiting_for_journal_table *t, *n;
+	struct bucket_hashed extra[2] = { *new };
+	size_t i, new_size, nr_elements = 1;
+
+	if (rcu_access_pointer(s->old) &&
+	    !bucket_shard_migrate(s, flushed_seq, &extra[1]))
+		return bucket_shard_rehash(s, flushed_seq, extra, 2);
+
+	t = rcu_dereference_protected(s->t, lockdep_is_held(&s->lock));
+
+	if (likely(bucket_table_insert(t, new, flushed_seq)))
+		return 0;
+
+	/*
+	 * @new is now whichever entry got evicted: if we're still moving
+	 * entries out of the old table, we have to rehash everything now:
+	 */
+	if (rcu_access_pointer(s->old))
+		return bucket_shard_rehash(s, flushed_seq, new, 1);
+
+	for (i = 0; i < t->size; i++)
+		nr_elements += t->d[i].journal_seq > flushed_seq;
+
+	new_size = nr_elements < t->size / 3 ? t->size : t->size * 2;
+
+	n = bucket_shard_spare(s, new_size);
+	if (!n)
+		return -ENOMEM;
+
+	BUG_ON(!bucket_table_insert(n, new, flushed_seq));
+
+	bucket_shard_set(s, n, t);
+
+	pr_debug("resizing to %zu, table at %zu/%zu elements",
+		 new_size, nr_elements, t->size);
+	return 0;
+}
+
+int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
+					 u64 flushed_seq,
+					 unsigned dev, u64 bucket,
+					 u64 journal_seq)
+{
+	struct bucket_hashed new = {
+		.dev_bucket	= (u64) dev << 56 | bucket,
+		.journal_seq	= journal_seq,
+	};
+	struct buckets_waiting_for_journal_shard *s = bucket_shard(b, new.dev_bucket);
+	int ret;
+
+	mutex_lock(&s->lock);
+	ret = bucket_shard_prealloc(s);
+	if (!ret) {
+		write_seqcount_begin(&s->seq);
+		ret = bucket_shard_insert(s, flushed_seq, &new);
+		write_seqcount_end(&s->seq);
+	}
+	mutex_unlock(&s->lock);
 
 	return ret;
 }
@@ -146,8 +338,13 @@ out:
 void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
+	struct buckets_waiting_for_journal_shard *s;
 
-	kvfree(b->t);
+	for (s = b->s; s < b->s + ARRAY_SIZE(b->s); s++) {
+		kvfree(s->spare);
+		kvfree(rcu_dereference_protected(s->old, 1));
+		kvfree(rcu_dereference_protected(s->t, 1));
+	}
 }
 
 #define INITIAL_TABLE_SIZE	8
@@ -155,13 +352,16 @@ void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
 int bch2_fs_buckets_waiting_for_journal_init(struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
+	struct buckets_waiting_for_journal_shard *s;
 
-	mutex_init(&b->lock);
+	for (s = b->s; s < b->s + ARRAY_SIZE(b->s); s++) {
+		mutex_init(&s->lock);
+		seqcount_init(&s->seq);
 
-	b->t = kvmalloc(sizeof(*b->t) + sizeof(b->t->d[0]) * INITIAL_TABLE_SIZE, GFP_KERNEL);
-	if (!b->t)
-		return -ENOMEM;
+		s->t = bucket_table_alloc(INITIAL_TABLE_SIZE);
+		if (!s->t)
+			return -ENOMEM;
+	}
 
-	bucket_table_init(b->t, INITIAL_TABLE_SIZE);
 	return 0;
 }
@@ -2,6 +2,7 @@
 #ifndef _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 #define _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 
+#include <linux/seqlock.h>
 #include <linux/siphash.h>
 
 struct bucket_hashed {
@@ -12,12 +13,36 @@ struct bucket_hashed {
 struct buckets_waiting_for_journal_table {
 	size_t			size;
 	siphash_key_t		hash_seeds[3];
+	struct rcu_head		rcu;
 	struct bucket_hashed	d[];
 };
 
-struct buckets_waiting_for_journal {
+/*
+ * Readers don't take the lock: they look up under rcu_read_lock() and retry if
+ * @seq changed, since a cuckoo insert may move entries between slots. Writers
+ * are serialized by @lock, and @seq is only ever written with it held.
+ *
+ * Nothing may sleep inside the @seq write section, so the table a resize or
+ * rehash needs is allocated before entering it, and kept in @spare.
+ *
+ * When @t fills up we don't rehash it all at once: a new table is allocated,
+ * the old one is kept in @old and lookups check both, and each insert moves a
+ * few more entries from @old until it's empty.
+ */
+struct buckets_waiting_for_journal_shard {
 	struct mutex		lock;
-	struct buckets_waiting_for_journal_table *t;
+	seqcount_t		seq;
+	struct buckets_waiting_for_journal_table __rcu *t;
+	struct buckets_waiting_for_journal_table __rcu *old;
+	size_t			old_pos;
+	struct buckets_waiting_for_journal_table *spare;
+} ____cacheline_aligned_in_smp;
+
+#define BUCKETS_WAITING_FOR_JOURNAL_SHARDS_BITS	4
+#define BUCKETS_WAITING_FOR_JOURNAL_SHARDS	(1U << BUCKETS_WAITING_FOR_JOURNAL_SHARDS_BITS)
+
+struct buckets_waiting_for_journal {
+	struct buckets_waiting_for_journal_shard s[BUCKETS_WAITING_FOR_JOURNAL_SHARDS];
 };
 
 #endif /* _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H */
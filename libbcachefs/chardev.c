@@ -293,6 +293,8 @@ struct bch_data_ctx {
 	struct bch_fs			*c;
 	struct bch_ioctl_data		arg;
 	struct bch_move_stats		stats;
+	/* for migrate, data on the device when the job started: */
+	u64				sectors_start;
 
 	int				ret;
 
@@ -319,6 +321,24 @@ static int bch2_data_job_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* Data left on a device being evacuated, for reporting progress: */
+static u64 dev_data_sectors(struct bch_fs *c, unsigned dev)
+{
+	struct bch_dev *ca = bch2_device_lookup(c, dev, BCH_BY_INDEX);
+	struct bch_dev_usage u;
+
+	if (IS_ERR(ca))
+		return 0;
+
+	u = bch2_dev_usage_read(ca);
+	percpu_ref_put(&ca->ref);
+
+	return  u.d[BCH_DATA_btree].sectors +
+		u.d[BCH_DATA_user].sectors +
+		u.d[BCH_DATA_cached].sectors +
+		u.d[BCH_DATA_parity].sectors;
+}
+
 static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 				  size_t len, loff_t *ppos)
 {
@@ -336,6 +356,14 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 	if (len < sizeof(e))
 		return -EINVAL;
 
+	if (ctx->arg.op == BCH_DATA_OP_MIGRATE) {
+		u64 remaining = dev_data_sectors(c, ctx->arg.migrate.dev);
+
+		e.p.sectors_total	= ctx->sectors_start;
+		e.p.sectors_done	= ctx->sectors_start -
+			min(remaining, ctx->sectors_start);
+	}
+
 	return copy_to_user(buf, &e, sizeof(e)) ?: sizeof(e);
 }
 
@@ -356,7 +384,8 @@ static long bch2_ioctl_data(struct bch_fs *c,
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	if (arg.op >= BCH_DATA_OP_NR || arg.flags)
+	if (arg.op >= BCH_DATA_OP_NR ||
+	    (arg.flags & ~(BCH_DATA_MIGRATE_RESTART|BCH_DATA_SCRUB_RESTART)))
 		return -EINVAL;
 
 	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
@@ -366,6 +395,9 @@ static long bch2_ioctl_data(struct bch_fs *c,
 	ctx->c = c;
 	ctx->arg = arg;
 
+	if (arg.op == BCH_DATA_OP_MIGRATE)
+		ctx->sectors_start = dev_data_sectors(c, arg.migrate.dev);
+
 	ctx->thread = kthread_create(bch2_data_thread, ctx,
 				     "bch-data/%s", c->name);
 	if (IS_ERR(ctx->thread)) {
@@ -514,6 +546,93 @@ static long bch2_ioctl_dev_usage(struct bch_fs *c,
 	return copy_to_user(user_arg, &arg, sizeof(arg));
 }
 
+static long bch2_ioctl_fs_usage_counters(struct bch_fs *c,
+			struct bch_ioctl_fs_usage_counters __user *user_arg)
+{
+	struct bch_ioctl_fs_usage_counters arg;
+	struct bch_fs_usage_online *src;
+	struct bch_dev *ca;
+	u64 *counters, *d;
+	unsigned i, j, nr;
+	long ret = 0;
+
+	if (!test_bit(BCH_FS_STARTED, &c->flags))
+		return -EINVAL;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags)
+		return -EINVAL;
+
+	src = bch2_fs_usage_read(c);
+	if (!src)
+		return -ENOMEM;
+
+	arg.seq		= journal_cur_seq(&c->journal);
+	arg.nr_replicas	= c->replicas.nr;
+	arg.nr_devices	= c->sb.nr_devices;
+
+	nr = bch_usage_counters_nr(arg.nr_replicas, arg.nr_devices);
+	if (arg.nr < nr) {
+		percpu_up_read(&c->mark_lock);
+		kfree(src);
+
+		arg.nr = nr;
+		return copy_to_user(user_arg, &arg, sizeof(arg)) ? -EFAULT : -ERANGE;
+	}
+	arg.nr = nr;
+
+	counters = kvzalloc(sizeof(u64) * nr, GFP_KERNEL);
+	if (!counters) {
+		percpu_up_read(&c->mark_lock);
+		kfree(src);
+		return -ENOMEM;
+	}
+
+	counters[BCH_USAGE_COUNTER_capacity]		= c->capacity;
+	counters[BCH_USAGE_COUNTER_used]		= bch2_fs_sectors_used(c, src);
+	counters[BCH_USAGE_COUNTER_online_reserved]	= src->online_reserved;
+
+	for (i = 0; i < BCH_REPLICAS_MAX; i++)
+		counters[BCH_USAGE_COUNTER_persistent_reserved + i] =
+			src->u.persistent_reserved[i];
+
+	for (i = 0; i < arg.nr_replicas; i++)
+		counters[BCH_USAGE_COUNTER_replicas + i] = src->u.replicas[i];
+
+	percpu_up_read(&c->mark_lock);
+	kfree(src);
+
+	for_each_member_device(ca, c, i) {
+		struct bch_dev_usage u;
+
+		if (i >= arg.nr_devices) {
+			percpu_ref_put(&ca->ref);
+			break;
+		}
+
+		u = bch2_dev_usage_read(ca);
+		d = counters + bch_usage_counters_nr(arg.nr_replicas, i);
+
+		d[BCH_DEV_USAGE_COUNTER_nr_buckets]	= ca->mi.nbuckets - ca->mi.first_bucket;
+		d[BCH_DEV_USAGE_COUNTER_buckets_ec]	= u.buckets_ec;
+
+		for (j = 0; j < BCH_DATA_NR; j++) {
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 0] = u.d[j].buckets;
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 1] = u.d[j].sectors;
+			d[BCH_DEV_USAGE_COUNTER_d + j * 3 + 2] = u.d[j].fragmented;
+		}
+	}
+
+	if (copy_to_user(user_arg, &arg, sizeof(arg)) ||
+	    copy_to_user(user_arg->counters, counters, sizeof(u64) * nr))
+		ret = -EFAULT;
+
+	kvfree(counters);
+	return ret;
+}
+
 static long bch2_ioctl_read_super(struct bch_fs *c,
 				  struct bch_ioctl_read_super arg)
 {
@@ -643,6 +762,8 @@ long bch2_fs_ioctl(struct bch_fs *c, unsigned cmd, void __user *arg)
 		return bch2_ioctl_fs_usage(c, arg);
 	case BCH_IOCTL_DEV_USAGE:
 		return bch2_ioctl_dev_usage(c, arg);
+	case BCH_IOCTL_FS_USAGE_COUNTERS:
+		return bch2_ioctl_fs_usage_counters(c, arg);
 #if 0
 	case BCH_IOCTL_START:
 		BCH_IOCTL(start, struct bch_ioctl_start);
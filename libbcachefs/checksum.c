@@ -13,6 +13,7 @@
 #include <linux/scatterlist.h>
 #include <crypto/algapi.h>
 #include <crypto/chacha.h>
+#include <crypto/ghash.h>
 #include <crypto/hash.h>
 #include <crypto/poly1305.h>
 #include <crypto/skcipher.h>
@@ -29,6 +30,7 @@ struct bch2_checksum_state {
 	union {
 		u64 seed;
 		struct xxh64_state h64state;
+		struct xxh3_state h3state;
 	};
 	unsigned int type;
 };
@@ -50,27 +52,50 @@ static void bch2_checksum_init(struct bch2_checksum_state *state)
 	case BCH_CSUM_xxhash:
 		xxh64_reset(&state->h64state, 0);
 		break;
+	case BCH_CSUM_xxh3:
+	case BCH_CSUM_xxh3_128:
+		xxh3_reset(&state->h3state, 0);
+		break;
 	default:
 		BUG();
 	}
 }
 
-static u64 bch2_checksum_final(const struct bch2_checksum_state *state)
+static struct bch_csum bch2_checksum_final(const struct bch2_checksum_state *state)
 {
+	u64 ret;
+
 	switch (state->type) {
 	case BCH_CSUM_none:
 	case BCH_CSUM_crc32c:
 	case BCH_CSUM_crc64:
-		return state->seed;
+		ret = state->seed;
+		break;
 	case BCH_CSUM_crc32c_nonzero:
-		return state->seed ^ U32_MAX;
+		ret = state->seed ^ U32_MAX;
+		break;
 	case BCH_CSUM_crc64_nonzero:
-		return state->seed ^ U64_MAX;
+		ret = state->seed ^ U64_MAX;
+		break;
 	case BCH_CSUM_xxhash:
-		return xxh64_digest(&state->h64state);
+		ret = xxh64_digest(&state->h64state);
+		break;
+	case BCH_CSUM_xxh3:
+		ret = xxh3_64_digest(&state->h3state);
+		break;
+	case BCH_CSUM_xxh3_128: {
+		struct xxh128_hash h = xxh3_128_digest(&state->h3state);
+
+		return (struct bch_csum) {
+			.lo = cpu_to_le64(h.low64),
+			.hi = cpu_to_le64(h.high64),
+		};
+	}
 	default:
 		BUG();
 	}
+
+	return (struct bch_csum) { .lo = cpu_to_le64(ret) };
 }
 
 static void bch2_checksum_update(struct bch2_checksum_state *state, const void *data, size_t len)
@@ -89,6 +114,10 @@ static void bch2_checksum_update(struct bch2_checksum_state *state, const void *
 	case BCH_CSUM_xxhash:
 		xxh64_update(&state->h64state, data, len);
 		break;
+	case BCH_CSUM_xxh3:
+	case BCH_CSUM_xxh3_128:
+		xxh3_update(&state->h3state, data, len);
+		break;
 	default:
 		BUG();
 	}
@@ -177,6 +206,30 @@ err:
 	return ret;
 }
 
+/*
+ * ctr(aes) increments its IV as a big endian 128 bit integer, while chacha20
+ * and nonce_add() count in the first, little endian word of the nonce: byte
+ * swapping the nonce gives ctr(aes) the same counter.
+ */
+static inline struct nonce aes_ctr_iv(struct nonce nonce)
+{
+	struct nonce iv;
+	u8 *src = (u8 *) nonce.d, *dst = (u8 *) iv.d;
+	unsigned i;
+
+	for (i = 0; i < sizeof(iv); i++)
+		dst[i] = src[sizeof(iv) - 1 - i];
+	return iv;
+}
+
+static int bch2_encrypt_sg(struct bch_fs *c, unsigned type, struct nonce nonce,
+			   struct scatterlist *sg, size_t len)
+{
+	return bch2_csum_type_is_aes(type)
+		? do_encrypt_sg(c->aes256_ctr, aes_ctr_iv(nonce), sg, len)
+		: do_encrypt_sg(c->chacha20, nonce, sg, len);
+}
+
 static int gen_poly_key(struct bch_fs *c, struct shash_desc *desc,
 			struct nonce nonce)
 {
@@ -196,6 +249,51 @@ static int gen_poly_key(struct bch_fs *c, struct shash_desc *desc,
 	return 0;
 }
 
+/*
+ * The GCM tag: GHASH (keyed with E(0), see bch2_set_cipher_key()) of the
+ * ciphertext and its length, xored with the keystream block at the MAC nonce -
+ * the same nonce poly1305 gets its one time key from.
+ */
+static int gen_ghash_mask(struct bch_fs *c, struct shash_desc *desc,
+			  struct nonce nonce, u8 *mask)
+{
+	int ret;
+
+	nonce.d[3] ^= BCH_NONCE_POLY;
+
+	memset(mask, 0, AES_BLOCK_SIZE);
+	ret = do_encrypt(c->aes256_ctr, aes_ctr_iv(nonce), mask, AES_BLOCK_SIZE);
+	if (ret)
+		return ret;
+
+	desc->tfm = c->ghash;
+	crypto_shash_init(desc);
+	return 0;
+}
+
+static struct bch_csum ghash_mac_final(struct shash_desc *desc, unsigned type,
+				       const u8 *mask, size_t len)
+{
+	static const u8 zeroes[GHASH_BLOCK_SIZE];
+	__be64 lens[2] = { 0, cpu_to_be64((u64) len << 3) };
+	u8 digest[GHASH_DIGEST_SIZE];
+	struct bch_csum ret = { 0 };
+	unsigned i;
+
+	/* ghash only pads the final block, not the one before the lengths: */
+	if (len % GHASH_BLOCK_SIZE)
+		crypto_shash_update(desc, zeroes,
+				    GHASH_BLOCK_SIZE - len % GHASH_BLOCK_SIZE);
+	crypto_shash_update(desc, (void *) lens, sizeof(lens));
+	crypto_shash_final(desc, digest);
+
+	for (i = 0; i < sizeof(digest); i++)
+		digest[i] ^= mask[i];
+
+	memcpy(&ret, digest, bch_crc_bytes[type]);
+	return ret;
+}
+
 struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 			      struct nonce nonce, const void *data, size_t len)
 {
@@ -205,6 +303,8 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 	case BCH_CSUM_crc64_nonzero:
 	case BCH_CSUM_crc32c:
 	case BCH_CSUM_xxhash:
+	case BCH_CSUM_xxh3:
+	case BCH_CSUM_xxh3_128:
 	case BCH_CSUM_crc64: {
 		struct bch2_checksum_state state;
 
@@ -213,7 +313,7 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 		bch2_checksum_init(&state);
 		bch2_checksum_update(&state, data, len);
 
-		return (struct bch_csum) { .lo = cpu_to_le64(bch2_checksum_final(&state)) };
+		return bch2_checksum_final(&state);
 	}
 
 	case BCH_CSUM_chacha20_poly1305_80:
@@ -230,18 +330,70 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 		memcpy(&ret, digest, bch_crc_bytes[type]);
 		return ret;
 	}
+
+	case BCH_CSUM_aes256_gcm_80:
+	case BCH_CSUM_aes256_gcm_128: {
+		SHASH_DESC_ON_STACK(desc, c->ghash);
+		u8 mask[AES_BLOCK_SIZE];
+
+		gen_ghash_mask(c, desc, nonce, mask);
+
+		crypto_shash_update(desc, data, len);
+		return ghash_mac_final(desc, type, mask, len);
+	}
 	default:
 		BUG();
 	}
 }
 
+/*
+ * Checksum @nr independent buffers: for crc32c these are done three at a time,
+ * with their crc chains interleaved, which matters for buffers too short for
+ * crc32c() to split up internally (a bset, a stripe's checksum granularity).
+ *
+ * Other checksum types are done one buffer at a time: xxhash already runs four
+ * independent lanes per buffer.
+ */
+void bch2_checksum_bufs(struct bch_fs *c, unsigned type,
+			struct bch_csum_buf *bufs, unsigned nr)
+{
+	unsigned i = 0, j;
+
+	if (type == BCH_CSUM_crc32c ||
+	    type == BCH_CSUM_crc32c_nonzero) {
+		u32 seed = type == BCH_CSUM_crc32c_nonzero ? U32_MAX : 0;
+
+		for (; i + 3 <= nr; i += 3) {
+			struct bch_csum_buf *b = bufs + i;
+			size_t len = min(b[0].len, min(b[1].len, b[2].len));
+			const void *data[3] = { b[0].data, b[1].data, b[2].data };
+			u32 crc[3] = { seed, seed, seed };
+
+			crc32c_x3(crc, data, len);
+
+			for (j = 0; j < 3; j++) {
+				crc[j] = crc32c(crc[j], b[j].data + len, b[j].len - len);
+				b[j].csum = (struct bch_csum) {
+					.lo = cpu_to_le64(crc[j] ^ seed)
+				};
+			}
+		}
+	}
+
+	for (; i < nr; i++)
+		bufs[i].csum = bch2_checksum(c, type, bufs[i].nonce,
+					     bufs[i].data, bufs[i].len);
+}
+
 int bch2_encrypt(struct bch_fs *c, unsigned type,
 		  struct nonce nonce, void *data, size_t len)
 {
 	if (!bch2_csum_type_is_encryption(type))
 		return 0;
 
-	return do_encrypt(c->chacha20, nonce, data, len);
+	return bch2_csum_type_is_aes(type)
+		? do_encrypt(c->aes256_ctr, aes_ctr_iv(nonce), data, len)
+		: do_encrypt(c->chacha20, nonce, data, len);
 }
 
 static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
@@ -257,6 +409,8 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	case BCH_CSUM_crc64_nonzero:
 	case BCH_CSUM_crc32c:
 	case BCH_CSUM_xxhash:
+	case BCH_CSUM_xxh3:
+	case BCH_CSUM_xxh3_128:
 	case BCH_CSUM_crc64: {
 		struct bch2_checksum_state state;
 
@@ -274,7 +428,7 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 			bch2_checksum_update(&state, page_address(bv.bv_page) + bv.bv_offset,
 				bv.bv_len);
 #endif
-		return (struct bch_csum) { .lo = cpu_to_le64(bch2_checksum_final(&state)) };
+		return bch2_checksum_final(&state);
 	}
 
 	case BCH_CSUM_chacha20_poly1305_80:
@@ -303,6 +457,30 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 		memcpy(&ret, digest, bch_crc_bytes[type]);
 		return ret;
 	}
+
+	case BCH_CSUM_aes256_gcm_80:
+	case BCH_CSUM_aes256_gcm_128: {
+		SHASH_DESC_ON_STACK(desc, c->ghash);
+		u8 mask[AES_BLOCK_SIZE];
+		size_t len = iter->bi_size;
+
+		gen_ghash_mask(c, desc, nonce, mask);
+
+#ifdef CONFIG_HIGHMEM
+		__bio_for_each_segment(bv, bio, *iter, *iter) {
+			void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
+
+			crypto_shash_update(desc, p, bv.bv_len);
+			kunmap_atomic(p);
+		}
+#else
+		__bio_for_each_bvec(bv, bio, *iter, *iter)
+			crypto_shash_update(desc,
+				page_address(bv.bv_page) + bv.bv_offset,
+				bv.bv_len);
+#endif
+		return ghash_mac_final(desc, type, mask, len);
+	}
 	default:
 		BUG();
 	}
@@ -334,11 +512,11 @@ int bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 		if (sg == sgl + ARRAY_SIZE(sgl)) {
 			sg_mark_end(sg - 1);
 
-			ret = do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
+			ret = bch2_encrypt_sg(c, type, nonce, sgl, bytes);
 			if (ret)
 				return ret;
 
-			nonce = nonce_add(nonce, bytes);
+			nonce = nonce_add(type, nonce, bytes);
 			bytes = 0;
 
 			sg_init_table(sgl, ARRAY_SIZE(sgl));
@@ -350,7 +528,7 @@ int bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	}
 
 	sg_mark_end(sg - 1);
-	return do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
+	return bch2_encrypt_sg(c, type, nonce, sgl, bytes);
 }
 
 struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
@@ -364,6 +542,12 @@ struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
 
 	BUG_ON(!bch2_checksum_mergeable(type));
 
+	if (type == BCH_CSUM_crc32c) {
+		a.lo = cpu_to_le64(crc32c_combine(le64_to_cpu(a.lo),
+						  le64_to_cpu(b.lo), b_len));
+		return a;
+	}
+
 	while (b_len) {
 		unsigned b = min_t(unsigned, b_len, PAGE_SIZE);
 
@@ -371,7 +555,7 @@ struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
 				page_address(ZERO_PAGE(0)), b);
 		b_len -= b;
 	}
-	a.lo = bch2_checksum_final(&state);
+	a.lo = bch2_checksum_final(&state).lo;
 	a.lo ^= b.lo;
 	a.hi ^= b.hi;
 	return a;
@@ -415,7 +599,7 @@ int bch2_rechecksum_bio(struct bch_fs *c, struct bio *bio,
 						      nonce, bio, &iter);
 		else
 			bio_advance_iter(bio, &iter, i->len << 9);
-		nonce = nonce_add(nonce, i->len << 9);
+		nonce = nonce_add(new_csum_type, nonce, i->len << 9);
 	}
 
 	if (mergeable)
@@ -551,6 +735,16 @@ err:
 	return ret;
 }
 
+static bool bch2_sb_has_aes(struct bch_sb *sb)
+{
+	return le64_to_cpu(sb->features[0]) & (1ULL << BCH_FEATURE_aes256_gcm);
+}
+
+/*
+ * chacha20/poly1305 is always allocated, and AES-256/GHASH too if the
+ * filesystem uses it: going by the feature bit, not the encryption type, since
+ * existing data stays encrypted after encryption is disabled.
+ */
 static int bch2_alloc_ciphers(struct bch_fs *c)
 {
 	int ret;
@@ -573,9 +767,53 @@ static int bch2_alloc_ciphers(struct bch_fs *c)
 		return ret;
 	}
 
+	if (!bch2_sb_has_aes(c->disk_sb.sb))
+		return 0;
+
+	if (!c->aes256_ctr)
+		c->aes256_ctr = crypto_alloc_sync_skcipher("ctr(aes)", 0, 0);
+	ret = PTR_ERR_OR_ZERO(c->aes256_ctr);
+
+	if (ret) {
+		bch_err(c, "error requesting ctr(aes) module: %s", bch2_err_str(ret));
+		return ret;
+	}
+
+	if (!c->ghash)
+		c->ghash = crypto_alloc_shash("ghash", 0, 0);
+	ret = PTR_ERR_OR_ZERO(c->ghash);
+
+	if (ret) {
+		bch_err(c, "error requesting ghash module: %s", bch2_err_str(ret));
+		return ret;
+	}
+
 	return 0;
 }
 
+static int bch2_set_cipher_keys(struct bch_fs *c, struct bch_key *key)
+{
+	u8 h[GHASH_BLOCK_SIZE];
+	int ret;
+
+	ret = crypto_skcipher_setkey(&c->chacha20->base,
+			(void *) key, sizeof(*key));
+	if (ret || !c->aes256_ctr)
+		return ret;
+
+	ret = crypto_skcipher_setkey(&c->aes256_ctr->base,
+			(void *) key, sizeof(*key));
+	if (ret)
+		return ret;
+
+	/* The GHASH key is E(0), as in GCM: */
+	memset(h, 0, sizeof(h));
+	ret =   do_encrypt(c->aes256_ctr, null_nonce(), h, sizeof(h)) ?:
+		crypto_shash_setkey(c->ghash, h, sizeof(h));
+	memzero_explicit(h, sizeof(h));
+	return ret;
+}
+
 int bch2_disable_encryption(struct bch_fs *c)
 {
 	struct bch_sb_field_crypt *crypt;
@@ -608,7 +846,7 @@ out:
 	return ret;
 }
 
-int bch2_enable_encryption(struct bch_fs *c, bool keyed)
+int bch2_enable_encryption(struct bch_fs *c, unsigned type, bool keyed)
 {
 	struct bch_encrypted_key key;
 	struct bch_key user_key;
@@ -621,6 +859,13 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 	if (bch2_sb_get_crypt(c->disk_sb.sb))
 		goto err;
 
+	if (!type || type >= BCH_ENCRYPTION_NR)
+		goto err;
+
+	if (type == BCH_ENCRYPTION_aes256_gcm)
+		c->disk_sb.sb->features[0] |=
+			cpu_to_le64(1ULL << BCH_FEATURE_aes256_gcm);
+
 	ret = bch2_alloc_ciphers(c);
 	if (ret)
 		goto err;
@@ -641,8 +886,7 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 			goto err;
 	}
 
-	ret = crypto_skcipher_setkey(&c->chacha20->base,
-			(void *) &key.key, sizeof(key.key));
+	ret = bch2_set_cipher_keys(c, &key.key);
 	if (ret)
 		goto err;
 
@@ -655,7 +899,7 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 	crypt->key = key;
 
 	/* write superblock */
-	SET_BCH_SB_ENCRYPTION_TYPE(c->disk_sb.sb, 1);
+	SET_BCH_SB_ENCRYPTION_TYPE(c->disk_sb.sb, type);
 	bch2_write_super(c);
 err:
 	mutex_unlock(&c->sb_lock);
@@ -666,6 +910,10 @@ err:
 
 void bch2_fs_encryption_exit(struct bch_fs *c)
 {
+	if (!IS_ERR_OR_NULL(c->ghash))
+		crypto_free_shash(c->ghash);
+	if (!IS_ERR_OR_NULL(c->aes256_ctr))
+		crypto_free_sync_skcipher(c->aes256_ctr);
 	if (!IS_ERR_OR_NULL(c->poly1305))
 		crypto_free_shash(c->poly1305);
 	if (!IS_ERR_OR_NULL(c->chacha20))
@@ -701,8 +949,7 @@ int bch2_fs_encryption_init(struct bch_fs *c)
 	if (ret)
 		goto out;
 
-	ret = crypto_skcipher_setkey(&c->chacha20->base,
-			(void *) &key.key, sizeof(key.key));
+	ret = bch2_set_cipher_keys(c, &key);
 	if (ret)
 		goto out;
 out:
@@ -7,6 +7,7 @@
 #include "super-io.h"
 
 #include <linux/crc64.h>
+#include <crypto/aes.h>
 #include <crypto/chacha.h>
 
 static inline bool bch2_checksum_mergeable(unsigned type)
@@ -34,6 +35,20 @@ struct bch_csum bch2_checksum_merge(unsigned, struct bch_csum,
 struct bch_csum bch2_checksum(struct bch_fs *, unsigned, struct nonce,
 			     const void *, size_t);
 
+/*
+ * For bch2_checksum_bufs(): one of several independent buffers to checksum,
+ * with @csum filled in on return
+ */
+struct bch_csum_buf {
+	struct nonce		nonce;
+	const void		*data;
+	size_t			len;
+	struct bch_csum		csum;
+};
+
+void bch2_checksum_bufs(struct bch_fs *, unsigned,
+			struct bch_csum_buf *, unsigned);
+
 /*
  * This is used for various on disk data structures - bch_sb, prio_set, bset,
  * jset: The checksum is _always_ the first field of these structs
@@ -68,7 +83,7 @@ int bch2_decrypt_sb_key(struct bch_fs *, struct bch_sb_field_crypt *,
 			struct bch_key *);
 
 int bch2_disable_encryption(struct bch_fs *);
-int bch2_enable_encryption(struct bch_fs *, bool);
+int bch2_enable_encryption(struct bch_fs *, unsigned, bool);
 
 void bch2_fs_encryption_exit(struct bch_fs *);
 int bch2_fs_encryption_init(struct bch_fs *);
@@ -85,6 +100,10 @@ static inline enum bch_csum_type bch2_csum_opt_to_type(enum bch_csum_opts type,
 	     return data ? BCH_CSUM_crc64 : BCH_CSUM_crc64_nonzero;
 	case BCH_CSUM_OPT_xxhash:
 	     return BCH_CSUM_xxhash;
+	case BCH_CSUM_OPT_xxh3:
+	     return BCH_CSUM_xxh3;
+	case BCH_CSUM_OPT_xxh3_128:
+	     return BCH_CSUM_xxh3_128;
 	default:
 	     BUG();
 	}
@@ -93,20 +112,30 @@ static inline enum bch_csum_type bch2_csum_opt_to_type(enum bch_csum_opts type,
 static inline enum bch_csum_type bch2_data_checksum_type(struct bch_fs *c,
 							 unsigned opt)
 {
-	if (c->sb.encryption_type)
+	switch (c->sb.encryption_type) {
+	case BCH_ENCRYPTION_none:
+		return bch2_csum_opt_to_type(opt, true);
+	case BCH_ENCRYPTION_aes256_gcm:
+		return c->opts.wide_macs
+			? BCH_CSUM_aes256_gcm_128
+			: BCH_CSUM_aes256_gcm_80;
+	default:
 		return c->opts.wide_macs
 			? BCH_CSUM_chacha20_poly1305_128
 			: BCH_CSUM_chacha20_poly1305_80;
-
-	return bch2_csum_opt_to_type(opt, true);
+	}
 }
 
 static inline enum bch_csum_type bch2_meta_checksum_type(struct bch_fs *c)
 {
-	if (c->sb.encryption_type)
+	switch (c->sb.encryption_type) {
+	case BCH_ENCRYPTION_none:
+		return bch2_csum_opt_to_type(c->opts.metadata_checksum, false);
+	case BCH_ENCRYPTION_aes256_gcm:
+		return BCH_CSUM_aes256_gcm_128;
+	default:
 		return BCH_CSUM_chacha20_poly1305_128;
-
-	return bch2_csum_opt_to_type(c->opts.metadata_checksum, false);
+	}
 }
 
 static const unsigned bch2_compression_opt_to_type[] = {
@@ -121,7 +150,8 @@ static inline bool bch2_checksum_type_valid(const struct bch_fs *c,
 	if (type >= BCH_CSUM_NR)
 		return false;
 
-	if (bch2_csum_type_is_encryption(type) && !c->chacha20)
+	if (bch2_csum_type_is_encryption(type) &&
+	    !(bch2_csum_type_is_aes(type) ? c->aes256_ctr : c->chacha20))
 		return false;
 
 	return true;
@@ -137,12 +167,23 @@ static inline bool bch2_crc_cmp(struct bch_csum l, struct bch_csum r)
 	return ((l.lo ^ r.lo) | (l.hi ^ r.hi)) != 0;
 }
 
+/* The unit of the counter in the low word of the nonce: */
+static inline unsigned bch2_crypt_block_size(unsigned type)
+{
+	return bch2_csum_type_is_aes(type)
+		? AES_BLOCK_SIZE
+		: CHACHA_BLOCK_SIZE;
+}
+
 /* for skipping ahead and encrypting/decrypting at an offset: */
-static inline struct nonce nonce_add(struct nonce nonce, unsigned offset)
+static inline struct nonce nonce_add(unsigned type, struct nonce nonce,
+				     unsigned offset)
 {
-	EBUG_ON(offset & (CHACHA_BLOCK_SIZE - 1));
+	unsigned block_size = bch2_crypt_block_size(type);
+
+	EBUG_ON(offset & (block_size - 1));
 
-	le32_add_cpu(&nonce.d[0], offset / CHACHA_BLOCK_SIZE);
+	le32_add_cpu(&nonce.d[0], offset / block_size);
 	return nonce;
 }
 
@@ -169,7 +210,7 @@ static inline struct nonce extent_nonce(struct bversion version,
 				  (compression_type << 24))^BCH_NONCE_EXTENT,
 	}};
 
-	return nonce_add(nonce, crc.nonce << 9);
+	return nonce_add(crc.csum_type, nonce, crc.nonce << 9);
 }
 
 static inline bool bch2_key_is_encrypted(struct bch_encrypted_key *key)
@@ -13,9 +13,24 @@ static inline long io_timer_cmp(io_timer_heap *h,
 	return l->expire - r->expire;
 }
 
+/*
+ * Called with timer_lock held whenever the heap changes; if the heap is empty
+ * no timer can expire until the clock wraps, and if that ever happens we just
+ * take the slow path once and recalculate:
+ */
+static void io_timer_next_expire_update(struct io_clock *clock)
+{
+	unsigned long next = clock->timers.used
+		? clock->timers.data[0]->expire
+		: (unsigned long) atomic64_read(&clock->now) + LONG_MAX;
+
+	atomic_long_set(&clock->next_expire, next);
+}
+
 void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
 {
 	size_t i;
+	bool expired;
 
 	spin_lock(&clock->timer_lock);
 
@@ -31,8 +46,20 @@ void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
 			goto out;
 
 	BUG_ON(!heap_add(&clock->timers, timer, io_timer_cmp, NULL));
+	io_timer_next_expire_update(clock);
 out:
+	/*
+	 * Pairs with the barrier in atomic64_add_return() in
+	 * __bch2_increment_clock(): either it sees the new next_expire, or we
+	 * see its increment and run the timer ourselves:
+	 */
+	smp_mb();
+	expired = time_after_eq((unsigned long) atomic64_read(&clock->now),
+				(unsigned long) atomic_long_read(&clock->next_expire));
 	spin_unlock(&clock->timer_lock);
+
+	if (expired)
+		__bch2_increment_clock(clock, 0);
 }
 
 void bch2_io_timer_del(struct io_clock *clock, struct io_timer *timer)
@@ -44,6 +71,7 @@ void bch2_io_timer_del(struct io_clock *clock, struct io_timer *timer)
 	for (i = 0; i < clock->timers.used; i++)
 		if (clock->timers.data[i] == timer) {
 			heap_del(&clock->timers, i, io_timer_cmp, NULL);
+			io_timer_next_expire_update(clock);
 			break;
 		}
 
@@ -138,6 +166,8 @@ static struct io_timer *get_expired_timer(struct io_clock *clock,
 	    time_after_eq(now, clock->timers.data[0]->expire))
 		heap_pop(&clock->timers, ret, io_timer_cmp, NULL);
 
+	io_timer_next_expire_update(clock);
+
 	spin_unlock(&clock->timer_lock);
 
 	return ret;
@@ -148,6 +178,9 @@ void __bch2_increment_clock(struct io_clock *clock, unsigned sectors)
 	struct io_timer *timer;
 	unsigned long now = atomic64_add_return(sectors, &clock->now);
 
+	if (time_before(now, (unsigned long) atomic_long_read(&clock->next_expire)))
+		return;
+
 	while ((timer = get_expired_timer(clock, now)))
 		timer->fn(timer);
 }
@@ -176,6 +209,7 @@ void bch2_io_clock_exit(struct io_clock *clock)
 int bch2_io_clock_init(struct io_clock *clock)
 {
 	atomic64_set(&clock->now, 0);
+	atomic_long_set(&clock->next_expire, LONG_MAX);
 	spin_lock_init(&clock->timer_lock);
 
 	clock->max_slop = IO_CLOCK_PCPU_SECTORS * num_possible_cpus();
@@ -30,6 +30,12 @@ struct io_clock {
 	u16 __percpu		*pcpu_buf;
 	unsigned		max_slop;
 
+	/*
+	 * Expiry of the first timer in the heap, so that clock increments
+	 * only take timer_lock when something has expired:
+	 */
+	atomic_long_t		next_expire;
+
 	spinlock_t		timer_lock;
 	io_timer_heap		timers;
 };
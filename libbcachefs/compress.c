@@ -5,7 +5,9 @@
 #include "extents.h"
 #include "io.h"
 #include "super-io.h"
+#include "vstructs.h"
 
+#include <asm/unaligned.h>
 #include <linux/lz4.h>
 #include <linux/zlib.h>
 #include <linux/zstd.h>
@@ -16,27 +18,92 @@ struct bbuf {
 	enum {
 		BB_NONE,
 		BB_VMAP,
-		BB_KMALLOC,
-		BB_MEMPOOL,
+		BB_BOUNCE,
 	}		type;
 	int		rw;
 };
 
-static struct bbuf __bounce_alloc(struct bch_fs *c, unsigned size, int rw)
+/*
+ * Bounce buffers and workspaces are cached percpu, so that concurrent reads
+ * and writes don't serialize on the mempools: the mempools are only the
+ * reserve for when we can't allocate a new buffer.
+ *
+ * Compression can sleep, so buffers are taken from and returned to the percpu
+ * slot with xchg()/cmpxchg() instead of disabling preemption; if we migrated
+ * and the slot was refilled in the meantime, the buffer goes back to the
+ * mempool, which frees it if the reserve is already full.
+ */
+static void *compress_buf_get(struct bch_fs *c, void * __percpu *slot,
+			      mempool_t *pool, enum bch_persistent_counters wait)
 {
-	void *b;
+	void *p = xchg(this_cpu_ptr(slot), NULL);
 
-	BUG_ON(size > c->opts.encoded_extent_max);
+	if (p)
+		return p;
+
+	p = pool->alloc(GFP_NOIO|__GFP_NOWARN, pool->pool_data);
+	if (p)
+		return p;
+
+	this_cpu_inc(c->counters[wait]);
+	return mempool_alloc(pool, GFP_NOIO);
+}
+
+static void compress_buf_put(void * __percpu *slot, mempool_t *pool, void *p)
+{
+	if (cmpxchg(this_cpu_ptr(slot), NULL, p))
+		mempool_free(p, pool);
+}
+
+static void compress_buf_free(void * __percpu *slot, mempool_t *pool)
+{
+	unsigned cpu;
+	void *p;
 
-	b = kmalloc(size, GFP_NOIO|__GFP_NOWARN);
-	if (b)
-		return (struct bbuf) { .b = b, .type = BB_KMALLOC, .rw = rw };
+	for_each_possible_cpu(cpu) {
+		p = xchg(per_cpu_ptr(slot, cpu), NULL);
+		if (p)
+			pool->free(p, pool->pool_data);
+	}
+}
+
+static void *workspace_get(struct bch_fs *c, unsigned type)
+{
+	return compress_buf_get(c, &c->pcpu->compress_workspace[type],
+				&c->compress_workspace[type],
+				BCH_COUNTER_compression_workspace_wait);
+}
 
-	b = mempool_alloc(&c->compression_bounce[rw], GFP_NOIO);
-	if (b)
-		return (struct bbuf) { .b = b, .type = BB_MEMPOOL, .rw = rw };
+static void workspace_put(struct bch_fs *c, unsigned type, void *p)
+{
+	compress_buf_put(&c->pcpu->compress_workspace[type],
+			 &c->compress_workspace[type], p);
+}
 
-	BUG();
+static void *decompress_workspace_get(struct bch_fs *c)
+{
+	return compress_buf_get(c, &c->pcpu->decompress_workspace,
+				&c->decompress_workspace,
+				BCH_COUNTER_compression_workspace_wait);
+}
+
+static void decompress_workspace_put(struct bch_fs *c, void *p)
+{
+	compress_buf_put(&c->pcpu->decompress_workspace,
+			 &c->decompress_workspace, p);
+}
+
+static struct bbuf __bounce_alloc(struct bch_fs *c, unsigned size, int rw)
+{
+	BUG_ON(size > c->opts.encoded_extent_max);
+
+	return (struct bbuf) {
+		.b	= compress_buf_get(c, &c->pcpu->compression_bounce[rw],
+					   &c->compression_bounce[rw],
+					   BCH_COUNTER_compression_bounce_wait),
+		.type	= BB_BOUNCE,
+		.rw	= rw,
+	};
 }
 
 static bool bio_phys_contig(struct bio *bio, struct bvec_iter start)
@@ -134,11 +201,9 @@ static void bio_unmap_or_unbounce(struct bch_fs *c, struct bbuf buf)
 	case BB_VMAP:
 		vunmap((void *) ((unsigned long) buf.b & PAGE_MASK));
 		break;
-	case BB_KMALLOC:
-		kfree(buf.b);
-		break;
-	case BB_MEMPOOL:
-		mempool_free(buf.b, &c->compression_bounce[buf.rw]);
+	case BB_BOUNCE:
+		compress_buf_put(&c->pcpu->compression_bounce[buf.rw],
+				 &c->compression_bounce[buf.rw], buf.b);
 		break;
 	}
 }
@@ -150,75 +215,97 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
-static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+static int __uncompress_buf(struct bch_fs *c, unsigned compression_type,
+			    void *dst_data, size_t dst_len,
+			    void *src_data, size_t src_len)
 {
-	struct bbuf src_data = { NULL };
-	size_t src_len = src->bi_iter.bi_size;
-	size_t dst_len = crc.uncompressed_size << 9;
 	void *workspace;
 	int ret;
 
-	src_data = bio_map_or_bounce(c, src, READ);
-
-	switch (crc.compression_type) {
+	switch (compression_type) {
 	case BCH_COMPRESSION_TYPE_lz4_old:
 	case BCH_COMPRESSION_TYPE_lz4:
-		ret = LZ4_decompress_safe_partial(src_data.b, dst_data,
+		ret = LZ4_decompress_safe_partial(src_data, dst_data,
 						  src_len, dst_len, dst_len);
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	case BCH_COMPRESSION_TYPE_gzip: {
 		z_stream strm = {
-			.next_in	= src_data.b,
+			.next_in	= src_data,
 			.avail_in	= src_len,
 			.next_out	= dst_data,
 			.avail_out	= dst_len,
 		};
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = decompress_workspace_get(c);
 
 		zlib_set_workspace(&strm, workspace);
 		zlib_inflateInit2(&strm, -MAX_WBITS);
 		ret = zlib_inflate(&strm, Z_FINISH);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		decompress_workspace_put(c, workspace);
 
 		if (ret != Z_STREAM_END)
-			goto err;
+			return -EIO;
 		break;
 	}
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_DCtx *ctx;
-		size_t real_src_len = le32_to_cpup(src_data.b);
+		ZSTD_DDict *ddict;
+		zstd_frame_header header;
+		size_t real_src_len;
 
+		if (src_len < 4)
+			return -EIO;
+
+		real_src_len = le32_to_cpup(src_data);
 		if (real_src_len > src_len - 4)
-			goto err;
+			return -EIO;
+
+		if (zstd_get_frame_header(&header, src_data + 4, real_src_len))
+			return -EIO;
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		ddict = header.dictID ? smp_load_acquire(&c->zstd_ddict) : NULL;
+		if (header.dictID &&
+		    (!ddict || header.dictID != c->zstd_dict_id))
+			return -EIO;
+
+		workspace = decompress_workspace_get(c);
 		ctx = zstd_init_dctx(workspace, zstd_dctx_workspace_bound());
 
-		ret = zstd_decompress_dctx(ctx,
+		ret = header.dictID
+			? zstd_decompress_using_ddict(ctx,
+				dst_data,	dst_len,
+				src_data + 4,	real_src_len,
+				ddict)
+			: zstd_decompress_dctx(ctx,
 				dst_data,	dst_len,
-				src_data.b + 4, real_src_len);
+				src_data + 4,	real_src_len);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		decompress_workspace_put(c, workspace);
 
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	}
 	default:
 		BUG();
 	}
-	ret = 0;
-out:
+
+	return 0;
+}
+
+static int __bio_uncompress(struct bch_fs *c, struct bio *src,
+			    void *dst_data, struct bch_extent_crc_unpacked crc)
+{
+	struct bbuf src_data = bio_map_or_bounce(c, src, READ);
+	int ret = __uncompress_buf(c, crc.compression_type,
+				   dst_data, crc.uncompressed_size << 9,
+				   src_data.b, src->bi_iter.bi_size);
+
 	bio_unmap_or_unbounce(c, src_data);
 	return ret;
-err:
-	ret = -EIO;
-	goto out;
 }
 
 int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
@@ -292,11 +379,26 @@ err:
 	return ret;
 }
 
+/*
+ * Decompress the whole extent into @dst, which must be crc.uncompressed_size
+ * sectors: used by the read cache, which keeps entire decompressed extents
+ */
+int bch2_bio_uncompress_buf(struct bch_fs *c, struct bio *src, void *dst,
+			    struct bch_extent_crc_unpacked crc)
+{
+	if (crc.uncompressed_size << 9	> c->opts.encoded_extent_max ||
+	    crc.compressed_size << 9	> c->opts.encoded_extent_max)
+		return -EIO;
+
+	return __bio_uncompress(c, src, dst, crc);
+}
+
 static int attempt_compress(struct bch_fs *c,
 			    void *workspace,
 			    void *dst, size_t dst_len,
 			    void *src, size_t src_len,
-			    enum bch_compression_type compression_type)
+			    enum bch_compression_type compression_type,
+			    unsigned flags)
 {
 	switch (compression_type) {
 	case BCH_COMPRESSION_TYPE_lz4: {
@@ -320,7 +422,9 @@ static int attempt_compress(struct bch_fs *c,
 		};
 
 		zlib_set_workspace(&strm, workspace);
-		zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+		zlib_deflateInit2(&strm, flags & BCH_COMPRESS_FAST
+				  ? Z_BEST_SPEED
+				  : Z_DEFAULT_COMPRESSION,
 				  Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
 				  Z_DEFAULT_STRATEGY);
 
@@ -334,7 +438,11 @@ static int attempt_compress(struct bch_fs *c,
 	}
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_CCtx *ctx = zstd_init_cctx(workspace,
-			zstd_cctx_workspace_bound(&c->zstd_params.cParams));
+			max(zstd_cctx_workspace_bound(&c->zstd_params.cParams),
+			    zstd_cctx_workspace_bound(&c->zstd_params_fast.cParams)));
+		ZSTD_parameters *params = flags & BCH_COMPRESS_FAST
+			? &c->zstd_params_fast
+			: &c->zstd_params;
 
 		/*
 		 * ZSTD requires that when we decompress we pass in the exact
@@ -347,10 +455,17 @@ static int attempt_compress(struct bch_fs *c,
 		 * factor (7 bytes) from the dst buffer size to account for
 		 * that.
 		 */
-		size_t len = zstd_compress_cctx(ctx,
+		ZSTD_CDict *cdict = flags & BCH_COMPRESS_ZSTD_DICT
+			? smp_load_acquire(&c->zstd_cdict) : NULL;
+		size_t len = cdict
+			? zstd_compress_using_cdict(ctx,
+				dst + 4,	dst_len - 4 - 7,
+				src,		src_len,
+				cdict)
+			: zstd_compress_cctx(ctx,
 				dst + 4,	dst_len - 4 - 7,
 				src,		src_len,
-				&c->zstd_params);
+				params);
 		if (zstd_is_error(len))
 			return 0;
 
@@ -362,10 +477,50 @@ static int attempt_compress(struct bch_fs *c,
 	}
 }
 
+/*
+ * Cheap estimate of whether @src is worth trying to compress: sample
+ * ENTROPY_SAMPLES chunks spread across the buffer and compute the order 2
+ * (collision) entropy of the byte histogram, log2(n^2 / sum(count^2)).
+ * Random or already compressed data comes out at very nearly 8 bits per byte;
+ * text and most other compressible data is well below that.
+ *
+ * This only looks at single bytes, so it's deliberately conservative: we only
+ * say no when the data is indistinguishable from random.
+ */
+#define ENTROPY_SAMPLES		16
+#define ENTROPY_SAMPLE_BYTES	256
+
+static bool compress_worth_trying(const u8 *src, size_t src_len)
+{
+	unsigned counts[256] = { 0 };
+	size_t stride = src_len / ENTROPY_SAMPLES;
+	u64 n = 0, sum_sq = 0;
+	unsigned i, j;
+
+	if (stride < ENTROPY_SAMPLE_BYTES)
+		return true;
+
+	for (i = 0; i < ENTROPY_SAMPLES; i++, src += stride)
+		for (j = 0; j < ENTROPY_SAMPLE_BYTES; j++)
+			counts[src[j]]++;
+
+	for (i = 0; i < 256; i++) {
+		n += counts[i];
+		sum_sq += (u64) counts[i] * counts[i];
+	}
+
+	/*
+	 * For uniformly random bytes, n^2 / sum_sq is about 241 with 4k of
+	 * samples; 7.75 bits/byte of entropy would be 215:
+	 */
+	return n * n < 215 * sum_sq;
+}
+
 static unsigned __bio_compress(struct bch_fs *c,
 			       struct bio *dst, size_t *dst_len,
 			       struct bio *src, size_t *src_len,
-			       enum bch_compression_type compression_type)
+			       enum bch_compression_type compression_type,
+			       unsigned flags)
 {
 	struct bbuf src_data = { NULL }, dst_data = { NULL };
 	void *workspace;
@@ -379,14 +534,24 @@ static unsigned __bio_compress(struct bch_fs *c,
 	if (src->bi_iter.bi_size <= c->opts.block_size)
 		return 0;
 
-	dst_data = bio_map_or_bounce(c, dst, WRITE);
 	src_data = bio_map_or_bounce(c, src, READ);
 
-	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOIO);
-
 	*src_len = src->bi_iter.bi_size;
 	*dst_len = dst->bi_iter.bi_size;
 
+	if ((flags & BCH_COMPRESS_ADAPTIVE) &&
+	    !compress_worth_trying(src_data.b, *src_len)) {
+		this_cpu_inc(c->counters[BCH_COUNTER_compression_skip_incompressible]);
+		goto err;
+	}
+
+	if (flags & BCH_COMPRESS_FAST)
+		this_cpu_inc(c->counters[BCH_COUNTER_compression_fast]);
+
+	dst_data = bio_map_or_bounce(c, dst, WRITE);
+
+	workspace = workspace_get(c, compression_type);
+
 	/*
 	 * XXX: this algorithm sucks when the compression code doesn't tell us
 	 * how much would fit, like LZ4 does:
@@ -400,7 +565,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 		ret = attempt_compress(c, workspace,
 				       dst_data.b,	*dst_len,
 				       src_data.b,	*src_len,
-				       compression_type);
+				       compression_type, flags);
 		if (ret > 0) {
 			*dst_len = ret;
 			ret = 0;
@@ -425,7 +590,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 		*src_len = round_down(*src_len, block_bytes(c));
 	}
 
-	mempool_free(workspace, &c->compress_workspace[compression_type]);
+	workspace_put(c, compression_type, workspace);
 
 	if (ret)
 		goto err;
@@ -456,10 +621,62 @@ err:
 	goto out;
 }
 
+/*
+ * Compress a flat buffer, for metadata that doesn't go through the bio paths:
+ * the format is the same as for compressed extents, so it's decompressed with
+ * bch2_uncompress_buf() and the size isn't rounded up to a block.
+ *
+ * Returns the compressed size, or 0 if it didn't fit in @dst_len (or the
+ * codec isn't initialized).
+ */
+size_t bch2_compress_buf(struct bch_fs *c, unsigned compression_type,
+			 void *dst, size_t dst_len,
+			 void *src, size_t src_len, unsigned flags)
+{
+	void *workspace;
+	int ret;
+
+	if (compression_type == BCH_COMPRESSION_TYPE_lz4_old)
+		compression_type = BCH_COMPRESSION_TYPE_lz4;
+
+	/* zstd needs the length, and a bit of slop: */
+	if (compression_type >= BCH_COMPRESSION_TYPE_NR ||
+	    !mempool_initialized(&c->compress_workspace[compression_type]) ||
+	    dst_len < 16)
+		return 0;
+
+	workspace = workspace_get(c, compression_type);
+	ret = attempt_compress(c, workspace, dst, dst_len, src, src_len,
+			       compression_type, flags);
+	workspace_put(c, compression_type, workspace);
+
+	return max(ret, 0);
+}
+
+int bch2_uncompress_buf(struct bch_fs *c, unsigned compression_type,
+			void *dst, size_t dst_len,
+			void *src, size_t src_len)
+{
+	switch (compression_type) {
+	case BCH_COMPRESSION_TYPE_lz4_old:
+	case BCH_COMPRESSION_TYPE_lz4:
+		break;
+	case BCH_COMPRESSION_TYPE_gzip:
+	case BCH_COMPRESSION_TYPE_zstd:
+		if (!mempool_initialized(&c->decompress_workspace))
+			return -EIO;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return __uncompress_buf(c, compression_type, dst, dst_len, src, src_len);
+}
+
 unsigned bch2_bio_compress(struct bch_fs *c,
 			   struct bio *dst, size_t *dst_len,
 			   struct bio *src, size_t *src_len,
-			   unsigned compression_type)
+			   unsigned compression_type, unsigned flags)
 {
 	unsigned orig_dst = dst->bi_iter.bi_size;
 	unsigned orig_src = src->bi_iter.bi_size;
@@ -474,7 +691,8 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 		compression_type = BCH_COMPRESSION_TYPE_lz4;
 
 	compression_type =
-		__bio_compress(c, dst, dst_len, src, src_len, compression_type);
+		__bio_compress(c, dst, dst_len, src, src_len, compression_type,
+			       flags);
 
 	dst->bi_iter.bi_size = orig_dst;
 	src->bi_iter.bi_size = orig_src;
@@ -535,11 +753,104 @@ void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
 
+	if (c->pcpu) {
+		if (mempool_initialized(&c->decompress_workspace))
+			compress_buf_free(&c->pcpu->decompress_workspace,
+					  &c->decompress_workspace);
+		for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
+			if (mempool_initialized(&c->compress_workspace[i]))
+				compress_buf_free(&c->pcpu->compress_workspace[i],
+						  &c->compress_workspace[i]);
+		for (i = 0; i < ARRAY_SIZE(c->compression_bounce); i++)
+			if (mempool_initialized(&c->compression_bounce[i]))
+				compress_buf_free(&c->pcpu->compression_bounce[i],
+						  &c->compression_bounce[i]);
+	}
+
 	mempool_exit(&c->decompress_workspace);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
 		mempool_exit(&c->compress_workspace[i]);
 	mempool_exit(&c->compression_bounce[WRITE]);
 	mempool_exit(&c->compression_bounce[READ]);
+
+	zstd_free_ddict(c->zstd_ddict);
+	zstd_free_cdict(c->zstd_cdict);
+	kvfree(c->zstd_dict);
+}
+
+/* zstd dictionary: */
+
+static void *zstd_dict_alloc(void *opaque, size_t size)
+{
+	return kvmalloc(size, GFP_KERNEL);
+}
+
+static void zstd_dict_free(void *opaque, void *p)
+{
+	kvfree(p);
+}
+
+static const zstd_custom_mem zstd_dict_mem = {
+	.customAlloc	= zstd_dict_alloc,
+	.customFree	= zstd_dict_free,
+};
+
+/*
+ * The dictionary is referenced, not copied, by the digested dictionaries - and
+ * the superblock may be reallocated, so we keep our own copy.
+ *
+ * Called with sb_lock held (or before the filesystem is started): this may run
+ * when the zstd_dict option is turned on at runtime, so the digested
+ * dictionaries are fully built before they're published. Once loaded the
+ * dictionary is never replaced - existing extents may have been compressed
+ * with it.
+ */
+static int bch2_fs_zstd_dict_init(struct bch_fs *c)
+{
+	struct bch_sb_field_zstd_dict *d = bch2_sb_get_zstd_dict(c->disk_sb.sb);
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+	void *dict;
+	unsigned len;
+
+	if (!d || c->zstd_dict)
+		return 0;
+
+	len = le32_to_cpu(d->dict_len);
+
+	dict = kvmalloc(len, GFP_KERNEL);
+	if (!dict)
+		return -ENOMEM;
+	memcpy(dict, d->data, len);
+
+	cdict = zstd_create_cdict_byreference(dict, len,
+					c->zstd_params.cParams, zstd_dict_mem);
+	ddict = zstd_create_ddict_byreference(dict, len, zstd_dict_mem);
+	if (!cdict || !ddict) {
+		zstd_free_ddict(ddict);
+		zstd_free_cdict(cdict);
+		kvfree(dict);
+		return -ENOMEM;
+	}
+
+	c->zstd_dict	= dict;
+	c->zstd_dict_id	= le32_to_cpu(d->dict_id);
+	smp_store_release(&c->zstd_ddict, ddict);
+	smp_store_release(&c->zstd_cdict, cdict);
+	return 0;
+}
+
+int bch2_check_set_has_zstd_dict(struct bch_fs *c, bool v)
+{
+	int ret;
+
+	if (!v || READ_ONCE(c->zstd_cdict))
+		return 0;
+
+	mutex_lock(&c->sb_lock);
+	ret = bch2_fs_zstd_dict_init(c);
+	mutex_unlock(&c->sb_lock);
+	return ret;
 }
 
 static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
@@ -547,6 +858,7 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 	size_t decompress_workspace_size = 0;
 	bool decompress_workspace_needed;
 	ZSTD_parameters params = zstd_get_params(0, c->opts.encoded_extent_max);
+	ZSTD_parameters params_fast = zstd_get_params(1, c->opts.encoded_extent_max);
 	struct {
 		unsigned	feature;
 		unsigned	type;
@@ -558,7 +870,8 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 			zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL),
 			zlib_inflate_workspacesize(), },
 		{ BCH_FEATURE_zstd, BCH_COMPRESSION_TYPE_zstd,
-			zstd_cctx_workspace_bound(&params.cParams),
+			max(zstd_cctx_workspace_bound(&params.cParams),
+			    zstd_cctx_workspace_bound(&params_fast.cParams)),
 			zstd_dctx_workspace_bound() },
 	}, *i;
 	int ret = 0;
@@ -566,6 +879,7 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 	pr_verbose_init(c->opts, "");
 
 	c->zstd_params = params;
+	c->zstd_params_fast = params_fast;
 
 	for (i = compression_types;
 	     i < compression_types + ARRAY_SIZE(compression_types);
@@ -619,6 +933,9 @@ have_compressed:
 		if (ret)
 			goto out;
 	}
+
+	if (features & (1 << BCH_FEATURE_zstd))
+		ret = bch2_fs_zstd_dict_init(c);
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
 	return ret;
@@ -634,6 +951,56 @@ int bch2_fs_compress_init(struct bch_fs *c)
 	if (c->opts.background_compression)
 		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.background_compression];
 
+	if (c->opts.journal_compression)
+		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.journal_compression];
+
 	return __bch2_fs_compress_init(c, f);
 
 }
+
+/* BCH_SB_FIELD_zstd_dict: */
+
+static int bch2_sb_zstd_dict_validate(struct bch_sb *sb,
+				      struct bch_sb_field *f,
+				      struct printbuf *err)
+{
+	struct bch_sb_field_zstd_dict *d = field_to_type(f, zstd_dict);
+	unsigned len;
+
+	if (vstruct_bytes(&d->field) < sizeof(*d)) {
+		prt_printf(err, "wrong size (got %zu should be at least %zu)",
+		       vstruct_bytes(&d->field), sizeof(*d));
+		return -EINVAL;
+	}
+
+	len = le32_to_cpu(d->dict_len);
+	if (len < 8 || len > vstruct_bytes(&d->field) - sizeof(*d)) {
+		prt_printf(err, "bad dictionary length %u", len);
+		return -EINVAL;
+	}
+
+	if (get_unaligned_le32(d->data) != ZSTD_DICT_MAGIC ||
+	    get_unaligned_le32(d->data + 4) != le32_to_cpu(d->dict_id) ||
+	    !d->dict_id) {
+		prt_printf(err, "not a zstd dictionary, or bad dictionary id");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bch2_sb_zstd_dict_to_text(struct printbuf *out, struct bch_sb *sb,
+				      struct bch_sb_field *f)
+{
+	struct bch_sb_field_zstd_dict *d = field_to_type(f, zstd_dict);
+
+	prt_printf(out, "Dictionary id:     %u", le32_to_cpu(d->dict_id));
+	prt_newline(out);
+	prt_printf(out, "Size:              %u", le32_to_cpu(d->dict_len));
+	prt_newline(out);
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_zstd_dict = {
+	.validate	= bch2_sb_zstd_dict_validate,
+	.to_text	= bch2_sb_zstd_dict_to_text,
+};
@@ -8,11 +8,33 @@ int bch2_bio_uncompress_inplace(struct bch_fs *, struct bio *,
 				struct bch_extent_crc_unpacked *);
 int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 		       struct bvec_iter, struct bch_extent_crc_unpacked);
+int bch2_bio_uncompress_buf(struct bch_fs *, struct bio *, void *,
+			    struct bch_extent_crc_unpacked);
+
+enum bch_compress_flags {
+	/* Use the filesystem's trained zstd dictionary, if it has one: */
+	BCH_COMPRESS_ZSTD_DICT		= 1 << 0,
+	/* Skip data that looks incompressible, without trying to compress it: */
+	BCH_COMPRESS_ADAPTIVE		= 1 << 1,
+	/* Writes are backed up: trade ratio for speed */
+	BCH_COMPRESS_FAST		= 1 << 2,
+};
+
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
-			   struct bio *, size_t *, unsigned);
+			   struct bio *, size_t *, unsigned, unsigned);
+
+size_t bch2_compress_buf(struct bch_fs *, unsigned, void *, size_t,
+			 void *, size_t, unsigned);
+int bch2_uncompress_buf(struct bch_fs *, unsigned, void *, size_t,
+			void *, size_t);
 
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
+int bch2_check_set_has_zstd_dict(struct bch_fs *, bool);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
 
+#define ZSTD_DICT_MAGIC		0xEC30A437
+
+extern const struct bch_sb_field_ops bch_sb_field_ops_zstd_dict;
+
 #endif /* _BCACHEFS_COMPRESS_H */
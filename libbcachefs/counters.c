@@ -12,6 +12,13 @@ const char * const bch2_counter_names[] = {
 	NULL
 };
 
+const char * const bch2_fs_counter_names[] = {
+#define x(t) (#t),
+	BCH_FS_COUNTERS()
+#undef x
+	NULL
+};
+
 static size_t bch2_sb_counter_nr_entries(struct bch_sb_field_counters *ctrs)
 {
 	if (!ctrs)
@@ -87,18 +94,110 @@ int bch2_sb_counters_from_cpu(struct bch_fs *c)
 	return 0;
 }
 
+/* Persistent counters first, then BCH_FS_COUNTERS(): */
+static void bch2_fs_counters_read(struct bch_fs *c, u64 *v)
+{
+	unsigned i;
+
+	for (i = 0; i < BCH_COUNTER_NR; i++)
+		v[i] = percpu_u64_get(&c->counters[i]);
+	for (i = 0; i < BCH_FS_COUNTER_NR; i++)
+		v[BCH_COUNTER_NR + i] = percpu_u64_get(&c->fs_counters[i]);
+}
+
+static const char *bch2_fs_counter_name(unsigned i)
+{
+	return i < BCH_COUNTER_NR
+		? bch2_counter_names[i]
+		: bch2_fs_counter_names[i - BCH_COUNTER_NR];
+}
+
+/**
+ * bch2_fs_counters_all_to_text - every counter, one "name value" per line
+ *
+ * Persistent counters are since mount, to match the non persistent ones.
+ */
+void bch2_fs_counters_all_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	u64 v[BCH_COUNTER_NR + BCH_FS_COUNTER_NR];
+	unsigned i;
+
+	bch2_fs_counters_read(c, v);
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		if (i < BCH_COUNTER_NR)
+			v[i] -= c->counters_on_mount[i];
+
+		prt_printf(out, "%s %llu", bch2_fs_counter_name(i), v[i]);
+		prt_newline(out);
+	}
+}
+
+/**
+ * bch2_fs_counters_rate_to_text - events/sec for every counter, since the
+ * previous call (or mount)
+ *
+ * Counters that didn't change are skipped.
+ */
+void bch2_fs_counters_rate_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	u64 v[BCH_COUNTER_NR + BCH_FS_COUNTER_NR];
+	u64 now, elapsed;
+	unsigned i;
+
+	mutex_lock(&c->counters_rate_lock);
+	now = local_clock();
+	bch2_fs_counters_read(c, v);
+
+	elapsed = max_t(u64, now - c->counters_rate_time, 1);
+
+	prt_printf(out, "interval:");
+	prt_tab(out);
+	bch2_pr_time_units(out, elapsed);
+	prt_newline(out);
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		u64 d = v[i] - c->counters_rate_last[i];
+
+		if (!d)
+			continue;
+
+		prt_printf(out, "%s:", bch2_fs_counter_name(i));
+		prt_tab(out);
+		prt_printf(out, "%llu/sec",
+			   div64_u64(d * NSEC_PER_SEC, elapsed));
+		prt_newline(out);
+	}
+
+	memcpy(c->counters_rate_last, v, sizeof(v));
+	c->counters_rate_time = now;
+	mutex_unlock(&c->counters_rate_lock);
+}
+
 void bch2_fs_counters_exit(struct bch_fs *c)
 {
+	free_percpu(c->fs_counters);
 	free_percpu(c->counters);
 }
 
 int bch2_fs_counters_init(struct bch_fs *c)
 {
+	int ret;
+
 	c->counters = __alloc_percpu(sizeof(u64) * BCH_COUNTER_NR, sizeof(u64));
-	if (!c->counters)
+	c->fs_counters = __alloc_percpu(sizeof(u64) * BCH_FS_COUNTER_NR, sizeof(u64));
+	if (!c->counters || !c->fs_counters)
 		return -ENOMEM;
 
-	return bch2_sb_counters_to_cpu(c);
+	ret = bch2_sb_counters_to_cpu(c);
+	if (ret)
+		return ret;
+
+	mutex_init(&c->counters_rate_lock);
+	memcpy(c->counters_rate_last, c->counters_on_mount,
+	       sizeof(c->counters_on_mount));
+	c->counters_rate_time = local_clock();
+	return 0;
 }
 
 const struct bch_sb_field_ops bch_sb_field_ops_counters = {
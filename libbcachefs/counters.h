@@ -9,6 +9,12 @@
 int bch2_sb_counters_to_cpu(struct bch_fs *);
 int bch2_sb_counters_from_cpu(struct bch_fs *);
 
+extern const char * const bch2_counter_names[];
+extern const char * const bch2_fs_counter_names[];
+
+void bch2_fs_counters_all_to_text(struct printbuf *, struct bch_fs *);
+void bch2_fs_counters_rate_to_text(struct printbuf *, struct bch_fs *);
+
 void bch2_fs_counters_exit(struct bch_fs *);
 int bch2_fs_counters_init(struct bch_fs *);
 
@@ -34,7 +34,7 @@ static int insert_snapshot_whiteouts(struct btree_trans *trans,
 	if (!bkey_cmp(old_pos, new_pos))
 		return 0;
 
-	if (!snapshot_t(c, old_pos.snapshot)->children[0])
+	if (!bch2_snapshot_internal_node(c, old_pos.snapshot))
 		return 0;
 
 	bch2_trans_iter_init(trans, &iter, id, old_pos,
@@ -279,16 +279,243 @@ void bch2_data_update_read_done(struct data_update *m,
 	m->op.crc = crc;
 	m->op.wbio.bio.bi_iter.bi_size = crc.compressed_size << 9;
 
+	/*
+	 * If we're not asked to change the encoding, keep the existing
+	 * compression and checksum type, so that bch2_write() can write the
+	 * data out exactly as we read it, without decompressing/recompressing
+	 * or rechecksumming:
+	 */
+	if (!m->data_opts.reencode &&
+	    crc.compression_type != BCH_COMPRESSION_TYPE_lz4_old) {
+		m->op.compression_type = crc_is_compressed(crc)
+			? crc.compression_type
+			: BCH_COMPRESSION_TYPE_none;
+		m->op.csum_type = crc.csum_type;
+	}
+
 	closure_call(&m->op.cl, bch2_write, NULL, cl);
 }
 
+/*
+ * Coalescing: several contiguous extents were read (and decoded) into a single
+ * buffer and written out as one new extent. We can only replace the old
+ * extents if every one of them is still exactly what we read - anything else
+ * means we raced with a foreground write, and the data we wrote is stale:
+ */
+static bool coalesce_extent_was_read(struct bch_fs *c, struct data_update *m,
+				     struct bkey_s_c k, struct bkey_buf *tmp)
+{
+	struct bkey_i *old;
+
+	for_each_keylist_key(&m->coalesced, old) {
+		if (bkey_start_offset(&old->k) > bkey_start_offset(k.k) ||
+		    old->k.p.offset < k.k->p.offset)
+			continue;
+
+		bch2_bkey_buf_copy(tmp, c, old);
+		bch2_cut_front(bkey_start_pos(k.k),	tmp->k);
+		bch2_cut_back(k.k->p,			tmp->k);
+
+		return  k.k->type == tmp->k->k.type &&
+			k.k->size == tmp->k->k.size &&
+			!bversion_cmp(k.k->version, tmp->k->k.version) &&
+			bkey_val_bytes(k.k) == bkey_val_bytes(&tmp->k->k) &&
+			!memcmp(k.v, &tmp->k->v, bkey_val_bytes(k.k));
+	}
+
+	return false;
+}
+
+static int coalesce_extents_unchanged(struct btree_trans *trans,
+				      struct data_update *m,
+				      struct bkey_i *new, bool *unchanged)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_buf tmp;
+	u64 pos = bkey_start_offset(&new->k);
+	int ret;
+
+	*unchanged = false;
+	bch2_bkey_buf_init(&tmp);
+
+	for_each_btree_key_upto_norestart(trans, iter, m->btree_id,
+				bkey_start_pos(&new->k),
+				POS(new->k.p.inode, U64_MAX),
+				BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		if (k.k->p.snapshot != new->k.p.snapshot)
+			continue;
+
+		if (bkey_start_offset(k.k) > pos ||
+		    !coalesce_extent_was_read(c, m, k, &tmp))
+			break;
+
+		pos = k.k->p.offset;
+		if (pos >= new->k.p.offset) {
+			*unchanged = true;
+			break;
+		}
+	}
+	bch2_trans_iter_exit(trans, &iter);
+	bch2_bkey_buf_exit(&tmp, c);
+	return ret;
+}
+
+static int __coalesce_index_update(struct btree_trans *trans,
+				   struct data_update *m,
+				   struct bkey_i *new, bool *raced)
+{
+	struct bch_write_op *op = &m->op;
+	struct btree_iter iter;
+	struct bkey_i *insert;
+	bool unchanged;
+	int ret;
+
+	ret = coalesce_extents_unchanged(trans, m, new, &unchanged);
+	if (ret)
+		return ret;
+
+	*raced = !unchanged;
+	if (!unchanged)
+		return 0;
+
+	insert = bch2_trans_kmalloc(trans, bkey_bytes(&new->k));
+	ret = PTR_ERR_OR_ZERO(insert);
+	if (ret)
+		return ret;
+
+	bkey_copy(insert, new);
+
+	bch2_trans_iter_init(trans, &iter, m->btree_id,
+			     bkey_start_pos(&insert->k),
+			     BTREE_ITER_INTENT);
+	ret   = bch2_btree_iter_traverse(&iter) ?:
+		bch2_trans_update(trans, &iter, insert,
+				  BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE) ?:
+		bch2_trans_commit(trans, &op->res,
+				  op_journal_seq(op),
+				  BTREE_INSERT_NOFAIL|
+				  m->data_opts.btree_insert_flags);
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int bch2_data_update_coalesce_index_update(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	struct btree_trans trans;
+	struct data_update *m =
+		container_of(op, struct data_update, op);
+	struct keylist *keys = &op->insert_keys;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 1024);
+
+	while (!bch2_keylist_empty(keys)) {
+		struct bkey_i *new = bch2_keylist_front(keys);
+		bool raced = false;
+
+		ret = lockrestart_do(&trans,
+				__coalesce_index_update(&trans, m, new, &raced));
+		if (ret)
+			break;
+
+		if (raced) {
+			if (m->ctxt) {
+				atomic64_inc(&m->ctxt->stats->keys_raced);
+				atomic64_add(new->k.size,
+					     &m->ctxt->stats->sectors_raced);
+			}
+
+			this_cpu_add(c->counters[BCH_COUNTER_move_extent_race], new->k.size);
+			trace_move_extent_race(&new->k);
+		} else {
+			this_cpu_add(c->counters[BCH_COUNTER_move_extent_finish], new->k.size);
+			trace_move_extent_finish(&new->k);
+		}
+
+		bch2_keylist_pop_front(keys);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+void bch2_data_update_coalesce_read_done(struct data_update *m,
+					 struct closure *cl)
+{
+	/* write bio must own pages: */
+	BUG_ON(!m->op.wbio.bio.bi_vcnt);
+
+	m->op.wbio.bio.bi_iter.bi_size = keylist_sectors(&m->coalesced) << 9;
+
+	closure_call(&m->op.cl, bch2_write, NULL, cl);
+}
+
+/*
+ * Like bch2_data_update_init(), but for rewriting all of @keys - contiguous,
+ * unencrypted extents in the same inode and snapshot - as a single new extent,
+ * with the data read and decoded rather than moved as is:
+ */
+int bch2_data_update_coalesce_init(struct bch_fs *c, struct data_update *m,
+				   struct write_point_specifier wp,
+				   struct bch_io_opts io_opts,
+				   struct data_update_opts data_opts,
+				   enum btree_id btree_id,
+				   struct keylist *keys)
+{
+	struct bkey_i *first = bch2_keylist_front(keys);
+	int ret;
+
+	bch2_keylist_init(&m->coalesced,
+			  kmemdup(keys->keys_p, bch2_keylist_bytes(keys), GFP_KERNEL));
+	if (!m->coalesced.keys_p)
+		return -ENOMEM;
+	m->coalesced.top_p += bch2_keylist_u64s(keys);
+
+	bch2_bkey_buf_init(&m->k);
+	bch2_bkey_buf_copy(&m->k, c, first);
+	m->btree_id	= btree_id;
+	m->data_opts	= data_opts;
+
+	bch2_write_op_init(&m->op, c, io_opts);
+	m->op.pos	= bkey_start_pos(&first->k);
+	m->op.version	= first->k.version;
+	m->op.target	= data_opts.target;
+	m->op.write_point = wp;
+	m->op.flags	|= BCH_WRITE_PAGES_STABLE|
+		BCH_WRITE_PAGES_OWNED|
+		BCH_WRITE_FROM_INTERNAL|
+		m->data_opts.write_flags;
+	m->op.compression_type =
+		bch2_compression_opt_to_type[io_opts.background_compression ?:
+					     io_opts.compression];
+	if (m->data_opts.btree_insert_flags & BTREE_INSERT_USE_RESERVE)
+		m->op.alloc_reserve = RESERVE_movinggc;
+	m->op.index_update_fn	= bch2_data_update_coalesce_index_update;
+	m->op.nr_replicas = m->op.nr_replicas_required = io_opts.data_replicas;
+
+	ret = bch2_disk_reservation_get(c, &m->op.res, keylist_sectors(keys),
+					io_opts.data_replicas, 0);
+	if (ret) {
+		bch2_bkey_buf_exit(&m->k, c);
+		kfree(m->coalesced.keys_p);
+		bch2_keylist_init(&m->coalesced, NULL);
+	}
+
+	return ret;
+}
+
 void bch2_data_update_exit(struct data_update *update)
 {
 	struct bch_fs *c = update->op.c;
 
+	kfree(update->coalesced.keys_p);
 	bch2_bkey_buf_exit(&update->k, c);
 	bch2_disk_reservation_put(c, &update->op.res);
-	bch2_bio_free_pages_pool(c, &update->op.wbio.bio);
+	/* pages come from bch2_bio_alloc_pages(), never a single allocation: */
+	bch2_bio_free_pages_pool(c, &update->op.wbio.bio, 0);
 }
 
 int bch2_data_update_init(struct bch_fs *c, struct data_update *m,
@@ -306,6 +533,7 @@ int bch2_data_update_init(struct bch_fs *c, struct data_update *m,
 
 	bch2_bkey_buf_init(&m->k);
 	bch2_bkey_buf_reassemble(&m->k, c, k);
+	bch2_keylist_init(&m->coalesced, NULL);
 	m->btree_id	= btree_id;
 	m->data_opts	= data_opts;
 
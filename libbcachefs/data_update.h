@@ -5,6 +5,7 @@
 
 #include "bkey_buf.h"
 #include "io_types.h"
+#include "keylist_types.h"
 
 struct moving_context;
 
@@ -13,6 +14,11 @@ struct data_update_opts {
 	unsigned	kill_ptrs;
 	u16		target;
 	u8		extra_replicas;
+	/*
+	 * Recompress and rechecksum with the current io options; otherwise the
+	 * encoded data is moved as is whenever possible:
+	 */
+	bool		reencode;
 	unsigned	btree_insert_flags;
 	unsigned	write_flags;
 };
@@ -22,6 +28,8 @@ struct data_update {
 	enum btree_id		btree_id;
 	struct bkey_buf		k;
 	struct data_update_opts	data_opts;
+	/* extents being coalesced into one, for bch2_data_update_coalesce_init(): */
+	struct keylist		coalesced;
 	struct moving_context	*ctxt;
 	struct bch_write_op	op;
 };
@@ -35,6 +43,12 @@ int bch2_data_update_init(struct bch_fs *, struct data_update *,
 			  struct write_point_specifier,
 			  struct bch_io_opts, struct data_update_opts,
 			  enum btree_id, struct bkey_s_c);
+int bch2_data_update_coalesce_init(struct bch_fs *, struct data_update *,
+				   struct write_point_specifier,
+				   struct bch_io_opts, struct data_update_opts,
+				   enum btree_id, struct keylist *);
+void bch2_data_update_coalesce_read_done(struct data_update *,
+					 struct closure *);
 void bch2_data_update_opts_normalize(struct bkey_s_c, struct data_update_opts *);
 
 #endif /* _BCACHEFS_DATA_UPDATE_H */
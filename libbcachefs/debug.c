@@ -13,6 +13,7 @@
 #include "btree_iter.h"
 #include "btree_locking.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
 #include "buckets.h"
 #include "debug.h"
 #include "error.h"
@@ -688,6 +689,302 @@ static const struct file_operations lock_held_stats_op = {
 	.read = lock_held_stats_read,
 };
 
+static ssize_t trans_restart_stats_read(struct file *file, char __user *buf,
+					size_t size, loff_t *ppos)
+{
+	struct dump_iter        *i = file->private_data;
+	struct bch_fs *c = i->c;
+	int err;
+
+	i->ubuf = buf;
+	i->size = size;
+	i->ret  = 0;
+
+	while (1) {
+		struct btree_transaction_stats *s = &c->btree_transaction_stats[i->iter];
+		unsigned j;
+		u64 nr = 0;
+
+		err = flush_buf(i);
+		if (err)
+			return err;
+
+		if (!i->size)
+			break;
+
+		if (i->iter == ARRAY_SIZE(c->btree_transaction_fns) ||
+		    !c->btree_transaction_fns[i->iter])
+			break;
+
+		i->iter++;
+
+		for (j = 0; j < BCH_TRANS_RESTART_NR; j++)
+			nr += atomic64_read(&s->restarts[j]);
+		if (!nr)
+			continue;
+
+		prt_printf(&i->buf, "%s: ", c->btree_transaction_fns[i->iter - 1]);
+		prt_newline(&i->buf);
+		printbuf_indent_add(&i->buf, 2);
+		bch2_trans_restart_stats_to_text(&i->buf, s);
+		printbuf_indent_sub(&i->buf, 2);
+		prt_newline(&i->buf);
+	}
+
+	if (i->buf.allocation_failure)
+		return -ENOMEM;
+
+	return i->ret;
+}
+
+static const struct file_operations trans_restart_stats_op = {
+	.owner = THIS_MODULE,
+	.open = lock_held_stats_open,
+	.release = lock_held_stats_release,
+	.read = trans_restart_stats_read,
+};
+
+struct btree_layout_stats {
+	u64			nodes;
+	u64			skipped;
+	u64			needs_redo;
+	u64			bytes;
+	u64			unwritten_bytes;
+	u64			packed_keys;
+	u64			unpacked_keys;
+	u64			key_u64s;
+	u64			field_bits[BKEY_NR_FIELDS];
+	u8			field_bits_max[BKEY_NR_FIELDS];
+	struct bset_stats	bsets;
+};
+
+static void btree_node_layout_account(struct btree_layout_stats *s,
+				      struct btree *b)
+{
+	struct bset_tree *t;
+	unsigned i;
+
+	s->nodes++;
+	s->needs_redo		+= bch2_bkey_format_needs_redo(&b->format);
+	s->bytes		+= b->nr.live_u64s * sizeof(u64);
+	s->packed_keys		+= b->nr.packed_keys;
+	s->unpacked_keys	+= b->nr.unpacked_keys;
+	s->key_u64s		+= b->format.key_u64s;
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++) {
+		s->field_bits[i] += b->format.bits_per_field[i];
+		s->field_bits_max[i] = max(s->field_bits_max[i],
+					   b->format.bits_per_field[i]);
+	}
+
+	for_each_bset(b, t)
+		if (!bset_written(b, bset(b, t)))
+			s->unwritten_bytes += le16_to_cpu(bset(b, t)->u64s) *
+				sizeof(u64);
+
+	bch2_btree_keys_stats(b, &s->bsets);
+}
+
+static void btree_layout_stats_to_text(struct printbuf *out, struct bch_fs *c,
+				       struct btree_layout_stats *s)
+{
+	static const char * const aux_tree_types[] = { "none", "ro", "rw" };
+	u64 nr_keys = s->packed_keys + s->unpacked_keys;
+	u64 nr_bsets = 0;
+	unsigned i;
+
+	for (i = 0; i < BSET_TREE_NR_TYPES; i++)
+		nr_bsets += s->bsets.sets[i].nr;
+
+	prt_printf(out, "nodes:\t%llu", s->nodes);
+	if (s->skipped)
+		prt_printf(out, " (%llu locked, skipped)", s->skipped);
+	prt_newline(out);
+
+	prt_printf(out, "full:\t%llu%%",
+		   div64_u64(s->bytes * 100, s->nodes * btree_max_u64s(c) * sizeof(u64)));
+	prt_newline(out);
+
+	prt_printf(out, "bsets per node:\t%llu.%02llu",
+		   nr_bsets / s->nodes, nr_bsets * 100 / s->nodes % 100);
+	prt_newline(out);
+
+	printbuf_indent_add(out, 2);
+	for (i = 0; i < BSET_TREE_NR_TYPES; i++) {
+		prt_printf(out, "aux tree %s:\t%zu bsets, ",
+			   aux_tree_types[i], s->bsets.sets[i].nr);
+		prt_human_readable_u64(out, s->bsets.sets[i].bytes);
+		prt_newline(out);
+	}
+	printbuf_indent_sub(out, 2);
+
+	prt_printf(out, "unwritten bsets:\t");
+	prt_human_readable_u64(out, s->unwritten_bytes);
+	prt_printf(out, ", avg ");
+	prt_human_readable_u64(out, div64_u64(s->unwritten_bytes, s->nodes));
+	prt_printf(out, " per node");
+	prt_newline(out);
+
+	prt_printf(out, "bkey floats failed:\t%zu/%zu", s->bsets.failed, s->bsets.floats);
+	if (s->bsets.floats)
+		prt_printf(out, " (%zu.%02zu%%)",
+			   s->bsets.failed * 100 / s->bsets.floats,
+			   s->bsets.failed * 10000 / s->bsets.floats % 100);
+	prt_newline(out);
+
+	prt_printf(out, "keys packed/unpacked:\t%llu/%llu", s->packed_keys, s->unpacked_keys);
+	prt_newline(out);
+
+	prt_printf(out, "avg key u64s:\t%llu.%02llu packed, %zu unpacked",
+		   s->key_u64s / s->nodes, s->key_u64s * 100 / s->nodes % 100,
+		   BKEY_U64s);
+	if (nr_keys)
+		prt_printf(out, ", %llu bytes per key incl. value",
+			   div64_u64(s->bytes, nr_keys));
+	prt_newline(out);
+
+	prt_printf(out, "field bits avg/max:\t");
+	for (i = 0; i < BKEY_NR_FIELDS; i++)
+		prt_printf(out, "%llu/%u ",
+			   div64_u64(s->field_bits[i], s->nodes),
+			   s->field_bits_max[i]);
+	prt_newline(out);
+
+	prt_printf(out, "format needs rewrite:\t%llu", s->needs_redo);
+	prt_newline(out);
+}
+
+/*
+ * Summary of how efficient the in memory layout of cached btree nodes is, per
+ * btree: lots of bsets, failed bkey floats or wide formats all make lookups
+ * slower, and mean the node would benefit from being compacted or rewritten.
+ * Nodes that are locked are skipped, rather than blocking under RCU:
+ */
+static ssize_t bch2_btree_node_layout_read(struct file *file, char __user *buf,
+					   size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	struct bch_fs *c = i->c;
+	struct btree_layout_stats *stats;
+	struct bucket_table *tbl;
+	struct rhash_head *pos;
+	struct btree *b;
+	unsigned id, j;
+	ssize_t ret;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	if (i->iter)
+		goto out;
+	i->iter++;
+
+	stats = kcalloc(BTREE_ID_NR, sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	tbl = rht_dereference_rcu(c->btree_cache.table.tbl,
+				  &c->btree_cache.table);
+	for (j = 0; j < tbl->size; j++)
+		rht_for_each_entry_rcu(b, pos, tbl, j, hash) {
+			if (b->c.btree_id >= BTREE_ID_NR)
+				continue;
+
+			if (!six_trylock_read(&b->c.lock)) {
+				stats[b->c.btree_id].skipped++;
+				continue;
+			}
+
+			btree_node_layout_account(&stats[b->c.btree_id], b);
+			six_unlock_read(&b->c.lock);
+		}
+	rcu_read_unlock();
+
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		if (!stats[id].nodes)
+			continue;
+
+		prt_printf(&i->buf, "%s:", bch2_btree_ids[id]);
+		prt_newline(&i->buf);
+		printbuf_indent_add(&i->buf, 2);
+		btree_layout_stats_to_text(&i->buf, c, &stats[id]);
+		printbuf_indent_sub(&i->buf, 2);
+		prt_newline(&i->buf);
+	}
+
+	kfree(stats);
+out:
+	if (i->buf.allocation_failure)
+		return -ENOMEM;
+
+	ret = flush_buf(i);
+	return ret ?: i->ret;
+}
+
+static const struct file_operations btree_node_layout_ops = {
+	.owner		= THIS_MODULE,
+	.open		= lock_held_stats_open,
+	.release	= lock_held_stats_release,
+	.read		= bch2_btree_node_layout_read,
+};
+
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+static ssize_t btree_lock_wait_times_read(struct file *file, char __user *buf,
+					  size_t size, loff_t *ppos)
+{
+	static const char * const lock_types[] = { "read", "intent", "write" };
+	struct dump_iter        *i = file->private_data;
+	struct bch_fs *c = i->c;
+	int err;
+
+	i->ubuf = buf;
+	i->size = size;
+	i->ret  = 0;
+
+	while (1) {
+		unsigned btree	= i->iter / (BTREE_MAX_DEPTH * 3);
+		unsigned level	= i->iter / 3 % BTREE_MAX_DEPTH;
+		unsigned type	= i->iter % 3;
+		struct time_stats *s;
+
+		err = flush_buf(i);
+		if (err)
+			return err;
+
+		if (!i->size || btree >= BTREE_ID_NR)
+			break;
+
+		i->iter++;
+
+		s = &c->btree_lock_wait_times[btree][level][type];
+		if (!READ_ONCE(s->count))
+			continue;
+
+		prt_printf(&i->buf, "%s level %u %s:",
+			   bch2_btree_ids[btree], level, lock_types[type]);
+		prt_newline(&i->buf);
+		printbuf_indent_add(&i->buf, 2);
+		bch2_time_stats_to_text(&i->buf, s);
+		printbuf_indent_sub(&i->buf, 2);
+		prt_newline(&i->buf);
+	}
+
+	if (i->buf.allocation_failure)
+		return -ENOMEM;
+
+	return i->ret;
+}
+
+static const struct file_operations btree_lock_wait_times_op = {
+	.owner = THIS_MODULE,
+	.open = lock_held_stats_open,
+	.release = lock_held_stats_release,
+	.read = btree_lock_wait_times_read,
+};
+#endif
+
 static ssize_t bch2_btree_deadlock_read(struct file *file, char __user *buf,
 					    size_t size, loff_t *ppos)
 {
@@ -756,6 +1053,9 @@ void bch2_fs_debug_init(struct bch_fs *c)
 	debugfs_create_file("cached_btree_nodes", 0400, c->fs_debug_dir,
 			    c->btree_debug, &cached_btree_nodes_ops);
 
+	debugfs_create_file("btree_node_layout", 0400, c->fs_debug_dir,
+			    c, &btree_node_layout_ops);
+
 	debugfs_create_file("btree_transactions", 0400, c->fs_debug_dir,
 			    c->btree_debug, &btree_transactions_ops);
 
@@ -765,6 +1065,14 @@ void bch2_fs_debug_init(struct bch_fs *c)
 	debugfs_create_file("btree_transaction_stats", 0400, c->fs_debug_dir,
 			    c, &lock_held_stats_op);
 
+	debugfs_create_file("btree_transaction_restarts", 0400, c->fs_debug_dir,
+			    c, &trans_restart_stats_op);
+
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	debugfs_create_file("btree_lock_wait_times", 0400, c->fs_debug_dir,
+			    c, &btree_lock_wait_times_op);
+#endif
+
 	debugfs_create_file("btree_deadlock", 0400, c->fs_debug_dir,
 			    c->btree_debug, &btree_deadlock_ops);
 
@@ -11,6 +11,8 @@
 #include "subvolume.h"
 
 #include <linux/dcache.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
 
 unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent d)
 {
@@ -190,6 +192,121 @@ static struct bkey_i_dirent *dirent_create_key(struct btree_trans *trans,
 	return dirent;
 }
 
+/* Negative dirent cache: */
+
+static struct bch_dirent_neg_bucket *
+dirent_neg_bucket(struct bch_fs *c, subvol_inum dir, const struct qstr *name)
+{
+	u32 h = jhash(name->name, name->len,
+		      jhash_2words(dir.inum, dir.subvol, dir.inum >> 32));
+
+	return c->dirent_neg_cache.buckets +
+		(h & (BCH_DIRENT_NEG_BUCKETS - 1));
+}
+
+static inline bool dirent_neg_cacheable(struct bch_fs *c, const struct qstr *name)
+{
+	return c->dirent_neg_cache.buckets &&
+		name->len &&
+		name->len <= BCH_DIRENT_NEG_NAME_MAX;
+}
+
+static struct bch_dirent_neg_entry *
+dirent_neg_find(struct bch_dirent_neg_bucket *b, subvol_inum dir,
+		const struct qstr *name)
+{
+	struct bch_dirent_neg_entry *e;
+
+	for (e = b->e; e < b->e + ARRAY_SIZE(b->e); e++)
+		if (e->name_len == name->len &&
+		    e->dir	== dir.inum &&
+		    e->subvol	== dir.subvol &&
+		    !memcmp(e->name, name->name, name->len))
+			return e;
+	return NULL;
+}
+
+static bool dirent_neg_cache_lookup(struct bch_fs *c, subvol_inum dir,
+				    const struct qstr *name)
+{
+	struct bch_dirent_neg_bucket *b;
+	bool ret;
+
+	if (!dirent_neg_cacheable(c, name))
+		return false;
+
+	b = dirent_neg_bucket(c, dir, name);
+	spin_lock(&b->lock);
+	ret = dirent_neg_find(b, dir, name) != NULL;
+	spin_unlock(&b->lock);
+	return ret;
+}
+
+static void dirent_neg_cache_add(struct bch_fs *c, subvol_inum dir,
+				 const struct qstr *name, u64 seq)
+{
+	struct bch_dirent_neg_bucket *b;
+	struct bch_dirent_neg_entry *e;
+
+	if (!dirent_neg_cacheable(c, name))
+		return;
+
+	b = dirent_neg_bucket(c, dir, name);
+	spin_lock(&b->lock);
+	/* Raced with a create? */
+	if (atomic64_read(&c->dirent_neg_cache.seq) == seq &&
+	    !dirent_neg_find(b, dir, name)) {
+		e = b->e + b->next++ % ARRAY_SIZE(b->e);
+		e->dir		= dir.inum;
+		e->subvol	= dir.subvol;
+		e->name_len	= name->len;
+		memcpy(e->name, name->name, name->len);
+	}
+	spin_unlock(&b->lock);
+}
+
+/*
+ * Called when creating a dirent, before commit: this is sufficient because
+ * lookups and creates in the same directory are serialized by the VFS.
+ */
+static void dirent_neg_cache_invalidate(struct bch_fs *c, subvol_inum dir,
+					const struct qstr *name)
+{
+	struct bch_dirent_neg_bucket *b;
+	struct bch_dirent_neg_entry *e;
+
+	atomic64_inc(&c->dirent_neg_cache.seq);
+
+	if (!dirent_neg_cacheable(c, name))
+		return;
+
+	b = dirent_neg_bucket(c, dir, name);
+	spin_lock(&b->lock);
+	e = dirent_neg_find(b, dir, name);
+	if (e)
+		e->name_len = 0;
+	spin_unlock(&b->lock);
+}
+
+/* For when entire directories may appear, i.e. creating a subvolume: */
+void bch2_dirent_neg_cache_flush(struct bch_fs *c)
+{
+	struct bch_dirent_neg_bucket *b;
+
+	atomic64_inc(&c->dirent_neg_cache.seq);
+
+	if (!c->dirent_neg_cache.buckets)
+		return;
+
+	for (b = c->dirent_neg_cache.buckets;
+	     b < c->dirent_neg_cache.buckets + BCH_DIRENT_NEG_BUCKETS;
+	     b++) {
+		spin_lock(&b->lock);
+		memset(b->e, 0, sizeof(b->e));
+		spin_unlock(&b->lock);
+	}
+}
+
 int bch2_dirent_create(struct btree_trans *trans, subvol_inum dir,
 		       const struct bch_hash_info *hash_info,
 		       u8 type, const struct qstr *name, u64 dst_inum,
@@ -203,6 +320,8 @@ int bch2_dirent_create(struct btree_trans *trans, subvol_inum dir,
 	if (ret)
 		return ret;
 
+	dirent_neg_cache_invalidate(trans->c, dir, name);
+
 	ret = bch2_hash_set(trans, bch2_dirent_hash_desc, hash_info,
 			    dir, &dirent->k_i, flags);
 	*dir_offset = dirent->k.p.offset;
@@ -260,6 +379,8 @@ int bch2_dirent_rename(struct btree_trans *trans,
 	if (src_dir.subvol != dst_dir.subvol)
 		return -EXDEV;
 
+	dirent_neg_cache_invalidate(trans->c, dst_dir, dst_name);
+
 	memset(src_inum, 0, sizeof(*src_inum));
 	memset(dst_inum, 0, sizeof(*dst_inum));
 
@@ -463,8 +584,12 @@ u64 bch2_dirent_lookup(struct bch_fs *c, subvol_inum dir,
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
+	u64 seq = atomic64_read(&c->dirent_neg_cache.seq);
 	int ret;
 
+	if (dirent_neg_cache_lookup(c, dir, name))
+		return -ENOENT;
+
 	bch2_trans_init(&trans, c, 0, 0);
 retry:
 	bch2_trans_begin(&trans);
@@ -476,6 +601,9 @@ retry:
 	if (!ret)
 		bch2_trans_iter_exit(&trans, &iter);
 	bch2_trans_exit(&trans);
+
+	if (ret == -ENOENT)
+		dirent_neg_cache_add(c, dir, name, seq);
 	return ret;
 }
 
@@ -522,7 +650,7 @@ retry:
 
 	for_each_btree_key_upto_norestart(&trans, iter, BTREE_ID_dirents,
 			   SPOS(inum.inum, ctx->pos, snapshot),
-			   POS(inum.inum, U64_MAX), 0, k, ret) {
+			   POS(inum.inum, U64_MAX), BTREE_ITER_PREFETCH, k, ret) {
 		if (k.k->type != KEY_TYPE_dirent)
 			continue;
 
@@ -563,3 +691,194 @@ err:
 
 	return ret;
 }
+
+static int readdir_entry_inum_cmp(const void *_l, const void *_r)
+{
+	const struct bch_readdir_entry *l = *((struct bch_readdir_entry **) _l);
+	const struct bch_readdir_entry *r = *((struct bch_readdir_entry **) _r);
+
+	return cmp_int(l->target.subvol, r->target.subvol) ?:
+		cmp_int(l->target.inum, r->target.inum);
+}
+
+static int readdir_entry_set_inode(struct bch_readdir_entry *e, struct bkey_s_c k)
+{
+	if (!bkey_is_inode(k.k)) {
+		/* raced with an unlink: skip it */
+		e->inode.bi_inum = 0;
+		return 0;
+	}
+
+	return bch2_inode_unpack(k, &e->inode);
+}
+
+/*
+ * Look up the inodes for entries [start, end) of @order, which all have the
+ * same target subvolume, with one multiget:
+ */
+static int readdir_plus_lookup_inodes(struct btree_trans *trans,
+				      struct bch_readdir_entry **order,
+				      unsigned start, unsigned end)
+{
+	struct bpos pos[BCH_READDIR_BATCH];
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u32 snapshot;
+	unsigned i;
+	int ret;
+
+	ret = bch2_subvolume_get_snapshot(trans, order[start]->target.subvol, &snapshot);
+	if (ret)
+		return ret;
+
+	for (i = start; i < end; i++)
+		pos[i - start] = SPOS(0, order[i]->target.inum, snapshot);
+
+	return for_each_btree_key_multiget(trans, iter, BTREE_ID_inodes,
+					   pos, end - start, 0, i, k,
+		readdir_entry_set_inode(order[start + i], k));
+}
+
+/*
+ * Read the next batch of dirents starting from @pos, then look up their
+ * inodes:
+ */
+static int readdir_plus_fill(struct btree_trans *trans, subvol_inum dir,
+			     struct bch_readdir_cursor *cur, u64 pos)
+{
+	struct bch_readdir_entry *order[BCH_READDIR_BATCH], *e;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent dirent;
+	subvol_inum target;
+	u32 snapshot;
+	unsigned i, j;
+	int ret;
+
+	cur->pos	= pos;
+	cur->nr		= 0;
+	cur->idx	= 0;
+
+	ret = bch2_subvolume_get_snapshot(trans, dir.subvol, &snapshot);
+	if (ret)
+		return ret;
+
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_dirents,
+			   SPOS(dir.inum, pos, snapshot),
+			   POS(dir.inum, U64_MAX), BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		dirent = bkey_s_c_to_dirent(k);
+
+		ret = bch2_dirent_read_target(trans, dir, dirent, &target);
+		if (ret < 0)
+			break;
+		if (ret) {
+			ret = 0;
+			continue;
+		}
+
+		e = cur->entries + cur->nr;
+		e->pos		= dirent.k->p.offset;
+		e->target	= target;
+		e->d_type	= vfs_d_type(dirent.v->d_type);
+		e->name_len	= bch2_dirent_name_bytes(dirent);
+		memcpy(e->name, dirent.v->d_name, e->name_len);
+
+		if (++cur->nr == BCH_READDIR_BATCH)
+			break;
+
+		ret = btree_trans_too_many_iters(trans);
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (ret)
+		return ret;
+
+	/*
+	 * Look up the inodes in inode number order: inodes created together are
+	 * usually in the same btree node, and we walk the inodes btree forwards
+	 * instead of jumping around in hash order - and the multiget starts the
+	 * reads for all the leaves we'll need up front:
+	 */
+	for (i = 0; i < cur->nr; i++)
+		order[i] = cur->entries + i;
+	sort(order, cur->nr, sizeof(order[0]), readdir_entry_inum_cmp, NULL);
+
+	for (i = 0; i < cur->nr; i = j) {
+		for (j = i + 1;
+		     j < cur->nr && order[j]->target.subvol == order[i]->target.subvol;
+		     j++)
+			;
+
+		ret = readdir_plus_lookup_inodes(trans, order, i, j);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Like bch2_readdir(), but returns the target inode of each entry - looked up
+ * a batch at a time - and @fn is called without btree locks held.
+ */
+int bch2_readdir_plus(struct bch_fs *c, subvol_inum dir,
+		      struct bch_readdir_cursor *cur, u64 pos,
+		      bch_readdir_plus_fn fn, void *arg)
+{
+	struct btree_trans trans;
+	struct bch_readdir_entry *e;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	while (1) {
+		if (pos != cur->pos || cur->idx >= cur->nr) {
+			ret = lockrestart_do(&trans,
+				readdir_plus_fill(&trans, dir, cur, pos));
+			bch2_trans_unlock(&trans);
+
+			if (ret || !cur->nr)
+				break;
+		}
+
+		e = cur->entries + cur->idx;
+
+		if (e->inode.bi_inum && fn(arg, e))
+			break;
+
+		cur->idx++;
+		pos = cur->pos = e->pos + 1;
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+void bch2_fs_dirent_exit(struct bch_fs *c)
+{
+	kvpfree(c->dirent_neg_cache.buckets,
+		sizeof(struct bch_dirent_neg_bucket) * BCH_DIRENT_NEG_BUCKETS);
+	c->dirent_neg_cache.buckets = NULL;
+}
+
+int bch2_fs_dirent_init(struct bch_fs *c)
+{
+	unsigned i;
+
+	atomic64_set(&c->dirent_neg_cache.seq, 0);
+
+	c->dirent_neg_cache.buckets =
+		kvpmalloc(sizeof(struct bch_dirent_neg_bucket) * BCH_DIRENT_NEG_BUCKETS,
+			  GFP_KERNEL|__GFP_ZERO);
+	if (!c->dirent_neg_cache.buckets)
+		return -ENOMEM;
+
+	for (i = 0; i < BCH_DIRENT_NEG_BUCKETS; i++)
+		spin_lock_init(&c->dirent_neg_cache.buckets[i].lock);
+	return 0;
+}
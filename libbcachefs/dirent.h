@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_DIRENT_H
 #define _BCACHEFS_DIRENT_H
 
+#include "inode.h"
 #include "str_hash.h"
 
 extern const struct bch_hash_desc bch2_dirent_hash_desc;
@@ -61,7 +62,44 @@ u64 bch2_dirent_lookup(struct bch_fs *, subvol_inum,
 		       const struct bch_hash_info *,
 		       const struct qstr *, subvol_inum *);
 
+void bch2_dirent_neg_cache_flush(struct bch_fs *);
+
 int bch2_empty_dir_trans(struct btree_trans *, subvol_inum);
 int bch2_readdir(struct bch_fs *, subvol_inum, struct dir_context *);
 
+#define BCH_READDIR_BATCH	64
+
+struct bch_readdir_entry {
+	u64			pos;
+	subvol_inum		target;
+	struct bch_inode_unpacked inode;
+	u8			d_type;
+	u8			name_len;
+	char			name[BCH_NAME_MAX];
+};
+
+/*
+ * For readdir with the target inodes (readdirplus): kept across calls on the
+ * same open directory, so that entries we looked up that didn't fit in the
+ * previous call's buffer don't have to be looked up again.
+ *
+ * @pos is the position the next entry will be returned from, @entries[@idx] is
+ * that entry if it's been read:
+ */
+struct bch_readdir_cursor {
+	u64			pos;
+	unsigned		nr;
+	unsigned		idx;
+	struct bch_readdir_entry entries[BCH_READDIR_BATCH];
+};
+
+/* Return nonzero to stop, e.g. when the caller's buffer is full: */
+typedef int (*bch_readdir_plus_fn)(void *, struct bch_readdir_entry *);
+
+int bch2_readdir_plus(struct bch_fs *, subvol_inum, struct bch_readdir_cursor *,
+		      u64, bch_readdir_plus_fn, void *);
+
+void bch2_fs_dirent_exit(struct bch_fs *);
+int bch2_fs_dirent_init(struct bch_fs *);
+
 #endif /* _BCACHEFS_DIRENT_H */
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_DIRENT_TYPES_H
+#define _BCACHEFS_DIRENT_TYPES_H
+
+#include <linux/spinlock.h>
+
+/*
+ * Negative dirent cache: names recently looked up and found not to exist, so
+ * that repeated failing lookups (build systems, $PATH searches) don't walk the
+ * dirents btree. Longer names aren't cached.
+ */
+#define BCH_DIRENT_NEG_NAME_MAX		43
+#define BCH_DIRENT_NEG_WAYS		4
+#define BCH_DIRENT_NEG_BUCKETS_BITS	8
+#define BCH_DIRENT_NEG_BUCKETS		(1U << BCH_DIRENT_NEG_BUCKETS_BITS)
+
+struct bch_dirent_neg_entry {
+	u64			dir;
+	u32			subvol;
+	/* 0 if unused: */
+	u8			name_len;
+	char			name[BCH_DIRENT_NEG_NAME_MAX];
+};
+
+struct bch_dirent_neg_bucket {
+	spinlock_t		lock;
+	unsigned		next;
+	struct bch_dirent_neg_entry e[BCH_DIRENT_NEG_WAYS];
+};
+
+struct bch_dirent_neg_cache {
+	/*
+	 * Bumped on every dirent create: a lookup only adds an entry if no
+	 * create happened since it started
+	 */
+	atomic64_t		seq;
+	struct bch_dirent_neg_bucket *buckets;
+};
+
+#endif /* _BCACHEFS_DIRENT_TYPES_H */
@@ -54,7 +54,43 @@ static inline struct target target_decode(unsigned target)
 	return (struct target) { .type = TARGET_NULL };
 }
 
-const struct bch_devs_mask *bch2_target_to_mask(struct bch_fs *, unsigned);
+/*
+ * The devices in each disk group, including those in child groups, are
+ * precomputed by bch2_sb_disk_groups_to_cpu(), so these are just a lookup:
+ * must be called under rcu_read_lock().
+ */
+static inline const struct bch_devs_mask *bch2_target_to_mask(struct bch_fs *c,
+							      unsigned target)
+{
+	struct target t = target_decode(target);
+
+	switch (t.type) {
+	case TARGET_NULL:
+		return NULL;
+	case TARGET_DEV: {
+		struct bch_dev *ca = t.dev < c->sb.nr_devices
+			? rcu_dereference(c->devs[t.dev])
+			: NULL;
+		return ca ? &ca->self : NULL;
+	}
+	case TARGET_GROUP: {
+		struct bch_disk_groups_cpu *g = rcu_dereference(c->disk_groups);
+
+		return g && t.group < g->nr && !g->entries[t.group].deleted
+			? &g->entries[t.group].devs
+			: NULL;
+	}
+	default:
+		BUG();
+	}
+}
+
+/* For testing many devices against a mask from bch2_target_to_mask(): */
+static inline bool bch2_dev_in_target_mask(const struct bch_devs_mask *m,
+					   unsigned dev)
+{
+	return m && test_bit(dev, m->d);
+}
 
 static inline struct bch_devs_mask target_rw_devs(struct bch_fs *c,
 						  enum bch_data_type data_type,
@@ -68,7 +104,21 @@ static inline struct bch_devs_mask target_rw_devs(struct bch_fs *c,
 	return devs;
 }
 
-bool bch2_dev_in_target(struct bch_fs *, unsigned, unsigned);
+static inline bool bch2_dev_in_target(struct bch_fs *c, unsigned dev,
+				      unsigned target)
+{
+	struct target t = target_decode(target);
+	bool ret;
+
+	if (t.type != TARGET_GROUP)
+		return t.type == TARGET_DEV && dev == t.dev;
+
+	rcu_read_lock();
+	ret = bch2_dev_in_target_mask(bch2_target_to_mask(c, target), dev);
+	rcu_read_unlock();
+
+	return ret;
+}
 
 int bch2_disk_path_find(struct bch_sb_handle *, const char *);
 
@@ -20,6 +20,7 @@
 #include "super-io.h"
 #include "util.h"
 
+#include <linux/kthread.h>
 #include <linux/sort.h>
 
 #ifdef __KERNEL__
@@ -98,6 +99,8 @@ struct ec_bio {
 	struct bch_dev		*ca;
 	struct ec_stripe_buf	*buf;
 	size_t			idx;
+	u64			submit_time;
+	enum bch_data_type	data_type;
 	struct bio		bio;
 };
 
@@ -237,8 +240,8 @@ err:
 
 /* Checksumming: */
 
-static struct bch_csum ec_block_checksum(struct ec_stripe_buf *buf,
-					 unsigned block, unsigned offset)
+static struct bch_csum_buf ec_block_csum_buf(struct ec_stripe_buf *buf,
+					     unsigned block, unsigned offset)
 {
 	struct bch_stripe *v = &buf->key.v;
 	unsigned csum_granularity = 1 << v->csum_granularity_bits;
@@ -251,15 +254,21 @@ static struct bch_csum ec_block_checksum(struct ec_stripe_buf *buf,
 	BUG_ON(offset + len != le16_to_cpu(v->sectors) &&
 	       (len & (csum_granularity - 1)));
 
-	return bch2_checksum(NULL, v->csum_type,
-			     null_nonce(),
-			     buf->data[block] + ((offset - buf->offset) << 9),
-			     len << 9);
+	return (struct bch_csum_buf) {
+		.nonce	= null_nonce(),
+		.data	= buf->data[block] + ((offset - buf->offset) << 9),
+		.len	= len << 9,
+	};
 }
 
+/*
+ * Blocks are checksummed a row (one checksum granularity's worth of every
+ * block) at a time, so that the checksums can be computed in parallel:
+ */
 static void ec_generate_checksums(struct ec_stripe_buf *buf)
 {
 	struct bch_stripe *v = &buf->key.v;
+	struct bch_csum_buf bufs[BCH_BKEY_PTRS_MAX];
 	unsigned i, j, csums_per_device = stripe_csums_per_device(v);
 
 	if (!v->csum_type)
@@ -268,33 +277,47 @@ static void ec_generate_checksums(struct ec_stripe_buf *buf)
 	BUG_ON(buf->offset);
 	BUG_ON(buf->size != le16_to_cpu(v->sectors));
 
-	for (i = 0; i < v->nr_blocks; i++)
-		for (j = 0; j < csums_per_device; j++)
-			stripe_csum_set(v, i, j,
-				ec_block_checksum(buf, i, j << v->csum_granularity_bits));
+	for (j = 0; j < csums_per_device; j++) {
+		for (i = 0; i < v->nr_blocks; i++)
+			bufs[i] = ec_block_csum_buf(buf, i,
+					j << v->csum_granularity_bits);
+
+		bch2_checksum_bufs(NULL, v->csum_type, bufs, v->nr_blocks);
+
+		for (i = 0; i < v->nr_blocks; i++)
+			stripe_csum_set(v, i, j, bufs[i].csum);
+	}
 }
 
 static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
 {
 	struct bch_stripe *v = &buf->key.v;
+	struct bch_csum_buf bufs[BCH_BKEY_PTRS_MAX];
+	unsigned blocks[BCH_BKEY_PTRS_MAX];
 	unsigned csum_granularity = 1 << v->csum_granularity_bits;
-	unsigned i;
+	unsigned offset = buf->offset;
+	unsigned end = buf->offset + buf->size;
+	unsigned i, nr;
 
 	if (!v->csum_type)
 		return;
 
-	for (i = 0; i < v->nr_blocks; i++) {
-		unsigned offset = buf->offset;
-		unsigned end = buf->offset + buf->size;
+	while (offset < end) {
+		unsigned j = offset >> v->csum_granularity_bits;
+		unsigned len = min(csum_granularity, end - offset);
 
-		if (!test_bit(i, buf->valid))
-			continue;
+		nr = 0;
+		for (i = 0; i < v->nr_blocks; i++)
+			if (test_bit(i, buf->valid)) {
+				blocks[nr] = i;
+				bufs[nr++] = ec_block_csum_buf(buf, i, offset);
+			}
+
+		bch2_checksum_bufs(c, v->csum_type, bufs, nr);
 
-		while (offset < end) {
-			unsigned j = offset >> v->csum_granularity_bits;
-			unsigned len = min(csum_granularity, end - offset);
-			struct bch_csum want = stripe_csum_get(v, i, j);
-			struct bch_csum got = ec_block_checksum(buf, i, offset);
+		for (i = 0; i < nr; i++) {
+			struct bch_csum want = stripe_csum_get(v, blocks[i], j);
+			struct bch_csum got = bufs[i].csum;
 
 			if (bch2_crc_cmp(want, got)) {
 				struct printbuf buf2 = PRINTBUF;
@@ -303,15 +326,14 @@ static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
 
 				bch_err_ratelimited(c,
 					"stripe checksum error for %ps at %u:%u: csum type %u, expected %llx got %llx\n%s",
-					(void *) _RET_IP_, i, j, v->csum_type,
+					(void *) _RET_IP_, blocks[i], j, v->csum_type,
 					want.lo, got.lo, buf2.buf);
 				printbuf_exit(&buf2);
-				clear_bit(i, buf->valid);
-				break;
+				clear_bit(blocks[i], buf->valid);
 			}
-
-			offset += len;
 		}
+
+		offset += len;
 	}
 }
 
@@ -375,16 +397,19 @@ static void ec_block_endio(struct bio *bio)
 		clear_bit(ec_bio->idx, ec_bio->buf->valid);
 	}
 
+	bch2_latency_acct(ca, ec_bio->submit_time, bio_data_dir(bio),
+			  ec_bio->data_type);
 	bio_put(&ec_bio->bio);
 	percpu_ref_put(&ca->io_ref);
 	closure_put(cl);
 }
 
-static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
-			unsigned rw, unsigned idx, struct closure *cl)
+static void __ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
+			  unsigned rw, unsigned idx,
+			  unsigned offset, unsigned bytes,
+			  struct closure *cl)
 {
 	struct bch_stripe *v = &buf->key.v;
-	unsigned offset = 0, bytes = buf->size << 9;
 	struct bch_extent_ptr *ptr = &v->ptrs[idx];
 	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 	enum bch_data_type data_type = idx < buf->key.v.nr_blocks - buf->key.v.nr_redundant
@@ -404,11 +429,11 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 		return;
 	}
 
-	this_cpu_add(ca->io_done->sectors[rw][data_type], buf->size);
+	this_cpu_add(ca->io_done->sectors[rw][data_type], (bytes - offset) >> 9);
 
 	while (offset < bytes) {
 		unsigned nr_iovecs = min_t(size_t, BIO_MAX_VECS,
-					   DIV_ROUND_UP(bytes, PAGE_SIZE));
+					   DIV_ROUND_UP(bytes - offset, PAGE_SIZE));
 		unsigned b = min_t(size_t, bytes - offset,
 				   nr_iovecs << PAGE_SHIFT);
 		struct ec_bio *ec_bio;
@@ -423,6 +448,7 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 		ec_bio->ca			= ca;
 		ec_bio->buf			= buf;
 		ec_bio->idx			= idx;
+		ec_bio->data_type		= data_type;
 
 		ec_bio->bio.bi_iter.bi_sector	= ptr->offset + buf->offset + (offset >> 9);
 		ec_bio->bio.bi_end_io		= ec_block_endio;
@@ -433,6 +459,7 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 		closure_get(cl);
 		percpu_ref_get(&ca->io_ref);
 
+		ec_bio->submit_time		= local_clock();
 		submit_bio(&ec_bio->bio);
 
 		offset += b;
@@ -441,6 +468,12 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 	percpu_ref_put(&ca->io_ref);
 }
 
+static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
+			unsigned rw, unsigned idx, struct closure *cl)
+{
+	__ec_block_io(c, buf, rw, idx, 0, buf->size << 9, cl);
+}
+
 static int get_stripe_key(struct bch_fs *c, u64 idx, struct ec_stripe_buf *stripe)
 {
 	struct btree_trans trans;
@@ -466,13 +499,95 @@ err:
 	return ret;
 }
 
+static bool stripe_keys_eq(struct bkey_i_stripe *l, struct bkey_i_stripe *r)
+{
+	return  bkey_val_bytes(&l->k) == bkey_val_bytes(&r->k) &&
+		!memcmp(&l->v, &r->v, bkey_val_bytes(&l->k));
+}
+
+static bool ec_recov_cache_read(struct bch_fs *c, struct bch_read_bio *rbio,
+				u64 idx, struct bkey_i_stripe *key,
+				unsigned offset)
+{
+	struct ec_recov_cache_entry *e;
+	bool ret = false;
+
+	mutex_lock(&c->ec_recov_cache_lock);
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++) {
+		struct ec_stripe_buf *buf = e->buf;
+
+		if (!buf ||
+		    e->idx != idx ||
+		    offset < buf->offset ||
+		    offset + bio_sectors(&rbio->bio) > buf->offset + buf->size ||
+		    !stripe_keys_eq(&buf->key, key))
+			continue;
+
+		memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
+			      buf->data[rbio->pick.ec.block] +
+			      ((offset - buf->offset) << 9));
+		e->last_used = jiffies;
+		ret = true;
+		break;
+	}
+	mutex_unlock(&c->ec_recov_cache_lock);
+
+	return ret;
+}
+
+/* Takes ownership of @buf: */
+static void ec_recov_cache_add(struct bch_fs *c, u64 idx,
+			       struct ec_stripe_buf *buf)
+{
+	struct ec_recov_cache_entry *e, *victim = c->ec_recov_cache;
+
+	mutex_lock(&c->ec_recov_cache_lock);
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++) {
+		if (!e->buf) {
+			victim = e;
+			break;
+		}
+
+		if (time_before(e->last_used, victim->last_used))
+			victim = e;
+	}
+
+	swap(victim->buf, buf);
+	victim->idx		= idx;
+	victim->last_used	= jiffies;
+	mutex_unlock(&c->ec_recov_cache_lock);
+
+	if (buf) {
+		ec_stripe_buf_exit(buf);
+		kfree(buf);
+	}
+}
+
+static void ec_recov_cache_exit(struct bch_fs *c)
+{
+	struct ec_recov_cache_entry *e;
+
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++)
+		if (e->buf) {
+			ec_stripe_buf_exit(e->buf);
+			kfree(e->buf);
+			e->buf = NULL;
+		}
+}
+
 /* recovery read path: */
 int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
 {
 	struct ec_stripe_buf *buf;
 	struct closure cl;
 	struct bch_stripe *v;
-	unsigned i, offset;
+	unsigned i, offset, start, end;
 	int ret = 0;
 
 	closure_init_stack(&cl);
@@ -508,7 +623,19 @@ int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
 		goto err;
 	}
 
-	ret = ec_stripe_buf_init(buf, offset, bio_sectors(&rbio->bio));
+	if (ec_recov_cache_read(c, rbio, rbio->pick.ec.idx, &buf->key, offset))
+		goto err;
+
+	/*
+	 * Reconstruct a bit more than we need, so that reads of neighbouring
+	 * extents hit in the cache:
+	 */
+	start	= round_down(offset, EC_RECOV_CACHE_SECTORS);
+	end	= min_t(unsigned, le16_to_cpu(v->sectors),
+			round_up(offset + bio_sectors(&rbio->bio),
+				 EC_RECOV_CACHE_SECTORS));
+
+	ret = ec_stripe_buf_init(buf, start, end - start);
 	if (ret)
 		goto err;
 
@@ -532,12 +659,208 @@ int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
 
 	memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
 		      buf->data[rbio->pick.ec.block] + ((offset - buf->offset) << 9));
+
+	ec_recov_cache_add(c, rbio->pick.ec.idx, buf);
+	return 0;
 err:
 	ec_stripe_buf_exit(buf);
 	kfree(buf);
 	return ret;
 }
 
+/* scrub: */
+
+#define EC_SCRUB_PARALLEL	4
+
+/*
+ * Without stripe checksums, the best we can do is check that parity matches
+ * the data - and if it doesn't, assume the parity is bad:
+ */
+static int ec_verify_parity(struct ec_stripe_buf *buf)
+{
+	struct bch_stripe *v = &buf->key.v;
+	unsigned i, nr_data = v->nr_blocks - v->nr_redundant;
+	unsigned bytes = buf->size << 9;
+	void *old[BCH_BKEY_PTRS_MAX];
+
+	for (i = nr_data; i < v->nr_blocks; i++) {
+		old[i] = buf->data[i];
+		buf->data[i] = kvpmalloc(bytes, GFP_KERNEL);
+		if (!buf->data[i]) {
+			buf->data[i] = old[i];
+			while (--i >= nr_data) {
+				kvpfree(buf->data[i], bytes);
+				buf->data[i] = old[i];
+			}
+			return -ENOMEM;
+		}
+	}
+
+	ec_generate_ec(buf);
+
+	for (i = nr_data; i < v->nr_blocks; i++) {
+		if (memcmp(old[i], buf->data[i], bytes))
+			clear_bit(i, buf->valid);
+		kvpfree(old[i], bytes);
+	}
+
+	return 0;
+}
+
+static void ec_scrub_stripe(struct bch_fs *c, struct ec_stripe_buf *buf)
+{
+	struct bch_stripe *v = &buf->key.v;
+	struct ec_stripe_buf *cur;
+	unsigned long bad[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
+	unsigned i, nr_data = v->nr_blocks - v->nr_redundant, nr_bad;
+	struct closure cl;
+	u64 idx = buf->key.k.p.offset;
+
+	ec_validate_checksums(c, buf);
+
+	if (!v->csum_type && !ec_nr_failed(buf) &&
+	    ec_verify_parity(buf))
+		return;
+
+	nr_bad = ec_nr_failed(buf);
+	if (!nr_bad)
+		return;
+
+	if (nr_bad > v->nr_redundant) {
+		bch_err_ratelimited(c, "stripe %llu: %u bad blocks, unable to repair",
+				    idx, nr_bad);
+		return;
+	}
+
+	bitmap_complement(bad, buf->valid, v->nr_blocks);
+
+	if (find_first_bit(bad, nr_data) < nr_data &&
+	    ec_do_recov(c, buf))
+		return;
+
+	ec_generate_ec(buf);
+
+	/*
+	 * Don't write to the stripe's buckets if it's been deleted or changed
+	 * since we read it - the buckets may have been reused:
+	 */
+	cur = kzalloc(sizeof(*cur), GFP_KERNEL);
+	if (!cur)
+		return;
+
+	if (get_stripe_key(c, idx, cur) ||
+	    !stripe_keys_eq(&cur->key, &buf->key) ||
+	    !percpu_ref_tryget_live(&c->writes))
+		goto out;
+
+	closure_init_stack(&cl);
+
+	for_each_set_bit(i, bad, v->nr_blocks)
+		ec_block_io(c, buf, REQ_OP_WRITE, i, &cl);
+	closure_sync(&cl);
+
+	percpu_ref_put(&c->writes);
+
+	bch_info(c, "stripe %llu: repaired %u blocks", idx, nr_bad);
+out:
+	kfree(cur);
+}
+
+static int ec_scrub_next_stripes(struct btree_trans *trans, u64 *idx,
+				 struct ec_stripe_buf **bufs, unsigned *nr)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	*nr = 0;
+
+	for_each_btree_key_norestart(trans, iter, BTREE_ID_stripes,
+				     POS(0, *idx), 0, k, ret) {
+		if (k.k->type != KEY_TYPE_stripe)
+			continue;
+
+		bkey_reassemble(&bufs[*nr]->key.k_i, k);
+		*idx = k.k->p.offset + 1;
+
+		if (++*nr == EC_SCRUB_PARALLEL)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+/*
+ * Read every stripe, verify the checksums of data and parity blocks (or, for
+ * stripes without checksums, that parity matches), and rewrite blocks that
+ * are bad. EC_SCRUB_PARALLEL stripes are read at a time:
+ */
+int bch2_ec_scrub(struct bch_fs *c, struct bch_move_stats *stats)
+{
+	struct ec_stripe_buf *bufs[EC_SCRUB_PARALLEL] = { NULL };
+	struct btree_trans trans;
+	struct closure cl;
+	u64 idx = 0;
+	unsigned i, j, nr;
+	int ret = 0;
+
+	stats->data_type	= BCH_DATA_parity;
+	stats->btree_id		= BTREE_ID_stripes;
+
+	for (i = 0; i < EC_SCRUB_PARALLEL; i++) {
+		bufs[i] = kzalloc(sizeof(*bufs[i]), GFP_KERNEL);
+		if (!bufs[i]) {
+			ret = -ENOMEM;
+			goto err;
+		}
+	}
+
+	bch2_trans_init(&trans, c, 0, 0);
+	closure_init_stack(&cl);
+
+	while (!kthread_should_stop()) {
+		ret = lockrestart_do(&trans,
+				ec_scrub_next_stripes(&trans, &idx, bufs, &nr));
+		bch2_trans_unlock(&trans);
+		if (ret || !nr)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			struct bch_stripe *v = &bufs[i]->key.v;
+
+			ret = ec_stripe_buf_init(bufs[i], 0, le16_to_cpu(v->sectors));
+			if (ret)
+				break;
+
+			for (j = 0; j < v->nr_blocks; j++)
+				ec_block_io(c, bufs[i], REQ_OP_READ, j, &cl);
+		}
+		closure_sync(&cl);
+
+		nr = i;
+		for (i = 0; i < nr; i++) {
+			struct bch_stripe *v = &bufs[i]->key.v;
+
+			ec_scrub_stripe(c, bufs[i]);
+
+			stats->pos = bufs[i]->key.k.p;
+			atomic64_add(le16_to_cpu(v->sectors) * v->nr_blocks,
+				     &stats->sectors_seen);
+			ec_stripe_buf_exit(bufs[i]);
+		}
+
+		if (ret)
+			break;
+	}
+
+	bch2_trans_exit(&trans);
+err:
+	for (i = 0; i < EC_SCRUB_PARALLEL; i++)
+		kfree(bufs[i]);
+	return ret;
+}
+
 /* stripe bucket accounting: */
 
 static int __ec_stripe_mem_alloc(struct bch_fs *c, size_t idx, gfp_t gfp)
@@ -928,6 +1251,41 @@ static int ec_stripe_update_extents(struct bch_fs *c, struct ec_stripe_buf *s)
 /*
  * data buckets of new stripe all written: create the stripe
  */
+/*
+ * A data bucket may have been taken off its write point before it was full -
+ * because the stripe was flushed, or the write point was stopped. What's on
+ * disk past the end of the data isn't what's in our buffer, so zero the rest
+ * of the block and write it out, so that parity computed from the buffer
+ * matches the disk:
+ */
+static void ec_stripe_pad_blocks(struct ec_stripe_new *s)
+{
+	struct bch_fs *c = s->c;
+	struct ec_stripe_buf *buf = &s->new_stripe;
+	unsigned i;
+
+	for (i = 0; i < s->nr_data; i++) {
+		struct open_bucket *ob;
+		struct bch_dev *ca;
+		unsigned offset;
+
+		if (!s->blocks[i])
+			continue;
+
+		ob	= c->open_buckets + s->blocks[i];
+		ca	= bch_dev_bkey_exists(c, ob->dev);
+		offset	= ca->mi.bucket_size - ob->sectors_free;
+
+		if (!ob->sectors_free || offset >= buf->size)
+			continue;
+
+		memset(buf->data[i] + (offset << 9), 0,
+		       (buf->size - offset) << 9);
+		__ec_block_io(c, buf, REQ_OP_WRITE, i,
+			      offset << 9, buf->size << 9, &s->iodone);
+	}
+}
+
 static void ec_stripe_create(struct ec_stripe_new *s)
 {
 	struct bch_fs *c = s->c;
@@ -968,6 +1326,14 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	if (!percpu_ref_tryget_live(&c->writes))
 		goto err;
 
+	ec_stripe_pad_blocks(s);
+	closure_sync(&s->iodone);
+
+	if (ec_nr_failed(&s->new_stripe)) {
+		bch_err(c, "error creating stripe: error padding data buckets");
+		goto err_put_writes;
+	}
+
 	ec_generate_ec(&s->new_stripe);
 
 	ec_generate_checksums(&s->new_stripe);
@@ -1060,23 +1426,64 @@ static void ec_stripe_set_pending(struct bch_fs *c, struct ec_stripe_head *h)
 
 	h->s		= NULL;
 	s->pending	= true;
+	s->pending_time	= jiffies;
 
 	mutex_lock(&c->ec_stripe_new_lock);
 	list_add(&s->list, &c->ec_stripe_new_list);
 	mutex_unlock(&c->ec_stripe_new_lock);
 
+	if (c->opts.ec_stripe_flush_delay)
+		queue_delayed_work(system_long_wq, &c->ec_stripe_flush_work,
+				   msecs_to_jiffies(c->opts.ec_stripe_flush_delay));
+
 	ec_stripe_new_put(c, s);
 }
 
-/* have a full bucket - hand it off to be erasure coded: */
-void bch2_ec_bucket_written(struct bch_fs *c, struct open_bucket *ob)
+/*
+ * Stripes are created once all their data buckets have been filled, which can
+ * take a long time with slow writers - meanwhile the data stays replicated. If
+ * a stripe has been waiting on its buckets for longer than
+ * ec_stripe_flush_delay, take its buckets off the write points they're on:
+ * ec_stripe_create() will pad them out.
+ */
+static void ec_stripe_flush_work(struct work_struct *work)
 {
-	struct ec_stripe_new *s = ob->ec;
+	struct bch_fs *c = container_of(to_delayed_work(work),
+		struct bch_fs, ec_stripe_flush_work);
+	unsigned long delay = msecs_to_jiffies(c->opts.ec_stripe_flush_delay);
+	unsigned long next = 0;
+	struct ec_stripe_new *s;
+	bool flush = false;
 
-	if (ob->sectors_free)
-		s->err = -1;
+	if (!delay)
+		return;
 
-	ec_stripe_new_put(c, s);
+	mutex_lock(&c->ec_stripe_new_lock);
+	list_for_each_entry(s, &c->ec_stripe_new_list, list) {
+		if (s->flushing)
+			continue;
+
+		if (time_after_eq(jiffies, s->pending_time + delay)) {
+			WRITE_ONCE(s->flushing, true);
+			flush = true;
+		} else if (!next || time_before(s->pending_time + delay, next)) {
+			next = s->pending_time + delay;
+		}
+	}
+	mutex_unlock(&c->ec_stripe_new_lock);
+
+	if (flush)
+		bch2_writepoints_stop_ec_flushing(c);
+
+	if (next)
+		queue_delayed_work(system_long_wq, &c->ec_stripe_flush_work,
+				   next - jiffies);
+}
+
+/* have a full bucket - hand it off to be erasure coded: */
+void bch2_ec_bucket_written(struct bch_fs *c, struct open_bucket *ob)
+{
+	ec_stripe_new_put(c, ob->ec);
 }
 
 void bch2_ec_bucket_cancel(struct bch_fs *c, struct open_bucket *ob)
@@ -1658,6 +2065,9 @@ void bch2_fs_ec_exit(struct bch_fs *c)
 		kfree(h);
 	}
 
+	cancel_delayed_work_sync(&c->ec_stripe_flush_work);
+	ec_recov_cache_exit(c);
+
 	BUG_ON(!list_empty(&c->ec_stripe_new_list));
 
 	free_heap(&c->ec_stripes_heap);
@@ -1669,6 +2079,8 @@ void bch2_fs_ec_init_early(struct bch_fs *c)
 {
 	INIT_WORK(&c->ec_stripe_create_work, ec_stripe_create_work);
 	INIT_WORK(&c->ec_stripe_delete_work, ec_stripe_delete_work);
+	INIT_DELAYED_WORK(&c->ec_stripe_flush_work, ec_stripe_flush_work);
+	mutex_init(&c->ec_recov_cache_lock);
 }
 
 int bch2_fs_ec_init(struct bch_fs *c)
@@ -159,6 +159,9 @@ struct ec_stripe_new {
 	bool			allocated;
 	bool			pending;
 	bool			have_existing_stripe;
+	/* set by ec_stripe_flush_work(), buckets are being taken off write points: */
+	bool			flushing;
+	unsigned long		pending_time;
 
 	unsigned long		blocks_gotten[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
 	unsigned long		blocks_allocated[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
@@ -191,6 +194,9 @@ struct ec_stripe_head {
 
 int bch2_ec_read_extent(struct bch_fs *, struct bch_read_bio *);
 
+struct bch_move_stats;
+int bch2_ec_scrub(struct bch_fs *, struct bch_move_stats *);
+
 void *bch2_writepoint_ec_buf(struct bch_fs *, struct write_point *);
 
 void bch2_ec_bucket_written(struct bch_fs *, struct open_bucket *);
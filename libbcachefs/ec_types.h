@@ -43,4 +43,19 @@ struct ec_stripe_heap_entry {
 
 typedef HEAP(struct ec_stripe_heap_entry) ec_stripes_heap;
 
+struct ec_stripe_buf;
+
+/*
+ * Recently reconstructed stripe ranges, so that degraded reads of neighbouring
+ * extents in the same stripe share one reconstruction:
+ */
+#define EC_RECOV_CACHE_NR	4
+#define EC_RECOV_CACHE_SECTORS	256
+
+struct ec_recov_cache_entry {
+	u64			idx;
+	unsigned long		last_used;
+	struct ec_stripe_buf	*buf;
+};
+
 #endif /* _BCACHEFS_EC_TYPES_H */
@@ -72,6 +72,20 @@ void bch2_mark_io_failure(struct bch_io_failures *failed,
 	}
 }
 
+/*
+ * Expected time for a new read to complete on @ca: the recent average latency,
+ * scaled by the number of reads already queued ahead of it. The average alone
+ * lags behind load, so without the queue depth every reader piles onto the
+ * device that was fastest a moment ago:
+ */
+static inline u64 dev_read_cost(struct bch_fs *c, unsigned dev)
+{
+	struct bch_dev *ca = bch_dev_bkey_exists(c, dev);
+
+	return (atomic64_read(&ca->cur_latency[READ]) + 1) *
+		(atomic_read(&ca->reads_in_flight) + 1);
+}
+
 /*
  * returns true if p1 is better than p2:
  */
@@ -80,15 +94,14 @@ static inline bool ptr_better(struct bch_fs *c,
 			      const struct extent_ptr_decoded p2)
 {
 	if (likely(!p1.idx && !p2.idx)) {
-		struct bch_dev *dev1 = bch_dev_bkey_exists(c, p1.ptr.dev);
-		struct bch_dev *dev2 = bch_dev_bkey_exists(c, p2.ptr.dev);
-
-		u64 l1 = atomic64_read(&dev1->cur_latency[READ]);
-		u64 l2 = atomic64_read(&dev2->cur_latency[READ]);
+		u64 l1 = dev_read_cost(c, p1.ptr.dev);
+		u64 l2 = dev_read_cost(c, p2.ptr.dev);
 
-		/* Pick at random, biased in favor of the faster device: */
+		if (l1 != l2)
+			return l1 < l2;
 
-		return bch2_rand_range(l1 + l2) > l1;
+		/* Break ties at random, so idle devices share the load: */
+		return bch2_rand_range(2);
 	}
 
 	if (bch2_force_reconstruct_read)
@@ -111,6 +124,8 @@ int bch2_bkey_pick_read_device(struct bch_fs *c, struct bkey_s_c k,
 	struct extent_ptr_decoded p;
 	struct bch_dev_io_failures *f;
 	struct bch_dev *ca;
+	struct extent_ptr_decoded sample[2];
+	unsigned i, nr_direct = 0;
 	int ret = 0;
 
 	if (k.k->type == KEY_TYPE_error)
@@ -146,6 +161,20 @@ int bch2_bkey_pick_read_device(struct bch_fs *c, struct bkey_s_c k,
 		if (p.idx >= (unsigned) p.has_ec + 1)
 			continue;
 
+		/*
+		 * Of the replicas we can read directly, compare only two chosen
+		 * at random (power of two choices): if every reader compared
+		 * all of them they'd all pile onto the same device, which then
+		 * isn't the least loaded anymore. Reservoir sample two:
+		 */
+		if (!p.idx) {
+			i = nr_direct < 2 ? nr_direct : bch2_rand_range(nr_direct + 1);
+			if (i < 2)
+				sample[i] = p;
+			nr_direct++;
+			continue;
+		}
+
 		if (ret > 0 && !ptr_better(c, p, *pick))
 			continue;
 
@@ -153,6 +182,17 @@ int bch2_bkey_pick_read_device(struct bch_fs *c, struct bkey_s_c k,
 		ret = 1;
 	}
 
+	if (nr_direct) {
+		p = nr_direct > 1 && ptr_better(c, sample[1], sample[0])
+			? sample[1]
+			: sample[0];
+
+		if (ret <= 0 || ptr_better(c, p, *pick)) {
+			*pick = p;
+			ret = 1;
+		}
+	}
+
 	return ret;
 }
 
@@ -891,14 +931,22 @@ bool bch2_bkey_has_target(struct bch_fs *c, struct bkey_s_c k, unsigned target)
 {
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const struct bch_extent_ptr *ptr;
+	const struct bch_devs_mask *m;
+	bool ret = false;
+
+	rcu_read_lock();
+	m = bch2_target_to_mask(c, target);
 
 	bkey_for_each_ptr(ptrs, ptr)
-		if (bch2_dev_in_target(c, ptr->dev, target) &&
+		if (bch2_dev_in_target_mask(m, ptr->dev) &&
 		    (!ptr->cached ||
-		     !ptr_stale(bch_dev_bkey_exists(c, ptr->dev), ptr)))
-			return true;
+		     !ptr_stale(bch_dev_bkey_exists(c, ptr->dev), ptr))) {
+			ret = true;
+			break;
+		}
+	rcu_read_unlock();
 
-	return false;
+	return ret;
 }
 
 bool bch2_bkey_matches_ptr(struct bch_fs *c, struct bkey_s_c k,
@@ -1286,6 +1334,110 @@ int bch2_cut_front_s(struct bpos where, struct bkey_s k)
 	return -val_u64s_delta;
 }
 
+/* Extent hole cache: */
+
+static struct bch_extent_hole_cache_set *extent_hole_cache_set(struct bch_fs *c,
+							       u64 inum)
+{
+	return c->extent_hole_cache.sets + hash_64(inum, BCH_EXTENT_HOLE_CACHE_SETS_BITS);
+}
+
+/*
+ * Read before walking a range, and pass to bch2_extent_hole_add() after: if data
+ * was written to the inode in between, the hole isn't added.
+ */
+u32 bch2_extent_hole_cache_seq(struct bch_fs *c, u64 inum)
+{
+	struct bch_extent_hole_cache_set *s = extent_hole_cache_set(c, inum);
+	u32 seq;
+
+	spin_lock(&s->lock);
+	seq = s->seq;
+	spin_unlock(&s->lock);
+	return seq;
+}
+
+/*
+ * Returns true if sector @offset of @inum is in a known hole, with @hole_end
+ * set to where the hole ends: there's no data - no keys for which
+ * bkey_extent_is_data() is true - in [offset, hole_end).
+ */
+bool bch2_extent_hole_cached(struct bch_fs *c, u64 inum, u32 snapshot,
+			     u64 offset, u64 *hole_end)
+{
+	struct bch_extent_hole_cache_set *s = extent_hole_cache_set(c, inum);
+	bool ret = false;
+	unsigned i;
+
+	spin_lock(&s->lock);
+	for (i = 0; i < ARRAY_SIZE(s->e); i++)
+		if (s->e[i].inum	== inum &&
+		    s->e[i].snapshot	== snapshot &&
+		    s->e[i].start	<= offset &&
+		    s->e[i].end		>  offset) {
+			*hole_end = s->e[i].end;
+			ret = true;
+			break;
+		}
+	spin_unlock(&s->lock);
+	return ret;
+}
+
+void bch2_extent_hole_add(struct bch_fs *c, u64 inum, u32 snapshot,
+			  u64 start, u64 end, u32 seq)
+{
+	struct bch_extent_hole_cache_set *s = extent_hole_cache_set(c, inum);
+	unsigned i;
+
+	if (start >= end)
+		return;
+
+	spin_lock(&s->lock);
+	if (s->seq != seq)
+		goto out;
+
+	/* Extend a hole we already have, if they touch: */
+	for (i = 0; i < ARRAY_SIZE(s->e); i++)
+		if (s->e[i].inum	== inum &&
+		    s->e[i].snapshot	== snapshot &&
+		    s->e[i].start	<= end &&
+		    s->e[i].end		>= start) {
+			s->e[i].start	= min(s->e[i].start, start);
+			s->e[i].end	= max(s->e[i].end, end);
+			goto out;
+		}
+
+	i = s->next++ % ARRAY_SIZE(s->e);
+	s->e[i].inum		= inum;
+	s->e[i].snapshot	= snapshot;
+	s->e[i].start		= start;
+	s->e[i].end		= end;
+out:
+	spin_unlock(&s->lock);
+}
+
+/* Called when data is inserted into the extents btree: */
+void bch2_extent_hole_cache_invalidate(struct bch_fs *c, u64 inum)
+{
+	struct bch_extent_hole_cache_set *s = extent_hole_cache_set(c, inum);
+	unsigned i;
+
+	spin_lock(&s->lock);
+	s->seq++;
+	for (i = 0; i < ARRAY_SIZE(s->e); i++)
+		if (s->e[i].inum == inum)
+			s->e[i].inum = 0;
+	spin_unlock(&s->lock);
+}
+
+void bch2_fs_extent_hole_cache_init(struct bch_fs *c)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(c->extent_hole_cache.sets); i++)
+		spin_lock_init(&c->extent_hole_cache.sets[i].lock);
+}
+
 int bch2_cut_back_s(struct bpos where, struct bkey_s k)
 {
 	unsigned new_val_u64s = bkey_val_u64s(k.k);
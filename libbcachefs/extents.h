@@ -652,6 +652,12 @@ static inline void bch2_cut_back(struct bpos where, struct bkey_i *k)
 	bch2_cut_back_s(where, bkey_i_to_s(k));
 }
 
+u32 bch2_extent_hole_cache_seq(struct bch_fs *, u64);
+bool bch2_extent_hole_cached(struct bch_fs *, u64, u32, u64, u64 *);
+void bch2_extent_hole_add(struct bch_fs *, u64, u32, u64, u64, u32);
+void bch2_extent_hole_cache_invalidate(struct bch_fs *, u64);
+void bch2_fs_extent_hole_cache_init(struct bch_fs *);
+
 /**
  * bch_key_resize - adjust size of @k
  *
@@ -4,6 +4,8 @@
 
 #include "bcachefs_format.h"
 
+#include <linux/spinlock.h>
+
 struct bch_extent_crc_unpacked {
 	u32			compressed_size;
 	u32			uncompressed_size;
@@ -37,4 +39,31 @@ struct bch_io_failures {
 	}			devs[BCH_REPLICAS_MAX];
 };
 
+/*
+ * Ranges of the extents btree recently found to have no data, so that asking
+ * again - seeking over a big hole, or truncate checking whether a partial page
+ * needs zeroing - doesn't walk the keys again: see bch2_extent_hole_cached().
+ * Set associative by inode number, since any data written to an inode drops
+ * its holes in every snapshot.
+ */
+#define BCH_EXTENT_HOLE_CACHE_SETS_BITS	7
+#define BCH_EXTENT_HOLE_CACHE_WAYS	4
+
+struct bch_extent_hole_cache_set {
+	spinlock_t		lock;
+	/* bumped on invalidate, so that a racing walk doesn't add a stale hole: */
+	u32			seq;
+	u32			next;
+	struct {
+		u64		inum;
+		u64		start;
+		u64		end;
+		u32		snapshot;
+	}			e[BCH_EXTENT_HOLE_CACHE_WAYS];
+};
+
+struct bch_extent_hole_cache {
+	struct bch_extent_hole_cache_set sets[1U << BCH_EXTENT_HOLE_CACHE_SETS_BITS];
+};
+
 #endif /* _BCACHEFS_EXTENTS_TYPES_H */
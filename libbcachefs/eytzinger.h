@@ -4,6 +4,7 @@
 
 #include <linux/bitops.h>
 #include <linux/log2.h>
+#include <linux/prefetch.h>
 
 #include "util.h"
 
@@ -259,6 +260,36 @@ static inline ssize_t eytzinger0_find_le(void *base, size_t nr, size_t size,
 	}
 }
 
+/*
+ * eytzinger0_find_le() for trees keyed by a u64: @base points to the key in
+ * element 0, and @size is the stride between elements.
+ *
+ * The descent doesn't branch on the comparison, and prefetches four levels
+ * ahead - a node's sixteen descendants at that depth are contiguous - so the
+ * loads for successive levels overlap. Once we fall off the bottom of the
+ * tree, the path taken encodes the first element greater than @search: the
+ * last left turn. The answer is the element before that.
+ */
+static inline ssize_t eytzinger0_find_le_u64(const void *base, size_t nr,
+					     size_t size, u64 search)
+{
+	size_t i = 1;
+
+	if (!nr)
+		return -1;
+
+	while (i <= nr) {
+		prefetch(base + (16 * i - 1) * size);
+		i = 2 * i + (*(const u64 *) (base + (i - 1) * size) <= search);
+	}
+
+	/* Strip the right turns after the last left turn, and that one: */
+	i >>= __ffs(~i) + 1;
+
+	/* eytzinger1_prev(0) is the last element, if nothing was greater: */
+	return (ssize_t) eytzinger1_prev(i, nr) - 1;
+}
+
 #define eytzinger0_find(base, nr, size, _cmp, search)			\
 ({									\
 	void *_base	= (base);					\
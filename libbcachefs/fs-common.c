@@ -183,6 +183,115 @@ err:
 	return ret;
 }
 
+/*
+ * Create several entries in one directory, in one transaction: the directory
+ * is looked up and its inode written once for the whole batch, instead of once
+ * per entry. No ACLs, subvolumes or tmpfiles - new inodes just inherit from
+ * @dir_u, as in bch2_create_trans().
+ *
+ * Creates up to @nr entries, and sets @nr_created to the number created. The
+ * batch may end early - before an entry that already exists (that entry then
+ * fails with -EEXIST when it's first in the next batch), or that would collide
+ * with an earlier entry in this batch, since neither the new dirents nor the
+ * new inodes are visible to lookups until we commit. Each call creates at least
+ * one entry, or returns an error.
+ */
+int bch2_create_batch_trans(struct btree_trans *trans,
+			    subvol_inum dir,
+			    struct bch_inode_unpacked *dir_u,
+			    struct bch_create_entry *entries, unsigned nr,
+			    uid_t uid, gid_t gid,
+			    unsigned *nr_created)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter dir_iter = { NULL };
+	struct btree_iter inode_iter = { NULL };
+	struct bch_hash_info dir_hash;
+	u64 hashes[BCH_CREATE_BATCH_MAX];
+	u64 now = bch2_current_time(c);
+	u64 cpu = raw_smp_processor_id();
+	u32 snapshot;
+	unsigned i, j;
+	int ret;
+
+	*nr_created = 0;
+	nr = min_t(unsigned, nr, BCH_CREATE_BATCH_MAX);
+
+	ret = bch2_subvolume_get_snapshot(trans, dir.subvol, &snapshot);
+	if (ret)
+		goto err;
+
+	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir, BTREE_ITER_INTENT);
+	if (ret)
+		goto err;
+
+	dir_hash = bch2_hash_info_init(c, dir_u);
+
+	for (i = 0; i < nr; i++) {
+		struct bch_create_entry *e = entries + i;
+		u64 dir_offset;
+
+		hashes[i] = bch2_dirent_hash_desc.hash_key(&dir_hash, &e->name);
+		for (j = 0; j < i; j++)
+			if (hashes[j] == hashes[i])
+				goto done;
+
+		bch2_inode_init_late(&e->inode, now, uid, gid,
+				     e->mode, e->rdev, dir_u);
+
+		ret = bch2_inode_create(trans, &inode_iter, &e->inode, snapshot, cpu);
+		if (ret)
+			goto err;
+
+		for (j = 0; j < i; j++)
+			if (entries[j].inode.bi_inum == e->inode.bi_inum) {
+				bch2_trans_iter_exit(trans, &inode_iter);
+				goto done;
+			}
+
+		ret = bch2_dirent_create(trans, dir, &dir_hash,
+					 mode_to_type(e->mode),
+					 &e->name,
+					 e->inode.bi_inum,
+					 &dir_offset,
+					 BCH_HASH_SET_MUST_CREATE);
+		if (ret) {
+			bch2_trans_iter_exit(trans, &inode_iter);
+			if (ret == -EEXIST && i) {
+				ret = 0;
+				goto done;
+			}
+			goto err;
+		}
+
+		if (c->sb.version >= bcachefs_metadata_version_inode_backpointers) {
+			e->inode.bi_dir		= dir_u->bi_inum;
+			e->inode.bi_dir_offset	= dir_offset;
+		}
+
+		inode_iter.flags &= ~BTREE_ITER_ALL_SNAPSHOTS;
+		bch2_btree_iter_set_snapshot(&inode_iter, snapshot);
+
+		ret   = bch2_btree_iter_traverse(&inode_iter) ?:
+			bch2_inode_write(trans, &inode_iter, &e->inode);
+		bch2_trans_iter_exit(trans, &inode_iter);
+		if (ret)
+			goto err;
+
+		if (is_subdir_for_nlink(&e->inode))
+			dir_u->bi_nlink++;
+	}
+done:
+	*nr_created = i;
+
+	dir_u->bi_mtime = dir_u->bi_ctime = now;
+
+	ret = bch2_inode_write(trans, &dir_iter, dir_u);
+err:
+	bch2_trans_iter_exit(trans, &dir_iter);
+	return ret;
+}
+
 int bch2_link_trans(struct btree_trans *trans,
 		    subvol_inum dir,  struct bch_inode_unpacked *dir_u,
 		    subvol_inum inum, struct bch_inode_unpacked *inode_u,
@@ -18,6 +18,24 @@ int bch2_create_trans(struct btree_trans *, subvol_inum,
 		      struct posix_acl *,
 		      subvol_inum, unsigned);
 
+/*
+ * An entry for bch2_create_batch_trans(): @inode is the new inode, filled in
+ * on success.
+ */
+struct bch_create_entry {
+	struct qstr			name;
+	umode_t				mode;
+	dev_t				rdev;
+	struct bch_inode_unpacked	inode;
+};
+
+#define BCH_CREATE_BATCH_MAX		64
+
+int bch2_create_batch_trans(struct btree_trans *, subvol_inum,
+			    struct bch_inode_unpacked *,
+			    struct bch_create_entry *, unsigned,
+			    uid_t, gid_t, unsigned *);
+
 int bch2_link_trans(struct btree_trans *,
 		    subvol_inum, struct bch_inode_unpacked *,
 		    subvol_inum, struct bch_inode_unpacked *,
@@ -152,11 +152,16 @@ static int bch2_quota_reservation_add(struct bch_fs *c,
 				      struct bch_inode_info *inode,
 				      struct quota_res *res,
 				      unsigned sectors,
-				      bool check_enospc)
+				      bool check_enospc,
+				      bool nowait)
 {
 	int ret;
 
-	mutex_lock(&inode->ei_quota_lock);
+	if (!nowait)
+		mutex_lock(&inode->ei_quota_lock);
+	else if (!mutex_trylock(&inode->ei_quota_lock))
+		return -EAGAIN;
+
 	ret = bch2_quota_acct(c, inode->ei_qid, Q_SPC, sectors,
 			      check_enospc ? KEY_TYPE_QUOTA_PREALLOC : KEY_TYPE_QUOTA_NOCHECK);
 	if (likely(!ret)) {
@@ -180,7 +185,8 @@ static int bch2_quota_reservation_add(struct bch_fs *c,
 				      struct bch_inode_info *inode,
 				      struct quota_res *res,
 				      unsigned sectors,
-				      bool check_enospc)
+				      bool check_enospc,
+				      bool nowait)
 {
 	return 0;
 }
@@ -273,18 +279,30 @@ struct bch_page_sector {
 	}			state:8;
 };
 
+/*
+ * Sector state is tracked per folio, and sized to the folio: @s is indexed by
+ * sector offset from the start of the folio.
+ */
 struct bch_page_state {
 	spinlock_t		lock;
 	atomic_t		write_count;
 	bool			uptodate;
-	struct bch_page_sector	s[PAGE_SECTORS];
+	struct bch_page_sector	s[];
 };
 
+static inline unsigned folio_sectors(struct folio *folio)
+{
+	return folio_size(folio) >> 9;
+}
+
+static inline unsigned page_state_sectors(struct page *page)
+{
+	return folio_sectors(page_folio(page));
+}
+
 static inline struct bch_page_state *__bch2_page_state(struct page *page)
 {
-	return page_has_private(page)
-		? (struct bch_page_state *) page_private(page)
-		: NULL;
+	return folio_get_private(page_folio(page));
 }
 
 static inline struct bch_page_state *bch2_page_state(struct page *page)
@@ -297,7 +315,7 @@ static inline struct bch_page_state *bch2_page_state(struct page *page)
 /* for newly allocated pages: */
 static void __bch2_page_state_release(struct page *page)
 {
-	kfree(detach_page_private(page));
+	kfree(folio_detach_private(page_folio(page)));
 }
 
 static void bch2_page_state_release(struct page *page)
@@ -310,14 +328,15 @@ static void bch2_page_state_release(struct page *page)
 static struct bch_page_state *__bch2_page_state_create(struct page *page,
 						       gfp_t gfp)
 {
+	struct folio *folio = page_folio(page);
 	struct bch_page_state *s;
 
-	s = kzalloc(sizeof(*s), GFP_NOFS|gfp);
+	s = kzalloc(struct_size(s, s, folio_sectors(folio)), GFP_NOFS|gfp);
 	if (!s)
 		return NULL;
 
 	spin_lock_init(&s->lock);
-	attach_page_private(page, s);
+	folio_attach_private(folio, s);
 	return s;
 }
 
@@ -341,10 +360,10 @@ static void __bch2_page_state_set(struct page *page,
 				  unsigned nr_ptrs, unsigned state)
 {
 	struct bch_page_state *s = bch2_page_state_create(page, __GFP_NOFAIL);
-	unsigned i;
+	unsigned i, nr_sectors = page_state_sectors(page);
 
-	BUG_ON(pg_offset >= PAGE_SECTORS);
-	BUG_ON(pg_offset + pg_len > PAGE_SECTORS);
+	BUG_ON(pg_offset >= nr_sectors);
+	BUG_ON(pg_offset + pg_len > nr_sectors);
 
 	spin_lock(&s->lock);
 
@@ -353,7 +372,7 @@ static void __bch2_page_state_set(struct page *page,
 		s->s[i].state = state;
 	}
 
-	if (i == PAGE_SECTORS)
+	if (i == nr_sectors)
 		s->uptodate = true;
 
 	spin_unlock(&s->lock);
@@ -447,14 +466,14 @@ static void mark_pagecache_unallocated(struct bch_inode_info *inode,
 		for (i = 0; i < folio_batch_count(&fbatch); i++) {
 			struct folio *folio = fbatch.folios[i];
 			u64 pg_start = folio->index << PAGE_SECTORS_SHIFT;
-			u64 pg_end = (folio->index + 1) << PAGE_SECTORS_SHIFT;
+			u64 pg_end = pg_start + folio_sectors(folio);
 			unsigned pg_offset = max(start, pg_start) - pg_start;
 			unsigned pg_len = min(end, pg_end) - pg_offset - pg_start;
 			struct bch_page_state *s;
 
 			BUG_ON(end <= pg_start);
-			BUG_ON(pg_offset >= PAGE_SECTORS);
-			BUG_ON(pg_offset + pg_len > PAGE_SECTORS);
+			BUG_ON(pg_offset >= folio_sectors(folio));
+			BUG_ON(pg_offset + pg_len > folio_sectors(folio));
 
 			folio_lock(folio);
 			s = bch2_page_state(&folio->page);
@@ -493,14 +512,14 @@ static void mark_pagecache_reserved(struct bch_inode_info *inode,
 		for (i = 0; i < folio_batch_count(&fbatch); i++) {
 			struct folio *folio = fbatch.folios[i];
 			u64 pg_start = folio->index << PAGE_SECTORS_SHIFT;
-			u64 pg_end = (folio->index + 1) << PAGE_SECTORS_SHIFT;
+			u64 pg_end = pg_start + folio_sectors(folio);
 			unsigned pg_offset = max(start, pg_start) - pg_start;
 			unsigned pg_len = min(end, pg_end) - pg_offset - pg_start;
 			struct bch_page_state *s;
 
 			BUG_ON(end <= pg_start);
-			BUG_ON(pg_offset >= PAGE_SECTORS);
-			BUG_ON(pg_offset + pg_len > PAGE_SECTORS);
+			BUG_ON(pg_offset >= folio_sectors(folio));
+			BUG_ON(pg_offset + pg_len > folio_sectors(folio));
 
 			folio_lock(folio);
 			s = bch2_page_state(&folio->page);
@@ -560,7 +579,7 @@ static int bch2_get_page_disk_reservation(struct bch_fs *c,
 	if (!s)
 		return -ENOMEM;
 
-	for (i = 0; i < ARRAY_SIZE(s->s); i++)
+	for (i = 0; i < page_state_sectors(page); i++)
 		disk_res_sectors += sectors_to_reserve(&s->s[i], nr_replicas);
 
 	if (!disk_res_sectors)
@@ -574,7 +593,7 @@ static int bch2_get_page_disk_reservation(struct bch_fs *c,
 	if (unlikely(ret))
 		return ret;
 
-	for (i = 0; i < ARRAY_SIZE(s->s); i++)
+	for (i = 0; i < page_state_sectors(page); i++)
 		s->s[i].replicas_reserved +=
 			sectors_to_reserve(&s->s[i], nr_replicas);
 
@@ -606,7 +625,8 @@ static void bch2_page_reservation_put(struct bch_fs *c,
 static int bch2_page_reservation_get(struct bch_fs *c,
 			struct bch_inode_info *inode, struct page *page,
 			struct bch2_page_reservation *res,
-			unsigned offset, unsigned len, bool check_enospc)
+			unsigned offset, unsigned len,
+			bool check_enospc, bool nowait)
 {
 	struct bch_page_state *s = bch2_page_state_create(page, 0);
 	unsigned i, disk_sectors = 0, quota_sectors = 0;
@@ -628,9 +648,12 @@ static int bch2_page_reservation_get(struct bch_fs *c,
 	if (disk_sectors) {
 		ret = bch2_disk_reservation_add(c, &res->disk,
 						disk_sectors,
-						!check_enospc
-						? BCH_DISK_RESERVATION_NOFAIL
-						: 0);
+						(!check_enospc
+						 ? BCH_DISK_RESERVATION_NOFAIL
+						 : 0)|
+						(nowait
+						 ? BCH_DISK_RESERVATION_NOWAIT
+						 : 0));
 		if (unlikely(ret))
 			return ret;
 	}
@@ -638,7 +661,7 @@ static int bch2_page_reservation_get(struct bch_fs *c,
 	if (quota_sectors) {
 		ret = bch2_quota_reservation_add(c, inode, &res->quota,
 						 quota_sectors,
-						 check_enospc);
+						 check_enospc, nowait);
 		if (unlikely(ret)) {
 			struct disk_reservation tmp = {
 				.sectors = disk_sectors
@@ -667,7 +690,7 @@ static void bch2_clear_page_bits(struct page *page)
 	EBUG_ON(!PageLocked(page));
 	EBUG_ON(PageWriteback(page));
 
-	for (i = 0; i < ARRAY_SIZE(s->s); i++) {
+	for (i = 0; i < page_state_sectors(page); i++) {
 		disk_res.sectors += s->s[i].replicas_reserved;
 		s->s[i].replicas_reserved = 0;
 
@@ -822,7 +845,7 @@ vm_fault_t bch2_page_mkwrite(struct vm_fault *vmf)
 		}
 	}
 
-	if (bch2_page_reservation_get(c, inode, page, &res, 0, len, true)) {
+	if (bch2_page_reservation_get(c, inode, page, &res, 0, len, true, false)) {
 		unlock_page(page);
 		ret = VM_FAULT_SIGBUS;
 		goto out;
@@ -1195,6 +1218,9 @@ int bch2_read_folio(struct file *file, struct folio *folio)
 struct bch_writepage_state {
 	struct bch_writepage_io	*io;
 	struct bch_io_opts	opts;
+	/* copy of the sector state of the folio being written: */
+	struct bch_page_sector	*tmp;
+	unsigned		tmp_sectors;
 };
 
 static inline struct bch_writepage_state bch_writepage_state_init(struct bch_fs *c,
@@ -1234,7 +1260,7 @@ static void bch2_writepage_io_done(struct closure *cl)
 
 			s = __bch2_page_state(bvec->bv_page);
 			spin_lock(&s->lock);
-			for (i = 0; i < PAGE_SECTORS; i++)
+			for (i = 0; i < page_state_sectors(bvec->bv_page); i++)
 				s->s[i].nr_replicas = 0;
 			spin_unlock(&s->lock);
 		}
@@ -1246,7 +1272,7 @@ static void bch2_writepage_io_done(struct closure *cl)
 
 			s = __bch2_page_state(bvec->bv_page);
 			spin_lock(&s->lock);
-			for (i = 0; i < PAGE_SECTORS; i++)
+			for (i = 0; i < page_state_sectors(bvec->bv_page); i++)
 				s->s[i].nr_replicas = 0;
 			spin_unlock(&s->lock);
 		}
@@ -1331,8 +1357,8 @@ static int __bch2_writepage(struct page *page,
 	struct bch_inode_info *inode = to_bch_ei(page->mapping->host);
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct bch_writepage_state *w = data;
-	struct bch_page_state *s, orig;
-	unsigned i, offset, nr_replicas_this_write = U32_MAX;
+	struct bch_page_state *s;
+	unsigned i, offset, f_sectors, nr_replicas_this_write = U32_MAX;
 	loff_t i_size = i_size_read(&inode->v);
 	pgoff_t end_index = i_size >> PAGE_SHIFT;
 	int ret;
@@ -1360,6 +1386,14 @@ static int __bch2_writepage(struct page *page,
 	zero_user_segment(page, offset, PAGE_SIZE);
 do_io:
 	s = bch2_page_state_create(page, __GFP_NOFAIL);
+	f_sectors = page_state_sectors(page);
+
+	if (f_sectors > w->tmp_sectors) {
+		kfree(w->tmp);
+		w->tmp = kcalloc(f_sectors, sizeof(struct bch_page_sector),
+				 GFP_NOFS|__GFP_NOFAIL);
+		w->tmp_sectors = f_sectors;
+	}
 
 	/*
 	 * Things get really hairy with errors during writeback:
@@ -1369,10 +1403,10 @@ do_io:
 
 	/* Before unlocking the page, get copy of reservations: */
 	spin_lock(&s->lock);
-	orig = *s;
+	memcpy(w->tmp, s->s, sizeof(struct bch_page_sector) * f_sectors);
 	spin_unlock(&s->lock);
 
-	for (i = 0; i < PAGE_SECTORS; i++) {
+	for (i = 0; i < f_sectors; i++) {
 		if (s->s[i].state < SECTOR_DIRTY)
 			continue;
 
@@ -1382,7 +1416,7 @@ do_io:
 			      s->s[i].replicas_reserved);
 	}
 
-	for (i = 0; i < PAGE_SECTORS; i++) {
+	for (i = 0; i < f_sectors; i++) {
 		if (s->s[i].state < SECTOR_DIRTY)
 			continue;
 
@@ -1406,17 +1440,17 @@ do_io:
 		unsigned sectors = 0, dirty_sectors = 0, reserved_sectors = 0;
 		u64 sector;
 
-		while (offset < PAGE_SECTORS &&
-		       orig.s[offset].state < SECTOR_DIRTY)
+		while (offset < f_sectors &&
+		       w->tmp[offset].state < SECTOR_DIRTY)
 			offset++;
 
-		if (offset == PAGE_SECTORS)
+		if (offset == f_sectors)
 			break;
 
-		while (offset + sectors < PAGE_SECTORS &&
-		       orig.s[offset + sectors].state >= SECTOR_DIRTY) {
-			reserved_sectors += orig.s[offset + sectors].replicas_reserved;
-			dirty_sectors += orig.s[offset + sectors].state == SECTOR_DIRTY;
+		while (offset + sectors < f_sectors &&
+		       w->tmp[offset + sectors].state >= SECTOR_DIRTY) {
+			reserved_sectors += w->tmp[offset + sectors].replicas_reserved;
+			dirty_sectors += w->tmp[offset + sectors].state == SECTOR_DIRTY;
 			sectors++;
 		}
 		BUG_ON(!sectors);
@@ -1471,6 +1505,7 @@ int bch2_writepages(struct address_space *mapping, struct writeback_control *wbc
 	if (w.io)
 		bch2_writepage_do_io(&w);
 	blk_finish_plug(&plug);
+	kfree(w.tmp);
 	return bch2_err_class(ret);
 }
 
@@ -1531,7 +1566,7 @@ out:
 	}
 
 	ret = bch2_page_reservation_get(c, inode, page, res,
-					offset, len, true);
+					offset, len, true, false);
 	if (ret) {
 		if (!PageUptodate(page)) {
 			/*
@@ -1607,10 +1642,15 @@ int bch2_write_end(struct file *file, struct address_space *mapping,
 
 #define WRITE_BATCH_PAGES	32
 
+/*
+ * With @nowait (IOCB_NOWAIT), return -EAGAIN rather than block on page locks,
+ * reads, or disk and quota reservations
+ */
 static int __bch2_buffered_write(struct bch_inode_info *inode,
 				 struct address_space *mapping,
 				 struct iov_iter *iter,
-				 loff_t pos, unsigned len)
+				 loff_t pos, unsigned len,
+				 bool nowait)
 {
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct page *pages[WRITE_BATCH_PAGES];
@@ -1628,11 +1668,15 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	bch2_page_reservation_init(c, inode, &res);
 
 	for (i = 0; i < nr_pages; i++) {
-		pages[i] = grab_cache_page_write_begin(mapping, index + i);
+		pages[i] = !nowait
+			? grab_cache_page_write_begin(mapping, index + i)
+			: pagecache_get_page(mapping, index + i,
+					     FGP_WRITEBEGIN|FGP_NOWAIT,
+					     mapping_gfp_mask(mapping));
 		if (!pages[i]) {
 			nr_pages = i;
 			if (!i) {
-				ret = -ENOMEM;
+				ret = nowait ? -EAGAIN : -ENOMEM;
 				goto out;
 			}
 			len = min_t(unsigned, len,
@@ -1642,7 +1686,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	}
 
 	if (offset && !PageUptodate(pages[0])) {
-		ret = bch2_read_single_page(pages[0], mapping);
+		ret = nowait ? -EAGAIN : bch2_read_single_page(pages[0], mapping);
 		if (ret)
 			goto out;
 	}
@@ -1652,7 +1696,8 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		if ((index + nr_pages - 1) << PAGE_SHIFT >= inode->v.i_size) {
 			zero_user(pages[nr_pages - 1], 0, PAGE_SIZE);
 		} else {
-			ret = bch2_read_single_page(pages[nr_pages - 1], mapping);
+			ret = nowait ? -EAGAIN
+				: bch2_read_single_page(pages[nr_pages - 1], mapping);
 			if (ret)
 				goto out;
 		}
@@ -1673,7 +1718,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		}
 
 		ret = bch2_page_reservation_get(c, inode, page, &res,
-						pg_offset, pg_len, true);
+						pg_offset, pg_len, true, nowait);
 		if (ret)
 			goto out;
 
@@ -1752,10 +1797,14 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 	struct address_space *mapping = file->f_mapping;
 	struct bch_inode_info *inode = file_bch_inode(file);
 	loff_t pos = iocb->ki_pos;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
 	ssize_t written = 0;
 	int ret = 0;
 
-	bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	if (!nowait)
+		bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	else if (!bch2_pagecache_add_tryget(&inode->ei_pagecache_lock))
+		return -EAGAIN;
 
 	do {
 		unsigned offset = pos & (PAGE_SIZE - 1);
@@ -1787,7 +1836,8 @@ again:
 			break;
 		}
 
-		ret = __bch2_buffered_write(inode, mapping, iter, pos, bytes);
+		ret = __bch2_buffered_write(inode, mapping, iter, pos, bytes,
+					    nowait);
 		if (unlikely(ret < 0))
 			break;
 
@@ -1810,7 +1860,11 @@ again:
 		written += ret;
 		ret = 0;
 
-		balance_dirty_pages_ratelimited(mapping);
+		if (balance_dirty_pages_ratelimited_flags(mapping,
+				nowait ? BDP_ASYNC : 0)) {
+			ret = -EAGAIN;
+			break;
+		}
 	} while (iov_iter_count(iter));
 
 	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
@@ -1976,6 +2030,13 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	if (iocb->ki_flags & IOCB_DIRECT) {
 		struct blk_plug plug;
 
+		if ((iocb->ki_flags & IOCB_NOWAIT) &&
+		    filemap_range_needs_writeback(mapping, iocb->ki_pos,
+						  iocb->ki_pos + count - 1)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
 		ret = filemap_write_and_wait_range(mapping,
 					iocb->ki_pos,
 					iocb->ki_pos + count - 1);
@@ -1991,7 +2052,13 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		if (ret >= 0)
 			iocb->ki_pos += ret;
 	} else {
-		bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+		if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+			bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+		} else if (!bch2_pagecache_add_tryget(&inode->ei_pagecache_lock)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
 		ret = generic_file_read_iter(iocb, iter);
 		bch2_pagecache_add_put(&inode->ei_pagecache_lock);
 	}
@@ -2245,27 +2312,44 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	prefetch(&inode->ei_inode);
 	prefetch((void *) &inode->ei_inode + 64);
 
-	inode_lock(&inode->v);
+	if (!(req->ki_flags & IOCB_NOWAIT))
+		inode_lock(&inode->v);
+	else if (!inode_trylock(&inode->v))
+		return -EAGAIN;
 
 	ret = generic_write_checks(req, iter);
 	if (unlikely(ret <= 0))
 		goto err;
 
-	ret = file_remove_privs(file);
+	ret = kiocb_modified(req);
 	if (unlikely(ret))
 		goto err;
 
-	ret = file_update_time(file);
-	if (unlikely(ret))
+	if (unlikely((req->ki_pos|iter->count) & (block_bytes(c) - 1)))
 		goto err;
 
-	if (unlikely((req->ki_pos|iter->count) & (block_bytes(c) - 1)))
+	extending = req->ki_pos + iter->count > inode->v.i_size;
+
+	/*
+	 * Extending writes have to complete synchronously, and shooting down
+	 * the page cache may mean waiting on writeback:
+	 */
+	if ((req->ki_flags & IOCB_NOWAIT) &&
+	    (extending ||
+	     filemap_range_has_page(mapping, req->ki_pos,
+				    req->ki_pos + iter->count - 1))) {
+		ret = -EAGAIN;
 		goto err;
+	}
 
+	if (!(req->ki_flags & IOCB_NOWAIT)) {
+		bch2_pagecache_block_get(&inode->ei_pagecache_lock);
+	} else if (!bch2_pagecache_block_tryget(&inode->ei_pagecache_lock)) {
+		ret = -EAGAIN;
+		goto err;
+	}
 	inode_dio_begin(&inode->v);
-	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
 
-	extending = req->ki_pos + iter->count > inode->v.i_size;
 	if (!extending) {
 		inode_unlock(&inode->v);
 		locked = false;
@@ -2288,7 +2372,8 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	dio->iter		= *iter;
 
 	ret = bch2_quota_reservation_add(c, inode, &dio->quota_res,
-					 iter->count >> 9, true);
+					 iter->count >> 9, true,
+					 req->ki_flags & IOCB_NOWAIT);
 	if (unlikely(ret))
 		goto err_put_bio;
 
@@ -2322,19 +2407,21 @@ ssize_t bch2_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		goto out;
 	}
 
+	if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+		inode_lock(&inode->v);
+	} else if (!inode_trylock(&inode->v)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
 	/* We can write back this queue in page reclaim */
 	current->backing_dev_info = inode_to_bdi(&inode->v);
-	inode_lock(&inode->v);
 
 	ret = generic_write_checks(iocb, from);
 	if (ret <= 0)
 		goto unlock;
 
-	ret = file_remove_privs(file);
-	if (ret)
-		goto unlock;
-
-	ret = file_update_time(file);
+	ret = kiocb_modified(iocb);
 	if (ret)
 		goto unlock;
 
@@ -2394,6 +2481,8 @@ static inline int range_has_data(struct bch_fs *c, u32 subvol,
 	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
+	u32 seq = bch2_extent_hole_cache_seq(c, start.inode);
+	u64 hole_start = start.offset, hole_end;
 	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
@@ -2404,6 +2493,11 @@ retry:
 	if (ret)
 		goto err;
 
+	if (bch2_extent_hole_cached(c, start.inode, start.snapshot,
+				    start.offset, &hole_end) &&
+	    hole_end >= end.offset)
+		goto err;
+
 	for_each_btree_key_norestart(&trans, iter, BTREE_ID_extents, start, 0, k, ret) {
 		if (bkey_cmp(bkey_start_pos(k.k), end) >= 0)
 			break;
@@ -2415,6 +2509,10 @@ retry:
 	}
 	start = iter.pos;
 	bch2_trans_iter_exit(&trans, &iter);
+
+	if (!ret)
+		bch2_extent_hole_add(c, start.inode, start.snapshot,
+				     hole_start, end.offset, seq);
 err:
 	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 		goto retry;
@@ -2984,7 +3082,7 @@ static int __bchfs_fallocate(struct bch_inode_info *inode, int mode,
 		if (!bkey_extent_is_allocation(k.k)) {
 			ret = bch2_quota_reservation_add(c, inode,
 					&quota_res,
-					sectors, true);
+					sectors, true, false);
 			if (unlikely(ret))
 				goto bkey_err;
 		}
@@ -3002,7 +3100,7 @@ static int __bchfs_fallocate(struct bch_inode_info *inode, int mode,
 		ret = bch2_extent_update(&trans, inode_inum(inode), &iter,
 					 &reservation.k_i,
 				&disk_res, NULL,
-				0, &i_sectors_delta, true);
+				0, &i_sectors_delta, BCH_WRITE_CHECK_ENOSPC);
 		if (ret)
 			goto bkey_err;
 		i_sectors_acct(c, inode, &quota_res, i_sectors_delta);
@@ -3167,7 +3265,7 @@ err:
 	if (ret)
 		return ret;
 
-	return bch2_quota_reservation_add(c, inode, res, sectors, true);
+	return bch2_quota_reservation_add(c, inode, res, sectors, true, false);
 }
 
 loff_t bch2_remap_file_range(struct file *file_src, loff_t pos_src,
@@ -3265,7 +3363,8 @@ static loff_t bch2_seek_data(struct file *file, u64 offset)
 	struct bkey_s_c k;
 	subvol_inum inum = inode_inum(inode);
 	u64 isize, next_data = MAX_LFS_FILESIZE;
-	u32 snapshot;
+	u64 seek_start, hole_end;
+	u32 snapshot, seq = bch2_extent_hole_cache_seq(c, inum.inum);
 	int ret;
 
 	isize = i_size_read(&inode->v);
@@ -3280,17 +3379,29 @@ retry:
 	if (ret)
 		goto err;
 
-	for_each_btree_key_norestart(&trans, iter, BTREE_ID_extents,
-			   SPOS(inode->v.i_ino, offset >> 9, snapshot), 0, k, ret) {
-		if (k.k->p.inode != inode->v.i_ino) {
-			break;
-		} else if (bkey_extent_is_data(k.k)) {
+	/* Skip over a hole we've already walked: */
+	seek_start = offset >> 9;
+	if (bch2_extent_hole_cached(c, inum.inum, snapshot, seek_start, &hole_end))
+		seek_start = hole_end;
+	hole_end = U64_MAX;
+
+	for_each_btree_key_upto_norestart(&trans, iter, BTREE_ID_extents,
+			   SPOS(inode->v.i_ino, seek_start, snapshot),
+			   POS(inode->v.i_ino, U64_MAX), 0, k, ret) {
+		if (bkey_extent_is_data(k.k)) {
 			next_data = max(offset, bkey_start_offset(k.k) << 9);
+			hole_end = bkey_start_offset(k.k);
 			break;
-		} else if (k.k->p.offset >> 9 > isize)
+		} else if (bkey_start_offset(k.k) << 9 >= isize) {
+			hole_end = bkey_start_offset(k.k);
 			break;
+		}
 	}
 	bch2_trans_iter_exit(&trans, &iter);
+
+	if (!ret)
+		bch2_extent_hole_add(c, inum.inum, snapshot,
+				     offset >> 9, hole_end, seq);
 err:
 	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 		goto retry;
@@ -3321,50 +3432,65 @@ static int __page_hole_offset(struct page *page, unsigned offset)
 	if (!s)
 		return 0;
 
-	for (i = offset >> 9; i < PAGE_SECTORS; i++)
+	for (i = offset >> 9; i < page_state_sectors(page); i++)
 		if (s->s[i].state < SECTOR_DIRTY)
 			return i << 9;
 
 	return -1;
 }
 
-static loff_t page_hole_offset(struct address_space *mapping, loff_t offset)
+/*
+ * Returns the first offset in [start_offset, end_offset) that isn't dirty in
+ * the page cache, or end_offset: walks only the folios that exist, so a large
+ * range with nothing cached is a single lookup
+ */
+static loff_t bch2_seek_pagecache_hole(struct inode *vinode,
+				       loff_t start_offset,
+				       loff_t end_offset)
 {
-	pgoff_t index = offset >> PAGE_SHIFT;
-	struct page *page;
-	int pg_offset;
-	loff_t ret = -1;
+	struct address_space *mapping = vinode->i_mapping;
+	pgoff_t index = start_offset >> PAGE_SHIFT;
+	pgoff_t end_index = (end_offset - 1) >> PAGE_SHIFT;
+	loff_t offset = start_offset;
+	struct folio_batch fbatch;
+	unsigned i;
 
-	page = find_lock_page(mapping, index);
-	if (!page)
-		return offset;
+	if (start_offset >= end_offset)
+		return end_offset;
 
-	pg_offset = __page_hole_offset(page, offset & (PAGE_SIZE - 1));
-	if (pg_offset >= 0)
-		ret = ((loff_t) index << PAGE_SHIFT) + pg_offset;
+	folio_batch_init(&fbatch);
 
-	unlock_page(page);
+	while (filemap_get_folios(mapping, &index, end_index, &fbatch)) {
+		for (i = 0; i < folio_batch_count(&fbatch); i++) {
+			struct folio *folio = fbatch.folios[i];
+			loff_t folio_start = folio_pos(folio);
+			int pg_offset = 0;
 
-	return ret;
-}
+			/* Nothing cached before this folio: */
+			if (folio_start > offset)
+				goto out;
 
-static loff_t bch2_seek_pagecache_hole(struct inode *vinode,
-				       loff_t start_offset,
-				       loff_t end_offset)
-{
-	struct address_space *mapping = vinode->i_mapping;
-	loff_t offset = start_offset, hole;
+			folio_lock(folio);
+			if (folio->mapping == mapping)
+				pg_offset = __page_hole_offset(&folio->page,
+						offset - folio_start);
+			folio_unlock(folio);
 
-	while (offset < end_offset) {
-		hole = page_hole_offset(mapping, offset);
-		if (hole >= 0 && hole <= end_offset)
-			return max(start_offset, hole);
+			if (pg_offset >= 0) {
+				offset = folio_start + pg_offset;
+				goto out;
+			}
 
-		offset += PAGE_SIZE;
-		offset &= PAGE_MASK;
+			offset = folio_start + folio_size(folio);
+		}
+		folio_batch_release(&fbatch);
+		cond_resched();
 	}
 
-	return end_offset;
+	return min(offset, end_offset);
+out:
+	folio_batch_release(&fbatch);
+	return min(max(start_offset, offset), end_offset);
 }
 
 static loff_t bch2_seek_hole(struct file *file, u64 offset)
@@ -3398,6 +3524,11 @@ retry:
 			next_hole = bch2_seek_pagecache_hole(&inode->v,
 					offset, MAX_LFS_FILESIZE);
 			break;
+		} else if (bkey_start_offset(k.k) << 9 >= isize) {
+			/* everything past i_size is a hole: */
+			next_hole = bch2_seek_pagecache_hole(&inode->v,
+					offset, isize);
+			break;
 		} else if (!bkey_extent_is_data(k.k)) {
 			next_hole = bch2_seek_pagecache_hole(&inode->v,
 					max(offset, bkey_start_offset(k.k) << 9),
@@ -13,6 +13,7 @@
 #include <linux/fsnotify.h>
 #include <linux/mount.h>
 #include <linux/namei.h>
+#include <linux/posix_acl.h>
 #include <linux/security.h>
 #include <linux/writeback.h>
 
@@ -185,14 +186,54 @@ static int bch2_reinherit_attrs_fn(struct bch_inode_info *inode,
 	return !bch2_reinherit_attrs(bi, &dir->ei_inode);
 }
 
+/* Returns 1 if @inum's attributes changed, 0 if they didn't: */
+static int bch2_reinherit_attrs_inum(struct bch_fs *c,
+				     struct bch_inode_info *src,
+				     subvol_inum inum,
+				     struct bch_inode_info **ret_dst)
+{
+	struct bch_inode_info *dst;
+	struct inode *vinode;
+	int ret;
+
+	vinode = bch2_vfs_inode_get(c, inum);
+	ret = PTR_ERR_OR_ZERO(vinode);
+	if (ret)
+		return ret;
+
+	dst = to_bch_ei(vinode);
+
+	bch2_lock_inodes(INODE_UPDATE_LOCK, src, dst);
+
+	if (inode_attr_changing(src, dst, Inode_opt_project)) {
+		ret = bch2_fs_quota_transfer(c, dst,
+					     src->ei_qid,
+					     1 << QTYP_PRJ,
+					     KEY_TYPE_QUOTA_PREALLOC);
+		if (ret)
+			goto err;
+	}
+
+	ret = bch2_write_inode(c, dst, bch2_reinherit_attrs_fn, src, 0);
+err:
+	bch2_unlock_inodes(INODE_UPDATE_LOCK, src, dst);
+
+	/* return true if we did work */
+	if (ret >= 0)
+		ret = !ret;
+
+	if (ret > 0 && ret_dst)
+		*ret_dst = dst;
+	else
+		iput(vinode);
+	return ret;
+}
+
 static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 				    struct file *file,
 				    struct bch_inode_info *src,
 				    const char __user *name)
 {
-	struct bch_hash_info hash = bch2_hash_info_init(c, &src->ei_inode);
-	struct bch_inode_info *dst;
-	struct inode *vinode = NULL;
 	char *kname = NULL;
 	struct qstr qstr;
 	int ret = 0;
@@ -209,47 +250,133 @@ static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 	qstr.len	= ret;
 	qstr.name	= kname;
 
-	ret = bch2_dirent_lookup(c, inode_inum(src), &hash, &qstr, &inum);
+	ret = bch2_dirent_lookup(c, inode_inum(src), &src->ei_str_hash,
+				 &qstr, &inum);
 	if (ret)
 		goto err1;
 
-	vinode = bch2_vfs_inode_get(c, inum);
-	ret = PTR_ERR_OR_ZERO(vinode);
+	ret = mnt_want_write_file(file);
 	if (ret)
 		goto err1;
 
-	dst = to_bch_ei(vinode);
+	ret = bch2_reinherit_attrs_inum(c, src, inum, NULL);
+
+	mnt_drop_write_file(file);
+err1:
+	kfree(kname);
+
+	return ret;
+}
+
+struct reinherit_dirents {
+	struct bch_inode_info	*dir;
+	DARRAY(struct bch_readdir_entry *) entries;
+};
+
+static int reinherit_dirent_fn(void *p, struct bch_readdir_entry *e)
+{
+	struct reinherit_dirents *d = p;
+	struct bch_inode_unpacked u = e->inode;
+	struct bch_readdir_entry *n;
+
+	/* Subvolumes inherit nothing from their parent directory: */
+	if (e->d_type == DT_SUBVOL ||
+	    e->target.subvol != inode_inum(d->dir).subvol)
+		return 0;
+
+	/* Don't get entries that are already up to date into the inode cache: */
+	if (!bch2_reinherit_attrs(&u, &d->dir->ei_inode))
+		return 0;
+
+	n = kmemdup(e, sizeof(*e), GFP_KERNEL);
+	if (!n || darray_push(&d->entries, n)) {
+		kfree(n);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * BCHFS_IOC_REINHERIT_ATTRS_RECURSIVE: reinherit attributes on everything under
+ * a directory, walking the dirents btree directly so userspace doesn't need a
+ * readdir, stat and ioctl per file. Like BCHFS_IOC_REINHERIT_ATTRS, we don't
+ * descend into directories that didn't change.
+ *
+ * Returns the number of inodes updated.
+ */
+static long bch2_ioc_reinherit_attrs_recursive(struct bch_fs *c,
+					       struct file *file,
+					       struct bch_inode_info *src)
+{
+	DARRAY(struct bch_inode_info *) dirs = { 0 };
+	struct bch_readdir_cursor *cur;
+	struct reinherit_dirents d;
+	struct bch_readdir_entry **e;
+	struct bch_inode_info *dst;
+	long nr = 0;
+	int ret;
+
+	if (!S_ISDIR(src->v.i_mode))
+		return -ENOTDIR;
+
+	cur = kmalloc(sizeof(*cur), GFP_KERNEL);
+	if (!cur)
+		return -ENOMEM;
 
 	ret = mnt_want_write_file(file);
 	if (ret)
-		goto err2;
-
-	bch2_lock_inodes(INODE_UPDATE_LOCK, src, dst);
+		goto err;
 
-	if (inode_attr_changing(src, dst, Inode_opt_project)) {
-		ret = bch2_fs_quota_transfer(c, dst,
-					     src->ei_qid,
-					     1 << QTYP_PRJ,
-					     KEY_TYPE_QUOTA_PREALLOC);
-		if (ret)
-			goto err3;
+	ihold(&src->v);
+	ret = darray_push(&dirs, src);
+	if (ret) {
+		iput(&src->v);
+		goto err_drop_write;
 	}
 
-	ret = bch2_write_inode(c, dst, bch2_reinherit_attrs_fn, src, 0);
-err3:
-	bch2_unlock_inodes(INODE_UPDATE_LOCK, src, dst);
+	while (dirs.nr) {
+		d.dir = dirs.data[--dirs.nr];
+		darray_init(&d.entries);
+
+		memset(cur, 0, sizeof(*cur));
+		ret = bch2_readdir_plus(c, inode_inum(d.dir), cur, 0,
+					reinherit_dirent_fn, &d);
+
+		darray_for_each(d.entries, e) {
+			if (!ret && fatal_signal_pending(current))
+				ret = -EINTR;
+
+			if (!ret) {
+				dst = NULL;
+				ret = bch2_reinherit_attrs_inum(c, d.dir, (*e)->target,
+						(*e)->d_type == DT_DIR ? &dst : NULL);
+				if (ret > 0) {
+					nr++;
+					ret = 0;
+				}
+
+				if (dst && darray_push(&dirs, dst)) {
+					iput(&dst->v);
+					ret = -ENOMEM;
+				}
+			}
+			kfree(*e);
+		}
+		darray_exit(&d.entries);
 
-	/* return true if we did work */
-	if (ret >= 0)
-		ret = !ret;
+		iput(&d.dir->v);
 
-	mnt_drop_write_file(file);
-err2:
-	iput(vinode);
-err1:
-	kfree(kname);
+		if (ret)
+			while (dirs.nr)
+				iput(&dirs.data[--dirs.nr]->v);
+	}
 
-	return ret;
+	darray_exit(&dirs);
+err_drop_write:
+	mnt_drop_write_file(file);
+err:
+	kfree(cur);
+	return ret ?: min_t(long, nr, INT_MAX);
 }
 
 static int bch2_ioc_goingdown(struct bch_fs *c, u32 __user *arg)
@@ -296,7 +423,7 @@ err:
 	return ret;
 }
 
-static long bch2_ioctl_subvolume_create(struct bch_fs *c, struct file *filp,
+static long __bch2_ioctl_subvolume_create(struct bch_fs *c, struct file *filp,
 				struct bch_ioctl_subvolume arg)
 {
 	struct inode *dir;
@@ -324,24 +451,17 @@ static long bch2_ioctl_subvolume_create(struct bch_fs *c, struct file *filp,
 
 	if (arg.flags & BCH_SUBVOL_SNAPSHOT_RO)
 		create_flags |= BCH_CREATE_SNAPSHOT_RO;
-
-	/* why do we need this lock? */
-	down_read(&c->vfs_sb->s_umount);
-
-	if (arg.flags & BCH_SUBVOL_SNAPSHOT_CREATE)
-		sync_inodes_sb(c->vfs_sb);
 retry:
 	if (arg.src_ptr) {
 		error = user_path_at(arg.dirfd,
 				(const char __user *)(unsigned long)arg.src_ptr,
 				how, &src_path);
 		if (error)
-			goto err1;
+			return error;
 
 		if (src_path.dentry->d_sb->s_fs_info != c) {
 			path_put(&src_path);
-			error = -EXDEV;
-			goto err1;
+			return -EXDEV;
 		}
 
 		snapshot_src = inode_inum(to_bch_ei(src_path.dentry->d_inode));
@@ -412,12 +532,27 @@ err2:
 		lookup_flags |= LOOKUP_REVAL;
 		goto retry;
 	}
-err1:
-	up_read(&c->vfs_sb->s_umount);
 
 	return error;
 }
 
+static long bch2_ioctl_subvolume_create(struct bch_fs *c, struct file *filp,
+				struct bch_ioctl_subvolume arg)
+{
+	long ret;
+
+	/* why do we need this lock? */
+	down_read(&c->vfs_sb->s_umount);
+
+	if (arg.flags & BCH_SUBVOL_SNAPSHOT_CREATE)
+		sync_inodes_sb(c->vfs_sb);
+
+	ret = __bch2_ioctl_subvolume_create(c, filp, arg);
+
+	up_read(&c->vfs_sb->s_umount);
+	return ret;
+}
+
 static long bch2_ioctl_subvolume_destroy(struct bch_fs *c, struct file *filp,
 				struct bch_ioctl_subvolume arg)
 {
@@ -451,6 +586,326 @@ static long bch2_ioctl_subvolume_destroy(struct bch_fs *c, struct file *filp,
 	return ret;
 }
 
+/*
+ * Batched create/destroy: entries are done in order, stopping at the first
+ * error; snapshots in the batch share a single sync_inodes_sb().
+ */
+static long bch2_ioctl_subvolume_batch(struct bch_fs *c, struct file *filp,
+				bool create,
+				struct bch_ioctl_subvolume_batch __user *user_arg)
+{
+	struct bch_ioctl_subvolume_batch arg;
+	struct bch_ioctl_subvolume __user *entries;
+	struct bch_ioctl_subvolume i;
+	bool synced = false;
+	u32 nr_done;
+	long ret = 0;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags || arg.pad)
+		return -EINVAL;
+
+	entries = (void __user *)(unsigned long) arg.entries;
+
+	if (create)
+		down_read(&c->vfs_sb->s_umount);
+
+	for (nr_done = 0; nr_done < arg.nr; nr_done++) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		if (copy_from_user(&i, entries + nr_done, sizeof(i))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (create &&
+		    (i.flags & BCH_SUBVOL_SNAPSHOT_CREATE) &&
+		    !synced) {
+			sync_inodes_sb(c->vfs_sb);
+			synced = true;
+		}
+
+		ret = create
+			? __bch2_ioctl_subvolume_create(c, filp, i)
+			: bch2_ioctl_subvolume_destroy(c, filp, i);
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+
+	if (create)
+		up_read(&c->vfs_sb->s_umount);
+
+	if (put_user(nr_done, &user_arg->nr_done) && !ret)
+		ret = -EFAULT;
+
+	return ret;
+}
+
+static int bch2_create_batch_entry_get(struct bch_ioctl_create_entry __user *user_e,
+					struct bch_create_entry *e, char *name)
+{
+	struct bch_ioctl_create_entry i;
+
+	if (copy_from_user(&i, user_e, sizeof(i)))
+		return -EFAULT;
+
+	if (i.pad || !i.name_len || i.name_len > BCH_NAME_MAX)
+		return -EINVAL;
+
+	switch (i.mode & S_IFMT) {
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (copy_from_user(name, (void __user *)(unsigned long) i.name_ptr,
+			   i.name_len))
+		return -EFAULT;
+
+	if (memchr(name, '/', i.name_len) ||
+	    memchr(name, '\0', i.name_len) ||
+	    (name[0] == '.' && (i.name_len == 1 ||
+				(i.name_len == 2 && name[1] == '.'))))
+		return -EINVAL;
+
+	e->name		= (struct qstr) QSTR_INIT(name, i.name_len);
+	e->mode		= i.mode & ~current_umask();
+	e->rdev		= S_ISCHR(i.mode) || S_ISBLK(i.mode)
+		? new_decode_dev(i.rdev) : 0;
+	return 0;
+}
+
+static int bch2_create_batch_security(struct inode *dir, struct dentry *dentry,
+				      umode_t mode, dev_t rdev)
+{
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		return security_inode_mkdir(dir, dentry, mode);
+	case S_IFREG:
+		return security_inode_create(dir, dentry, mode);
+	default:
+		return security_inode_mknod(dir, dentry, mode, rdev);
+	}
+}
+
+/*
+ * Batched create: up to BCH_CREATE_BATCH_MAX entries are created per
+ * transaction, with one directory inode update and one quota update for all of
+ * them. The directory is locked for the whole batch, so the names can't appear
+ * between our lookups and the commit.
+ */
+static long bch2_ioc_create_batch(struct bch_fs *c, struct file *file,
+				  struct bch_inode_info *dir,
+				  struct bch_ioctl_create_batch __user *user_arg)
+{
+	struct user_namespace *mnt_userns = file_mnt_user_ns(file);
+	struct bch_ioctl_create_batch arg;
+	struct bch_ioctl_create_entry __user *user_entries;
+	struct bch_create_entry *entries = NULL;
+	struct dentry **dentries = NULL;
+	struct btree_trans trans;
+	struct bch_inode_unpacked dir_u;
+	char *names = NULL;
+	unsigned i, n = 0, nr_created;
+	u32 nr_done = 0;
+	long lookup_ret;
+	uid_t uid;
+	gid_t gid;
+	long ret;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags || arg.pad)
+		return -EINVAL;
+
+	if (!S_ISDIR(dir->v.i_mode))
+		return -ENOTDIR;
+
+	user_entries = (void __user *)(unsigned long) arg.entries;
+
+#ifdef CONFIG_BCACHEFS_POSIX_ACL
+	if (IS_POSIXACL(&dir->v)) {
+		struct posix_acl *acl = get_acl(&dir->v, ACL_TYPE_DEFAULT);
+
+		if (IS_ERR(acl))
+			return PTR_ERR(acl);
+		if (acl) {
+			posix_acl_release(acl);
+			return -EOPNOTSUPP;
+		}
+	}
+#endif
+	if (!kuid_has_mapping(dir->v.i_sb->s_user_ns, current_fsuid()) ||
+	    !kgid_has_mapping(dir->v.i_sb->s_user_ns, current_fsgid()))
+		return -EOVERFLOW;
+
+	uid = from_kuid(mnt_userns, current_fsuid());
+	gid = from_kgid(mnt_userns, current_fsgid());
+
+	entries		= kvmalloc_array(BCH_CREATE_BATCH_MAX, sizeof(*entries), GFP_KERNEL);
+	dentries	= kcalloc(BCH_CREATE_BATCH_MAX, sizeof(*dentries), GFP_KERNEL);
+	names		= kvmalloc_array(BCH_CREATE_BATCH_MAX, BCH_NAME_MAX, GFP_KERNEL);
+	if (!entries || !dentries || !names) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto err_free;
+
+	inode_lock_nested(&dir->v, I_MUTEX_PARENT);
+
+	ret = inode_permission(mnt_userns, &dir->v, MAY_WRITE | MAY_EXEC);
+	if (ret)
+		goto err_unlock;
+
+	bch2_trans_init(&trans, c, 8, 2048 + BCH_CREATE_BATCH_MAX * 64);
+
+	while (nr_done < arg.nr) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		if (IS_DEADDIR(&dir->v)) {
+			ret = -ENOENT;
+			break;
+		}
+
+		/* Look up this batch's names, and check they don't exist yet: */
+		for (n = 0; n < min(arg.nr - nr_done, BCH_CREATE_BATCH_MAX); n++) {
+			struct bch_create_entry *e = entries + n;
+
+			bch2_inode_init_early(c, &e->inode);
+
+			ret = bch2_create_batch_entry_get(user_entries + nr_done + n, e,
+							  names + n * BCH_NAME_MAX);
+			if (ret)
+				break;
+
+			dentries[n] = lookup_one_len((void *) e->name.name,
+						     file->f_path.dentry,
+						     e->name.len);
+			ret = PTR_ERR_OR_ZERO(dentries[n]);
+			if (ret) {
+				dentries[n] = NULL;
+				break;
+			}
+
+			if (d_really_is_positive(dentries[n])) {
+				dput(dentries[n]);
+				dentries[n] = NULL;
+				ret = -EEXIST;
+				break;
+			}
+
+			ret = bch2_create_batch_security(&dir->v, dentries[n],
+							 e->mode, e->rdev);
+			if (ret) {
+				dput(dentries[n]);
+				dentries[n] = NULL;
+				break;
+			}
+		}
+
+		/* entries before the one that failed are still created: */
+		if (!n)
+			break;
+		lookup_ret = ret;
+
+		mutex_lock(&dir->ei_update_lock);
+retry:
+		bch2_trans_begin(&trans);
+
+		nr_created = 0;
+		ret = bch2_create_batch_trans(&trans, inode_inum(dir), &dir_u,
+					      entries, n, uid, gid, &nr_created) ?:
+			bch2_quota_acct(c, bch_qid(&entries[0].inode), Q_INO,
+					nr_created, KEY_TYPE_QUOTA_PREALLOC);
+		if (!ret) {
+			ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+			if (ret)
+				bch2_quota_acct(c, bch_qid(&entries[0].inode), Q_INO,
+						-(s64) nr_created, KEY_TYPE_QUOTA_WARN);
+		}
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			goto retry;
+
+		if (!ret)
+			bch2_inode_update_after_write(&trans, dir, &dir_u,
+						      ATTR_MTIME|ATTR_CTIME);
+		mutex_unlock(&dir->ei_update_lock);
+
+		if (ret)
+			nr_created = 0;
+
+		for (i = 0; i < n; i++) {
+			struct bch_create_entry *e = entries + i;
+			struct inode *inode = NULL;
+
+			if (i < nr_created) {
+				inode = bch2_vfs_inode_get(c, (subvol_inum) {
+					.subvol	= dir->ei_subvol,
+					.inum	= e->inode.bi_inum,
+				});
+				if (IS_ERR(inode)) {
+					/* it's created, but we can't cache it: */
+					d_drop(dentries[i]);
+					inode = NULL;
+				}
+			}
+
+			if (inode) {
+				d_instantiate(dentries[i], inode);
+				if (S_ISDIR(e->mode))
+					fsnotify_mkdir(&dir->v, dentries[i]);
+				else
+					fsnotify_create(&dir->v, dentries[i]);
+			}
+
+			dput(dentries[i]);
+			dentries[i] = NULL;
+		}
+
+		nr_done += nr_created;
+
+		/* the entry that failed lookup is next if this batch got that far: */
+		ret = ret ?: (nr_created == n ? lookup_ret : 0);
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+
+	bch2_trans_exit(&trans);
+err_unlock:
+	inode_unlock(&dir->v);
+	mnt_drop_write_file(file);
+
+	if (put_user(nr_done, &user_arg->nr_done) && !ret)
+		ret = -EFAULT;
+err_free:
+	kvfree(names);
+	kfree(dentries);
+	kvfree(entries);
+	return ret;
+}
+
 long bch2_fs_file_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 {
 	struct bch_inode_info *inode = file_bch_inode(file);
@@ -480,6 +935,14 @@ long bch2_fs_file_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 					       (void __user *) arg);
 		break;
 
+	case BCHFS_IOC_REINHERIT_ATTRS_RECURSIVE:
+		ret = bch2_ioc_reinherit_attrs_recursive(c, file, inode);
+		break;
+
+	case BCHFS_IOC_CREATE_BATCH:
+		ret = bch2_ioc_create_batch(c, file, inode, (void __user *) arg);
+		break;
+
 	case FS_IOC_GETVERSION:
 		ret = -ENOTTY;
 		break;
@@ -510,6 +973,13 @@ long bch2_fs_file_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 		break;
 	}
 
+	case BCH_IOCTL_SUBVOLUME_CREATE_BATCH:
+	case BCH_IOCTL_SUBVOLUME_DESTROY_BATCH:
+		ret = bch2_ioctl_subvolume_batch(c, file,
+				cmd == BCH_IOCTL_SUBVOLUME_CREATE_BATCH,
+				(void __user *) arg);
+		break;
+
 	default:
 		ret = bch2_fs_ioctl(c, cmd, (void __user *) arg);
 		break;
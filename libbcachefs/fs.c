@@ -90,6 +90,11 @@ void bch2_pagecache_block_put(struct pagecache_lock *lock)
 	__pagecache_lock_put(lock, -1);
 }
 
+bool bch2_pagecache_block_tryget(struct pagecache_lock *lock)
+{
+	return __pagecache_lock_tryget(lock, -1);
+}
+
 void bch2_pagecache_block_get(struct pagecache_lock *lock)
 {
 	__pagecache_lock_get(lock, -1);
@@ -396,12 +401,11 @@ static struct dentry *bch2_lookup(struct inode *vdir, struct dentry *dentry,
 {
 	struct bch_fs *c = vdir->i_sb->s_fs_info;
 	struct bch_inode_info *dir = to_bch_ei(vdir);
-	struct bch_hash_info hash = bch2_hash_info_init(c, &dir->ei_inode);
 	struct inode *vinode = NULL;
 	subvol_inum inum = { .subvol = 1 };
 	int ret;
 
-	ret = bch2_dirent_lookup(c, inode_inum(dir), &hash,
+	ret = bch2_dirent_lookup(c, inode_inum(dir), &dir->ei_str_hash,
 				 &dentry->d_name, &inum);
 
 	if (!ret)
@@ -845,8 +849,64 @@ static int bch2_tmpfile(struct user_namespace *mnt_userns,
 	return 0;
 }
 
+/*
+ * Extents are buffered before being handed to fiemap_fill_next_extent(), so
+ * that keys that are contiguous both logically and on disk - e.g. a file
+ * written in small appends - are reported as a single extent:
+ */
+struct bch_fiemap_extent {
+	u64		logical;
+	u64		physical;
+	u64		length;
+	unsigned	dev;
+	u32		flags;
+};
+
+static int bch2_fiemap_flush(struct fiemap_extent_info *info,
+			     struct bch_fiemap_extent *e, u32 flags)
+{
+	int ret = 0;
+
+	if (e->length)
+		ret = fiemap_fill_next_extent(info, e->logical, e->physical,
+					      e->length, e->flags|flags);
+	e->length = 0;
+	return ret;
+}
+
+static int bch2_fiemap_add(struct fiemap_extent_info *info,
+			   struct bch_fiemap_extent *e,
+			   u64 logical, u64 physical, u64 length,
+			   unsigned dev, u32 flags)
+{
+	int ret;
+
+	if (e->length &&
+	    e->logical + e->length == logical &&
+	    e->dev	== dev &&
+	    e->flags	== flags &&
+	    !(flags & (FIEMAP_EXTENT_ENCODED|FIEMAP_EXTENT_DATA_INLINE)) &&
+	    ((flags & FIEMAP_EXTENT_DELALLOC) ||
+	     e->physical + e->length == physical)) {
+		e->length += length;
+		return 0;
+	}
+
+	ret = bch2_fiemap_flush(info, e, 0);
+	if (ret)
+		return ret;
+
+	e->logical	= logical;
+	e->physical	= physical;
+	e->length	= length;
+	e->dev		= dev;
+	e->flags	= flags;
+	return 0;
+}
+
 static int bch2_fill_extent(struct bch_fs *c,
 			    struct fiemap_extent_info *info,
+			    struct bch_fiemap_extent *e,
 			    struct bkey_s_c k, unsigned flags)
 {
 	if (bkey_extent_is_direct_data(k.k)) {
@@ -871,45 +931,92 @@ static int bch2_fill_extent(struct bch_fs *c,
 			    (k.k->size & (block_sectors(c) - 1)))
 				flags2 |= FIEMAP_EXTENT_NOT_ALIGNED;
 
-			ret = fiemap_fill_next_extent(info,
-						bkey_start_offset(k.k) << 9,
-						offset << 9,
-						k.k->size << 9, flags|flags2);
+			ret = bch2_fiemap_add(info, e,
+					      bkey_start_offset(k.k) << 9,
+					      offset << 9,
+					      k.k->size << 9,
+					      p.ptr.dev, flags|flags2);
 			if (ret)
 				return ret;
 		}
 
 		return 0;
 	} else if (bkey_extent_is_inline_data(k.k)) {
-		return fiemap_fill_next_extent(info,
-					       bkey_start_offset(k.k) << 9,
-					       0, k.k->size << 9,
-					       flags|
-					       FIEMAP_EXTENT_DATA_INLINE);
+		return bch2_fiemap_add(info, e,
+				       bkey_start_offset(k.k) << 9,
+				       0, k.k->size << 9, 0,
+				       flags|
+				       FIEMAP_EXTENT_DATA_INLINE);
 	} else if (k.k->type == KEY_TYPE_reservation) {
-		return fiemap_fill_next_extent(info,
-					       bkey_start_offset(k.k) << 9,
-					       0, k.k->size << 9,
-					       flags|
-					       FIEMAP_EXTENT_DELALLOC|
-					       FIEMAP_EXTENT_UNWRITTEN);
+		return bch2_fiemap_add(info, e,
+				       bkey_start_offset(k.k) << 9,
+				       0, k.k->size << 9, 0,
+				       flags|
+				       FIEMAP_EXTENT_DELALLOC|
+				       FIEMAP_EXTENT_UNWRITTEN);
 	} else {
 		BUG();
 	}
 }
 
+/*
+ * Like bch2_read_indirect_extent(), but keeps the reflink iterator and the
+ * last indirect extent around for the whole walk: a fragmented reflinked file
+ * has many reflink pointers into the same indirect extent, and those are then
+ * resolved without another btree lookup.
+ */
+static int bch2_fiemap_read_indirect(struct btree_trans *trans,
+				     struct btree_iter *reflink_iter,
+				     struct bkey_buf *reflink,
+				     unsigned *offset_into_extent,
+				     struct bkey_buf *k)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_s_c r;
+	u64 idx;
+	int ret;
+
+	if (k->k->k.type != KEY_TYPE_reflink_p)
+		return 0;
+
+	idx = le64_to_cpu(bkey_i_to_reflink_p(k->k)->v.idx) +
+		*offset_into_extent;
+
+	if (!reflink->k->k.size ||
+	    idx <  bkey_start_offset(&reflink->k->k) ||
+	    idx >= reflink->k->k.p.offset) {
+		bch2_btree_iter_set_pos(reflink_iter, POS(0, idx));
+		r = bch2_btree_iter_peek_slot(reflink_iter);
+		ret = bkey_err(r);
+		if (ret)
+			return ret;
+
+		if (r.k->type != KEY_TYPE_reflink_v &&
+		    r.k->type != KEY_TYPE_indirect_inline_data)
+			/* for the error message: */
+			return __bch2_read_indirect_extent(trans,
+						offset_into_extent, k);
+
+		bch2_bkey_buf_reassemble(reflink, c, r);
+	}
+
+	*offset_into_extent = idx - bkey_start_offset(&reflink->k->k);
+	bch2_bkey_buf_copy(k, c, reflink->k);
+	return 0;
+}
+
 static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 		       u64 start, u64 len)
 {
 	struct bch_fs *c = vinode->i_sb->s_fs_info;
 	struct bch_inode_info *ei = to_bch_ei(vinode);
 	struct btree_trans trans;
-	struct btree_iter iter;
+	struct btree_iter iter, reflink_iter;
 	struct bkey_s_c k;
-	struct bkey_buf cur, prev;
+	struct bkey_buf cur, reflink;
+	struct bch_fiemap_extent e = { 0 };
 	struct bpos end = POS(ei->v.i_ino, (start + len) >> 9);
 	unsigned offset_into_extent, sectors;
-	bool have_extent = false;
 	u32 snapshot;
 	int ret = 0;
 
@@ -923,23 +1030,26 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 	start >>= 9;
 
 	bch2_bkey_buf_init(&cur);
-	bch2_bkey_buf_init(&prev);
+	bch2_bkey_buf_init(&reflink);
 	bch2_trans_init(&trans, c, 0, 0);
 retry:
 	bch2_trans_begin(&trans);
 
+	/* don't trust the cached indirect extent across a restart: */
+	bkey_init(&reflink.k->k);
+
 	ret = bch2_subvolume_get_snapshot(&trans, ei->ei_subvol, &snapshot);
 	if (ret)
 		goto err;
 
 	bch2_trans_iter_init(&trans, &iter, BTREE_ID_extents,
 			     SPOS(ei->v.i_ino, start, snapshot), 0);
+	bch2_trans_iter_init(&trans, &reflink_iter, BTREE_ID_reflink,
+			     POS_MIN, BTREE_ITER_SLOTS);
 
 	while (!(ret = btree_trans_too_many_iters(&trans)) &&
 	       (k = bch2_btree_iter_peek_upto(&iter, end)).k &&
 	       !(ret = bkey_err(k))) {
-		enum btree_id data_btree = BTREE_ID_extents;
-
 		if (!bkey_extent_is_data(k.k) &&
 		    k.k->type != KEY_TYPE_reservation) {
 			bch2_btree_iter_advance(&iter);
@@ -952,13 +1062,12 @@ retry:
 
 		bch2_bkey_buf_reassemble(&cur, c, k);
 
-		ret = bch2_read_indirect_extent(&trans, &data_btree,
-					&offset_into_extent, &cur);
+		ret = bch2_fiemap_read_indirect(&trans, &reflink_iter, &reflink,
+						&offset_into_extent, &cur);
 		if (ret)
 			break;
 
 		k = bkey_i_to_s_c(cur.k);
-		bch2_bkey_buf_realloc(&prev, c, k.k->u64s);
 
 		sectors = min(sectors, k.k->size - offset_into_extent);
 
@@ -970,32 +1079,26 @@ retry:
 		cur.k->k.p = iter.pos;
 		cur.k->k.p.offset += cur.k->k.size;
 
-		if (have_extent) {
-			ret = bch2_fill_extent(c, info,
-					bkey_i_to_s_c(prev.k), 0);
-			if (ret)
-				break;
-		}
-
-		bkey_copy(prev.k, cur.k);
-		have_extent = true;
+		ret = bch2_fill_extent(c, info, &e, bkey_i_to_s_c(cur.k), 0);
+		if (ret)
+			break;
 
 		bch2_btree_iter_set_pos(&iter,
 			POS(iter.pos.inode, iter.pos.offset + sectors));
 	}
 	start = iter.pos.offset;
+	bch2_trans_iter_exit(&trans, &reflink_iter);
 	bch2_trans_iter_exit(&trans, &iter);
 err:
 	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 		goto retry;
 
-	if (!ret && have_extent)
-		ret = bch2_fill_extent(c, info, bkey_i_to_s_c(prev.k),
-				       FIEMAP_EXTENT_LAST);
+	if (!ret)
+		ret = bch2_fiemap_flush(info, &e, FIEMAP_EXTENT_LAST);
 
 	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&reflink, c);
 	bch2_bkey_buf_exit(&cur, c);
-	bch2_bkey_buf_exit(&prev, c);
 	return ret < 0 ? ret : 0;
 }
 
@@ -1032,12 +1135,19 @@ static int bch2_vfs_readdir(struct file *file, struct dir_context *ctx)
 	return bch2_readdir(c, inode_inum(inode), ctx);
 }
 
+/* bch2_read_iter() and bch2_write_iter() handle IOCB_NOWAIT: */
+static int bch2_file_open(struct inode *vinode, struct file *file)
+{
+	file->f_mode |= FMODE_NOWAIT;
+	return generic_file_open(vinode, file);
+}
+
 static const struct file_operations bch_file_operations = {
 	.llseek		= bch2_llseek,
 	.read_iter	= bch2_read_iter,
 	.write_iter	= bch2_write_iter,
 	.mmap		= bch2_mmap,
-	.open		= generic_file_open,
+	.open		= bch2_file_open,
 	.fsync		= bch2_fsync,
 	.splice_read	= generic_file_splice_read,
 	.splice_write	= iter_file_splice_write,
@@ -1376,6 +1486,7 @@ static void bch2_vfs_inode_init(struct btree_trans *trans, subvol_inum inum,
 	inode->ei_quota_reserved = 0;
 	inode->ei_qid		= bch_qid(bi);
 	inode->ei_subvol	= inum.subvol;
+	inode->ei_str_hash	= bch2_hash_info_init(trans->c, bi);
 
 	inode->v.i_mapping->a_ops = &bch_address_space_operations;
 
@@ -29,6 +29,7 @@ void bch2_pagecache_add_put(struct pagecache_lock *);
 bool bch2_pagecache_add_tryget(struct pagecache_lock *);
 void bch2_pagecache_add_get(struct pagecache_lock *);
 void bch2_pagecache_block_put(struct pagecache_lock *);
+bool bch2_pagecache_block_tryget(struct pagecache_lock *);
 void bch2_pagecache_block_get(struct pagecache_lock *);
 
 struct bch_inode_info {
@@ -48,6 +49,9 @@ struct bch_inode_info {
 
 	/* copy of inode in btree: */
 	struct bch_inode_unpacked ei_inode;
+
+	/* bi_hash_seed and the hash type never change, so this is set once: */
+	struct bch_hash_info	ei_str_hash;
 };
 
 static inline subvol_inum inode_inum(struct bch_inode_info *inode)
@@ -198,6 +202,10 @@ int bch2_vfs_init(void);
 
 #else
 
+static inline void bch2_inode_update_after_write(struct btree_trans *trans,
+						 struct bch_inode_info *inode,
+						 struct bch_inode_unpacked *bi,
+						 unsigned fields) {}
 static inline void bch2_evict_subvolume_inodes(struct bch_fs *c,
 					       snapshot_id_list *s) {}
 static inline void bch2_vfs_exit(void) {}
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "bbpos.h"
 #include "bkey_buf.h"
 #include "btree_update.h"
 #include "darray.h"
@@ -16,9 +17,191 @@
 
 #include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
+#include <linux/sort.h>
+
+#ifndef __KERNEL__
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/mm.h>
+#endif
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
+/*
+ * With fsck_quick, passes are skipped if none of the btrees they check have
+ * been written to since the last fsck: snapshots and subvolumes change which
+ * keys are visible where, so every pass depends on them.
+ */
+#define FSCK_BTREES(...)						\
+	(BIT(BTREE_ID_snapshots)|BIT(BTREE_ID_subvolumes)|__VA_ARGS__)
+
+static bool fsck_pass_needed(struct bch_fs *c, const char *pass,
+			     unsigned long btrees)
+{
+	if (c->fsck_btrees & btrees)
+		return true;
+
+	bch_verbose(c, "%s: no btrees written since last fsck, skipping", pass);
+	return false;
+}
+
+/* Progress reporting: */
+
+#define FSCK_PROGRESS_INTERVAL	(10 * HZ)
+
+static void fsck_progress_btree(struct bch_fs *c, enum btree_id btree)
+{
+	struct fsck_progress *p = &c->fsck_progress;
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct btree_node_iter node_iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	struct btree *b;
+	int ret;
+
+	/* Passes are single threaded in between walking btrees: */
+	p->btree	= btree;
+	p->pos		= POS_MIN;
+	p->leaves.nr	= 0;
+
+	/*
+	 * Leaf boundaries come from the nodes one level up, which we're going
+	 * to read anyways; if that fails, or the btree is just a root node, we
+	 * report progress without a percentage:
+	 */
+	bch2_trans_init(&trans, c, 0, 0);
+	__for_each_btree_node(&trans, iter, btree, POS_MIN, 0, 1, 0, b, ret) {
+		if (b->c.level != 1)
+			break;
+
+		for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked)
+			if (darray_push(&p->leaves, k.k->p))
+				break;
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+	bch2_trans_exit(&trans);
+}
+
+static void fsck_progress_start(struct bch_fs *c, const char *pass,
+				enum btree_id btree)
+{
+	struct fsck_progress *p = &c->fsck_progress;
+
+	if (!p->pass || strcmp(p->pass, pass)) {
+		p->pass		= pass;
+		p->start_time	= local_clock();
+		p->last_report	= jiffies;
+		percpu_u64_set(p->nr_keys, 0);
+	}
+
+	fsck_progress_btree(c, btree);
+}
+
+/* Returns percent done, or -1 if we can't tell: */
+static int fsck_progress_percent(struct fsck_progress *p, struct bpos pos)
+{
+	size_t l = 0, r = p->leaves.nr;
+
+	if (!r)
+		return -1;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (bpos_cmp(p->leaves.data[m], pos) < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return div_u64((u64) l * 100, p->leaves.nr);
+}
+
+static void fsck_progress_report(struct bch_fs *c, struct bpos pos, bool done)
+{
+	struct fsck_progress *p = &c->fsck_progress;
+	struct printbuf buf = PRINTBUF;
+	u64 elapsed = max_t(u64, local_clock() - p->start_time, 1);
+	u64 nr_keys = percpu_u64_get(p->nr_keys);
+	u64 keys_per_sec = div64_u64(nr_keys * NSEC_PER_SEC, elapsed);
+	int percent = done ? 100 : fsck_progress_percent(p, pos);
+	u64 eta = percent > 0
+		? div_u64(elapsed, percent) * (100 - percent)
+		: 0;
+
+	prt_printf(&buf, "%s: ", p->pass);
+	if (done) {
+		prt_printf(&buf, "done, %llu keys in ", nr_keys);
+		bch2_pr_time_units(&buf, elapsed);
+		prt_printf(&buf, ", %llu keys/sec", keys_per_sec);
+	} else {
+		bch2_bbpos_to_text(&buf, BBPOS(p->btree, pos));
+		if (percent >= 0)
+			prt_printf(&buf, ", %u%% done", percent);
+		prt_printf(&buf, ", %llu keys, %llu keys/sec, elapsed ", nr_keys, keys_per_sec);
+		bch2_pr_time_units(&buf, elapsed);
+		if (percent > 0) {
+			prt_printf(&buf, ", eta ");
+			bch2_pr_time_units(&buf, eta);
+		}
+	}
+	bch_info(c, "%s", buf.buf);
+
+	if (c->opts.fsck_progress_json) {
+		printbuf_reset(&buf);
+		prt_printf(&buf, "{\"pass\":\"%s\",\"btree\":\"%s\",\"pos\":\"",
+			   p->pass, bch2_btree_ids[p->btree]);
+		bch2_bpos_to_text(&buf, pos);
+		prt_printf(&buf, "\",\"done\":%s,\"percent\":%i,\"keys\":%llu,"
+			   "\"keys_per_sec\":%llu,\"elapsed_ns\":%llu,\"eta_ns\":%llu}",
+			   done ? "true" : "false", percent, nr_keys,
+			   keys_per_sec, elapsed, eta);
+		bch_info(c, "fsck_progress %s", buf.buf);
+	}
+
+	printbuf_exit(&buf);
+}
+
+/*
+ * Called for every key a pass looks at, possibly from several threads at once:
+ * the reported position is the furthest one any of them has reached. Only the
+ * position is updated under the lock - the report is formatted and printed
+ * outside it, by whichever thread won the cmpxchg on @last_report:
+ */
+static inline void fsck_progress_key(struct bch_fs *c, struct bpos pos)
+{
+	struct fsck_progress *p = &c->fsck_progress;
+	unsigned long last = READ_ONCE(p->last_report);
+
+	this_cpu_inc(*p->nr_keys);
+
+	if (likely(!time_after(jiffies, last + FSCK_PROGRESS_INTERVAL)) ||
+	    cmpxchg(&p->last_report, last, jiffies) != last)
+		return;
+
+	spin_lock(&p->lock);
+	if (bpos_cmp(pos, p->pos) > 0)
+		p->pos = pos;
+	pos = p->pos;
+	spin_unlock(&p->lock);
+
+	fsck_progress_report(c, pos, false);
+}
+
+static int fsck_progress_end(struct bch_fs *c, int ret)
+{
+	struct fsck_progress *p = &c->fsck_progress;
+
+	if (!ret)
+		fsck_progress_report(c, p->pos, true);
+
+	darray_exit(&p->leaves);
+	p->pass = NULL;
+	return ret;
+}
+
 /*
  * XXX: this is handling transaction restarts without returning
  * -BCH_ERR_transaction_restart_nested, this is not how we do things anymore:
@@ -876,6 +1059,8 @@ static int check_inode(struct btree_trans *trans,
 	bool do_update = false;
 	int ret;
 
+	fsck_progress_key(c, k.k->p);
+
 	ret = check_key_has_snapshot(trans, iter, k);
 	if (ret < 0)
 		goto err;
@@ -1014,6 +1199,11 @@ static int check_inodes(struct bch_fs *c, bool full)
 	struct bkey_s_c k;
 	int ret;
 
+	if (!fsck_pass_needed(c, "check_inodes", FSCK_BTREES(BIT(BTREE_ID_inodes))))
+		return 0;
+
+	fsck_progress_start(c, "check_inodes", BTREE_ID_inodes);
+
 	snapshots_seen_init(&s);
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
@@ -1022,6 +1212,7 @@ static int check_inodes(struct bch_fs *c, bool full)
 			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
 			NULL, NULL, BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
 		check_inode(&trans, &iter, k, &prev, &s, full));
+	ret = fsck_progress_end(c, ret);
 
 	bch2_trans_exit(&trans);
 	snapshots_seen_exit(&s);
@@ -1176,6 +1367,8 @@ static int check_extent(struct btree_trans *trans, struct btree_iter *iter,
 	struct bpos equiv;
 	int ret = 0;
 
+	fsck_progress_key(c, k.k->p);
+
 	ret = check_key_has_snapshot(trans, iter, k);
 	if (ret) {
 		ret = ret < 0 ? ret : 0;
@@ -1300,42 +1493,170 @@ fsck_err:
 }
 
 /*
- * Walk extents: verify that extents have a corresponding S_ISREG inode, and
- * that i_size an i_sectors are consistent
+ * check_extents, check_dirents and check_xattrs only look at other inodes
+ * through lookups, so each pass is split up into shards by inode number, and
+ * the shards are checked by a pool of workers - each shard with its own
+ * btree_trans, inode_walker and snapshots_seen.
+ *
+ * Shard boundaries are taken from the keys of the btree nodes one level above
+ * the leaves, so that shards are of roughly equal size; there are a few shards
+ * per worker, to even out shards that have more to repair than others.
  */
-noinline_for_stack
-static int check_extents(struct bch_fs *c)
+#define FSCK_SHARD_WORKERS_MAX		16
+#define FSCK_SHARDS_PER_WORKER		4
+
+typedef int (*fsck_shard_fn)(struct btree_trans *, struct bpos, struct bpos);
+
+struct fsck_shards {
+	struct bch_fs		*c;
+	fsck_shard_fn		fn;
+	/* shard i is inodes [start[i], start[i + 1]) */
+	DARRAY(u64)		start;
+	atomic_t		next;
+	int			ret;
+};
+
+struct fsck_shard_worker {
+	struct closure		cl;
+	struct fsck_shards	*s;
+};
+
+static int fsck_shards_init(struct btree_trans *trans, enum btree_id btree_id,
+			    struct fsck_shards *s, unsigned nr_shards)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	DARRAY(u64) nodes;
+	u64 *inum;
+	unsigned i;
+	int ret;
+
+	darray_init(&nodes);
+
+	ret = darray_push(&s->start, BCACHEFS_ROOT_INO);
+	if (ret || nr_shards <= 1)
+		return ret;
+
+	__for_each_btree_node(trans, iter, btree_id, POS(BCACHEFS_ROOT_INO, 0),
+			      0, 1, 0, b, ret) {
+		ret = darray_push(&nodes, b->key.k.p.inode);
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	for (i = 1; !ret && i < nr_shards; i++) {
+		inum = nodes.data + div_u64((u64) nodes.nr * i, nr_shards);
+
+		if (inum < nodes.data + nodes.nr &&
+		    *inum > s->start.data[s->start.nr - 1])
+			ret = darray_push(&s->start, *inum);
+	}
+
+	darray_exit(&nodes);
+	return ret;
+}
+
+static void fsck_shard_worker(struct closure *cl)
+{
+	struct fsck_shard_worker *w = container_of(cl, struct fsck_shard_worker, cl);
+	struct fsck_shards *s = w->s;
+	struct btree_trans trans;
+	unsigned i;
+	int ret;
+
+	bch2_trans_init(&trans, s->c, BTREE_ITER_MAX, 0);
+
+	while (!READ_ONCE(s->ret) &&
+	       (i = atomic_inc_return(&s->next) - 1) < s->start.nr) {
+		struct bpos start = POS(s->start.data[i], 0);
+		struct bpos end = i + 1 < s->start.nr
+			? SPOS(s->start.data[i + 1] - 1, U64_MAX, U32_MAX)
+			: SPOS_MAX;
+
+		ret = s->fn(&trans, start, end);
+		if (ret)
+			cmpxchg(&s->ret, 0, ret);
+	}
+
+	bch2_trans_exit(&trans);
+	closure_return(cl);
+}
+
+static int fsck_run_sharded(struct bch_fs *c, enum btree_id btree_id,
+			    fsck_shard_fn fn)
+{
+	struct fsck_shards s = { .c = c, .fn = fn };
+	struct fsck_shard_worker w[FSCK_SHARD_WORKERS_MAX];
+	struct btree_trans trans;
+	struct closure cl;
+	unsigned i, nr_workers = min_t(unsigned, num_online_cpus(),
+				       FSCK_SHARD_WORKERS_MAX);
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	ret = fsck_shards_init(&trans, btree_id, &s,
+			       nr_workers * FSCK_SHARDS_PER_WORKER);
+	bch2_trans_exit(&trans);
+	if (ret)
+		goto err;
+
+	closure_init_stack(&cl);
+	for (i = 0; i < min_t(size_t, nr_workers, s.start.nr); i++) {
+		w[i].s = &s;
+		closure_call(&w[i].cl, fsck_shard_worker, system_unbound_wq, &cl);
+	}
+	closure_sync(&cl);
+
+	ret = s.ret;
+err:
+	darray_exit(&s.start);
+	return ret;
+}
+
+static int check_extents_shard(struct btree_trans *trans,
+			       struct bpos start, struct bpos end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct snapshots_seen s;
-	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	int ret = 0;
+	int ret;
 
-#if 0
-	struct bkey_buf prev;
-	bch2_bkey_buf_init(&prev);
-	prev.k->k = KEY(0, 0, 0);
-#endif
 	snapshots_seen_init(&s);
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
-
-	bch_verbose(c, "checking extents");
 
-	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_extents,
-			POS(BCACHEFS_ROOT_INO, 0),
+	ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_extents,
+			start, end,
 			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
 			NULL, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
-		check_extent(&trans, &iter, k, &w, &s));
-#if 0
-	bch2_bkey_buf_exit(&prev, c);
-#endif
+		check_extent(trans, &iter, k, &w, &s)) ?:
+		commit_do(trans, NULL, NULL,
+			  BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
+			  check_i_sectors(trans, &w));
+
 	inode_walker_exit(&w);
-	bch2_trans_exit(&trans);
 	snapshots_seen_exit(&s);
+	return ret;
+}
+
+/*
+ * Walk extents: verify that extents have a corresponding S_ISREG inode, and
+ * that i_size an i_sectors are consistent
+ */
+noinline_for_stack
+static int check_extents(struct bch_fs *c)
+{
+	int ret;
+
+	if (!fsck_pass_needed(c, "check_extents", FSCK_BTREES(BIT(BTREE_ID_extents)|BIT(BTREE_ID_inodes))))
+		return 0;
 
+	bch_verbose(c, "checking extents");
+	fsck_progress_start(c, "check_extents", BTREE_ID_extents);
+
+	ret = fsck_run_sharded(c, BTREE_ID_extents, check_extents_shard);
+	ret = fsck_progress_end(c, ret);
 	if (ret)
 		bch_err(c, "error from check_extents(): %s", bch2_err_str(ret));
 	return ret;
@@ -1515,6 +1836,8 @@ static int check_dirent(struct btree_trans *trans, struct btree_iter *iter,
 	struct bpos equiv;
 	int ret = 0;
 
+	fsck_progress_key(c, k.k->p);
+
 	ret = check_key_has_snapshot(trans, iter, k);
 	if (ret) {
 		ret = ret < 0 ? ret : 0;
@@ -1672,39 +1995,130 @@ fsck_err:
 }
 
 /*
- * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
- * validate d_type
+ * Looking up dirent targets is random access into the inodes btree: to keep
+ * from stalling on each one, when the dirent walk passes the end of the last
+ * window we read ahead the next fsck_prefetch_inodes dirents, and issue reads
+ * for the inodes btree leaves their targets are in.
  */
-noinline_for_stack
-static int check_dirents(struct bch_fs *c)
+struct dirent_prefetch {
+	/* targets of dirents up to here have been prefetched: */
+	struct bpos		end;
+	DARRAY(struct bpos)	pos;
+};
+
+static int dirent_prefetch_pos_cmp(const void *l, const void *r)
+{
+	return bpos_cmp(*((const struct bpos *) l), *((const struct bpos *) r));
+}
+
+static int dirent_targets_prefetch(struct btree_trans *trans,
+				   struct dirent_prefetch *pf,
+				   struct bpos pos, struct bpos end)
+{
+	struct bch_fs *c = trans->c;
+	unsigned nr_dirents = c->opts.fsck_prefetch_inodes;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bpos last = pos;
+	struct bpos *i, *dst;
+	int ret;
+
+	if (!nr_dirents || bpos_cmp(pos, pf->end) <= 0)
+		return 0;
+
+	pf->pos.nr = 0;
+
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_dirents, pos, end,
+					  BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		struct bkey_s_c_dirent d;
+
+		last = k.k->p;
+
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		d = bkey_s_c_to_dirent(k);
+		if (d.v->d_type != DT_SUBVOL) {
+			ret = darray_push(&pf->pos, POS(0, le64_to_cpu(d.v->d_inum)));
+			if (ret)
+				break;
+		}
+
+		if (!--nr_dirents)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (ret)
+		return ret;
+
+	sort(pf->pos.data, pf->pos.nr, sizeof(pf->pos.data[0]),
+	     dirent_prefetch_pos_cmp, NULL);
+
+	dst = pf->pos.data;
+	darray_for_each(pf->pos, i)
+		if (dst == pf->pos.data || bpos_cmp(*i, dst[-1]))
+			*dst++ = *i;
+	pf->pos.nr = dst - pf->pos.data;
+
+	ret = bch2_btree_multiget_prefetch(trans, BTREE_ID_inodes,
+					   pf->pos.data, pf->pos.nr, 0);
+	if (!ret)
+		pf->end = !nr_dirents ? last : end;
+	return ret;
+}
+
+static int check_dirents_shard(struct btree_trans *trans,
+			       struct bpos start, struct bpos end)
 {
 	struct inode_walker dir = inode_walker_init();
 	struct inode_walker target = inode_walker_init();
+	struct dirent_prefetch pf = { .end = POS_MIN };
 	struct snapshots_seen s;
 	struct bch_hash_info hash_info;
-	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	int ret = 0;
-
-	bch_verbose(c, "checking dirents");
+	int ret;
 
 	snapshots_seen_init(&s);
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+	darray_init(&pf.pos);
 
-	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_dirents,
-			POS(BCACHEFS_ROOT_INO, 0),
+	ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_dirents,
+			start, end,
 			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
 			k,
 			NULL, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
-		check_dirent(&trans, &iter, k, &hash_info, &dir, &target, &s));
+		dirent_targets_prefetch(trans, &pf, k.k->p, end) ?:
+		check_dirent(trans, &iter, k, &hash_info, &dir, &target, &s)) ?:
+		commit_do(trans, NULL, NULL,
+			  BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
+			  check_subdir_count(trans, &dir));
 
-	bch2_trans_exit(&trans);
+	darray_exit(&pf.pos);
 	snapshots_seen_exit(&s);
 	inode_walker_exit(&dir);
 	inode_walker_exit(&target);
+	return ret;
+}
+
+/*
+ * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
+ * validate d_type
+ */
+noinline_for_stack
+static int check_dirents(struct bch_fs *c)
+{
+	int ret;
+
+	if (!fsck_pass_needed(c, "check_dirents", FSCK_BTREES(BIT(BTREE_ID_dirents)|BIT(BTREE_ID_inodes))))
+		return 0;
+
+	bch_verbose(c, "checking dirents");
+	fsck_progress_start(c, "check_dirents", BTREE_ID_dirents);
 
+	ret = fsck_run_sharded(c, BTREE_ID_dirents, check_dirents_shard);
+	ret = fsck_progress_end(c, ret);
 	if (ret)
 		bch_err(c, "error from check_dirents(): %s", bch2_err_str(ret));
 	return ret;
@@ -1716,8 +2130,11 @@ static int check_xattr(struct btree_trans *trans, struct btree_iter *iter,
 		       struct inode_walker *inode)
 {
 	struct bch_fs *c = trans->c;
+	struct inode_walker_entry *i;
 	int ret;
 
+	fsck_progress_key(c, k.k->p);
+
 	ret = check_key_has_snapshot(trans, iter, k);
 	if (ret)
 		return ret;
@@ -1734,51 +2151,77 @@ static int check_xattr(struct btree_trans *trans, struct btree_iter *iter,
 	if (ret == INT_MAX)
 		return 0;
 
+	i = inode->inodes.data + ret;
 	ret = 0;
 
 	if (inode->first_this_inode)
 		*hash_info = bch2_hash_info_init(c, &inode->inodes.data[0].inode);
 
 	ret = hash_check_key(trans, bch2_xattr_hash_desc, hash_info, iter, k);
+
+	/*
+	 * We deleted an xattr: the inode's inline xattr cache may have it, so
+	 * drop the cache in the same transaction:
+	 */
+	if (ret > 0) {
+		ret = 0;
+
+		if (i->inode.bi_xattrs_inline) {
+			i->inode.bi_xattrs_inline	= false;
+			i->inode.bi_xattrs_bytes	= 0;
+
+			ret = __write_inode(trans, &i->inode, i->snapshot);
+		}
+	}
 fsck_err:
 	if (ret && !bch2_err_matches(ret, BCH_ERR_transaction_restart))
 		bch_err(c, "error from check_xattr(): %s", bch2_err_str(ret));
 	return ret;
 }
 
-/*
- * Walk xattrs: verify that they all have a corresponding inode
- */
-noinline_for_stack
-static int check_xattrs(struct bch_fs *c)
+static int check_xattrs_shard(struct btree_trans *trans,
+			      struct bpos start, struct bpos end)
 {
 	struct inode_walker inode = inode_walker_init();
 	struct bch_hash_info hash_info;
-	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	int ret = 0;
-
-	bch_verbose(c, "checking xattrs");
-
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+	int ret;
 
-	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_xattrs,
-			POS(BCACHEFS_ROOT_INO, 0),
+	ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_xattrs,
+			start, end,
 			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
 			k,
 			NULL, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
-		check_xattr(&trans, &iter, k, &hash_info, &inode));
-
-	bch2_trans_exit(&trans);
+		check_xattr(trans, &iter, k, &hash_info, &inode));
 
-	if (ret)
-		bch_err(c, "error from check_xattrs(): %s", bch2_err_str(ret));
+	inode_walker_exit(&inode);
 	return ret;
 }
 
-static int check_root_trans(struct btree_trans *trans)
+/*
+ * Walk xattrs: verify that they all have a corresponding inode
+ */
+noinline_for_stack
+static int check_xattrs(struct bch_fs *c)
+{
+	int ret;
+
+	if (!fsck_pass_needed(c, "check_xattrs", FSCK_BTREES(BIT(BTREE_ID_xattrs)|BIT(BTREE_ID_inodes))))
+		return 0;
+
+	bch_verbose(c, "checking xattrs");
+	fsck_progress_start(c, "check_xattrs", BTREE_ID_xattrs);
+
+	ret = fsck_run_sharded(c, BTREE_ID_xattrs, check_xattrs_shard);
+	ret = fsck_progress_end(c, ret);
+	if (ret)
+		bch_err(c, "error from check_xattrs(): %s", bch2_err_str(ret));
+	return ret;
+}
+
+static int check_root_trans(struct btree_trans *trans)
 {
 	struct bch_fs *c = trans->c;
 	struct bch_inode_unpacked root_inode;
@@ -1877,22 +2320,114 @@ static int path_down(struct bch_fs *c, pathbuf *p,
 	return ret;
 }
 
+/*
+ * Directories already known to be reachable from the root, so that
+ * check_path() only walks each ancestor chain once: open addressing, keyed by
+ * inode number and the snapshot the directory was found in. Inode number 0 is
+ * never a valid directory, and marks an empty slot.
+ */
+struct reachable_dirs {
+	size_t			nr;
+	size_t			size;
+	struct pathbuf_entry	*d;
+};
+
+static inline size_t reachable_dirs_slot(struct reachable_dirs *r,
+					 u64 inum, u32 snapshot)
+{
+	return hash_64(inum ^ ((u64) snapshot << 32), ilog2(r->size));
+}
+
+static bool reachable_dirs_has(struct reachable_dirs *r, u64 inum, u32 snapshot)
+{
+	size_t i;
+
+	if (!r->size)
+		return false;
+
+	for (i = reachable_dirs_slot(r, inum, snapshot);
+	     r->d[i].inum;
+	     i = (i + 1) & (r->size - 1))
+		if (r->d[i].inum	== inum &&
+		    r->d[i].snapshot	== snapshot)
+			return true;
+
+	return false;
+}
+
+static void __reachable_dirs_add(struct reachable_dirs *r, u64 inum, u32 snapshot)
+{
+	size_t i;
+
+	for (i = reachable_dirs_slot(r, inum, snapshot);
+	     r->d[i].inum;
+	     i = (i + 1) & (r->size - 1))
+		if (r->d[i].inum	== inum &&
+		    r->d[i].snapshot	== snapshot)
+			return;
+
+	r->d[i] = (struct pathbuf_entry) {
+		.inum		= inum,
+		.snapshot	= snapshot,
+	};
+	r->nr++;
+}
+
+static int reachable_dirs_add(struct bch_fs *c, struct reachable_dirs *r,
+			      u64 inum, u32 snapshot)
+{
+	if ((r->nr + 1) * 4 > r->size * 3) {
+		struct reachable_dirs n = {
+			.size = max_t(size_t, 1024, r->size * 2),
+		};
+		size_t i;
+
+		n.d = kvmalloc_array(n.size, sizeof(n.d[0]), GFP_KERNEL|__GFP_ZERO);
+		if (!n.d) {
+			bch_err(c, "fsck: error allocating memory for reachable dirs table, size %zu",
+				n.size);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < r->size; i++)
+			if (r->d[i].inum)
+				__reachable_dirs_add(&n, r->d[i].inum, r->d[i].snapshot);
+
+		kvfree(r->d);
+		*r = n;
+	}
+
+	__reachable_dirs_add(r, inum, snapshot);
+	return 0;
+}
+
 /*
  * Check that a given inode is reachable from the root:
  *
+ * Directories on a path that checks out are remembered in @reachable, and the
+ * walk stops at the first one it finds, so that deep directory trees aren't
+ * rewalked for every descendant.
+ *
  * XXX: we should also be verifying that inodes are in the right subvolumes
  */
 static int check_path(struct btree_trans *trans,
 		      pathbuf *p,
+		      struct reachable_dirs *reachable,
 		      struct bch_inode_unpacked *inode,
 		      u32 snapshot)
 {
 	struct bch_fs *c = trans->c;
+	struct pathbuf_entry *i;
+	bool repaired = false;
 	int ret = 0;
 
 	snapshot = bch2_snapshot_equiv(c, snapshot);
 	p->nr = 0;
 
+	if (S_ISDIR(inode->bi_mode) &&
+	    reachable_dirs_has(reachable, inode->bi_inum, snapshot))
+		return 0;
+
 	while (!(inode->bi_inum == BCACHEFS_ROOT_INO &&
 		 inode->bi_subvol == BCACHEFS_ROOT_SUBVOL)) {
 		struct btree_iter dirent_iter;
@@ -1928,6 +2463,7 @@ static int check_path(struct btree_trans *trans,
 				     inode->bi_dir,
 				     inode->bi_dir_offset))
 				ret = reattach_inode(trans, inode, snapshot);
+			repaired = true;
 			break;
 		}
 
@@ -1951,9 +2487,10 @@ static int check_path(struct btree_trans *trans,
 			break;
 		}
 
-		if (path_is_dup(p, inode->bi_inum, snapshot)) {
-			struct pathbuf_entry *i;
+		if (reachable_dirs_has(reachable, inode->bi_inum, snapshot))
+			break;
 
+		if (path_is_dup(p, inode->bi_inum, snapshot)) {
 			/* XXX print path */
 			bch_err(c, "directory structure loop");
 
@@ -1974,8 +2511,17 @@ static int check_path(struct btree_trans *trans,
 			}
 
 			ret = reattach_inode(trans, inode, snapshot);
+			repaired = true;
 		}
 	}
+
+	/* Only remember paths we didn't have to change: */
+	if (!ret && !repaired)
+		darray_for_each(*p, i) {
+			ret = reachable_dirs_add(c, reachable, i->inum, i->snapshot);
+			if (ret)
+				break;
+		}
 fsck_err:
 	if (ret)
 		bch_err(c, "%s: err %s", __func__, bch2_err_str(ret));
@@ -1995,14 +2541,22 @@ static int check_directory_structure(struct bch_fs *c)
 	struct bkey_s_c k;
 	struct bch_inode_unpacked u;
 	pathbuf path = { 0, };
+	struct reachable_dirs reachable = { 0 };
 	int ret;
 
+	if (!fsck_pass_needed(c, "check_directory_structure", FSCK_BTREES(BIT(BTREE_ID_inodes)|BIT(BTREE_ID_dirents))))
+		return 0;
+
+	fsck_progress_start(c, "check_directory_structure", BTREE_ID_inodes);
+
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	for_each_btree_key(&trans, iter, BTREE_ID_inodes, POS_MIN,
 			   BTREE_ITER_INTENT|
 			   BTREE_ITER_PREFETCH|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		fsck_progress_key(c, k.k->p);
+
 		if (!bkey_is_inode(k.k))
 			continue;
 
@@ -2016,21 +2570,24 @@ static int check_directory_structure(struct bch_fs *c)
 		if (u.bi_flags & BCH_INODE_UNLINKED)
 			continue;
 
-		ret = check_path(&trans, &path, &u, iter.pos.snapshot);
+		ret = check_path(&trans, &path, &reachable, &u, iter.pos.snapshot);
 		if (ret)
 			break;
 	}
 	bch2_trans_iter_exit(&trans, &iter);
 
+	kvfree(reachable.d);
 	darray_exit(&path);
 
 	bch2_trans_exit(&trans);
-	return ret;
+	return fsck_progress_end(c, ret);
 }
 
 struct nlink_table {
 	size_t		nr;
 	size_t		size;
+	/* in bytes, 0 for no limit: */
+	size_t		max_size;
 
 	struct nlink {
 		u64	inum;
@@ -2044,7 +2601,14 @@ static int add_nlink(struct bch_fs *c, struct nlink_table *t,
 {
 	if (t->nr == t->size) {
 		size_t new_size = max_t(size_t, 128UL, t->size * 2);
-		void *d = kvmalloc(new_size * sizeof(t->d[0]), GFP_KERNEL);
+		void *d;
+
+		/* Caller will split up the range of inodes to check: */
+		if (t->max_size &&
+		    new_size * sizeof(t->d[0]) > t->max_size)
+			return -ENOMEM;
+
+		d = kvmalloc(new_size * sizeof(t->d[0]), GFP_KERNEL);
 		if (!d) {
 			bch_err(c, "fsck: error allocating memory for nlink_table, size %zu",
 				new_size);
@@ -2114,6 +2678,8 @@ static int check_nlinks_find_hardlinks(struct bch_fs *c,
 	struct bch_inode_unpacked u;
 	int ret = 0;
 
+	fsck_progress_start(c, "check_nlinks", BTREE_ID_inodes);
+
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	for_each_btree_key(&trans, iter, BTREE_ID_inodes,
@@ -2121,6 +2687,8 @@ static int check_nlinks_find_hardlinks(struct bch_fs *c,
 			   BTREE_ITER_INTENT|
 			   BTREE_ITER_PREFETCH|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		fsck_progress_key(c, k.k->p);
+
 		if (!bkey_is_inode(k.k))
 			continue;
 
@@ -2165,6 +2733,7 @@ static int check_nlinks_walk_dirents(struct bch_fs *c, struct nlink_table *links
 	struct bkey_s_c_dirent d;
 	int ret;
 
+	fsck_progress_start(c, "check_nlinks", BTREE_ID_dirents);
 	snapshots_seen_init(&s);
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
@@ -2173,6 +2742,8 @@ static int check_nlinks_walk_dirents(struct bch_fs *c, struct nlink_table *links
 			   BTREE_ITER_INTENT|
 			   BTREE_ITER_PREFETCH|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		fsck_progress_key(c, k.k->p);
+
 		ret = snapshots_seen_update(c, &s, iter.btree_id, k.k->p);
 		if (ret)
 			break;
@@ -2212,6 +2783,8 @@ static int check_nlinks_update_inode(struct btree_trans *trans, struct btree_ite
 	if (k.k->p.offset >= range_end)
 		return 1;
 
+	fsck_progress_key(c, k.k->p);
+
 	if (!bkey_is_inode(k.k))
 		return 0;
 
@@ -2251,6 +2824,8 @@ static int check_nlinks_update_hardlinks(struct bch_fs *c,
 	size_t idx = 0;
 	int ret = 0;
 
+	fsck_progress_start(c, "check_nlinks", BTREE_ID_inodes);
+
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_inodes,
@@ -2269,15 +2844,486 @@ static int check_nlinks_update_hardlinks(struct bch_fs *c,
 	return 0;
 }
 
+#ifndef __KERNEL__
+
+/*
+ * External sort mode for check_nlinks, for when the hardlink table doesn't
+ * fit in memory: instead of rescanning dirents once per range of inodes,
+ * dirents are walked once and every reference to a non directory inode is
+ * appended to sorted runs, spilled to a temporary file. The runs are then
+ * merged, in inode number order, alongside a single walk of the inodes btree.
+ *
+ * Whether a reference is visible in a given snapshot depends on the
+ * snapshots_seen at the dirent's position, so that's saved with each
+ * reference; if it's too big to save (lots of overwrites in snapshots of one
+ * dirent), we fall back to the in memory mode.
+ */
+#define NLINK_REF_SEEN_MAX	5
+#define NLINK_PROGRESS_INTERVAL	(10 * HZ)
+
+struct nlink_ref {
+	u64		inum;
+	u32		snapshot;
+	u32		nr_seen;
+	u32		seen[NLINK_REF_SEEN_MAX];
+	/* only used while merging: */
+	u32		done;
+};
+
+struct nlink_run {
+	u64		pos, end;	/* in refs, in the temporary file */
+	struct nlink_ref *buf;
+	unsigned	buf_nr, buf_idx;
+};
+
+struct nlink_external {
+	struct bch_fs	*c;
+	int		fd;
+	size_t		mem;
+
+	/* while walking dirents: */
+	struct nlink_ref *buf;
+	size_t		buf_nr, buf_size;
+
+	/* while merging: */
+	DARRAY(struct nlink_run) runs;
+	HEAP(struct nlink_run *) heap;
+	unsigned	run_buf_size;
+
+	/* references to the inode number currently being checked: */
+	DARRAY(struct nlink_ref) refs;
+	u64		inum;
+	/* so that a transaction restart doesn't count references twice: */
+	struct bpos	last_pos;
+	u32		last_count;
+
+	u64		nr_refs;
+	u64		nr_merged;
+	unsigned long	last_progress;
+};
+
+static size_t nlink_mem_budget(void)
+{
+	struct sysinfo info;
+
+	si_meminfo(&info);
+
+	/* no limit if we can't tell: */
+	return (u64) info.freeram * info.mem_unit / 4;
+}
+
+static int nlink_ref_cmp(const void *_l, const void *_r)
+{
+	const struct nlink_ref *l = _l;
+	const struct nlink_ref *r = _r;
+
+	return cmp_int(l->inum, r->inum) ?: cmp_int(l->snapshot, r->snapshot);
+}
+
+static int nlink_pwrite(int fd, const void *buf, size_t len, u64 offset)
+{
+	while (len) {
+		ssize_t r = pwrite(fd, buf, len, offset);
+
+		if (r < 0)
+			return -errno;
+
+		buf	+= r;
+		len	-= r;
+		offset	+= r;
+	}
+
+	return 0;
+}
+
+static int nlink_pread(int fd, void *buf, size_t len, u64 offset)
+{
+	while (len) {
+		ssize_t r = pread(fd, buf, len, offset);
+
+		if (r < 0)
+			return -errno;
+		if (!r)
+			return -EIO;
+
+		buf	+= r;
+		len	-= r;
+		offset	+= r;
+	}
+
+	return 0;
+}
+
+static int nlink_run_flush(struct nlink_external *e)
+{
+	struct nlink_run r = {
+		.pos	= e->nr_refs,
+		.end	= e->nr_refs + e->buf_nr,
+	};
+	int ret;
+
+	if (!e->buf_nr)
+		return 0;
+
+	sort(e->buf, e->buf_nr, sizeof(e->buf[0]), nlink_ref_cmp, NULL);
+
+	ret =   nlink_pwrite(e->fd, e->buf, e->buf_nr * sizeof(e->buf[0]),
+			     r.pos * sizeof(e->buf[0])) ?:
+		darray_push(&e->runs, r);
+	if (ret)
+		return ret;
+
+	e->nr_refs += e->buf_nr;
+	e->buf_nr = 0;
+	return 0;
+}
+
+static int nlink_ref_add(struct nlink_external *e, struct snapshots_seen *s,
+			 u64 inum, u32 snapshot)
+{
+	struct nlink_ref *ref;
+	unsigned i;
+
+	if (s->ids.nr > NLINK_REF_SEEN_MAX)
+		return -EOPNOTSUPP;
+
+	if (e->buf_nr == e->buf_size) {
+		int ret = nlink_run_flush(e);
+		if (ret)
+			return ret;
+	}
+
+	ref = e->buf + e->buf_nr++;
+	memset(ref, 0, sizeof(*ref));
+	ref->inum	= inum;
+	ref->snapshot	= snapshot;
+	ref->nr_seen	= s->ids.nr;
+	for (i = 0; i < s->ids.nr; i++)
+		ref->seen[i] = s->ids.data[i].equiv;
+	return 0;
+}
+
+static int check_nlinks_external_walk_dirents(struct nlink_external *e)
+{
+	struct bch_fs *c = e->c;
+	struct btree_trans trans;
+	struct snapshots_seen s;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent d;
+	int ret;
+
+	fsck_progress_start(c, "check_nlinks", BTREE_ID_dirents);
+	snapshots_seen_init(&s);
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_dirents, POS_MIN,
+			   BTREE_ITER_INTENT|
+			   BTREE_ITER_PREFETCH|
+			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		fsck_progress_key(c, k.k->p);
+
+		ret = snapshots_seen_update(c, &s, iter.btree_id, k.k->p);
+		if (ret)
+			break;
+
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		d = bkey_s_c_to_dirent(k);
+
+		if (d.v->d_type != DT_DIR &&
+		    d.v->d_type != DT_SUBVOL) {
+			ret = nlink_ref_add(e, &s, le64_to_cpu(d.v->d_inum),
+					    bch2_snapshot_equiv(c, d.k->p.snapshot));
+			if (ret)
+				break;
+		}
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+
+	bch2_trans_exit(&trans);
+	snapshots_seen_exit(&s);
+
+	return ret ?: nlink_run_flush(e);
+}
+
+/* Returns 1 if the run has refs left: */
+static int nlink_run_fill(struct nlink_external *e, struct nlink_run *r)
+{
+	int ret;
+
+	if (r->buf_idx < r->buf_nr)
+		return 1;
+	if (r->pos == r->end)
+		return 0;
+
+	r->buf_nr	= min_t(u64, e->run_buf_size, r->end - r->pos);
+	r->buf_idx	= 0;
+
+	ret = nlink_pread(e->fd, r->buf, r->buf_nr * sizeof(r->buf[0]),
+			  r->pos * sizeof(r->buf[0]));
+	if (ret)
+		return ret;
+
+	r->pos += r->buf_nr;
+	return 1;
+}
+
+static inline int nlink_run_heap_cmp(void *h, struct nlink_run *l,
+				     struct nlink_run *r)
+{
+	return nlink_ref_cmp(l->buf + l->buf_idx, r->buf + r->buf_idx);
+}
+
+static int nlink_merge_start(struct nlink_external *e)
+{
+	struct nlink_run *r;
+	int ret;
+
+	e->run_buf_size = clamp_t(size_t,
+			e->mem / max_t(size_t, e->runs.nr, 1) / sizeof(struct nlink_ref),
+			64, 1U << 16);
+
+	if (!init_heap(&e->heap, max_t(size_t, e->runs.nr, 1), GFP_KERNEL))
+		return -ENOMEM;
+
+	darray_for_each(e->runs, r) {
+		r->buf = kvmalloc_array(e->run_buf_size, sizeof(r->buf[0]), GFP_KERNEL);
+		if (!r->buf)
+			return -ENOMEM;
+
+		ret = nlink_run_fill(e, r);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			BUG_ON(!heap_add(&e->heap, r, nlink_run_heap_cmp, NULL));
+	}
+
+	e->inum		= 0;
+	e->last_pos	= POS_MAX;
+	e->last_progress = jiffies;
+	return 0;
+}
+
+/* Collect the references to @inum, dropping references to missing inodes: */
+static int nlink_merge_load(struct nlink_external *e, u64 inum)
+{
+	int ret;
+
+	e->refs.nr = 0;
+
+	while (e->heap.used) {
+		struct nlink_run *r = heap_peek(&e->heap);
+		struct nlink_ref *ref = r->buf + r->buf_idx;
+
+		if (ref->inum > inum)
+			break;
+
+		if (ref->inum == inum) {
+			ret = darray_push(&e->refs, *ref);
+			if (ret)
+				return ret;
+		}
+
+		e->nr_merged++;
+		r->buf_idx++;
+
+		ret = nlink_run_fill(e, r);
+		if (ret < 0)
+			return ret;
+
+		if (ret)
+			heap_sift_down(&e->heap, 0, nlink_run_heap_cmp, NULL);
+		else
+			heap_del(&e->heap, 0, nlink_run_heap_cmp, NULL);
+	}
+
+	e->inum = inum;
+
+	if (time_after(jiffies, e->last_progress + NLINK_PROGRESS_INTERVAL)) {
+		bch_info(e->c, "checking nlinks: %llu/%llu references (%llu%%)",
+			 e->nr_merged, e->nr_refs,
+			 div64_u64(e->nr_merged * 100, max_t(u64, e->nr_refs, 1)));
+		e->last_progress = jiffies;
+	}
+
+	return 0;
+}
+
+static bool nlink_ref_visible(struct bch_fs *c, struct nlink_ref *ref, u32 dst)
+{
+	struct snapshots_seen_entry ids[NLINK_REF_SEEN_MAX];
+	struct snapshots_seen s = { .pos.snapshot = ref->snapshot };
+	unsigned i;
+
+	for (i = 0; i < ref->nr_seen; i++)
+		ids[i] = (struct snapshots_seen_entry) {
+			.id	= ref->seen[i],
+			.equiv	= ref->seen[i],
+		};
+
+	s.ids.data	= ids;
+	s.ids.nr	= ref->nr_seen;
+	s.ids.size	= ARRAY_SIZE(ids);
+
+	return ref_visible(c, &s, ref->snapshot, dst);
+}
+
+/*
+ * Inodes are visited in snapshot order within an inode number, and a reference
+ * is counted the same way inc_link() does: against every visible inode up to
+ * the first one in a snapshot at or after the reference's.
+ */
+static int check_nlinks_external_inode(struct btree_trans *trans,
+				       struct btree_iter *iter,
+				       struct bkey_s_c k,
+				       struct nlink_external *e)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_inode_unpacked u;
+	struct nlink_ref *ref;
+	int ret = 0;
+
+	fsck_progress_key(c, k.k->p);
+
+	if (!bkey_is_inode(k.k))
+		return 0;
+
+	BUG_ON(bch2_inode_unpack(k, &u));
+
+	if (S_ISDIR(le16_to_cpu(u.bi_mode)))
+		return 0;
+
+	if (!u.bi_nlink)
+		return 0;
+
+	if (bpos_cmp(k.k->p, e->last_pos)) {
+		if (k.k->p.offset != e->inum) {
+			ret = nlink_merge_load(e, k.k->p.offset);
+			if (ret)
+				return ret;
+		}
+
+		e->last_pos	= k.k->p;
+		e->last_count	= 0;
+
+		darray_for_each(e->refs, ref)
+			if (!ref->done &&
+			    nlink_ref_visible(c, ref, k.k->p.snapshot)) {
+				e->last_count++;
+				if (k.k->p.snapshot >= ref->snapshot)
+					ref->done = true;
+			}
+	}
+
+	if (fsck_err_on(bch2_inode_nlink_get(&u) != e->last_count, c,
+			"inode %llu type %s has wrong i_nlink (%u, should be %u)",
+			u.bi_inum, bch2_d_types[mode_to_type(u.bi_mode)],
+			bch2_inode_nlink_get(&u), e->last_count)) {
+		bch2_inode_nlink_set(&u, e->last_count);
+		ret = __write_inode(trans, &u, k.k->p.snapshot);
+	}
+fsck_err:
+	return ret;
+}
+
+static void nlink_external_exit(struct nlink_external *e)
+{
+	struct nlink_run *r;
+
+	darray_exit(&e->refs);
+	darray_for_each(e->runs, r)
+		kvfree(r->buf);
+	darray_exit(&e->runs);
+	free_heap(&e->heap);
+	kvfree(e->buf);
+	if (e->fd >= 0)
+		close(e->fd);
+}
+
+/* Returns -EOPNOTSUPP if the in memory mode has to be used instead: */
+noinline_for_stack
+static int check_nlinks_external(struct bch_fs *c, size_t mem)
+{
+	struct nlink_external e = {
+		.c	= c,
+		.mem	= mem,
+		.fd	= -1,
+	};
+	const char *tmpdir = getenv("TMPDIR") ?: "/tmp";
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	e.fd = open(tmpdir, O_TMPFILE|O_RDWR|O_EXCL, 0600);
+	if (e.fd < 0) {
+		bch_err(c, "fsck: error creating temporary file in %s: %s",
+			tmpdir, strerror(errno));
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	e.buf_size = max_t(size_t, mem / sizeof(e.buf[0]), 1024);
+	e.buf = kvmalloc_array(e.buf_size, sizeof(e.buf[0]), GFP_KERNEL);
+	if (!e.buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = check_nlinks_external_walk_dirents(&e);
+	if (ret)
+		goto err;
+
+	kvfree(e.buf);
+	e.buf = NULL;
+
+	bch_info(c, "checking nlinks: sorted %llu references into %zu runs",
+		 e.nr_refs, e.runs.nr);
+
+	ret = nlink_merge_start(&e);
+	if (ret)
+		goto err;
+
+	fsck_progress_start(c, "check_nlinks", BTREE_ID_inodes);
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_inodes,
+			POS_MIN,
+			BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			NULL, NULL, BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
+		check_nlinks_external_inode(&trans, &iter, k, &e));
+
+	bch2_trans_exit(&trans);
+err:
+	if (ret && ret != -EOPNOTSUPP)
+		bch_err(c, "error in fsck: %s while checking nlinks", bch2_err_str(ret));
+	nlink_external_exit(&e);
+	return ret;
+}
+
+#endif /* __KERNEL__ */
+
 noinline_for_stack
 static int check_nlinks(struct bch_fs *c)
 {
 	struct nlink_table links = { 0 };
 	u64 this_iter_range_start, next_iter_range_start = 0;
+	bool try_external = false;
 	int ret = 0;
 
+	if (!fsck_pass_needed(c, "check_nlinks", FSCK_BTREES(BIT(BTREE_ID_inodes)|BIT(BTREE_ID_dirents))))
+		return 0;
+
 	bch_verbose(c, "checking inode nlinks");
 
+#ifndef __KERNEL__
+	links.max_size = nlink_mem_budget();
+	try_external = links.max_size != 0;
+#endif
+
 	do {
 		this_iter_range_start = next_iter_range_start;
 		next_iter_range_start = U64_MAX;
@@ -2285,6 +3331,31 @@ static int check_nlinks(struct bch_fs *c)
 		ret = check_nlinks_find_hardlinks(c, &links,
 						  this_iter_range_start,
 						  &next_iter_range_start);
+#ifndef __KERNEL__
+		/*
+		 * If the hardlinks table doesn't fit in memory, we'd have to
+		 * walk dirents once per range - sort them externally instead:
+		 */
+		if (try_external && next_iter_range_start != U64_MAX) {
+			try_external = false;
+
+			kvfree(links.d);
+			links.d		= NULL;
+			links.nr	= 0;
+			links.size	= 0;
+
+			bch_info(c, "checking nlinks: hardlinks table too big for memory, sorting externally");
+
+			ret = check_nlinks_external(c, links.max_size);
+			if (ret != -EOPNOTSUPP)
+				break;
+
+			bch_info(c, "checking nlinks: external sort not possible, checking in ranges");
+			next_iter_range_start = 0;
+			ret = 0;
+			continue;
+		}
+#endif
 
 		ret = check_nlinks_walk_dirents(c, &links,
 					  this_iter_range_start,
@@ -2303,7 +3374,7 @@ static int check_nlinks(struct bch_fs *c)
 
 	kvfree(links.d);
 
-	return ret;
+	return fsck_progress_end(c, ret);
 }
 
 static int fix_reflink_p_key(struct btree_trans *trans, struct btree_iter *iter,
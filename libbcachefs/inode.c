@@ -13,6 +13,7 @@
 #include "subvolume.h"
 #include "varint.h"
 
+#include <linux/hash.h>
 #include <linux/random.h>
 
 #include <asm/unaligned.h>
@@ -106,6 +107,14 @@ void bch2_inode_pack(struct bch_fs *c,
 	out = last_nonzero_field;
 	nr_fields = last_nonzero_fieldnr;
 
+	if (inode->bi_xattrs_inline) {
+		*out++ = BCH_INODE_XATTRS_INLINE_MAGIC;
+		*out++ = inode->bi_xattrs_bytes;
+		memcpy(out, inode->bi_xattrs, inode->bi_xattrs_bytes);
+		out += inode->bi_xattrs_bytes;
+	}
+	BUG_ON(out > end);
+
 	bytes = out - (u8 *) &packed->inode.v;
 	set_bkey_val_bytes(&packed->inode.k, bytes);
 	memset_u64s_tail(&packed->inode.v, 0, bytes);
@@ -121,6 +130,10 @@ void bch2_inode_pack(struct bch_fs *c,
 		BUG_ON(unpacked.bi_inum		!= inode->bi_inum);
 		BUG_ON(unpacked.bi_hash_seed	!= inode->bi_hash_seed);
 		BUG_ON(unpacked.bi_mode		!= inode->bi_mode);
+		BUG_ON(unpacked.bi_xattrs_inline != inode->bi_xattrs_inline);
+		BUG_ON(unpacked.bi_xattrs_bytes	!= inode->bi_xattrs_bytes);
+		BUG_ON(memcmp(unpacked.bi_xattrs, inode->bi_xattrs,
+			      inode->bi_xattrs_bytes));
 
 #define x(_name, _bits)	if (unpacked._name != inode->_name)		\
 			panic("unpacked %llu should be %llu",		\
@@ -164,37 +177,86 @@ static noinline int bch2_inode_unpack_v1(struct bkey_s_c_inode inode,
 	return 0;
 }
 
+/* Fields wider than 64 bits are stored as two varints: */
+enum {
+#define x(_name, _bits)		+ (_bits > 64 ? 2 : 1)
+	BCH_INODE_NR_VARINTS = 0 BCH_INODE_FIELDS()
+#undef  x
+};
+
+enum {
+#define x(_name, _bits)		+ 1
+	BCH_INODE_NR_KNOWN_FIELDS = 0 BCH_INODE_FIELDS()
+#undef  x
+};
+
+/*
+ * The inline xattr cache is only a cache: if it's malformed, ignore it and
+ * look xattrs up in the btree:
+ */
+static void bch2_inode_xattrs_inline_unpack(struct bch_inode_unpacked *unpacked,
+					    const u8 *in, const u8 *end)
+{
+	const struct bch_inode_xattr_inline *x;
+	unsigned bytes;
+
+	if (end - in < 2 || in[0] != BCH_INODE_XATTRS_INLINE_MAGIC)
+		return;
+
+	bytes = in[1];
+	if (bytes > BCH_INODE_XATTRS_INLINE_MAX ||
+	    bytes > end - in - 2)
+		return;
+
+	memcpy(unpacked->bi_xattrs, in + 2, bytes);
+	unpacked->bi_xattrs_bytes = bytes;
+
+	for_each_inode_xattr_inline(unpacked, x)
+		if ((void *) x + sizeof(*x) > (void *) unpacked->bi_xattrs + bytes ||
+		    (void *) inode_xattr_inline_next(x) >
+		    (void *) unpacked->bi_xattrs + bytes) {
+			unpacked->bi_xattrs_bytes = 0;
+			return;
+		}
+
+	unpacked->bi_xattrs_inline = true;
+}
+
 static int bch2_inode_unpack_v2(struct bch_inode_unpacked *unpacked,
 				const u8 *in, const u8 *end,
 				unsigned nr_fields)
 {
-	unsigned fieldnr = 0;
+	u64 v[BCH_INODE_NR_VARINTS], *p = v;
+	unsigned fieldnr = 0, nr_varints = 0;
 	int ret;
-	u64 v[2];
 
 #define x(_name, _bits)							\
-	if (fieldnr < nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v[0]);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-									\
-		if (_bits > 64) {					\
-			ret = bch2_varint_decode_fast(in, end, &v[1]);	\
-			if (ret < 0)					\
-				return ret;				\
-			in += ret;					\
-		} else {						\
-			v[1] = 0;					\
-		}							\
+	if (fieldnr++ < nr_fields)					\
+		nr_varints += _bits > 64 ? 2 : 1;
+
+	BCH_INODE_FIELDS()
+#undef  x
+
+	ret = bch2_varint_decode_fast_n(in, end, v, nr_varints);
+	if (ret < 0)
+		return ret;
+
+	/* Fields from a newer version would be where the cache otherwise is: */
+	if (nr_fields <= BCH_INODE_NR_KNOWN_FIELDS)
+		bch2_inode_xattrs_inline_unpack(unpacked, in + ret, end);
+
+	fieldnr = 0;
+#define x(_name, _bits)							\
+	if (fieldnr++ < nr_fields) {					\
+		unpacked->_name = p[0];					\
+		if (p[0] != unpacked->_name)				\
+			return -1;					\
+		if (_bits > 64 && p[1])					\
+			return -1;					\
+		p += _bits > 64 ? 2 : 1;				\
 	} else {							\
-		v[0] = v[1] = 0;					\
-	}								\
-									\
-	unpacked->_name = v[0];						\
-	if (v[1] || v[0] != unpacked->_name)				\
-		return -1;						\
-	fieldnr++;
+		unpacked->_name = 0;					\
+	}
 
 	BCH_INODE_FIELDS()
 #undef  x
@@ -206,6 +268,9 @@ static int bch2_inode_unpack_v2(struct bch_inode_unpacked *unpacked,
 int bch2_inode_unpack(struct bkey_s_c k,
 		      struct bch_inode_unpacked *unpacked)
 {
+	unpacked->bi_xattrs_inline	= false;
+	unpacked->bi_xattrs_bytes	= 0;
+
 	switch (k.k->type) {
 	case KEY_TYPE_inode: {
 		struct bkey_s_c_inode inode = bkey_s_c_to_inode(k);
@@ -388,6 +453,9 @@ static void __bch2_inode_unpacked_to_text(struct printbuf *out, struct bch_inode
 	prt_printf(out, " "#_name " %llu", (u64) inode->_name);
 	BCH_INODE_FIELDS()
 #undef  x
+
+	if (inode->bi_xattrs_inline)
+		prt_printf(out, " xattrs_inline %u", inode->bi_xattrs_bytes);
 }
 
 void bch2_inode_unpacked_to_text(struct printbuf *out, struct bch_inode_unpacked *inode)
@@ -409,6 +477,68 @@ void bch2_inode_to_text(struct printbuf *out, struct bch_fs *c,
 	__bch2_inode_unpacked_to_text(out, &inode);
 }
 
+/* Inline xattr cache: */
+
+const struct bch_inode_xattr_inline *
+bch2_inode_xattr_inline_find(const struct bch_inode_unpacked *inode,
+			     unsigned type, const char *name, unsigned name_len)
+{
+	const struct bch_inode_xattr_inline *x;
+
+	for_each_inode_xattr_inline(inode, x)
+		if (x->x_type == type &&
+		    x->x_name_len == name_len &&
+		    !memcmp(x->x_name, name, name_len))
+			return x;
+	return NULL;
+}
+
+/*
+ * Called for every change to an inode's xattrs, in the same transaction as the
+ * xattrs btree update, with the inode that transaction writes: @val NULL
+ * deletes. An xattr that doesn't fit means the cache can't be complete
+ * anymore, so it's dropped for good and lookups go back to the btree.
+ */
+void bch2_inode_xattr_inline_set(struct bch_inode_unpacked *inode,
+				 unsigned type, const char *name, unsigned name_len,
+				 const void *val, unsigned val_len)
+{
+	struct bch_inode_xattr_inline *x;
+	unsigned bytes = sizeof(*x) + name_len + val_len;
+
+	if (!inode->bi_xattrs_inline)
+		return;
+
+	x = (void *) bch2_inode_xattr_inline_find(inode, type, name, name_len);
+	if (x) {
+		u8 *next = (void *) inode_xattr_inline_next(x);
+		u8 *end = inode->bi_xattrs + inode->bi_xattrs_bytes;
+
+		memmove(x, next, end - next);
+		inode->bi_xattrs_bytes -= next - (u8 *) x;
+	}
+
+	if (!val)
+		return;
+
+	if (name_len > U8_MAX ||
+	    val_len > U8_MAX ||
+	    inode->bi_xattrs_bytes + bytes > BCH_INODE_XATTRS_INLINE_MAX) {
+		inode->bi_xattrs_inline	= false;
+		inode->bi_xattrs_bytes	= 0;
+		return;
+	}
+
+	x = (void *) inode->bi_xattrs + inode->bi_xattrs_bytes;
+	x->x_type	= type;
+	x->x_name_len	= name_len;
+	x->x_val_len	= val_len;
+	memcpy(x->x_name, name, name_len);
+	memcpy((void *) inode_xattr_inline_val(x), val, val_len);
+
+	inode->bi_xattrs_bytes += bytes;
+}
+
 int bch2_inode_generation_invalid(const struct bch_fs *c, struct bkey_s_c k,
 				  int rw, struct printbuf *err)
 {
@@ -446,6 +576,9 @@ void bch2_inode_init_early(struct bch_fs *c,
 	inode_u->bi_flags |= str_hash << INODE_STR_HASH_OFFSET;
 	get_random_bytes(&inode_u->bi_hash_seed,
 			 sizeof(inode_u->bi_hash_seed));
+
+	/* A new inode has no xattrs, so its (empty) cache is complete: */
+	inode_u->bi_xattrs_inline = c->opts.inline_xattrs;
 }
 
 void bch2_inode_init_late(struct bch_inode_unpacked *inode_u, u64 now,
@@ -496,6 +629,67 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
+/*
+ * Without sharding, each cpu allocates inode numbers from its own range, so
+ * that parallel creates insert into different btree nodes:
+ */
+#define INODE_ALLOC_RANGE		4096U
+/* After this many used up ranges in a row, search the whole inode space: */
+#define INODE_ALLOC_REFILLS_MAX		4
+
+/*
+ * Start handing out ranges after the last inode number in use, instead of
+ * walking (and colliding with) every used up range again after each mount:
+ */
+static int inode_alloc_cursor_seed(struct btree_trans *trans, u64 min, u64 max)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 v, old, seed = 0;
+	int ret;
+
+	if (likely(smp_load_acquire(&c->inode_alloc_cursor_seeded)))
+		return 0;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes, POS(0, max),
+			     BTREE_ITER_ALL_SNAPSHOTS);
+	k = bch2_btree_iter_peek_prev(&iter);
+	ret = bkey_err(k);
+	if (!ret && k.k && !k.k->p.inode && k.k->p.offset >= min)
+		seed = div64_u64(k.k->p.offset - min, INODE_ALLOC_RANGE) + 1;
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (ret)
+		return ret;
+
+	v = atomic64_read(&c->inode_alloc_cursor);
+	do {
+		old = v;
+		if (old >= seed)
+			break;
+	} while ((v = atomic64_cmpxchg(&c->inode_alloc_cursor, old, seed)) != old);
+
+	smp_store_release(&c->inode_alloc_cursor_seeded, true);
+	return 0;
+}
+
+static void inode_alloc_range_refill(struct bch_fs *c,
+				     struct inode_alloc_range *r,
+				     u64 min, u64 max)
+{
+	u64 nr = max_t(u64, (max - min) / INODE_ALLOC_RANGE, 1);
+	u64 start;
+
+	div64_u64_rem(atomic64_inc_return(&c->inode_alloc_cursor) - 1, nr, &start);
+	start = min + start * INODE_ALLOC_RANGE;
+
+	WRITE_ONCE(r->pos, start);
+	WRITE_ONCE(r->end, min_t(u64, start + INODE_ALLOC_RANGE, max));
+
+	this_cpu_inc(c->counters[BCH_COUNTER_inode_alloc_range_refill]);
+}
+
 /*
  * This just finds an empty slot:
  */
@@ -505,8 +699,10 @@ int bch2_inode_create(struct btree_trans *trans,
 		      u32 snapshot, u64 cpu)
 {
 	struct bch_fs *c = trans->c;
+	struct inode_alloc_range *r = NULL;
 	struct bkey_s_c k;
-	u64 min, max, start, pos, *hint;
+	u64 min, max, start, end, pos, *hint;
+	unsigned refills = 0;
 	int ret = 0;
 	unsigned bits = (c->opts.inodes_32bit ? 31 : 63);
 
@@ -522,12 +718,29 @@ int bch2_inode_create(struct btree_trans *trans,
 		min = BLOCKDEV_INODE_MAX;
 		max = ~(ULLONG_MAX << bits);
 		hint = c->unused_inode_hints;
+
+		r = c->inode_alloc_ranges +
+			(cpu & ((1U << c->inode_shard_bits) - 1));
+
+		ret = inode_alloc_cursor_seed(trans, min, max);
+		if (ret)
+			return ret;
 	}
 
 	start = READ_ONCE(*hint);
 
 	if (start >= max || start < min)
 		start = min;
+	end = max;
+
+	if (r) {
+		if (READ_ONCE(r->pos) >= READ_ONCE(r->end) ||
+		    READ_ONCE(r->end) > max)
+			inode_alloc_range_refill(c, r, min, max);
+
+		start	= READ_ONCE(r->pos);
+		end	= READ_ONCE(r->end);
+	}
 
 	pos = start;
 	bch2_trans_iter_init(trans, iter, BTREE_ID_inodes, POS(0, pos),
@@ -536,7 +749,7 @@ int bch2_inode_create(struct btree_trans *trans,
 again:
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret = bkey_err(k)) &&
-	       bkey_cmp(k.k->p, POS(0, max)) < 0) {
+	       bkey_cmp(k.k->p, POS(0, end)) < 0) {
 		while (pos < iter->pos.offset) {
 			if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos)))
 				goto found_slot;
@@ -551,6 +764,9 @@ again:
 			continue;
 		}
 
+		if (r)
+			this_cpu_inc(c->counters[BCH_COUNTER_inode_alloc_collision]);
+
 		/*
 		 * We don't need to iterate over keys in every snapshot once
 		 * we've found just one:
@@ -559,13 +775,32 @@ again:
 		bch2_btree_iter_set_pos(iter, POS(0, pos));
 	}
 
-	while (!ret && pos < max) {
+	while (!ret && pos < end) {
 		if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos)))
 			goto found_slot;
 
 		pos++;
 	}
 
+	if (!ret && r) {
+		/* This range is used up: try another, or search everything */
+		if (++refills < INODE_ALLOC_REFILLS_MAX) {
+			inode_alloc_range_refill(c, r, min, max);
+			start	= READ_ONCE(r->pos);
+			end	= READ_ONCE(r->end);
+		} else {
+			r	= NULL;
+			start	= READ_ONCE(*hint);
+			if (start >= max || start < min)
+				start = min;
+			end	= max;
+		}
+
+		pos = start;
+		bch2_btree_iter_set_pos(iter, POS(0, pos));
+		goto again;
+	}
+
 	if (!ret && start == min)
 		ret = -BCH_ERR_ENOSPC_inode_create;
 
@@ -589,10 +824,21 @@ found_slot:
 
 	/* We may have raced while the iterator wasn't pointing at pos: */
 	if (bkey_is_inode(k.k) ||
-	    bch2_btree_key_cache_find(c, BTREE_ID_inodes, k.k->p))
+	    bch2_btree_key_cache_find(c, BTREE_ID_inodes, k.k->p)) {
+		if (r)
+			this_cpu_inc(c->counters[BCH_COUNTER_inode_alloc_collision]);
 		goto again;
+	}
 
-	*hint			= k.k->p.offset;
+	/*
+	 * Advance past the slot we took: it isn't visible to the btree until
+	 * we commit, and bch2_create_batch_trans() allocates several inodes in
+	 * one transaction:
+	 */
+	if (r)
+		WRITE_ONCE(r->pos, k.k->p.offset + 1);
+	else
+		*hint		= k.k->p.offset + 1;
 	inode_u->bi_inum	= k.k->p.offset;
 	inode_u->bi_generation	= bkey_generation(k);
 	return 0;
@@ -737,6 +983,114 @@ int bch2_inode_find_by_inum(struct bch_fs *c, subvol_inum inum,
 		bch2_inode_find_by_inum_trans(&trans, inum, inode));
 }
 
+/* Cached io options: */
+
+static struct bch_io_opts_cache_set *io_opts_cache_set(struct bch_fs *c, u64 inum)
+{
+	return c->io_opts_cache.sets + hash_64(inum, BCH_IO_OPTS_CACHE_SETS_BITS);
+}
+
+/*
+ * Effective io options for extents of inode @inum in snapshot @snapshot:
+ * returns -ENOENT if there's no such inode.
+ */
+int bch2_inode_opts_get_cached(struct btree_trans *trans, u64 inum, u32 snapshot,
+			       struct bch_io_opts *opts)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_io_opts_cache_set *s = io_opts_cache_set(c, inum);
+	struct bch_inode_unpacked inode;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	unsigned i;
+	u32 seq;
+	int ret;
+
+	spin_lock(&c->io_opts_cache.lock);
+	for (i = 0; i < ARRAY_SIZE(s->e); i++)
+		if (s->e[i].inum == inum &&
+		    s->e[i].snapshot == snapshot) {
+			*opts = s->e[i].opts;
+			spin_unlock(&c->io_opts_cache.lock);
+			return 0;
+		}
+	seq = s->seq;
+	spin_unlock(&c->io_opts_cache.lock);
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes,
+			     SPOS(0, inum, snapshot), BTREE_ITER_CACHED);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k) ?:
+		(bkey_is_inode(k.k) ? 0 : -ENOENT) ?:
+		bch2_inode_unpack(k, &inode);
+	bch2_trans_iter_exit(trans, &iter);
+	if (ret)
+		return ret;
+
+	*opts = io_opts(c, &inode);
+
+	spin_lock(&c->io_opts_cache.lock);
+	if (s->seq == seq) {
+		i = s->next++ % ARRAY_SIZE(s->e);
+		s->e[i].inum		= inum;
+		s->e[i].snapshot	= snapshot;
+		s->e[i].opts		= *opts;
+	}
+	spin_unlock(&c->io_opts_cache.lock);
+	return 0;
+}
+
+void bch2_inode_opts_cache_invalidate(struct bch_fs *c, u64 inum)
+{
+	struct bch_io_opts_cache_set *s = io_opts_cache_set(c, inum);
+	unsigned i;
+
+	spin_lock(&c->io_opts_cache.lock);
+	s->seq++;
+	for (i = 0; i < ARRAY_SIZE(s->e); i++)
+		if (s->e[i].inum == inum)
+			s->e[i].inum = 0;
+	spin_unlock(&c->io_opts_cache.lock);
+}
+
+/* Filesystem options changed: */
+void bch2_inode_opts_cache_invalidate_all(struct bch_fs *c)
+{
+	struct bch_io_opts_cache_set *s;
+
+	spin_lock(&c->io_opts_cache.lock);
+	for (s = c->io_opts_cache.sets;
+	     s < c->io_opts_cache.sets + ARRAY_SIZE(c->io_opts_cache.sets);
+	     s++) {
+		s->seq++;
+		memset(s->e, 0, sizeof(s->e));
+	}
+	spin_unlock(&c->io_opts_cache.lock);
+}
+
+/*
+ * For the inode trigger: most inode updates are to i_size and timestamps, and
+ * mustn't evict the cached options:
+ */
+bool bch2_inode_opts_changed(struct bkey_s_c old, struct bkey_s_c new)
+{
+	struct bch_inode_unpacked o, n;
+
+	if (!bkey_is_inode(old.k) || !bkey_is_inode(new.k))
+		return bkey_is_inode(old.k) || bkey_is_inode(new.k);
+
+	if (bch2_inode_unpack(old, &o) ||
+	    bch2_inode_unpack(new, &n))
+		return true;
+
+#define x(_name, _bits)							\
+	if (o.bi_##_name != n.bi_##_name)				\
+		return true;
+	BCH_INODE_OPTS()
+#undef x
+	return false;
+}
+
 int bch2_inode_nlink_inc(struct bch_inode_unpacked *bi)
 {
 	if (bi->bi_flags & BCH_INODE_UNLINKED)
@@ -57,13 +57,19 @@ struct bch_inode_unpacked {
 #define x(_name, _bits)	u##_bits _name;
 	BCH_INODE_FIELDS()
 #undef  x
+
+	/* cache of small xattrs, see struct bch_inode_xattr_inline: */
+	bool			bi_xattrs_inline;
+	u8			bi_xattrs_bytes;
+	u8			bi_xattrs[BCH_INODE_XATTRS_INLINE_MAX];
 };
 
 struct bkey_inode_buf {
 	struct bkey_i_inode_v2	inode;
 
 #define x(_name, _bits)		+ 8 + _bits / 8
-	u8		_pad[0 + BCH_INODE_FIELDS()];
+	u8		_pad[0 + BCH_INODE_FIELDS() +
+			     2 + BCH_INODE_XATTRS_INLINE_MAX];
 #undef  x
 } __attribute__((packed, aligned(8)));
 
@@ -73,6 +79,31 @@ int bch2_inode_unpack(struct bkey_s_c, struct bch_inode_unpacked *);
 
 void bch2_inode_unpacked_to_text(struct printbuf *, struct bch_inode_unpacked *);
 
+static inline const void *
+inode_xattr_inline_val(const struct bch_inode_xattr_inline *x)
+{
+	return x->x_name + x->x_name_len;
+}
+
+static inline const struct bch_inode_xattr_inline *
+inode_xattr_inline_next(const struct bch_inode_xattr_inline *x)
+{
+	return inode_xattr_inline_val(x) + x->x_val_len;
+}
+
+#define for_each_inode_xattr_inline(_inode, _x)				\
+	for (_x = (void *) (_inode)->bi_xattrs;				\
+	     (void *) _x < (void *) (_inode)->bi_xattrs +		\
+			   (_inode)->bi_xattrs_bytes;				\
+	     _x = inode_xattr_inline_next(_x))
+
+const struct bch_inode_xattr_inline *
+bch2_inode_xattr_inline_find(const struct bch_inode_unpacked *, unsigned,
+			     const char *, unsigned);
+void bch2_inode_xattr_inline_set(struct bch_inode_unpacked *, unsigned,
+				 const char *, unsigned,
+				 const void *, unsigned);
+
 int bch2_inode_peek(struct btree_trans *, struct btree_iter *,
 		    struct bch_inode_unpacked *, subvol_inum, unsigned);
 int bch2_inode_write(struct btree_trans *, struct btree_iter *,
@@ -147,6 +178,12 @@ io_opts(struct bch_fs *c, struct bch_inode_unpacked *inode)
 	return opts;
 }
 
+int bch2_inode_opts_get_cached(struct btree_trans *, u64, u32,
+			       struct bch_io_opts *);
+void bch2_inode_opts_cache_invalidate(struct bch_fs *, u64);
+void bch2_inode_opts_cache_invalidate_all(struct bch_fs *);
+bool bch2_inode_opts_changed(struct bkey_s_c, struct bkey_s_c);
+
 static inline u8 mode_to_type(umode_t mode)
 {
 	return (mode >> 12) & 15;
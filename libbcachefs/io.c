@@ -26,6 +26,7 @@
 #include "journal.h"
 #include "keylist.h"
 #include "move.h"
+#include "read_cache.h"
 #include "rebalance.h"
 #include "subvolume.h"
 #include "super.h"
@@ -44,7 +45,10 @@ const char *bch2_blk_status_to_str(blk_status_t status)
 	return blk_status_to_str(status);
 }
 
-static bool bch2_target_congested(struct bch_fs *c, u16 target)
+/*
+ * @target may be 0, meaning all devices that take user data:
+ */
+bool __bch2_target_congested(struct bch_fs *c, u16 target)
 {
 	const struct bch_devs_mask *devs;
 	unsigned d, nr = 0, total = 0;
@@ -52,9 +56,6 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 	s64 congested;
 	struct bch_dev *ca;
 
-	if (!target)
-		return false;
-
 	rcu_read_lock();
 	devs = bch2_target_to_mask(c, target) ?:
 		&c->rw_devs[BCH_DATA_user];
@@ -77,6 +78,11 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 	return bch2_rand_range(nr * CONGESTED_MAX) < total;
 }
 
+static bool bch2_target_congested(struct bch_fs *c, u16 target)
+{
+	return target && __bch2_target_congested(c, target);
+}
+
 static inline void bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
 				       u64 now, int rw)
 {
@@ -103,7 +109,8 @@ static inline void bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
 	}
 }
 
-void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
+void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw,
+		       enum bch_data_type data_type)
 {
 	atomic64_t *latency = &ca->cur_latency[rw];
 	u64 now = local_clock();
@@ -130,18 +137,220 @@ void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
 	bch2_congested_acct(ca, io_latency, now, rw);
 
 	__bch2_time_stats_update(&ca->io_latency[rw], submit_time, now);
+	__bch2_time_stats_update(&ca->io_latency_by_type[rw][data_type],
+				 submit_time, now);
+}
+
+/* IO scheduling: */
+
+static const struct {
+	u32		rate;		/* MB/sec */
+	u32		deadline;	/* ms */
+} bch2_io_class_params[] = {
+#define x(n, _rate, _deadline)	{ .rate = _rate, .deadline = _deadline },
+	BCH_IO_CLASSES()
+#undef x
+};
+
+/*
+ * Background IO isn't held back when nothing of higher priority is running;
+ * when something is, each background class is limited to its own token bucket,
+ * except that a class that has been waiting for longer than its deadline gets
+ * to go anyways, so that it can't be starved:
+ */
+
+static inline u64 io_class_rate_sectors(enum bch_io_class class)
+{
+	return (u64) bch2_io_class_params[class].rate << (20 - 9);
+}
+
+/* How far a class's token bucket may fill, or go into debt: */
+static inline s64 io_class_burst_sectors(enum bch_io_class class)
+{
+	return io_class_rate_sectors(class) >> 3;
+}
+
+/*
+ * When allocations are blocked waiting for free buckets, copygc is what's
+ * going to free them - throttling it then only makes foreground writes wait
+ * longer:
+ */
+static inline bool io_class_exempt(struct bch_fs *c, enum bch_io_class class)
+{
+	return class == BCH_IO_CLASS_copygc &&
+		READ_ONCE(c->freelist_wait.list.first);
+}
+
+static bool io_sched_higher_busy(struct bch_fs *c, enum bch_io_class class,
+				 u64 now)
+{
+	unsigned i;
+
+	for (i = 0; i < class; i++) {
+		u64 last = READ_ONCE(c->io_sched.classes[i].last_active);
+
+		if (time_after64(last + BCH_IO_SCHED_BUSY_NS, now))
+			return true;
+	}
+
+	return false;
+}
+
+static s64 io_sched_refill(struct bch_fs *c, enum bch_io_class class, u64 now)
+{
+	struct bch_io_class_state *s = &c->io_sched.classes[class];
+	u64 rate = io_class_rate_sectors(class);
+	u64 elapsed = time_after64(now, s->last_refill)
+		? min_t(u64, now - s->last_refill, NSEC_PER_SEC)
+		: 0;
+
+	lockdep_assert_held(&c->io_sched.lock);
+
+	s->tokens = min_t(s64, s->tokens + div64_u64(elapsed * rate, NSEC_PER_SEC),
+			  io_class_burst_sectors(class));
+	s->last_refill = now;
+	return s->tokens;
+}
+
+void bch2_io_sched_charge(struct bch_fs *c, enum bch_io_class class,
+			  unsigned sectors)
+{
+	struct bch_io_sched *s = &c->io_sched;
+
+	bch2_io_sched_mark(c, class);
+
+	if (!bch2_io_class_params[class].rate ||
+	    io_class_exempt(c, class))
+		return;
+
+	/*
+	 * Clamp the debt, so that a burst of IO charged while nothing else was
+	 * running doesn't hold the class back for long after:
+	 */
+	spin_lock(&s->lock);
+	s->classes[class].tokens = max_t(s64, s->classes[class].tokens - sectors,
+					 -io_class_burst_sectors(class));
+	spin_unlock(&s->lock);
+}
+
+bool bch2_io_sched_may_submit(struct bch_fs *c, enum bch_io_class class)
+{
+	struct bch_io_sched *s = &c->io_sched;
+	u64 now = local_clock();
+	bool ret;
+
+	if (!bch2_io_class_params[class].rate ||
+	    io_class_exempt(c, class) ||
+	    !io_sched_higher_busy(c, class, now))
+		return true;
+
+	spin_lock(&s->lock);
+	ret = io_sched_refill(c, class, now) > 0;
+	spin_unlock(&s->lock);
+
+	return ret;
+}
+
+/*
+ * Wait until @class may submit more IO, or until it's been held back for its
+ * deadline:
+ */
+void bch2_io_sched_wait(struct bch_fs *c, enum bch_io_class class)
+{
+	u64 deadline = local_clock() +
+		(u64) bch2_io_class_params[class].deadline * NSEC_PER_MSEC;
+
+	while (!bch2_io_sched_may_submit(c, class) &&
+	       time_before64(local_clock(), deadline)) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(max(1UL, nsecs_to_jiffies(NSEC_PER_MSEC)));
+	}
+	__set_current_state(TASK_RUNNING);
 }
 
-/* Allocate, free from mempool: */
+/*
+ * Allocate, free from mempool:
+ *
+ * Bounce pages come from a small per cpu cache in front of the page allocator,
+ * refilled half at a time; the mempool is only used when the page allocator
+ * fails. Buffers bigger than a page are first tried as a single higher order
+ * allocation - physically contiguous, so that compression and checksumming
+ * don't have to vmap or bounce them again.
+ */
 
-void bch2_bio_free_pages_pool(struct bch_fs *c, struct bio *bio)
+static struct page *bounce_page_cache_get(struct bch_fs *c)
+{
+	struct bch_bounce_page_cache *pc = this_cpu_ptr(c->bounce_page_cache);
+	struct page *refill[BCH_BOUNCE_PAGE_CACHE_NR / 2], *page = NULL;
+	unsigned nr = 0;
+
+	spin_lock(&pc->lock);
+	if (pc->nr)
+		page = pc->pages[--pc->nr];
+	spin_unlock(&pc->lock);
+
+	if (page)
+		return page;
+
+	page = alloc_page(GFP_NOIO|__GFP_NOWARN);
+	if (!page)
+		return NULL;
+
+	count_event(c, bounce_pages_refill);
+
+	while (nr < ARRAY_SIZE(refill) &&
+	       (refill[nr] = alloc_page(GFP_NOIO|__GFP_NOWARN|__GFP_NORETRY)))
+		nr++;
+
+	spin_lock(&pc->lock);
+	while (nr && pc->nr < ARRAY_SIZE(pc->pages))
+		pc->pages[pc->nr++] = refill[--nr];
+	spin_unlock(&pc->lock);
+
+	while (nr)
+		__free_page(refill[--nr]);
+
+	return page;
+}
+
+static void bounce_page_cache_put(struct bch_fs *c, struct page *page)
+{
+	struct bch_bounce_page_cache *pc = this_cpu_ptr(c->bounce_page_cache);
+
+	spin_lock(&pc->lock);
+	if (pc->nr < ARRAY_SIZE(pc->pages)) {
+		pc->pages[pc->nr++] = page;
+		page = NULL;
+	}
+	spin_unlock(&pc->lock);
+
+	if (page)
+		mempool_free(page, &c->bio_bounce_pages);
+}
+
+/*
+ * @order is what bch2_bio_alloc_pages_pool() returned: if nonzero, the first
+ * bvec starts with a single allocation of that order, and everything else in
+ * the bio is order 0 pages:
+ */
+void bch2_bio_free_pages_pool(struct bch_fs *c, struct bio *bio, unsigned order)
 {
 	struct bvec_iter_all iter;
 	struct bio_vec *bv;
+	size_t contig = order ? PAGE_SIZE << order : 0;
+
+	if (order)
+		__free_pages(bio->bi_io_vec[0].bv_page, order);
+
+	bio_for_each_segment_all(bv, bio, iter) {
+		if (!iter.idx && contig) {
+			contig -= min_t(size_t, contig, bv->bv_len);
+			continue;
+		}
 
-	bio_for_each_segment_all(bv, bio, iter)
 		if (bv->bv_page != ZERO_PAGE(0))
-			mempool_free(bv->bv_page, &c->bio_bounce_pages);
+			bounce_page_cache_put(c, bv->bv_page);
+	}
 	bio->bi_vcnt = 0;
 }
 
@@ -150,10 +359,11 @@ static struct page *__bio_alloc_page_pool(struct bch_fs *c, bool *using_mempool)
 	struct page *page;
 
 	if (likely(!*using_mempool)) {
-		page = alloc_page(GFP_NOIO);
+		page = bounce_page_cache_get(c);
 		if (unlikely(!page)) {
 			mutex_lock(&c->bio_bounce_pages_lock);
 			*using_mempool = true;
+			count_event(c, bounce_pages_mempool);
 			goto pool_alloc;
 
 		}
@@ -165,10 +375,26 @@ pool_alloc:
 	return page;
 }
 
-void bch2_bio_alloc_pages_pool(struct bch_fs *c, struct bio *bio,
-			       size_t size)
+/*
+ * Returns the order of the allocation if we got a single physically contiguous
+ * one, which has to be passed to bch2_bio_free_pages_pool(), or 0:
+ */
+unsigned bch2_bio_alloc_pages_pool(struct bch_fs *c, struct bio *bio,
+				   size_t size)
 {
 	bool using_mempool = false;
+	unsigned order = get_order(size);
+
+	if (order && order <= BCH_BOUNCE_ORDER_MAX && !bio->bi_vcnt) {
+		struct page *page = alloc_pages(GFP_NOIO|__GFP_NOWARN|__GFP_NORETRY,
+						order);
+
+		if (page) {
+			count_event(c, bounce_pages_contig);
+			BUG_ON(!bio_add_page(bio, page, size, 0));
+			return order;
+		}
+	}
 
 	while (size) {
 		struct page *page = __bio_alloc_page_pool(c, &using_mempool);
@@ -180,6 +406,7 @@ void bch2_bio_alloc_pages_pool(struct bch_fs *c, struct bio *bio,
 
 	if (using_mempool)
 		mutex_unlock(&c->bio_bounce_pages_lock);
+	return 0;
 }
 
 /* Extent update path: */
@@ -240,7 +467,7 @@ int bch2_extent_update(struct btree_trans *trans,
 		       u64 *journal_seq,
 		       u64 new_i_size,
 		       s64 *i_sectors_delta_total,
-		       bool check_enospc)
+		       unsigned flags)
 {
 	struct btree_iter inode_iter;
 	struct bch_inode_unpacked inode_u;
@@ -277,7 +504,8 @@ int bch2_extent_update(struct btree_trans *trans,
 	    disk_sectors_delta > (s64) disk_res->sectors) {
 		ret = bch2_disk_reservation_add(trans->c, disk_res,
 					disk_sectors_delta - disk_res->sectors,
-					!check_enospc || !usage_increasing
+					!(flags & BCH_WRITE_CHECK_ENOSPC) ||
+					!usage_increasing
 					? BCH_DISK_RESERVATION_NOFAIL : 0);
 		if (ret)
 			return ret;
@@ -294,6 +522,14 @@ int bch2_extent_update(struct btree_trans *trans,
 
 	inode_u.bi_sectors += i_sectors_delta;
 
+	/*
+	 * For callers that don't otherwise update the inode on write: saves
+	 * them a separate transaction
+	 */
+	if (flags & BCH_WRITE_UPDATE_TIMES)
+		inode_u.bi_mtime = inode_u.bi_ctime =
+			bch2_current_time(trans->c);
+
 	ret =   bch2_trans_update(trans, iter, k, 0) ?:
 		bch2_inode_write(trans, &inode_iter, &inode_u) ?:
 		bch2_trans_commit(trans, disk_res, journal_seq,
@@ -361,7 +597,7 @@ int bch2_fpunch_at(struct btree_trans *trans, struct btree_iter *iter,
 
 		ret = bch2_extent_update(trans, inum, iter, &delete,
 				&disk_res, NULL,
-				0, i_sectors_delta, false);
+				0, i_sectors_delta, 0);
 		bch2_disk_reservation_put(c, &disk_res);
 	}
 
@@ -391,6 +627,30 @@ int bch2_fpunch(struct bch_fs *c, subvol_inum inum, u64 start, u64 end,
 	return ret;
 }
 
+/*
+ * A write that was split into several extents - across allocations, or at
+ * encoded_extent_max - may still have produced keys that are adjacent both
+ * logically and on disk: merge them here, so they're inserted in a single
+ * transaction as a single extent. Merging with the extents already in the
+ * btree happens in bch2_trans_update_extent().
+ */
+static void bch2_write_merge_keys(struct bch_fs *c, struct keylist *keys)
+{
+	struct bkey_i *k = bch2_keylist_front(keys), *n;
+
+	while ((n = bkey_next(k)) != keys->top) {
+		if (bch2_bkey_merge(c, bkey_i_to_s(k), bkey_i_to_s_c(n))) {
+			unsigned n_u64s = n->k.u64s;
+
+			memmove_u64s_down(n, bkey_next(n),
+					  (u64 *) keys->top - (u64 *) bkey_next(n));
+			keys->top_p -= n_u64s;
+		} else {
+			k = n;
+		}
+	}
+}
+
 int bch2_write_index_default(struct bch_write_op *op)
 {
 	struct bch_fs *c = op->c;
@@ -407,6 +667,8 @@ int bch2_write_index_default(struct bch_write_op *op)
 
 	BUG_ON(!inum.subvol);
 
+	bch2_write_merge_keys(c, keys);
+
 	bch2_bkey_buf_init(&sk);
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 1024);
 
@@ -430,7 +692,7 @@ int bch2_write_index_default(struct bch_write_op *op)
 		ret = bch2_extent_update(&trans, inum, &iter, sk.k,
 					 &op->res, op_journal_seq(op),
 					 op->new_i_size, &op->i_sectors_delta,
-					 op->flags & BCH_WRITE_CHECK_ENOSPC);
+					 op->flags);
 		bch2_trans_iter_exit(&trans, &iter);
 
 		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
@@ -496,6 +758,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 		if (likely(n->have_ioref)) {
 			this_cpu_add(ca->io_done->sectors[WRITE][type],
 				     bio_sectors(&n->bio));
+			atomic_inc(&ca->writes_in_flight);
 
 			bio_set_dev(&n->bio, ca->disk_sb.bdev);
 			submit_bio(&n->bio);
@@ -653,12 +916,15 @@ static void bch2_write_endio(struct bio *bio)
 	}
 
 	if (wbio->have_ioref) {
-		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		bch2_latency_acct(ca, wbio->submit_time, WRITE,
+				  op->flags & BCH_WRITE_CACHED
+				  ? BCH_DATA_cached : BCH_DATA_user);
+		atomic_dec(&ca->writes_in_flight);
 		percpu_ref_put(&ca->io_ref);
 	}
 
 	if (wbio->bounce)
-		bch2_bio_free_pages_pool(c, bio);
+		bch2_bio_free_pages_pool(c, bio, wbio->bounce_order);
 
 	if (wbio->put_bio)
 		bio_put(bio);
@@ -727,12 +993,13 @@ static struct bio *bch2_write_bio_alloc(struct bch_fs *c,
 	}
 
 	wbio->bounce		= true;
+	count_event(c, write_bounce_alloc);
 
 	/*
 	 * We can't use mempool for more than c->sb.encoded_extent_max
 	 * worth of pages, but we'd like to allocate more if we can:
 	 */
-	bch2_bio_alloc_pages_pool(c, bio,
+	wbio->bounce_order = bch2_bio_alloc_pages_pool(c, bio,
 				  min_t(unsigned, output_available,
 					c->opts.encoded_extent_max));
 
@@ -879,6 +1146,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 {
 	struct bch_fs *c = op->c;
 	struct bio *src = &op->wbio.bio, *dst = src;
+	unsigned compress_flags = 0;
 	struct bvec_iter saved_iter;
 	void *ec_buf;
 	unsigned total_output = 0, total_input = 0;
@@ -925,6 +1193,16 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 	saved_iter = dst->bi_iter;
 
+	if (op->compression_type) {
+		if (op->opts.zstd_dict)
+			compress_flags |= BCH_COMPRESS_ZSTD_DICT;
+		if (c->opts.compression_adaptive) {
+			compress_flags |= BCH_COMPRESS_ADAPTIVE;
+			if (__bch2_target_congested(c, op->target))
+				compress_flags |= BCH_COMPRESS_FAST;
+		}
+	}
+
 	do {
 		struct bch_extent_crc_unpacked crc =
 			(struct bch_extent_crc_unpacked) { 0 };
@@ -945,7 +1223,8 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			? BCH_COMPRESSION_TYPE_incompressible
 			: op->compression_type
 			? bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					    op->compression_type)
+					    op->compression_type,
+					    compress_flags)
 			: 0;
 		if (!crc_is_compressed(crc)) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
@@ -1060,7 +1339,7 @@ csum_err:
 	ret = -EIO;
 err:
 	if (to_wbio(dst)->bounce)
-		bch2_bio_free_pages_pool(c, dst);
+		bch2_bio_free_pages_pool(c, dst, to_wbio(dst)->bounce_order);
 	if (to_wbio(dst)->put_bio)
 		bio_put(dst);
 
@@ -1298,6 +1577,9 @@ void bch2_write(struct closure *cl)
 	this_cpu_add(c->counters[BCH_COUNTER_io_write], bio_sectors(bio));
 	bch2_increment_clock(c, bio_sectors(bio), WRITE);
 
+	if (!(op->flags & BCH_WRITE_FROM_INTERNAL))
+		bch2_io_sched_mark(c, BCH_IO_CLASS_fg_write);
+
 	data_len = min_t(u64, bio->bi_iter.bi_size,
 			 op->new_i_size - (op->pos.offset << 9));
 
@@ -1341,6 +1623,42 @@ static const struct rhashtable_params bch_promote_params = {
 	.key_len	= sizeof(struct bpos),
 };
 
+/*
+ * Records a read of @k, and returns an estimate of how many times it's been
+ * read within the current window: the estimate can only be too high, never
+ * too low. Increments are racy, which is fine for an estimate.
+ */
+static unsigned promote_filter_inc(struct bch_promote_filter *f,
+				   struct bkey_s_c k)
+{
+	u32 h1 = jhash(&k.k->p, sizeof(k.k->p), k.k->type);
+	u32 h2 = jhash(&k.k->p, sizeof(k.k->p), h1) | 1;
+	unsigned idx[BCH_PROMOTE_FILTER_HASHES];
+	unsigned i, j, nr = U8_MAX;
+
+	for (i = 0; i < BCH_PROMOTE_FILTER_HASHES; i++) {
+		idx[i] = (h1 + i * h2) & ((1U << BCH_PROMOTE_FILTER_BITS) - 1);
+		nr = min_t(unsigned, nr, READ_ONCE(f->counters[i][idx[i]]));
+	}
+
+	/* conservative update: only bump the counters at the minimum */
+	if (nr < U8_MAX)
+		for (i = 0; i < BCH_PROMOTE_FILTER_HASHES; i++)
+			if (READ_ONCE(f->counters[i][idx[i]]) == nr)
+				WRITE_ONCE(f->counters[i][idx[i]], nr + 1);
+
+	if (atomic_inc_return(&f->nr) >= BCH_PROMOTE_FILTER_WINDOW &&
+	    spin_trylock(&f->lock)) {
+		for (i = 0; i < BCH_PROMOTE_FILTER_HASHES; i++)
+			for (j = 0; j < ARRAY_SIZE(f->counters[i]); j++)
+				f->counters[i][j] >>= 1;
+		atomic_set(&f->nr, 0);
+		spin_unlock(&f->lock);
+	}
+
+	return min_t(unsigned, nr + 1, U8_MAX);
+}
+
 static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 				  struct bpos pos,
 				  struct bch_io_opts opts,
@@ -1355,6 +1673,12 @@ static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 	if (bch2_bkey_has_target(c, k, opts.promote_target))
 		return false;
 
+	if (opts.promote_min_reads > 1 &&
+	    promote_filter_inc(&c->promote_filter, k) < opts.promote_min_reads) {
+		this_cpu_inc(c->counters[BCH_COUNTER_promote_rejected]);
+		return false;
+	}
+
 	if (bch2_target_congested(c, opts.promote_target)) {
 		/* XXX trace this */
 		return false;
@@ -1364,6 +1688,7 @@ static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 				   bch_promote_params))
 		return false;
 
+	this_cpu_inc(c->counters[BCH_COUNTER_promote_accepted]);
 	return true;
 }
 
@@ -1563,7 +1888,7 @@ static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
 	rbio->promote = NULL;
 
 	if (rbio->bounce)
-		bch2_bio_free_pages_pool(rbio->c, &rbio->bio);
+		bch2_bio_free_pages_pool(rbio->c, &rbio->bio, rbio->bounce_order);
 
 	if (rbio->split) {
 		struct bch_read_bio *parent = rbio->parent;
@@ -1768,6 +2093,33 @@ static noinline void bch2_rbio_narrow_crcs(struct bch_read_bio *rbio)
 }
 
 /* Inner part that may run in process context */
+/*
+ * If we only wanted part of a compressed extent, keep the whole decompressed
+ * extent in the read cache for the next small read into it:
+ */
+static int rbio_uncompress(struct bch_fs *c, struct bch_read_bio *rbio,
+			   struct bio *src, struct bio *dst,
+			   struct bvec_iter dst_iter,
+			   struct bch_extent_crc_unpacked crc)
+{
+	size_t bytes = crc.uncompressed_size << 9;
+	void *buf;
+
+	if (!bch2_read_cache_wanted(c, &rbio->pick) ||
+	    crc.live_size >= crc.uncompressed_size ||
+	    !(buf = kvpmalloc(bytes, GFP_NOIO)))
+		return bch2_bio_uncompress(c, src, dst, dst_iter, crc);
+
+	if (bch2_bio_uncompress_buf(c, src, buf, crc)) {
+		kvpfree(buf, bytes);
+		return -EIO;
+	}
+
+	memcpy_to_bio(dst, dst_iter, buf + (crc.offset << 9));
+	bch2_read_cache_add(c, &rbio->pick, buf);
+	return 0;
+}
+
 static void __bch2_read_endio(struct work_struct *work)
 {
 	struct bch_read_bio *rbio =
@@ -1820,11 +2172,11 @@ static void __bch2_read_endio(struct work_struct *work)
 		if (ret)
 			goto decrypt_err;
 
-		if (bch2_bio_uncompress(c, src, dst, dst_iter, crc))
+		if (rbio_uncompress(c, rbio, src, dst, dst_iter, crc))
 			goto decompression_err;
 	} else {
 		/* don't need to decrypt the entire bio: */
-		nonce = nonce_add(nonce, crc.offset << 9);
+		nonce = nonce_add(crc.csum_type, nonce, crc.offset << 9);
 		bio_advance(src, crc.offset << 9);
 
 		BUG_ON(src->bi_iter.bi_size < dst_iter.bi_size);
@@ -1900,7 +2252,10 @@ static void bch2_read_endio(struct bio *bio)
 	enum rbio_context context = RBIO_CONTEXT_NULL;
 
 	if (rbio->have_ioref) {
-		bch2_latency_acct(ca, rbio->submit_time, READ);
+		bch2_latency_acct(ca, rbio->submit_time, READ,
+				  rbio->pick.ptr.cached
+				  ? BCH_DATA_cached : BCH_DATA_user);
+		atomic_dec(&ca->reads_in_flight);
 		percpu_ref_put(&ca->io_ref);
 	}
 
@@ -2107,6 +2462,12 @@ retry_pick:
 		bounce = true;
 	}
 
+	if (bvec_iter_sectors(iter) < pick.crc.uncompressed_size &&
+	    bch2_read_cache_wanted(c, &pick) &&
+	    bch2_read_cache_get(c, &pick, &orig->bio, iter,
+				pick.crc.offset + offset_into_extent))
+		goto out_read_done;
+
 	if (orig->opts.promote_target)
 		promote = promote_alloc(c, iter, k, &pick, orig->opts, flags,
 					&rbio, &bounce, &read_full);
@@ -2151,7 +2512,7 @@ get_bio:
 						  &c->bio_read_split),
 				 orig->opts);
 
-		bch2_bio_alloc_pages_pool(c, &rbio->bio, sectors << 9);
+		rbio->bounce_order = bch2_bio_alloc_pages_pool(c, &rbio->bio, sectors << 9);
 		rbio->bounce	= true;
 		rbio->split	= true;
 	} else if (flags & BCH_READ_MUST_CLONE) {
@@ -2186,6 +2547,8 @@ get_bio:
 	rbio->offset_into_extent= offset_into_extent;
 	rbio->flags		= flags;
 	rbio->have_ioref	= pick_ret > 0 && bch2_dev_get_ioref(ca, READ);
+	if (rbio->have_ioref)
+		atomic_inc(&ca->reads_in_flight);
 	rbio->narrow_crcs	= narrow_crcs;
 	rbio->hole		= 0;
 	rbio->retry		= 0;
@@ -2404,6 +2767,20 @@ err:
 
 void bch2_fs_io_exit(struct bch_fs *c)
 {
+	unsigned cpu;
+
+	if (c->bounce_page_cache) {
+		for_each_possible_cpu(cpu) {
+			struct bch_bounce_page_cache *pc =
+				per_cpu_ptr(c->bounce_page_cache, cpu);
+
+			while (pc->nr)
+				__free_page(pc->pages[--pc->nr]);
+		}
+		free_percpu(c->bounce_page_cache);
+	}
+
+	bch2_fs_read_cache_exit(c);
 	if (c->promote_table.tbl)
 		rhashtable_destroy(&c->promote_table);
 	mempool_exit(&c->bio_bounce_pages);
@@ -2414,6 +2791,12 @@ void bch2_fs_io_exit(struct bch_fs *c)
 
 int bch2_fs_io_init(struct bch_fs *c)
 {
+	unsigned cpu;
+
+	spin_lock_init(&c->io_sched.lock);
+	spin_lock_init(&c->promote_filter.lock);
+	bch2_fs_read_cache_init(c);
+
 	if (bioset_init(&c->bio_read, 1, offsetof(struct bch_read_bio, bio),
 			BIOSET_NEED_BVECS) ||
 	    bioset_init(&c->bio_read_split, 1, offsetof(struct bch_read_bio, bio),
@@ -2425,8 +2808,12 @@ int bch2_fs_io_init(struct bch_fs *c)
 					 c->opts.btree_node_size,
 					 c->opts.encoded_extent_max) /
 				   PAGE_SIZE, 0) ||
-	    rhashtable_init(&c->promote_table, &bch_promote_params))
+	    rhashtable_init(&c->promote_table, &bch_promote_params) ||
+	    !(c->bounce_page_cache = alloc_percpu(*c->bounce_page_cache)))
 		return -ENOMEM;
 
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(c->bounce_page_cache, cpu)->lock);
+
 	return 0;
 }
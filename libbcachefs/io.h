@@ -12,10 +12,28 @@
 #define to_rbio(_bio)			\
 	container_of((_bio), struct bch_read_bio, bio)
 
-void bch2_bio_free_pages_pool(struct bch_fs *, struct bio *);
-void bch2_bio_alloc_pages_pool(struct bch_fs *, struct bio *, size_t);
+void bch2_bio_free_pages_pool(struct bch_fs *, struct bio *, unsigned);
+unsigned bch2_bio_alloc_pages_pool(struct bch_fs *, struct bio *, size_t);
 
-void bch2_latency_acct(struct bch_dev *, u64, int);
+bool __bch2_target_congested(struct bch_fs *, u16);
+void bch2_latency_acct(struct bch_dev *, u64, int, enum bch_data_type);
+
+/* A class counts as busy if it submitted IO this recently: */
+#define BCH_IO_SCHED_BUSY_NS	(10 * NSEC_PER_MSEC)
+
+static inline void bch2_io_sched_mark(struct bch_fs *c, enum bch_io_class class)
+{
+	struct bch_io_class_state *s = &c->io_sched.classes[class];
+	u64 now = local_clock();
+
+	/* avoid dirtying the cacheline on every IO: */
+	if (now - READ_ONCE(s->last_active) > NSEC_PER_MSEC)
+		WRITE_ONCE(s->last_active, now);
+}
+
+void bch2_io_sched_charge(struct bch_fs *, enum bch_io_class, unsigned);
+bool bch2_io_sched_may_submit(struct bch_fs *, enum bch_io_class);
+void bch2_io_sched_wait(struct bch_fs *, enum bch_io_class);
 
 void bch2_submit_wbio_replicas(struct bch_write_bio *, struct bch_fs *,
 			       enum bch_data_type, const struct bkey_i *);
@@ -35,12 +53,13 @@ enum bch_write_flags {
 	BCH_WRITE_WROTE_DATA_INLINE	= (1 << 7),
 	BCH_WRITE_FROM_INTERNAL		= (1 << 8),
 	BCH_WRITE_CHECK_ENOSPC		= (1 << 9),
+	BCH_WRITE_UPDATE_TIMES		= (1 << 10),
 
 	/* Internal: */
-	BCH_WRITE_JOURNAL_SEQ_PTR	= (1 << 10),
-	BCH_WRITE_SKIP_CLOSURE_PUT	= (1 << 11),
-	BCH_WRITE_DONE			= (1 << 12),
-	BCH_WRITE_IO_ERROR		= (1 << 13),
+	BCH_WRITE_JOURNAL_SEQ_PTR	= (1 << 11),
+	BCH_WRITE_SKIP_CLOSURE_PUT	= (1 << 12),
+	BCH_WRITE_DONE			= (1 << 13),
+	BCH_WRITE_IO_ERROR		= (1 << 14),
 };
 
 static inline u64 *op_journal_seq(struct bch_write_op *op)
@@ -60,7 +79,8 @@ int bch2_sum_sector_overwrites(struct btree_trans *, struct btree_iter *,
 			       struct bkey_i *, bool *, s64 *, s64 *);
 int bch2_extent_update(struct btree_trans *, subvol_inum,
 		       struct btree_iter *, struct bkey_i *,
-		       struct disk_reservation *, u64 *, u64, s64 *, bool);
+		       struct disk_reservation *, u64 *, u64, s64 *,
+		       unsigned);
 
 int bch2_fpunch_at(struct btree_trans *, struct btree_iter *,
 		   subvol_inum, u64, s64 *);
@@ -167,6 +187,8 @@ static inline void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio,
 	rbio->start_time = local_clock();
 	rbio->subvol = inum.subvol;
 
+	bch2_io_sched_mark(c, BCH_IO_CLASS_fg_read);
+
 	__bch2_read(c, rbio, rbio->bio.bi_iter, inum, &failed,
 		    BCH_READ_RETRY_IF_STALE|
 		    BCH_READ_MAY_PROMOTE|
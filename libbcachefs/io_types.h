@@ -13,6 +13,47 @@
 #include <linux/llist.h>
 #include <linux/workqueue.h>
 
+/*
+ * Bounce buffers up to this order may be a single allocation, whose order is
+ * kept in the bio, see bch2_bio_alloc_pages_pool():
+ */
+#define BCH_BOUNCE_ORDER_BITS		4
+#define BCH_BOUNCE_ORDER_MAX		((1U << BCH_BOUNCE_ORDER_BITS) - 1)
+
+/*
+ * IO classes, highest priority first: name, rate in MB/sec a class is limited
+ * to while a higher priority class is busy (0 for never limited), and how
+ * long in milliseconds it may be held back for:
+ */
+#define BCH_IO_CLASSES()			\
+	x(fg_read,		0,	0)	\
+	x(fg_write,		0,	0)	\
+	x(btree,		0,	0)	\
+	x(journal_reclaim,	0,	0)	\
+	x(copygc,		64,	50)	\
+	x(rereplicate,		48,	100)	\
+	x(rebalance,		32,	200)	\
+	x(scrub,		16,	1000)
+
+enum bch_io_class {
+#define x(n, rate, deadline)	BCH_IO_CLASS_##n,
+	BCH_IO_CLASSES()
+#undef x
+	BCH_IO_CLASS_NR
+};
+
+struct bch_io_class_state {
+	u64			last_active;
+	/* token bucket, in sectors: */
+	s64			tokens;
+	u64			last_refill;
+};
+
+struct bch_io_sched {
+	spinlock_t		lock;
+	struct bch_io_class_state classes[BCH_IO_CLASS_NR];
+};
+
 struct bch_read_bio {
 	struct bch_fs		*c;
 	u64			start_time;
@@ -50,7 +91,8 @@ struct bch_read_bio {
 				narrow_crcs:1,
 				hole:1,
 				retry:2,
-				context:2;
+				context:2,
+				bounce_order:BCH_BOUNCE_ORDER_BITS;
 	};
 	u16			_state;
 	};
@@ -96,7 +138,8 @@ struct bch_write_bio {
 				put_bio:1,
 				have_ioref:1,
 				used_mempool:1,
-				first_btree_write:1;
+				first_btree_write:1,
+				bounce_order:BCH_BOUNCE_ORDER_BITS;
 
 	struct bio		bio;
 };
@@ -158,4 +201,29 @@ struct bch_write_op {
 	struct bch_write_bio	wbio;
 };
 
+/* Per cpu cache of bounce pages, see bch2_bio_alloc_pages_pool(): */
+#define BCH_BOUNCE_PAGE_CACHE_NR	32
+
+struct bch_bounce_page_cache {
+	spinlock_t		lock;
+	unsigned		nr;
+	struct page		*pages[BCH_BOUNCE_PAGE_CACHE_NR];
+};
+
+/*
+ * Count-min sketch of recent reads of extents that are candidates for
+ * promotion, for the promote_min_reads option: counters are halved every
+ * BCH_PROMOTE_FILTER_WINDOW reads, so that old reads age out.
+ */
+#define BCH_PROMOTE_FILTER_HASHES	4
+#define BCH_PROMOTE_FILTER_BITS		12
+#define BCH_PROMOTE_FILTER_WINDOW	(8U << BCH_PROMOTE_FILTER_BITS)
+
+struct bch_promote_filter {
+	atomic_t		nr;
+	spinlock_t		lock;
+	u8			counters[BCH_PROMOTE_FILTER_HASHES]
+					[1U << BCH_PROMOTE_FILTER_BITS];
+};
+
 #endif /* _BCACHEFS_IO_TYPES_H */
@@ -81,7 +81,138 @@ void __bch2_journal_buf_put(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 
-	closure_call(&j->io, bch2_journal_write, c->io_complete_wq, NULL);
+	queue_work(c->io_complete_wq, &j->write_start_work);
+}
+
+/* Per CPU reservations: */
+
+/*
+ * Fill the part of a chunk that wasn't handed out with an (empty) log entry, so
+ * that the journal entry still parses:
+ */
+static void journal_res_pad(struct journal *j, unsigned idx,
+			    unsigned offset, unsigned u64s)
+{
+	struct jset_entry *entry;
+
+	if (!u64s)
+		return;
+
+	entry = vstruct_idx(j->buf[idx].data, offset);
+	journal_entry_init(entry, BCH_JSET_ENTRY_log, 0, 0, u64s - 1);
+	memset(entry->_data, 0, (u64s - 1) * sizeof(u64));
+}
+
+static void journal_res_pcpu_release(struct journal *j, unsigned idx,
+				     union journal_res_pcpu_state s)
+{
+	journal_res_pad(j, idx, s.offset, s.end - s.offset);
+	bch2_journal_buf_put(j, idx);
+}
+
+static void journal_res_pcpu_invalidate(struct journal *j, unsigned idx,
+					union journal_res_pcpu_state *p)
+{
+	union journal_res_pcpu_state old, new;
+	u64 v = atomic64_read(&p->counter);
+
+	do {
+		old.v = new.v = v;
+
+		if (!old.valid)
+			return;
+
+		new.valid = 0;
+		if (!new.count)
+			new.v = 0;
+	} while ((v = atomic64_cmpxchg(&p->counter,
+				       old.v, new.v)) != old.v);
+
+	if (!old.count)
+		journal_res_pcpu_release(j, idx, old);
+}
+
+void bch2_journal_res_pcpu_put(struct journal *j, struct journal_res *res)
+{
+	union journal_res_pcpu_state old, new, *p =
+		&per_cpu_ptr(j->res_pcpu, res->pcpu - 1)->s[res->idx];
+	u64 v = atomic64_read(&p->counter);
+
+	do {
+		old.v = new.v = v;
+
+		EBUG_ON(!old.count);
+		new.count--;
+		if (!new.count && !new.valid)
+			new.v = 0;
+	} while ((v = atomic64_cmpxchg(&p->counter,
+				       old.v, new.v)) != old.v);
+
+	if (old.count == 1 && !old.valid)
+		journal_res_pcpu_release(j, res->idx, old);
+}
+
+/*
+ * This CPU's chunk is missing or used up: take a new one from the current
+ * journal entry, and the reservation from that:
+ */
+bool bch2_journal_res_get_pcpu_refill(struct journal *j,
+				      struct journal_res *res,
+				      unsigned flags)
+{
+	struct journal_res chunk = { .u64s = JOURNAL_RES_PCPU_CHUNK };
+	union journal_res_pcpu_state new, *p;
+	union journal_res_state s;
+	unsigned cpu = raw_smp_processor_id();
+
+	s.v	= atomic64_read(&j->reservations.counter);
+	p	= &per_cpu_ptr(j->res_pcpu, cpu)->s[s.idx];
+
+	if (atomic64_read(&p->counter)) {
+		journal_res_pcpu_invalidate(j, s.idx, p);
+
+		/* still has outstanding reservations: */
+		if (atomic64_read(&p->counter))
+			return false;
+	}
+
+	if (!journal_res_get_fast(j, &chunk, flags))
+		return false;
+
+	new.v		= 0;
+	new.offset	= chunk.offset + res->u64s;
+	new.end		= chunk.offset + chunk.u64s;
+	new.count	= 1;
+	new.valid	= 1;
+
+	p = &per_cpu_ptr(j->res_pcpu, cpu)->s[chunk.idx];
+
+	if (atomic64_cmpxchg(&p->counter, 0, new.v)) {
+		/*
+		 * Raced with another thread on this CPU: use the chunk as a
+		 * normal reservation, and pad out the rest now:
+		 */
+		journal_res_pad(j, chunk.idx, new.offset, new.end - new.offset);
+		*res = chunk;
+		res->u64s = new.offset - chunk.offset;
+		return true;
+	}
+
+	res->ref	= true;
+	res->idx	= chunk.idx;
+	res->offset	= chunk.offset;
+	res->seq	= chunk.seq;
+	res->pcpu	= cpu + 1;
+
+	/*
+	 * If the entry was closed after we took the chunk and before we
+	 * installed it, __journal_entry_close() may have missed it:
+	 */
+	s.v = atomic64_read(&j->reservations.counter);
+	if (!__journal_entry_is_open(s) || s.idx != chunk.idx)
+		journal_res_pcpu_invalidate(j, chunk.idx, p);
+
+	return true;
 }
 
 /*
@@ -97,6 +228,7 @@ static void __journal_entry_close(struct journal *j, unsigned closed_val)
 	union journal_res_state old, new;
 	u64 v = atomic64_read(&j->reservations.counter);
 	unsigned sectors;
+	int cpu;
 
 	BUG_ON(closed_val != JOURNAL_ENTRY_CLOSED_VAL &&
 	       closed_val != JOURNAL_ENTRY_ERROR_VAL);
@@ -116,6 +248,16 @@ static void __journal_entry_close(struct journal *j, unsigned closed_val)
 	if (!__journal_entry_is_open(old))
 		return;
 
+	/*
+	 * Per CPU chunks of this entry: nothing new can be handed out from
+	 * them now, and whatever wasn't used is padded out and the ref on this
+	 * buf released once their outstanding reservations are done:
+	 */
+	if (j->res_pcpu)
+		for_each_possible_cpu(cpu)
+			journal_res_pcpu_invalidate(j, old.idx,
+				&per_cpu_ptr(j->res_pcpu, cpu)->s[old.idx]);
+
 	/* Close out old buffer: */
 	buf->data->u64s		= cpu_to_le32(old.cur_entry_offset);
 
@@ -168,9 +310,13 @@ void bch2_journal_halt(struct journal *j)
 static bool journal_entry_want_write(struct journal *j)
 {
 	bool ret = !journal_entry_is_open(j) ||
-		journal_cur_seq(j) == journal_last_unwritten_seq(j);
+		journal_cur_seq(j) - journal_last_unwritten_seq(j) <
+		JOURNAL_BUF_NR - 2;
 
-	/* Don't close it yet if we already have a write in flight: */
+	/*
+	 * Don't close it yet if we already have as many writes in flight as
+	 * will still let us open a new entry:
+	 */
 	if (ret)
 		__journal_entry_close(j, JOURNAL_ENTRY_CLOSED_VAL);
 	else if (nr_unwritten_journal_entries(j)) {
@@ -1041,6 +1187,7 @@ void bch2_fs_journal_stop(struct journal *j)
 	       j->last_empty_seq != journal_cur_seq(j));
 
 	cancel_delayed_work_sync(&j->write_work);
+	cancel_work_sync(&j->write_start_work);
 }
 
 int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
@@ -1079,6 +1226,7 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
 	j->last_seq_ondisk	= last_seq;
 	j->flushed_seq_ondisk	= cur_seq - 1;
 	j->seq_ondisk		= cur_seq - 1;
+	j->seq_write_started	= cur_seq - 1;
 	j->pin.front		= last_seq;
 	j->pin.back		= cur_seq;
 	atomic64_set(&j->seq, cur_seq - 1);
@@ -1133,11 +1281,16 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
 
 void bch2_dev_journal_exit(struct bch_dev *ca)
 {
-	kfree(ca->journal.bio);
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(ca->journal.bio); i++) {
+		kfree(ca->journal.bio[i]);
+		ca->journal.bio[i] = NULL;
+	}
+
 	kfree(ca->journal.buckets);
 	kfree(ca->journal.bucket_seq);
 
-	ca->journal.bio		= NULL;
 	ca->journal.buckets	= NULL;
 	ca->journal.bucket_seq	= NULL;
 }
@@ -1168,11 +1321,14 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 
 	nr_bvecs = DIV_ROUND_UP(JOURNAL_ENTRY_SIZE_MAX, PAGE_SIZE);
 
-	ca->journal.bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
-	if (!ca->journal.bio)
-		return -ENOMEM;
+	for (i = 0; i < ARRAY_SIZE(ja->bio); i++) {
+		ja->bio[i] = kzalloc(sizeof(*ja->bio[i]) +
+				     sizeof(struct bio_vec) * nr_bvecs, GFP_KERNEL);
+		if (!ja->bio[i])
+			return -ENOMEM;
 
-	bio_init(ca->journal.bio, NULL, ca->journal.bio->bi_inline_vecs, nr_bvecs, 0);
+		bio_init(&ja->bio[i]->bio, NULL, ja->bio[i]->bio.bi_inline_vecs, nr_bvecs, 0);
+	}
 
 	ja->buckets = kcalloc(ja->nr, sizeof(u64), GFP_KERNEL);
 	if (!ja->buckets)
@@ -1200,7 +1356,11 @@ void bch2_fs_journal_exit(struct journal *j)
 
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
 		kvpfree(j->buf[i].data, j->buf[i].buf_size);
+	kvpfree(j->compress_buf, j->compress_buf_size);
 	free_fifo(&j->pin);
+	free_percpu(j->res_pcpu);
+	if (j->pin_flush_wq)
+		destroy_workqueue(j->pin_flush_wq);
 }
 
 int bch2_fs_journal_init(struct journal *j)
@@ -1215,12 +1375,19 @@ int bch2_fs_journal_init(struct journal *j)
 	spin_lock_init(&j->lock);
 	spin_lock_init(&j->err_lock);
 	init_waitqueue_head(&j->wait);
+	INIT_WORK(&j->write_start_work, bch2_journal_write_work);
 	INIT_DELAYED_WORK(&j->write_work, journal_write_work);
 	init_waitqueue_head(&j->reclaim_wait);
 	init_waitqueue_head(&j->pin_flush_wait);
 	mutex_init(&j->reclaim_lock);
 	mutex_init(&j->discard_lock);
 
+	for (i = 0; i < ARRAY_SIZE(j->flush_in_progress); i++) {
+		j->flush_in_progress[i].j = j;
+		INIT_WORK(&j->flush_in_progress[i].work,
+			  bch2_journal_pin_flush_work);
+	}
+
 	lockdep_init_map(&j->res_map, "journal res", &res_key, 0);
 
 	atomic64_set(&j->reservations.counter,
@@ -1233,6 +1400,7 @@ int bch2_fs_journal_init(struct journal *j)
 	}
 
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++) {
+		j->buf[i].idx = i;
 		j->buf[i].buf_size = JOURNAL_ENTRY_SIZE_MIN;
 		j->buf[i].data = kvpmalloc(j->buf[i].buf_size, GFP_KERNEL);
 		if (!j->buf[i].data) {
@@ -1241,6 +1409,20 @@ int bch2_fs_journal_init(struct journal *j)
 		}
 	}
 
+	j->res_pcpu = alloc_percpu(struct journal_res_pcpu);
+	if (!j->res_pcpu) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Journal reclaim is what memory reclaim waits on, hence WQ_MEM_RECLAIM: */
+	j->pin_flush_wq = alloc_workqueue("bcachefs_journal_flush",
+				WQ_UNBOUND|WQ_MEM_RECLAIM, JOURNAL_PIN_FLUSH_MAX);
+	if (!j->pin_flush_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	j->pin.front = j->pin.back = 1;
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
@@ -265,7 +265,7 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
 				    .buf3_count = idx == 3,
 				    }).v, &j->reservations.counter);
 
-	if (!journal_state_count(s, idx) && idx == s.unwritten_idx)
+	if (!journal_state_count(s, idx))
 		__bch2_journal_buf_put(j);
 }
 
@@ -273,6 +273,8 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
  * This function releases the journal write structure so other threads can
  * then proceed to add their keys as well.
  */
+void bch2_journal_res_pcpu_put(struct journal *, struct journal_res *);
+
 static inline void bch2_journal_res_put(struct journal *j,
 				       struct journal_res *res)
 {
@@ -286,7 +288,10 @@ static inline void bch2_journal_res_put(struct journal *j,
 				       BCH_JSET_ENTRY_btree_keys,
 				       0, 0, 0);
 
-	bch2_journal_buf_put(j, res->idx);
+	if (res->pcpu)
+		bch2_journal_res_pcpu_put(j, res);
+	else
+		bch2_journal_buf_put(j, res->idx);
 
 	res->ref = 0;
 }
@@ -339,6 +344,54 @@ static inline int journal_res_get_fast(struct journal *j,
 	res->idx	= old.idx;
 	res->offset	= old.cur_entry_offset;
 	res->seq	= le64_to_cpu(j->buf[old.idx].data->seq);
+	res->pcpu	= 0;
+	return 1;
+}
+
+/* Size of the chunks CPUs take from the current journal entry: */
+#define JOURNAL_RES_PCPU_CHUNK		128U
+
+bool bch2_journal_res_get_pcpu_refill(struct journal *, struct journal_res *,
+				      unsigned);
+
+static inline int journal_res_get_pcpu(struct journal *j,
+				       struct journal_res *res,
+				       unsigned flags)
+{
+	union journal_res_state s;
+	union journal_res_pcpu_state old, new, *p;
+	unsigned cpu;
+	u64 v;
+
+	if (!j->res_pcpu ||
+	    (flags & JOURNAL_RES_GET_CHECK) ||
+	    (flags & JOURNAL_WATERMARK_MASK) < j->watermark ||
+	    res->u64s > JOURNAL_RES_PCPU_CHUNK / 4)
+		return 0;
+
+	s.v	= atomic64_read(&j->reservations.counter);
+	cpu	= raw_smp_processor_id();
+	p	= &per_cpu_ptr(j->res_pcpu, cpu)->s[s.idx];
+	v	= atomic64_read(&p->counter);
+
+	do {
+		old.v = new.v = v;
+
+		if (!old.valid ||
+		    old.offset + res->u64s > old.end)
+			return bch2_journal_res_get_pcpu_refill(j, res, flags);
+
+		new.offset += res->u64s;
+		new.count++;
+	} while ((v = atomic64_cmpxchg(&p->counter,
+				       old.v, new.v)) != old.v);
+
+	/* The chunk holds a ref on the journal buf, so it can't be reused: */
+	res->ref	= true;
+	res->idx	= s.idx;
+	res->offset	= old.offset;
+	res->seq	= le64_to_cpu(j->buf[s.idx].data->seq);
+	res->pcpu	= cpu + 1;
 	return 1;
 }
 
@@ -352,7 +405,8 @@ static inline int bch2_journal_res_get(struct journal *j, struct journal_res *re
 
 	res->u64s = u64s;
 
-	if (journal_res_get_fast(j, res, flags))
+	if (journal_res_get_pcpu(j, res, flags) ||
+	    journal_res_get_fast(j, res, flags))
 		goto out;
 
 	ret = bch2_journal_res_get_slowpath(j, res, flags);
@@ -6,6 +6,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "error.h"
 #include "io.h"
@@ -803,6 +804,50 @@ static int jset_validate_for_write(struct bch_fs *c, struct jset *jset)
 		jset_validate_entries(c, jset, WRITE);
 }
 
+/*
+ * Returns a new, uncompressed copy of a jset with JSET_COMPRESSION_TYPE set;
+ * @jset must already have been checksummed and decrypted:
+ */
+static struct jset *jset_decompress(struct bch_fs *c, struct bch_dev *ca,
+				    struct jset *jset, u64 sector)
+{
+	struct jset_compressed *h = (void *) jset->_data;
+	size_t src_bytes = vstruct_bytes(jset) - sizeof(*jset);
+	size_t u64s, bytes;
+	struct jset *n;
+
+	if (src_bytes < sizeof(*h))
+		goto err;
+
+	u64s	= le32_to_cpu(h->u64s);
+	bytes	= le32_to_cpu(h->bytes);
+
+	if (bytes > src_bytes - sizeof(*h) ||
+	    sizeof(*jset) + u64s * sizeof(u64) > JOURNAL_ENTRY_SIZE_MAX)
+		goto err;
+
+	n = kvpmalloc(sizeof(*jset) + u64s * sizeof(u64), GFP_KERNEL);
+	if (!n)
+		return ERR_PTR(-ENOMEM);
+
+	memcpy(n, jset, sizeof(*jset));
+	n->u64s = h->u64s;
+	SET_JSET_COMPRESSION_TYPE(n, 0);
+
+	if (bch2_uncompress_buf(c, JSET_COMPRESSION_TYPE(jset),
+				n->_data, u64s * sizeof(u64),
+				h->data, bytes)) {
+		kvpfree(n, vstruct_bytes(n));
+		goto err;
+	}
+
+	return n;
+err:
+	bch_err(c, "%s sector %llu seq %llu: error decompressing journal entry",
+		ca->name, sector, le64_to_cpu(jset->seq));
+	return ERR_PTR(-EIO);
+}
+
 struct journal_read_buf {
 	void		*data;
 	size_t		size;
@@ -835,7 +880,7 @@ static int journal_read_bucket(struct bch_dev *ca,
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct jset *j = NULL;
+	struct jset *j = NULL, *uncompressed;
 	unsigned sectors, sectors_read = 0;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
@@ -922,6 +967,17 @@ reread:
 
 		ja->bucket_seq[bucket] = le64_to_cpu(j->seq);
 
+		uncompressed = NULL;
+		if (JSET_COMPRESSION_TYPE(j)) {
+			uncompressed = jset_decompress(c, ca, j, offset);
+			if (PTR_ERR_OR_ZERO(uncompressed) == -ENOMEM)
+				return -ENOMEM;
+			if (IS_ERR(uncompressed)) {
+				saw_bad = true;
+				goto next_block;
+			}
+		}
+
 		mutex_lock(&jlist->lock);
 		ret = journal_entry_add(c, ca, (struct journal_ptr) {
 					.dev		= ca->dev_idx,
@@ -929,9 +985,12 @@ reread:
 					.bucket_offset	= offset -
 						bucket_to_sector(ca, ja->buckets[bucket]),
 					.sector		= offset,
-					}, jlist, j, ret != 0);
+					}, jlist, uncompressed ?: j, ret != 0);
 		mutex_unlock(&jlist->lock);
 
+		if (uncompressed)
+			kvpfree(uncompressed, vstruct_bytes(uncompressed));
+
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
 			break;
@@ -950,6 +1009,74 @@ next_block:
 	return 0;
 }
 
+/*
+ * Each device's journal buckets are read by several workers at once, so that
+ * we keep multiple reads in flight and checksum/validate entries while other
+ * buckets are being read:
+ */
+#define JOURNAL_READ_WORKERS		4
+
+struct journal_read_worker;
+
+struct journal_read_dev {
+	struct bch_dev		*ca;
+	struct journal_list	*jlist;
+	atomic_t		next_bucket;
+	int			ret;
+
+	struct journal_read_worker {
+		struct closure		cl;
+		struct journal_read_dev	*d;
+	}			w[JOURNAL_READ_WORKERS];
+};
+
+static void journal_read_buckets(struct closure *cl)
+{
+	struct journal_read_worker *w =
+		container_of(cl, struct journal_read_worker, cl);
+	struct journal_read_dev *d = w->d;
+	struct journal_device *ja = &d->ca->journal;
+	struct journal_read_buf buf = { NULL, 0 };
+	unsigned i;
+	int ret;
+
+	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
+
+	while (!ret &&
+	       !READ_ONCE(d->ret) &&
+	       (i = atomic_inc_return(&d->next_bucket) - 1) < ja->nr)
+		ret = journal_read_bucket(d->ca, &buf, d->jlist, i);
+
+	if (ret)
+		cmpxchg(&d->ret, 0, ret);
+
+	kvpfree(buf.data, buf.size);
+	closure_return(cl);
+}
+
+static int journal_read_device_buckets(struct bch_dev *ca,
+				       struct journal_list *jlist)
+{
+	struct journal_read_dev d = {
+		.ca	= ca,
+		.jlist	= jlist,
+	};
+	struct closure cl;
+	unsigned i, nr = min_t(unsigned, ca->journal.nr, JOURNAL_READ_WORKERS);
+
+	closure_init_stack(&cl);
+	atomic_set(&d.next_bucket, 0);
+
+	for (i = 0; i < nr; i++) {
+		d.w[i].d = &d;
+		closure_call(&d.w[i].cl, journal_read_buckets,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+	return d.ret;
+}
+
 static void bch2_journal_read_device(struct closure *cl)
 {
 	struct journal_device *ja =
@@ -960,7 +1087,6 @@ static void bch2_journal_read_device(struct closure *cl)
 		container_of(cl->parent, struct journal_list, cl);
 	struct journal_replay *r, **_r;
 	struct genradix_iter iter;
-	struct journal_read_buf buf = { NULL, 0 };
 	u64 min_seq = U64_MAX;
 	unsigned i;
 	int ret = 0;
@@ -968,17 +1094,11 @@ static void bch2_journal_read_device(struct closure *cl)
 	if (!ja->nr)
 		goto out;
 
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
-	if (ret)
-		goto err;
-
 	pr_debug("%u journal buckets", ja->nr);
 
-	for (i = 0; i < ja->nr; i++) {
-		ret = journal_read_bucket(ca, &buf, jlist, i);
-		if (ret)
-			goto err;
-	}
+	ret = journal_read_device_buckets(ca, jlist);
+	if (ret)
+		goto err;
 
 	/* Find the journal bucket with the highest sequence number: */
 	for (i = 0; i < ja->nr; i++) {
@@ -1041,7 +1161,6 @@ static void bch2_journal_read_device(struct closure *cl)
 		ja->dirty_idx = (ja->cur_idx + 1) % ja->nr;
 out:
 	bch_verbose(c, "journal read done on device %s, ret %i", ca->name, ret);
-	kvpfree(buf.data, buf.size);
 	percpu_ref_put(&ca->io_ref);
 	closure_return(cl);
 	return;
@@ -1425,104 +1544,127 @@ static inline struct journal_buf *journal_last_unwritten_buf(struct journal *j)
 	return j->buf + (journal_last_unwritten_seq(j) & JOURNAL_BUF_MASK);
 }
 
-static void journal_write_done(struct closure *cl)
+static inline struct journal *journal_buf_to_journal(struct journal_buf *w)
+{
+	return container_of(w - w->idx, struct journal, buf[0]);
+}
+
+/*
+ * Writes can complete out of order, but they're completed in order here: the
+ * oldest unwritten entry isn't done until everything before it is:
+ */
+static void journal_writes_complete(struct journal *j)
 {
-	struct journal *j = container_of(cl, struct journal, io);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
-	struct journal_buf *w = journal_last_unwritten_buf(j);
-	struct bch_replicas_padded replicas;
+	struct journal_buf *w;
 	union journal_res_state old, new;
 	u64 v, seq;
-	int err = 0;
 
-	bch2_time_stats_update(!JSET_NO_FLUSH(w->data)
-			       ? j->flush_write_time
-			       : j->noflush_write_time, j->write_start_time);
+	lockdep_assert_held(&j->lock);
 
-	if (!w->devs_written.nr) {
-		bch_err(c, "unable to write journal to sufficient devices");
-		err = -EIO;
-	} else {
-		bch2_devlist_to_replicas(&replicas.e, BCH_DATA_journal,
-					 w->devs_written);
-		if (bch2_mark_replicas(c, &replicas.e))
-			err = -EIO;
-	}
+	while (j->seq_ondisk < j->seq_write_started &&
+	       (w = journal_last_unwritten_buf(j))->write_done) {
+		seq = le64_to_cpu(w->data->seq);
 
-	if (err)
-		bch2_fatal_error(c);
-
-	spin_lock(&j->lock);
-	seq = le64_to_cpu(w->data->seq);
+		if (seq >= j->pin.front)
+			journal_seq_pin(j, seq)->devs = w->devs_written;
 
-	if (seq >= j->pin.front)
-		journal_seq_pin(j, seq)->devs = w->devs_written;
+		if (!w->write_err) {
+			if (!JSET_NO_FLUSH(w->data)) {
+				j->flushed_seq_ondisk = seq;
+				j->last_seq_ondisk = w->last_seq;
 
-	if (!err) {
-		if (!JSET_NO_FLUSH(w->data)) {
-			j->flushed_seq_ondisk = seq;
-			j->last_seq_ondisk = w->last_seq;
-
-			bch2_do_discards(c);
-			closure_wake_up(&c->freelist_wait);
-		}
-	} else if (!j->err_seq || seq < j->err_seq)
-		j->err_seq	= seq;
+				bch2_do_discards(c);
+				closure_wake_up(&c->freelist_wait);
+			}
+		} else if (!j->err_seq || seq < j->err_seq)
+			j->err_seq	= seq;
 
-	j->seq_ondisk		= seq;
+		j->seq_ondisk		= seq;
+		w->write_done		= false;
 
-	/*
-	 * Updating last_seq_ondisk may let bch2_journal_reclaim_work() discard
-	 * more buckets:
-	 *
-	 * Must come before signaling write completion, for
-	 * bch2_fs_journal_stop():
-	 */
-	if (j->watermark)
-		journal_reclaim_kick(&c->journal);
+		/*
+		 * Updating last_seq_ondisk may let bch2_journal_reclaim_work() discard
+		 * more buckets:
+		 *
+		 * Must come before signaling write completion, for
+		 * bch2_fs_journal_stop():
+		 */
+		if (j->watermark)
+			journal_reclaim_kick(&c->journal);
 
-	/* also must come before signalling write completion: */
-	closure_debug_destroy(cl);
+		v = atomic64_read(&j->reservations.counter);
+		do {
+			old.v = new.v = v;
+			BUG_ON(journal_state_count(new, new.unwritten_idx));
 
-	v = atomic64_read(&j->reservations.counter);
-	do {
-		old.v = new.v = v;
-		BUG_ON(journal_state_count(new, new.unwritten_idx));
+			new.unwritten_idx++;
+		} while ((v = atomic64_cmpxchg(&j->reservations.counter,
+					       old.v, new.v)) != old.v);
 
-		new.unwritten_idx++;
-	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
-				       old.v, new.v)) != old.v);
+		bch2_journal_space_available(j);
 
-	bch2_journal_space_available(j);
+		closure_wake_up(&w->wait);
+	}
 
-	closure_wake_up(&w->wait);
 	journal_wake(j);
 
-	if (!journal_state_count(new, new.unwritten_idx) &&
-	    journal_last_unwritten_seq(j) <= journal_cur_seq(j)) {
-		closure_call(&j->io, bch2_journal_write, c->io_complete_wq, NULL);
-	} else if (journal_last_unwritten_seq(j) == journal_cur_seq(j) &&
-		   new.cur_entry_offset < JOURNAL_ENTRY_CLOSED_VAL) {
+	if (journal_cur_seq(j) - journal_last_unwritten_seq(j) < JOURNAL_BUF_NR - 2 &&
+	    j->reservations.cur_entry_offset < JOURNAL_ENTRY_CLOSED_VAL) {
 		struct journal_buf *buf = journal_cur_buf(j);
 		long delta = buf->expires - jiffies;
 
 		/*
-		 * We don't close a journal entry to write it while there's
-		 * previous entries still in flight - the current journal entry
-		 * might want to be written now:
+		 * We don't close a journal entry to write it while too many
+		 * previous entries are still in flight - the current journal
+		 * entry might want to be written now:
 		 */
 
 		mod_delayed_work(c->io_complete_wq, &j->write_work, max(0L, delta));
 	}
+}
+
+static void journal_write_done(struct closure *cl)
+{
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = journal_buf_to_journal(w);
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct bch_replicas_padded replicas;
+	int err = 0;
+
+	bch2_time_stats_update(!JSET_NO_FLUSH(w->data)
+			       ? j->flush_write_time
+			       : j->noflush_write_time, w->write_start_time);
+
+	if (!w->devs_written.nr) {
+		bch_err(c, "unable to write journal to sufficient devices");
+		err = -EIO;
+	} else {
+		bch2_devlist_to_replicas(&replicas.e, BCH_DATA_journal,
+					 w->devs_written);
+		if (bch2_mark_replicas(c, &replicas.e))
+			err = -EIO;
+	}
+
+	if (err)
+		bch2_fatal_error(c);
+
+	/* must come before signalling write completion: */
+	closure_debug_destroy(cl);
 
+	spin_lock(&j->lock);
+	w->write_err	= err;
+	w->write_done	= true;
+	journal_writes_complete(j);
 	spin_unlock(&j->lock);
 }
 
 static void journal_write_endio(struct bio *bio)
 {
-	struct bch_dev *ca = bio->bi_private;
+	struct journal_bio *jbio = container_of(bio, struct journal_bio, bio);
+	struct bch_dev *ca = jbio->ca;
+	struct journal_buf *w = jbio->buf;
 	struct journal *j = &ca->fs->journal;
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	unsigned long flags;
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "error writing journal entry %llu: %s",
@@ -1534,16 +1676,27 @@ static void journal_write_endio(struct bio *bio)
 		spin_unlock_irqrestore(&j->err_lock, flags);
 	}
 
-	closure_put(&j->io);
+	bch2_latency_acct(ca, jbio->submit_time, WRITE, BCH_DATA_journal);
+	closure_put(&w->io);
 	percpu_ref_put(&ca->io_ref);
 }
 
+static struct bio *journal_write_bio(struct bch_dev *ca, struct journal_buf *w)
+{
+	struct journal_bio *jbio = ca->journal.bio[w->idx];
+
+	jbio->ca		= ca;
+	jbio->buf		= w;
+	jbio->submit_time	= local_clock();
+	return &jbio->bio;
+}
+
 static void do_journal_write(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = journal_buf_to_journal(w);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct bch_extent_ptr *ptr;
 	struct bio *bio;
 	unsigned sectors = vstruct_sectors(w->data, c->block_bits);
@@ -1559,15 +1712,12 @@ static void do_journal_write(struct closure *cl)
 		this_cpu_add(ca->io_done->sectors[WRITE][BCH_DATA_journal],
 			     sectors);
 
-		bio = ca->journal.bio;
+		bio = journal_write_bio(ca, w);
 		bio_reset(bio, ca->disk_sb.bdev, REQ_OP_WRITE|REQ_SYNC|REQ_META);
 		bio->bi_iter.bi_sector	= ptr->offset;
 		bio->bi_end_io		= journal_write_endio;
 		bio->bi_private		= ca;
 
-		BUG_ON(bio->bi_iter.bi_sector == ca->prev_journal_sector);
-		ca->prev_journal_sector = bio->bi_iter.bi_sector;
-
 		if (!JSET_NO_FLUSH(w->data))
 			bio->bi_opf    |= REQ_FUA;
 		if (!JSET_NO_FLUSH(w->data) && !w->separate_flush)
@@ -1577,35 +1727,133 @@ static void do_journal_write(struct closure *cl)
 
 		trace_and_count(c, journal_write, bio);
 		closure_bio_submit(bio, cl);
-
-		ca->journal.bucket_seq[ca->journal.cur_idx] =
-			le64_to_cpu(w->data->seq);
 	}
 
 	continue_at(cl, journal_write_done, c->io_complete_wq);
 	return;
 }
 
-void bch2_journal_write(struct closure *cl)
+/*
+ * Noflush writes may be in flight together, and complete in any order; but a
+ * flush write only makes the journal durable up to its seq if every write
+ * before it has completed - so it waits for them before it's submitted:
+ */
+static void journal_write_submit(struct closure *cl)
+{
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = journal_buf_to_journal(w);
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	u64 seq = le64_to_cpu(w->data->seq);
+	struct bch_dev *ca;
+	struct bio *bio;
+	unsigned i;
+
+	if (!JSET_NO_FLUSH(w->data)) {
+		spin_lock(&j->lock);
+		if (j->seq_ondisk < seq - 1) {
+			closure_wait(&j->buf[(seq - 1) & JOURNAL_BUF_MASK].wait, cl);
+			spin_unlock(&j->lock);
+			continue_at(cl, journal_write_submit, c->io_complete_wq);
+			return;
+		}
+		spin_unlock(&j->lock);
+	}
+
+	if (c->opts.nochanges)
+		goto no_io;
+
+	if (!JSET_NO_FLUSH(w->data) && w->separate_flush) {
+		for_each_rw_member(ca, c, i) {
+			percpu_ref_get(&ca->io_ref);
+
+			bio = journal_write_bio(ca, w);
+			bio_reset(bio, ca->disk_sb.bdev, REQ_OP_FLUSH);
+			bio->bi_end_io		= journal_write_endio;
+			bio->bi_private		= ca;
+			closure_bio_submit(bio, cl);
+		}
+	}
+
+	continue_at(cl, do_journal_write, c->io_complete_wq);
+	return;
+no_io:
+	continue_at(cl, journal_write_done, c->io_complete_wq);
+}
+
+/*
+ * Compress the entries in @jset, if it saves at least a block; the caller must
+ * already have validated it:
+ */
+static void jset_compress(struct bch_fs *c, struct journal *j, struct jset *jset,
+			  unsigned compression_opt)
+{
+	unsigned type = bch2_compression_opt_to_type[compression_opt];
+	size_t src_bytes = le32_to_cpu(jset->u64s) * sizeof(u64), dst_bytes;
+	struct jset_compressed *h = (void *) jset->_data;
+	unsigned u64s;
+
+	if (!type ||
+	    !(c->sb.features & (1ULL << BCH_FEATURE_journal_compression)) ||
+	    src_bytes <= block_bytes(c))
+		return;
+
+	if (j->compress_buf_size < src_bytes) {
+		size_t new_size = roundup_pow_of_two(src_bytes);
+		void *n = kvpmalloc(new_size, GFP_NOIO|__GFP_NOWARN);
+
+		if (!n)
+			return;
+
+		kvpfree(j->compress_buf, j->compress_buf_size);
+		j->compress_buf		= n;
+		j->compress_buf_size	= new_size;
+	}
+
+	dst_bytes = bch2_compress_buf(c, type, j->compress_buf,
+				      src_bytes - sizeof(*h),
+				      jset->_data, src_bytes, 0);
+	if (!dst_bytes)
+		return;
+
+	u64s = DIV_ROUND_UP(sizeof(*h) + dst_bytes, sizeof(u64));
+	if (round_up(sizeof(*jset) + u64s * sizeof(u64), block_bytes(c)) >=
+	    round_up(vstruct_bytes(jset), block_bytes(c)))
+		return;
+
+	h->u64s		= jset->u64s;
+	h->bytes	= cpu_to_le32(dst_bytes);
+	memcpy(h->data, j->compress_buf, dst_bytes);
+	memset(h->data + dst_bytes, 0,
+	       u64s * sizeof(u64) - sizeof(*h) - dst_bytes);
+
+	jset->u64s = cpu_to_le32(u64s);
+	SET_JSET_COMPRESSION_TYPE(jset, type);
+}
+
+/*
+ * Prepare the write for a journal entry, and allocate space for it; then it's
+ * submitted and completes asynchronously, on @w->io:
+ */
+static void journal_write_prep(struct journal *j, struct journal_buf *w)
 {
-	struct journal *j = container_of(cl, struct journal, io);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct jset_entry *start, *end;
 	struct jset *jset;
-	struct bio *bio;
 	struct printbuf journal_debug_buf = PRINTBUF;
 	bool validate_before_checksum = false;
 	unsigned i, sectors, bytes, u64s, nr_rw_members = 0;
+	unsigned compression = READ_ONCE(c->opts.journal_compression);
 	int ret;
 
 	BUG_ON(BCH_SB_CLEAN(c->disk_sb.sb));
 
+	closure_init(&w->io, NULL);
+
 	journal_buf_realloc(j, w);
 	jset = w->data;
 
-	j->write_start_time = local_clock();
+	w->write_start_time = local_clock();
 
 	spin_lock(&j->lock);
 	if (bch2_journal_error(j) ||
@@ -1666,10 +1914,17 @@ void bch2_journal_write(struct closure *cl)
 	if (le32_to_cpu(jset->version) < bcachefs_metadata_version_current)
 		validate_before_checksum = true;
 
+	/* entries can only be validated before they're compressed: */
+	if (compression)
+		validate_before_checksum = true;
+
 	if (validate_before_checksum &&
 	    jset_validate_for_write(c, jset))
 		goto err;
 
+	if (compression)
+		jset_compress(c, j, jset, compression);
+
 	ret = bch2_encrypt(c, JSET_CSUM_TYPE(jset), journal_nonce(jset),
 		    jset->encrypted_start,
 		    vstruct_end(jset) - (void *) jset->encrypted_start);
@@ -1721,39 +1976,52 @@ retry_alloc:
 			journal_debug_buf.buf);
 		printbuf_exit(&journal_debug_buf);
 		bch2_fatal_error(c);
-		continue_at(cl, journal_write_done, c->io_complete_wq);
+		continue_at_nobarrier(&w->io, journal_write_done, c->io_complete_wq);
 		return;
 	}
 
 	w->devs_written = bch2_bkey_devs(bkey_i_to_s_c(&w->key));
 
-	if (c->opts.nochanges)
-		goto no_io;
-
 	for_each_rw_member(ca, c, i)
 		nr_rw_members++;
 
 	if (nr_rw_members > 1)
 		w->separate_flush = true;
 
-	if (!JSET_NO_FLUSH(jset) && w->separate_flush) {
-		for_each_rw_member(ca, c, i) {
-			percpu_ref_get(&ca->io_ref);
-
-			bio = ca->journal.bio;
-			bio_reset(bio, ca->disk_sb.bdev, REQ_OP_FLUSH);
-			bio->bi_end_io		= journal_write_endio;
-			bio->bi_private		= ca;
-			closure_bio_submit(bio, cl);
-		}
-	}
-
-	continue_at(cl, do_journal_write, c->io_complete_wq);
-	return;
-no_io:
-	continue_at(cl, journal_write_done, c->io_complete_wq);
+	continue_at_nobarrier(&w->io, journal_write_submit, c->io_complete_wq);
 	return;
 err:
 	bch2_fatal_error(c);
-	continue_at(cl, journal_write_done, c->io_complete_wq);
+	continue_at_nobarrier(&w->io, journal_write_done, c->io_complete_wq);
+}
+
+static struct journal_buf *journal_next_write(struct journal *j)
+{
+	u64 seq = j->seq_write_started + 1;
+	union journal_res_state s;
+
+	if (seq > journal_cur_seq(j))
+		return NULL;
+
+	/* buf refcount hits zero once it's been closed and all reservations released: */
+	s.v = atomic64_read(&j->reservations.counter);
+	if (journal_state_count(s, seq & JOURNAL_BUF_MASK))
+		return NULL;
+
+	return j->buf + (seq & JOURNAL_BUF_MASK);
+}
+
+/*
+ * Journal writes are started in order, one at a time, but don't wait for the
+ * previous write to complete - up to JOURNAL_BUF_NR - 1 may be in flight:
+ */
+void bch2_journal_write_work(struct work_struct *work)
+{
+	struct journal *j = container_of(work, struct journal, write_start_work);
+	struct journal_buf *w;
+
+	while ((w = journal_next_write(j))) {
+		j->seq_write_started++;
+		journal_write_prep(j, w);
+	}
 }
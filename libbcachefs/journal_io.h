@@ -54,6 +54,6 @@ void bch2_journal_ptrs_to_text(struct printbuf *, struct bch_fs *,
 
 int bch2_journal_read(struct bch_fs *, u64 *, u64 *);
 
-void bch2_journal_write(struct closure *);
+void bch2_journal_write_work(struct work_struct *);
 
 #endif /* _BCACHEFS_JOURNAL_IO_H */
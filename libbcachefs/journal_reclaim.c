@@ -281,7 +281,24 @@ void bch2_journal_do_discards(struct journal *j)
 		struct journal_device *ja = &ca->journal;
 
 		while (should_discard_bucket(j, ja)) {
+			/*
+			 * A zone has to be reset before it can be written
+			 * again: if that fails, don't make the bucket available,
+			 * and retry on the next reclaim:
+			 */
 			if (!c->opts.nochanges &&
+			    bdev_is_zoned(ca->disk_sb.bdev)) {
+				int ret = blkdev_zone_mgmt(ca->disk_sb.bdev, REQ_OP_ZONE_RESET,
+					bucket_to_sector(ca,
+						ja->buckets[ja->discard_idx]),
+					ca->mi.bucket_size, GFP_NOIO);
+
+				if (ret) {
+					bch_err_ratelimited(c, "%s: error resetting journal zone: %s",
+							    ca->name, bch2_err_str(ret));
+					break;
+				}
+			} else if (!c->opts.nochanges &&
 			    ca->mi.discard &&
 			    bdev_max_discard_sectors(ca->disk_sb.bdev))
 				blkdev_issue_discard(ca->disk_sb.bdev,
@@ -347,16 +364,31 @@ void bch2_journal_pin_put(struct journal *j, u64 seq)
 	}
 }
 
+static struct journal_pin_flush *
+journal_pin_flush_find(struct journal *j, struct journal_entry_pin *pin)
+{
+	struct journal_pin_flush *f;
+
+	for (f = j->flush_in_progress;
+	     f < j->flush_in_progress + ARRAY_SIZE(j->flush_in_progress);
+	     f++)
+		if (f->pin == pin)
+			return f;
+	return NULL;
+}
+
 static inline void __journal_pin_drop(struct journal *j,
 				      struct journal_entry_pin *pin)
 {
 	struct journal_entry_pin_list *pin_list;
+	struct journal_pin_flush *f;
 
 	if (!journal_pin_active(pin))
 		return;
 
-	if (j->flush_in_progress == pin)
-		j->flush_in_progress_dropped = true;
+	f = journal_pin_flush_find(j, pin);
+	if (f)
+		f->dropped = true;
 
 	pin_list = journal_seq_pin(j, pin->seq);
 	pin->seq = 0;
@@ -424,11 +456,22 @@ void bch2_journal_pin_set(struct journal *j, u64 seq,
 /**
  * bch2_journal_pin_flush: ensure journal pin callback is no longer running
  */
+static bool journal_pin_flush_done(struct journal *j, struct journal_entry_pin *pin)
+{
+	bool ret;
+
+	spin_lock(&j->lock);
+	ret = !journal_pin_flush_find(j, pin);
+	spin_unlock(&j->lock);
+
+	return ret;
+}
+
 void bch2_journal_pin_flush(struct journal *j, struct journal_entry_pin *pin)
 {
 	BUG_ON(journal_pin_active(pin));
 
-	wait_event(j->pin_flush_wait, j->flush_in_progress != pin);
+	wait_event(j->pin_flush_wait, journal_pin_flush_done(j, pin));
 }
 
 /*
@@ -449,87 +492,176 @@ journal_get_next_pin(struct journal *j,
 	struct journal_entry_pin_list *pin_list;
 	struct journal_entry_pin *ret = NULL;
 
+	/* Skips pins that are already being flushed: */
 	fifo_for_each_entry_ptr(pin_list, &j->pin, *seq) {
 		if (*seq > max_seq && !get_any && !get_key_cache)
 			break;
 
-		if (*seq <= max_seq || get_any) {
-			ret = list_first_entry_or_null(&pin_list->list,
-				struct journal_entry_pin, list);
-			if (ret)
-				return ret;
-		}
+		if (*seq <= max_seq || get_any)
+			list_for_each_entry(ret, &pin_list->list, list)
+				if (!journal_pin_flush_find(j, ret))
+					return ret;
 
-		if (*seq <= max_seq || get_any || get_key_cache) {
-			ret = list_first_entry_or_null(&pin_list->key_cache_list,
-				struct journal_entry_pin, list);
-			if (ret)
-				return ret;
-		}
+		if (*seq <= max_seq || get_any || get_key_cache)
+			list_for_each_entry(ret, &pin_list->key_cache_list, list)
+				if (!journal_pin_flush_find(j, ret))
+					return ret;
 	}
 
 	return NULL;
 }
 
+void bch2_journal_pin_flush_work(struct work_struct *work)
+{
+	struct journal_pin_flush *f =
+		container_of(work, struct journal_pin_flush, work);
+	struct journal *j = f->j;
+	unsigned flags;
+	int err;
+
+	/* Same as the reclaim thread, see __bch2_journal_reclaim(): */
+	flags = memalloc_noreclaim_save();
+	err = f->fn(j, f->pin, f->seq);
+	memalloc_noreclaim_restore(flags);
+
+	spin_lock(&j->lock);
+	/* Pin might have been dropped or rearmed: */
+	if (likely(!err && !f->dropped))
+		list_move(&f->pin->list, &journal_seq_pin(j, f->seq)->flushed);
+
+	if (err)
+		j->flush_err = err;
+	else
+		j->flush_nr_flushed++;
+
+	f->pin = NULL;
+	j->flush_nr_in_flight--;
+	spin_unlock(&j->lock);
+
+	wake_up(&j->pin_flush_wait);
+}
+
 /* returns true if we did work */
 static size_t journal_flush_pins(struct journal *j, u64 seq_to_flush,
 				 unsigned min_any,
 				 unsigned min_key_cache)
 {
 	struct journal_entry_pin *pin;
-	size_t nr_flushed = 0;
-	journal_pin_flush_fn flush_fn;
+	struct journal_pin_flush *f;
+	size_t nr_flushed;
+	unsigned nr_in_flight;
 	u64 seq;
-	int err;
 
 	lockdep_assert_held(&j->reclaim_lock);
 
-	while (1) {
-		cond_resched();
+	spin_lock(&j->lock);
+	j->flush_nr_flushed	= 0;
+	j->flush_err		= 0;
 
+	/*
+	 * Pins are dispatched oldest first, but flushes can complete in any
+	 * order: nothing needs them in order, only that everything up to
+	 * seq_to_flush gets flushed. After an error, stop dispatching and wait
+	 * for what's in flight:
+	 */
+	while (1) {
 		j->last_flushed = jiffies;
 
-		spin_lock(&j->lock);
-		pin = journal_get_next_pin(j,
-					   min_any != 0,
-					   min_key_cache != 0,
-					   seq_to_flush, &seq);
+		pin = !j->flush_err &&
+			j->flush_nr_in_flight < JOURNAL_PIN_FLUSH_MAX
+			? journal_get_next_pin(j,
+					       min_any != 0,
+					       min_key_cache != 0,
+					       seq_to_flush, &seq)
+			: NULL;
 		if (pin) {
-			BUG_ON(j->flush_in_progress);
-			j->flush_in_progress = pin;
-			j->flush_in_progress_dropped = false;
-			flush_fn = pin->flush;
+			f = journal_pin_flush_find(j, NULL);
+			BUG_ON(!f);
+
+			f->pin		= pin;
+			f->fn		= pin->flush;
+			f->seq		= seq;
+			f->dropped	= false;
+			j->flush_nr_in_flight++;
+
+			if (min_key_cache && pin->flush == bch2_btree_key_cache_journal_flush)
+				min_key_cache--;
+
+			if (min_any)
+				min_any--;
+
+			queue_work(j->pin_flush_wq, &f->work);
+			continue;
 		}
-		spin_unlock(&j->lock);
 
-		if (!pin)
+		nr_in_flight = j->flush_nr_in_flight;
+		if (!nr_in_flight)
 			break;
+		spin_unlock(&j->lock);
 
-		if (min_key_cache && pin->flush == bch2_btree_key_cache_journal_flush)
-			min_key_cache--;
+		/* Wait for a slot, or for a flush that might have added pins: */
+		wait_event(j->pin_flush_wait,
+			   READ_ONCE(j->flush_nr_in_flight) < nr_in_flight);
+		cond_resched();
 
-		if (min_any)
-			min_any--;
+		spin_lock(&j->lock);
+	}
 
-		err = flush_fn(j, pin, seq);
+	nr_flushed = j->flush_nr_flushed;
+	spin_unlock(&j->lock);
 
-		spin_lock(&j->lock);
-		/* Pin might have been dropped or rearmed: */
-		if (likely(!err && !j->flush_in_progress_dropped))
-			list_move(&pin->list, &journal_seq_pin(j, seq)->flushed);
-		j->flush_in_progress = NULL;
-		j->flush_in_progress_dropped = false;
-		spin_unlock(&j->lock);
+	return nr_flushed;
+}
 
-		wake_up(&j->pin_flush_wait);
+/*
+ * Rate based reclaim: going by the fill level alone, reclaim only starts
+ * flushing once the journal or the key cache is already past its watermark,
+ * and then stalls commits while it catches up. So we also track how fast the
+ * journal is filling and the key cache is getting dirtied, and flush for where
+ * they'll be JOURNAL_RECLAIM_HORIZON_MS from now:
+ */
+#define JOURNAL_RECLAIM_HORIZON_MS	1000
 
-		if (err)
-			break;
+static void journal_reclaim_rates_update(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct bch_dev *ca;
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - j->reclaim_rate_time;
+	long dirty;
+	unsigned iter;
+
+	lockdep_assert_held(&j->lock);
+
+	/* Too soon to tell: */
+	if (elapsed < msecs_to_jiffies(10))
+		return;
+
+	for_each_rw_member(ca, c, iter) {
+		struct journal_device *ja = &ca->journal;
+		u64 used;
 
-		nr_flushed++;
+		if (!ja->nr)
+			continue;
+
+		used = (ja->cur_idx + ja->nr - ja->reclaim_idx) % ja->nr;
+		ja->reclaim_idx = ja->cur_idx;
+		ja->fill_rate = ewma_add(ja->fill_rate,
+					 div64_u64((used << 8) * HZ, elapsed), 3);
 	}
 
-	return nr_flushed;
+	dirty = atomic_long_read(&c->btree_key_cache.nr_dirty);
+	j->key_cache_dirty_rate = ewma_add(j->key_cache_dirty_rate,
+			div64_u64((u64) max(dirty - j->reclaim_key_cache_dirty, 0L) * HZ << 8,
+				  elapsed), 3);
+	j->reclaim_key_cache_dirty = dirty;
+
+	j->reclaim_rate_time = now;
+}
+
+static inline u64 journal_reclaim_predict(u64 rate)
+{
+	return (rate * JOURNAL_RECLAIM_HORIZON_MS / MSEC_PER_SEC) >> 8;
 }
 
 static u64 journal_seq_to_flush(struct journal *j)
@@ -540,6 +672,7 @@ static u64 journal_seq_to_flush(struct journal *j)
 	unsigned iter;
 
 	spin_lock(&j->lock);
+	journal_reclaim_rates_update(j);
 
 	for_each_rw_member(ca, c, iter) {
 		struct journal_device *ja = &ca->journal;
@@ -556,6 +689,9 @@ static u64 journal_seq_to_flush(struct journal *j)
 					   (ca->mi.bucket_size << 6) -
 					   journal_entry_overhead(j));
 
+		/* And what we expect to be written before we're next done: */
+		nr_buckets += journal_reclaim_predict(ja->fill_rate);
+
 		nr_buckets = min(nr_buckets, ja->nr);
 
 		bucket_to_flush = (ja->cur_idx + nr_buckets) % ja->nr;
@@ -639,7 +775,9 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct, bool kicked)
 		if (atomic_read(&c->btree_cache.dirty) * 2 > c->btree_cache.used)
 			min_nr = 1;
 
-		min_key_cache = min(bch2_nr_btree_keys_need_flush(c), (size_t) 128);
+		min_key_cache = min(bch2_nr_btree_keys_need_flush(c) +
+				    (size_t) journal_reclaim_predict(j->key_cache_dirty_rate),
+				    (size_t) 128);
 
 		trace_and_count(c, journal_reclaim_start, c,
 				direct, kicked,
@@ -67,6 +67,7 @@ static inline void bch2_journal_pin_update(struct journal *j, u64 seq,
 }
 
 void bch2_journal_pin_flush(struct journal *, struct journal_entry_pin *);
+void bch2_journal_pin_flush_work(struct work_struct *);
 
 void bch2_journal_do_discards(struct journal *);
 int bch2_journal_reclaim(struct journal *);
@@ -119,29 +119,17 @@ out:
 	return ret ?: bch2_blacklist_table_initialize(c);
 }
 
-static int journal_seq_blacklist_table_cmp(const void *_l,
-					   const void *_r, size_t size)
-{
-	const struct journal_seq_blacklist_table_entry *l = _l;
-	const struct journal_seq_blacklist_table_entry *r = _r;
-
-	return cmp_int(l->start, r->start);
-}
-
 bool bch2_journal_seq_is_blacklisted(struct bch_fs *c, u64 seq,
 				     bool dirty)
 {
 	struct journal_seq_blacklist_table *t = c->journal_seq_blacklist_table;
-	struct journal_seq_blacklist_table_entry search = { .start = seq };
-	int idx;
+	ssize_t idx;
 
 	if (!t)
 		return false;
 
-	idx = eytzinger0_find_le(t->entries, t->nr,
-				 sizeof(t->entries[0]),
-				 journal_seq_blacklist_table_cmp,
-				 &search);
+	idx = eytzinger0_find_le_u64(&t->entries[0].start, t->nr,
+				     sizeof(t->entries[0]), seq);
 	if (idx < 0)
 		return false;
 
@@ -160,7 +148,7 @@ int bch2_blacklist_table_initialize(struct bch_fs *c)
 	struct bch_sb_field_journal_seq_blacklist *bl =
 		bch2_sb_get_journal_seq_blacklist(c->disk_sb.sb);
 	struct journal_seq_blacklist_table *t;
-	unsigned i, nr = blacklist_nr_entries(bl);
+	unsigned i, e, nr = blacklist_nr_entries(bl);
 
 	if (!bl)
 		return 0;
@@ -172,17 +160,17 @@ int bch2_blacklist_table_initialize(struct bch_fs *c)
 
 	t->nr = nr;
 
-	for (i = 0; i < nr; i++) {
-		t->entries[i].start	= le64_to_cpu(bl->start[i].start);
-		t->entries[i].end	= le64_to_cpu(bl->start[i].end);
+	/*
+	 * Superblock entries are sorted (checked by validate), so they can be
+	 * laid out in eytzinger order with a single inorder walk:
+	 */
+	i = 0;
+	eytzinger0_for_each(e, nr) {
+		t->entries[e].start	= le64_to_cpu(bl->start[i].start);
+		t->entries[e].end	= le64_to_cpu(bl->start[i].end);
+		i++;
 	}
 
-	eytzinger0_sort(t->entries,
-			t->nr,
-			sizeof(t->entries[0]),
-			journal_seq_blacklist_table_cmp,
-			NULL);
-
 	kfree(c->journal_seq_blacklist_table);
 	c->journal_seq_blacklist_table = t;
 	return 0;
@@ -36,6 +36,22 @@ struct journal_buf {
 	bool			noflush;	/* write has already been kicked off, and was noflush */
 	bool			must_flush;	/* something wants a flush */
 	bool			separate_flush;
+
+	/* index of this buf in journal->buf: */
+	u8			idx;
+	/* write completed, but an earlier write may not have: */
+	bool			write_done;
+	int			write_err;
+	u64			write_start_time;
+	struct closure		io;
+};
+
+/* Per device, per journal_buf bio, so that writes can be in flight together: */
+struct journal_bio {
+	struct bch_dev		*ca;
+	struct journal_buf	*buf;
+	u64			submit_time;
+	struct bio		bio;
 };
 
 /*
@@ -62,12 +78,31 @@ struct journal_entry_pin {
 	u64				seq;
 };
 
+/*
+ * Journal reclaim runs up to JOURNAL_PIN_FLUSH_MAX pin flushes at a time, each
+ * from its own work item:
+ */
+#define JOURNAL_PIN_FLUSH_MAX		8
+
+struct journal_pin_flush {
+	struct work_struct		work;
+	struct journal			*j;
+	/* NULL if this slot is free: */
+	struct journal_entry_pin	*pin;
+	journal_pin_flush_fn		fn;
+	u64				seq;
+	/* Pin was dropped or rearmed while being flushed: */
+	bool				dropped;
+};
+
 struct journal_res {
 	bool			ref;
 	u8			idx;
 	u16			u64s;
 	u32			offset;
 	u64			seq;
+	/* if nonzero, taken from this CPU's (+ 1) journal_res_pcpu: */
+	u32			pcpu;
 };
 
 /*
@@ -127,6 +162,35 @@ union journal_preres_state {
 #define JOURNAL_ENTRY_CLOSED_VAL	(JOURNAL_ENTRY_OFFSET_MAX - 1)
 #define JOURNAL_ENTRY_ERROR_VAL		(JOURNAL_ENTRY_OFFSET_MAX)
 
+/*
+ * Per CPU journal reservations: each CPU carves a chunk of u64s out of the
+ * current journal entry, holding a single ref on the journal buf, and hands out
+ * reservations from it without touching journal->reservations. The chunk
+ * is invalidated when the journal entry is closed; whoever drops the last
+ * reservation on an invalidated chunk pads out what's left of it and drops the
+ * buf ref:
+ */
+union journal_res_pcpu_state {
+	struct {
+		atomic64_t	counter;
+	};
+
+	struct {
+		u64		v;
+	};
+
+	struct {
+		u64		offset:20,
+				end:20,
+				count:20,
+				valid:1;
+	};
+};
+
+struct journal_res_pcpu {
+	union journal_res_pcpu_state s[JOURNAL_BUF_NR];
+};
+
 struct journal_space {
 	/* Units of 512 bytes sectors: */
 	unsigned	next_entry; /* How big the next journal entry can be */
@@ -184,6 +248,7 @@ struct journal {
 
 	union journal_res_state reservations;
 	enum journal_watermark	watermark;
+	struct journal_res_pcpu __percpu *res_pcpu;
 
 	/* Max size of current journal entry */
 	unsigned		cur_entry_u64s;
@@ -203,11 +268,15 @@ struct journal {
 	unsigned		buf_size_want;
 
 	/*
-	 * Two journal entries -- one is currently open for new entries, the
-	 * other is possibly being written out.
+	 * One journal entry is currently open for new entries, the others are
+	 * closed and possibly being written out.
 	 */
 	struct journal_buf	buf[JOURNAL_BUF_NR];
 
+	/* For compressing entries, in journal_write_prep(): */
+	void			*compress_buf;
+	size_t			compress_buf_size;
+
 	spinlock_t		lock;
 
 	/* if nonzero, we may not open a new journal entry: */
@@ -218,12 +287,15 @@ struct journal {
 	struct closure_waitlist	async_wait;
 	struct closure_waitlist	preres_wait;
 
-	struct closure		io;
+	struct work_struct	write_start_work;
 	struct delayed_work	write_work;
 
 	/* Sequence number of most recent journal entry (last entry in @pin) */
 	atomic64_t		seq;
 
+	/* most recent journal entry we've started writing: */
+	u64			seq_write_started;
+
 	/* seq, last_seq from the most recent journal entry successfully written */
 	u64			seq_ondisk;
 	u64			flushed_seq_ondisk;
@@ -273,8 +345,18 @@ struct journal {
 	u64			nr_background_reclaim;
 
 	unsigned long		last_flushed;
-	struct journal_entry_pin *flush_in_progress;
-	bool			flush_in_progress_dropped;
+
+	/* Rate based reclaim, see journal_reclaim_rates_update(): */
+	unsigned long		reclaim_rate_time;
+	long			reclaim_key_cache_dirty;
+	/* dirty key cache keys per second, << 8: */
+	u64			key_cache_dirty_rate;
+
+	struct journal_pin_flush flush_in_progress[JOURNAL_PIN_FLUSH_MAX];
+	unsigned		flush_nr_in_flight;
+	size_t			flush_nr_flushed;
+	int			flush_err;
+	struct workqueue_struct	*pin_flush_wq;
 	wait_queue_head_t	pin_flush_wait;
 
 	/* protects advancing ja->discard_idx: */
@@ -284,7 +366,6 @@ struct journal {
 	unsigned long		last_flush_write;
 
 	u64			res_get_blocked_start;
-	u64			write_start_time;
 
 	u64			nr_flush_writes;
 	u64			nr_noflush_writes;
@@ -321,10 +402,14 @@ struct journal_device {
 	unsigned		cur_idx;		/* Journal bucket we're currently writing to */
 	unsigned		nr;
 
+	/* journal reclaim: cur_idx last time we checked, and buckets/sec << 8 */
+	unsigned		reclaim_idx;
+	u64			fill_rate;
+
 	u64			*buckets;
 
-	/* Bio for journal reads/writes to this device */
-	struct bio		*bio;
+	/* Bios for journal writes to this device, one per journal_buf */
+	struct journal_bio	*bio[JOURNAL_BUF_NR];
 
 	/* for bch_journal_read_device */
 	struct closure		read;
@@ -30,6 +30,49 @@ void bch2_lru_to_text(struct printbuf *out, struct bch_fs *c,
 	prt_printf(out, "idx %llu", le64_to_cpu(lru->idx));
 }
 
+/*
+ * Bucket invalidation walks a device's lru entries from the oldest; after many
+ * invalidations the start of that range is mostly whiteouts, which every walk
+ * would have to skip over again. So we remember where the first live entry was
+ * on the previous walk, and start there - anything that adds an entry below
+ * the cursor must lower it, which bch2_lru_set() does.
+ *
+ * Journal replay adds lru entries without going through bch2_lru_set(), so
+ * the cursor isn't used until replay is done.
+ */
+void bch2_lru_cursor_lower(struct bch_fs *c, u64 lru_id, u64 time)
+{
+	atomic64_t *cursor;
+	u64 v, old;
+
+	if (lru_id >= BCH_SB_MEMBERS_MAX || !bch2_dev_exists2(c, lru_id))
+		return;
+
+	cursor = &bch_dev_bkey_exists(c, lru_id)->lru_cursor;
+	v = atomic64_read(cursor);
+	do {
+		if (time >= v)
+			return;
+		old = v;
+	} while ((v = atomic64_cmpxchg(cursor, old, time)) != old);
+
+	this_cpu_inc(c->counters[BCH_COUNTER_lru_cursor_lower]);
+}
+
+/*
+ * @pos was the cursor when the walk started, @first the first live entry it
+ * saw; if the cursor was lowered in the meantime, leave it:
+ */
+void bch2_lru_cursor_advance(struct bch_fs *c, u64 lru_id, u64 pos, u64 first)
+{
+	if (!test_bit(JOURNAL_REPLAY_DONE, &c->journal.flags) || first <= pos)
+		return;
+
+	if (atomic64_cmpxchg(&bch_dev_bkey_exists(c, lru_id)->lru_cursor,
+			     pos, first) == pos)
+		this_cpu_inc(c->counters[BCH_COUNTER_lru_cursor_advance]);
+}
+
 int bch2_lru_delete(struct btree_trans *trans, u64 id, u64 idx, u64 time,
 		    struct bkey_s_c orig_k)
 {
@@ -101,6 +144,8 @@ int bch2_lru_set(struct btree_trans *trans, u64 lru_id, u64 idx, u64 *time)
 	BUG_ON(iter.pos.inode != lru_id);
 	*time = iter.pos.offset;
 
+	bch2_lru_cursor_lower(trans->c, lru_id, *time);
+
 	lru = bch2_trans_kmalloc(trans, sizeof(*lru));
 	ret = PTR_ERR_OR_ZERO(lru);
 	if (ret)
@@ -10,6 +10,16 @@ void bch2_lru_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
 	.val_to_text	= bch2_lru_to_text,	\
 }
 
+void bch2_lru_cursor_lower(struct bch_fs *, u64, u64);
+void bch2_lru_cursor_advance(struct bch_fs *, u64, u64, u64);
+
+static inline u64 bch2_lru_cursor(struct bch_fs *c, unsigned dev)
+{
+	return test_bit(JOURNAL_REPLAY_DONE, &c->journal.flags)
+		? atomic64_read(&bch_dev_bkey_exists(c, dev)->lru_cursor)
+		: 0;
+}
+
 int bch2_lru_delete(struct btree_trans *, u64, u64, u64, struct bkey_s_c);
 int bch2_lru_set(struct btree_trans *, u64, u64, u64 *);
 int bch2_lru_change(struct btree_trans *, u64, u64, u64, u64 *, struct bkey_s_c);
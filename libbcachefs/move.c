@@ -1,12 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "alloc_background.h"
 #include "alloc_foreground.h"
 #include "backpointers.h"
 #include "bkey_buf.h"
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
+#include "checksum.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "errcode.h"
@@ -15,12 +17,16 @@
 #include "io.h"
 #include "journal_reclaim.h"
 #include "move.h"
+#include "reflink.h"
 #include "replicas.h"
+#include "subvolume.h"
 #include "super-io.h"
 #include "keylist.h"
 
 #include <linux/ioprio.h>
 #include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
 
 #include <trace/events/bcachefs.h>
 
@@ -45,6 +51,7 @@ struct moving_io {
 
 	unsigned		read_sectors;
 	unsigned		write_sectors;
+	u64			start_time;
 
 	struct bch_read_bio	rbio;
 
@@ -53,6 +60,73 @@ struct moving_io {
 	struct bio_vec		bi_inline_vecs[0];
 };
 
+/* How much slower than the best recent latency we tolerate IOs being: */
+#define MOVE_WINDOW_LATENCY_SHIFT	1
+/* Forget the lowest latency after this long, so we notice the device slowing: */
+#define MOVE_WINDOW_MIN_LATENCY_RESET	(10 * NSEC_PER_SEC)
+
+static void move_window_init(struct move_window *w, unsigned min, unsigned max)
+{
+	memset(w, 0, sizeof(*w));
+	w->min		= min;
+	w->max		= max;
+	w->sectors	= min;
+	w->slow_start	= true;
+}
+
+static void move_window_update(struct moving_context *ctxt, int rw,
+			       u64 start_time, unsigned sectors)
+{
+	struct move_window *w = rw == READ
+		? &ctxt->read_window
+		: &ctxt->write_window;
+	struct bch_move_stats *stats = ctxt->stats;
+	u64 now = local_clock();
+	u64 latency = time_after64(now, start_time) ? now - start_time : 0;
+	bool congested = __bch2_target_congested(ctxt->c, 0);
+	bool decreased = false;
+	unsigned long flags;
+
+	/* called from endio as well as process context: */
+	spin_lock_irqsave(&ctxt->window_lock, flags);
+	w->latency = w->latency ? ewma_add(w->latency, latency, 3) : latency;
+
+	if (!w->min_latency ||
+	    latency < w->min_latency ||
+	    time_after64(now, w->min_latency_time + MOVE_WINDOW_MIN_LATENCY_RESET)) {
+		w->min_latency		= latency;
+		w->min_latency_time	= now;
+	}
+
+	w->acked += sectors;
+
+	if (congested ||
+	    w->latency > w->min_latency << MOVE_WINDOW_LATENCY_SHIFT) {
+		/* decrease at most once per window's worth of completions: */
+		if (w->acked >= w->sectors) {
+			w->sectors	= max(w->sectors >> 1, w->min);
+			w->acked	= 0;
+			w->slow_start	= false;
+			decreased	= true;
+		}
+	} else if (w->slow_start) {
+		w->sectors = min(w->sectors + sectors, w->max);
+	} else if (w->acked >= w->sectors) {
+		w->sectors	= min(w->sectors + sectors, w->max);
+		w->acked	= 0;
+	}
+
+	if (stats) {
+		WRITE_ONCE(*(rw == READ ? &stats->read_window : &stats->write_window),
+			   w->sectors);
+		WRITE_ONCE(*(rw == READ ? &stats->read_latency : &stats->write_latency),
+			   w->latency);
+		if (decreased)
+			atomic64_inc(&stats->window_decreases);
+	}
+	spin_unlock_irqrestore(&ctxt->window_lock, flags);
+}
+
 static void move_free(struct closure *cl)
 {
 	struct moving_io *io = container_of(cl, struct moving_io, cl);
@@ -73,6 +147,8 @@ static void move_write_done(struct closure *cl)
 	if (io->write.op.error)
 		ctxt->write_error = true;
 
+	move_window_update(ctxt, WRITE, io->start_time, io->write_sectors);
+
 	atomic_sub(io->write_sectors, &io->write.ctxt->write_sectors);
 	closure_return_with_destructor(cl, move_free);
 }
@@ -87,8 +163,12 @@ static void move_write(struct closure *cl)
 	}
 
 	atomic_add(io->write_sectors, &io->write.ctxt->write_sectors);
+	io->start_time = local_clock();
 
-	bch2_data_update_read_done(&io->write, io->rbio.pick.crc, cl);
+	if (io->write.coalesced.keys_p)
+		bch2_data_update_coalesce_read_done(&io->write, cl);
+	else
+		bch2_data_update_read_done(&io->write, io->rbio.pick.crc, cl);
 	continue_at(cl, move_write_done, NULL);
 }
 
@@ -105,6 +185,8 @@ static void move_read_endio(struct bio *bio)
 	struct moving_io *io = container_of(bio, struct moving_io, rbio.bio);
 	struct moving_context *ctxt = io->write.ctxt;
 
+	move_window_update(ctxt, READ, io->start_time, io->read_sectors);
+
 	atomic_sub(io->read_sectors, &ctxt->read_sectors);
 	io->read_completed = true;
 
@@ -165,7 +247,8 @@ void bch2_moving_ctxt_init(struct moving_context *ctxt,
 			   struct bch_ratelimit *rate,
 			   struct bch_move_stats *stats,
 			   struct write_point_specifier wp,
-			   bool wait_on_copygc)
+			   bool wait_on_copygc,
+			   enum bch_io_class io_class)
 {
 	memset(ctxt, 0, sizeof(*ctxt));
 
@@ -174,17 +257,41 @@ void bch2_moving_ctxt_init(struct moving_context *ctxt,
 	ctxt->stats	= stats;
 	ctxt->wp	= wp;
 	ctxt->wait_on_copygc = wait_on_copygc;
+	ctxt->io_class	= io_class;
+	ctxt->coalesce	= c->opts.move_coalesce_extents;
 
 	closure_init_stack(&ctxt->cl);
 	INIT_LIST_HEAD(&ctxt->reads);
 	init_waitqueue_head(&ctxt->wait);
 
+	spin_lock_init(&ctxt->window_lock);
+	bch2_moving_ctxt_window_limits(ctxt,
+			max_t(unsigned, c->opts.move_bytes_in_flight >> 15, PAGE_SECTORS),
+			c->opts.move_bytes_in_flight >> 9);
+
 	if (stats) {
 		progress_list_add(c, stats);
 		stats->data_type = BCH_DATA_user;
 	}
 }
 
+/*
+ * The in flight windows start at @min_sectors and grow up to @max_sectors;
+ * @min_sectors == @max_sectors gives a fixed window:
+ */
+void bch2_moving_ctxt_window_limits(struct moving_context *ctxt,
+				    unsigned min_sectors, unsigned max_sectors)
+{
+	unsigned long flags;
+
+	min_sectors = min(min_sectors, max_sectors);
+
+	spin_lock_irqsave(&ctxt->window_lock, flags);
+	move_window_init(&ctxt->read_window,	min_sectors, max_sectors);
+	move_window_init(&ctxt->write_window,	min_sectors, max_sectors);
+	spin_unlock_irqrestore(&ctxt->window_lock, flags);
+}
+
 void bch_move_stats_init(struct bch_move_stats *stats, char *name)
 {
 	memset(stats, 0, sizeof(*stats));
@@ -235,13 +342,15 @@ static int bch2_extent_drop_ptrs(struct btree_trans *trans,
 		bch2_trans_commit(trans, NULL, NULL, BTREE_INSERT_NOFAIL);
 }
 
-static int bch2_move_extent(struct btree_trans *trans,
-			    struct btree_iter *iter,
-			    struct moving_context *ctxt,
-			    struct bch_io_opts io_opts,
-			    enum btree_id btree_id,
-			    struct bkey_s_c k,
-			    struct data_update_opts data_opts)
+/* @failed, if not NULL, lists devices the read should avoid: */
+static int __bch2_move_extent(struct btree_trans *trans,
+			      struct btree_iter *iter,
+			      struct moving_context *ctxt,
+			      struct bch_io_opts io_opts,
+			      enum btree_id btree_id,
+			      struct bkey_s_c k,
+			      struct data_update_opts data_opts,
+			      struct bch_io_failures *failed)
 {
 	struct bch_fs *c = trans->c;
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
@@ -311,17 +420,21 @@ static int bch2_move_extent(struct btree_trans *trans,
 
 	atomic_add(io->read_sectors, &ctxt->read_sectors);
 	list_add_tail(&io->list, &ctxt->reads);
+	io->start_time = local_clock();
+
+	/* the read and the write: */
+	bch2_io_sched_charge(c, ctxt->io_class, io->read_sectors + io->write_sectors);
 
 	/*
 	 * dropped by move_read_endio() - guards against use after free of
 	 * ctxt when doing wakeup
 	 */
 	closure_get(&ctxt->cl);
-	bch2_read_extent(trans, &io->rbio,
-			 bkey_start_pos(k.k),
-			 btree_id, k, 0,
-			 BCH_READ_NODECODE|
-			 BCH_READ_LAST_FRAGMENT);
+	__bch2_read_extent(trans, &io->rbio, io->rbio.bio.bi_iter,
+			   bkey_start_pos(k.k),
+			   btree_id, k, 0, failed,
+			   BCH_READ_NODECODE|
+			   BCH_READ_LAST_FRAGMENT);
 	return 0;
 err_free_pages:
 	bio_free_pages(&io->write.op.wbio.bio);
@@ -333,37 +446,269 @@ err:
 	return ret;
 }
 
-static int lookup_inode(struct btree_trans *trans, struct bpos pos,
-			struct bch_inode_unpacked *inode)
+static int bch2_move_extent(struct btree_trans *trans,
+			    struct btree_iter *iter,
+			    struct moving_context *ctxt,
+			    struct bch_io_opts io_opts,
+			    enum btree_id btree_id,
+			    struct bkey_s_c k,
+			    struct data_update_opts data_opts)
+{
+	return __bch2_move_extent(trans, iter, ctxt, io_opts, btree_id,
+				  k, data_opts, NULL);
+}
+
+/*
+ * Coalescing (the move_coalesce_extents option): runs of small extents that
+ * are contiguous in the same inode and snapshot are read together, decoded,
+ * and written out as a single new extent - i.e. online defragmentation:
+ */
+struct move_coalesce {
+	struct keylist		keys;
+	u64			inline_keys[BKEY_EXTENT_U64s_MAX * 2];
+	unsigned		nr;
+	unsigned		sectors;
+	struct bpos		end;
+	struct bversion		version;
+	struct bch_io_opts	io_opts;
+	struct data_update_opts	data_opts;
+};
+
+static void move_coalesce_init(struct move_coalesce *co)
 {
-	struct btree_iter iter;
-	struct bkey_s_c k;
-	int ret;
+	bch2_keylist_init(&co->keys, co->inline_keys);
+	co->nr		= 0;
+	co->sectors	= 0;
+}
 
-	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes, pos,
-			     BTREE_ITER_ALL_SNAPSHOTS);
-	k = bch2_btree_iter_peek(&iter);
-	ret = bkey_err(k);
+static void move_coalesce_exit(struct move_coalesce *co)
+{
+	bch2_keylist_free(&co->keys, co->inline_keys);
+}
+
+static bool move_extent_can_coalesce(struct moving_context *ctxt,
+				     enum btree_id btree_id,
+				     struct bkey_s_c k,
+				     struct data_update_opts data_opts)
+{
+	struct bch_fs *c = ctxt->c;
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+
+	if (!ctxt->coalesce ||
+	    btree_id != BTREE_ID_extents ||
+	    k.k->type != KEY_TYPE_extent ||
+	    k.k->size >= c->opts.encoded_extent_max >> 9)
+		return false;
+
+	/* overwriting extents that child snapshots can see needs whiteouts: */
+	if (bch2_snapshot_internal_node(c, k.k->p.snapshot))
+		return false;
+
+	bch2_data_update_opts_normalize(k, &data_opts);
+	if (!data_opts.rewrite_ptrs || data_opts.kill_ptrs)
+		return false;
+
+	/* encrypted extents have to be moved as is: */
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (bch2_csum_type_is_encryption(p.crc.csum_type))
+			return false;
+
+	return true;
+}
+
+static bool move_coalesce_contiguous(struct bch_fs *c, struct move_coalesce *co,
+				     struct bkey_s_c k)
+{
+	return !co->nr ||
+		(k.k->p.inode		== co->end.inode &&
+		 k.k->p.snapshot	== co->end.snapshot &&
+		 bkey_start_offset(k.k)	== co->end.offset &&
+		 !bversion_cmp(k.k->version, co->version) &&
+		 co->sectors + k.k->size <= c->opts.encoded_extent_max >> 9);
+}
+
+static int move_coalesce_push(struct move_coalesce *co, struct bkey_s_c k,
+			      struct bch_io_opts *io_opts,
+			      struct data_update_opts *data_opts)
+{
+	int ret = bch2_keylist_realloc(&co->keys, co->inline_keys,
+				       ARRAY_SIZE(co->inline_keys),
+				       BKEY_U64s + bkey_val_u64s(k.k));
 	if (ret)
-		goto err;
+		return ret;
 
-	if (!k.k || bkey_cmp(k.k->p, pos)) {
-		ret = -ENOENT;
-		goto err;
+	bkey_reassemble(co->keys.top, k);
+	bch2_keylist_push(&co->keys);
+
+	if (!co->nr) {
+		co->version	= k.k->version;
+		co->io_opts	= *io_opts;
+		co->data_opts	= *data_opts;
 	}
 
-	ret = bkey_is_inode(k.k) ? 0 : -EIO;
-	if (ret)
+	co->nr++;
+	co->sectors	+= k.k->size;
+	co->end		= k.k->p;
+	return 0;
+}
+
+static int bch2_move_extents_coalesced(struct btree_trans *trans,
+				       struct moving_context *ctxt,
+				       enum btree_id btree_id,
+				       struct move_coalesce *co)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_i *first = bch2_keylist_front(&co->keys), *k;
+	struct moving_io *io;
+	struct bvec_iter iter;
+	unsigned pages = DIV_ROUND_UP(co->sectors, PAGE_SECTORS);
+	int ret = -ENOMEM;
+
+	if (!percpu_ref_tryget_live(&c->writes))
+		return -EROFS;
+
+	io = kzalloc(sizeof(struct moving_io) +
+		     sizeof(struct bio_vec) * pages, GFP_KERNEL);
+	if (!io)
 		goto err;
 
-	ret = bch2_inode_unpack(k, inode);
+	io->write.ctxt		= ctxt;
+	io->read_sectors	= co->sectors;
+	io->write_sectors	= co->sectors;
+
+	bio_init(&io->write.op.wbio.bio, NULL, io->bi_inline_vecs, pages, 0);
+	bio_set_prio(&io->write.op.wbio.bio,
+		     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+	if (bch2_bio_alloc_pages(&io->write.op.wbio.bio, co->sectors << 9,
+				 GFP_KERNEL))
+		goto err_free;
+
+	io->rbio.c		= c;
+	io->rbio.opts		= co->io_opts;
+	bio_init(&io->rbio.bio, NULL, io->bi_inline_vecs, pages, 0);
+	io->rbio.bio.bi_vcnt = pages;
+	bio_set_prio(&io->rbio.bio, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+	io->rbio.bio.bi_iter.bi_size = co->sectors << 9;
+
+	bio_set_op_attrs(&io->rbio.bio, REQ_OP_READ, 0);
+	io->rbio.bio.bi_iter.bi_sector	= bkey_start_offset(&first->k);
+	io->rbio.bio.bi_end_io		= move_read_endio;
+
+	ret = bch2_data_update_coalesce_init(c, &io->write, ctxt->wp,
+					     co->io_opts, co->data_opts,
+					     btree_id, &co->keys);
 	if (ret)
-		goto err;
+		goto err_free_pages;
+
+	io->write.ctxt = ctxt;
+
+	atomic64_add(co->nr, &ctxt->stats->keys_moved);
+	atomic64_add(co->sectors, &ctxt->stats->sectors_moved);
+	this_cpu_add(c->counters[BCH_COUNTER_io_move], co->sectors);
+	this_cpu_add(c->counters[BCH_COUNTER_move_extent_read], co->sectors);
+	trace_move_extent_read(&first->k);
+
+	atomic_add(io->read_sectors, &ctxt->read_sectors);
+	list_add_tail(&io->list, &ctxt->reads);
+	io->start_time = local_clock();
+
+	bch2_io_sched_charge(c, ctxt->io_class, io->read_sectors + io->write_sectors);
+
+	closure_get(&ctxt->cl);
+
+	/* one fragment per extent, the write sees a single decoded buffer: */
+	iter = io->rbio.bio.bi_iter;
+	for_each_keylist_key(&co->keys, k) {
+		unsigned bytes = k->k.size << 9;
+		unsigned flags = 0;
+
+		swap(iter.bi_size, bytes);
+		if (iter.bi_size == bytes)
+			flags |= BCH_READ_LAST_FRAGMENT;
+
+		__bch2_read_extent(trans, &io->rbio, iter,
+				   bkey_start_pos(&k->k), btree_id,
+				   bkey_i_to_s_c(k), 0, NULL, flags);
+
+		swap(iter.bi_size, bytes);
+		bio_advance_iter(&io->rbio.bio, &iter, bytes);
+	}
+	return 0;
+err_free_pages:
+	bio_free_pages(&io->write.op.wbio.bio);
+err_free:
+	kfree(io);
 err:
-	bch2_trans_iter_exit(trans, &iter);
+	percpu_ref_put(&c->writes);
+	trace_and_count(c, move_extent_alloc_mem_fail, &first->k);
 	return ret;
 }
 
+static void move_coalesce_flush(struct btree_trans *trans,
+				struct btree_iter *iter,
+				struct moving_context *ctxt,
+				enum btree_id btree_id,
+				struct move_coalesce *co,
+				move_pred_fn pred, void *arg)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_i *k;
+
+	if (!co->nr)
+		return;
+
+	/*
+	 * A single extent, or if we couldn't get the memory or disk
+	 * reservation for rewriting the run as one extent: move the extents
+	 * individually, as we would have without coalescing:
+	 */
+	if (co->nr == 1 ||
+	    bch2_move_extents_coalesced(trans, ctxt, btree_id, co)) {
+		for_each_keylist_key(&co->keys, k) {
+			struct bch_io_opts io_opts = co->io_opts;
+			struct data_update_opts data_opts = { 0 };
+			int ret;
+
+			if (!pred(c, arg, bkey_i_to_s_c(k), &io_opts, &data_opts))
+				continue;
+
+			while ((ret = bch2_move_extent(trans, iter, ctxt, io_opts,
+						btree_id, bkey_i_to_s_c(k),
+						data_opts)) == -ENOMEM)
+				bch2_move_ctxt_wait_for_io(ctxt, trans);
+		}
+	}
+
+	bch2_keylist_free(&co->keys, co->inline_keys);
+	move_coalesce_init(co);
+}
+
+static u64 data_job_limits_delay(struct data_job_limits *l)
+{
+	return max(l->sectors.rate	? bch2_ratelimit_delay(&l->sectors)	: 0,
+		   l->iops.rate		? bch2_ratelimit_delay(&l->iops)	: 0);
+}
+
+static void data_job_limits_increment(struct data_job_limits *l, u64 sectors)
+{
+	if (l->sectors.rate)
+		bch2_ratelimit_increment(&l->sectors, sectors);
+	if (l->iops.rate)
+		bch2_ratelimit_increment(&l->iops, 1);
+}
+
+static void move_ratelimit_increment(struct moving_context *ctxt, u64 sectors)
+{
+	if (ctxt->rate)
+		bch2_ratelimit_increment(ctxt->rate, sectors);
+	if (ctxt->limits)
+		data_job_limits_increment(ctxt->limits, sectors);
+}
+
 static int move_ratelimit(struct btree_trans *trans,
 			  struct moving_context *ctxt)
 {
@@ -379,6 +724,8 @@ static int move_ratelimit(struct btree_trans *trans,
 
 	do {
 		delay = ctxt->rate ? bch2_ratelimit_delay(ctxt->rate) : 0;
+		if (ctxt->limits)
+			delay = max(delay, data_job_limits_delay(ctxt->limits));
 
 		if (delay) {
 			bch2_trans_unlock(trans);
@@ -399,13 +746,18 @@ static int move_ratelimit(struct btree_trans *trans,
 		}
 	} while (delay);
 
+	if (!bch2_io_sched_may_submit(c, ctxt->io_class)) {
+		bch2_trans_unlock(trans);
+		bch2_io_sched_wait(c, ctxt->io_class);
+	}
+
 	move_ctxt_wait_event(ctxt, trans,
 		atomic_read(&ctxt->write_sectors) <
-		c->opts.move_bytes_in_flight >> 9);
+		READ_ONCE(ctxt->write_window.sectors));
 
 	move_ctxt_wait_event(ctxt, trans,
 		atomic_read(&ctxt->read_sectors) <
-		c->opts.move_bytes_in_flight >> 9);
+		READ_ONCE(ctxt->read_window.sectors));
 
 	return 0;
 }
@@ -414,28 +766,24 @@ static int move_get_io_opts(struct btree_trans *trans,
 			    struct bch_io_opts *io_opts,
 			    struct bkey_s_c k, u64 *cur_inum)
 {
-	struct bch_inode_unpacked inode;
 	int ret;
 
 	if (*cur_inum == k.k->p.inode)
 		return 0;
 
-	*io_opts = bch2_opts_to_inode_opts(trans->c->opts);
-
-	ret = lookup_inode(trans,
-			   SPOS(0, k.k->p.inode, k.k->p.snapshot),
-			   &inode);
+	ret = bch2_inode_opts_get_cached(trans, k.k->p.inode,
+					 k.k->p.snapshot, io_opts);
 	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 		return ret;
 
-	if (!ret)
-		bch2_io_opts_apply(io_opts, bch2_inode_opts_get(&inode));
+	if (ret)
+		*io_opts = bch2_opts_to_inode_opts(trans->c->opts);
 
 	*cur_inum = k.k->p.inode;
 	return 0;
 }
 
-static int __bch2_move_data(struct moving_context *ctxt,
+int __bch2_move_data(struct moving_context *ctxt,
 			    struct bpos start,
 			    struct bpos end,
 			    move_pred_fn pred, void *arg,
@@ -448,10 +796,12 @@ static int __bch2_move_data(struct moving_context *ctxt,
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct data_update_opts data_opts;
+	struct move_coalesce co;
 	u64 cur_inum = U64_MAX;
 	int ret = 0, ret2;
 
 	bch2_bkey_buf_init(&sk);
+	move_coalesce_init(&co);
 	bch2_trans_init(&trans, c, 0, 0);
 
 	ctxt->stats->data_type	= BCH_DATA_user;
@@ -460,6 +810,7 @@ static int __bch2_move_data(struct moving_context *ctxt,
 
 	bch2_trans_iter_init(&trans, &iter, btree_id, start,
 			     BTREE_ITER_PREFETCH|
+			     BTREE_ITER_COLD|
 			     BTREE_ITER_ALL_SNAPSHOTS);
 
 	if (ctxt->rate)
@@ -483,6 +834,19 @@ static int __bch2_move_data(struct moving_context *ctxt,
 
 		ctxt->stats->pos = iter.pos;
 
+		if (ctxt->checkpoint &&
+		    time_after_eq(jiffies, ctxt->checkpoint_next)) {
+			move_coalesce_flush(&trans, &iter, ctxt, btree_id,
+					    &co, pred, arg);
+			bch2_trans_unlock(&trans);
+			move_ctxt_wait_event(ctxt, NULL, list_empty(&ctxt->reads));
+			closure_sync(&ctxt->cl);
+
+			ctxt->checkpoint(ctxt, btree_id, iter.pos);
+			ctxt->checkpoint_next = jiffies + MOVE_CHECKPOINT_INTERVAL;
+			continue;
+		}
+
 		if (!bkey_extent_is_direct_data(k.k))
 			goto next_nondata;
 
@@ -501,6 +865,17 @@ static int __bch2_move_data(struct moving_context *ctxt,
 		bch2_bkey_buf_reassemble(&sk, c, k);
 		k = bkey_i_to_s_c(sk.k);
 
+		if (move_extent_can_coalesce(ctxt, btree_id, k, data_opts)) {
+			if (!move_coalesce_contiguous(c, &co, k))
+				move_coalesce_flush(&trans, &iter, ctxt, btree_id,
+						    &co, pred, arg);
+
+			if (!move_coalesce_push(&co, k, &io_opts, &data_opts))
+				goto moved;
+		}
+
+		move_coalesce_flush(&trans, &iter, ctxt, btree_id, &co, pred, arg);
+
 		ret2 = bch2_move_extent(&trans, &iter, ctxt, io_opts,
 					btree_id, k, data_opts);
 		if (ret2) {
@@ -516,15 +891,17 @@ static int __bch2_move_data(struct moving_context *ctxt,
 			/* XXX signal failure */
 			goto next;
 		}
-
-		if (ctxt->rate)
-			bch2_ratelimit_increment(ctxt->rate, k.k->size);
+moved:
+		move_ratelimit_increment(ctxt, k.k->size);
 next:
 		atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
 next_nondata:
 		bch2_btree_iter_advance(&iter);
 	}
 
+	move_coalesce_flush(&trans, &iter, ctxt, btree_id, &co, pred, arg);
+	move_coalesce_exit(&co);
+
 	bch2_trans_iter_exit(&trans, &iter);
 	bch2_trans_exit(&trans);
 	bch2_bkey_buf_exit(&sk, c);
@@ -532,31 +909,24 @@ next_nondata:
 	return ret;
 }
 
-int bch2_move_data(struct bch_fs *c,
-		   enum btree_id start_btree_id, struct bpos start_pos,
-		   enum btree_id end_btree_id,   struct bpos end_pos,
-		   struct bch_ratelimit *rate,
-		   struct bch_move_stats *stats,
-		   struct write_point_specifier wp,
-		   bool wait_on_copygc,
-		   move_pred_fn pred, void *arg)
+static int move_data_btrees(struct moving_context *ctxt,
+			    enum btree_id start_btree_id, struct bpos start_pos,
+			    enum btree_id end_btree_id,   struct bpos end_pos,
+			    move_pred_fn pred, void *arg)
 {
-	struct moving_context ctxt;
 	enum btree_id id;
-	int ret;
-
-	bch2_moving_ctxt_init(&ctxt, c, rate, stats, wp, wait_on_copygc);
+	int ret = 0;
 
 	for (id = start_btree_id;
 	     id <= min_t(unsigned, end_btree_id, BTREE_ID_NR - 1);
 	     id++) {
-		stats->btree_id = id;
+		ctxt->stats->btree_id = id;
 
 		if (id != BTREE_ID_extents &&
 		    id != BTREE_ID_reflink)
 			continue;
 
-		ret = __bch2_move_data(&ctxt,
+		ret = __bch2_move_data(ctxt,
 				       id == start_btree_id ? start_pos : POS_MIN,
 				       id == end_btree_id   ? end_pos   : POS_MAX,
 				       pred, arg, id);
@@ -564,6 +934,25 @@ int bch2_move_data(struct bch_fs *c,
 			break;
 	}
 
+	return ret;
+}
+
+int bch2_move_data(struct bch_fs *c,
+		   enum btree_id start_btree_id, struct bpos start_pos,
+		   enum btree_id end_btree_id,   struct bpos end_pos,
+		   struct bch_ratelimit *rate,
+		   struct bch_move_stats *stats,
+		   struct write_point_specifier wp,
+		   bool wait_on_copygc,
+		   enum bch_io_class io_class,
+		   move_pred_fn pred, void *arg)
+{
+	struct moving_context ctxt;
+	int ret;
+
+	bch2_moving_ctxt_init(&ctxt, c, rate, stats, wp, wait_on_copygc, io_class);
+	ret = move_data_btrees(&ctxt, start_btree_id, start_pos,
+			       end_btree_id, end_pos, pred, arg);
 	bch2_moving_ctxt_exit(&ctxt);
 
 	return ret;
@@ -684,8 +1073,7 @@ int __bch2_evacuate_bucket(struct moving_context *ctxt,
 			if (ret)
 				goto err;
 
-			if (ctxt->rate)
-				bch2_ratelimit_increment(ctxt->rate, k.k->size);
+			move_ratelimit_increment(ctxt, k.k->size);
 			atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
 		} else {
 			struct btree *b;
@@ -710,9 +1098,7 @@ int __bch2_evacuate_bucket(struct moving_context *ctxt,
 			if (ret)
 				goto err;
 
-			if (ctxt->rate)
-				bch2_ratelimit_increment(ctxt->rate,
-							 c->opts.btree_node_size >> 9);
+			move_ratelimit_increment(ctxt, c->opts.btree_node_size >> 9);
 			atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_seen);
 			atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_moved);
 		}
@@ -739,18 +1125,104 @@ int bch2_evacuate_bucket(struct bch_fs *c,
 			 struct bch_ratelimit *rate,
 			 struct bch_move_stats *stats,
 			 struct write_point_specifier wp,
-			 bool wait_on_copygc)
+			 bool wait_on_copygc,
+			 enum bch_io_class io_class)
 {
 	struct moving_context ctxt;
 	int ret;
 
-	bch2_moving_ctxt_init(&ctxt, c, rate, stats, wp, wait_on_copygc);
+	bch2_moving_ctxt_init(&ctxt, c, rate, stats, wp, wait_on_copygc, io_class);
 	ret = __bch2_evacuate_bucket(&ctxt, bucket, gen, data_opts);
 	bch2_moving_ctxt_exit(&ctxt);
 
 	return ret;
 }
 
+/*
+ * Find the next bucket in [*bucket, end) that still has data on it, returning
+ * 1 if there is one:
+ */
+static int next_nonempty_bucket(struct btree_trans *trans,
+				struct bpos *bucket, struct bpos end, int *gen)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_alloc_v4 a;
+	int ret;
+
+	for_each_btree_key_norestart(trans, iter, BTREE_ID_alloc, *bucket,
+				     BTREE_ITER_PREFETCH, k, ret) {
+		if (bkey_cmp(k.k->p, end) >= 0)
+			break;
+
+		bch2_alloc_to_v4(k, &a);
+		if (data_type_is_empty(a.data_type))
+			continue;
+
+		if (a.data_type == BCH_DATA_sb ||
+		    a.data_type == BCH_DATA_journal ||
+		    a.stripe) {
+			ret = -EBUSY;
+			break;
+		}
+
+		*bucket	= k.k->p;
+		*gen	= a.gen;
+		ret = 1;
+		break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+/*
+ * Evacuate every bucket in [start, end) on @ca, walking the alloc btree so that
+ * only buckets that actually have data are looked at; the caller is
+ * responsible for making sure nothing new is allocated in that range.
+ *
+ * Returns -EBUSY if a bucket in the range can't be moved (superblock, journal
+ * or erasure coded buckets).
+ */
+int bch2_evacuate_bucket_range(struct bch_fs *c, struct bch_dev *ca,
+			       u64 start, u64 end,
+			       struct bch_move_stats *stats)
+{
+	struct moving_context ctxt;
+	struct btree_trans trans;
+	struct bpos bucket = POS(ca->dev_idx, start);
+	struct bpos end_pos = POS(ca->dev_idx, end);
+	struct data_update_opts data_opts = {
+		.btree_insert_flags = BTREE_INSERT_USE_RESERVE,
+	};
+	int gen, ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_ptr(&c->rebalance_write_point),
+			      false, BCH_IO_CLASS_rebalance);
+
+	while (!kthread_should_stop()) {
+		ret = lockrestart_do(&trans,
+			next_nonempty_bucket(&trans, &bucket, end_pos, &gen));
+		if (ret <= 0)
+			break;
+
+		bch2_trans_unlock(&trans);
+
+		ret = __bch2_evacuate_bucket(&ctxt, bucket, gen, data_opts);
+		if (ret)
+			break;
+
+		bucket.offset++;
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_trans_exit(&trans);
+
+	return ret;
+}
+
 typedef bool (*move_btree_pred)(struct bch_fs *, void *,
 				struct btree *, struct bch_io_opts *,
 				struct data_update_opts *);
@@ -759,7 +1231,8 @@ static int bch2_move_btree(struct bch_fs *c,
 			   enum btree_id start_btree_id, struct bpos start_pos,
 			   enum btree_id end_btree_id,   struct bpos end_pos,
 			   move_btree_pred pred, void *arg,
-			   struct bch_move_stats *stats)
+			   struct bch_move_stats *stats,
+			   struct data_job_limits *limits)
 {
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
 	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
@@ -799,11 +1272,26 @@ retry:
 			if (!pred(c, arg, b, &io_opts, &data_opts))
 				goto next;
 
+			if (limits) {
+				u64 delay = data_job_limits_delay(limits);
+
+				if (delay) {
+					bch2_trans_unlock(&trans);
+					set_current_state(TASK_INTERRUPTIBLE);
+					schedule_timeout(delay);
+					continue;
+				}
+			}
+
 			ret = bch2_btree_node_rewrite(&trans, &iter, b, 0) ?: ret;
 			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 				continue;
 			if (ret)
 				break;
+
+			if (limits)
+				data_job_limits_increment(limits,
+						c->opts.btree_node_size >> 9);
 next:
 			bch2_btree_iter_next_node(&iter);
 		}
@@ -886,30 +1374,6 @@ static bool migrate_btree_pred(struct bch_fs *c, void *arg,
 	return migrate_pred(c, arg, bkey_i_to_s_c(&b->key), io_opts, data_opts);
 }
 
-static bool bformat_needs_redo(struct bkey_format *f)
-{
-	unsigned i;
-
-	for (i = 0; i < f->nr_fields; i++) {
-		unsigned unpacked_bits = bch2_bkey_format_current.bits_per_field[i];
-		u64 unpacked_mask = ~((~0ULL << 1) << (unpacked_bits - 1));
-		u64 field_offset = le64_to_cpu(f->field_offset[i]);
-
-		if (f->bits_per_field[i] > unpacked_bits)
-			return true;
-
-		if ((f->bits_per_field[i] == unpacked_bits) && field_offset)
-			return true;
-
-		if (((field_offset + ((1ULL << f->bits_per_field[i]) - 1)) &
-		     unpacked_mask) <
-		    field_offset)
-			return true;
-	}
-
-	return false;
-}
-
 static bool rewrite_old_nodes_pred(struct bch_fs *c, void *arg,
 				   struct btree *b,
 				   struct bch_io_opts *io_opts,
@@ -917,7 +1381,7 @@ static bool rewrite_old_nodes_pred(struct bch_fs *c, void *arg,
 {
 	if (b->version_ondisk != c->sb.version ||
 	    btree_node_need_rewrite(b) ||
-	    bformat_needs_redo(&b->format)) {
+	    bch2_bkey_format_needs_redo(&b->format)) {
 		data_opts->target		= 0;
 		data_opts->extra_replicas	= 0;
 		data_opts->btree_insert_flags	= 0;
@@ -927,14 +1391,16 @@ static bool rewrite_old_nodes_pred(struct bch_fs *c, void *arg,
 	return false;
 }
 
-int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
+static int __bch2_scan_old_btree_nodes(struct bch_fs *c,
+				       struct bch_move_stats *stats,
+				       struct data_job_limits *limits)
 {
 	int ret;
 
 	ret = bch2_move_btree(c,
 			      0,		POS_MIN,
 			      BTREE_ID_NR,	SPOS_MAX,
-			      rewrite_old_nodes_pred, c, stats);
+			      rewrite_old_nodes_pred, c, stats, limits);
 	if (!ret) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_extents_above_btree_updates_done);
@@ -947,14 +1413,1153 @@ int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
 	return ret;
 }
 
+int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
+{
+	return __bch2_scan_old_btree_nodes(c, stats, NULL);
+}
+
+static bool defrag_pred(struct bch_fs *c, void *arg,
+			struct bkey_s_c k,
+			struct bch_io_opts *io_opts,
+			struct data_update_opts *data_opts)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+	unsigned i = 0;
+
+	data_opts->rewrite_ptrs		= 0;
+	data_opts->target		= io_opts->background_target;
+	data_opts->extra_replicas	= 0;
+	data_opts->btree_insert_flags	= 0;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (!ptr->cached)
+			data_opts->rewrite_ptrs |= 1U << i;
+		i++;
+	}
+
+	return data_opts->rewrite_ptrs != 0;
+}
+
+struct defrag_inode {
+	u64			inum;
+	u64			extents;
+	u64			sectors;
+	u64			buckets;
+	u64			min_buckets;
+};
+
+/*
+ * Count extents and bucket transitions of the next inode at or after @inum
+ * that has any data:
+ */
+static int defrag_inode_scan(struct btree_trans *trans, u64 inum, u64 end,
+			     struct defrag_inode *s)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bpos last_bucket = POS_MAX;
+	unsigned bucket_size = 0;
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	s->inum = U64_MAX;
+
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_extents,
+				POS(inum, 0), POS(end, U64_MAX),
+				BTREE_ITER_ALL_SNAPSHOTS|
+				BTREE_ITER_PREFETCH, k, ret) {
+		struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+		const struct bch_extent_ptr *ptr;
+
+		if (s->inum == U64_MAX)
+			s->inum = k.k->p.inode;
+		if (k.k->p.inode != s->inum)
+			break;
+
+		if (!bkey_extent_is_direct_data(k.k))
+			continue;
+
+		s->extents++;
+		s->sectors += k.k->size;
+
+		bkey_for_each_ptr(ptrs, ptr) {
+			struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+			struct bpos bucket = PTR_BUCKET_POS(c, ptr);
+
+			if (ptr->cached)
+				continue;
+
+			if (bpos_cmp(bucket, last_bucket))
+				s->buckets++;
+			last_bucket = bucket;
+			bucket_size = ca->mi.bucket_size;
+			break;
+		}
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (bucket_size)
+		s->min_buckets = DIV_ROUND_UP(s->sectors, bucket_size);
+	return ret;
+}
+
+static bool defrag_inode_fragmented(struct defrag_inode *s,
+				    struct bch_ioctl_data *op)
+{
+	unsigned min_extent	= op->defrag.min_extent_sectors ?: 128;
+	unsigned bucket_ratio	= op->defrag.max_bucket_ratio ?: 2;
+
+	if (s->extents <= 1)
+		return false;
+
+	return div64_u64(s->sectors, s->extents) < min_extent ||
+		s->buckets > s->min_buckets * bucket_ratio;
+}
+
+/*
+ * Rewrite files that are made up of small extents, or are spread over many
+ * more buckets than they need, so that they're contiguous again: the whole
+ * file goes through one writepoint, and runs of small extents are coalesced.
+ */
+static int bch2_defrag(struct bch_fs *c, struct bch_move_stats *stats,
+		       struct bch_ioctl_data op,
+		       struct data_job_limits *limits,
+		       enum bch_io_class io_class)
+{
+	struct moving_context ctxt;
+	struct btree_trans trans;
+	struct defrag_inode s;
+	u64 inum = op.start_pos.inode;
+	int ret = 0;
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      true, io_class);
+	ctxt.limits	= limits;
+	ctxt.coalesce	= true;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	while (inum <= op.end_pos.inode &&
+	       !kthread_should_stop()) {
+		ret = lockrestart_do(&trans,
+				defrag_inode_scan(&trans, inum, op.end_pos.inode, &s));
+		bch2_trans_unlock(&trans);
+		if (ret || s.inum == U64_MAX)
+			break;
+
+		stats->pos = POS(s.inum, 0);
+
+		if (defrag_inode_fragmented(&s, &op)) {
+			ret = __bch2_move_data(&ctxt, POS(s.inum, 0),
+					       POS(s.inum, U64_MAX),
+					       defrag_pred, NULL,
+					       BTREE_ID_extents);
+			if (ret)
+				break;
+		} else {
+			atomic64_add(s.sectors, &stats->sectors_seen);
+		}
+
+		if (s.inum == U64_MAX - 1)
+			break;
+		inum = s.inum + 1;
+	}
+
+	bch2_trans_exit(&trans);
+	bch2_moving_ctxt_exit(&ctxt);
+	return ret;
+}
+
+/* scrub: */
+
+/*
+ * Scrub walks buckets in physical order, and for each bucket reads the extents
+ * its backpointers point to, straight from the device, verifying checksums.
+ * Reads are batched, up to SCRUB_BATCH_IOS or SCRUB_BATCH_SECTORS in flight,
+ * and checksums are verified on system_unbound_wq as reads complete, so that
+ * checksumming a batch runs in parallel. Bad copies are rewritten from a good
+ * replica or reconstructed from erasure coding by the move path, which avoids
+ * the device that returned bad data; bad cached copies are just dropped.
+ */
+#define SCRUB_BATCH_IOS		64
+#define SCRUB_BATCH_SECTORS	(8U << 11)
+
+struct scrub_io {
+	struct work_struct	work;
+	struct closure		*cl;
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+
+	struct bpos		bucket;
+	u64			bp_offset;
+	struct bch_backpointer	bp;
+	struct bkey_buf		k;
+	struct extent_ptr_decoded p;
+	unsigned		ptr_idx;
+
+	void			*buf;
+	struct bio		*bio;
+	bool			read_err;
+	bool			csum_err;
+};
+
+struct scrub_batch {
+	struct closure		cl;
+	unsigned		nr;
+	unsigned		sectors;
+	struct scrub_io		io[SCRUB_BATCH_IOS];
+};
+
+static void scrub_io_verify(struct work_struct *work)
+{
+	struct scrub_io *io = container_of(work, struct scrub_io, work);
+	struct bch_extent_crc_unpacked crc = io->p.crc;
+	struct bch_csum csum;
+
+	/* If the bucket was reused while we were reading, the data's gone: */
+	if (!io->read_err &&
+	    crc.csum_type &&
+	    !ptr_stale(io->ca, &io->p.ptr)) {
+		csum = bch2_checksum(io->c, crc.csum_type,
+				     extent_nonce(io->k.k->k.version, crc),
+				     io->buf, crc.compressed_size << 9);
+		io->csum_err = bch2_crc_cmp(csum, crc.csum);
+	}
+
+	closure_put(io->cl);
+}
+
+static void scrub_io_endio(struct bio *bio)
+{
+	struct scrub_io *io = bio->bi_private;
+
+	io->read_err = bch2_dev_io_err_on(bio->bi_status, io->ca,
+					  "scrub read error: %s",
+					  bch2_blk_status_to_str(bio->bi_status));
+	percpu_ref_put(&io->ca->io_ref);
+
+	INIT_WORK(&io->work, scrub_io_verify);
+	queue_work(system_unbound_wq, &io->work);
+}
+
+static void scrub_io_free(struct scrub_io *io)
+{
+	kvpfree(io->buf, io->p.crc.compressed_size << 9);
+	kfree(io->bio);
+	io->buf = NULL;
+	io->bio = NULL;
+}
+
+static int scrub_io_submit(struct scrub_batch *batch, struct scrub_io *io)
+{
+	unsigned bytes = io->p.crc.compressed_size << 9;
+	unsigned nr_bvecs;
+
+	io->read_err	= false;
+	io->csum_err	= false;
+	io->cl		= &batch->cl;
+
+	io->buf = kvpmalloc(bytes, GFP_KERNEL);
+	if (!io->buf)
+		return -ENOMEM;
+
+	nr_bvecs = buf_pages(io->buf, bytes);
+	io->bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+	if (!io->bio) {
+		scrub_io_free(io);
+		return -ENOMEM;
+	}
+
+	if (!percpu_ref_tryget(&io->ca->io_ref)) {
+		scrub_io_free(io);
+		return -EROFS;
+	}
+
+	bio_init(io->bio, io->ca->disk_sb.bdev, io->bio->bi_inline_vecs,
+		 nr_bvecs, REQ_OP_READ);
+	io->bio->bi_iter.bi_sector	= io->p.ptr.offset;
+	io->bio->bi_end_io		= scrub_io_endio;
+	io->bio->bi_private		= io;
+	bch2_bio_map(io->bio, io->buf, bytes);
+
+	this_cpu_add(io->ca->io_done->sectors[READ][BCH_DATA_user],
+		     io->p.crc.compressed_size);
+
+	closure_get(&batch->cl);
+	submit_bio(io->bio);
+
+	batch->nr++;
+	batch->sectors += io->p.crc.compressed_size;
+	return 0;
+}
+
+static bool scrub_find_ptr(struct bch_fs *c, struct bkey_s_c k,
+			   struct bpos bucket, struct scrub_io *io)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	unsigned i = 0;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (p.ptr.dev == bucket.inode &&
+		    PTR_BUCKET_NR(io->ca, &p.ptr) == bucket.offset) {
+			io->p		= p;
+			io->ptr_idx	= i;
+			return true;
+		}
+		i++;
+	}
+
+	return false;
+}
+
+/* Is there anything other than the bad copy we can read this extent from? */
+static bool scrub_have_good_copy(struct scrub_io *io)
+{
+	struct bkey_s_c k = bkey_i_to_s_c(io->k.k);
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+	unsigned i = 0;
+
+	if (io->p.has_ec)
+		return true;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		if (i++ != io->ptr_idx &&
+		    !ptr_stale(bch_dev_bkey_exists(io->c, ptr->dev), ptr))
+			return true;
+
+	return false;
+}
+
+static bool scrub_key_unchanged(struct bkey_s_c old, struct bkey_s_c new)
+{
+	return  !bpos_cmp(old.k->p, new.k->p) &&
+		old.k->size == new.k->size &&
+		bkey_val_bytes(old.k) == bkey_val_bytes(new.k) &&
+		!memcmp(old.v, new.v, bkey_val_bytes(old.k));
+}
+
+static int __scrub_repair(struct btree_trans *trans,
+			  struct moving_context *ctxt,
+			  struct scrub_io *io,
+			  struct data_update_opts data_opts)
+{
+	struct bkey_s_c old = bkey_i_to_s_c(io->k.k);
+	struct bch_io_failures failed = { .nr = 0 };
+	struct bch_io_opts io_opts;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 cur_inum = U64_MAX;
+	int ret;
+
+	k = bch2_backpointer_get_key(trans, &iter, io->bucket,
+				     io->bp_offset, io->bp);
+	ret = bkey_err(k);
+	if (ret || !k.k)
+		return ret;
+
+	/* Overwritten or moved since we read it, nothing to repair: */
+	if (!scrub_key_unchanged(old, k))
+		goto out;
+
+	/* Don't read the new copy from the one we just found bad: */
+	bch2_mark_io_failure(&failed, &io->p);
+
+	ret =   move_get_io_opts(trans, &io_opts, k, &cur_inum) ?:
+		__bch2_move_extent(trans, &iter, ctxt, io_opts,
+				   io->bp.btree_id, k, data_opts, &failed);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static void scrub_repair(struct btree_trans *trans,
+			 struct moving_context *ctxt,
+			 struct scrub_io *io)
+{
+	struct bch_fs *c = trans->c;
+	struct data_update_opts data_opts = { 0 };
+	struct printbuf buf = PRINTBUF;
+	int ret;
+
+	this_cpu_inc(c->counters[BCH_COUNTER_scrub_error]);
+
+	bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(io->k.k));
+
+	if (io->csum_err)
+		bch2_dev_inum_io_error(io->ca, io->k.k->k.p.inode,
+				       bkey_start_offset(&io->k.k->k),
+				       "scrub: data checksum error at sector %llu, %s",
+				       (u64) io->p.ptr.offset, buf.buf);
+
+	if (io->p.ptr.cached) {
+		data_opts.kill_ptrs	= 1U << io->ptr_idx;
+	} else if (scrub_have_good_copy(io)) {
+		data_opts.rewrite_ptrs	= 1U << io->ptr_idx;
+	} else {
+		bch_err_ratelimited(c, "scrub: no good copy to repair %s from", buf.buf);
+		goto out;
+	}
+
+	do {
+		bch2_trans_begin(trans);
+		ret = __scrub_repair(trans, ctxt, io, data_opts);
+		if (ret == -ENOMEM) {
+			/* memory allocation failure, wait for some IO to finish */
+			bch2_move_ctxt_wait_for_io(ctxt, trans);
+			ret = -BCH_ERR_transaction_restart;
+		}
+	} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+
+	if (ret)
+		bch_err_ratelimited(c, "scrub: error %s repairing %s",
+				    bch2_err_str(ret), buf.buf);
+	else
+		this_cpu_inc(c->counters[BCH_COUNTER_scrub_repaired]);
+out:
+	printbuf_exit(&buf);
+}
+
+/* Wait for the batch to complete, and repair anything that came back bad: */
+static void scrub_batch_finish(struct btree_trans *trans,
+			       struct moving_context *ctxt,
+			       struct scrub_batch *batch)
+{
+	struct scrub_io *io;
+
+	bch2_trans_unlock(trans);
+	closure_sync(&batch->cl);
+
+	for (io = batch->io; io < batch->io + batch->nr; io++) {
+		scrub_io_free(io);
+
+		if (io->read_err || io->csum_err)
+			scrub_repair(trans, ctxt, io);
+	}
+
+	batch->nr	= 0;
+	batch->sectors	= 0;
+}
+
+static int scrub_bucket(struct btree_trans *trans,
+			struct moving_context *ctxt,
+			struct scrub_batch *batch,
+			struct bpos bucket, int gen)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_dev *ca = bch_dev_bkey_exists(c, bucket.inode);
+	struct btree_iter iter;
+	struct bch_backpointer bp;
+	u64 bp_offset = 0;
+	int ret;
+
+	while (!(ret = move_ratelimit(trans, ctxt))) {
+		struct scrub_io *io;
+		struct bkey_s_c k;
+
+		if (batch->nr == SCRUB_BATCH_IOS ||
+		    batch->sectors >= SCRUB_BATCH_SECTORS)
+			scrub_batch_finish(trans, ctxt, batch);
+		io = &batch->io[batch->nr];
+
+		bch2_trans_begin(trans);
+
+		ret = bch2_get_next_backpointer(trans, bucket, gen,
+						&bp_offset, &bp);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret || bp_offset == U64_MAX)
+			break;
+
+		/* btree nodes are checksummed every time they're read: */
+		if (bp.level)
+			goto next;
+
+		k = bch2_backpointer_get_key(trans, &iter, bucket, bp_offset, bp);
+		ret = bkey_err(k);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret)
+			break;
+		if (!k.k)
+			goto next;
+
+		io->c		= c;
+		io->ca		= ca;
+		io->bucket	= bucket;
+		io->bp_offset	= bp_offset;
+		io->bp		= bp;
+		bch2_bkey_buf_reassemble(&io->k, c, k);
+		bch2_trans_iter_exit(trans, &iter);
+
+		if (!scrub_find_ptr(c, bkey_i_to_s_c(io->k.k), bucket, io))
+			goto next;
+
+		ret = scrub_io_submit(batch, io);
+		if (ret == -EROFS) {
+			ret = 0;
+			break;
+		}
+		if (ret)
+			break;
+
+		bch2_io_sched_charge(c, ctxt->io_class, io->p.crc.compressed_size);
+		move_ratelimit_increment(ctxt, io->p.crc.compressed_size);
+		atomic64_add(io->p.crc.compressed_size, &ctxt->stats->sectors_seen);
+next:
+		bp_offset++;
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Find the next bucket in [*bucket, end) with user data in it, returning 1 if
+ * there is one; parity is checked by bch2_ec_scrub():
+ */
+static int scrub_next_bucket(struct btree_trans *trans,
+			     struct bpos *bucket, struct bpos end, int *gen)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_alloc_v4 a;
+	int ret;
+
+	for_each_btree_key_norestart(trans, iter, BTREE_ID_alloc, *bucket,
+				     BTREE_ITER_PREFETCH, k, ret) {
+		if (bkey_cmp(k.k->p, end) >= 0)
+			break;
+
+		bch2_alloc_to_v4(k, &a);
+		if (a.data_type != BCH_DATA_user &&
+		    a.data_type != BCH_DATA_cached)
+			continue;
+
+		*bucket	= k.k->p;
+		*gen	= a.gen;
+		ret = 1;
+		break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+/*
+ * Scrub user data in buckets [start_pos, end_pos). A scrub of the whole
+ * filesystem checkpoints its position in the superblock every
+ * MOVE_CHECKPOINT_INTERVAL, and resumes from there unless
+ * BCH_DATA_SCRUB_RESTART is passed:
+ */
+static int bch2_scrub_data(struct bch_fs *c,
+			   struct bch_move_stats *stats,
+			   struct bch_ioctl_data *op,
+			   struct data_job_limits *limits,
+			   enum bch_io_class io_class)
+{
+	bool whole_fs = !bpos_cmp(op->start_pos, POS_MIN) &&
+			!bpos_cmp(op->end_pos, POS_MAX);
+	unsigned long checkpoint_next = jiffies + MOVE_CHECKPOINT_INTERVAL;
+	struct bpos bucket = op->start_pos;
+	struct moving_context ctxt;
+	struct btree_trans trans;
+	struct scrub_batch *batch;
+	struct scrub_io *io;
+	int gen, ret = 0;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (io = batch->io; io < batch->io + SCRUB_BATCH_IOS; io++)
+		bch2_bkey_buf_init(&io->k);
+	closure_init_stack(&batch->cl);
+
+	if (whole_fs && !(op->flags & BCH_DATA_SCRUB_RESTART)) {
+		bucket = bch2_scrub_cursor_get(c);
+		if (bpos_cmp(bucket, POS_MIN))
+			bch_info(c, "resuming scrub at device %llu bucket %llu",
+				 bucket.inode, bucket.offset);
+	}
+
+	stats->data_type	= BCH_DATA_user;
+	stats->btree_id		= BTREE_ID_alloc;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      true, io_class);
+	ctxt.limits = limits;
+
+	if (whole_fs)
+		bch2_scrub_cursor_set(c, bucket);
+
+	while (!kthread_should_stop()) {
+		ret = lockrestart_do(&trans,
+			scrub_next_bucket(&trans, &bucket, op->end_pos, &gen));
+		if (ret <= 0)
+			break;
+
+		stats->pos = bucket;
+
+		ret = scrub_bucket(&trans, &ctxt, batch, bucket, gen);
+		if (ret)
+			break;
+
+		bucket.offset++;
+
+		if (whole_fs &&
+		    time_after_eq(jiffies, checkpoint_next)) {
+			/* every bucket before @bucket has been checked: */
+			scrub_batch_finish(&trans, &ctxt, batch);
+			bch2_scrub_cursor_set(c, bucket);
+			checkpoint_next = jiffies + MOVE_CHECKPOINT_INTERVAL;
+		}
+	}
+
+	scrub_batch_finish(&trans, &ctxt, batch);
+
+	if (whole_fs) {
+		if (kthread_should_stop())
+			bch2_scrub_cursor_set(c, bucket);
+		else if (!ret)
+			bch2_scrub_cursor_clear(c);
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_trans_exit(&trans);
+
+	for (io = batch->io; io < batch->io + SCRUB_BATCH_IOS; io++)
+		bch2_bkey_buf_exit(&io->k, c);
+	kfree(batch);
+	return ret;
+}
+
+/* dedupe: */
+
+/*
+ * Extents are indexed by content hash - their checksum, or for extents without
+ * one an xxh3_128 of their data - in passes of as many extents as fit in a
+ * quarter of free memory, up to DEDUPE_INDEX_MAX. The index is sorted, and within each run of extents with the same hash the
+ * contents are compared before the duplicates are turned into reflink
+ * pointers to the first.
+ *
+ * Only whole extents, exactly covered by their checksum and no bigger than
+ * encoded_extent_max, are candidates: then the same data has the same encoded
+ * form and checksum. Encrypted extents never match, nor do duplicates found in
+ * different passes.
+ */
+#define DEDUPE_INDEX_MAX	(1U << 22)
+#define DEDUPE_INDEX_MIN	(1U << 12)
+
+struct dedupe_entry {
+	bool			dead;
+	u8			csum_type;
+	u8			compression_type;
+	u32			size;
+	u32			compressed_size;
+	struct bch_csum		csum;
+	struct bpos		pos;
+};
+
+struct dedupe_scan {
+	struct dedupe_entry	*idx;
+	size_t			nr;
+	size_t			nr_max;
+	unsigned		min_sectors;
+	unsigned		max_sectors;
+	bool			more;
+	struct bpos		next;
+};
+
+static bool dedupe_crc_eq(struct bch_extent_crc_unpacked l,
+			  struct bch_extent_crc_unpacked r)
+{
+	return  l.compressed_size	== r.compressed_size &&
+		l.uncompressed_size	== r.uncompressed_size &&
+		l.live_size		== r.live_size &&
+		l.csum_type		== r.csum_type &&
+		l.compression_type	== r.compression_type &&
+		l.offset		== r.offset &&
+		!bch2_crc_cmp(l.csum, r.csum);
+}
+
+static bool dedupe_entry_init(struct bkey_s_c k,
+			      unsigned min_sectors, unsigned max_sectors,
+			      struct dedupe_entry *e)
+{
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	struct bch_extent_crc_unpacked crc;
+	bool have_ptr = false;
+
+	if (k.k->type != KEY_TYPE_extent ||
+	    k.k->size < min_sectors)
+		return false;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (have_ptr && !dedupe_crc_eq(crc, p.crc))
+			return false;
+		crc = p.crc;
+		have_ptr = true;
+	}
+
+	if (!have_ptr ||
+	    crc.offset ||
+	    crc.live_size != k.k->size ||
+	    crc.uncompressed_size != k.k->size ||
+	    crc.compressed_size > max_sectors ||
+	    bch2_csum_type_is_encryption(crc.csum_type))
+		return false;
+
+	memset(e, 0, sizeof(*e));
+	e->csum_type		= crc.csum_type;
+	e->compression_type	= crc.compression_type;
+	e->size			= k.k->size;
+	e->compressed_size	= crc.compressed_size;
+	e->csum			= crc.csum;
+	e->pos			= k.k->p;
+	return true;
+}
+
+static int dedupe_entry_content_cmp(const struct dedupe_entry *l,
+				    const struct dedupe_entry *r)
+{
+	return  cmp_int(l->dead,		r->dead) ?:
+		cmp_int(l->csum_type,		r->csum_type) ?:
+		cmp_int(l->compression_type,	r->compression_type) ?:
+		cmp_int(l->size,		r->size) ?:
+		cmp_int(l->compressed_size,	r->compressed_size) ?:
+		cmp_int(l->csum.hi,		r->csum.hi) ?:
+		cmp_int(l->csum.lo,		r->csum.lo);
+}
+
+static int dedupe_entry_cmp(const void *_l, const void *_r)
+{
+	const struct dedupe_entry *l = _l, *r = _r;
+
+	return dedupe_entry_content_cmp(l, r) ?: bpos_cmp(l->pos, r->pos);
+}
+
+/*
+ * The index is allocated once, up front, sized by how much memory is free -
+ * not grown as we go:
+ */
+static int dedupe_index_alloc(struct dedupe_scan *s)
+{
+	struct sysinfo i;
+	u64 nr;
+
+	si_meminfo(&i);
+	nr = div_u64((u64) i.freeram * i.mem_unit / 4, sizeof(s->idx[0]));
+	nr = clamp_t(u64, nr, DEDUPE_INDEX_MIN, DEDUPE_INDEX_MAX);
+
+	for (; nr >= DEDUPE_INDEX_MIN; nr >>= 1) {
+		s->idx = kvmalloc_array(nr, sizeof(s->idx[0]), GFP_KERNEL);
+		if (s->idx) {
+			s->nr_max = nr;
+			return 0;
+		}
+	}
+
+	return -ENOMEM;
+}
+
+static void dedupe_index_sort(struct dedupe_scan *s)
+{
+	sort(s->idx, s->nr, sizeof(s->idx[0]), dedupe_entry_cmp, NULL);
+}
+
+static int dedupe_index_add(struct dedupe_scan *s, struct bkey_s_c k,
+			    struct bch_move_stats *stats)
+{
+	struct dedupe_entry e;
+
+	stats->pos = k.k->p;
+
+	if (!dedupe_entry_init(k, s->min_sectors, s->max_sectors, &e))
+		return 0;
+
+	if (s->nr == s->nr_max) {
+		s->next = bkey_start_pos(k.k);
+		s->more = true;
+		return 1;
+	}
+
+	atomic64_add(k.k->size, &stats->sectors_seen);
+	s->idx[s->nr++] = e;
+	return 0;
+}
+
+/* Look up the extent @e was made from, returning 1 if it's changed since: */
+static int dedupe_entry_get(struct btree_trans *trans, struct dedupe_entry *e,
+			    struct bkey_buf *k_buf)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct dedupe_entry cur;
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_extents,
+			     SPOS(e->pos.inode, e->pos.offset - e->size,
+				  e->pos.snapshot), 0);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto out;
+
+	if (!dedupe_entry_init(k, 0, U32_MAX, &cur) ||
+	    bpos_cmp(cur.pos, e->pos) ||
+	    cur.csum_type		!= e->csum_type ||
+	    cur.compression_type	!= e->compression_type ||
+	    cur.size			!= e->size ||
+	    cur.compressed_size		!= e->compressed_size ||
+	    (cur.csum_type && bch2_crc_cmp(cur.csum, e->csum))) {
+		ret = 1;
+		goto out;
+	}
+
+	bch2_bkey_buf_reassemble(k_buf, trans->c, k);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/* Read the encoded data of @k, from the first copy we can read: */
+static int dedupe_read(struct bch_fs *c, struct bkey_s_c k, void *buf)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	int ret = -EIO;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+		unsigned bytes = p.crc.compressed_size << 9;
+		unsigned nr_bvecs = buf_pages(buf, bytes);
+		struct bio *bio;
+
+		if (ptr_stale(ca, &p.ptr) ||
+		    !percpu_ref_tryget(&ca->io_ref))
+			continue;
+
+		bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+		if (!bio) {
+			percpu_ref_put(&ca->io_ref);
+			return -ENOMEM;
+		}
+
+		bio_init(bio, ca->disk_sb.bdev, bio->bi_inline_vecs,
+			 nr_bvecs, REQ_OP_READ);
+		bio->bi_iter.bi_sector = p.ptr.offset;
+		bch2_bio_map(bio, buf, bytes);
+
+		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_user],
+			     p.crc.compressed_size);
+
+		ret = submit_bio_wait(bio);
+		kfree(bio);
+		percpu_ref_put(&ca->io_ref);
+
+		if (!ret && !ptr_stale(ca, &p.ptr))
+			return 0;
+		ret = ret ?: -EIO;
+	}
+
+	return ret;
+}
+
+/*
+ * Hash the data of extents without checksums - only those that have the same
+ * size as some other unchecksummed extent, since nothing else can match them:
+ */
+static int dedupe_hash_unchecksummed(struct btree_trans *trans,
+				     struct moving_context *ctxt,
+				     struct dedupe_scan *s,
+				     struct bkey_buf *k, void *buf)
+{
+	struct bch_fs *c = trans->c;
+	struct dedupe_entry *e, *end = s->idx + s->nr, *run_end;
+	int ret = 0;
+
+	dedupe_index_sort(s);
+
+	for (e = s->idx; e < end; e = run_end) {
+		for (run_end = e + 1;
+		     run_end < end && !dedupe_entry_content_cmp(e, run_end);
+		     run_end++)
+			;
+
+		if (e->csum_type || run_end - e == 1)
+			continue;
+
+		for (; e < run_end; e++) {
+			ret = move_ratelimit(trans, ctxt);
+			if (ret)
+				return ret < 0 ? ret : 0;
+
+			ret = lockrestart_do(trans, dedupe_entry_get(trans, e, k));
+			if (ret < 0)
+				return ret;
+
+			bch2_trans_unlock(trans);
+
+			if (ret || dedupe_read(c, bkey_i_to_s_c(k->k), buf)) {
+				e->dead = true;
+				continue;
+			}
+
+			e->csum = bch2_checksum(c, BCH_CSUM_xxh3_128,
+						(struct nonce) {{ 0 }},
+						buf, e->compressed_size << 9);
+			move_ratelimit_increment(ctxt, e->compressed_size);
+		}
+	}
+
+	return 0;
+}
+
+/* Turn every extent in [start, end) that matches the first into a reflink pointer: */
+static int dedupe_run(struct btree_trans *trans,
+		      struct moving_context *ctxt,
+		      struct dedupe_entry *start, struct dedupe_entry *end,
+		      struct bkey_buf *src, struct bkey_buf *dst,
+		      void *src_data, void *dst_data)
+{
+	struct bch_fs *c = trans->c;
+	struct dedupe_entry *e, *src_e = NULL;
+	int ret = 0;
+
+	for (e = start; e < end; e++) {
+		ret = move_ratelimit(trans, ctxt);
+		if (ret)
+			return ret < 0 ? ret : 0;
+
+		ctxt->stats->pos = e->pos;
+
+		if (src_e && !bpos_cmp(src_e->pos, e->pos))
+			continue;
+
+		ret = lockrestart_do(trans, dedupe_entry_get(trans, e, dst));
+		if (ret < 0)
+			return ret;
+		if (ret)
+			continue;
+
+		bch2_trans_unlock(trans);
+
+		if (dedupe_read(c, bkey_i_to_s_c(dst->k),
+				src_e ? dst_data : src_data))
+			continue;
+		move_ratelimit_increment(ctxt, e->compressed_size);
+
+		if (!src_e) {
+			src_e = e;
+			bch2_bkey_buf_copy(src, c, dst->k);
+			continue;
+		}
+
+		/* hash collision: */
+		if (memcmp(src_data, dst_data, e->compressed_size << 9))
+			continue;
+
+		do {
+			bch2_trans_begin(trans);
+			ret = bch2_dedupe_extent(trans, src, dst->k);
+		} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+
+		if (ret < 0)
+			return ret;
+
+		if (ret) {
+			/* raced with a write, start over from the next extent: */
+			src_e = NULL;
+			continue;
+		}
+
+		atomic64_inc(&ctxt->stats->keys_moved);
+		atomic64_add(e->size, &ctxt->stats->sectors_moved);
+	}
+
+	return 0;
+}
+
+static int bch2_dedupe(struct bch_fs *c, struct bch_move_stats *stats,
+		       struct bch_ioctl_data op,
+		       struct data_job_limits *limits,
+		       enum bch_io_class io_class)
+{
+	struct dedupe_scan s = {
+		.min_sectors	= op.dedupe.min_extent_sectors ?: 8,
+		.max_sectors	= c->opts.encoded_extent_max >> 9,
+		.next		= POS(op.start_pos.inode, 0),
+	};
+	struct bpos end = POS(op.end_pos.inode, U64_MAX);
+	struct moving_context ctxt;
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_buf src, dst;
+	struct dedupe_entry *e, *run_end;
+	void *src_data, *dst_data;
+	int ret = 0;
+
+	stats->data_type	= BCH_DATA_user;
+	stats->btree_id		= BTREE_ID_extents;
+
+	src_data = kvpmalloc(c->opts.encoded_extent_max, GFP_KERNEL);
+	dst_data = kvpmalloc(c->opts.encoded_extent_max, GFP_KERNEL);
+	if (!src_data || !dst_data) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = dedupe_index_alloc(&s);
+	if (ret)
+		goto out;
+
+	bch2_bkey_buf_init(&src);
+	bch2_bkey_buf_init(&dst);
+	bch2_trans_init(&trans, c, 0, 0);
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      true, io_class);
+	ctxt.limits = limits;
+
+	do {
+		struct bpos start = s.next;
+
+		s.nr		= 0;
+		s.more		= false;
+
+		ret = for_each_btree_key2_upto(&trans, iter, BTREE_ID_extents,
+				start, end,
+				BTREE_ITER_ALL_SNAPSHOTS|BTREE_ITER_PREFETCH, k,
+			dedupe_index_add(&s, k, stats));
+		if (ret < 0)
+			break;
+
+		ret = dedupe_hash_unchecksummed(&trans, &ctxt, &s, &src, src_data);
+		if (ret)
+			break;
+
+		dedupe_index_sort(&s);
+
+		for (e = s.idx;
+		     e < s.idx + s.nr && !kthread_should_stop();
+		     e = run_end) {
+			for (run_end = e + 1;
+			     run_end < s.idx + s.nr &&
+			     !dedupe_entry_content_cmp(e, run_end);
+			     run_end++)
+				;
+
+			if (e->dead || run_end - e == 1)
+				continue;
+
+			ret = dedupe_run(&trans, &ctxt, e, run_end,
+					 &src, &dst, src_data, dst_data);
+			if (ret)
+				break;
+		}
+	} while (!ret && s.more && !kthread_should_stop());
+
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&dst, c);
+	bch2_bkey_buf_exit(&src, c);
+out:
+	kvfree(s.idx);
+	kvpfree(dst_data, c->opts.encoded_extent_max);
+	kvpfree(src_data, c->opts.encoded_extent_max);
+	return ret;
+}
+
+static void migrate_checkpoint(struct moving_context *ctxt,
+			       enum btree_id btree, struct bpos pos)
+{
+	struct bch_ioctl_data *op = ctxt->checkpoint_arg;
+
+	bch2_migrate_cursor_set(ctxt->c, op->migrate.dev, BBPOS(btree, pos));
+}
+
+static int data_job_move_data(struct bch_fs *c,
+			      struct bch_move_stats *stats,
+			      struct bch_ioctl_data *op,
+			      struct bbpos start,
+			      struct data_job_limits *limits,
+			      enum bch_io_class io_class,
+			      move_pred_fn pred, void *arg)
+{
+	struct moving_context ctxt;
+	int ret;
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      true, io_class);
+	ctxt.limits = limits;
+
+	if (op->op == BCH_DATA_OP_MIGRATE) {
+		ctxt.checkpoint		= migrate_checkpoint;
+		ctxt.checkpoint_arg	= op;
+		ctxt.checkpoint_next	= jiffies + MOVE_CHECKPOINT_INTERVAL;
+	}
+
+	ret = move_data_btrees(&ctxt,
+			       start.btree,	start.pos,
+			       op->end_btree,	op->end_pos,
+			       pred, arg);
+	bch2_moving_ctxt_exit(&ctxt);
+	return ret;
+}
+
+static const enum bch_io_class data_job_io_class[] = {
+	[BCH_DATA_JOB_PRIO_LOW]		= BCH_IO_CLASS_scrub,
+	[BCH_DATA_JOB_PRIO_NORMAL]	= BCH_IO_CLASS_rebalance,
+	[BCH_DATA_JOB_PRIO_HIGH]	= BCH_IO_CLASS_copygc,
+};
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
 {
+	struct data_job_limits limits = {
+		.sectors.rate	= op.rate_mb << 11,
+		.iops.rate	= op.rate_iops,
+	};
+	enum bch_io_class io_class;
 	int ret = 0;
 
+	if (op.priority >= BCH_DATA_JOB_PRIO_NR ||
+	    op.rate_mb > U32_MAX >> 11)
+		return -EINVAL;
+
+	io_class = data_job_io_class[op.priority];
+	bch2_ratelimit_reset(&limits.sectors);
+	bch2_ratelimit_reset(&limits.iops);
+
 	switch (op.op) {
+	case BCH_DATA_OP_SCRUB:
+		bch_move_stats_init(stats, "scrub");
+		ret = bch2_scrub_data(c, stats, &op, &limits, io_class);
+		if (!ret && !kthread_should_stop() &&
+		    !bpos_cmp(op.start_pos, POS_MIN) &&
+		    !bpos_cmp(op.end_pos, POS_MAX))
+			ret = bch2_ec_scrub(c, stats);
+		break;
 	case BCH_DATA_OP_REREPLICATE:
+		/*
+		 * Restoring redundancy isn't optional background work like
+		 * scrub - don't let a low priority job run it at scrub's rate:
+		 */
+		io_class = min_t(unsigned, io_class, BCH_IO_CLASS_rereplicate);
 		bch_move_stats_init(stats, "rereplicate");
 		stats->data_type = BCH_DATA_journal;
 		ret = bch2_journal_flush_device_pins(&c->journal, -1);
@@ -962,23 +2567,40 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c,
 				      op.start_btree,	op.start_pos,
 				      op.end_btree,	op.end_pos,
-				      rereplicate_btree_pred, c, stats) ?: ret;
+				      rereplicate_btree_pred, c, stats,
+				      &limits) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c,
-				     op.start_btree,	op.start_pos,
-				     op.end_btree,	op.end_pos,
-				     NULL,
-				     stats,
-				     writepoint_hashed((unsigned long) current),
-				     true,
-				     rereplicate_pred, c) ?: ret;
+		ret = data_job_move_data(c, stats, &op,
+					 BBPOS(op.start_btree, op.start_pos),
+					 &limits, io_class,
+					 rereplicate_pred, c) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
-	case BCH_DATA_OP_MIGRATE:
+	case BCH_DATA_OP_MIGRATE: {
+		struct bbpos start = BBPOS(op.start_btree, op.start_pos);
+		struct bbpos cursor = BBPOS_MIN;
+
 		if (op.migrate.dev >= c->sb.nr_devices)
 			return -EINVAL;
 
+		/*
+		 * Pick up where an interrupted evacuate left off; the btree
+		 * pass is cheap enough to just redo:
+		 */
+		if (!(op.flags & BCH_DATA_MIGRATE_RESTART))
+			cursor = bch2_migrate_cursor_get(c, op.migrate.dev);
+		if (bbpos_cmp(cursor, start) > 0) {
+			struct printbuf buf = PRINTBUF;
+
+			bch2_bbpos_to_text(&buf, cursor);
+			bch_info(c, "resuming evacuate of device %u at %s",
+				 op.migrate.dev, buf.buf);
+			printbuf_exit(&buf);
+			start = cursor;
+		}
+
+		io_class = min_t(unsigned, io_class, BCH_IO_CLASS_rereplicate);
 		bch_move_stats_init(stats, "migrate");
 		stats->data_type = BCH_DATA_journal;
 		ret = bch2_journal_flush_device_pins(&c->journal, op.migrate.dev);
@@ -986,22 +2608,40 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c,
 				      op.start_btree,	op.start_pos,
 				      op.end_btree,	op.end_pos,
-				      migrate_btree_pred, &op, stats) ?: ret;
+				      migrate_btree_pred, &op, stats,
+				      &limits) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c,
-				     op.start_btree,	op.start_pos,
-				     op.end_btree,	op.end_pos,
-				     NULL,
-				     stats,
-				     writepoint_hashed((unsigned long) current),
-				     true,
-				     migrate_pred, &op) ?: ret;
+		ret = data_job_move_data(c, stats, &op, start,
+					 &limits, io_class,
+					 migrate_pred, &op) ?: ret;
+
+		if (kthread_should_stop()) {
+			/* every move before stats->pos has completed: */
+			if (stats->data_type == BCH_DATA_user)
+				bch2_migrate_cursor_set(c, op.migrate.dev,
+					BBPOS(stats->btree_id, stats->pos));
+		} else if (!ret) {
+			mutex_lock(&c->sb_lock);
+			if (bch2_migrate_cursor_clear(c, op.migrate.dev))
+				bch2_write_super_async(c);
+			mutex_unlock(&c->sb_lock);
+		}
+
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
+	}
 	case BCH_DATA_OP_REWRITE_OLD_NODES:
 		bch_move_stats_init(stats, "rewrite_old_nodes");
-		ret = bch2_scan_old_btree_nodes(c, stats);
+		ret = __bch2_scan_old_btree_nodes(c, stats, &limits);
+		break;
+	case BCH_DATA_OP_DEFRAG:
+		bch_move_stats_init(stats, "defrag");
+		ret = bch2_defrag(c, stats, op, &limits, io_class);
+		break;
+	case BCH_DATA_OP_DEDUPE:
+		bch_move_stats_init(stats, "dedupe");
+		ret = bch2_dedupe(c, stats, op, &limits, io_class);
 		break;
 	default:
 		ret = -EINVAL;
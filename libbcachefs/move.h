@@ -9,13 +9,28 @@
 
 struct bch_read_bio;
 
+#define MOVE_CHECKPOINT_INTERVAL	(30 * HZ)
+
 struct moving_context {
 	struct bch_fs		*c;
 	struct bch_ratelimit	*rate;
+	struct data_job_limits	*limits;
 	struct bch_move_stats	*stats;
 	struct write_point_specifier wp;
 	bool			wait_on_copygc;
 	bool			write_error;
+	/* rewrite runs of small extents as one, see move_coalesce_extents: */
+	bool			coalesce;
+	enum bch_io_class	io_class;
+
+	/*
+	 * Called every MOVE_CHECKPOINT_INTERVAL, once every move before @pos
+	 * has completed:
+	 */
+	void			(*checkpoint)(struct moving_context *,
+					      enum btree_id, struct bpos);
+	void			*checkpoint_arg;
+	unsigned long		checkpoint_next;
 
 	/* For waiting on outstanding reads and writes: */
 	struct closure		cl;
@@ -25,6 +40,10 @@ struct moving_context {
 	atomic_t		read_sectors;
 	atomic_t		write_sectors;
 
+	spinlock_t		window_lock;
+	struct move_window	read_window;
+	struct move_window	write_window;
+
 	wait_queue_head_t	wait;
 };
 
@@ -34,17 +53,24 @@ typedef bool (*move_pred_fn)(struct bch_fs *, void *, struct bkey_s_c,
 void bch2_moving_ctxt_exit(struct moving_context *);
 void bch2_moving_ctxt_init(struct moving_context *, struct bch_fs *,
 			   struct bch_ratelimit *, struct bch_move_stats *,
-			   struct write_point_specifier, bool);
+			   struct write_point_specifier, bool,
+			   enum bch_io_class);
+void bch2_moving_ctxt_window_limits(struct moving_context *,
+				    unsigned, unsigned);
 
 int bch2_scan_old_btree_nodes(struct bch_fs *, struct bch_move_stats *);
 
+int __bch2_move_data(struct moving_context *,
+		     struct bpos, struct bpos,
+		     move_pred_fn, void *,
+		     enum btree_id);
 int bch2_move_data(struct bch_fs *,
 		   enum btree_id, struct bpos,
 		   enum btree_id, struct bpos,
 		   struct bch_ratelimit *,
 		   struct bch_move_stats *,
 		   struct write_point_specifier,
-		   bool,
+		   bool, enum bch_io_class,
 		   move_pred_fn, void *);
 
 int __bch2_evacuate_bucket(struct moving_context *,
@@ -55,7 +81,9 @@ int bch2_evacuate_bucket(struct bch_fs *, struct bpos, int,
 			 struct bch_ratelimit *,
 			 struct bch_move_stats *,
 			 struct write_point_specifier,
-			 bool);
+			 bool, enum bch_io_class);
+int bch2_evacuate_bucket_range(struct bch_fs *, struct bch_dev *,
+			       u64, u64, struct bch_move_stats *);
 int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
 		  struct bch_ioctl_data);
@@ -2,6 +2,19 @@
 #ifndef _BCACHEFS_MOVE_TYPES_H
 #define _BCACHEFS_MOVE_TYPES_H
 
+#include "util.h"
+
+/*
+ * Limits on a single data job, from struct bch_ioctl_data; a rate of 0 means
+ * unlimited:
+ */
+struct data_job_limits {
+	/* in sectors: */
+	struct bch_ratelimit	sectors;
+	/* in extents or btree nodes: */
+	struct bch_ratelimit	iops;
+};
+
 struct bch_move_stats {
 	enum bch_data_type	data_type;
 	enum btree_id		btree_id;
@@ -14,6 +27,30 @@ struct bch_move_stats {
 	atomic64_t		sectors_moved;
 	atomic64_t		sectors_seen;
 	atomic64_t		sectors_raced;
+
+	/* current in flight windows, in sectors, and completion latencies: */
+	unsigned		read_window;
+	unsigned		write_window;
+	u64			read_latency;
+	u64			write_latency;
+	atomic64_t		window_decreases;
+};
+
+/*
+ * Amount of IO the move path keeps in flight, sized from completion latency:
+ * grown while latency stays close to the lowest we've seen recently and the
+ * devices aren't congested, halved when it's not:
+ */
+struct move_window {
+	unsigned		sectors;
+	unsigned		min;
+	unsigned		max;
+	/* sectors completed since we last changed the window: */
+	unsigned		acked;
+	bool			slow_start;
+	u64			latency;
+	u64			min_latency;
+	u64			min_latency_time;
 };
 
 #endif /* _BCACHEFS_MOVE_TYPES_H */
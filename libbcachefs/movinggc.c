@@ -38,53 +38,92 @@ static inline int fragmentation_cmp(copygc_heap *heap,
 	return cmp_int(l.fragmentation, r.fragmentation);
 }
 
+static int copygc_candidate_add(struct btree_trans *trans,
+				struct btree_iter *iter,
+				struct bch_dev *ca, u64 b)
+{
+	struct bch_fs *c = trans->c;
+	struct copygc_heap_entry e;
+	struct bch_alloc_v4 a;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, b));
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	bch2_alloc_to_v4(k, &a);
+
+	if (copygc_frag_level(ca, a) < 0 ||
+	    bch2_bucket_is_open(c, ca->dev_idx, b))
+		return 0;
+
+	e = (struct copygc_heap_entry) {
+		.dev		= ca->dev_idx,
+		.gen		= a.gen,
+		.replicas	= 1 + a.stripe_redundancy,
+		.fragmentation	= div_u64((u64) a.dirty_sectors * (1ULL << 31),
+					  ca->mi.bucket_size),
+		.sectors	= a.dirty_sectors,
+		.bucket		= b,
+	};
+	heap_add_or_replace(&c->copygc_heap, e, -fragmentation_cmp, NULL);
+	return 0;
+}
+
 static int find_buckets_to_copygc(struct bch_fs *c)
 {
 	copygc_heap *h = &c->copygc_heap;
 	struct btree_trans trans;
 	struct btree_iter iter;
-	struct bkey_s_c k;
-	struct bch_alloc_v4 a;
-	int ret;
+	struct bch_dev *ca;
+	u64 start_time = local_clock();
+	unsigned dev_idx, level;
+	unsigned long b;
+	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
+	bch2_trans_iter_init(&trans, &iter, BTREE_ID_alloc, POS_MIN, 0);
 
 	/*
-	 * Find buckets with lowest sector counts, skipping completely
-	 * empty buckets, by building a maxheap sorted by sector count,
-	 * and repeatedly replacing the maximum element until all
-	 * buckets have been visited.
+	 * Find buckets with lowest sector counts, by building a maxheap sorted
+	 * by sector count and repeatedly replacing the maximum element.
+	 *
+	 * Candidates are kept in per device bitmaps by how full they are
+	 * (updated by bch2_mark_alloc()), so we only have to look at the
+	 * emptiest ranges: once the heap is full after a range, no bucket in
+	 * a fuller range could replace anything in it.
 	 */
 	h->used = 0;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_alloc, POS_MIN,
-			   BTREE_ITER_PREFETCH, k, ret) {
-		struct bch_dev *ca = bch_dev_bkey_exists(c, iter.pos.inode);
-		struct copygc_heap_entry e;
+	for (level = 0;
+	     level < COPYGC_FRAG_LEVELS && h->used < h->size && !ret;
+	     level++)
+		for_each_member_device(ca, c, dev_idx) {
+			struct copygc_candidates *g = ca->copygc_candidates;
 
-		bch2_alloc_to_v4(k, &a);
+			if (!g)
+				continue;
 
-		if ((a.data_type != BCH_DATA_btree &&
-		     a.data_type != BCH_DATA_user) ||
-		    a.dirty_sectors >= ca->mi.bucket_size ||
-		    bch2_bucket_is_open(c, iter.pos.inode, iter.pos.offset))
-			continue;
-
-		e = (struct copygc_heap_entry) {
-			.dev		= iter.pos.inode,
-			.gen		= a.gen,
-			.replicas	= 1 + a.stripe_redundancy,
-			.fragmentation	= div_u64((u64) a.dirty_sectors * (1ULL << 31),
-						  ca->mi.bucket_size),
-			.sectors	= a.dirty_sectors,
-			.bucket		= iter.pos.offset,
-		};
-		heap_add_or_replace(h, e, -fragmentation_cmp, NULL);
+			for_each_set_bit(b, copygc_candidates_level(g, level), g->nbuckets) {
+				ret = lockrestart_do(&trans,
+					copygc_candidate_add(&trans, &iter, ca, b));
+				if (ret)
+					break;
+			}
 
-	}
+			if (ret) {
+				percpu_ref_put(&ca->ref);
+				break;
+			}
+		}
 	bch2_trans_iter_exit(&trans, &iter);
 
 	bch2_trans_exit(&trans);
+
+	bch2_time_stats_update(&c->times[BCH_TIME_copygc_select], start_time);
 	return ret;
 }
 
@@ -151,7 +190,7 @@ static int bch2_copygc(struct bch_fs *c)
 
 	bch2_moving_ctxt_init(&ctxt, c, NULL, &move_stats,
 			      writepoint_ptr(&c->copygc_write_point),
-			      false);
+			      false, BCH_IO_CLASS_copygc);
 
 	/* not correct w.r.t. device removal */
 	while (h->used && !ret) {
@@ -49,6 +49,11 @@ const char * const bch2_csum_opts[] = {
 	NULL
 };
 
+const char * const bch2_encryption_types[] = {
+	BCH_ENCRYPTION_TYPES()
+	NULL
+};
+
 const char * const bch2_compression_types[] = {
 	BCH_COMPRESSION_TYPES()
 	NULL
@@ -74,6 +79,11 @@ const char * const bch2_data_types[] = {
 	NULL
 };
 
+const char * const bch2_write_alloc_policies[] = {
+	BCH_WRITE_ALLOC_POLICIES()
+	NULL
+};
+
 const char * const bch2_member_states[] = {
 	BCH_MEMBER_STATES()
 	NULL
@@ -361,10 +371,28 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 	case Opt_background_compression:
 		ret = bch2_check_set_has_compressed_data(c, v);
 		break;
+	case Opt_journal_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_journal_compression);
+		break;
+	case Opt_zstd_dict:
+		ret = bch2_check_set_has_zstd_dict(c, v);
+		break;
 	case Opt_erasure_code:
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
 		break;
+	case Opt_metadata_checksum:
+	case Opt_data_checksum:
+		if (v == BCH_CSUM_OPT_xxh3 ||
+		    v == BCH_CSUM_OPT_xxh3_128)
+			bch2_check_set_feature(c, BCH_FEATURE_xxh3);
+		break;
+	case Opt_str_hash:
+		if (v == BCH_STR_HASH_OPT_xxh3)
+			bch2_check_set_feature(c, BCH_FEATURE_xxh3);
+		break;
 	}
 
 	return ret;
@@ -8,6 +8,16 @@
 #include <linux/sysfs.h>
 #include "bcachefs_format.h"
 
+#define BCH_WRITE_ALLOC_POLICIES()	\
+	x(stripe,	0)		\
+	x(latency,	1)
+
+enum bch_write_alloc_policy {
+#define x(t, n) BCH_WRITE_ALLOC_##t = n,
+	BCH_WRITE_ALLOC_POLICIES()
+#undef x
+};
+
 extern const char * const bch2_metadata_versions[];
 extern const char * const bch2_error_actions[];
 extern const char * const bch2_sb_features[];
@@ -15,6 +25,7 @@ extern const char * const bch2_sb_compat[];
 extern const char * const bch2_btree_ids[];
 extern const char * const bch2_csum_types[];
 extern const char * const bch2_csum_opts[];
+extern const char * const bch2_encryption_types[];
 extern const char * const bch2_compression_types[];
 extern const char * const bch2_compression_opts[];
 extern const char * const bch2_str_hash_types[];
@@ -24,6 +35,7 @@ extern const char * const bch2_member_states[];
 extern const char * const bch2_jset_entry_types[];
 extern const char * const bch2_fs_usage_types[];
 extern const char * const bch2_d_types[];
+extern const char * const bch2_write_alloc_policies[];
 
 static inline const char *bch2_d_type_str(unsigned d_type)
 {
@@ -181,11 +193,28 @@ enum opt_type {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_PROMOTE_TARGET,	0,				\
 	  "(target)",	"Device or label to promote data to on read")	\
+	x(promote_min_reads,		u8,				\
+	  OPT_FS|OPT_INODE|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, 255),						\
+	  BCH_SB_PROMOTE_MIN_READS,	0,				\
+	  "#",		"Only promote extents read at least this many times\n"\
+			"recently (0 or 1: promote on first read)")	\
 	x(erasure_code,			u16,				\
 	  OPT_FS|OPT_INODE|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_BOOL(),							\
 	  BCH_SB_ERASURE_CODE,		false,				\
 	  NULL,		"Enable erasure coding (DO NOT USE YET)")	\
+	x(compression_adaptive,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH_SB_COMPRESSION_ADAPTIVE,	false,				\
+	  NULL,		"Skip compressing data that looks incompressible, and\n"\
+			"compress faster when writes are backed up")	\
+	x(zstd_dict,			u8,				\
+	  OPT_FS|OPT_INODE|OPT_MOUNT|OPT_RUNTIME,			\
+	  OPT_BOOL(),							\
+	  BCH_SB_ZSTD_DICT,		false,				\
+	  NULL,		"Compress with the filesystem's trained zstd dictionary")\
 	x(inodes_32bit,			u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
 	  OPT_BOOL(),							\
@@ -201,11 +230,31 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH_SB_INODES_USE_KEY_CACHE,	true,				\
 	  NULL,		"Use the btree key cache for the inodes btree")	\
+	x(dirents_use_key_cache,	u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Use the btree key cache for directory lookups")\
+	x(dirents_key_cache_max,	u32,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		1U << 16,			\
+	  NULL,		"Max number of dirents in the btree key cache, 0 for no limit")\
+	x(subvolumes_use_key_cache,	u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		true,				\
+	  NULL,		"Use the btree key cache for the subvolumes btree")\
 	x(btree_node_mem_ptr_optimization, u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Stash pointer to in memory btree node in btree ptr")\
+	x(btree_readahead,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 64),						\
+	  BCH2_NO_SB_OPT,		16,				\
+	  NULL,		"Maximum number of leaf nodes to read ahead when scanning a btree")\
 	x(gc_reserve_percent,		u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
 	  OPT_UINT(5, 21),						\
@@ -233,6 +282,13 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Enable inline data extents")			\
+	x(inline_xattrs,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		true,				\
+	  NULL,		"Cache small xattrs in new inodes, so that ACL\n"\
+			"and security label lookups don't need the\n"	\
+			"xattrs btree")					\
 	x(acl,				u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT,					\
 	  OPT_BOOL(),							\
@@ -268,11 +324,46 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Enable discard/TRIM support")			\
+	x(discard_max_bandwidth,	u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Maximum rate of discards, in bytes per second\n"\
+			"(0 for no limit)")				\
+	x(discard_max_iops,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Maximum number of discards issued per second\n"\
+			"(0 for no limit)")				\
+	x(discard_idle,			u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Only issue discards when the filesystem is otherwise idle")\
+	x(write_alloc_policy,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_STR(bch2_write_alloc_policies),				\
+	  BCH2_NO_SB_OPT,		BCH_WRITE_ALLOC_stripe,		\
+	  NULL,		"How to pick devices for writes: stripe by free\n"\
+			"space, or also avoid slow and busy devices")	\
+	x(invalidate_batch,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 8),						\
+	  BCH2_NO_SB_OPT,		8,				\
+	  NULL,		"Number of cached buckets to invalidate per\n"	\
+			"transaction commit")				\
 	x(verbose,			u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		false,				\
 	  NULL,		"Extra debugging information during mount/recovery")\
+	x(ec_stripe_flush_delay,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		30000,				\
+	  NULL,		"Delay in milliseconds before a partially written\n"\
+			"stripe is padded out and erasure coded, 0 to disable")\
 	x(journal_flush_delay,		u32,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_UINT(1, U32_MAX),						\
@@ -290,16 +381,71 @@ enum opt_type {
 	  OPT_UINT(0, U32_MAX),						\
 	  BCH_SB_JOURNAL_RECLAIM_DELAY,	100,				\
 	  NULL,		"Delay in milliseconds before automatic journal reclaim")\
+	x(journal_compression,		u8,				\
+	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
+	  OPT_STR(bch2_compression_opts),				\
+	  BCH_SB_JOURNAL_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compress journal entries")			\
+	x(read_cache_size,		u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		4U << 20,			\
+	  NULL,		"Memory for caching decompressed extents, for small\n"\
+			"reads into large compressed extents (0 to disable)")\
 	x(move_bytes_in_flight,		u32,				\
 	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_UINT(1024, U32_MAX),					\
 	  BCH2_NO_SB_OPT,		1U << 20,			\
 	  NULL,		"Amount of IO in flight to keep in flight by the move path")\
+	x(move_coalesce_extents,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"When moving data, rewrite runs of small contiguous\n"\
+			"extents as a single extent")			\
+	x(btree_read_threads,		u32,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(0, 1024),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Threads for validating and sorting btree nodes\n"\
+			"as they're read in (0: one per cpu)")		\
+	x(btree_read_trusted,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Skip per key validation of btree nodes whose\n"\
+			"checksum matched and that were written by the\n"\
+			"current version")				\
+	x(btree_read_hedge,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Reissue btree node reads that are slow to\n"	\
+			"complete to another replica, and use whichever\n"\
+			"finishes first")				\
+	x(btree_split_async,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		true,				\
+	  NULL,		"Split leaf nodes that are nearly full from a\n"\
+			"worker, instead of when an insert overflows them")\
 	x(fsck,				u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		false,				\
 	  NULL,		"Run fsck on mount")				\
+	x(fsck_quick,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Run fsck on mount, but only check btrees written\n"\
+			"since the last fsck that found no errors")	\
+	x(fsck_prefetch_inodes,		u32,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(0, 1U << 16),					\
+	  BCH2_NO_SB_OPT,		256,				\
+	  NULL,		"Number of dirents ahead to prefetch target inodes\n"\
+			"for when checking dirents, 0 to disable")	\
 	x(fix_errors,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -310,6 +456,11 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		RATELIMIT_ERRORS_DEFAULT,	\
 	  NULL,		"Ratelimit error messages during fsck")		\
+	x(fsck_progress_json,		u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Also report fsck progress as JSON")		\
 	x(nochanges,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -501,6 +652,31 @@ struct bch_io_opts {
 #undef x
 };
 
+/*
+ * Resolved io options - filesystem options with the inode's applied - for
+ * recently used (inum, snapshot) pairs; see bch2_inode_opts_get_cached().
+ * Set associative, indexed by inode number so that an update to an inode can
+ * drop its entries in every snapshot:
+ */
+#define BCH_IO_OPTS_CACHE_SETS_BITS	7
+#define BCH_IO_OPTS_CACHE_WAYS		4
+
+struct bch_io_opts_cache_set {
+	/* bumped on invalidate, so that a racing lookup doesn't add stale opts: */
+	u32			seq;
+	u32			next;
+	struct {
+		u64		inum;
+		u32		snapshot;
+		struct bch_io_opts opts;
+	}			e[BCH_IO_OPTS_CACHE_WAYS];
+};
+
+struct bch_io_opts_cache {
+	spinlock_t		lock;
+	struct bch_io_opts_cache_set sets[1U << BCH_IO_OPTS_CACHE_SETS_BITS];
+};
+
 struct bch_io_opts bch2_opts_to_inode_opts(struct bch_opts);
 struct bch_opts bch2_inode_opts_to_opts(struct bch_io_opts);
 void bch2_io_opts_apply(struct bch_io_opts *, struct bch_io_opts);
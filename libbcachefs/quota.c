@@ -258,6 +258,108 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 	return 0;
 }
 
+/*
+ * Per cpu slack:
+ *
+ * Taking the quota locks for every inode created and every sector written is
+ * expensive, so when charging a positive amount we charge a bit extra, if that
+ * doesn't cross a limit, and stash it in a per cpu slot; further charges (and
+ * small releases) for the same qid then hit only the slot. Slack counts as
+ * used, so soft and hard limits are enforced early rather than late;
+ * bch2_quota_flush() gives it back before usage is reported or limits are
+ * changed.
+ */
+static const u64 quota_slack[Q_COUNTERS] = {
+	[Q_SPC]	= 2048,
+	[Q_INO]	= 64,
+};
+
+static bool bch2_quota_acct_fast(struct bch_fs *c, struct bch_qid qid,
+				 enum quota_counters counter, s64 v)
+{
+	struct bch_quota_pcpu *p;
+	bool ret = false;
+
+	if (!c->quota_pcpu)
+		return false;
+
+	p = raw_cpu_ptr(c->quota_pcpu);
+
+	spin_lock(&p->lock);
+	if (p->valid &&
+	    !memcmp(&p->qid, &qid, sizeof(qid)) &&
+	    (v >= 0
+	     ? p->slack[counter] >= v
+	     : p->slack[counter] + -v <= quota_slack[counter] * 2)) {
+		p->slack[counter] -= v;
+		ret = true;
+	}
+	spin_unlock(&p->lock);
+
+	return ret;
+}
+
+/* Returns slack held by @p to the in memory quotas; quota locks must be held */
+static void bch2_quota_pcpu_return(struct bch_fs *c, unsigned qtypes,
+				   struct bch_quota_pcpu *p)
+{
+	struct bch_memquota_type *q;
+	struct bch_memquota *mq;
+	struct bch_qid qid;
+	u64 slack[Q_COUNTERS];
+	bool valid;
+	unsigned i, j;
+
+	spin_lock(&p->lock);
+	valid	= p->valid;
+	qid	= p->qid;
+	memcpy(slack, p->slack, sizeof(slack));
+	p->valid = false;
+	spin_unlock(&p->lock);
+
+	if (!valid)
+		return;
+
+	for_each_set_qtype(c, i, q, qtypes) {
+		mq = genradix_ptr(&q->table, qid.q[i]);
+		if (WARN_ON(!mq))
+			continue;
+
+		for (j = 0; j < Q_COUNTERS; j++) {
+			BUG_ON(mq->c[j].v < slack[j]);
+			mq->c[j].v -= slack[j];
+		}
+	}
+}
+
+static bool bch2_quota_slack_ok(struct bch_memquota *mq,
+				enum quota_counters counter, u64 v)
+{
+	struct memquota_counter *qc = &mq->c[counter];
+
+	return (!qc->hardlimit || qc->v + v <= qc->hardlimit) &&
+		(!qc->softlimit || qc->v + v <= qc->softlimit);
+}
+
+void bch2_quota_flush(struct bch_fs *c)
+{
+	unsigned qtypes = enabled_qtypes(c);
+	struct bch_memquota_type *q;
+	unsigned i, cpu;
+
+	if (!c->quota_pcpu)
+		return;
+
+	for_each_set_qtype(c, i, q, qtypes)
+		mutex_lock_nested(&q->lock, i);
+
+	for_each_possible_cpu(cpu)
+		bch2_quota_pcpu_return(c, qtypes, per_cpu_ptr(c->quota_pcpu, cpu));
+
+	for_each_set_qtype(c, i, q, qtypes)
+		mutex_unlock(&q->lock);
+}
+
 int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 		    enum quota_counters counter, s64 v,
 		    enum quota_acct_mode mode)
@@ -265,15 +367,31 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 	unsigned qtypes = enabled_qtypes(c);
 	struct bch_memquota_type *q;
 	struct bch_memquota *mq[QTYP_NR];
+	struct bch_quota_pcpu *p = NULL;
 	struct quota_msgs msgs;
+	u64 slack = 0;
 	unsigned i;
 	int ret = 0;
 
+	if (!qtypes)
+		return 0;
+
+	if (bch2_quota_acct_fast(c, qid, counter, v))
+		return 0;
+
 	memset(&msgs, 0, sizeof(msgs));
 
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_lock_nested(&q->lock, i);
 
+	if (c->quota_pcpu) {
+		p = raw_cpu_ptr(c->quota_pcpu);
+		bch2_quota_pcpu_return(c, qtypes, p);
+
+		if (v > 0 && mode != KEY_TYPE_QUOTA_NOCHECK)
+			slack = quota_slack[counter];
+	}
+
 	for_each_set_qtype(c, i, q, qtypes) {
 		mq[i] = genradix_ptr_alloc(&q->table, qid.q[i], GFP_NOFS);
 		if (!mq[i]) {
@@ -281,13 +399,30 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 			goto err;
 		}
 
+		if (slack && !bch2_quota_slack_ok(mq[i], counter, v + slack))
+			slack = 0;
+
 		ret = bch2_quota_check_limit(c, i, mq[i], &msgs, counter, v, mode);
 		if (ret)
 			goto err;
 	}
 
+	if (slack) {
+		spin_lock(&p->lock);
+		if (!p->valid) {
+			memset(p->slack, 0, sizeof(p->slack));
+			p->qid			= qid;
+			p->slack[counter]	= slack;
+			p->valid		= true;
+		} else {
+			/* someone else refilled this cpu's slot: */
+			slack = 0;
+		}
+		spin_unlock(&p->lock);
+	}
+
 	for_each_set_qtype(c, i, q, qtypes)
-		mq[i]->c[counter].v += v;
+		mq[i]->c[counter].v += v + slack;
 err:
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_unlock(&q->lock);
@@ -401,16 +536,25 @@ void bch2_fs_quota_exit(struct bch_fs *c)
 {
 	unsigned i;
 
+	free_percpu(c->quota_pcpu);
+	c->quota_pcpu = NULL;
+
 	for (i = 0; i < ARRAY_SIZE(c->quotas); i++)
 		genradix_free(&c->quotas[i].table);
 }
 
 void bch2_fs_quota_init(struct bch_fs *c)
 {
-	unsigned i;
+	unsigned i, cpu;
 
 	for (i = 0; i < ARRAY_SIZE(c->quotas); i++)
 		mutex_init(&c->quotas[i].lock);
+
+	/* Optional: without it, every charge takes the quota locks */
+	c->quota_pcpu = alloc_percpu(struct bch_quota_pcpu);
+	if (c->quota_pcpu)
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(c->quota_pcpu, cpu)->lock);
 }
 
 static void bch2_sb_quota_read(struct bch_fs *c)
@@ -541,6 +685,8 @@ static int bch2_quota_disable(struct super_block *sb, unsigned uflags)
 	if (sb->s_flags & SB_RDONLY)
 		return -EROFS;
 
+	bch2_quota_flush(c);
+
 	mutex_lock(&c->sb_lock);
 	if (uflags & FS_QUOTA_UDQ_ENFD)
 		SET_BCH_SB_USRQUOTA(c->disk_sb.sb, false);
@@ -719,6 +865,8 @@ static int bch2_get_quota(struct super_block *sb, struct kqid kqid,
 
 	memset(qdq, 0, sizeof(*qdq));
 
+	bch2_quota_flush(c);
+
 	mutex_lock(&q->lock);
 	mq = genradix_ptr(&q->table, qid);
 	if (mq)
@@ -738,6 +886,8 @@ static int bch2_get_next_quota(struct super_block *sb, struct kqid *kqid,
 	struct bch_memquota *mq;
 	int ret = 0;
 
+	bch2_quota_flush(c);
+
 	mutex_lock(&q->lock);
 
 	genradix_for_each_from(&q->table, iter, mq, qid)
@@ -804,6 +954,9 @@ static int bch2_set_quota(struct super_block *sb, struct kqid qid,
 			    bch2_set_quota_trans(&trans, &new_quota, qdq)) ?:
 		__bch2_quota_set(c, bkey_i_to_s_c(&new_quota.k_i));
 
+	/* slack taken under the old limits: */
+	bch2_quota_flush(c);
+
 	return ret;
 }
 
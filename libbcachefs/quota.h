@@ -39,6 +39,8 @@ int bch2_quota_acct(struct bch_fs *, struct bch_qid, enum quota_counters,
 int bch2_quota_transfer(struct bch_fs *, unsigned, struct bch_qid,
 			struct bch_qid, u64, enum quota_acct_mode);
 
+void bch2_quota_flush(struct bch_fs *);
+
 void bch2_fs_quota_exit(struct bch_fs *);
 void bch2_fs_quota_init(struct bch_fs *);
 int bch2_fs_quota_read(struct bch_fs *);
@@ -62,6 +64,8 @@ static inline int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 	return 0;
 }
 
+static inline void bch2_quota_flush(struct bch_fs *c) {}
+
 static inline void bch2_fs_quota_exit(struct bch_fs *c) {}
 static inline void bch2_fs_quota_init(struct bch_fs *c) {}
 static inline int bch2_fs_quota_read(struct bch_fs *c) { return 0; }
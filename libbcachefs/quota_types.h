@@ -34,6 +34,14 @@ struct quota_limit {
 	u32				warnlimit;
 };
 
+/* See bch2_quota_acct(): */
+struct bch_quota_pcpu {
+	spinlock_t			lock;
+	bool				valid;
+	struct bch_qid			qid;
+	u64				slack[Q_COUNTERS];
+};
+
 struct bch_memquota_type {
 	struct quota_limit		limits[Q_COUNTERS];
 	bch_memquota_table		table;
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "read_cache.h"
+#include "util.h"
+
+#include <linux/jhash.h>
+
+static void read_cache_key_init(struct bch_read_cache_key *key,
+				struct extent_ptr_decoded *pick)
+{
+	memset(key, 0, sizeof(*key));
+	key->offset		= pick->ptr.offset;
+	key->csum		= pick->crc.csum;
+	key->dev		= pick->ptr.dev;
+	key->compressed_size	= pick->crc.compressed_size;
+	key->uncompressed_size	= pick->crc.uncompressed_size;
+	key->gen		= pick->ptr.gen;
+	key->compression_type	= pick->crc.compression_type;
+}
+
+static struct list_head *read_cache_bucket(struct bch_read_cache *rc,
+					   struct bch_read_cache_key *key)
+{
+	u32 h = jhash(key, sizeof(*key), 0);
+
+	return rc->table + (h & (BCH_READ_CACHE_HASH_NR - 1));
+}
+
+static struct bch_read_cache_entry *
+read_cache_find(struct bch_read_cache *rc, struct bch_read_cache_key *key)
+{
+	struct bch_read_cache_entry *e;
+
+	list_for_each_entry(e, read_cache_bucket(rc, key), hash)
+		if (!memcmp(&e->key, key, sizeof(*key)))
+			return e;
+	return NULL;
+}
+
+static inline size_t read_cache_entry_bytes(struct bch_read_cache_entry *e)
+{
+	return e->key.uncompressed_size << 9;
+}
+
+static void read_cache_entry_free(struct bch_read_cache_entry *e)
+{
+	kvpfree(e->data, read_cache_entry_bytes(e));
+	kfree(e);
+}
+
+/*
+ * Copy @iter's worth of data, starting @offset sectors into the uncompressed
+ * extent, from the cache: returns false on a miss
+ */
+bool bch2_read_cache_get(struct bch_fs *c, struct extent_ptr_decoded *pick,
+			 struct bio *bio, struct bvec_iter iter,
+			 unsigned offset)
+{
+	struct bch_read_cache *rc = &c->read_cache;
+	struct bch_read_cache_key key;
+	struct bch_read_cache_entry *e;
+
+	read_cache_key_init(&key, pick);
+
+	spin_lock(&rc->lock);
+	e = read_cache_find(rc, &key);
+	if (e) {
+		list_move(&e->lru, &rc->lru);
+		memcpy_to_bio(bio, iter, e->data + (offset << 9));
+	}
+	spin_unlock(&rc->lock);
+
+	if (e)
+		this_cpu_inc(c->counters[BCH_COUNTER_read_cache_hit]);
+	else
+		this_cpu_inc(c->counters[BCH_COUNTER_read_cache_miss]);
+	return e != NULL;
+}
+
+/*
+ * Add a decompressed extent to the cache: takes ownership of @data, which was
+ * allocated with kvpmalloc() and is pick->crc.uncompressed_size sectors
+ */
+void bch2_read_cache_add(struct bch_fs *c, struct extent_ptr_decoded *pick,
+			 void *data)
+{
+	struct bch_read_cache *rc = &c->read_cache;
+	struct bch_read_cache_entry *e, *n;
+	LIST_HEAD(evicted);
+
+	e = kmalloc(sizeof(*e), GFP_NOWAIT);
+	if (!e) {
+		kvpfree(data, pick->crc.uncompressed_size << 9);
+		return;
+	}
+
+	read_cache_key_init(&e->key, pick);
+	e->data = data;
+
+	spin_lock(&rc->lock);
+	if (read_cache_find(rc, &e->key)) {
+		/* Raced with another read of the same extent: */
+		spin_unlock(&rc->lock);
+		read_cache_entry_free(e);
+		return;
+	}
+
+	list_add(&e->hash, read_cache_bucket(rc, &e->key));
+	list_add(&e->lru, &rc->lru);
+	rc->bytes += read_cache_entry_bytes(e);
+
+	while (rc->bytes > c->opts.read_cache_size &&
+	       !list_empty(&rc->lru)) {
+		n = list_last_entry(&rc->lru, struct bch_read_cache_entry, lru);
+		list_del(&n->hash);
+		list_move(&n->lru, &evicted);
+		rc->bytes -= read_cache_entry_bytes(n);
+	}
+	spin_unlock(&rc->lock);
+
+	list_for_each_entry_safe(e, n, &evicted, lru)
+		read_cache_entry_free(e);
+}
+
+void bch2_fs_read_cache_exit(struct bch_fs *c)
+{
+	struct bch_read_cache *rc = &c->read_cache;
+	struct bch_read_cache_entry *e, *n;
+
+	list_for_each_entry_safe(e, n, &rc->lru, lru)
+		read_cache_entry_free(e);
+	INIT_LIST_HEAD(&rc->lru);
+	rc->bytes = 0;
+}
+
+void bch2_fs_read_cache_init(struct bch_fs *c)
+{
+	struct bch_read_cache *rc = &c->read_cache;
+	unsigned i;
+
+	spin_lock_init(&rc->lock);
+	INIT_LIST_HEAD(&rc->lru);
+	for (i = 0; i < ARRAY_SIZE(rc->table); i++)
+		INIT_LIST_HEAD(&rc->table[i]);
+}
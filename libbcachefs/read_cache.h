@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_READ_CACHE_H
+#define _BCACHEFS_READ_CACHE_H
+
+#include "checksum.h"
+#include "extents_types.h"
+
+static inline bool bch2_read_cache_wanted(struct bch_fs *c,
+					  struct extent_ptr_decoded *pick)
+{
+	/* Don't keep plaintext of encrypted data around: */
+	return c->opts.read_cache_size &&
+		crc_is_compressed(pick->crc) &&
+		!bch2_csum_type_is_encryption(pick->crc.csum_type) &&
+		pick->crc.uncompressed_size << 9 <= c->opts.read_cache_size;
+}
+
+bool bch2_read_cache_get(struct bch_fs *, struct extent_ptr_decoded *,
+			 struct bio *, struct bvec_iter, unsigned);
+void bch2_read_cache_add(struct bch_fs *, struct extent_ptr_decoded *, void *);
+
+void bch2_fs_read_cache_exit(struct bch_fs *);
+void bch2_fs_read_cache_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_READ_CACHE_H */
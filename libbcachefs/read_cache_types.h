@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_READ_CACHE_TYPES_H
+#define _BCACHEFS_READ_CACHE_TYPES_H
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/*
+ * Identifies an encoded extent on disk: a given copy of a given version of the
+ * extent. Matching the checksum and generation means a cached copy can't be
+ * returned after the bucket has been reused:
+ */
+struct bch_read_cache_key {
+	u64			offset;
+	struct bch_csum		csum;
+	u32			dev;
+	u16			compressed_size;
+	u16			uncompressed_size;
+	u8			gen;
+	u8			compression_type;
+	u8			pad[2];
+};
+
+struct bch_read_cache_entry {
+	struct list_head	hash;
+	struct list_head	lru;
+	struct bch_read_cache_key key;
+	void			*data;
+};
+
+#define BCH_READ_CACHE_HASH_BITS	8
+#define BCH_READ_CACHE_HASH_NR		(1U << BCH_READ_CACHE_HASH_BITS)
+
+/*
+ * Whole decompressed extents, for small reads into big compressed extents;
+ * entries are evicted in LRU order once we're over the read_cache_size option:
+ */
+struct bch_read_cache {
+	spinlock_t		lock;
+	size_t			bytes;
+	struct list_head	lru;
+	struct list_head	table[BCH_READ_CACHE_HASH_NR];
+};
+
+#endif /* _BCACHEFS_READ_CACHE_TYPES_H */
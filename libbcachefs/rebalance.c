@@ -2,7 +2,9 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "btree_cache.h"
 #include "btree_iter.h"
+#include "btree_update.h"
 #include "buckets.h"
 #include "clock.h"
 #include "disk_groups.h"
@@ -16,6 +18,7 @@
 #include <linux/freezer.h>
 #include <linux/kthread.h>
 #include <linux/sched/cputime.h>
+#include <linux/sort.h>
 #include <trace/events/bcachefs.h>
 
 /*
@@ -35,6 +38,7 @@ static bool rebalance_pred(struct bch_fs *c, void *arg,
 	data_opts->target		= io_opts->background_target;
 	data_opts->extra_replicas	= 0;
 	data_opts->btree_insert_flags	= 0;
+	data_opts->reencode		= false;
 
 	if (io_opts->background_compression &&
 	    !bch2_bkey_is_incompressible(k)) {
@@ -45,27 +49,128 @@ static bool rebalance_pred(struct bch_fs *c, void *arg,
 		bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
 			if (!p.ptr.cached &&
 			    p.crc.compression_type !=
-			    bch2_compression_opt_to_type[io_opts->background_compression])
+			    bch2_compression_opt_to_type[io_opts->background_compression]) {
 				data_opts->rewrite_ptrs |= 1U << i;
+				data_opts->reencode = true;
+			}
 			i++;
 		}
 	}
 
 	if (io_opts->background_target) {
 		const struct bch_extent_ptr *ptr;
+		const struct bch_devs_mask *m;
+
+		rcu_read_lock();
+		m = bch2_target_to_mask(c, io_opts->background_target);
 
 		i = 0;
 		bkey_for_each_ptr(ptrs, ptr) {
 			if (!ptr->cached &&
-			    !bch2_dev_in_target(c, ptr->dev, io_opts->background_target))
+			    !bch2_dev_in_target_mask(m, ptr->dev))
 				data_opts->rewrite_ptrs |= 1U << i;
 			i++;
 		}
+		rcu_read_unlock();
 	}
 
 	return data_opts->rewrite_ptrs != 0;
 }
 
+static bool rebalance_work_range_merge(struct rebalance_work_range *l,
+				       const struct rebalance_work_range *n)
+{
+	if (l->btree	!= n->btree ||
+	    l->inum	!= n->inum ||
+	    l->start	> n->end ||
+	    l->end	< n->start)
+		return false;
+
+	l->start	= min(l->start, n->start);
+	l->end		= max(l->end, n->end);
+	return true;
+}
+
+static void rebalance_work_index_push(struct bch_fs *c,
+				      struct rebalance_work_range *d,
+				      unsigned nr)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	unsigned i;
+
+	mutex_lock(&r->work_lock);
+	for (i = 0; i < nr && !r->work_scan_all; i++) {
+		/* writes are mostly sequential, so just try to merge with the last: */
+		if (r->work.nr &&
+		    rebalance_work_range_merge(&r->work.data[r->work.nr - 1], &d[i]))
+			continue;
+
+		if (r->work.nr >= REBALANCE_WORK_RANGES_MAX ||
+		    darray_push(&r->work, d[i])) {
+			r->work_scan_all = true;
+			darray_exit(&r->work);
+		}
+	}
+	mutex_unlock(&r->work_lock);
+}
+
+static void rebalance_work_pcpu_flush(struct bch_fs *c)
+{
+	struct rebalance_work_range d[REBALANCE_WORK_PCPU_NR];
+	unsigned cpu, nr;
+
+	for_each_possible_cpu(cpu) {
+		struct rebalance_work_pcpu *p =
+			per_cpu_ptr(c->rebalance.work_pcpu, cpu);
+
+		spin_lock(&p->lock);
+		nr = p->nr;
+		memcpy(d, p->d, sizeof(d[0]) * nr);
+		p->nr = 0;
+		spin_unlock(&p->lock);
+
+		if (nr)
+			rebalance_work_index_push(c, d, nr);
+	}
+}
+
+static void rebalance_work_index_add(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct rebalance_work_range d[REBALANCE_WORK_PCPU_NR];
+	/* indirect extents are at inode 0, which the extents btree never uses: */
+	struct rebalance_work_range n = {
+		.btree	= k.k->p.inode ? BTREE_ID_extents : BTREE_ID_reflink,
+		.inum	= k.k->p.inode,
+		.start	= bkey_start_offset(k.k),
+		.end	= k.k->p.offset,
+	};
+	struct rebalance_work_pcpu *p;
+	unsigned nr = 0;
+
+	if (READ_ONCE(r->work_scan_all))
+		return;
+
+	p = raw_cpu_ptr(r->work_pcpu);
+	spin_lock(&p->lock);
+	if (p->nr &&
+	    rebalance_work_range_merge(&p->d[p->nr - 1], &n))
+		goto out;
+
+	if (p->nr == REBALANCE_WORK_PCPU_NR) {
+		nr = p->nr;
+		memcpy(d, p->d, sizeof(p->d));
+		p->nr = 0;
+	}
+
+	p->d[p->nr++] = n;
+out:
+	spin_unlock(&p->lock);
+
+	if (nr)
+		rebalance_work_index_push(c, d, nr);
+}
+
 void bch2_rebalance_add_key(struct bch_fs *c,
 			    struct bkey_s_c k,
 			    struct bch_io_opts *io_opts)
@@ -78,6 +183,8 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 	if (!rebalance_pred(c, NULL, k, io_opts, &update_opts))
 		return;
 
+	rebalance_work_index_add(c, k);
+
 	i = 0;
 	ptrs = bch2_bkey_ptrs_c(k);
 	bkey_for_each_ptr(ptrs, ptr) {
@@ -92,6 +199,12 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 
 void bch2_rebalance_add_work(struct bch_fs *c, u64 sectors)
 {
+	/* we don't know which extents this is for: */
+	mutex_lock(&c->rebalance.work_lock);
+	c->rebalance.work_scan_all = true;
+	darray_exit(&c->rebalance.work);
+	mutex_unlock(&c->rebalance.work_lock);
+
 	if (atomic64_add_return(sectors, &c->rebalance.work_unknown_dev) ==
 	    sectors)
 		rebalance_wakeup(c);
@@ -161,6 +274,146 @@ static void rebalance_work_reset(struct bch_fs *c)
 	atomic64_set(&c->rebalance.work_unknown_dev, 0);
 }
 
+static int rebalance_work_range_cmp(const void *_l, const void *_r)
+{
+	const struct rebalance_work_range *l = _l, *r = _r;
+
+	return  cmp_int(l->btree, r->btree) ?:
+		cmp_int(l->inum, r->inum) ?:
+		cmp_int(l->start, r->start);
+}
+
+/*
+ * Move the extents the work index says need it, or everything if it doesn't
+ * know:
+ */
+static void rebalance_do_work(struct bch_fs *c, struct bch_move_stats *stats)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct moving_context ctxt;
+	struct rebalance_work_range *i, *dst;
+	darray_rebalance_work_range work;
+	bool scan_all;
+
+	rebalance_work_pcpu_flush(c);
+
+	mutex_lock(&r->work_lock);
+	scan_all	= r->work_scan_all;
+	work		= r->work;
+	r->work_scan_all = false;
+	darray_init(&r->work);
+	mutex_unlock(&r->work_lock);
+
+	if (scan_all) {
+		darray_exit(&work);
+
+		bch2_move_data(c,
+			       0,		POS_MIN,
+			       BTREE_ID_NR,	POS_MAX,
+			       /* ratelimiting disabled for now */
+			       NULL, /*  &r->pd.rate, */
+			       stats,
+			       writepoint_ptr(&c->rebalance_write_point),
+			       true,
+			       BCH_IO_CLASS_rebalance,
+			       rebalance_pred, NULL);
+		return;
+	}
+
+	sort(work.data, work.nr, sizeof(work.data[0]),
+	     rebalance_work_range_cmp, NULL);
+
+	/* merge overlapping ranges: */
+	dst = work.data;
+	darray_for_each(work, i)
+		if (dst == work.data ||
+		    !rebalance_work_range_merge(&dst[-1], i))
+			*dst++ = *i;
+	work.nr = dst - work.data;
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_ptr(&c->rebalance_write_point),
+			      true, BCH_IO_CLASS_rebalance);
+
+	darray_for_each(work, i) {
+		if (kthread_should_stop())
+			break;
+
+		__bch2_move_data(&ctxt,
+				 POS(i->inum, i->start),
+				 POS(i->inum, i->end),
+				 rebalance_pred, NULL,
+				 i->btree);
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+	darray_exit(&work);
+}
+
+/*
+ * Nodes that have picked up several bsets, many failed bkey floats or lots of
+ * unpacked keys slow down every lookup until they're next compacted; when
+ * rebalance has nothing else to do, rewrite a few of the worst ones:
+ */
+#define REBALANCE_BTREE_REWRITE_INTERVAL	(10 * HZ)
+#define REBALANCE_BTREE_REWRITE_MAX		8
+
+static bool btree_node_needs_rewrite(struct bch_fs *c, struct btree *b)
+{
+	if (btree_node_dirty(b) ||
+	    btree_node_write_in_flight(b) ||
+	    btree_node_read_in_flight(b))
+		return false;
+
+	return bch2_bkey_format_needs_redo(&b->format) ||
+		bch2_btree_node_lookup_cost(b) >=
+		c->rebalance.btree_node_rewrite_threshold;
+}
+
+static void rebalance_rewrite_btree_nodes(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct btree *nodes[REBALANCE_BTREE_REWRITE_MAX];
+	struct bucket_table *tbl;
+	struct rhash_head *pos;
+	struct btree *b;
+	unsigned i, nr = 0;
+
+	if (!r->btree_node_rewrite_threshold ||
+	    time_before(jiffies, r->btree_node_rewrite_last +
+			REBALANCE_BTREE_REWRITE_INTERVAL))
+		return;
+
+	r->btree_node_rewrite_last = jiffies;
+
+	rcu_read_lock();
+	tbl = rht_dereference_rcu(c->btree_cache.table.tbl,
+				  &c->btree_cache.table);
+	for (i = 0; i < tbl->size && nr < REBALANCE_BTREE_REWRITE_MAX; i++)
+		rht_for_each_entry_rcu(b, pos, tbl, i, hash) {
+			if (!six_trylock_read(&b->c.lock))
+				continue;
+
+			if (!btree_node_needs_rewrite(c, b)) {
+				six_unlock_read(&b->c.lock);
+				continue;
+			}
+
+			/* the read lock pins the node until we're out of RCU: */
+			nodes[nr++] = b;
+			if (nr >= REBALANCE_BTREE_REWRITE_MAX)
+				break;
+		}
+	rcu_read_unlock();
+
+	for (i = 0; i < nr; i++) {
+		bch2_btree_node_rewrite_async(c, nodes[i]);
+		six_unlock_read(&nodes[i]->c.lock);
+	}
+
+	r->btree_node_rewrites += nr;
+}
+
 static unsigned long curr_cputime(void)
 {
 	u64 utime, stime;
@@ -204,7 +457,20 @@ static int bch2_rebalance_thread(void *arg)
 
 		if (!w.total_work) {
 			r->state = REBALANCE_WAITING;
-			kthread_wait_freezable(rebalance_work(c).total_work);
+
+			if (!r->btree_node_rewrite_threshold) {
+				kthread_wait_freezable(rebalance_work(c).total_work);
+				continue;
+			}
+
+			rebalance_rewrite_btree_nodes(c);
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop() &&
+			    !rebalance_work(c).total_work)
+				schedule_timeout(REBALANCE_BTREE_REWRITE_INTERVAL);
+			__set_current_state(TASK_RUNNING);
+			try_to_freeze();
 			continue;
 		}
 
@@ -249,15 +515,7 @@ static int bch2_rebalance_thread(void *arg)
 		memset(&move_stats, 0, sizeof(move_stats));
 		rebalance_work_reset(c);
 
-		bch2_move_data(c,
-			       0,		POS_MIN,
-			       BTREE_ID_NR,	POS_MAX,
-			       /* ratelimiting disabled for now */
-			       NULL, /*  &r->pd.rate, */
-			       &move_stats,
-			       writepoint_ptr(&c->rebalance_write_point),
-			       true,
-			       rebalance_pred, NULL);
+		rebalance_do_work(c, &move_stats);
 	}
 
 	return 0;
@@ -309,6 +567,11 @@ void bch2_rebalance_work_to_text(struct printbuf *out, struct bch_fs *c)
 		break;
 	}
 	prt_newline(out);
+
+	prt_printf(out, "btree node rewrites:");
+	prt_tab(out);
+	prt_printf(out, "%llu", r->btree_node_rewrites);
+	prt_newline(out);
 }
 
 void bch2_rebalance_stop(struct bch_fs *c)
@@ -354,9 +617,33 @@ int bch2_rebalance_start(struct bch_fs *c)
 	return 0;
 }
 
-void bch2_fs_rebalance_init(struct bch_fs *c)
+void bch2_fs_rebalance_exit(struct bch_fs *c)
+{
+	free_percpu(c->rebalance.work_pcpu);
+	darray_exit(&c->rebalance.work);
+}
+
+int bch2_fs_rebalance_init(struct bch_fs *c)
+{
+	unsigned cpu;
+
+	c->rebalance.work_pcpu = alloc_percpu(struct rebalance_work_pcpu);
+	if (!c->rebalance.work_pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(c->rebalance.work_pcpu, cpu)->lock);
+	return 0;
+}
+
+void bch2_fs_rebalance_init_early(struct bch_fs *c)
 {
 	bch2_pd_controller_init(&c->rebalance.pd);
 
 	atomic64_set(&c->rebalance.work_unknown_dev, S64_MAX);
+
+	mutex_init(&c->rebalance.work_lock);
+	darray_init(&c->rebalance.work);
+	c->rebalance.work_scan_all = true;
+	c->rebalance.btree_node_rewrite_threshold = 200;
 }
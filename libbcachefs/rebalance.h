@@ -23,6 +23,8 @@ void bch2_rebalance_work_to_text(struct printbuf *, struct bch_fs *);
 
 void bch2_rebalance_stop(struct bch_fs *);
 int bch2_rebalance_start(struct bch_fs *);
-void bch2_fs_rebalance_init(struct bch_fs *);
+void bch2_fs_rebalance_exit(struct bch_fs *);
+int bch2_fs_rebalance_init(struct bch_fs *);
+void bch2_fs_rebalance_init_early(struct bch_fs *);
 
 #endif /* _BCACHEFS_REBALANCE_H */
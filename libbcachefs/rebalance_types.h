@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_REBALANCE_TYPES_H
 #define _BCACHEFS_REBALANCE_TYPES_H
 
+#include "darray.h"
 #include "move_types.h"
 
 enum rebalance_state {
@@ -10,16 +11,61 @@ enum rebalance_state {
 	REBALANCE_RUNNING,
 };
 
+/*
+ * Extents in this range of an inode (or of the reflink btree, for indirect
+ * extents) may need to be moved or recompressed:
+ */
+struct rebalance_work_range {
+	enum btree_id		btree;
+	u64			inum;
+	u64			start;
+	u64			end;
+};
+
+typedef DARRAY(struct rebalance_work_range) darray_rebalance_work_range;
+
+/* Past this many ranges we give up on the index and scan everything: */
+#define REBALANCE_WORK_RANGES_MAX	(1U << 16)
+
+/*
+ * New ranges are buffered per cpu, so that extent writes don't all take
+ * @work_lock; a full buffer is added to the index in one go:
+ */
+#define REBALANCE_WORK_PCPU_NR		16
+
+struct rebalance_work_pcpu {
+	spinlock_t		lock;
+	unsigned		nr;
+	struct rebalance_work_range d[REBALANCE_WORK_PCPU_NR];
+};
+
 struct bch_fs_rebalance {
 	struct task_struct __rcu *thread;
 	struct bch_pd_controller pd;
 
 	atomic64_t		work_unknown_dev;
 
+	/*
+	 * Index of where the work is, so that we don't have to walk every
+	 * extent: if @work_scan_all is set, we don't know
+	 */
+	struct mutex		work_lock;
+	darray_rebalance_work_range work;
+	bool			work_scan_all;
+	struct rebalance_work_pcpu __percpu *work_pcpu;
+
 	enum rebalance_state	state;
 	u64			throttled_until_iotime;
 	unsigned long		throttled_until_cputime;
 
+	/*
+	 * When idle, rewrite cached btree nodes whose lookup cost (see
+	 * bch2_btree_node_lookup_cost()) is at least this; 0 disables:
+	 */
+	unsigned		btree_node_rewrite_threshold;
+	unsigned long		btree_node_rewrite_last;
+	u64			btree_node_rewrites;
+
 	unsigned		enabled:1;
 };
 
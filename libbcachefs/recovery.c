@@ -208,6 +208,9 @@ int bch2_journal_key_insert_take(struct bch_fs *c, enum btree_id id,
 
 	BUG_ON(test_bit(BCH_FS_RW, &c->flags));
 
+	if (test_bit(BCH_FS_GC_PARALLEL, &c->flags))
+		return -BCH_ERR_need_serial_gc;
+
 	if (idx < keys->size &&
 	    journal_key_cmp(&n, &keys->d[idx]) == 0) {
 		if (keys->d[idx].allocated)
@@ -421,7 +424,9 @@ void __bch2_btree_and_journal_iter_init_node_iter(struct btree_and_journal_iter
 
 /*
  * this version is used by btree_gc before filesystem has gone RW and
- * multithreaded, so uses the journal_iters list:
+ * multithreaded, so uses the journal_iters list - except when gc is walking
+ * btrees in parallel, when journal keys can't be inserted and iterators never
+ * need fixing up:
  */
 void bch2_btree_and_journal_iter_init_node_iter(struct btree_and_journal_iter *iter,
 						struct bch_fs *c,
@@ -431,7 +436,8 @@ void bch2_btree_and_journal_iter_init_node_iter(struct btree_and_journal_iter *i
 
 	bch2_btree_node_iter_init_from_start(&node_iter, b);
 	__bch2_btree_and_journal_iter_init_node_iter(iter, c, b, node_iter, b->data->min_key);
-	list_add(&iter->journal.list, &c->journal_iters);
+	if (!test_bit(BCH_FS_GC_PARALLEL, &c->flags))
+		list_add(&iter->journal.list, &c->journal_iters);
 }
 
 /* sort and dedup all keys in the journal: */
@@ -477,6 +483,183 @@ void bch2_journal_keys_free(struct journal_keys *keys)
 	keys->nr = keys->gap = keys->size = 0;
 }
 
+/*
+ * With lots of journal keys, sorting is done in parallel: the keys are split
+ * into one chunk per worker and the chunks are sorted concurrently, then pairs
+ * of sorted runs are merged concurrently until there's a single run left.
+ * Deduplicating is also split up, at boundaries that don't split up keys with
+ * the same position.
+ */
+#define JOURNAL_KEYS_SORT_PARALLEL_MIN	(1U << 16)
+#define JOURNAL_KEYS_SORT_WORKERS_MAX	16
+
+struct journal_keys_sort_work {
+	struct closure		cl;
+	struct journal_key	*src;
+	struct journal_key	*dst;
+	size_t			l, m, r;
+};
+
+static inline bool journal_keys_same_pos(const struct journal_key *l,
+					 const struct journal_key *r)
+{
+	return  l->btree_id	== r->btree_id &&
+		l->level	== r->level &&
+		!bpos_cmp(l->k->k.p, r->k->k.p);
+}
+
+static void journal_keys_sort_chunk(struct closure *cl)
+{
+	struct journal_keys_sort_work *w =
+		container_of(cl, struct journal_keys_sort_work, cl);
+
+	sort(w->src + w->l, w->r - w->l, sizeof(w->src[0]),
+	     journal_sort_key_cmp, NULL);
+	closure_return(cl);
+}
+
+static void journal_keys_merge_runs(struct closure *cl)
+{
+	struct journal_keys_sort_work *w =
+		container_of(cl, struct journal_keys_sort_work, cl);
+	struct journal_key *l = w->src + w->l, *l_end = w->src + w->m;
+	struct journal_key *r = w->src + w->m, *r_end = w->src + w->r;
+	struct journal_key *dst = w->dst + w->l;
+
+	while (l < l_end && r < r_end)
+		*dst++ = journal_sort_key_cmp(l, r) <= 0 ? *l++ : *r++;
+
+	memcpy(dst, l, (l_end - l) * sizeof(*l));
+	dst += l_end - l;
+	memcpy(dst, r, (r_end - r) * sizeof(*r));
+	closure_return(cl);
+}
+
+/* Dedup [l, r) in place, leaving the number of keys kept in w->m: */
+static void journal_keys_dedup_chunk(struct closure *cl)
+{
+	struct journal_keys_sort_work *w =
+		container_of(cl, struct journal_keys_sort_work, cl);
+	struct journal_key *src = w->src + w->l, *end = w->src + w->r;
+	struct journal_key *dst = src;
+
+	while (src < end) {
+		while (src + 1 < end &&
+		       journal_keys_same_pos(&src[0], &src[1]))
+			src++;
+
+		*dst++ = *src++;
+	}
+
+	w->m = dst - (w->src + w->l);
+	closure_return(cl);
+}
+
+static void journal_keys_sort_run(struct journal_keys_sort_work *w,
+				  unsigned nr, closure_fn *fn)
+{
+	struct closure cl;
+	unsigned i;
+
+	closure_init_stack(&cl);
+	for (i = 0; i < nr; i++)
+		closure_call(&w[i].cl, fn, system_unbound_wq, &cl);
+	closure_sync(&cl);
+}
+
+static int journal_keys_sort_parallel(struct journal_keys *keys)
+{
+	struct journal_keys_sort_work *w;
+	size_t runs[JOURNAL_KEYS_SORT_WORKERS_MAX + 1];
+	struct journal_key *src = keys->d, *dst;
+	unsigned i, nr_runs = min_t(unsigned, num_online_cpus(),
+				    JOURNAL_KEYS_SORT_WORKERS_MAX);
+	size_t nr = keys->nr, kept;
+
+	w = kmalloc_array(nr_runs, sizeof(*w), GFP_KERNEL);
+	dst = kvmalloc(sizeof(keys->d[0]) * keys->size, GFP_KERNEL);
+	if (!w || !dst) {
+		kvfree(dst);
+		kfree(w);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i <= nr_runs; i++)
+		runs[i] = div_u64((u64) nr * i, nr_runs);
+
+	for (i = 0; i < nr_runs; i++)
+		w[i] = (struct journal_keys_sort_work) {
+			.src	= src,
+			.l	= runs[i],
+			.r	= runs[i + 1],
+		};
+	journal_keys_sort_run(w, nr_runs, journal_keys_sort_chunk);
+
+	while (nr_runs > 1) {
+		unsigned nr_merges = nr_runs / 2;
+
+		for (i = 0; i < nr_merges; i++)
+			w[i] = (struct journal_keys_sort_work) {
+				.src	= src,
+				.dst	= dst,
+				.l	= runs[i * 2],
+				.m	= runs[i * 2 + 1],
+				.r	= runs[i * 2 + 2],
+			};
+		journal_keys_sort_run(w, nr_merges, journal_keys_merge_runs);
+
+		if (nr_runs & 1)
+			memcpy(dst + runs[nr_runs - 1],
+			       src + runs[nr_runs - 1],
+			       (nr - runs[nr_runs - 1]) * sizeof(src[0]));
+
+		for (i = 0; i < nr_merges; i++)
+			runs[i] = runs[i * 2];
+		runs[nr_merges] = runs[nr_runs - 1];
+		nr_runs = DIV_ROUND_UP(nr_runs, 2);
+		runs[nr_runs] = nr;
+
+		swap(src, dst);
+	}
+
+	kvfree(dst);
+	keys->d = src;
+
+	/* Dedup, without splitting up keys at the same position: */
+	nr_runs = min_t(unsigned, num_online_cpus(),
+			JOURNAL_KEYS_SORT_WORKERS_MAX);
+	for (i = 0; i <= nr_runs; i++) {
+		runs[i] = div_u64((u64) nr * i, nr_runs);
+
+		if (i && runs[i] < runs[i - 1])
+			runs[i] = runs[i - 1];
+
+		while (runs[i] && runs[i] < nr &&
+		       journal_keys_same_pos(&src[runs[i] - 1], &src[runs[i]]))
+			runs[i]++;
+	}
+
+	for (i = 0; i < nr_runs; i++)
+		w[i] = (struct journal_keys_sort_work) {
+			.src	= src,
+			.l	= runs[i],
+			.r	= runs[i + 1],
+		};
+	journal_keys_sort_run(w, nr_runs, journal_keys_dedup_chunk);
+
+	kept = w[0].m;
+	for (i = 1; i < nr_runs; i++) {
+		memmove(src + kept, src + w[i].l, w[i].m * sizeof(src[0]));
+		kept += w[i].m;
+	}
+
+	kfree(w);
+
+	keys->nr = kept;
+	keys->gap = keys->nr;
+	return 0;
+}
+
 static int journal_keys_sort(struct bch_fs *c)
 {
 	struct genradix_iter iter;
@@ -522,6 +705,10 @@ static int journal_keys_sort(struct bch_fs *c)
 			};
 	}
 
+	if (keys->nr >= JOURNAL_KEYS_SORT_PARALLEL_MIN &&
+	    num_online_cpus() > 1)
+		return journal_keys_sort_parallel(keys);
+
 	sort(keys->d, keys->nr, sizeof(keys->d[0]), journal_sort_key_cmp, NULL);
 
 	src = dst = keys->d;
@@ -589,20 +776,154 @@ static int journal_sort_seq_cmp(const void *_l, const void *_r)
 	return cmp_int(l->journal_seq, r->journal_seq);
 }
 
+/*
+ * Keys are replayed in windows of journal sequence numbers: before a window
+ * is started, the journal pins for everything older than it are dropped, same
+ * as when replaying one key at a time - a window is kept small enough that
+ * journal reclaim isn't held up for long.
+ *
+ * Within a window every key is at a distinct position (keys were deduplicated
+ * when sorted), so keys are independent of each other: the window is sorted
+ * back into btree order and split into contiguous ranges, each replayed by a
+ * different worker with its own btree_trans.
+ *
+ * Keys are replayed with triggers off, and accounting was already restored by
+ * journal_replay_early(), so replay doesn't touch accounting; the one ordering
+ * constraint kept is that alloc btree updates are replayed after the rest of
+ * their window, once the updates that reference those buckets are in.
+ */
+#define JOURNAL_REPLAY_WINDOW_KEYS	(1U << 14)
+#define JOURNAL_REPLAY_WINDOW_SEQS	8
+#define JOURNAL_REPLAY_WORKERS_MAX	16
+#define JOURNAL_REPLAY_WORKER_MIN_KEYS	256
+
+struct journal_replay_work {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct journal_key	**k;
+	size_t			nr;
+	int			ret;
+};
+
+static inline bool journal_replay_btree_is_alloc(enum btree_id id)
+{
+	return id == BTREE_ID_alloc ||
+		id == BTREE_ID_lru ||
+		id == BTREE_ID_freespace ||
+		id == BTREE_ID_need_discard ||
+		id == BTREE_ID_backpointers;
+}
+
+/* Alloc btree keys last, and otherwise in btree order: */
+static int journal_replay_window_cmp(const void *_l, const void *_r)
+{
+	const struct journal_key *l = *((const struct journal_key **)_l);
+	const struct journal_key *r = *((const struct journal_key **)_r);
+
+	return  cmp_int(journal_replay_btree_is_alloc(l->btree_id),
+			journal_replay_btree_is_alloc(r->btree_id)) ?:
+		cmp_int(l, r);
+}
+
+static void journal_replay_keys_work(struct closure *cl)
+{
+	struct journal_replay_work *w =
+		container_of(cl, struct journal_replay_work, cl);
+	struct bch_fs *c = w->c;
+	struct journal_key *k;
+	size_t i;
+
+	for (i = 0; i < w->nr && !w->ret; i++) {
+		k = w->k[i];
+
+		cond_resched();
+
+		w->ret = bch2_trans_do(c, NULL, NULL,
+				       BTREE_INSERT_LAZY_RW|
+				       BTREE_INSERT_NOFAIL|
+				       (!k->allocated
+					? BTREE_INSERT_JOURNAL_REPLAY|JOURNAL_WATERMARK_reserved
+					: 0),
+				bch2_journal_replay_key(&trans, k));
+		if (w->ret)
+			bch_err(c, "journal replay: error %d while replaying key at btree %s level %u",
+				w->ret, bch2_btree_ids[k->btree_id], k->level);
+	}
+
+	closure_return(cl);
+}
+
+/* Replay @nr keys, split up across as many workers as is worthwhile: */
+static int journal_replay_keys(struct bch_fs *c, struct journal_replay_work *w,
+			       struct journal_key **keys, size_t nr)
+{
+	struct closure cl;
+	unsigned i, nr_workers =
+		clamp_t(size_t, nr / JOURNAL_REPLAY_WORKER_MIN_KEYS, 1,
+			min_t(unsigned, num_online_cpus(),
+			      JOURNAL_REPLAY_WORKERS_MAX));
+	int ret = 0;
+
+	if (!nr)
+		return 0;
+
+	closure_init_stack(&cl);
+	for (i = 0; i < nr_workers; i++) {
+		size_t l = div_u64((u64) nr * i, nr_workers);
+		size_t r = div_u64((u64) nr * (i + 1), nr_workers);
+
+		w[i] = (struct journal_replay_work) {
+			.c	= c,
+			.k	= keys + l,
+			.nr	= r - l,
+		};
+		closure_call(&w[i].cl, journal_replay_keys_work,
+			     system_unbound_wq, &cl);
+	}
+	closure_sync(&cl);
+
+	for (i = 0; i < nr_workers; i++)
+		ret = ret ?: w[i].ret;
+	return ret;
+}
+
+static int journal_replay_window(struct bch_fs *c, struct journal_replay_work *w,
+				 struct journal_key **keys, size_t nr)
+{
+	size_t nr_alloc;
+	int ret;
+
+	sort(keys, nr, sizeof(keys[0]), journal_replay_window_cmp, NULL);
+
+	for (nr_alloc = 0;
+	     nr_alloc < nr &&
+	     journal_replay_btree_is_alloc(keys[nr - nr_alloc - 1]->btree_id);
+	     nr_alloc++)
+		;
+
+	ret =   journal_replay_keys(c, w, keys, nr - nr_alloc) ?:
+		journal_replay_keys(c, w, keys + nr - nr_alloc, nr_alloc);
+	return ret;
+}
+
 static int bch2_journal_replay(struct bch_fs *c)
 {
 	struct journal_keys *keys = &c->journal_keys;
-	struct journal_key **keys_sorted, *k;
+	struct journal_key **keys_sorted;
+	struct journal_replay_work *w;
 	struct journal *j = &c->journal;
-	size_t i;
-	int ret;
+	size_t i, end;
+	int ret = 0;
 
 	move_gap(keys->d, keys->nr, keys->size, keys->gap, keys->nr);
 	keys->gap = keys->nr;
 
 	keys_sorted = kvmalloc_array(sizeof(*keys_sorted), keys->nr, GFP_KERNEL);
-	if (!keys_sorted)
-		return -ENOMEM;
+	w = kmalloc_array(JOURNAL_REPLAY_WORKERS_MAX, sizeof(*w), GFP_KERNEL);
+	if (!keys_sorted || !w) {
+		ret = -ENOMEM;
+		goto err;
+	}
 
 	for (i = 0; i < keys->nr; i++)
 		keys_sorted[i] = &keys->d[i];
@@ -611,25 +932,21 @@ static int bch2_journal_replay(struct bch_fs *c)
 	     sizeof(keys_sorted[0]),
 	     journal_sort_seq_cmp, NULL);
 
-	for (i = 0; i < keys->nr; i++) {
-		k = keys_sorted[i];
+	for (i = 0; i < keys->nr; i = end) {
+		u64 seq = keys_sorted[i]->journal_seq;
 
-		cond_resched();
+		for (end = i + 1;
+		     end < keys->nr &&
+		     end - i < JOURNAL_REPLAY_WINDOW_KEYS &&
+		     keys_sorted[end]->journal_seq < seq + JOURNAL_REPLAY_WINDOW_SEQS;
+		     end++)
+			;
 
-		replay_now_at(j, k->journal_seq);
+		replay_now_at(j, seq);
 
-		ret = bch2_trans_do(c, NULL, NULL,
-				    BTREE_INSERT_LAZY_RW|
-				    BTREE_INSERT_NOFAIL|
-				    (!k->allocated
-				     ? BTREE_INSERT_JOURNAL_REPLAY|JOURNAL_WATERMARK_reserved
-				     : 0),
-			     bch2_journal_replay_key(&trans, k));
-		if (ret) {
-			bch_err(c, "journal replay: error %d while replaying key at btree %s level %u",
-				ret, bch2_btree_ids[k->btree_id], k->level);
+		ret = journal_replay_window(c, w, keys_sorted + i, end - i);
+		if (ret)
 			goto err;
-		}
 	}
 
 	replay_now_at(j, j->replay_journal_seq_end);
@@ -642,6 +959,7 @@ static int bch2_journal_replay(struct bch_fs *c)
 	if (keys->nr && !ret)
 		bch2_journal_log_msg(&c->journal, "journal replay finished");
 err:
+	kfree(w);
 	kvfree(keys_sorted);
 	return ret;
 }
@@ -1040,12 +1358,84 @@ err:
 	return ret;
 }
 
+/* fsck_quick: */
+
+/*
+ * The fsck_checkpoint section is only valid if we shut down cleanly, with the
+ * same clean section it was last updated for - otherwise, some btrees may have
+ * been written to without being recorded, by an unclean shutdown or an older
+ * version:
+ */
+static void bch2_fsck_checkpoint_read(struct bch_fs *c,
+				      struct bch_sb_field_clean *clean)
+{
+	struct bch_sb_field_fsck_checkpoint *cp;
+
+	mutex_lock(&c->sb_lock);
+	cp = bch2_sb_get_fsck_checkpoint(c->disk_sb.sb);
+
+	c->fsck_checkpoint_valid = cp && clean &&
+		cp->journal_seq &&
+		cp->journal_seq == clean->journal_seq &&
+		!BCH_SB_HAS_ERRORS(c->disk_sb.sb);
+
+	/* Invalidated on disk before we go rw and write anything: */
+	if (cp && !c->fsck_checkpoint_valid)
+		cp->journal_seq = 0;
+	mutex_unlock(&c->sb_lock);
+
+	if (!c->opts.fsck_quick || c->opts.fsck)
+		return;
+
+	c->opts.fsck = true;
+
+	if (!c->fsck_checkpoint_valid) {
+		bch_info(c, "no valid fsck checkpoint, running full fsck");
+	} else if (!cp->btrees_written) {
+		bch_info(c, "no btrees written since last fsck, skipping fsck");
+		c->opts.fsck = false;
+	} else {
+		struct printbuf buf = PRINTBUF;
+		unsigned i;
+
+		c->fsck_btrees = le64_to_cpu(cp->btrees_written);
+
+		for (i = 0; i < BTREE_ID_NR; i++)
+			if (c->fsck_btrees & (1UL << i))
+				prt_printf(&buf, " %s", bch2_btree_ids[i]);
+		bch_info(c, "quick fsck, btrees written since last fsck:%s", buf.buf);
+		printbuf_exit(&buf);
+	}
+}
+
+/*
+ * fsck completed without errors: start a new checkpoint, which becomes valid
+ * at the next clean shutdown. Called with sb_lock held:
+ */
+static void bch2_fsck_checkpoint_reset(struct bch_fs *c)
+{
+	struct bch_sb_field_fsck_checkpoint *cp =
+		bch2_sb_resize_fsck_checkpoint(&c->disk_sb,
+					       sizeof(*cp) / sizeof(u64));
+
+	if (!cp) {
+		bch_err(c, "error resizing superblock for fsck checkpoint");
+		return;
+	}
+
+	cp->journal_seq		= 0;
+	cp->btrees_written	= 0;
+	c->btrees_written	= 0;
+	c->fsck_checkpoint_valid = true;
+}
+
 int bch2_fs_recovery(struct bch_fs *c)
 {
 	const char *err = "cannot allocate memory";
 	struct bch_sb_field_clean *clean = NULL;
 	struct jset *last_journal_entry = NULL;
 	u64 blacklist_seq, journal_seq;
+	u64 start_time;
 	bool write_sb = false;
 	int ret = 0;
 
@@ -1095,6 +1485,8 @@ int bch2_fs_recovery(struct bch_fs *c)
 		}
 	}
 
+	bch2_fsck_checkpoint_read(c, clean);
+
 	if (c->opts.fsck && c->opts.norecovery) {
 		bch_err(c, "cannot select both norecovery and fsck");
 		ret = -EINVAL;
@@ -1112,9 +1504,11 @@ int bch2_fs_recovery(struct bch_fs *c)
 		struct journal_replay **i;
 
 		bch_verbose(c, "starting journal read");
+		start_time = local_clock();
 		ret = bch2_journal_read(c, &blacklist_seq, &journal_seq);
 		if (ret)
 			goto err;
+		bch2_time_stats_update(&c->times[BCH_TIME_recovery_journal_read], start_time);
 
 		genradix_for_each_reverse(&c->journal_entries, iter, i)
 			if (*i && !(*i)->ignore) {
@@ -1136,9 +1530,11 @@ int bch2_fs_recovery(struct bch_fs *c)
 			goto use_clean;
 		}
 
+		start_time = local_clock();
 		ret = journal_keys_sort(c);
 		if (ret)
 			goto err;
+		bch2_time_stats_update(&c->times[BCH_TIME_recovery_journal_keys_sort], start_time);
 
 		if (c->sb.clean && last_journal_entry) {
 			ret = verify_superblock_clean(c, &clean,
@@ -1212,12 +1608,14 @@ use_clean:
 	bch_verbose(c, "starting alloc read");
 	err = "error reading allocation information";
 
+	start_time = local_clock();
 	down_read(&c->gc_lock);
 	ret = bch2_alloc_read(c);
 	up_read(&c->gc_lock);
 
 	if (ret)
 		goto err;
+	bch2_time_stats_update(&c->times[BCH_TIME_recovery_alloc_read], start_time);
 	bch_verbose(c, "alloc read done");
 
 	bch_verbose(c, "starting stripes_read");
@@ -1252,9 +1650,11 @@ use_clean:
 
 		bch_info(c, "starting journal replay, %zu keys", c->journal_keys.nr);
 		err = "journal replay failed";
+		start_time = local_clock();
 		ret = bch2_journal_replay(c);
 		if (ret)
 			goto err;
+		bch2_time_stats_update(&c->times[BCH_TIME_recovery_journal_replay], start_time);
 		if (c->opts.verbose || !c->sb.clean)
 			bch_info(c, "journal replay done");
 
@@ -1308,9 +1708,11 @@ use_clean:
 
 		bch_verbose(c, "starting journal replay, %zu keys", c->journal_keys.nr);
 		err = "journal replay failed";
+		start_time = local_clock();
 		ret = bch2_journal_replay(c);
 		if (ret)
 			goto err;
+		bch2_time_stats_update(&c->times[BCH_TIME_recovery_journal_replay], start_time);
 		if (c->opts.verbose || !c->sb.clean)
 			bch_info(c, "journal replay done");
 	}
@@ -1386,6 +1788,8 @@ use_clean:
 	    !test_bit(BCH_FS_ERRORS_NOT_FIXED, &c->flags)) {
 		SET_BCH_SB_HAS_ERRORS(c->disk_sb.sb, 0);
 		SET_BCH_SB_HAS_TOPOLOGY_ERRORS(c->disk_sb.sb, 0);
+		if (!c->opts.nochanges)
+			bch2_fsck_checkpoint_reset(c);
 		write_sb = true;
 	}
 
@@ -264,6 +264,145 @@ static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 	return ret ? bkey_s_c_err(ret) : bkey_s_c_null;
 }
 
+/*
+ * Maximum number of source reflink pointers a single destination reflink
+ * pointer is extended to cover: each indirect extent it spans gets its
+ * refcount updated in the same transaction, so this bounds transaction size:
+ */
+#define REMAP_BATCH_MAX		16
+
+/*
+ * Returns the end, in the source, of the run of reflink pointers starting with
+ * @src_k that point to contiguous indirect extents, so that they can be remapped
+ * with a single reflink pointer in the destination - one transaction instead
+ * of one per source extent:
+ */
+static int remap_reflink_p_run_end(struct btree_trans *trans,
+				   struct btree_iter *src_iter,
+				   struct bkey_s_c_reflink_p src_p,
+				   u64 src_want, u64 src_end, u64 *end)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 next_idx = le64_to_cpu(src_p.v->idx) + src_p.k->size;
+	unsigned nr;
+	int ret = 0;
+
+	*end = src_p.k->p.offset;
+
+	bch2_trans_copy_iter(&iter, src_iter);
+
+	for (nr = 1; nr < REMAP_BATCH_MAX && *end < src_end; nr++) {
+		struct bkey_s_c_reflink_p p;
+
+		bch2_btree_iter_set_pos(&iter, POS(src_iter->pos.inode, *end));
+		k = bch2_btree_iter_peek_slot(&iter);
+		ret = bkey_err(k);
+		if (ret)
+			break;
+
+		if (k.k->type != KEY_TYPE_reflink_p ||
+		    bkey_start_offset(k.k) != *end)
+			break;
+
+		p = bkey_s_c_to_reflink_p(k);
+		if (le64_to_cpu(p.v->idx) != next_idx ||
+		    k.k->p.offset - src_want > KEY_SIZE_MAX)
+			break;
+
+		*end = k.k->p.offset;
+		next_idx += k.k->size;
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/* Returns 1 if the key at @iter isn't @want anymore: */
+static int dedupe_key_changed(struct btree_iter *iter, struct bkey_i *want)
+{
+	struct bkey_s_c k = bch2_btree_iter_peek_slot(iter);
+	int ret = bkey_err(k);
+
+	if (ret)
+		return ret;
+
+	return  bpos_cmp(k.k->p, want->k.p) ||
+		k.k->type != want->k.type ||
+		k.k->size != want->k.size ||
+		bkey_val_bytes(k.k) != bkey_val_bytes(&want->k) ||
+		memcmp(k.v, &want->v, bkey_val_bytes(k.k));
+}
+
+/*
+ * Replace @dst with a reflink pointer to the data @src refers to, making @src
+ * indirect first if it isn't already: the caller is responsible for checking
+ * that they have the same contents. Both are overwritten in their own
+ * snapshot, since the data doesn't change for descendent snapshots either.
+ *
+ * Returns 1, doing nothing, if either key has changed since the caller looked
+ * them up; on success @src is updated to the reflink pointer it now is.
+ */
+int bch2_dedupe_extent(struct btree_trans *trans,
+		       struct bkey_buf *src, struct bkey_i *dst)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter src_iter, dst_iter;
+	struct bkey_i *s;
+	struct bkey_i_reflink_p *dst_p;
+	int ret;
+
+	if (src->k->k.size != dst->k.size)
+		return -EINVAL;
+
+	bch2_trans_iter_init(trans, &src_iter, BTREE_ID_extents,
+			     bkey_start_pos(&src->k->k), BTREE_ITER_INTENT);
+	bch2_trans_iter_init(trans, &dst_iter, BTREE_ID_extents,
+			     bkey_start_pos(&dst->k), BTREE_ITER_INTENT);
+
+	ret =   dedupe_key_changed(&src_iter, src->k) ?:
+		dedupe_key_changed(&dst_iter, dst);
+	if (ret)
+		goto err;
+
+	/* bch2_make_extent_indirect() turns @s into a reflink pointer: */
+	s = bch2_trans_kmalloc(trans, max(bkey_bytes(&src->k->k),
+					  sizeof(struct bkey_i_reflink_p)));
+	ret = PTR_ERR_OR_ZERO(s);
+	if (ret)
+		goto err;
+
+	bkey_copy(s, src->k);
+
+	if (s->k.type != KEY_TYPE_reflink_p) {
+		bch2_check_set_feature(c, BCH_FEATURE_reflink);
+
+		ret = bch2_make_extent_indirect(trans, &src_iter, s);
+		if (ret)
+			goto err;
+	}
+
+	dst_p = bch2_trans_kmalloc(trans, sizeof(*dst_p));
+	ret = PTR_ERR_OR_ZERO(dst_p);
+	if (ret)
+		goto err;
+
+	bkey_reflink_p_init(&dst_p->k_i);
+	dst_p->k.p	= dst->k.p;
+	bch2_key_resize(&dst_p->k, dst->k.size);
+	dst_p->v.idx	= bkey_i_to_reflink_p(s)->v.idx;
+
+	ret =   bch2_trans_update(trans, &dst_iter, &dst_p->k_i,
+				  BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE) ?:
+		bch2_trans_commit(trans, NULL, NULL, BTREE_INSERT_NOFAIL);
+	if (!ret)
+		bch2_bkey_buf_copy(src, c, s);
+err:
+	bch2_trans_iter_exit(trans, &dst_iter);
+	bch2_trans_iter_exit(trans, &src_iter);
+	return ret;
+}
+
 s64 bch2_remap_range(struct bch_fs *c,
 		     subvol_inum dst_inum, u64 dst_offset,
 		     subvol_inum src_inum, u64 src_offset,
@@ -278,7 +417,7 @@ s64 bch2_remap_range(struct bch_fs *c,
 	struct bpos src_start = POS(src_inum.inum, src_offset);
 	struct bpos dst_end = dst_start, src_end = src_start;
 	struct bpos src_want;
-	u64 dst_done;
+	u64 dst_done, src_k_end;
 	u32 dst_snapshot, src_snapshot;
 	int ret = 0, ret2 = 0;
 
@@ -368,19 +507,25 @@ s64 bch2_remap_range(struct bch_fs *c,
 				 bkey_start_offset(src_k.k));
 
 			dst_p->v.idx = cpu_to_le64(offset);
+
+			ret = remap_reflink_p_run_end(&trans, &src_iter, src_p,
+						      src_want.offset,
+						      src_end.offset, &src_k_end);
+			if (ret)
+				continue;
 		} else {
 			BUG();
 		}
 
 		new_dst.k->k.p = dst_iter.pos;
 		bch2_key_resize(&new_dst.k->k,
-				min(src_k.k->p.offset - src_want.offset,
+				min(src_k_end - src_want.offset,
 				    dst_end.offset - dst_iter.pos.offset));
 
 		ret = bch2_extent_update(&trans, dst_inum, &dst_iter,
 					 new_dst.k, &disk_res, NULL,
 					 new_i_size, i_sectors_delta,
-					 true);
+					 BCH_WRITE_CHECK_ENOSPC);
 		bch2_disk_reservation_put(c, &disk_res);
 	}
 	bch2_trans_iter_exit(&trans, &dst_iter);
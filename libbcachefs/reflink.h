@@ -73,4 +73,7 @@ static inline __le64 *bkey_refcount(struct bkey_i *k)
 s64 bch2_remap_range(struct bch_fs *, subvol_inum, u64,
 		     subvol_inum, u64, u64, u64, s64 *);
 
+struct bkey_buf;
+int bch2_dedupe_extent(struct btree_trans *, struct bkey_buf *, struct bkey_i *);
+
 #endif /* _BCACHEFS_REFLINK_H */
@@ -6,6 +6,8 @@
 #include "replicas.h"
 #include "super-io.h"
 
+#include <linux/jhash.h>
+
 static int bch2_cpu_replicas_to_sb_replicas(struct bch_fs *,
 					    struct bch_replicas_cpu *);
 
@@ -211,12 +213,67 @@ static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 	return idx < r->nr ? idx : -1;
 }
 
+static inline u32 replicas_entry_hash(struct bch_replicas_entry *e)
+{
+	return jhash(e, replicas_entry_bytes(e), 0);
+}
+
+static struct bch_replicas_hash *replicas_hash_build(struct bch_replicas_cpu *r)
+{
+	struct bch_replicas_hash *h;
+	unsigned i, nr = roundup_pow_of_two(max(r->nr * 2, 16U));
+
+	h = kvzalloc(struct_size(h, idx, nr), GFP_KERNEL);
+	if (!h)
+		return NULL;
+
+	h->mask = nr - 1;
+
+	for (i = 0; i < r->nr; i++) {
+		unsigned slot = replicas_entry_hash(cpu_replicas_entry(r, i));
+
+		while (h->idx[slot & h->mask])
+			slot++;
+		h->idx[slot & h->mask] = i + 1;
+	}
+
+	return h;
+}
+
+static inline int replicas_hash_idx(struct bch_replicas_hash *h,
+				    struct bch_replicas_cpu *r,
+				    struct bch_replicas_entry *search)
+{
+	unsigned bytes = replicas_entry_bytes(search);
+	unsigned slot = replicas_entry_hash(search);
+	u32 idx;
+
+	if (unlikely(bytes > r->entry_size))
+		return -1;
+
+	verify_replicas_entry(search);
+
+	while ((idx = h->idx[slot++ & h->mask]))
+		if (!memcmp(cpu_replicas_entry(r, idx - 1), search, bytes))
+			return idx - 1;
+
+	return -1;
+}
+
+static inline int replicas_entry_idx(struct bch_fs *c,
+				     struct bch_replicas_entry *search)
+{
+	return likely(c->replicas_hash)
+		? replicas_hash_idx(c->replicas_hash, &c->replicas, search)
+		: __replicas_entry_idx(&c->replicas, search);
+}
+
 int bch2_replicas_entry_idx(struct bch_fs *c,
 			    struct bch_replicas_entry *search)
 {
 	bch2_replicas_entry_sort(search);
 
-	return __replicas_entry_idx(&c->replicas, search);
+	return replicas_entry_idx(c, search);
 }
 
 static bool __replicas_has_entry(struct bch_replicas_cpu *r,
@@ -236,7 +293,7 @@ bool bch2_replicas_marked(struct bch_fs *c,
 	verify_replicas_entry(search);
 
 	percpu_down_read(&c->mark_lock);
-	marked = __replicas_has_entry(&c->replicas, search) &&
+	marked = replicas_entry_idx(c, search) >= 0 &&
 		(likely((!c->replicas_gc.entries)) ||
 		 __replicas_has_entry(&c->replicas_gc, search));
 	percpu_up_read(&c->mark_lock);
@@ -291,6 +348,7 @@ static int replicas_table_update(struct bch_fs *c,
 	struct bch_fs_usage_online *new_scratch = NULL;
 	struct bch_fs_usage __percpu *new_gc = NULL;
 	struct bch_fs_usage *new_base = NULL;
+	struct bch_replicas_hash *new_hash = NULL;
 	unsigned i, bytes = sizeof(struct bch_fs_usage) +
 		sizeof(u64) * new_r->nr;
 	unsigned scratch_bytes = sizeof(struct bch_fs_usage_online) +
@@ -306,6 +364,7 @@ static int replicas_table_update(struct bch_fs *c,
 
 	if (!(new_base = kzalloc(bytes, GFP_KERNEL)) ||
 	    !(new_scratch  = kmalloc(scratch_bytes, GFP_KERNEL)) ||
+	    !(new_hash = replicas_hash_build(new_r)) ||
 	    (c->usage_gc &&
 	     !(new_gc = __alloc_percpu_gfp(bytes, sizeof(u64), GFP_KERNEL))))
 		goto err;
@@ -327,7 +386,9 @@ static int replicas_table_update(struct bch_fs *c,
 	swap(c->usage_scratch,	new_scratch);
 	swap(c->usage_gc,	new_gc);
 	swap(c->replicas,	*new_r);
+	swap(c->replicas_hash,	new_hash);
 out:
+	kvfree(new_hash);
 	free_percpu(new_gc);
 	kfree(new_scratch);
 	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
@@ -1055,6 +1116,7 @@ void bch2_fs_replicas_exit(struct bch_fs *c)
 	kfree(c->usage_base);
 	kfree(c->replicas.entries);
 	kfree(c->replicas_gc.entries);
+	kvfree(c->replicas_hash);
 
 	mempool_exit(&c->replicas_delta_pool);
 }
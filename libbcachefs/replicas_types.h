@@ -7,4 +7,14 @@ struct bch_replicas_cpu {
 	struct bch_replicas_entry *entries;
 };
 
+/*
+ * Open addressing hash table of indexes into c->replicas, so that lookups on
+ * the accounting paths don't have to do a bsearch with variable length
+ * memcmps. Slots hold idx + 1, 0 is empty:
+ */
+struct bch_replicas_hash {
+	unsigned		mask;
+	u32			idx[];
+};
+
 #endif /* _BCACHEFS_REPLICAS_TYPES_H */
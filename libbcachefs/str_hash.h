@@ -12,6 +12,7 @@
 #include "super.h"
 
 #include <linux/crc32c.h>
+#include <linux/xxhash.h>
 #include <crypto/hash.h>
 #include <crypto/sha2.h>
 
@@ -27,6 +28,8 @@ bch2_str_hash_opt_to_type(struct bch_fs *c, enum bch_str_hash_opts opt)
 		return c->sb.features & (1ULL << BCH_FEATURE_new_siphash)
 			? BCH_STR_HASH_siphash
 			: BCH_STR_HASH_siphash_old;
+	case BCH_STR_HASH_OPT_xxh3:
+		return BCH_STR_HASH_xxh3;
 	default:
 	     BUG();
 	}
@@ -35,7 +38,7 @@ bch2_str_hash_opt_to_type(struct bch_fs *c, enum bch_str_hash_opts opt)
 struct bch_hash_info {
 	u8			type;
 	/*
-	 * For crc32 or crc64 string hashes the first key value of
+	 * For crc32, crc64 or xxh3 string hashes the first key value of
 	 * the siphash_key (k0) is used as the key.
 	 */
 	SIPHASH_KEY	siphash_key;
@@ -70,6 +73,7 @@ struct bch_str_hash_ctx {
 		u32		crc32c;
 		u64		crc64;
 		SIPHASH_CTX	siphash;
+		struct xxh3_state xxh3;
 	};
 };
 
@@ -89,6 +93,9 @@ static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_siphash:
 		SipHash24_Init(&ctx->siphash, &info->siphash_key);
 		break;
+	case BCH_STR_HASH_xxh3:
+		xxh3_reset(&ctx->xxh3, info->siphash_key.k0);
+		break;
 	default:
 		BUG();
 	}
@@ -109,6 +116,9 @@ static inline void bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_siphash:
 		SipHash24_Update(&ctx->siphash, data, len);
 		break;
+	case BCH_STR_HASH_xxh3:
+		xxh3_update(&ctx->xxh3, data, len);
+		break;
 	default:
 		BUG();
 	}
@@ -125,6 +135,8 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_siphash_old:
 	case BCH_STR_HASH_siphash:
 		return SipHash24_End(&ctx->siphash) >> 1;
+	case BCH_STR_HASH_xxh3:
+		return xxh3_64_digest(&ctx->xxh3) >> 1;
 	default:
 		BUG();
 	}
@@ -165,6 +177,37 @@ bch2_hash_lookup(struct btree_trans *trans,
 	if (ret)
 		return ret;
 
+	/*
+	 * Read only lookups try the key cache first, at the key's first slot:
+	 * that's the only place it can be unless there was a hash collision.
+	 * Key cache lookups are at an exact snapshot ID, so this is only
+	 * correct when the snapshot has no ancestors that could hold the key:
+	 */
+	if (!(flags & BTREE_ITER_INTENT) &&
+	    btree_id_cached(trans->c, desc.btree_id) &&
+	    !bch2_snapshot_parent(trans->c, snapshot) &&
+	    test_bit(JOURNAL_REPLAY_DONE, &trans->c->journal.flags)) {
+		bch2_trans_iter_init(trans, iter, desc.btree_id,
+			   SPOS(inum.inum, desc.hash_key(info, key), snapshot),
+			   BTREE_ITER_CACHED|flags);
+		k = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(k);
+		if (ret)
+			goto err;
+
+		if (is_visible_key(desc, inum, k) && !desc.cmp_key(k, key))
+			return 0;
+
+		/* hole, not found: */
+		if (k.k->type == KEY_TYPE_deleted) {
+			ret = -ENOENT;
+			goto err;
+		}
+
+		/* collision or whiteout: walk the hash chain */
+		bch2_trans_iter_exit(trans, iter);
+	}
+
 	for_each_btree_key_upto_norestart(trans, *iter, desc.btree_id,
 			   SPOS(inum.inum, desc.hash_key(info, key), snapshot),
 			   POS(inum.inum, U64_MAX),
@@ -179,6 +222,7 @@ bch2_hash_lookup(struct btree_trans *trans,
 			break;
 		}
 	}
+err:
 	bch2_trans_iter_exit(trans, iter);
 
 	return ret ?: -ENOENT;
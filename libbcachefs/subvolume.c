@@ -3,11 +3,14 @@
 #include "bcachefs.h"
 #include "btree_key_cache.h"
 #include "btree_update.h"
+#include "dirent.h"
 #include "errcode.h"
 #include "error.h"
 #include "fs.h"
 #include "subvolume.h"
 
+#include <linux/sort.h>
+
 /* Snapshot tree: */
 
 void bch2_snapshot_to_text(struct printbuf *out, struct bch_fs *c,
@@ -75,34 +78,207 @@ int bch2_snapshot_invalid(const struct bch_fs *c, struct bkey_s_c k,
 	return 0;
 }
 
+/*
+ * The snapshot table: readers go through rcu_dereference(c->snapshots) with no
+ * locking; updaters, under snapshot_table_lock, modify a private copy and
+ * publish it with rcu_assign_pointer(), so a published table is never written
+ * to:
+ */
+
+static inline struct snapshot_t *__snapshot_t_mut(struct snapshot_table *t, u32 id)
+{
+	return (struct snapshot_t *) __snapshot_t(t, id);
+}
+
+static inline struct snapshot_table *snapshot_table_locked(struct bch_fs *c)
+{
+	return rcu_dereference_protected(c->snapshots,
+				lockdep_is_held(&c->snapshot_table_lock));
+}
+
+/* Copy of @old, with room for at least @nr entries: */
+static struct snapshot_table *snapshot_table_copy(struct snapshot_table *old, size_t nr)
+{
+	struct snapshot_table *new;
+
+	nr = max(nr, old ? old->nr : 0);
+
+	new = kvzalloc(struct_size(new, s, nr), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	new->nr = nr;
+	if (old)
+		memcpy(new->s, old->s, sizeof(old->s[0]) * old->nr);
+	return new;
+}
+
+/* Grow a table that hasn't been published yet, so that it holds @id: */
+static int snapshot_table_resize(struct snapshot_table **t, u32 id)
+{
+	size_t idx = U32_MAX - id;
+	struct snapshot_table *new;
+
+	if (*t && idx < (*t)->nr)
+		return 0;
+
+	new = snapshot_table_copy(*t, roundup_pow_of_two(idx + 1));
+	if (!new)
+		return -ENOMEM;
+
+	kvfree(*t);
+	*t = new;
+	return 0;
+}
+
+static void snapshot_table_publish(struct bch_fs *c, struct snapshot_table *new)
+{
+	struct snapshot_table *old = snapshot_table_locked(c);
+
+	rcu_assign_pointer(c->snapshots, new);
+	if (old)
+		kvfree_rcu(old, rcu);
+}
+
+/*
+ * Compute the ancestor bitmap and jump pointer of a node from its parent's, so
+ * the parent's have to be up to date: jump pointers are the skew binary scheme
+ * from Myers, "An applicative random-access stack", for O(log depth) ancestor
+ * lookups.
+ */
+static void bch2_snapshot_set_ancestors(struct snapshot_table *table, u32 id)
+{
+	struct snapshot_t *t = __snapshot_t_mut(table, id);
+	const struct snapshot_t *p, *pskip, *pskip2;
+	u32 a;
+
+	memset(t->is_ancestor, 0, sizeof(t->is_ancestor));
+	t->depth	= 0;
+	t->skip		= 0;
+
+	if (!t->parent)
+		return;
+
+	p = __snapshot_t(table, t->parent);
+	if (!p) /* nonexistent parent, check_snapshots() will complain */
+		return;
+
+	t->depth	= p->depth + 1;
+	t->skip		= t->parent;
+
+	if (p->skip) {
+		pskip	= __snapshot_t(table, p->skip);
+		pskip2	= pskip && pskip->skip ? __snapshot_t(table, pskip->skip) : NULL;
+
+		if (pskip2 &&
+		    p->depth - pskip->depth ==
+		    pskip->depth - pskip2->depth)
+			t->skip = pskip->skip;
+	}
+
+	for (a = t->parent, p = __snapshot_t(table, a);
+	     a && p && a - id <= SNAPSHOT_ANCESTOR_BITMAP;
+	     a = p->parent, p = __snapshot_t(table, a))
+		__set_bit(a - id - 1, t->is_ancestor);
+}
+
+/*
+ * When snapshots are first read in, parents are seen after their children; walk
+ * them again in reverse. Parents have higher ids, and table indices are
+ * U32_MAX - id:
+ */
+static void bch2_snapshots_set_ancestors(struct snapshot_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->nr; i++)
+		bch2_snapshot_set_ancestors(t, U32_MAX - i);
+}
+
+static struct snapshot_t_update snapshot_t_update_init(struct bkey_s_c k)
+{
+	struct snapshot_t_update u = { .id = k.k->p.offset };
+
+	if (k.k->type == KEY_TYPE_snapshot) {
+		struct bkey_s_c_snapshot s = bkey_s_c_to_snapshot(k);
+
+		u.parent	= le32_to_cpu(s.v->parent);
+		u.children[0]	= le32_to_cpu(s.v->children[0]);
+		u.children[1]	= le32_to_cpu(s.v->children[1]);
+		u.subvol	= BCH_SNAPSHOT_SUBVOL(s.v) ? le32_to_cpu(s.v->subvol) : 0;
+	}
+
+	return u;
+}
+
+static void __bch2_mark_snapshot(struct snapshot_table *table,
+				 const struct snapshot_t_update *u)
+{
+	struct snapshot_t *t = __snapshot_t_mut(table, u->id);
+
+	t->parent	= u->parent;
+	t->children[0]	= u->children[0];
+	t->children[1]	= u->children[1];
+	t->subvol	= u->subvol;
+}
+
+/*
+ * The trigger only records the update: copying and publishing the whole table
+ * for every key would be quadratic for transactions that touch many snapshot
+ * keys. bch2_snapshot_updates_publish() applies them all to one copy, at
+ * commit:
+ */
 int bch2_mark_snapshot(struct btree_trans *trans,
 		       struct bkey_s_c old, struct bkey_s_c new,
 		       unsigned flags)
+{
+	return darray_push(&trans->snapshot_updates, snapshot_t_update_init(new));
+}
+
+static int snapshot_t_update_id_cmp(const void *_l, const void *_r)
+{
+	const struct snapshot_t_update *l = _l, *r = _r;
+
+	return -cmp_int(l->id, r->id);
+}
+
+int bch2_snapshot_updates_publish(struct btree_trans *trans)
 {
 	struct bch_fs *c = trans->c;
-	struct snapshot_t *t;
+	struct snapshot_t_update *u;
+	struct snapshot_table *t;
+	u32 min_id = U32_MAX;
+	int ret = 0;
 
-	t = genradix_ptr_alloc(&c->snapshots,
-			       U32_MAX - new.k->p.offset,
-			       GFP_KERNEL);
-	if (!t)
-		return -ENOMEM;
+	if (likely(!trans->snapshot_updates.nr))
+		return 0;
 
-	if (new.k->type == KEY_TYPE_snapshot) {
-		struct bkey_s_c_snapshot s = bkey_s_c_to_snapshot(new);
+	darray_for_each(trans->snapshot_updates, u)
+		min_id = min(min_id, u->id);
 
-		t->parent	= le32_to_cpu(s.v->parent);
-		t->children[0]	= le32_to_cpu(s.v->children[0]);
-		t->children[1]	= le32_to_cpu(s.v->children[1]);
-		t->subvol	= BCH_SNAPSHOT_SUBVOL(s.v) ? le32_to_cpu(s.v->subvol) : 0;
-	} else {
-		t->parent	= 0;
-		t->children[0]	= 0;
-		t->children[1]	= 0;
-		t->subvol	= 0;
+	mutex_lock(&c->snapshot_table_lock);
+	t = snapshot_table_copy(snapshot_table_locked(c), U32_MAX - min_id + 1);
+	if (!t) {
+		ret = -ENOMEM;
+		goto err;
 	}
 
-	return 0;
+	/* in the order the updates were made, so the last update of a key wins: */
+	darray_for_each(trans->snapshot_updates, u)
+		__bch2_mark_snapshot(t, u);
+
+	/* parents have higher ids, and the ancestors of a node depend on its parent's: */
+	sort(trans->snapshot_updates.data, trans->snapshot_updates.nr,
+	     sizeof(trans->snapshot_updates.data[0]),
+	     snapshot_t_update_id_cmp, NULL);
+	darray_for_each(trans->snapshot_updates, u)
+		bch2_snapshot_set_ancestors(t, u->id);
+
+	snapshot_table_publish(c, t);
+err:
+	mutex_unlock(&c->snapshot_table_lock);
+	trans->snapshot_updates.nr = 0;
+	return ret;
 }
 
 static int snapshot_lookup(struct btree_trans *trans, u32 id,
@@ -141,9 +317,11 @@ static int snapshot_live(struct btree_trans *trans, u32 id)
 	return !BCH_SNAPSHOT_DELETED(&v);
 }
 
-static int bch2_snapshot_set_equiv(struct btree_trans *trans, struct bkey_s_c k)
+static int bch2_snapshot_set_equiv(struct btree_trans *trans,
+				   struct snapshot_table *t,
+				   struct bkey_s_c k)
 {
-	struct bch_fs *c = trans->c;
+	const struct snapshot_t *s;
 	unsigned i, nr_live = 0, live_idx = 0;
 	struct bkey_s_c_snapshot snap;
 	u32 id = k.k->p.offset, child[2];
@@ -166,9 +344,8 @@ static int bch2_snapshot_set_equiv(struct btree_trans *trans, struct bkey_s_c k)
 		nr_live += ret;
 	}
 
-	snapshot_t(c, id)->equiv = nr_live == 1
-		? snapshot_t(c, child[live_idx])->equiv
-		: id;
+	s = nr_live == 1 ? __snapshot_t(t, child[live_idx]) : NULL;
+	__snapshot_t_mut(t, id)->equiv = s ? s->equiv : id;
 	return 0;
 }
 
@@ -346,25 +523,53 @@ int bch2_fs_check_subvols(struct bch_fs *c)
 
 void bch2_fs_snapshots_exit(struct bch_fs *c)
 {
-	genradix_free(&c->snapshots);
+	kvfree(rcu_dereference_protected(c->snapshots, 1));
+	c->snapshots = NULL;
 }
 
+static int snapshot_start_key(struct btree_trans *trans,
+			      struct snapshot_table **t,
+			      struct bkey_s_c k)
+{
+	struct snapshot_t_update u = snapshot_t_update_init(k);
+	int ret = snapshot_table_resize(t, k.k->p.offset);
+	if (ret)
+		return ret;
+
+	__bch2_mark_snapshot(*t, &u);
+	return bch2_snapshot_set_equiv(trans, *t, k);
+}
+
+/*
+ * Build the whole table privately and publish it once, instead of copying it
+ * for every key:
+ */
 int bch2_fs_snapshots_start(struct bch_fs *c)
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
+	struct snapshot_table *t = NULL;
 	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_key2(&trans, iter, BTREE_ID_snapshots,
-			   POS_MIN, 0, k,
-		bch2_mark_snapshot(&trans, bkey_s_c_null, k, 0) ?:
-		bch2_snapshot_set_equiv(&trans, k));
+	ret = for_each_btree_key2(&trans, iter, BTREE_ID_snapshots,
+				  POS_MIN, 0, k,
+		snapshot_start_key(&trans, &t, k));
 
 	bch2_trans_exit(&trans);
 
+	if (!ret && t) {
+		bch2_snapshots_set_ancestors(t);
+
+		mutex_lock(&c->snapshot_table_lock);
+		snapshot_table_publish(c, t);
+		mutex_unlock(&c->snapshot_table_lock);
+		t = NULL;
+	}
+	kvfree(t);
+
 	if (ret)
 		bch_err(c, "error starting snapshots: %s", bch2_err_str(ret));
 	return ret;
@@ -535,7 +740,8 @@ int bch2_snapshot_node_create(struct btree_trans *trans, u32 parent,
 		SET_BCH_SNAPSHOT_SUBVOL(&n->v, true);
 
 		ret   = bch2_trans_update(trans, &iter, &n->k_i, 0) ?:
-			bch2_mark_snapshot(trans, bkey_s_c_null, bkey_i_to_s_c(&n->k_i), 0);
+			bch2_mark_snapshot(trans, bkey_s_c_null, bkey_i_to_s_c(&n->k_i), 0) ?:
+			bch2_snapshot_updates_publish(trans);
 		if (ret)
 			goto err;
 
@@ -589,13 +795,13 @@ static int snapshot_delete_key(struct btree_trans *trans,
 			       struct bpos *last_pos)
 {
 	struct bch_fs *c = trans->c;
-	u32 equiv = snapshot_t(c, k.k->p.snapshot)->equiv;
+	u32 equiv = bch2_snapshot_equiv(c, k.k->p.snapshot);
 
 	if (bkey_cmp(k.k->p, *last_pos))
 		equiv_seen->nr = 0;
 	*last_pos = k.k->p;
 
-	if (snapshot_list_has_id(deleted, k.k->p.snapshot) ||
+	if (snapshot_list_has_id_sorted(deleted, k.k->p.snapshot) ||
 	    snapshot_list_has_id(equiv_seen, equiv)) {
 		return bch2_btree_delete_at(trans, iter,
 					    BTREE_UPDATE_INTERNAL_SNAPSHOT_NODE);
@@ -604,6 +810,48 @@ static int snapshot_delete_key(struct btree_trans *trans,
 	}
 }
 
+/*
+ * Recompute equivalence classes: this walks the snapshots btree, so it can't
+ * hold snapshot_table_lock; compute them in a private copy of the table, then
+ * apply them to the current table - which may have gained nodes meanwhile:
+ */
+static int bch2_snapshots_set_equiv(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct snapshot_table *t, *new;
+	size_t i;
+	int ret;
+
+	mutex_lock(&c->snapshot_table_lock);
+	t = snapshot_table_copy(snapshot_table_locked(c), 0);
+	mutex_unlock(&c->snapshot_table_lock);
+	if (!t)
+		return -ENOMEM;
+
+	ret = for_each_btree_key2(trans, iter, BTREE_ID_snapshots,
+				  POS_MIN, 0, k,
+		snapshot_table_resize(&t, k.k->p.offset) ?:
+		bch2_snapshot_set_equiv(trans, t, k));
+	if (ret)
+		goto err;
+
+	mutex_lock(&c->snapshot_table_lock);
+	new = snapshot_table_copy(snapshot_table_locked(c), t->nr);
+	if (new) {
+		for (i = 0; i < t->nr; i++)
+			new->s[i].equiv = t->s[i].equiv;
+		snapshot_table_publish(c, new);
+	} else {
+		ret = -ENOMEM;
+	}
+	mutex_unlock(&c->snapshot_table_lock);
+err:
+	kvfree(t);
+	return ret;
+}
+
 static int bch2_delete_redundant_snapshot(struct btree_trans *trans, struct btree_iter *iter,
 					  struct bkey_s_c k)
 {
@@ -642,13 +890,19 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 	u32 i, id;
 	int ret = 0;
 
-	if (!test_bit(BCH_FS_HAVE_DELETED_SNAPSHOTS, &c->flags))
+	/*
+	 * Cleared before we start, not when we're done: snapshots deleted while
+	 * we're running requeue us, and get picked up by the next pass along
+	 * with everything else deleted in the meantime:
+	 */
+	if (!test_and_clear_bit(BCH_FS_HAVE_DELETED_SNAPSHOTS, &c->flags))
 		return 0;
 
 	if (!test_bit(BCH_FS_STARTED, &c->flags)) {
 		ret = bch2_fs_read_write_early(c);
 		if (ret) {
 			bch_err(c, "error deleleting dead snapshots: error going rw: %s", bch2_err_str(ret));
+			set_bit(BCH_FS_HAVE_DELETED_SNAPSHOTS, &c->flags);
 			return ret;
 		}
 	}
@@ -668,9 +922,7 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 		goto err;
 	}
 
-	for_each_btree_key2(&trans, iter, BTREE_ID_snapshots,
-			   POS_MIN, 0, k,
-		bch2_snapshot_set_equiv(&trans, k));
+	ret = bch2_snapshots_set_equiv(&trans);
 	if (ret) {
 		bch_err(c, "error in bch2_snapshots_set_equiv: %s", bch2_err_str(ret));
 		goto err;
@@ -695,7 +947,11 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 		goto err;
 	}
 
-	for (id = 0; id < BTREE_ID_NR; id++) {
+	/*
+	 * One pass over each btree for every dead snapshot ID: @deleted was
+	 * built in key order, so it's sorted:
+	 */
+	for (id = 0; id < BTREE_ID_NR && deleted.nr; id++) {
 		struct bpos last_pos = POS_MIN;
 		snapshot_id_list equiv_seen = { 0 };
 
@@ -726,8 +982,9 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 		}
 	}
 
-	clear_bit(BCH_FS_HAVE_DELETED_SNAPSHOTS, &c->flags);
 err:
+	if (ret)
+		set_bit(BCH_FS_HAVE_DELETED_SNAPSHOTS, &c->flags);
 	darray_exit(&deleted);
 	bch2_trans_exit(&trans);
 	return ret;
@@ -1016,6 +1273,9 @@ int bch2_subvolume_create(struct btree_trans *trans, u64 inode,
 	u32 parent = 0, new_nodes[2], snapshot_subvols[2];
 	int ret = 0;
 
+	/* Subvolume IDs are reused, don't let stale negative dirents apply: */
+	bch2_dirent_neg_cache_flush(c);
+
 	for_each_btree_key(trans, dst_iter, BTREE_ID_subvolumes, SUBVOL_POS_MIN,
 			   BTREE_ITER_SLOTS|BTREE_ITER_INTENT, k, ret) {
 		if (bkey_cmp(k.k->p, SUBVOL_POS_MAX) > 0)
@@ -16,56 +16,119 @@ int bch2_snapshot_invalid(const struct bch_fs *, struct bkey_s_c,
 
 int bch2_mark_snapshot(struct btree_trans *, struct bkey_s_c,
 		       struct bkey_s_c, unsigned);
+int bch2_snapshot_updates_publish(struct btree_trans *);
+
+/*
+ * c->snapshots is read locklessly, under rcu_read_lock(): a published table is
+ * never modified, updates copy it and publish the new table (see
+ * snapshot_table_update()), so there's no lock for readers to contend on, and
+ * they never see a half updated entry:
+ */
+static inline const struct snapshot_t *
+__snapshot_t(struct snapshot_table *t, u32 id)
+{
+	size_t idx = U32_MAX - id;
+
+	return t && idx < t->nr ? t->s + idx : NULL;
+}
 
-static inline struct snapshot_t *snapshot_t(struct bch_fs *c, u32 id)
+static inline const struct snapshot_t *snapshot_t(struct bch_fs *c, u32 id)
 {
-	return genradix_ptr(&c->snapshots, U32_MAX - id);
+	return __snapshot_t(rcu_dereference(c->snapshots), id);
 }
 
 static inline u32 bch2_snapshot_parent(struct bch_fs *c, u32 id)
 {
-	return snapshot_t(c, id)->parent;
+	const struct snapshot_t *s;
+	u32 parent;
+
+	rcu_read_lock();
+	s = snapshot_t(c, id);
+	parent = s ? s->parent : 0;
+	rcu_read_unlock();
+
+	return parent;
 }
 
 static inline u32 bch2_snapshot_equiv(struct bch_fs *c, u32 id)
 {
-	return snapshot_t(c, id)->equiv;
+	const struct snapshot_t *s;
+	u32 equiv;
+
+	rcu_read_lock();
+	s = snapshot_t(c, id);
+	equiv = s ? s->equiv : 0;
+	rcu_read_unlock();
+
+	return equiv;
 }
 
 static inline bool bch2_snapshot_is_equiv(struct bch_fs *c, u32 id)
 {
-	return id == snapshot_t(c, id)->equiv;
+	return id == bch2_snapshot_equiv(c, id);
 }
 
 static inline u32 bch2_snapshot_internal_node(struct bch_fs *c, u32 id)
 {
-	struct snapshot_t *s = snapshot_t(c, id);
+	const struct snapshot_t *s;
+	u32 ret;
+
+	rcu_read_lock();
+	s = snapshot_t(c, id);
+	ret = s && (s->children[0] || s->children[1]);
+	rcu_read_unlock();
 
-	return s->children[0] || s->children[1];
+	return ret;
 }
 
 static inline u32 bch2_snapshot_sibling(struct bch_fs *c, u32 id)
 {
-	struct snapshot_t *s;
-	u32 parent = bch2_snapshot_parent(c, id);
+	const struct snapshot_t *s;
+	u32 parent = bch2_snapshot_parent(c, id), ret = 0;
 
 	if (!parent)
 		return 0;
 
-	s = snapshot_t(c, bch2_snapshot_parent(c, id));
-	if (id == s->children[0])
-		return s->children[1];
-	if (id == s->children[1])
-		return s->children[0];
-	return 0;
+	rcu_read_lock();
+	s = snapshot_t(c, parent);
+	if (s && id == s->children[0])
+		ret = s->children[1];
+	else if (s && id == s->children[1])
+		ret = s->children[0];
+	rcu_read_unlock();
+
+	return ret;
 }
 
 static inline bool bch2_snapshot_is_ancestor(struct bch_fs *c, u32 id, u32 ancestor)
 {
-	while (id && id < ancestor)
-		id = bch2_snapshot_parent(c, id);
+	struct snapshot_table *t;
+	const struct snapshot_t *s;
+	bool ret;
+
+	rcu_read_lock();
+	t = rcu_dereference(c->snapshots);
+
+	while (id && id < ancestor &&
+	       ancestor - id > SNAPSHOT_ANCESTOR_BITMAP) {
+		s = __snapshot_t(t, id);
+		if (!s) {
+			id = 0;
+			break;
+		}
+
+		id = s->skip && s->skip <= ancestor ? s->skip : s->parent;
+	}
+
+	if (id && id < ancestor) {
+		s = __snapshot_t(t, id);
+		ret = s && test_bit(ancestor - id - 1, s->is_ancestor);
+	} else {
+		ret = id == ancestor;
+	}
+	rcu_read_unlock();
 
-	return id == ancestor;
+	return ret;
 }
 
 static inline bool snapshot_list_has_id(snapshot_id_list *s, u32 id)
@@ -78,6 +141,24 @@ static inline bool snapshot_list_has_id(snapshot_id_list *s, u32 id)
 	return false;
 }
 
+/* For lists built in key order, i.e. sorted by snapshot ID: */
+static inline bool snapshot_list_has_id_sorted(snapshot_id_list *s, u32 id)
+{
+	size_t l = 0, r = s->nr;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (s->data[m] == id)
+			return true;
+		if (s->data[m] < id)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return false;
+}
+
 static inline bool snapshot_list_has_ancestor(struct bch_fs *c, snapshot_id_list *s, u32 id)
 {
 	u32 *i;
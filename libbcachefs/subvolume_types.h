@@ -6,4 +6,12 @@
 
 typedef DARRAY(u32) snapshot_id_list;
 
+/* A change to the snapshot table, from a snapshot key: */
+struct snapshot_t_update {
+	u32			id;
+	u32			parent;
+	u32			children[2];
+	u32			subvol;
+};
+
 #endif /* _BCACHEFS_SUBVOLUME_TYPES_H */
@@ -4,6 +4,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
@@ -792,6 +793,8 @@ int bch2_write_super(struct bch_fs *c)
 	struct bch_devs_mask sb_written;
 	bool wrote, can_mount_without_written, can_mount_with_written;
 	unsigned degraded_flags = BCH_FORCE_IF_DEGRADED;
+	/* this write also covers everything bch2_write_super_async() queued: */
+	u64 seq = c->sb_write_seq;
 	int ret = 0;
 
 	trace_and_count(c, write_super, c, _RET_IP_);
@@ -922,9 +925,69 @@ out:
 	/* Make new options visible after they're persistent: */
 	bch2_sb_update(c);
 	printbuf_exit(&err);
+
+	c->sb_write_ret		= ret;
+	c->sb_written_seq	= seq;
+	wake_up(&c->sb_write_wait);
 	return ret;
 }
 
+/*
+ * Coalesced superblock writes:
+ *
+ * Callers that don't need the superblock to be persistent before they return
+ * update it under sb_lock, as for bch2_write_super(), then call
+ * bch2_write_super_async(): that only bumps sb_write_seq and kicks off
+ * sb_write_work, which writes out every update that came in within
+ * BCH_SB_WRITE_DELAY with a single bch2_write_super() - to every device in
+ * parallel. bch2_write_super_wait() waits for a particular update to be
+ * written, and any bch2_write_super() also writes out pending updates.
+ */
+#define BCH_SB_WRITE_DELAY	(HZ / 10)
+
+u64 bch2_write_super_async(struct bch_fs *c)
+{
+	lockdep_assert_held(&c->sb_lock);
+
+	c->sb_write_seq++;
+	queue_delayed_work(system_long_wq, &c->sb_write_work,
+			   BCH_SB_WRITE_DELAY);
+	return c->sb_write_seq;
+}
+
+int bch2_write_super_wait(struct bch_fs *c, u64 seq)
+{
+	int ret;
+
+	if (READ_ONCE(c->sb_written_seq) < seq)
+		mod_delayed_work(system_long_wq, &c->sb_write_work, 0);
+
+	wait_event(c->sb_write_wait, READ_ONCE(c->sb_written_seq) >= seq);
+
+	mutex_lock(&c->sb_lock);
+	ret = c->sb_write_ret;
+	mutex_unlock(&c->sb_lock);
+	return ret;
+}
+
+void bch2_write_super_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work),
+					struct bch_fs, sb_write_work);
+
+	mutex_lock(&c->sb_lock);
+	if (c->sb_written_seq < c->sb_write_seq)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+/* On shutdown: write out anything still queued, while we still can: */
+void bch2_write_super_flush(struct bch_fs *c)
+{
+	cancel_delayed_work_sync(&c->sb_write_work);
+	bch2_write_super_work(&c->sb_write_work.work);
+}
+
 void __bch2_check_set_feature(struct bch_fs *c, unsigned feat)
 {
 	mutex_lock(&c->sb_lock);
@@ -1121,6 +1184,11 @@ static int bch2_sb_crypt_validate(struct bch_sb *sb,
 		return -EINVAL;
 	}
 
+	if (BCH_SB_ENCRYPTION_TYPE(sb) >= BCH_ENCRYPTION_NR) {
+		prt_printf(err, "bad encryption type %llu", BCH_SB_ENCRYPTION_TYPE(sb));
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -1340,6 +1408,8 @@ void bch2_fs_mark_clean(struct bch_fs *c)
 		goto out;
 	}
 
+	bch2_fsck_checkpoint_update(c, le64_to_cpu(sb_clean->journal_seq));
+
 	bch2_write_super(c);
 out:
 	mutex_unlock(&c->sb_lock);
@@ -1388,6 +1458,302 @@ static const struct bch_sb_field_ops bch_sb_field_ops_clean = {
 	.to_text	= bch2_sb_clean_to_text,
 };
 
+/* BCH_SB_FIELD_fsck_checkpoint: */
+
+/*
+ * Called on clean shutdown, with sb_lock held: record the btrees written since
+ * mount, and make the checkpoint valid for the clean section we're writing -
+ * unless it was invalidated at mount time, by an unclean shutdown:
+ */
+void bch2_fsck_checkpoint_update(struct bch_fs *c, u64 journal_seq)
+{
+	struct bch_sb_field_fsck_checkpoint *cp =
+		bch2_sb_get_fsck_checkpoint(c->disk_sb.sb);
+
+	if (!cp || !c->fsck_checkpoint_valid)
+		return;
+
+	cp->journal_seq		= cpu_to_le64(journal_seq);
+	cp->btrees_written	|= cpu_to_le64(c->btrees_written);
+}
+
+static int bch2_sb_fsck_checkpoint_validate(struct bch_sb *sb,
+					    struct bch_sb_field *f,
+					    struct printbuf *err)
+{
+	struct bch_sb_field_fsck_checkpoint *cp = field_to_type(f, fsck_checkpoint);
+
+	if (vstruct_bytes(&cp->field) < sizeof(*cp)) {
+		prt_printf(err, "wrong size (got %zu should be %zu)",
+		       vstruct_bytes(&cp->field), sizeof(*cp));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bch2_sb_fsck_checkpoint_to_text(struct printbuf *out, struct bch_sb *sb,
+					    struct bch_sb_field *f)
+{
+	struct bch_sb_field_fsck_checkpoint *cp = field_to_type(f, fsck_checkpoint);
+	u64 written = le64_to_cpu(cp->btrees_written);
+	unsigned i;
+
+	prt_printf(out, "Journal seq:       %llu", le64_to_cpu(cp->journal_seq));
+	prt_newline(out);
+	prt_printf(out, "Btrees written:    ");
+	for (i = 0; i < BTREE_ID_NR; i++)
+		if (written & (1ULL << i))
+			prt_printf(out, "%s ", bch2_btree_ids[i]);
+	prt_newline(out);
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_fsck_checkpoint = {
+	.validate	= bch2_sb_fsck_checkpoint_validate,
+	.to_text	= bch2_sb_fsck_checkpoint_to_text,
+};
+
+/* BCH_SB_FIELD_migrate_cursor: */
+
+struct bbpos bch2_migrate_cursor_get(struct bch_fs *c, unsigned dev)
+{
+	struct bch_sb_field_members *mi;
+	struct bch_sb_field_migrate_cursor *cur;
+	struct bbpos ret = BBPOS_MIN;
+
+	mutex_lock(&c->sb_lock);
+	mi = bch2_sb_get_members(c->disk_sb.sb);
+	cur = bch2_sb_get_migrate_cursor(c->disk_sb.sb);
+	if (cur && le32_to_cpu(cur->dev) == dev &&
+	    BCH_MEMBER_STATE(&mi->members[dev]) != BCH_MEMBER_STATE_rw)
+		ret = BBPOS(cur->btree_id,
+			    SPOS(le64_to_cpu(cur->inode),
+				 le64_to_cpu(cur->offset),
+				 le32_to_cpu(cur->snapshot)));
+	mutex_unlock(&c->sb_lock);
+
+	return ret;
+}
+
+void bch2_migrate_cursor_set(struct bch_fs *c, unsigned dev, struct bbpos pos)
+{
+	struct bch_sb_field_members *mi;
+	struct bch_sb_field_migrate_cursor *cur;
+
+	mutex_lock(&c->sb_lock);
+	mi = bch2_sb_get_members(c->disk_sb.sb);
+	/* Only valid if nothing new can be written to the device: */
+	cur = BCH_MEMBER_STATE(&mi->members[dev]) != BCH_MEMBER_STATE_rw
+		? bch2_sb_resize_migrate_cursor(&c->disk_sb,
+					sizeof(*cur) / sizeof(u64))
+		: NULL;
+	if (cur) {
+		cur->dev	= cpu_to_le32(dev);
+		cur->btree_id	= pos.btree;
+		cur->inode	= cpu_to_le64(pos.pos.inode);
+		cur->offset	= cpu_to_le64(pos.pos.offset);
+		cur->snapshot	= cpu_to_le32(pos.pos.snapshot);
+		bch2_write_super_async(c);
+	}
+	mutex_unlock(&c->sb_lock);
+}
+
+/*
+ * Called with sb_lock held, when @dev goes read-write or is removed, or its
+ * evacuate completes; the caller writes the superblock:
+ */
+bool bch2_migrate_cursor_clear(struct bch_fs *c, unsigned dev)
+{
+	struct bch_sb_field_migrate_cursor *cur =
+		bch2_sb_get_migrate_cursor(c->disk_sb.sb);
+
+	if (!cur || le32_to_cpu(cur->dev) != dev)
+		return false;
+
+	bch2_sb_field_delete(&c->disk_sb, BCH_SB_FIELD_migrate_cursor);
+	return true;
+}
+
+static int bch2_sb_migrate_cursor_validate(struct bch_sb *sb,
+					   struct bch_sb_field *f,
+					   struct printbuf *err)
+{
+	struct bch_sb_field_migrate_cursor *cur = field_to_type(f, migrate_cursor);
+
+	if (vstruct_bytes(&cur->field) < sizeof(*cur)) {
+		prt_printf(err, "wrong size (got %zu should be %zu)",
+		       vstruct_bytes(&cur->field), sizeof(*cur));
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(cur->dev) >= sb->nr_devices) {
+		prt_printf(err, "invalid device %u", le32_to_cpu(cur->dev));
+		return -EINVAL;
+	}
+
+	if (cur->btree_id >= BTREE_ID_NR) {
+		prt_printf(err, "invalid btree id %u", cur->btree_id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bch2_sb_migrate_cursor_to_text(struct printbuf *out, struct bch_sb *sb,
+					   struct bch_sb_field *f)
+{
+	struct bch_sb_field_migrate_cursor *cur = field_to_type(f, migrate_cursor);
+
+	prt_printf(out, "Device:            %u", le32_to_cpu(cur->dev));
+	prt_newline(out);
+	prt_printf(out, "Position:          ");
+	bch2_bbpos_to_text(out, BBPOS(cur->btree_id,
+			SPOS(le64_to_cpu(cur->inode),
+			     le64_to_cpu(cur->offset),
+			     le32_to_cpu(cur->snapshot))));
+	prt_newline(out);
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_migrate_cursor = {
+	.validate	= bch2_sb_migrate_cursor_validate,
+	.to_text	= bch2_sb_migrate_cursor_to_text,
+};
+
+/* BCH_SB_FIELD_scrub_cursor: */
+
+struct bpos bch2_scrub_cursor_get(struct bch_fs *c)
+{
+	struct bch_sb_field_scrub_cursor *cur;
+	struct bpos ret = POS_MIN;
+
+	mutex_lock(&c->sb_lock);
+	cur = bch2_sb_get_scrub_cursor(c->disk_sb.sb);
+	if (cur)
+		ret = POS(le32_to_cpu(cur->dev), le64_to_cpu(cur->bucket));
+	mutex_unlock(&c->sb_lock);
+
+	return ret;
+}
+
+/* The cursor is created when a pass starts, and records when that was: */
+void bch2_scrub_cursor_set(struct bch_fs *c, struct bpos pos)
+{
+	struct bch_sb_field_scrub_cursor *cur;
+
+	mutex_lock(&c->sb_lock);
+	cur = bch2_sb_get_scrub_cursor(c->disk_sb.sb);
+	if (!cur) {
+		cur = bch2_sb_resize_scrub_cursor(&c->disk_sb,
+					sizeof(*cur) / sizeof(u64));
+		if (cur)
+			cur->time = cpu_to_le64(ktime_get_real_seconds());
+	}
+	if (cur) {
+		cur->dev	= cpu_to_le32(pos.inode);
+		cur->bucket	= cpu_to_le64(pos.offset);
+		bch2_write_super_async(c);
+	}
+	mutex_unlock(&c->sb_lock);
+}
+
+void bch2_scrub_cursor_clear(struct bch_fs *c)
+{
+	mutex_lock(&c->sb_lock);
+	if (bch2_sb_get_scrub_cursor(c->disk_sb.sb)) {
+		bch2_sb_field_delete(&c->disk_sb, BCH_SB_FIELD_scrub_cursor);
+		bch2_write_super_async(c);
+	}
+	mutex_unlock(&c->sb_lock);
+}
+
+static int bch2_sb_scrub_cursor_validate(struct bch_sb *sb,
+					 struct bch_sb_field *f,
+					 struct printbuf *err)
+{
+	struct bch_sb_field_scrub_cursor *cur = field_to_type(f, scrub_cursor);
+
+	if (vstruct_bytes(&cur->field) < sizeof(*cur)) {
+		prt_printf(err, "wrong size (got %zu should be %zu)",
+		       vstruct_bytes(&cur->field), sizeof(*cur));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bch2_sb_scrub_cursor_to_text(struct printbuf *out, struct bch_sb *sb,
+					 struct bch_sb_field *f)
+{
+	struct bch_sb_field_scrub_cursor *cur = field_to_type(f, scrub_cursor);
+
+	prt_printf(out, "Device:            %u", le32_to_cpu(cur->dev));
+	prt_newline(out);
+	prt_printf(out, "Bucket:            %llu", le64_to_cpu(cur->bucket));
+	prt_newline(out);
+	prt_printf(out, "Started:           %llu", le64_to_cpu(cur->time));
+	prt_newline(out);
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_scrub_cursor = {
+	.validate	= bch2_sb_scrub_cursor_validate,
+	.to_text	= bch2_sb_scrub_cursor_to_text,
+};
+
+/* BCH_SB_FIELD_btree_cache_hot: */
+
+static int bch2_sb_btree_cache_hot_validate(struct bch_sb *sb,
+					    struct bch_sb_field *f,
+					    struct printbuf *err)
+{
+	struct bch_sb_field_btree_cache_hot *hot = field_to_type(f, btree_cache_hot);
+	size_t bytes = vstruct_bytes(&hot->field) - sizeof(*hot);
+	struct bch_btree_cache_hot_node *n;
+
+	if (bytes % sizeof(*n)) {
+		prt_printf(err, "wrong size (got %zu, not a multiple of %zu)",
+			   bytes, sizeof(*n));
+		return -EINVAL;
+	}
+
+	for (n = hot->nodes; n < hot->nodes + bytes / sizeof(*n); n++)
+		if (n->level >= BTREE_MAX_DEPTH) {
+			prt_printf(err, "invalid level %u", n->level);
+			return -EINVAL;
+		}
+
+	return 0;
+}
+
+static void bch2_sb_btree_cache_hot_to_text(struct printbuf *out, struct bch_sb *sb,
+					    struct bch_sb_field *f)
+{
+	struct bch_sb_field_btree_cache_hot *hot = field_to_type(f, btree_cache_hot);
+	unsigned nr = (vstruct_bytes(&hot->field) - sizeof(*hot)) /
+		sizeof(hot->nodes[0]);
+	struct bch_btree_cache_hot_node *n;
+
+	prt_printf(out, "Nodes:             %u", nr);
+	prt_newline(out);
+
+	for (n = hot->nodes; n < hot->nodes + nr; n++) {
+		prt_printf(out, "level %u ", n->level);
+		if (n->btree_id < BTREE_ID_NR)
+			prt_str(out, bch2_btree_ids[n->btree_id]);
+		else
+			prt_printf(out, "(unknown btree %u)", n->btree_id);
+		prt_char(out, ':');
+		bch2_bpos_to_text(out, SPOS(le64_to_cpu(n->inode),
+					    le64_to_cpu(n->offset),
+					    le32_to_cpu(n->snapshot)));
+		prt_newline(out);
+	}
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_btree_cache_hot = {
+	.validate	= bch2_sb_btree_cache_hot_validate,
+	.to_text	= bch2_sb_btree_cache_hot_to_text,
+};
+
 static const struct bch_sb_field_ops *bch2_sb_field_ops[] = {
 #define x(f, nr)					\
 	[BCH_SB_FIELD_##f] = &bch_sb_field_ops_##f,
@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_SUPER_IO_H
 #define _BCACHEFS_SUPER_IO_H
 
+#include "bbpos.h"
 #include "extents.h"
 #include "eytzinger.h"
 #include "super_types.h"
@@ -67,6 +68,10 @@ int bch2_sb_realloc(struct bch_sb_handle *, unsigned);
 
 int bch2_read_super(const char *, struct bch_opts *, struct bch_sb_handle *);
 int bch2_write_super(struct bch_fs *);
+u64 bch2_write_super_async(struct bch_fs *);
+int bch2_write_super_wait(struct bch_fs *, u64);
+void bch2_write_super_work(struct work_struct *);
+void bch2_write_super_flush(struct bch_fs *);
 void __bch2_check_set_feature(struct bch_fs *, unsigned);
 
 static inline void bch2_check_set_feature(struct bch_fs *c, unsigned feat)
@@ -116,6 +121,15 @@ void bch2_journal_super_entries_add_common(struct bch_fs *,
 int bch2_sb_clean_validate_late(struct bch_fs *, struct bch_sb_field_clean *, int);
 
 int bch2_fs_mark_dirty(struct bch_fs *);
+void bch2_fsck_checkpoint_update(struct bch_fs *, u64);
+
+struct bbpos bch2_migrate_cursor_get(struct bch_fs *, unsigned);
+void bch2_migrate_cursor_set(struct bch_fs *, unsigned, struct bbpos);
+bool bch2_migrate_cursor_clear(struct bch_fs *, unsigned);
+
+struct bpos bch2_scrub_cursor_get(struct bch_fs *);
+void bch2_scrub_cursor_set(struct bch_fs *, struct bpos);
+void bch2_scrub_cursor_clear(struct bch_fs *);
 void bch2_fs_mark_clean(struct bch_fs *);
 
 void bch2_sb_field_to_text(struct printbuf *, struct bch_sb *,
@@ -22,10 +22,12 @@
 #include "clock.h"
 #include "compress.h"
 #include "debug.h"
+#include "dirent.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "errcode.h"
 #include "error.h"
+#include "extents.h"
 #include "fs.h"
 #include "fs-io.h"
 #include "fsck.h"
@@ -261,6 +263,7 @@ void bch2_fs_read_only(struct bch_fs *c)
 	percpu_ref_kill(&c->writes);
 
 	cancel_work_sync(&c->ec_stripe_delete_work);
+	bch2_btree_cache_hot_save_stop(c);
 
 	/*
 	 * If we're not doing an emergency shutdown, we want to wait on
@@ -291,6 +294,7 @@ void bch2_fs_read_only(struct bch_fs *c)
 	    test_bit(BCH_FS_CLEAN_SHUTDOWN, &c->flags) &&
 	    !c->opts.norecovery) {
 		bch_verbose(c, "marking filesystem clean");
+		bch2_btree_cache_hot_save(c, false);
 		bch2_fs_mark_clean(c);
 	}
 
@@ -346,6 +350,7 @@ static int bch2_fs_read_write_late(struct bch_fs *c)
 	}
 
 	schedule_work(&c->ec_stripe_delete_work);
+	bch2_btree_cache_hot_save_start(c);
 
 	return 0;
 }
@@ -432,6 +437,8 @@ static void __bch2_fs_free(struct bch_fs *c)
 	bch2_fs_ec_exit(c);
 	bch2_fs_encryption_exit(c);
 	bch2_fs_io_exit(c);
+	bch2_fs_dirent_exit(c);
+	bch2_fs_rebalance_exit(c);
 	bch2_fs_buckets_waiting_for_journal_exit(c);
 	bch2_fs_btree_interior_update_exit(c);
 	bch2_fs_btree_iter_exit(c);
@@ -447,11 +454,14 @@ static void __bch2_fs_free(struct bch_fs *c)
 	percpu_free_rwsem(&c->mark_lock);
 
 	if (c->btree_paths_bufs)
-		for_each_possible_cpu(cpu)
+		for_each_possible_cpu(cpu) {
 			kfree(per_cpu_ptr(c->btree_paths_bufs, cpu)->path);
+			kfree(per_cpu_ptr(c->btree_paths_bufs, cpu)->mem);
+		}
 
 	free_percpu(c->online_reserved);
 	free_percpu(c->btree_paths_bufs);
+	free_percpu(c->fsck_progress.nr_keys);
 	free_percpu(c->pcpu);
 	mempool_exit(&c->large_bkey_pool);
 	mempool_exit(&c->btree_bounce_pool);
@@ -460,6 +470,7 @@ static void __bch2_fs_free(struct bch_fs *c)
 	percpu_ref_exit(&c->writes);
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 	kfree(c->journal_seq_blacklist_table);
+	kfree(c->inode_alloc_ranges);
 	kfree(c->unused_inode_hints);
 	free_heap(&c->copygc_heap);
 
@@ -469,6 +480,8 @@ static void __bch2_fs_free(struct bch_fs *c)
 		destroy_workqueue(c->copygc_wq);
 	if (c->btree_io_complete_wq)
 		destroy_workqueue(c->btree_io_complete_wq);
+	if (c->btree_read_complete_wq)
+		destroy_workqueue(c->btree_read_complete_wq);
 	if (c->btree_update_wq)
 		destroy_workqueue(c->btree_update_wq);
 
@@ -494,11 +507,14 @@ void __bch2_fs_stop(struct bch_fs *c)
 	set_bit(BCH_FS_STOPPING, &c->flags);
 
 	cancel_work_sync(&c->journal_seq_blacklist_gc_work);
+	bch2_btree_cache_warm_stop(c);
 
 	down_write(&c->state_lock);
 	bch2_fs_read_only(c);
 	up_write(&c->state_lock);
 
+	bch2_write_super_flush(c);
+
 	for_each_member_device(ca, c, i)
 		if (ca->kobj.state_in_sysfs &&
 		    ca->disk_sb.bdev)
@@ -636,6 +652,10 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	init_rwsem(&c->state_lock);
 	mutex_init(&c->sb_lock);
+	spin_lock_init(&c->io_opts_cache.lock);
+	bch2_fs_extent_hole_cache_init(c);
+	INIT_DELAYED_WORK(&c->sb_write_work, bch2_write_super_work);
+	init_waitqueue_head(&c->sb_write_wait);
 	mutex_init(&c->replicas_gc_lock);
 	mutex_init(&c->btree_root_lock);
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
@@ -650,7 +670,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	bch2_fs_btree_key_cache_init_early(&c->btree_key_cache);
 	bch2_fs_allocator_background_init(c);
 	bch2_fs_allocator_foreground_init(c);
-	bch2_fs_rebalance_init(c);
+	bch2_fs_rebalance_init_early(c);
 	bch2_fs_quota_init(c);
 	bch2_fs_ec_init_early(c);
 
@@ -663,6 +683,13 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	spin_lock_init(&c->btree_write_error_lock);
 
+	spin_lock_init(&c->btree_group_commit_lock);
+	INIT_LIST_HEAD(&c->btree_group_commit_pending);
+	init_waitqueue_head(&c->btree_group_commit_wait);
+
+	spin_lock_init(&c->btree_compact_lock);
+	INIT_WORK(&c->btree_compact_work, bch2_btree_node_compact_work);
+
 	INIT_WORK(&c->journal_seq_blacklist_gc_work,
 		  bch2_blacklist_entries_gc);
 
@@ -670,6 +697,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	INIT_LIST_HEAD(&c->fsck_errors);
 	mutex_init(&c->fsck_error_lock);
+	c->fsck_btrees = ~0UL;
+	spin_lock_init(&c->fsck_progress.lock);
 
 	INIT_LIST_HEAD(&c->ec_stripe_head_list);
 	mutex_init(&c->ec_stripe_head_lock);
@@ -740,6 +769,13 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	c->btree_key_cache_btrees |= 1U << BTREE_ID_alloc;
 	if (c->opts.inodes_use_key_cache)
 		c->btree_key_cache_btrees |= 1U << BTREE_ID_inodes;
+	if (c->opts.dirents_use_key_cache)
+		c->btree_key_cache_btrees |= 1U << BTREE_ID_dirents;
+	if (c->opts.subvolumes_use_key_cache)
+		c->btree_key_cache_btrees |= 1U << BTREE_ID_subvolumes;
+
+	c->btree_key_cache.btrees[BTREE_ID_dirents].max_keys =
+		c->opts.dirents_key_cache_max;
 
 	c->block_bits		= ilog2(block_sectors(c));
 	c->btree_foreground_merge_threshold = BTREE_FOREGROUND_MERGE_THRESHOLD(c);
@@ -750,9 +786,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 		goto err;
 	}
 
-	iter_size = sizeof(struct sort_iter) +
-		(btree_blocks(c) + 1) * 2 *
-		sizeof(struct sort_iter_set);
+	iter_size = sort_iter_bytes((btree_blocks(c) + 1) * 2);
 
 	c->inode_shard_bits = ilog2(roundup_pow_of_two(num_possible_cpus()));
 
@@ -760,6 +794,9 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
 	    !(c->btree_io_complete_wq = alloc_workqueue("bcachefs_btree_io",
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
+	    !(c->btree_read_complete_wq = alloc_workqueue("bcachefs_btree_read",
+				WQ_UNBOUND|WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE,
+				c->opts.btree_read_threads ?: num_online_cpus())) ||
 	    !(c->copygc_wq = alloc_workqueue("bcachefs_copygc",
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
 	    !(c->io_complete_wq = alloc_workqueue("bcachefs_io",
@@ -772,13 +809,17 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 			    offsetof(struct btree_write_bio, wbio.bio)),
 			BIOSET_NEED_BVECS) ||
 	    !(c->pcpu = alloc_percpu(struct bch_fs_pcpu)) ||
+	    !(c->fsck_progress.nr_keys = alloc_percpu(u64)) ||
 	    !(c->btree_paths_bufs = alloc_percpu(struct btree_path_buf)) ||
 	    !(c->online_reserved = alloc_percpu(u64)) ||
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
 	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
 	    !(c->unused_inode_hints = kcalloc(1U << c->inode_shard_bits,
-					      sizeof(u64), GFP_KERNEL))) {
+					      sizeof(u64), GFP_KERNEL)) ||
+	    !(c->inode_alloc_ranges = kcalloc(1U << c->inode_shard_bits,
+					      sizeof(struct inode_alloc_range),
+					      GFP_KERNEL))) {
 		ret = -ENOMEM;
 		goto err;
 	}
@@ -794,6 +835,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    bch2_fs_btree_interior_update_init(c) ?:
 	    bch2_fs_buckets_waiting_for_journal_init(c) ?:
 	    bch2_fs_subvolumes_init(c) ?:
+	    bch2_fs_rebalance_init(c) ?:
+	    bch2_fs_dirent_init(c) ?:
 	    bch2_fs_io_init(c) ?:
 	    bch2_fs_encryption_init(c) ?:
 	    bch2_fs_compress_init(c) ?:
@@ -912,6 +955,7 @@ int bch2_fs_start(struct bch_fs *c)
 	}
 
 	set_bit(BCH_FS_STARTED, &c->flags);
+	bch2_btree_cache_warm(c);
 
 	if (c->opts.read_only || c->opts.nochanges) {
 		bch2_fs_read_only(c);
@@ -983,6 +1027,8 @@ static void bch2_dev_release(struct kobject *kobj)
 
 static void bch2_dev_free(struct bch_dev *ca)
 {
+	unsigned rw, i;
+
 	cancel_work_sync(&ca->io_error_work);
 
 	if (ca->kobj.state_in_sysfs &&
@@ -995,11 +1041,16 @@ static void bch2_dev_free(struct bch_dev *ca)
 	bch2_free_super(&ca->disk_sb);
 	bch2_dev_journal_exit(ca);
 
+	free_percpu(ca->alloc_cache);
 	free_percpu(ca->io_done);
 	bioset_exit(&ca->replica_set);
 	bch2_dev_buckets_free(ca);
+	kvfree(ca->oldest_gen);
 	free_page((unsigned long) ca->sb_read_scratch);
 
+	for (rw = 0; rw < 2; rw++)
+		for (i = 0; i < BCH_DATA_NR; i++)
+			bch2_time_stats_exit(&ca->io_latency_by_type[rw][i]);
 	bch2_time_stats_exit(&ca->io_latency[WRITE]);
 	bch2_time_stats_exit(&ca->io_latency[READ]);
 
@@ -1078,6 +1129,7 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 					struct bch_member *member)
 {
 	struct bch_dev *ca;
+	unsigned cpu, rw, i;
 
 	ca = kzalloc(sizeof(*ca), GFP_KERNEL);
 	if (!ca)
@@ -1093,6 +1145,9 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 
 	bch2_time_stats_init(&ca->io_latency[READ]);
 	bch2_time_stats_init(&ca->io_latency[WRITE]);
+	for (rw = 0; rw < 2; rw++)
+		for (i = 0; i < BCH_DATA_NR; i++)
+			bch2_time_stats_init(&ca->io_latency_by_type[rw][i]);
 
 	ca->mi = bch2_mi_to_cpu(member);
 	ca->uuid = member->uuid;
@@ -1108,9 +1163,13 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 	    bch2_dev_buckets_alloc(c, ca) ||
 	    bioset_init(&ca->replica_set, 4,
 			offsetof(struct bch_write_bio, bio), 0) ||
-	    !(ca->io_done	= alloc_percpu(*ca->io_done)))
+	    !(ca->io_done	= alloc_percpu(*ca->io_done)) ||
+	    !(ca->alloc_cache	= alloc_percpu(*ca->alloc_cache)))
 		goto err;
 
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(ca->alloc_cache, cpu)->lock);
+
 	return ca;
 err:
 	bch2_dev_free(ca);
@@ -1184,6 +1243,18 @@ static int __bch2_dev_attach_bdev(struct bch_dev *ca, struct bch_sb_handle *sb)
 		return -EINVAL;
 	}
 
+	/*
+	 * Zoned devices can only be written sequentially within a zone, and we
+	 * reset zones when we reuse buckets: that only works if buckets and
+	 * zones line up:
+	 */
+	if (bdev_is_zoned(sb->bdev) &&
+	    bdev_zone_sectors(sb->bdev) != ca->mi.bucket_size) {
+		bch_err(ca, "cannot online: zoned device with zone size %llu, bucket size %u",
+			(u64) bdev_zone_sectors(sb->bdev), ca->mi.bucket_size);
+		return -EINVAL;
+	}
+
 	ret = bch2_dev_journal_init(ca, sb->sb);
 	if (ret)
 		return ret;
@@ -1362,6 +1433,9 @@ int __bch2_dev_set_state(struct bch_fs *c, struct bch_dev *ca,
 	mutex_lock(&c->sb_lock);
 	mi = bch2_sb_get_members(c->disk_sb.sb);
 	SET_BCH_MEMBER_STATE(&mi->members[ca->dev_idx], new_state);
+	/* new data may be written anywhere on the device: */
+	if (new_state == BCH_MEMBER_STATE_rw)
+		bch2_migrate_cursor_clear(c, ca->dev_idx);
 	bch2_write_super(c);
 	mutex_unlock(&c->sb_lock);
 
@@ -1493,6 +1567,7 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 	mutex_lock(&c->sb_lock);
 	mi = bch2_sb_get_members(c->disk_sb.sb);
 	memset(&mi->members[dev_idx].uuid, 0, sizeof(mi->members[dev_idx].uuid));
+	bch2_migrate_cursor_clear(c, dev_idx);
 
 	bch2_write_super(c);
 
@@ -1750,19 +1825,195 @@ int bch2_dev_offline(struct bch_fs *c, struct bch_dev *ca, int flags)
 	return 0;
 }
 
-int bch2_dev_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
+struct dev_shrink_tail {
+	u64		free;
+	u64		need_discard;
+	u64		busy;
+};
+
+static int dev_shrink_tail_count(struct btree_trans *trans, struct bch_dev *ca,
+				 u64 nbuckets, struct dev_shrink_tail *t)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_alloc_v4 a;
+	int ret;
+
+	memset(t, 0, sizeof(*t));
+
+	for_each_btree_key_norestart(trans, iter, BTREE_ID_alloc,
+				     POS(ca->dev_idx, nbuckets),
+				     BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->p.inode != ca->dev_idx)
+			break;
+
+		bch2_alloc_to_v4(k, &a);
+		if (a.data_type == BCH_DATA_free)
+			t->free++;
+		else if (a.data_type == BCH_DATA_need_discard)
+			t->need_discard++;
+		else
+			t->busy++;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+static int dev_shrink_delete_alloc_info(struct bch_fs *c, struct bch_dev *ca,
+					u64 nbuckets)
+{
+	u64 old_nbuckets = ca->mi.nbuckets;
+	unsigned genbits;
+	int ret;
+
+	/*
+	 * Every bucket past the new size is free, so there's no accounting for
+	 * triggers to undo:
+	 */
+	ret = bch2_btree_delete_range(c, BTREE_ID_need_discard,
+				      POS(ca->dev_idx, nbuckets),
+				      POS(ca->dev_idx, U64_MAX),
+				      BTREE_TRIGGER_NORUN, NULL);
+
+	for (genbits = 0; genbits < 1U << 4 && !ret; genbits++) {
+		u64 g = (u64) genbits << 56;
+
+		ret = bch2_btree_delete_range(c, BTREE_ID_freespace,
+				POS(ca->dev_idx, g|nbuckets),
+				POS(ca->dev_idx, g|old_nbuckets),
+				BTREE_TRIGGER_NORUN, NULL);
+	}
+
+	return ret ?: bch2_btree_delete_range(c, BTREE_ID_alloc,
+				      POS(ca->dev_idx, nbuckets),
+				      POS(ca->dev_idx, U64_MAX),
+				      BTREE_TRIGGER_NORUN, NULL);
+}
+
+/*
+ * Shrinking a device: stop allocating from the buckets past the new size, move
+ * whatever is in them via backpointers, and once they're all free drop their
+ * alloc info and shrink the in memory bucket arrays:
+ */
+static int bch2_dev_shrink(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 {
+	struct bch_move_stats stats;
 	struct bch_member *mi;
+	struct dev_shrink_tail t;
+	unsigned i, retry;
 	int ret = 0;
 
-	down_write(&c->state_lock);
+	if (nbuckets < BCH_MIN_NR_NBUCKETS ||
+	    nbuckets <= ca->mi.first_bucket) {
+		bch_err(ca, "New size too small");
+		return -EINVAL;
+	}
 
-	if (nbuckets < ca->mi.nbuckets) {
-		bch_err(ca, "Cannot shrink yet");
-		ret = -EINVAL;
+	down_read(&c->state_lock);
+	for (i = 0; i < ca->journal.nr; i++)
+		if (ca->journal.buckets[i] >= nbuckets) {
+			bch_err(ca, "Cannot shrink: journal bucket %llu past new size",
+				ca->journal.buckets[i]);
+			up_read(&c->state_lock);
+			return -EBUSY;
+		}
+
+	WRITE_ONCE(ca->shrink_nbuckets, nbuckets);
+
+	/* Close open buckets, which may be past the new size: */
+	if (ca->mi.state == BCH_MEMBER_STATE_rw) {
+		bch2_dev_allocator_remove(c, ca);
+		bch2_dev_allocator_add(c, ca);
+	}
+	up_read(&c->state_lock);
+
+	bch_move_stats_init(&stats, "shrink");
+
+	for (retry = 0; retry < 100; retry++) {
+		if (retry) {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			schedule_timeout(HZ / 10);
+		}
+
+		ret = bch2_evacuate_bucket_range(c, ca, nbuckets,
+						 ca->mi.nbuckets, &stats) ?:
+			bch2_trans_run(c, lockrestart_do(&trans,
+				dev_shrink_tail_count(&trans, ca, nbuckets, &t)));
+		if (ret)
+			goto err;
+
+		if (!t.busy && !t.need_discard)
+			break;
+
+		/* Buckets we just emptied have to be discarded before reuse: */
+		bch2_journal_flush(&c->journal);
+		bch2_do_discards(c);
+	}
+
+	if (t.busy || t.need_discard) {
+		bch_err(ca, "Cannot shrink: %llu buckets past new size still in use",
+			t.busy + t.need_discard);
+		ret = -EBUSY;
 		goto err;
 	}
 
+	down_write(&c->state_lock);
+
+	/* Recheck with state_lock held: */
+	ret = bch2_trans_run(c, lockrestart_do(&trans,
+			dev_shrink_tail_count(&trans, ca, nbuckets, &t)));
+	if (!ret && (t.busy || t.need_discard))
+		ret = -EBUSY;
+	if (ret)
+		goto err_unlock;
+
+	ret = dev_shrink_delete_alloc_info(c, ca, nbuckets);
+	if (ret) {
+		bch_err(ca, "Error deleting alloc info: %s", bch2_err_str(ret));
+		goto err_unlock;
+	}
+
+	percpu_down_write(&c->mark_lock);
+	ca->usage_base->d[BCH_DATA_free].buckets -= t.free;
+	percpu_up_write(&c->mark_lock);
+
+	ret = bch2_dev_buckets_resize(c, ca, nbuckets);
+	if (ret) {
+		bch_err(ca, "Resize error: %s", bch2_err_str(ret));
+		goto err_unlock;
+	}
+
+	mutex_lock(&c->gc_gens_lock);
+	kvfree(ca->oldest_gen);
+	ca->oldest_gen = NULL;
+	mutex_unlock(&c->gc_gens_lock);
+
+	mutex_lock(&c->sb_lock);
+	mi = &bch2_sb_get_members(c->disk_sb.sb)->members[ca->dev_idx];
+	mi->nbuckets = cpu_to_le64(nbuckets);
+
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+
+	bch2_recalc_capacity(c);
+err_unlock:
+	up_write(&c->state_lock);
+err:
+	WRITE_ONCE(ca->shrink_nbuckets, 0);
+	return ret;
+}
+
+int bch2_dev_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
+{
+	struct bch_member *mi;
+	int ret = 0;
+
+	if (nbuckets < ca->mi.nbuckets)
+		return bch2_dev_shrink(c, ca, nbuckets);
+
+	down_write(&c->state_lock);
+
 	if (bch2_dev_is_online(ca) &&
 	    get_capacity(ca->disk_sb.bdev->bd_disk) <
 	    ca->mi.bucket_size * nbuckets) {
@@ -1777,6 +2028,12 @@ int bch2_dev_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 		goto err;
 	}
 
+	/* An in progress gens gc pass has to restart with the new size: */
+	mutex_lock(&c->gc_gens_lock);
+	kvfree(ca->oldest_gen);
+	ca->oldest_gen = NULL;
+	mutex_unlock(&c->gc_gens_lock);
+
 	ret = bch2_trans_mark_dev_sb(c, ca);
 	if (ret) {
 		goto err;
@@ -1814,6 +2071,65 @@ found:
 
 /* Filesystem open: */
 
+struct read_super_work {
+	struct closure		cl;
+	const char		*path;
+	struct bch_opts		opts;
+	struct bch_sb_handle	*sb;
+	int			ret;
+};
+
+static void read_super_work_fn(struct closure *cl)
+{
+	struct read_super_work *w = container_of(cl, struct read_super_work, cl);
+
+	w->ret = bch2_read_super(w->path, &w->opts, w->sb);
+	closure_return(cl);
+}
+
+/*
+ * Opening a device and reading its superblock is mostly waiting on IO, so with
+ * many member devices do them all at once:
+ */
+static int bch2_read_supers(char * const *devices, unsigned nr_devices,
+			    struct bch_opts *opts, struct bch_sb_handle *sb)
+{
+	struct read_super_work *w;
+	struct closure cl;
+	unsigned i;
+	int ret = 0;
+
+	if (nr_devices == 1)
+		return bch2_read_super(devices[0], opts, &sb[0]);
+
+	w = kcalloc(nr_devices, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr_devices; i++) {
+		w[i].path	= devices[i];
+		w[i].opts	= *opts;
+		w[i].sb		= &sb[i];
+		closure_call(&w[i].cl, read_super_work_fn,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+
+	for (i = 0; i < nr_devices; i++) {
+		ret = ret ?: w[i].ret;
+
+		/* bch2_read_super() may have fallen back to opening read only: */
+		if (opt_get(w[i].opts, nochanges))
+			opt_set(*opts, nochanges, true);
+	}
+
+	kfree(w);
+	return ret;
+}
+
 struct bch_fs *bch2_fs_open(char * const *devices, unsigned nr_devices,
 			    struct bch_opts opts)
 {
@@ -1841,12 +2157,9 @@ struct bch_fs *bch2_fs_open(char * const *devices, unsigned nr_devices,
 		goto err;
 	}
 
-	for (i = 0; i < nr_devices; i++) {
-		ret = bch2_read_super(devices[i], &opts, &sb[i]);
-		if (ret)
-			goto err;
-
-	}
+	ret = bch2_read_supers(devices, nr_devices, &opts, sb);
+	if (ret)
+		goto err;
 
 	for (i = 1; i < nr_devices; i++)
 		if (le64_to_cpu(sb[i].sb->seq) >
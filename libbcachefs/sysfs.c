@@ -21,6 +21,7 @@
 #include "btree_gc.h"
 #include "buckets.h"
 #include "clock.h"
+#include "counters.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "inode.h"
@@ -182,6 +183,10 @@ read_attribute(io_latency_read);
 read_attribute(io_latency_write);
 read_attribute(io_latency_stats_read);
 read_attribute(io_latency_stats_write);
+read_attribute(io_latency_hist_read);
+read_attribute(io_latency_hist_write);
+read_attribute(io_latency_by_type);
+read_attribute(io_latency_hist_by_type);
 read_attribute(congested);
 
 read_attribute(btree_avg_write_size);
@@ -204,6 +209,9 @@ read_attribute(alloc_debug);
 BCH_PERSISTENT_COUNTERS()
 #undef x
 
+read_attribute(counters_all);
+read_attribute(counters_rate);
+
 rw_attribute(discard);
 rw_attribute(label);
 
@@ -211,6 +219,7 @@ rw_attribute(copy_gc_enabled);
 read_attribute(copy_gc_wait);
 
 rw_attribute(rebalance_enabled);
+rw_attribute(btree_node_rewrite_threshold);
 sysfs_pd_controller_attribute(rebalance);
 read_attribute(rebalance_work);
 rw_attribute(promote_whole_extents);
@@ -228,7 +237,9 @@ write_attribute(perf_test);
 
 #define x(_name)						\
 	static struct attribute sysfs_time_stat_##_name =		\
-		{ .name = #_name, .mode = S_IRUGO };
+		{ .name = #_name, .mode = S_IRUGO };			\
+	static struct attribute sysfs_time_stat_hist_##_name =		\
+		{ .name = #_name "_hist", .mode = S_IRUGO };
 	BCH_TIME_STATS()
 #undef x
 
@@ -271,6 +282,15 @@ static long data_progress_to_text(struct printbuf *out, struct bch_fs *c)
 		       bch2_btree_ids[stats->btree_id]);
 		bch2_bpos_to_text(out, stats->pos);
 		prt_printf(out, "%s", "\n");
+
+		prt_printf(out, "  read window %u sectors latency ",
+			   READ_ONCE(stats->read_window));
+		bch2_pr_time_units(out, READ_ONCE(stats->read_latency));
+		prt_printf(out, " write window %u sectors latency ",
+			   READ_ONCE(stats->write_window));
+		bch2_pr_time_units(out, READ_ONCE(stats->write_latency));
+		prt_printf(out, " decreases %llu\n",
+			   atomic64_read(&stats->window_decreases));
 	}
 
 	mutex_unlock(&c->data_progress_lock);
@@ -403,9 +423,18 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_gc_gens_pos)
 		bch2_gc_gens_pos_to_text(out, c);
 
+	if (attr == &sysfs_counters_all)
+		bch2_fs_counters_all_to_text(out, c);
+
+	if (attr == &sysfs_counters_rate) {
+		printbuf_tabstop_push(out, 48);
+		bch2_fs_counters_rate_to_text(out, c);
+	}
+
 	sysfs_printf(copy_gc_enabled, "%i", c->copy_gc_enabled);
 
 	sysfs_printf(rebalance_enabled,		"%i", c->rebalance.enabled);
+	sysfs_print(btree_node_rewrite_threshold, c->rebalance.btree_node_rewrite_threshold);
 	sysfs_pd_controller_show(rebalance,	&c->rebalance.pd); /* XXX */
 	sysfs_hprint(copy_gc_wait,
 		     max(0LL, c->copygc_wait -
@@ -483,6 +512,14 @@ STORE(bch2_fs)
 		return ret;
 	}
 
+	if (attr == &sysfs_btree_node_rewrite_threshold) {
+		ssize_t ret = strtoul_safe(buf, c->rebalance.btree_node_rewrite_threshold)
+			?: (ssize_t) size;
+
+		rebalance_wakeup(c);
+		return ret;
+	}
+
 	sysfs_pd_controller_store(rebalance,	&c->rebalance.pd);
 
 	sysfs_strtoul(promote_whole_extents,	c->promote_whole_extents);
@@ -560,6 +597,9 @@ struct attribute *bch2_fs_files[] = {
 
 	&sysfs_compression_stats,
 
+	&sysfs_counters_all,
+	&sysfs_counters_rate,
+
 #ifdef CONFIG_BCACHEFS_TESTS
 	&sysfs_perf_test,
 #endif
@@ -646,6 +686,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_copy_gc_wait,
 
 	&sysfs_rebalance_enabled,
+	&sysfs_btree_node_rewrite_threshold,
 	&sysfs_rebalance_work,
 	sysfs_pd_controller_files(rebalance),
 
@@ -704,6 +745,9 @@ STORE(bch2_fs_opts_dir)
 	bch2_opt_set_sb(c, opt, v);
 	bch2_opt_set_by_id(&c->opts, id, v);
 
+	if (bch2_opt_is_inode_opt(id))
+		bch2_inode_opts_cache_invalidate_all(c);
+
 	if ((id == Opt_background_target ||
 	     id == Opt_background_compression) && v) {
 		bch2_rebalance_add_work(c, S64_MAX);
@@ -746,7 +790,9 @@ SHOW(bch2_fs_time_stats)
 
 #define x(name)								\
 	if (attr == &sysfs_time_stat_##name)				\
-		bch2_time_stats_to_text(out, &c->times[BCH_TIME_##name]);
+		bch2_time_stats_to_text(out, &c->times[BCH_TIME_##name]);\
+	if (attr == &sysfs_time_stat_hist_##name)			\
+		bch2_time_stats_hist_to_text(out, &c->times[BCH_TIME_##name]);
 	BCH_TIME_STATS()
 #undef x
 
@@ -761,7 +807,8 @@ SYSFS_OPS(bch2_fs_time_stats);
 
 struct attribute *bch2_fs_time_stats_files[] = {
 #define x(name)						\
-	&sysfs_time_stat_##name,
+	&sysfs_time_stat_##name,					\
+	&sysfs_time_stat_hist_##name,
 	BCH_TIME_STATS()
 #undef x
 	NULL
@@ -832,6 +879,80 @@ static void dev_iodone_to_text(struct printbuf *out, struct bch_dev *ca)
 	}
 }
 
+/*
+ * One line per direction and data type that has seen IO; latencies in ns,
+ * depth is the average number in flight (mean latency / mean interval):
+ */
+static void dev_io_latency_by_type_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	struct time_stats_hist *h = kmalloc(sizeof(*h), GFP_KERNEL);
+	int rw, i, j;
+
+	if (!h) {
+		prt_printf(out, "(out of memory)\n");
+		return;
+	}
+
+	prt_printf(out, "rw type nr bytes avg p50 p90 p99 p99.9 max depth\n");
+
+	for (rw = 0; rw < 2; rw++)
+		for (i = 1; i < BCH_DATA_NR; i++) {
+			struct time_stats *s = &ca->io_latency_by_type[rw][i];
+			u64 nr = 0, depth;
+
+			bch2_time_stats_hist_read(s, h);
+			for (j = 0; j < TIME_STATS_HIST_NR; j++)
+				nr += h->buckets[j];
+			if (!nr)
+				continue;
+
+			depth = s->average_frequency
+				? div64_u64(s->average_duration * 100,
+					    s->average_frequency)
+				: 0;
+
+			prt_printf(out, "%s %s %llu %llu %llu %llu %llu %llu %llu %llu %llu.%02llu\n",
+				   bch2_rw[rw], bch2_data_types[i], nr,
+				   percpu_u64_get(&ca->io_done->sectors[rw][i]) << 9,
+				   s->average_duration,
+				   bch2_time_stats_hist_quantile(h, nr, 1, 2),
+				   bch2_time_stats_hist_quantile(h, nr, 9, 10),
+				   bch2_time_stats_hist_quantile(h, nr, 99, 100),
+				   bch2_time_stats_hist_quantile(h, nr, 999, 1000),
+				   s->max_duration,
+				   depth / 100, depth % 100);
+		}
+
+	kfree(h);
+}
+
+/* rw type start end count, for every non empty histogram bucket: */
+static void dev_io_latency_hist_by_type_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	struct time_stats_hist *h = kmalloc(sizeof(*h), GFP_KERNEL);
+	int rw, i, j;
+
+	if (!h) {
+		prt_printf(out, "(out of memory)\n");
+		return;
+	}
+
+	for (rw = 0; rw < 2; rw++)
+		for (i = 1; i < BCH_DATA_NR; i++) {
+			bch2_time_stats_hist_read(&ca->io_latency_by_type[rw][i], h);
+
+			for (j = 0; j < TIME_STATS_HIST_NR; j++)
+				if (h->buckets[j])
+					prt_printf(out, "%s %s %llu %llu %llu\n",
+						   bch2_rw[rw], bch2_data_types[i],
+						   bch2_time_stats_hist_bucket_start(j),
+						   bch2_time_stats_hist_bucket_end(j),
+						   h->buckets[j]);
+		}
+
+	kfree(h);
+}
+
 SHOW(bch2_dev)
 {
 	struct bch_dev *ca = container_of(kobj, struct bch_dev, kobj);
@@ -878,6 +999,18 @@ SHOW(bch2_dev)
 	if (attr == &sysfs_io_latency_stats_write)
 		bch2_time_stats_to_text(out, &ca->io_latency[WRITE]);
 
+	if (attr == &sysfs_io_latency_hist_read)
+		bch2_time_stats_hist_to_text(out, &ca->io_latency[READ]);
+
+	if (attr == &sysfs_io_latency_hist_write)
+		bch2_time_stats_hist_to_text(out, &ca->io_latency[WRITE]);
+
+	if (attr == &sysfs_io_latency_by_type)
+		dev_io_latency_by_type_to_text(out, ca);
+
+	if (attr == &sysfs_io_latency_hist_by_type)
+		dev_io_latency_hist_by_type_to_text(out, ca);
+
 	sysfs_printf(congested,			"%u%%",
 		     clamp(atomic_read(&ca->congested), 0, CONGESTED_MAX)
 		     * 100 / CONGESTED_MAX);
@@ -944,6 +1077,10 @@ struct attribute *bch2_dev_files[] = {
 	&sysfs_io_latency_write,
 	&sysfs_io_latency_stats_read,
 	&sysfs_io_latency_stats_write,
+	&sysfs_io_latency_hist_read,
+	&sysfs_io_latency_hist_write,
+	&sysfs_io_latency_by_type,
+	&sysfs_io_latency_hist_by_type,
 	&sysfs_congested,
 
 	/* debug: */
@@ -2,12 +2,20 @@
 #ifdef CONFIG_BCACHEFS_TESTS
 
 #include "bcachefs.h"
+#include "bkey_sort.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
+#include "inode.h"
+#include "keylist.h"
 #include "journal_reclaim.h"
 #include "subvolume.h"
 #include "tests.h"
+#include "varint.h"
+#include "xattr.h"
 
+#include "linux/hash.h"
 #include "linux/kthread.h"
+#include "linux/prandom.h"
 #include "linux/random.h"
 
 static void delete_test_keys(struct bch_fs *c)
@@ -564,6 +572,19 @@ static int test_snapshots(struct bch_fs *c, u64 nr)
 
 /* perf tests */
 
+/*
+ * Per operation latencies, for the tests where an iteration is one operation;
+ * perf tests are serialized by perf_test_lock, so this can be global:
+ */
+static DEFINE_MUTEX(perf_test_lock);
+static struct time_stats *perf_test_times;
+
+static inline void perf_test_op_done(u64 start)
+{
+	if (perf_test_times)
+		bch2_time_stats_update(perf_test_times, start);
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -585,6 +606,8 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = test_rand();
 		k.k.p.snapshot = U32_MAX;
@@ -595,6 +618,7 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_insert: %s", bch2_err_str(ret));
 			break;
 		}
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_exit(&trans);
@@ -650,6 +674,8 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 			     SPOS(0, 0, U32_MAX), 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		bch2_btree_iter_set_pos(&iter, SPOS(0, test_rand(), U32_MAX));
 
 		lockrestart_do(&trans, bkey_err(k = bch2_btree_iter_peek(&iter)));
@@ -658,6 +684,7 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_lookup: %s", bch2_err_str(ret));
 			break;
 		}
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_iter_exit(&trans, &iter);
@@ -665,6 +692,66 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/*
+ * Lookups through many iterators in one transaction, like fsck and rename do:
+ * every lookup moves a path, and the transaction has to keep trans->sorted in
+ * order:
+ */
+#define MANY_PATHS_NR		(BTREE_ITER_MAX / 2)
+
+static int rand_lookup_many_paths_trans(struct btree_trans *trans,
+					struct btree_iter *iter)
+{
+	struct bkey_s_c k;
+	unsigned j;
+	int ret = 0;
+
+	for (j = 0; j < MANY_PATHS_NR && !ret; j++) {
+		bch2_btree_iter_set_pos(&iter[j], SPOS(0, test_rand(), U32_MAX));
+
+		k = bch2_btree_iter_peek(&iter[j]);
+		ret = bkey_err(k);
+	}
+
+	return ret;
+}
+
+static int rand_lookup_many_paths(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	int ret = 0;
+	unsigned j;
+	u64 i;
+
+	iter = kcalloc(MANY_PATHS_NR, sizeof(*iter), GFP_KERNEL);
+	if (!iter)
+		return -ENOMEM;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	for (j = 0; j < MANY_PATHS_NR; j++)
+		bch2_trans_iter_init(&trans, &iter[j], BTREE_ID_xattrs,
+				     SPOS(0, 0, U32_MAX), 0);
+
+	for (i = 0; i < nr; i += MANY_PATHS_NR) {
+		u64 start = local_clock();
+
+		ret = lockrestart_do(&trans,
+			rand_lookup_many_paths_trans(&trans, iter));
+		if (ret) {
+			bch_err(c, "error in rand_lookup_many_paths: %s", bch2_err_str(ret));
+			break;
+		}
+		perf_test_op_done(start);
+	}
+
+	for (j = 0; j < MANY_PATHS_NR; j++)
+		bch2_trans_iter_exit(&trans, &iter[j]);
+	bch2_trans_exit(&trans);
+	kfree(iter);
+	return ret;
+}
+
 static int rand_mixed_trans(struct btree_trans *trans,
 			    struct btree_iter *iter,
 			    struct bkey_i_cookie *cookie,
@@ -704,6 +791,8 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 			     SPOS(0, 0, U32_MAX), 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		rand = test_rand();
 		ret = commit_do(&trans, NULL, NULL, 0,
 			rand_mixed_trans(&trans, &iter, &cookie, i, rand));
@@ -711,6 +800,7 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 			bch_err(c, "update error in rand_mixed: %s", bch2_err_str(ret));
 			break;
 		}
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_iter_exit(&trans, &iter);
@@ -749,6 +839,7 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
 		struct bpos pos = SPOS(0, test_rand(), U32_MAX);
 
 		ret = commit_do(&trans, NULL, NULL, 0,
@@ -757,6 +848,7 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_delete: %s", bch2_err_str(ret));
 			break;
 		}
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_exit(&trans);
@@ -792,6 +884,36 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+static int seq_insert_bulk(struct bch_fs *c, u64 nr)
+{
+	struct keylist keys;
+	struct bkey_i_cookie *k;
+	size_t batch = min_t(u64, nr, 1 << 16);
+	u64 i = 0;
+	int ret = 0;
+
+	keys.keys = kvmalloc_array(batch, sizeof(*k), GFP_KERNEL);
+	if (!keys.keys)
+		return -ENOMEM;
+
+	while (!ret && i < nr) {
+		keys.top = keys.keys;
+
+		for (; i < nr && keys.top != (void *) keys.keys + batch * sizeof(*k); i++) {
+			k = bkey_cookie_init(keys.top);
+			k->k.p = SPOS(0, i, U32_MAX);
+			bch2_keylist_push(&keys);
+		}
+
+		ret = bch2_btree_bulk_insert(c, BTREE_ID_xattrs, &keys, 0);
+	}
+	if (ret)
+		bch_err(c, "error in %s(): %s", __func__, bch2_err_str(ret));
+
+	kvfree(keys.keys);
+	return ret;
+}
+
 static int seq_lookup(struct bch_fs *c, u64 nr)
 {
 	struct btree_trans trans;
@@ -849,8 +971,358 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/* inode unpacking: */
+
+static void inode_unpack_test_key(struct bch_fs *c, struct bkey_inode_buf *p)
+{
+	struct bch_inode_unpacked u;
+	u64 now = 1700000000ULL * NSEC_PER_SEC + get_random_u32();
+
+	bch2_inode_init(c, &u, 1000, 1000, S_IFREG|0644, 0, NULL);
+	u.bi_inum	= 4096;
+	u.bi_atime	= now;
+	u.bi_ctime	= now;
+	u.bi_mtime	= now;
+	u.bi_otime	= now;
+	u.bi_size	= 123456;
+	u.bi_sectors	= 248;
+	u.bi_nlink	= 0;
+	u.bi_dir	= 4095;
+	u.bi_dir_offset	= get_random_u32();
+
+	bch2_inode_pack(c, p, &u);
+}
+
+static int inode_unpack(struct bch_fs *c, u64 nr)
+{
+	struct bkey_inode_buf p;
+	struct bch_inode_unpacked u;
+	u64 i;
+	int ret = 0;
+
+	inode_unpack_test_key(c, &p);
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = bch2_inode_unpack(bkey_i_to_s_c(&p.inode.k_i), &u);
+
+	return ret ? -EINVAL : 0;
+}
+
+/* For comparison: decode the same fields one varint at a time */
+static int inode_unpack_scalar(struct bch_fs *c, u64 nr)
+{
+	struct bkey_inode_buf p;
+	const u8 *in, *end;
+	unsigned j, nr_varints = 0;
+	u64 i, v;
+	int ret;
+
+#define x(_name, _bits)	nr_varints += _bits > 64 ? 2 : 1;
+	BCH_INODE_FIELDS()
+#undef  x
+
+	inode_unpack_test_key(c, &p);
+	end = bkey_val_end(bkey_i_to_s_c(&p.inode.k_i));
+
+	for (i = 0; i < nr; i++)
+		for (in = p.inode.v.fields, j = 0; j < nr_varints; j++) {
+			ret = bch2_varint_decode_fast(in, end, &v);
+			if (ret < 0)
+				return -EINVAL;
+			in += ret;
+		}
+
+	return 0;
+}
+
 typedef int (*perf_test_fn)(struct bch_fs *, u64);
 
+/*
+ * Configurable workloads: keys are xattrs in inode 0 with values of the
+ * requested size, picked from a uniform, zipfian or hotspot distribution, or
+ * replayed from a trace:
+ */
+
+const char * const bch2_perf_ops[] = {
+#define x(n)	#n,
+	BCH_PERF_OPS()
+#undef x
+	NULL
+};
+
+const char * const bch2_perf_dists[] = {
+#define x(n)	#n,
+	BCH_PERF_DISTS()
+#undef x
+	NULL
+};
+
+/* Protected by perf_test_lock, like perf_test_times: */
+static struct bch_perf_workload *perf_workload;
+static u32 *perf_workload_snapshots;
+static unsigned perf_workload_nr_snapshots;
+static atomic64_t perf_workload_trace_next;
+
+static u64 mod64(u64 v, u64 n)
+{
+	u64 rem;
+
+	div64_u64_rem(v, n, &rem);
+	return rem;
+}
+
+static u64 test_rand_below(u64 n)
+{
+	return n > 1 ? mod64(test_rand(), n) : 0;
+}
+
+/*
+ * Zipfian with theta = 1, approximately: the probability of a key is
+ * proportional to 1/rank, so pick an octave of ranks uniformly, then a rank
+ * uniformly within it. Hot ranks are then scattered over the keyspace, as
+ * real hot keys would be. No floating point, so that this works in the kernel:
+ */
+static u64 perf_workload_zipf(u64 n)
+{
+	u64 r = test_rand();
+	unsigned e = (r >> 32) % fls64(n);
+	u64 rank = (1ULL << e) + (((r & U32_MAX) << e) >> 32) - 1;
+
+	return mod64(rank * GOLDEN_RATIO_64, n);
+}
+
+static u64 perf_workload_key(struct bch_perf_workload *w)
+{
+	u64 hot;
+
+	switch (w->dist) {
+	case BCH_PERF_DIST_zipf:
+		return perf_workload_zipf(w->nr_keys);
+	case BCH_PERF_DIST_hotspot:
+		hot = max_t(u64, div64_u64(w->nr_keys * w->hot_keys_pct, 100), 1);
+
+		if (hot >= w->nr_keys ||
+		    test_rand_below(100) < w->hot_ops_pct)
+			return test_rand_below(hot);
+		return hot + test_rand_below(w->nr_keys - hot);
+	default:
+		return test_rand_below(w->nr_keys);
+	}
+}
+
+static enum bch_perf_op perf_workload_op(struct bch_perf_workload *w)
+{
+	unsigned r = test_rand_below(100), op;
+
+	for (op = 0; op < BCH_PERF_OP_NR; op++) {
+		if (r < w->op_pct[op])
+			return op;
+		r -= w->op_pct[op];
+	}
+
+	return BCH_PERF_OP_read;
+}
+
+static u32 perf_workload_snapshot(void)
+{
+	return perf_workload_nr_snapshots
+		? perf_workload_snapshots[test_rand_below(perf_workload_nr_snapshots)]
+		: U32_MAX;
+}
+
+static int perf_workload_read(struct btree_trans *trans, struct bpos pos)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs, pos, 0);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k);
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int perf_workload_scan(struct btree_trans *trans, struct bpos pos,
+			      unsigned nr)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs, pos, 0);
+
+	while (nr--) {
+		k = bch2_btree_iter_peek(&iter);
+		ret = bkey_err(k);
+		if (ret || !k.k || k.k->p.inode)
+			break;
+		bch2_btree_iter_advance(&iter);
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int perf_workload_delete(struct btree_trans *trans, struct bpos pos)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs, pos,
+			     BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k);
+	if (!ret && k.k->type != KEY_TYPE_deleted)
+		ret = bch2_btree_delete_at(trans, &iter, 0);
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static void perf_workload_key_init(struct bch_perf_workload *w,
+				   struct bkey_i *k, struct bpos pos)
+{
+	struct bkey_i_xattr *x = bkey_xattr_init(k);
+	unsigned val_bytes = w->val_bytes_min +
+		test_rand_below(w->val_bytes_max - w->val_bytes_min + 1);
+
+	x->k.p			= pos;
+	x->v.x_type		= KEY_TYPE_XATTR_INDEX_USER;
+	x->v.x_name_len		= 1;
+	x->v.x_val_len		= cpu_to_le16(val_bytes);
+	x->v.x_name[0]		= 'w';
+	memset(xattr_val(&x->v), pos.offset, val_bytes);
+	set_bkey_val_u64s(&x->k, xattr_val_u64s(1, val_bytes));
+}
+
+static int perf_workload_op_do(struct btree_trans *trans,
+			       struct bch_perf_workload *w,
+			       enum bch_perf_op op, struct bpos pos,
+			       struct bkey_i *k)
+{
+	switch (op) {
+	case BCH_PERF_OP_read:
+		return lockrestart_do(trans, perf_workload_read(trans, pos));
+	case BCH_PERF_OP_scan:
+		return lockrestart_do(trans,
+			perf_workload_scan(trans, pos, w->scan_len));
+	case BCH_PERF_OP_write:
+		perf_workload_key_init(w, k, pos);
+		return commit_do(trans, NULL, NULL, 0,
+			__bch2_btree_insert(trans, BTREE_ID_xattrs, k));
+	case BCH_PERF_OP_delete:
+		return commit_do(trans, NULL, NULL, 0,
+			perf_workload_delete(trans, pos));
+	default:
+		return -EINVAL;
+	}
+}
+
+static int workload(struct bch_fs *c, u64 nr)
+{
+	struct bch_perf_workload *w = perf_workload;
+	struct btree_trans trans;
+	struct bkey_i *k;
+	enum bch_perf_op op;
+	u64 i, key, idx, start;
+	int ret = 0;
+
+	k = kmalloc(BKEY_U64s * sizeof(u64) +
+		    xattr_val_u64s(1, w->val_bytes_max) * sizeof(u64),
+		    GFP_KERNEL);
+	if (!k)
+		return -ENOMEM;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	/* When replaying a trace, threads take the next op until it's done: */
+	for (i = 0; w->trace || i < nr; i++) {
+		if (w->trace) {
+			idx = atomic64_inc_return(&perf_workload_trace_next) - 1;
+			if (idx >= w->trace_nr)
+				break;
+
+			op	= w->trace[idx].op;
+			key	= w->trace[idx].key;
+		} else {
+			op	= perf_workload_op(w);
+			key	= perf_workload_key(w);
+		}
+
+		start = local_clock();
+
+		ret = perf_workload_op_do(&trans, w, op,
+				SPOS(0, key, perf_workload_snapshot()), k);
+		if (ret) {
+			bch_err(c, "error in workload %s: %s",
+				bch2_perf_ops[op], bch2_err_str(ret));
+			break;
+		}
+
+		if (w->latency[op])
+			bch2_time_stats_update(w->latency[op], start);
+	}
+
+	bch2_trans_exit(&trans);
+	kfree(k);
+	return ret;
+}
+
+/*
+ * Snapshot heavy workloads: a chain of @nr snapshots, each node with one child
+ * that continues the chain and one leaf; keys are spread over the leaves, so
+ * lookups have to filter out keys in unrelated snapshots:
+ */
+static int perf_workload_snapshots_create(struct bch_fs *c, unsigned nr)
+{
+	u32 parent = U32_MAX, ids[2], subvols[2] = { 1, 1 };
+	unsigned i;
+	int ret = 0;
+
+	perf_workload_snapshots = kcalloc(nr + 1, sizeof(u32), GFP_KERNEL);
+	if (!perf_workload_snapshots)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		ret = bch2_trans_do(c, NULL, NULL, 0,
+			bch2_snapshot_node_create(&trans, parent, ids,
+						  subvols, 2));
+		if (ret)
+			return ret;
+
+		perf_workload_snapshots[perf_workload_nr_snapshots++] = ids[1];
+		parent = ids[0];
+	}
+
+	perf_workload_snapshots[perf_workload_nr_snapshots++] = parent;
+	return 0;
+}
+
+static int bch2_perf_workload_validate(struct bch_perf_workload *w)
+{
+	unsigned op, pct = 0;
+
+	for (op = 0; op < BCH_PERF_OP_NR; op++)
+		pct += w->op_pct[op];
+
+	if ((!w->trace && pct != 100) ||
+	    (!w->trace && !w->nr_keys) ||
+	    w->dist >= BCH_PERF_DIST_NR ||
+	    w->hot_keys_pct > 100 ||
+	    w->hot_ops_pct > 100 ||
+	    w->val_bytes_min > w->val_bytes_max ||
+	    BKEY_U64s + xattr_val_u64s(1, w->val_bytes_max) > U8_MAX)
+		return -EINVAL;
+
+	if (w->trace)
+		for (op = 0; op < w->trace_nr; op++)
+			if (w->trace[op].op >= BCH_PERF_OP_NR)
+				return -EINVAL;
+
+	return 0;
+}
+
 struct test_job {
 	struct bch_fs			*c;
 	u64				nr;
@@ -894,15 +1366,22 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			 u64 nr, unsigned nr_threads)
+/*
+ * Run a perf test, returning the elapsed time in @time; if @latency is non
+ * NULL, tests where each iteration is a single operation record per operation
+ * latencies in it:
+ */
+/* Caller holds perf_test_lock: */
+static int run_perf_test(struct bch_fs *c, perf_test_fn fn,
+			 u64 nr, unsigned nr_threads, u64 *time)
 {
-	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20];
-	struct printbuf nr_buf = PRINTBUF;
-	struct printbuf per_sec_buf = PRINTBUF;
+	struct test_job j = {
+		.c		= c,
+		.nr		= nr,
+		.nr_threads	= nr_threads,
+		.fn		= fn,
+	};
 	unsigned i;
-	u64 time;
 
 	atomic_set(&j.ready, nr_threads);
 	init_waitqueue_head(&j.ready_wait);
@@ -910,20 +1389,139 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	atomic_set(&j.done, nr_threads);
 	init_completion(&j.done_completion);
 
+	if (nr_threads == 1)
+		btree_perf_test_thread(&j);
+	else
+		for (i = 0; i < nr_threads; i++)
+			kthread_run(btree_perf_test_thread, &j,
+				    "bcachefs perf test[%u]", i);
+
+	while (wait_for_completion_interruptible(&j.done_completion))
+		;
+
+	*time = j.finish - j.start;
+	return j.ret;
+}
+
+/* bset merging: */
+
+#define BKEY_SORT_TEST_KEYS	256
+
+/*
+ * Merge nr_sets runs of BKEY_SORT_TEST_KEYS keys, interleaved so that every
+ * key comes from a different run than the last; with @overlapping, runs are
+ * paired up with the same keys, and key_sort_fix_overlapping() drops half:
+ */
+static int bkey_sort_test(struct bch_fs *c, u64 nr, unsigned nr_sets,
+			  bool overlapping)
+{
+	unsigned keys = nr_sets * BKEY_SORT_TEST_KEYS, i, j;
+	size_t run_bytes = BKEY_SORT_TEST_KEYS * BKEY_U64s * sizeof(u64);
+	struct btree *b = kzalloc(sizeof(*b), GFP_KERNEL);
+	struct sort_iter *iter = kmalloc(sort_iter_bytes(nr_sets), GFP_KERNEL);
+	struct bset *dst = kvpmalloc(sizeof(*dst) + keys * BKEY_U64s * sizeof(u64),
+				     GFP_KERNEL);
+	u64 *src = kvpmalloc(nr_sets * run_bytes, GFP_KERNEL);
+	u64 done;
+	int ret = 0;
+
+	if (!b || !iter || !dst || !src) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	b->format = bch2_bkey_format_current;
+
+	for (j = 0; j < nr_sets; j++)
+		for (i = 0; i < BKEY_SORT_TEST_KEYS; i++) {
+			struct bkey_i *k = (void *) src + j * run_bytes +
+				i * BKEY_U64s * sizeof(u64);
+
+			bkey_init(&k->k);
+			k->k.p.offset = overlapping
+				? i * (nr_sets / 2) + j / 2
+				: i * nr_sets + j;
+		}
+
+	for (done = 0; done < nr && !ret; done += keys) {
+		unsigned expected = overlapping ? keys / 2 : keys;
+		unsigned u64s;
+
+		sort_iter_init_nr(iter, b, nr_sets);
+		for (j = 0; j < nr_sets; j++)
+			sort_iter_add(iter, (void *) src + j * run_bytes,
+				      (void *) src + (j + 1) * run_bytes);
+
+		if (overlapping) {
+			bch2_key_sort_fix_overlapping(c, dst, iter);
+			u64s = le16_to_cpu(dst->u64s);
+		} else {
+			u64s = bch2_sort_keys(dst->start, iter, false);
+		}
+
+		if (u64s != expected * BKEY_U64s) {
+			pr_err("merged %u keys, expected %u",
+			       u64s / (unsigned) BKEY_U64s, expected);
+			ret = -EINVAL;
+		}
+	}
+err:
+	if (src)
+		kvpfree(src, nr_sets * run_bytes);
+	if (dst)
+		kvpfree(dst, sizeof(*dst) + keys * BKEY_U64s * sizeof(u64));
+	kfree(iter);
+	kfree(b);
+	return ret;
+}
+
+static int bkey_sort_3(struct bch_fs *c, u64 nr)
+{
+	return bkey_sort_test(c, nr, 3, false);
+}
+
+static int bkey_sort_64(struct bch_fs *c, u64 nr)
+{
+	return bkey_sort_test(c, nr, 64, false);
+}
+
+static int bkey_sort_overlapping_64(struct bch_fs *c, u64 nr)
+{
+	return bkey_sort_test(c, nr, 64, true);
+}
+
+int __bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			   u64 nr, unsigned nr_threads,
+			   u64 *time, struct time_stats *latency)
+{
+	perf_test_fn fn = NULL;
+	int ret;
+
+	*time = 0;
+
 #define perf_test(_test)				\
-	if (!strcmp(testname, #_test)) j.fn = _test
+	if (!strcmp(testname, #_test)) fn = _test
 
 	perf_test(rand_insert);
 	perf_test(rand_insert_multi);
 	perf_test(rand_lookup);
+	perf_test(rand_lookup_many_paths);
 	perf_test(rand_mixed);
 	perf_test(rand_delete);
 
 	perf_test(seq_insert);
+	perf_test(seq_insert_bulk);
 	perf_test(seq_lookup);
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(inode_unpack);
+	perf_test(inode_unpack_scalar);
+
+	perf_test(bkey_sort_3);
+	perf_test(bkey_sort_64);
+	perf_test(bkey_sort_overlapping_64);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -941,24 +1539,65 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 
 	perf_test(test_snapshots);
 
-	if (!j.fn) {
+	if (!fn) {
 		pr_err("unknown test %s", testname);
 		return -EINVAL;
 	}
 
 	//pr_info("running test %s:", testname);
 
-	if (nr_threads == 1)
-		btree_perf_test_thread(&j);
-	else
-		for (i = 0; i < nr_threads; i++)
-			kthread_run(btree_perf_test_thread, &j,
-				    "bcachefs perf test[%u]", i);
+	mutex_lock(&perf_test_lock);
+	perf_test_times = latency;
 
-	while (wait_for_completion_interruptible(&j.done_completion))
-		;
+	ret = run_perf_test(c, fn, nr, nr_threads, time);
+
+	perf_test_times = NULL;
+	mutex_unlock(&perf_test_lock);
+
+	return ret;
+}
+
+int bch2_btree_perf_workload(struct bch_fs *c, struct bch_perf_workload *w,
+			     u64 nr, unsigned nr_threads, u64 *time)
+{
+	int ret;
+
+	*time = 0;
+
+	ret = bch2_perf_workload_validate(w);
+	if (ret)
+		return ret;
 
-	time = j.finish - j.start;
+	mutex_lock(&perf_test_lock);
+	perf_workload = w;
+	atomic64_set(&perf_workload_trace_next, 0);
+
+	ret = perf_workload_snapshots_create(c, w->nr_snapshots);
+	if (!ret)
+		ret = run_perf_test(c, workload,
+				    w->trace ? w->trace_nr : nr, nr_threads, time);
+
+	kfree(perf_workload_snapshots);
+	perf_workload_snapshots		= NULL;
+	perf_workload_nr_snapshots	= 0;
+	perf_workload			= NULL;
+	mutex_unlock(&perf_test_lock);
+
+	return ret;
+}
+
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads)
+{
+	char name_buf[20];
+	struct printbuf nr_buf = PRINTBUF;
+	struct printbuf per_sec_buf = PRINTBUF;
+	u64 time;
+	int ret;
+
+	ret = __bch2_btree_perf_test(c, testname, nr, nr_threads, &time, NULL);
+	if (!time)	/* unknown test */
+		return ret;
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
 	prt_human_readable_u64(&nr_buf, nr);
@@ -970,7 +1609,7 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 		per_sec_buf.buf);
 	printbuf_exit(&per_sec_buf);
 	printbuf_exit(&nr_buf);
-	return j.ret;
+	return ret;
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
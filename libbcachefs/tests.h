@@ -6,6 +6,70 @@ struct bch_fs;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
+struct time_stats;
+
+#define BCH_PERF_OPS()		\
+	x(read)			\
+	x(write)		\
+	x(delete)		\
+	x(scan)
+
+enum bch_perf_op {
+#define x(n)	BCH_PERF_OP_##n,
+	BCH_PERF_OPS()
+#undef x
+	BCH_PERF_OP_NR
+};
+
+#define BCH_PERF_DISTS()	\
+	x(uniform)		\
+	x(zipf)			\
+	x(hotspot)
+
+enum bch_perf_dist {
+#define x(n)	BCH_PERF_DIST_##n,
+	BCH_PERF_DISTS()
+#undef x
+	BCH_PERF_DIST_NR
+};
+
+extern const char * const bch2_perf_ops[];
+extern const char * const bch2_perf_dists[];
+
+struct bch_perf_trace_op {
+	u64			key;
+	u8			op;
+};
+
+/*
+ * A btree workload for bch2_btree_perf_workload(): either a mix of operations
+ * on keys from a distribution, or a trace to replay.
+ */
+struct bch_perf_workload {
+	u64			nr_keys;
+	enum bch_perf_dist	dist;
+	/* hotspot: hot_ops_pct of operations go to the first hot_keys_pct of keys */
+	unsigned		hot_keys_pct;
+	unsigned		hot_ops_pct;
+	unsigned		val_bytes_min;
+	unsigned		val_bytes_max;
+	/* percentages, must add up to 100 */
+	unsigned		op_pct[BCH_PERF_OP_NR];
+	unsigned		scan_len;
+	unsigned		nr_snapshots;
+
+	const struct bch_perf_trace_op *trace;
+	u64			trace_nr;
+
+	/* per operation latencies, if non NULL: */
+	struct time_stats	*latency[BCH_PERF_OP_NR];
+};
+
+int bch2_btree_perf_workload(struct bch_fs *, struct bch_perf_workload *,
+			     u64, unsigned, u64 *);
+
+int __bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			   u64 *, struct time_stats *);
 int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
 
 #else
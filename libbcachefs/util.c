@@ -318,6 +318,111 @@ int bch2_prt_backtrace(struct printbuf *out, struct task_struct *task)
 
 /* time stats: */
 
+static unsigned time_stats_hist_idx(u64 v)
+{
+	unsigned shift;
+
+	if (v < TIME_STATS_HIST_SUB)
+		return v;
+
+	shift = fls64(v) - 1;
+	if (shift >= TIME_STATS_HIST_MAX_SHIFT)
+		return TIME_STATS_HIST_NR - 1;
+
+	return (shift - TIME_STATS_HIST_SUB_BITS + 1) * TIME_STATS_HIST_SUB +
+		((v >> (shift - TIME_STATS_HIST_SUB_BITS)) &
+		 (TIME_STATS_HIST_SUB - 1));
+}
+
+/* Smallest value counted in bucket @idx: */
+u64 bch2_time_stats_hist_bucket_start(unsigned idx)
+{
+	unsigned shift = idx / TIME_STATS_HIST_SUB;
+
+	if (!shift)
+		return idx;
+
+	return (u64) (TIME_STATS_HIST_SUB + idx % TIME_STATS_HIST_SUB) <<
+		(shift - 1);
+}
+
+u64 bch2_time_stats_hist_bucket_end(unsigned idx)
+{
+	return idx + 1 < TIME_STATS_HIST_NR
+		? bch2_time_stats_hist_bucket_start(idx + 1) - 1
+		: U64_MAX;
+}
+
+static noinline struct time_stats_hist __percpu *
+time_stats_hist_alloc(struct time_stats *stats)
+{
+	struct time_stats_hist __percpu *hist =
+		alloc_percpu_gfp(struct time_stats_hist, GFP_ATOMIC);
+
+	if (hist && cmpxchg(&stats->hist, NULL, hist))
+		free_percpu(hist);
+	return READ_ONCE(stats->hist);
+}
+
+static inline void time_stats_hist_update(struct time_stats *stats,
+					  u64 start, u64 end)
+{
+	struct time_stats_hist __percpu *hist = READ_ONCE(stats->hist);
+
+	if (unlikely(!hist)) {
+		hist = time_stats_hist_alloc(stats);
+		if (!hist)
+			return;
+	}
+
+	this_cpu_inc(hist->buckets[time_stats_hist_idx(time_after64(end, start)
+						       ? end - start : 0)]);
+}
+
+/**
+ * bch2_time_stats_hist_read - sum the percpu histograms of a time_stats
+ */
+void bch2_time_stats_hist_read(struct time_stats *stats,
+			       struct time_stats_hist *out)
+{
+	struct time_stats_hist __percpu *hist = READ_ONCE(stats->hist);
+	int cpu;
+	unsigned i;
+
+	memset(out, 0, sizeof(*out));
+
+	if (!hist)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct time_stats_hist *h = per_cpu_ptr(hist, cpu);
+
+		for (i = 0; i < TIME_STATS_HIST_NR; i++)
+			out->buckets[i] += READ_ONCE(h->buckets[i]);
+	}
+}
+
+/**
+ * bch2_time_stats_hist_quantile - the value below which @num/@den of the
+ * samples fall, e.g. 999/1000 for p99.9
+ *
+ * Returns the upper bound of the bucket the quantile falls in.
+ */
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *h, u64 nr,
+				  u64 num, u64 den)
+{
+	u64 want = nr - div64_u64(nr * (den - num), den), seen = 0;
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++) {
+		seen += h->buckets[i];
+		if (seen && seen >= want)
+			return bch2_time_stats_hist_bucket_end(i);
+	}
+
+	return 0;
+}
+
 static void bch2_time_stats_update_one(struct time_stats *stats,
 				       u64 start, u64 end)
 {
@@ -349,6 +454,8 @@ void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 {
 	unsigned long flags;
 
+	time_stats_hist_update(stats, start, end);
+
 	if (!stats->buffer) {
 		spin_lock_irqsave(&stats->lock, flags);
 		bch2_time_stats_update_one(stats, start, end);
@@ -410,7 +517,7 @@ static const struct time_unit *pick_time_units(u64 ns)
 	return u;
 }
 
-static void pr_time_units(struct printbuf *out, u64 ns)
+void bch2_pr_time_units(struct printbuf *out, u64 ns)
 {
 	const struct time_unit *u = pick_time_units(ns);
 
@@ -420,8 +527,9 @@ static void pr_time_units(struct printbuf *out, u64 ns)
 void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 {
 	const struct time_unit *u;
+	struct time_stats_hist *h;
 	u64 freq = READ_ONCE(stats->average_frequency);
-	u64 q, last_q = 0;
+	u64 q, last_q = 0, nr = 0;
 	int i;
 
 	prt_printf(out, "count:\t\t%llu",
@@ -432,15 +540,15 @@ void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 	prt_newline(out);
 
 	prt_printf(out, "frequency:\t");
-	pr_time_units(out, freq);
+	bch2_pr_time_units(out, freq);
 
 	prt_newline(out);
 	prt_printf(out, "avg duration:\t");
-	pr_time_units(out, stats->average_duration);
+	bch2_pr_time_units(out, stats->average_duration);
 
 	prt_newline(out);
 	prt_printf(out, "max duration:\t");
-	pr_time_units(out, stats->max_duration);
+	bch2_pr_time_units(out, stats->max_duration);
 
 	i = eytzinger0_first(NR_QUANTILES);
 	u = pick_time_units(stats->quantiles.entries[i].m);
@@ -457,10 +565,71 @@ void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 			prt_newline(out);
 		last_q = q;
 	}
+
+	h = kmalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return;
+
+	bch2_time_stats_hist_read(stats, h);
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		nr += h->buckets[i];
+
+	if (nr) {
+		static const struct {
+			const char	*name;
+			u64		num, den;
+		} pcts[] = {
+			{ "p50",	1,	2	},
+			{ "p90",	9,	10	},
+			{ "p99",	99,	100	},
+			{ "p99.9",	999,	1000	},
+			{ "p99.99",	9999,	10000	},
+		};
+
+		for (i = 0; i < ARRAY_SIZE(pcts); i++) {
+			prt_printf(out, "%s:\t\t", pcts[i].name);
+			bch2_pr_time_units(out,
+				bch2_time_stats_hist_quantile(h, nr,
+						pcts[i].num, pcts[i].den));
+			prt_newline(out);
+		}
+	}
+
+	kfree(h);
+}
+
+/**
+ * bch2_time_stats_hist_to_text - machine readable histogram
+ *
+ * One line per nonempty bucket: the bucket's range in nanoseconds, inclusive,
+ * and the number of samples in it.
+ */
+void bch2_time_stats_hist_to_text(struct printbuf *out, struct time_stats *stats)
+{
+	struct time_stats_hist *h = kmalloc(sizeof(*h), GFP_KERNEL);
+	unsigned i;
+
+	if (!h) {
+		prt_printf(out, "(out of memory)\n");
+		return;
+	}
+
+	bch2_time_stats_hist_read(stats, h);
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		if (h->buckets[i])
+			prt_printf(out, "%llu %llu %llu\n",
+				   bch2_time_stats_hist_bucket_start(i),
+				   bch2_time_stats_hist_bucket_end(i),
+				   h->buckets[i]);
+
+	kfree(h);
 }
 
 void bch2_time_stats_exit(struct time_stats *stats)
 {
+	free_percpu(stats->hist);
 	free_percpu(stats->buffer);
 }
 
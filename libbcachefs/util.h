@@ -378,6 +378,26 @@ struct time_stat_buffer {
 	}		entries[32];
 };
 
+/*
+ * Log-linear latency histogram, as in HdrHistogram: each power of two is split
+ * into 1 << TIME_STATS_HIST_SUB_BITS linear sub-buckets, so a bucket is within
+ * ~6% of the values it counts. Values below 1 << TIME_STATS_HIST_SUB_BITS are
+ * exact; anything from 1 << TIME_STATS_HIST_MAX_SHIFT ns (~4.5 minutes) up
+ * is counted in the last bucket.
+ *
+ * Counting is lock free, into a percpu copy; readers sum the percpu copies.
+ */
+#define TIME_STATS_HIST_SUB_BITS	4
+#define TIME_STATS_HIST_SUB		(1U << TIME_STATS_HIST_SUB_BITS)
+#define TIME_STATS_HIST_MAX_SHIFT	38
+#define TIME_STATS_HIST_NR						\
+	((TIME_STATS_HIST_MAX_SHIFT - TIME_STATS_HIST_SUB_BITS + 1) *	\
+	 TIME_STATS_HIST_SUB)
+
+struct time_stats_hist {
+	u64		buckets[TIME_STATS_HIST_NR];
+};
+
 struct time_stats {
 	spinlock_t	lock;
 	u64		count;
@@ -389,6 +409,7 @@ struct time_stats {
 	struct quantiles quantiles;
 
 	struct time_stat_buffer __percpu *buffer;
+	struct time_stats_hist __percpu *hist;
 };
 
 void __bch2_time_stats_update(struct time_stats *stats, u64, u64);
@@ -398,8 +419,15 @@ static inline void bch2_time_stats_update(struct time_stats *stats, u64 start)
 	__bch2_time_stats_update(stats, start, local_clock());
 }
 
+void bch2_pr_time_units(struct printbuf *, u64);
 void bch2_time_stats_to_text(struct printbuf *, struct time_stats *);
 
+u64 bch2_time_stats_hist_bucket_start(unsigned);
+u64 bch2_time_stats_hist_bucket_end(unsigned);
+void bch2_time_stats_hist_read(struct time_stats *, struct time_stats_hist *);
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *, u64, u64, u64);
+void bch2_time_stats_hist_to_text(struct printbuf *, struct time_stats *);
+
 void bch2_time_stats_exit(struct time_stats *);
 void bch2_time_stats_init(struct time_stats *);
 
@@ -119,3 +119,51 @@ int bch2_varint_decode_fast(const u8 *in, const u8 *end, u64 *out)
 	*out = v;
 	return bytes;
 }
+
+/**
+ * bch2_varint_decode_fast_n - decode @nr consecutive varints
+ *
+ * Same assumptions as bch2_varint_decode_fast(). Most fields of most keys are
+ * small, so runs of single byte varints (low bit clear) are decoded eight at a
+ * time from a single load, falling back to bch2_varint_decode_fast() for
+ * longer varints.
+ *
+ * Returns the number of bytes consumed, or -1 on failure
+ */
+int bch2_varint_decode_fast_n(const u8 *in, const u8 *end, u64 *out, unsigned nr)
+{
+	const u8 *start = in;
+	unsigned i, run;
+	int ret;
+
+	while (nr) {
+#ifdef CONFIG_VALGRIND
+		VALGRIND_MAKE_MEM_DEFINED(in, 8);
+#endif
+		u64 v = get_unaligned_le64(in);
+		u64 tags = v & 0x0101010101010101ULL;
+
+		run = tags ? __ffs64(tags) >> 3 : 8;
+		run = min_t(unsigned, run, nr);
+		run = min_t(unsigned, run, end - in);
+
+		for (i = 0; i < run; i++)
+			out[i] = (v >> (i * 8 + 1)) & 127;
+
+		in	+= run;
+		out	+= run;
+		nr	-= run;
+
+		if (nr && run < 8) {
+			ret = bch2_varint_decode_fast(in, end, out);
+			if (ret < 0)
+				return ret;
+
+			in	+= ret;
+			out++;
+			nr--;
+		}
+	}
+
+	return in - start;
+}
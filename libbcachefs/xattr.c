@@ -137,17 +137,52 @@ void bch2_xattr_to_text(struct printbuf *out, struct bch_fs *c,
 	       (char *) xattr_val(xattr.v));
 }
 
+/*
+ * Look up an xattr in the inode's inline xattr cache: returns the size of the
+ * value, -ENODATA if the cache is complete and doesn't have it, or -EAGAIN if
+ * the cache can't be used and the caller has to check the xattrs btree.
+ *
+ * xattr updates hold ei_update_lock while they update ei_inode; if someone
+ * holds it now, the btree is just as good as waiting for them.
+ */
+int bch2_xattr_get_inline(struct bch_inode_info *inode,
+			  const char *name, unsigned name_len,
+			  void *buffer, size_t size, int type)
+{
+	const struct bch_inode_xattr_inline *x;
+	int ret = -EAGAIN;
+
+	if (!inode->ei_inode.bi_xattrs_inline ||
+	    !mutex_trylock(&inode->ei_update_lock))
+		return ret;
+
+	if (inode->ei_inode.bi_xattrs_inline) {
+		x = bch2_inode_xattr_inline_find(&inode->ei_inode, type,
+						 name, name_len);
+		ret = x ? x->x_val_len : -ENODATA;
+
+		if (x && buffer) {
+			if (ret > size)
+				ret = -ERANGE;
+			else
+				memcpy(buffer, inode_xattr_inline_val(x), ret);
+		}
+	}
+
+	mutex_unlock(&inode->ei_update_lock);
+	return ret;
+}
+
 static int bch2_xattr_get_trans(struct btree_trans *trans, struct bch_inode_info *inode,
 				const char *name, void *buffer, size_t size, int type)
 {
-	struct bch_hash_info hash = bch2_hash_info_init(trans->c, &inode->ei_inode);
 	struct btree_iter iter;
 	struct bkey_s_c_xattr xattr;
 	struct bkey_s_c k;
 	int ret;
 
-	ret = bch2_hash_lookup(trans, &iter, bch2_xattr_hash_desc, &hash,
-			       inode_inum(inode),
+	ret = bch2_hash_lookup(trans, &iter, bch2_xattr_hash_desc,
+			       &inode->ei_str_hash, inode_inum(inode),
 			       &X_SEARCH(type, name, strlen(name)),
 			       0);
 	if (ret)
@@ -175,36 +210,31 @@ err1:
 int bch2_xattr_get(struct bch_fs *c, struct bch_inode_info *inode,
 		   const char *name, void *buffer, size_t size, int type)
 {
+	int ret = bch2_xattr_get_inline(inode, name, strlen(name),
+					buffer, size, type);
+	if (ret != -EAGAIN)
+		return ret;
+
 	return bch2_trans_do(c, NULL, NULL, 0,
 		bch2_xattr_get_trans(&trans, inode, name, buffer, size, type));
 }
 
-int bch2_xattr_set(struct btree_trans *trans, subvol_inum inum,
-		   const struct bch_hash_info *hash_info,
-		   const char *name, const void *value, size_t size,
-		   int type, int flags)
+/*
+ * Just the xattr update, for callers that are also writing the inode in the
+ * same transaction - e.g. because they just created it; @inode_u is the inode
+ * they write, for the inline xattr cache:
+ */
+int __bch2_xattr_set(struct btree_trans *trans, subvol_inum inum,
+		     struct bch_inode_unpacked *inode_u,
+		     const struct bch_hash_info *hash_info,
+		     const char *name, const void *value, size_t size,
+		     int type, int flags)
 {
-	struct btree_iter inode_iter = { NULL };
-	struct bch_inode_unpacked inode_u;
+	unsigned namelen = strlen(name);
 	int ret;
 
-	/*
-	 * We need to do an inode update so that bi_journal_sync gets updated
-	 * and fsync works:
-	 *
-	 * Perhaps we should be updating bi_mtime too?
-	 */
-
-	ret   = bch2_inode_peek(trans, &inode_iter, &inode_u, inum, BTREE_ITER_INTENT) ?:
-		bch2_inode_write(trans, &inode_iter, &inode_u);
-	bch2_trans_iter_exit(trans, &inode_iter);
-
-	if (ret)
-		return ret;
-
 	if (value) {
 		struct bkey_i_xattr *xattr;
-		unsigned namelen = strlen(name);
 		unsigned u64s = BKEY_U64s +
 			xattr_val_u64s(namelen, size);
 
@@ -229,7 +259,7 @@ int bch2_xattr_set(struct btree_trans *trans, subvol_inum inum,
 			      (flags & XATTR_REPLACE ? BCH_HASH_SET_MUST_REPLACE : 0));
 	} else {
 		struct xattr_search_key search =
-			X_SEARCH(type, name, strlen(name));
+			X_SEARCH(type, name, namelen);
 
 		ret = bch2_hash_delete(trans, bch2_xattr_hash_desc,
 				       hash_info, inum, &search);
@@ -238,6 +268,34 @@ int bch2_xattr_set(struct btree_trans *trans, subvol_inum inum,
 	if (ret == -ENOENT)
 		ret = flags & XATTR_REPLACE ? -ENODATA : 0;
 
+	if (!ret)
+		bch2_inode_xattr_inline_set(inode_u, type, name, namelen,
+					    value, size);
+	return ret;
+}
+
+/* @inode_u returns the updated inode, for the caller to update ei_inode: */
+int bch2_xattr_set(struct btree_trans *trans, subvol_inum inum,
+		   struct bch_inode_unpacked *inode_u,
+		   const struct bch_hash_info *hash_info,
+		   const char *name, const void *value, size_t size,
+		   int type, int flags)
+{
+	struct btree_iter inode_iter = { NULL };
+	int ret;
+
+	/*
+	 * We need to do an inode update so that bi_journal_sync gets updated
+	 * and fsync works:
+	 *
+	 * Perhaps we should be updating bi_mtime too?
+	 */
+
+	ret   = bch2_inode_peek(trans, &inode_iter, inode_u, inum, BTREE_ITER_INTENT) ?:
+		__bch2_xattr_set(trans, inum, inode_u, hash_info, name,
+				 value, size, type, flags) ?:
+		bch2_inode_write(trans, &inode_iter, inode_u);
+	bch2_trans_iter_exit(trans, &inode_iter);
 	return ret;
 }
 
@@ -383,12 +441,28 @@ static int bch2_xattr_set_handler(const struct xattr_handler *handler,
 {
 	struct bch_inode_info *inode = to_bch_ei(vinode);
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
-	struct bch_hash_info hash = bch2_hash_info_init(c, &inode->ei_inode);
+	struct bch_inode_unpacked inode_u;
+	struct btree_trans trans;
+	int ret;
 
-	return bch2_trans_do(c, NULL, NULL, 0,
-			bch2_xattr_set(&trans, inode_inum(inode), &hash,
-				       name, value, size,
-				       handler->flags, flags));
+	mutex_lock(&inode->ei_update_lock);
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	ret =   bch2_xattr_set(&trans, inode_inum(inode), &inode_u,
+			       &inode->ei_str_hash, name, value, size,
+			       handler->flags, flags) ?:
+		bch2_trans_commit(&trans, NULL, NULL, 0);
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		goto retry;
+
+	if (!ret)
+		bch2_inode_update_after_write(&trans, inode, &inode_u, 0);
+
+	bch2_trans_exit(&trans);
+	mutex_unlock(&inode->ei_update_lock);
+	return ret;
 }
 
 static const struct xattr_handler bch_xattr_user_handler = {
@@ -36,10 +36,17 @@ struct xattr_handler;
 struct bch_hash_info;
 struct bch_inode_info;
 
+int bch2_xattr_get_inline(struct bch_inode_info *, const char *, unsigned,
+			  void *, size_t, int);
 int bch2_xattr_get(struct bch_fs *, struct bch_inode_info *,
 		  const char *, void *, size_t, int);
 
+int __bch2_xattr_set(struct btree_trans *, subvol_inum,
+		     struct bch_inode_unpacked *,
+		     const struct bch_hash_info *,
+		     const char *, const void *, size_t, int, int);
 int bch2_xattr_set(struct btree_trans *, subvol_inum,
+		   struct bch_inode_unpacked *,
 		   const struct bch_hash_info *,
 		   const char *, const void *, size_t, int, int);
 
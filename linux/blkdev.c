@@ -3,12 +3,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include <libaio.h>
+#include <linux/nvme_ioctl.h>
 
 #ifdef CONFIG_VALGRIND
 #include <valgrind/memcheck.h>
@@ -16,9 +20,14 @@
 
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blkzoned.h>
 #include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/topology.h>
+#include <linux/wait.h>
 
 #include "tools-util.h"
 
@@ -27,37 +36,35 @@ struct fops {
 	void (*cleanup)(void);
 	void (*read)(struct bio *bio, struct iovec * iov, unsigned i);
 	void (*write)(struct bio *bio, struct iovec * iov, unsigned i);
+	void (*open)(struct block_device *bdev);
+	void (*close)(struct block_device *bdev);
+	void (*submit_batch)(struct bio_list *bios);
 };
 
 static struct fops *fops;
-static io_context_t aio_ctx;
 static atomic_t running_requests;
 
-void generic_make_request(struct bio *bio)
+static bool nvme_submit(struct bio *, struct iovec *, unsigned);
+static void nvme_open(struct block_device *, int);
+static void nvme_close(struct block_device *);
+
+static unsigned bio_nr_iovecs(struct bio *bio)
 {
-	struct iovec *iov;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
-
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
-		if (ret) {
-			fprintf(stderr, "fsync error: %m\n");
-			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			return;
-		}
-	}
+	unsigned i = 0;
 
-	i = 0;
 	bio_for_each_segment(bv, bio, iter)
 		i++;
+	return i;
+}
 
-	iov = alloca(sizeof(*iov) * i);
+static void bio_to_iovecs(struct bio *bio, struct iovec *iov)
+{
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	unsigned i = 0;
 
-	i = 0;
 	bio_for_each_segment(bv, bio, iter) {
 		void *start = page_address(bv.bv_page) + bv.bv_offset;
 		size_t len = bv.bv_len;
@@ -73,13 +80,36 @@ void generic_make_request(struct bio *bio)
 			VALGRIND_MAKE_MEM_DEFINED(start, len);
 #endif
 	}
+}
+
+static void __generic_make_request(struct bio *bio)
+{
+	struct iovec *iov;
+	ssize_t ret;
+	unsigned i;
+
+	if (bio->bi_opf & REQ_PREFLUSH) {
+		ret = fdatasync(bio->bi_bdev->bd_fd);
+		if (ret) {
+			fprintf(stderr, "fsync error: %m\n");
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			return;
+		}
+	}
+
+	i = bio_nr_iovecs(bio);
+	iov = alloca(sizeof(*iov) * i);
+	bio_to_iovecs(bio, iov);
 
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
-		fops->read(bio, iov, i);
+		if (!nvme_submit(bio, iov, i))
+			fops->read(bio, iov, i);
 		break;
 	case REQ_OP_WRITE:
-		fops->write(bio, iov, i);
+		if (!nvme_submit(bio, iov, i))
+			fops->write(bio, iov, i);
 		break;
 	case REQ_OP_FLUSH:
 		ret = fsync(bio->bi_bdev->bd_fd);
@@ -92,6 +122,67 @@ void generic_make_request(struct bio *bio)
 	}
 }
 
+/*
+ * Plugging: if the backend can submit a list of bios at once, reads and
+ * writes submitted while plugged are collected and submitted together when
+ * the plug is finished (or fills up):
+ */
+#define BLK_MAX_PLUGGED		32
+
+static __thread struct blk_plug *current_plug;
+
+static void blk_flush_plug(struct blk_plug *plug)
+{
+	struct bio_list bios = plug->bios;
+
+	bio_list_init(&plug->bios);
+	plug->nr = 0;
+
+	if (!bio_list_empty(&bios))
+		fops->submit_batch(&bios);
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	/* Nested plugs are ignored, as in the kernel: */
+	if (current_plug)
+		return;
+
+	bio_list_init(&plug->bios);
+	plug->nr = 0;
+	current_plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (plug != current_plug)
+		return;
+
+	blk_flush_plug(plug);
+	current_plug = NULL;
+}
+
+void generic_make_request(struct bio *bio)
+{
+	struct blk_plug *plug = current_plug;
+
+	if (plug && fops->submit_batch &&
+	    !bio->bi_bdev->bd_nvme &&
+	    (bio_op(bio) == REQ_OP_READ || bio_op(bio) == REQ_OP_WRITE) &&
+	    !(bio->bi_opf & REQ_PREFLUSH)) {
+		bio_list_add(&plug->bios, bio);
+		if (++plug->nr >= BLK_MAX_PLUGGED)
+			blk_flush_plug(plug);
+		return;
+	}
+
+	/* Don't reorder flushes and discards before plugged IO: */
+	if (plug && plug->nr)
+		blk_flush_plug(plug);
+
+	__generic_make_request(bio);
+}
+
 static void submit_bio_wait_endio(struct bio *bio)
 {
 	complete(bio->bi_private);
@@ -118,6 +209,42 @@ int blkdev_issue_discard(struct block_device *bdev,
 	return 0;
 }
 
+sector_t bdev_zone_sectors(struct block_device *bdev)
+{
+	return bdev->bd_zone_sectors;
+}
+
+int blkdev_zone_mgmt(struct block_device *bdev, enum req_opf op,
+		     sector_t sector, sector_t nr_sectors,
+		     gfp_t gfp_mask)
+{
+	struct blk_zone_range range = {
+		.sector		= sector,
+		.nr_sectors	= nr_sectors,
+	};
+
+	if (op != REQ_OP_ZONE_RESET)
+		return -EOPNOTSUPP;
+
+	if (!bdev->bd_zone_sectors ||
+	    (sector | nr_sectors) & (bdev->bd_zone_sectors - 1))
+		return -EINVAL;
+
+	return ioctl(bdev->bd_fd, BLKRESETZONE, &range) ? -errno : 0;
+}
+
+static sector_t blkdev_get_zone_sectors(int fd)
+{
+	__u32 zone_sectors = 0;
+
+	if (!S_ISBLK(xfstat(fd).st_mode) ||
+	    ioctl(fd, BLKGETZONESZ, &zone_sectors) ||
+	    !is_power_of_2(zone_sectors))
+		return 0;
+
+	return zone_sectors;
+}
+
 unsigned bdev_logical_block_size(struct block_device *bdev)
 {
 	struct stat statbuf;
@@ -156,6 +283,11 @@ sector_t get_capacity(struct gendisk *disk)
 
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
+	nvme_close(bdev);
+
+	if (fops->close)
+		fops->close(bdev);
+
 	fdatasync(bdev->bd_fd);
 	close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
@@ -202,6 +334,13 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->bd_disk		= &bdev->__bd_disk;
 	bdev->bd_disk->bdi	= &bdev->bd_disk->__bdi;
 	bdev->queue.backing_dev_info = bdev->bd_disk->bdi;
+	bdev->bd_uring_idx	= -1;
+	bdev->bd_zone_sectors	= blkdev_get_zone_sectors(fd);
+
+	if (fops->open)
+		fops->open(bdev);
+
+	nvme_open(bdev, flags);
 
 	return bdev;
 }
@@ -265,14 +404,37 @@ static void sync_write(struct bio *bio, struct iovec * iov, unsigned i)
 	sync_check(bio, ret);
 }
 
+/*
+ * aio backend:
+ *
+ * Each block device gets its own aio context, sized by the device's queue
+ * depth, and its own completion thread. Submitters reserve slots in the
+ * context before calling io_submit(), so we never overflow it; plugged bios
+ * are submitted with one io_submit() call per device.
+ */
+
+#define AIO_DEFAULT_DEPTH	256
+#define AIO_MIN_DEPTH		32
+#define AIO_MAX_DEPTH		4096
+#define AIO_REAP_BATCH		128
+
+struct blkdev_aio {
+	io_context_t		ctx;
+	unsigned		depth;
+	atomic_t		running_requests;
+	wait_queue_head_t	wait;
+	struct task_struct	*task;
+};
+
 static int aio_completion_thread(void *arg)
 {
-	struct io_event events[8], *ev;
-	int ret;
+	struct blkdev_aio *d = arg;
+	struct io_event events[AIO_REAP_BATCH], *ev;
+	int ret, nr;
 	bool stop = false;
 
 	while (!stop) {
-		ret = io_getevents(aio_ctx, 1, ARRAY_SIZE(events),
+		ret = io_getevents(d->ctx, 1, ARRAY_SIZE(events),
 				   events, NULL);
 
 		if (ret < 0 && ret == -EINTR)
@@ -280,12 +442,25 @@ static int aio_completion_thread(void *arg)
 		if (ret < 0)
 			die("io_getevents() error: %s", strerror(-ret));
 
+		/*
+		 * Release slots before running completions, which may submit
+		 * more IO:
+		 */
+		nr = 0;
+		for (ev = events; ev < events + ret; ev++)
+			nr += ev->data != NULL;
+
+		if (nr) {
+			atomic_sub(nr, &d->running_requests);
+			wake_up(&d->wait);
+		}
+
 		for (ev = events; ev < events + ret; ev++) {
 			struct bio *bio = (struct bio *) ev->data;
 
-			/* This should only happen during blkdev_cleanup() */
+			/* This should only happen during blkdev_put() */
 			if (!bio) {
-				BUG_ON(atomic_read(&running_requests) != 0);
+				BUG_ON(atomic_read(&d->running_requests) != 0);
 				stop = true;
 				continue;
 			}
@@ -294,36 +469,153 @@ static int aio_completion_thread(void *arg)
 				bio->bi_status = BLK_STS_IOERR;
 
 			bio_endio(bio);
-			atomic_dec(&running_requests);
 		}
 	}
 
 	return 0;
 }
 
-static struct task_struct *aio_task = NULL;
+static bool aio_reserve(struct blkdev_aio *d, unsigned nr)
+{
+	int old, v = atomic_read(&d->running_requests);
 
-static void aio_init(void)
+	do {
+		old = v;
+		if (old + nr > d->depth)
+			return false;
+	} while ((v = atomic_cmpxchg(&d->running_requests,
+				     old, old + nr)) != old);
+
+	return true;
+}
+
+static void aio_submit(struct blkdev_aio *d, struct iocb **iocbs, unsigned nr)
 {
-	struct task_struct *p;
-	long err = io_setup(256, &aio_ctx);
-	if (!err) {
-		p = kthread_run(aio_completion_thread, NULL, "aio_completion");
-		BUG_ON(IS_ERR(p));
+	while (nr) {
+		unsigned n = min(nr, d->depth);
+		int ret;
 
-		aio_task = p;
+		wait_event(d->wait, aio_reserve(d, n));
 
-	} else if (err == -ENOSYS) {
-		io_fallback();
-	} else {
-		die("io_setup() error: %s", strerror(err));
+		ret = io_submit(d->ctx, n, iocbs);
+		if (ret < 0 && ret != -EAGAIN)
+			die("io_submit err: %s", strerror(-ret));
+
+		ret = max(ret, 0);
+		if (ret < n) {
+			atomic_sub(n - ret, &d->running_requests);
+			if (!ret)
+				sched_yield();
+		}
+
+		iocbs	+= ret;
+		nr	-= ret;
 	}
 }
 
-static void aio_cleanup(void)
+static unsigned blkdev_queue_depth(struct block_device *bdev)
 {
-	struct task_struct *p = NULL;
-	swap(aio_task, p);
+	struct stat st = xfstat(bdev->bd_fd);
+	unsigned depth = 0;
+	char *path;
+	FILE *f;
+
+	if (!S_ISBLK(st.st_mode))
+		return AIO_DEFAULT_DEPTH;
+
+	/* Partitions don't have a queue directory, the whole device does: */
+	path = mprintf("/sys/dev/block/%u:%u/queue/nr_requests",
+		       major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "r");
+	free(path);
+
+	if (!f) {
+		path = mprintf("/sys/dev/block/%u:%u/../queue/nr_requests",
+			       major(st.st_rdev), minor(st.st_rdev));
+		f = fopen(path, "r");
+		free(path);
+	}
+
+	if (f) {
+		if (fscanf(f, "%u", &depth) != 1)
+			depth = 0;
+		fclose(f);
+	}
+
+	return clamp_t(unsigned, depth ?: AIO_DEFAULT_DEPTH,
+		       AIO_MIN_DEPTH, AIO_MAX_DEPTH);
+}
+
+/*
+ * The NUMA node the device's controller is attached to: the closest parent in
+ * sysfs with a numa_node attribute, e.g. the PCI function for an NVMe device.
+ */
+static int blkdev_numa_node(struct block_device *bdev)
+{
+	struct stat st = xfstat(bdev->bd_fd);
+	int node = NUMA_NO_NODE;
+	char *path, *dev, *p;
+	FILE *f;
+
+	if (!S_ISBLK(st.st_mode))
+		return NUMA_NO_NODE;
+
+	path = mprintf("/sys/dev/block/%u:%u",
+		       major(st.st_rdev), minor(st.st_rdev));
+	dev = realpath(path, NULL);
+	free(path);
+
+	while (dev && (p = strrchr(dev, '/')) && p != dev) {
+		path = mprintf("%s/numa_node", dev);
+		f = fopen(path, "r");
+		free(path);
+
+		if (f) {
+			if (fscanf(f, "%d", &node) != 1)
+				node = NUMA_NO_NODE;
+			fclose(f);
+			break;
+		}
+
+		*p = '\0';
+	}
+
+	free(dev);
+	return node;
+}
+
+static void aio_open(struct block_device *bdev)
+{
+	struct blkdev_aio *d = xcalloc(1, sizeof(*d));
+	struct task_struct *p;
+	long err;
+
+	d->depth = blkdev_queue_depth(bdev);
+	init_waitqueue_head(&d->wait);
+
+	/* We may be limited by fs.aio-max-nr: */
+	while ((err = io_setup(d->depth, &d->ctx)) == -EAGAIN &&
+	       d->depth > AIO_MIN_DEPTH)
+		d->depth /= 2;
+	if (err)
+		die("io_setup() error: %s", strerror(-err));
+
+	p = kthread_run(aio_completion_thread, d, "aio/%s",
+			basename(bdev->name));
+	BUG_ON(IS_ERR(p));
+	d->task = p;
+
+	/* Completions are handled - and bios freed - near the device: */
+	set_cpus_allowed_node(p, blkdev_numa_node(bdev));
+
+	bdev->bd_aio = d;
+}
+
+static void aio_close(struct block_device *bdev)
+{
+	struct blkdev_aio *d = bdev->bd_aio;
+	struct task_struct *p = d->task;
+
 	get_task_struct(p);
 
 	/* I mean, really?! IO_CMD_NOOP is even defined, but not implemented. */
@@ -341,7 +633,7 @@ static void aio_cleanup(void)
 		.u.c.buf = &junk,
 		.u.c.nbytes = 1,
 	}, *iocbp = &iocb;
-	ret = io_submit(aio_ctx, 1, &iocbp);
+	ret = io_submit(d->ctx, 1, &iocbp);
 	if (ret != 1)
 		die("io_submit cleanup err: %s", strerror(-ret));
 
@@ -352,53 +644,898 @@ static void aio_cleanup(void)
 
 	close(fds[0]);
 	close(fds[1]);
+
+	io_destroy(d->ctx);
+	free(d);
+	bdev->bd_aio = NULL;
 }
 
-static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
+static void aio_init(void)
 {
-	ssize_t ret;
-	struct iocb iocb = {
+	io_context_t ctx = 0;
+	long err = io_setup(1, &ctx);
+
+	if (!err)
+		io_destroy(ctx);
+	else if (err == -ENOSYS)
+		io_fallback();
+	else
+		die("io_setup() error: %s", strerror(-err));
+}
+
+static void aio_cleanup(void) {}
+
+static void aio_prep(struct iocb *iocb, struct bio *bio,
+		     struct iovec *iov, unsigned i)
+{
+	*iocb = (struct iocb) {
 		.data		= bio,
 		.aio_fildes	= bio->bi_opf & REQ_FUA
 			? bio->bi_bdev->bd_sync_fd
 			: bio->bi_bdev->bd_fd,
-		.aio_lio_opcode	= opcode,
+		.aio_lio_opcode	= bio_op(bio) == REQ_OP_WRITE
+			? IO_CMD_PWRITEV
+			: IO_CMD_PREADV,
 		.u.c.buf        = iov,
 		.u.c.nbytes     = i,
 		.u.c.offset     = bio->bi_iter.bi_sector << 9,
+	};
+}
 
-	}, *iocbp = &iocb;
+static void aio_op(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	struct iocb iocb, *iocbp = &iocb;
 
-	atomic_inc(&running_requests);
-	ret = io_submit(aio_ctx, 1, &iocbp);
-	if (ret != 1)
-		die("io_submit err: %s", strerror(-ret));
+	aio_prep(&iocb, bio, iov, i);
+	aio_submit(bio->bi_bdev->bd_aio, &iocbp, 1);
 }
 
 static void aio_read(struct bio *bio, struct iovec *iov, unsigned i)
 {
-	aio_op(bio, iov, i, IO_CMD_PREADV);
+	aio_op(bio, iov, i);
 }
 
 static void aio_write(struct bio *bio, struct iovec * iov, unsigned i)
 {
-	aio_op(bio, iov, i, IO_CMD_PWRITEV);
+	aio_op(bio, iov, i);
+}
+
+static void aio_submit_batch(struct bio_list *bios)
+{
+	struct iocb iocbs[BLK_MAX_PLUGGED], *iocbps[BLK_MAX_PLUGGED];
+	struct iovec *iovs[BLK_MAX_PLUGGED];
+	struct blkdev_aio *d = NULL;
+	struct bio *bio;
+	unsigned i, nr = 0;
+
+	while (1) {
+		bio = bio_list_pop(bios);
+
+		/* io_submit() copies the iovecs, so we can free them after: */
+		if (nr && (!bio || bio->bi_bdev->bd_aio != d ||
+			   nr == ARRAY_SIZE(iocbs))) {
+			aio_submit(d, iocbps, nr);
+
+			for (i = 0; i < nr; i++)
+				free(iovs[i]);
+			nr = 0;
+		}
+
+		if (!bio)
+			break;
+
+		i = bio_nr_iovecs(bio);
+		iovs[nr] = xmalloc(sizeof(struct iovec) * max(i, 1U));
+		bio_to_iovecs(bio, iovs[nr]);
+
+		aio_prep(&iocbs[nr], bio, iovs[nr], i);
+		iocbps[nr] = &iocbs[nr];
+		d = bio->bi_bdev->bd_aio;
+		nr++;
+	}
+}
+
+/*
+ * io_uring backend:
+ *
+ * We talk to the kernel directly via the raw syscalls, so there's no
+ * dependency on liburing. Submission is split in two: preparing SQEs
+ * (under uring.sq_lock) and calling io_uring_enter() (under
+ * uring.submit_lock) - whichever thread gets the submit lock submits
+ * everything that's been prepared so far, so under contention we submit
+ * SQEs for many bios with a single syscall.
+ *
+ * REQ_FUA writes are sent as a write linked to an fdatasync, so we don't
+ * need the O_SYNC fd. Block devices are registered as fixed files.
+ *
+ * CQE user_data is the bio pointer; the low bit is set for the trailing
+ * fsync of a FUA write, and 0 tells the completion thread to stop.
+ */
+
+#define URING_ENTRIES		256
+#define URING_MAX_FILES		256
+#define URING_FUA_FSYNC		1UL
+
+static struct uring {
+	int			fd;
+	bool			fixed_files;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_array;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	struct io_uring_sqe	*sqes;
+
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct mutex		sq_lock;
+	unsigned		sq_prepared;
+
+	struct mutex		submit_lock;
+	unsigned		sq_submitted;
+
+	struct mutex		files_lock;
+	DECLARE_BITMAP(files_used, URING_MAX_FILES);
+} uring;
+
+static struct task_struct *uring_task = NULL;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode,
+				 const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_endio(struct bio *bio, int res, bool fua_fsync)
+{
+	if (fua_fsync) {
+		/* -ECANCELED means the write failed, and has been reported: */
+		if (res < 0 && res != -ECANCELED)
+			bio->bi_status = BLK_STS_IOERR;
+	} else {
+		if (res != bio->bi_iter.bi_size)
+			bio->bi_status = BLK_STS_IOERR;
+
+		/* completion is signalled by the linked fsync: */
+		if (bio->bi_opf & REQ_FUA)
+			return;
+	}
+
+	bio_endio(bio);
+	atomic_dec(&running_requests);
+}
+
+static int uring_completion_thread(void *arg)
+{
+	bool stop = false;
+
+	while (!stop) {
+		unsigned head = *uring.cq_head;
+		unsigned tail = smp_load_acquire(uring.cq_tail);
+		int ret;
+
+		if (head == tail) {
+			ret = sys_io_uring_enter(uring.fd, 0, 1,
+						 IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				die("io_uring_enter() error: %m");
+			continue;
+		}
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+			unsigned long data = cqe->user_data;
+
+			/* This should only happen during blkdev_cleanup() */
+			if (!data) {
+				BUG_ON(atomic_read(&running_requests) != 0);
+				stop = true;
+				continue;
+			}
+
+			uring_endio((struct bio *) (data & ~URING_FUA_FSYNC),
+				    cqe->res, data & URING_FUA_FSYNC);
+		}
+
+		smp_store_release(uring.cq_head, head);
+	}
+
+	return 0;
+}
+
+/* Submit all prepared SQEs, up to and including @seq: */
+static void uring_flush(unsigned seq)
+{
+	mutex_lock(&uring.submit_lock);
+	while ((int) (seq - uring.sq_submitted) > 0) {
+		unsigned to_submit = smp_load_acquire(uring.sq_tail) -
+			uring.sq_submitted;
+		int ret = sys_io_uring_enter(uring.fd, to_submit, 0, 0);
+
+		if (ret < 0) {
+			/* CQ overflow: wait for the completion thread */
+			if (errno == EBUSY || errno == EAGAIN)
+				sched_yield();
+			else if (errno != EINTR)
+				die("io_uring_enter() error: %m");
+			continue;
+		}
+
+		uring.sq_submitted += ret;
+	}
+	mutex_unlock(&uring.submit_lock);
+}
+
+static struct io_uring_sqe *uring_get_sqes(unsigned nr)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	while (1) {
+		mutex_lock(&uring.sq_lock);
+		if (uring.sq_prepared + nr -
+		    smp_load_acquire(uring.sq_head) <= uring.sq_entries)
+			break;
+		mutex_unlock(&uring.sq_lock);
+
+		/* SQ ring full of prepared but unsubmitted entries: */
+		uring_flush(uring.sq_prepared);
+	}
+
+	sqe = &uring.sqes[uring.sq_prepared & uring.sq_mask];
+
+	for (i = 0; i < nr; i++) {
+		unsigned idx = (uring.sq_prepared + i) & uring.sq_mask;
+
+		uring.sq_array[idx] = idx;
+		memset(&uring.sqes[idx], 0, sizeof(uring.sqes[idx]));
+	}
+
+	return sqe;
+}
+
+/* Called with sq_lock held, returns the sequence number to flush: */
+static unsigned uring_publish_sqes(unsigned nr)
+{
+	unsigned seq = uring.sq_prepared += nr;
+
+	smp_store_release(uring.sq_tail, seq);
+	mutex_unlock(&uring.sq_lock);
+	return seq;
+}
+
+static void uring_prep_fd(struct io_uring_sqe *sqe, struct block_device *bdev)
+{
+	if (bdev->bd_uring_idx >= 0) {
+		sqe->fd		= bdev->bd_uring_idx;
+		sqe->flags	|= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd		= bdev->bd_fd;
+	}
+}
+
+static void uring_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
+{
+	bool fua = opcode == IORING_OP_WRITEV && (bio->bi_opf & REQ_FUA);
+	unsigned nr = fua ? 2 : 1;
+	struct io_uring_sqe *sqe;
+
+	atomic_inc(&running_requests);
+
+	sqe = uring_get_sqes(nr);
+
+	sqe->opcode	= opcode;
+	sqe->addr	= (unsigned long) iov;
+	sqe->len	= i;
+	sqe->off	= bio->bi_iter.bi_sector << 9;
+	sqe->user_data	= (unsigned long) bio;
+	uring_prep_fd(sqe, bio->bi_bdev);
+
+	if (fua) {
+		struct io_uring_sqe *fsync =
+			&uring.sqes[(uring.sq_prepared + 1) & uring.sq_mask];
+
+		sqe->flags		|= IOSQE_IO_LINK;
+
+		fsync->opcode		= IORING_OP_FSYNC;
+		fsync->fsync_flags	= IORING_FSYNC_DATASYNC;
+		fsync->user_data	= (unsigned long) bio | URING_FUA_FSYNC;
+		uring_prep_fd(fsync, bio->bi_bdev);
+	}
+
+	/*
+	 * The iovec lives on our caller's stack, so it has to have been
+	 * submitted before we return:
+	 */
+	uring_flush(uring_publish_sqes(nr));
+}
+
+static void uring_read(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_READV);
+}
+
+static void uring_write(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_WRITEV);
+}
+
+static void uring_files_update(unsigned idx, int fd)
+{
+	struct io_uring_files_update up = {
+		.offset	= idx,
+		.fds	= (unsigned long) &fd,
+	};
+	int ret = sys_io_uring_register(uring.fd, IORING_REGISTER_FILES_UPDATE,
+					&up, 1);
+	if (ret != 1)
+		die("io_uring files update error: %m");
+}
+
+static void uring_open(struct block_device *bdev)
+{
+	unsigned idx;
+
+	bdev->bd_uring_idx = -1;
+
+	if (!uring.fixed_files)
+		return;
+
+	mutex_lock(&uring.files_lock);
+	idx = find_first_zero_bit(uring.files_used, URING_MAX_FILES);
+	if (idx < URING_MAX_FILES) {
+		__set_bit(idx, uring.files_used);
+		uring_files_update(idx, bdev->bd_fd);
+		bdev->bd_uring_idx = idx;
+	}
+	mutex_unlock(&uring.files_lock);
+}
+
+static void uring_close(struct block_device *bdev)
+{
+	if (bdev->bd_uring_idx < 0)
+		return;
+
+	mutex_lock(&uring.files_lock);
+	uring_files_update(bdev->bd_uring_idx, -1);
+	__clear_bit(bdev->bd_uring_idx, uring.files_used);
+	mutex_unlock(&uring.files_lock);
+}
+
+static void uring_register_files(void)
+{
+	int fds[URING_MAX_FILES];
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(fds); i++)
+		fds[i] = -1;
+
+	/* a sparse file table needs 5.5; without it, just use plain fds */
+	uring.fixed_files = !sys_io_uring_register(uring.fd,
+				IORING_REGISTER_FILES, fds, ARRAY_SIZE(fds));
 }
 
+static void uring_init(void)
+{
+	struct io_uring_params p = { 0 };
+	struct task_struct *task;
+	int fd;
+
+	fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0) {
+		/* not supported, or disabled by seccomp/sysctl: */
+		io_fallback();
+		return;
+	}
+
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		/* we can't tolerate dropped completions: */
+		close(fd);
+		io_fallback();
+		return;
+	}
+
+	uring.fd		= fd;
+	uring.sq_ring_size	= p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size	= p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring.sq_ring_size = uring.cq_ring_size =
+			max(uring.sq_ring_size, uring.cq_ring_size);
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cq_ring = uring.sq_ring;
+	} else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ|PROT_WRITE,
+				     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+			die("io_uring mmap error: %m");
+	}
+
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	uring.sq_head	= uring.sq_ring + p.sq_off.head;
+	uring.sq_tail	= uring.sq_ring + p.sq_off.tail;
+	uring.sq_array	= uring.sq_ring + p.sq_off.array;
+	uring.sq_mask	= *(unsigned *) (uring.sq_ring + p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+
+	uring.cq_head	= uring.cq_ring + p.cq_off.head;
+	uring.cq_tail	= uring.cq_ring + p.cq_off.tail;
+	uring.cq_mask	= *(unsigned *) (uring.cq_ring + p.cq_off.ring_mask);
+	uring.cqes	= uring.cq_ring + p.cq_off.cqes;
+
+	uring.sq_prepared = uring.sq_submitted = *uring.sq_tail;
+
+	mutex_init(&uring.sq_lock);
+	mutex_init(&uring.submit_lock);
+	mutex_init(&uring.files_lock);
+
+	uring_register_files();
+
+	task = kthread_run(uring_completion_thread, NULL, "uring_completion");
+	BUG_ON(IS_ERR(task));
+	uring_task = task;
+}
+
+static void uring_cleanup(void)
+{
+	struct task_struct *p = NULL;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	swap(uring_task, p);
+	get_task_struct(p);
+
+	/* Wake up the completion thread with a NOP: user_data 0 means stop */
+	sqe = uring_get_sqes(1);
+	sqe->opcode = IORING_OP_NOP;
+	uring_flush(uring_publish_sqes(1));
+
+	ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
+
+	munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	munmap(uring.sq_ring, uring.sq_ring_size);
+	close(uring.fd);
+}
+
+/*
+ * NVMe passthrough:
+ *
+ * With BCACHEFS_NVME_PASSTHRU=1 in the environment, reads and writes to NVMe
+ * namespaces bypass the block layer: they're sent as NVMe commands on the
+ * namespace's generic char device (/dev/ngXnY) with IORING_OP_URING_CMD, which
+ * needs a 5.19 kernel. BCACHEFS_NVME_PASSTHRU=poll also polls for completions
+ * (IORING_SETUP_IOPOLL), which needs the nvme driver to have poll queues.
+ *
+ * Each namespace gets its own ring and completion thread, as with the aio
+ * backend, and anything that isn't available - permissions on the char
+ * device, kernel support - just leaves the device on the normal backend. So do
+ * bios that don't map to a single command: misaligned to the LBA size, or over
+ * the device's transfer size or segment limits. PREFLUSH is still done with
+ * fdatasync() on the block device, which flushes the same volatile cache.
+ *
+ * The iovec array is copied, since with uring_cmd it's only read when the
+ * command is issued, which may be after we return.
+ */
+
+#define NVME_RING_ENTRIES	256
+#define NVME_SQE_SHIFT		7	/* SQE128 */
+#define NVME_CQE_SHIFT		5	/* CQE32 */
+
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+#define NVME_RW_FUA		(1U << 30)
+
+struct blkdev_nvme {
+	int			fd;
+	u32			nsid;
+	unsigned		lba_shift;
+	u64			start;		/* partition offset, in sectors */
+	unsigned		max_bytes;
+	unsigned		max_segs;
+
+	int			ring_fd;
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	unsigned		*sq_tail;
+	unsigned		*sq_array;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	void			*sqes;
+
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	void			*cqes;
+
+	struct mutex		sq_lock;
+	atomic_t		running_requests;
+	wait_queue_head_t	wait;
+	bool			stop;
+	struct task_struct	*task;
+};
+
+struct nvme_req {
+	struct bio		*bio;
+	struct iovec		iov[];
+};
+
+static int nvme_completion_thread(void *arg)
+{
+	struct blkdev_nvme *d = arg;
+
+	while (1) {
+		unsigned head, tail, i;
+
+		wait_event(d->wait, atomic_read(&d->running_requests) ||
+			   READ_ONCE(d->stop));
+		if (!atomic_read(&d->running_requests))
+			break;
+
+		head = *d->cq_head;
+		tail = smp_load_acquire(d->cq_tail);
+
+		if (head == tail) {
+			/* with IOPOLL, this is where we poll: */
+			int ret = sys_io_uring_enter(d->ring_fd, 0, 1,
+						     IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				die("io_uring_enter() error: %m");
+			continue;
+		}
+
+		/*
+		 * Release slots before running completions, which may submit
+		 * more IO:
+		 */
+		atomic_sub(tail - head, &d->running_requests);
+		wake_up(&d->wait);
+
+		for (i = head; i != tail; i++) {
+			struct io_uring_cqe *cqe = d->cqes +
+				((i & d->cq_mask) << NVME_CQE_SHIFT);
+			struct nvme_req *req = (void *) (unsigned long) cqe->user_data;
+			struct bio *bio = req->bio;
+
+			/* negative errno, or NVMe status: */
+			if (cqe->res)
+				bio->bi_status = BLK_STS_IOERR;
+
+			free(req);
+			bio_endio(bio);
+			atomic_dec(&running_requests);
+		}
+
+		smp_store_release(d->cq_head, tail);
+	}
+
+	return 0;
+}
+
+static bool nvme_reserve(struct blkdev_nvme *d)
+{
+	int old, v = atomic_read(&d->running_requests);
+
+	do {
+		old = v;
+		if (old >= d->sq_entries)
+			return false;
+	} while ((v = atomic_cmpxchg(&d->running_requests,
+				     old, old + 1)) != old);
+
+	return true;
+}
+
+static bool nvme_submit(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct blkdev_nvme *d = bio->bi_bdev->bd_nvme;
+	unsigned bytes = bio->bi_iter.bi_size;
+	u64 lba_mask, slba;
+	struct io_uring_sqe *sqe;
+	struct nvme_uring_cmd *cmd;
+	struct nvme_req *req;
+	unsigned tail, idx;
+	int ret;
+
+	if (!d)
+		return false;
+
+	lba_mask = (1U << d->lba_shift) - 1;
+
+	if (!bytes ||
+	    (bytes & lba_mask) ||
+	    ((bio->bi_iter.bi_sector << 9) & lba_mask) ||
+	    bytes > d->max_bytes ||
+	    nr > d->max_segs)
+		return false;
+
+	req = xmalloc(sizeof(*req) + nr * sizeof(*iov));
+	req->bio = bio;
+	memcpy(req->iov, iov, nr * sizeof(*iov));
+
+	slba = ((bio->bi_iter.bi_sector + d->start) << 9) >> d->lba_shift;
+
+	atomic_inc(&running_requests);
+	wait_event(d->wait, nvme_reserve(d));
+
+	mutex_lock(&d->sq_lock);
+	tail	= *d->sq_tail;
+	idx	= tail & d->sq_mask;
+	sqe	= d->sqes + (idx << NVME_SQE_SHIFT);
+	memset(sqe, 0, 1U << NVME_SQE_SHIFT);
+
+	sqe->opcode	= IORING_OP_URING_CMD;
+	sqe->fd		= d->fd;
+	sqe->cmd_op	= nr == 1 ? NVME_URING_CMD_IO : NVME_URING_CMD_IO_VEC;
+	sqe->user_data	= (unsigned long) req;
+
+	cmd = (void *) sqe->cmd;
+	cmd->opcode	= bio_op(bio) == REQ_OP_WRITE
+		? NVME_CMD_WRITE : NVME_CMD_READ;
+	cmd->nsid	= d->nsid;
+	cmd->cdw10	= slba;
+	cmd->cdw11	= slba >> 32;
+	cmd->cdw12	= (bytes >> d->lba_shift) - 1;
+	if (bio_op(bio) == REQ_OP_WRITE && (bio->bi_opf & REQ_FUA))
+		cmd->cdw12 |= NVME_RW_FUA;
+
+	if (nr == 1) {
+		cmd->addr	= (unsigned long) req->iov[0].iov_base;
+		cmd->data_len	= req->iov[0].iov_len;
+	} else {
+		cmd->addr	= (unsigned long) req->iov;
+		cmd->data_len	= nr;
+	}
+
+	d->sq_array[idx] = idx;
+	smp_store_release(d->sq_tail, tail + 1);
+
+	while ((ret = sys_io_uring_enter(d->ring_fd, 1, 0, 0)) != 1) {
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			die("io_uring_enter() error: %m");
+		sched_yield();
+	}
+	mutex_unlock(&d->sq_lock);
+
+	/* the completion thread sleeps when nothing's in flight: */
+	wake_up(&d->wait);
+	return true;
+}
+
+static bool sysfs_read_u64(const char *dir, const char *attr, u64 *v)
+{
+	char *path = mprintf("%s/%s", dir, attr);
+	FILE *f = fopen(path, "r");
+	bool ret = false;
+
+	free(path);
+	if (f) {
+		ret = fscanf(f, "%llu", v) == 1;
+		fclose(f);
+	}
+	return ret;
+}
+
+static int nvme_ring_init(struct blkdev_nvme *d, unsigned entries, bool poll)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_SQE128|IORING_SETUP_CQE32|
+			(poll ? IORING_SETUP_IOPOLL : 0),
+	};
+	int fd = sys_io_uring_setup(entries, &p);
+
+	if (fd < 0)
+		return -errno;
+
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		return -EOPNOTSUPP;
+	}
+
+	d->ring_fd	= fd;
+	d->sq_ring_size	= p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	d->cq_ring_size	= p.cq_off.cqes + (p.cq_entries << NVME_CQE_SHIFT);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		d->sq_ring_size = d->cq_ring_size =
+			max(d->sq_ring_size, d->cq_ring_size);
+
+	d->sq_ring = mmap(NULL, d->sq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (d->sq_ring == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		d->cq_ring = d->sq_ring;
+	} else {
+		d->cq_ring = mmap(NULL, d->cq_ring_size, PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (d->cq_ring == MAP_FAILED)
+			die("io_uring mmap error: %m");
+	}
+
+	d->sqes = mmap(NULL, p.sq_entries << NVME_SQE_SHIFT,
+		       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		       fd, IORING_OFF_SQES);
+	if (d->sqes == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	d->sq_tail	= d->sq_ring + p.sq_off.tail;
+	d->sq_array	= d->sq_ring + p.sq_off.array;
+	d->sq_mask	= *(unsigned *) (d->sq_ring + p.sq_off.ring_mask);
+	d->sq_entries	= p.sq_entries;
+
+	d->cq_head	= d->cq_ring + p.cq_off.head;
+	d->cq_tail	= d->cq_ring + p.cq_off.tail;
+	d->cq_mask	= *(unsigned *) (d->cq_ring + p.cq_off.ring_mask);
+	d->cqes		= d->cq_ring + p.cq_off.cqes;
+	return 0;
+}
+
+static void nvme_ring_exit(struct blkdev_nvme *d)
+{
+	munmap(d->sqes, d->sq_entries << NVME_SQE_SHIFT);
+	if (d->cq_ring != d->sq_ring)
+		munmap(d->cq_ring, d->cq_ring_size);
+	munmap(d->sq_ring, d->sq_ring_size);
+	close(d->ring_fd);
+}
+
+static void nvme_open(struct block_device *bdev, int flags)
+{
+	const char *env = getenv("BCACHEFS_NVME_PASSTHRU");
+	struct stat st = xfstat(bdev->bd_fd);
+	struct blkdev_nvme *d;
+	struct task_struct *p;
+	char *path, *disk = NULL, *ng = NULL;
+	unsigned ctrl, ns;
+	u64 v, lba_size, max_kb, max_segs;
+
+	if (!env || !strcmp(env, "0") || !S_ISBLK(st.st_mode))
+		return;
+
+	path = mprintf("/sys/dev/block/%u:%u",
+		       major(st.st_rdev), minor(st.st_rdev));
+	disk = realpath(path, NULL);
+	free(path);
+	if (!disk)
+		return;
+
+	d = xcalloc(1, sizeof(*d));
+	d->fd = -1;
+
+	/* A partition: its parent in sysfs is the namespace */
+	if (sysfs_read_u64(disk, "partition", &v)) {
+		if (!sysfs_read_u64(disk, "start", &d->start))
+			goto err;
+		*strrchr(disk, '/') = '\0';
+	}
+
+	if (sscanf(strrchr(disk, '/') + 1, "nvme%un%u", &ctrl, &ns) != 2 ||
+	    !sysfs_read_u64(disk, "nsid", &v) ||
+	    !sysfs_read_u64(disk, "queue/logical_block_size", &lba_size) ||
+	    !sysfs_read_u64(disk, "queue/max_hw_sectors_kb", &max_kb) ||
+	    !sysfs_read_u64(disk, "queue/max_segments", &max_segs) ||
+	    !is_power_of_2(lba_size))
+		goto err;
+
+	d->nsid		= v;
+	d->lba_shift	= ilog2(lba_size);
+	/* NLB is 16 bits: */
+	d->max_bytes	= min_t(u64, max_kb << 10, (u64) U16_MAX << d->lba_shift);
+	d->max_segs	= max_segs;
+
+	ng = mprintf("/dev/ng%un%u", ctrl, ns);
+	d->fd = open(ng, flags);
+	if (d->fd < 0)
+		goto err;
+
+	if (nvme_ring_init(d, min_t(unsigned, blkdev_queue_depth(bdev),
+					     NVME_RING_ENTRIES),
+			   !strcmp(env, "poll")))
+		goto err;
+
+	mutex_init(&d->sq_lock);
+	init_waitqueue_head(&d->wait);
+
+	p = kthread_run(nvme_completion_thread, d, "nvme/%s",
+			basename(bdev->name));
+	BUG_ON(IS_ERR(p));
+	d->task = p;
+
+	set_cpus_allowed_node(p, blkdev_numa_node(bdev));
+
+	bdev->bd_nvme = d;
+	free(ng);
+	free(disk);
+	return;
+err:
+	if (d->fd >= 0)
+		close(d->fd);
+	free(d);
+	free(ng);
+	free(disk);
+}
+
+static void nvme_close(struct block_device *bdev)
+{
+	struct blkdev_nvme *d = bdev->bd_nvme;
+	struct task_struct *p;
+	int ret;
+
+	if (!d)
+		return;
+
+	p = d->task;
+	get_task_struct(p);
+
+	WRITE_ONCE(d->stop, true);
+	wake_up(&d->wait);
+
+	ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
 
-/* not implemented */
-static void uring_init(void) {
-	io_fallback();
+	nvme_ring_exit(d);
+	close(d->fd);
+	free(d);
+	bdev->bd_nvme = NULL;
 }
 
 struct fops fops_list[] = {
 	{
 		.init		= uring_init,
+		.cleanup	= uring_cleanup,
+		.read		= uring_read,
+		.write		= uring_write,
+		.open		= uring_open,
+		.close		= uring_close,
 	}, {
 		.init		= aio_init,
 		.cleanup	= aio_cleanup,
 		.read		= aio_read,
 		.write		= aio_write,
+		.open		= aio_open,
+		.close		= aio_close,
+		.submit_batch	= aio_submit_batch,
 	}, {
 		.init		= sync_init,
 		.cleanup	= sync_cleanup,
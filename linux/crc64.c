@@ -26,13 +26,407 @@
  *   Author: Coly Li <colyli@suse.de>
  */
 
+#include <asm/unaligned.h>
+#include <linux/compiler.h>
 #include <linux/module.h>
 #include <linux/types.h>
 #include "crc64table.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL		(1 << 4)
+#endif
+#endif
+
 MODULE_DESCRIPTION("CRC64 calculations");
 MODULE_LICENSE("GPL v2");
 
+/*
+ * Slice-by-8 tables: crc64_slice8[i][b] is the crc of byte b followed by i
+ * zero bytes, so that we can process 8 bytes per iteration with 8 independent
+ * lookups. crc64_slice8[0] is crc64table.
+ */
+static u64 ____cacheline_aligned crc64_slice8[8][256];
+
+static u64 __pure crc64_be_slice8(u64 crc, const void *p, size_t len)
+{
+	const u8 *_p = p;
+
+	while (len >= 8) {
+		u64 v = crc ^ get_unaligned_be64(_p);
+
+		crc =	crc64_slice8[7][v >> 56] ^
+			crc64_slice8[6][(v >> 48) & 0xff] ^
+			crc64_slice8[5][(v >> 40) & 0xff] ^
+			crc64_slice8[4][(v >> 32) & 0xff] ^
+			crc64_slice8[3][(v >> 24) & 0xff] ^
+			crc64_slice8[2][(v >> 16) & 0xff] ^
+			crc64_slice8[1][(v >>  8) & 0xff] ^
+			crc64_slice8[0][v & 0xff];
+		_p	+= 8;
+		len	-= 8;
+	}
+
+	while (len--)
+		crc = crc64table[(crc >> 56) ^ *_p++] ^ (crc << 8);
+
+	return crc;
+}
+
+/*
+ * Carryless multiply folding, as described in Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction":
+ *
+ * Since the crc of a message M is (M * x^64) mod P, we may replace any leading
+ * part of the message by anything congruent to it mod P. A 128 bit chunk R
+ * followed by d bits of message is folded forward onto the data d bits later
+ * by multiplying its halves by x^(d+64) mod P and x^d mod P - the products are
+ * at most 127 bits, so the accumulators never grow.
+ *
+ * Data is byte reversed on load so that bit n of a register is the coefficient
+ * of x^n, i.e. we work with the crc unreflected, as crc64_be() defines it.
+ *
+ * At the end, the 128 bit remainder is multiplied by x^64 and reduced mod P:
+ * one more fold gets it down to a 128 bit T congruent to R * x^64, then a
+ * Barrett reduction computes T mod P with mu = floor(x^128 / P).
+ */
+struct crc64_fold_consts {
+	u64		fold2048[2];
+	u64		fold512[2];
+	u64		fold128[2];
+	/* x^128 mod P, unused */
+	u64		reduce[2];
+	/* mu - x^64, P - x^64 */
+	u64		barrett[2];
+};
+
+static struct crc64_fold_consts ____cacheline_aligned crc64_consts;
+
+#define CRC64_POLY	0x42f0e1eba9ea3693ULL
+
+/* x^n mod P, for n >= 64: */
+static u64 xpow_mod(unsigned n)
+{
+	u64 v = CRC64_POLY;
+
+	while (n-- > 64)
+		v = (v << 1) ^ ((v >> 63) ? CRC64_POLY : 0);
+	return v;
+}
+
+/* floor(x^128 / P), without the x^64 term: */
+static u64 barrett_mu(void)
+{
+	u64 w = 0, mu = 0;
+	bool t = true;
+	int i;
+
+	for (i = 64; i >= 0; --i) {
+		if (i < 64 && t)
+			mu |= 1ULL << i;
+		if (t)
+			w ^= CRC64_POLY;
+		t = w >> 63;
+		w <<= 1;
+	}
+
+	return mu;
+}
+
+static void crc64_fold_consts_init(struct crc64_fold_consts *c)
+{
+	c->fold2048[0]	= xpow_mod(2048);
+	c->fold2048[1]	= xpow_mod(2048 + 64);
+	c->fold512[0]	= xpow_mod(512);
+	c->fold512[1]	= xpow_mod(512 + 64);
+	c->fold128[0]	= xpow_mod(128);
+	c->fold128[1]	= xpow_mod(128 + 64);
+	c->reduce[0]	= xpow_mod(128);
+	c->reduce[1]	= 0;
+	c->barrett[0]	= barrett_mu();
+	c->barrett[1]	= CRC64_POLY;
+}
+
+#if defined(__x86_64__)
+
+#define PCLMUL_TARGET	"pclmul,ssse3"
+#define VPCLMUL_TARGET	PCLMUL_TARGET ",avx2,avx512f,avx512bw,vpclmulqdq"
+
+static __always_inline __attribute__((target(PCLMUL_TARGET)))
+__m128i pclmul_load(const u8 *p)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+static __always_inline __attribute__((target(PCLMUL_TARGET)))
+__m128i pclmul_fold(__m128i r, __m128i k, __m128i d)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(r, k, 0x00),
+					   _mm_clmulepi64_si128(r, k, 0x11)), d);
+}
+
+static __always_inline __attribute__((target(PCLMUL_TARGET)))
+__m128i pclmul_const(const u64 *k)
+{
+	return _mm_load_si128((const __m128i *) k);
+}
+
+/*
+ * Fold four accumulators at consecutive 16 byte offsets along 64 bytes at a
+ * time, then combine them and finish: shared by the pclmul and vpclmul paths.
+ */
+static __always_inline __attribute__((target(PCLMUL_TARGET)))
+u64 pclmul_finish(__m128i x0, __m128i x1, __m128i x2, __m128i x3,
+		  const u8 *p, size_t len)
+{
+	const struct crc64_fold_consts *c = &crc64_consts;
+	__m128i k = pclmul_const(c->fold512), t;
+
+	while (len >= 64) {
+		x0 = pclmul_fold(x0, k, pclmul_load(p));
+		x1 = pclmul_fold(x1, k, pclmul_load(p + 16));
+		x2 = pclmul_fold(x2, k, pclmul_load(p + 32));
+		x3 = pclmul_fold(x3, k, pclmul_load(p + 48));
+		p	+= 64;
+		len	-= 64;
+	}
+
+	k = pclmul_const(c->fold128);
+	x0 = pclmul_fold(x0, k, x1);
+	x0 = pclmul_fold(x0, k, x2);
+	x0 = pclmul_fold(x0, k, x3);
+
+	while (len >= 16) {
+		x0 = pclmul_fold(x0, k, pclmul_load(p));
+		p	+= 16;
+		len	-= 16;
+	}
+
+	/* T = R * x^64, reduced to 128 bits: */
+	k = pclmul_const(c->reduce);
+	t = _mm_xor_si128(_mm_clmulepi64_si128(x0, k, 0x01),
+			  _mm_slli_si128(x0, 8));
+
+	/* Barrett: q = floor(T / P), crc = T - q * P */
+	k = pclmul_const(c->barrett);
+	x0 = _mm_xor_si128(_mm_srli_si128(_mm_clmulepi64_si128(t, k, 0x01), 8),
+			   _mm_srli_si128(t, 8));
+	t = _mm_xor_si128(t, _mm_clmulepi64_si128(x0, k, 0x10));
+
+	return crc64_be_slice8(_mm_cvtsi128_si64(t), p, len);
+}
+
+__attribute__((target(PCLMUL_TARGET)))
+static u64 __pure crc64_be_pclmul(u64 crc, const void *_p, size_t len)
+{
+	const u8 *p = _p;
+	__m128i x0;
+
+	if (len < 64)
+		return crc64_be_slice8(crc, p, len);
+
+	x0 = _mm_xor_si128(pclmul_load(p), _mm_set_epi64x(crc, 0));
+
+	return pclmul_finish(x0,
+			     pclmul_load(p + 16),
+			     pclmul_load(p + 32),
+			     pclmul_load(p + 48),
+			     p + 64, len - 64);
+}
+
+static __always_inline __attribute__((target(VPCLMUL_TARGET)))
+__m512i vpclmul_load(const u8 *p)
+{
+	const __m512i bswap = _mm512_broadcast_i32x4(
+		_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			     8, 9, 10, 11, 12, 13, 14, 15));
+
+	return _mm512_shuffle_epi8(_mm512_loadu_si512(p), bswap);
+}
+
+static __always_inline __attribute__((target(VPCLMUL_TARGET)))
+__m512i vpclmul_fold(__m512i r, __m512i k, __m512i d)
+{
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(r, k, 0x00),
+					 _mm512_clmulepi64_epi128(r, k, 0x11),
+					 d, 0x96);
+}
+
+/*
+ * Same as crc64_be_pclmul(), but with four 512 bit accumulators, 256 bytes
+ * per iteration; each 128 bit lane is an independent accumulator, so after the
+ * main loop the lanes are handed to pclmul_finish() as-is:
+ */
+__attribute__((target(VPCLMUL_TARGET)))
+static u64 __pure crc64_be_vpclmul(u64 crc, const void *_p, size_t len)
+{
+	const struct crc64_fold_consts *c = &crc64_consts;
+	const u8 *p = _p;
+	__m512i z0, z1, z2, z3, k;
+
+	if (len < 256)
+		return crc64_be_pclmul(crc, p, len);
+
+	z0 = _mm512_xor_si512(vpclmul_load(p),
+			      _mm512_set_epi64(0, 0, 0, 0, 0, 0, crc, 0));
+	z1 = vpclmul_load(p + 64);
+	z2 = vpclmul_load(p + 128);
+	z3 = vpclmul_load(p + 192);
+	p	+= 256;
+	len	-= 256;
+
+	k = _mm512_broadcast_i32x4(pclmul_const(c->fold2048));
+
+	while (len >= 256) {
+		z0 = vpclmul_fold(z0, k, vpclmul_load(p));
+		z1 = vpclmul_fold(z1, k, vpclmul_load(p + 64));
+		z2 = vpclmul_fold(z2, k, vpclmul_load(p + 128));
+		z3 = vpclmul_fold(z3, k, vpclmul_load(p + 192));
+		p	+= 256;
+		len	-= 256;
+	}
+
+	k = _mm512_broadcast_i32x4(pclmul_const(c->fold512));
+	z0 = vpclmul_fold(z0, k, z1);
+	z0 = vpclmul_fold(z0, k, z2);
+	z0 = vpclmul_fold(z0, k, z3);
+
+	return pclmul_finish(_mm512_extracti32x4_epi32(z0, 0),
+			     _mm512_extracti32x4_epi32(z0, 1),
+			     _mm512_extracti32x4_epi32(z0, 2),
+			     _mm512_extracti32x4_epi32(z0, 3),
+			     p, len);
+}
+
+#elif defined(__aarch64__)
+
+#define PMULL_TARGET	"+crypto"
+
+static __always_inline __attribute__((target(PMULL_TARGET)))
+uint64x2_t pmull_load(const u8 *p)
+{
+	uint64x2_t v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(p)));
+
+	return vextq_u64(v, v, 1);
+}
+
+static __always_inline __attribute__((target(PMULL_TARGET)))
+uint64x2_t pmull_lo(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0),
+						(poly64_t) vgetq_lane_u64(b, 0)));
+}
+
+static __always_inline __attribute__((target(PMULL_TARGET)))
+uint64x2_t pmull_hi(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_high_p64(vreinterpretq_p64_u64(a),
+						     vreinterpretq_p64_u64(b)));
+}
+
+static __always_inline __attribute__((target(PMULL_TARGET)))
+uint64x2_t pmull_fold(uint64x2_t r, uint64x2_t k, uint64x2_t d)
+{
+	return veorq_u64(veorq_u64(pmull_lo(r, k), pmull_hi(r, k)), d);
+}
+
+/* See crc64_be_pclmul(): */
+__attribute__((target(PMULL_TARGET)))
+static u64 __pure crc64_be_pmull(u64 crc, const void *_p, size_t len)
+{
+	const struct crc64_fold_consts *c = &crc64_consts;
+	const u8 *p = _p;
+	uint64x2_t x0, x1, x2, x3, k, t, q;
+
+	if (len < 64)
+		return crc64_be_slice8(crc, p, len);
+
+	x0 = veorq_u64(pmull_load(p), vcombine_u64(vcreate_u64(0),
+						   vcreate_u64(crc)));
+	x1 = pmull_load(p + 16);
+	x2 = pmull_load(p + 32);
+	x3 = pmull_load(p + 48);
+	p	+= 64;
+	len	-= 64;
+
+	k = vld1q_u64(c->fold512);
+
+	while (len >= 64) {
+		x0 = pmull_fold(x0, k, pmull_load(p));
+		x1 = pmull_fold(x1, k, pmull_load(p + 16));
+		x2 = pmull_fold(x2, k, pmull_load(p + 32));
+		x3 = pmull_fold(x3, k, pmull_load(p + 48));
+		p	+= 64;
+		len	-= 64;
+	}
+
+	k = vld1q_u64(c->fold128);
+	x0 = pmull_fold(x0, k, x1);
+	x0 = pmull_fold(x0, k, x2);
+	x0 = pmull_fold(x0, k, x3);
+
+	while (len >= 16) {
+		x0 = pmull_fold(x0, k, pmull_load(p));
+		p	+= 16;
+		len	-= 16;
+	}
+
+	/* T = R * x^64, reduced to 128 bits: */
+	t = veorq_u64(pmull_lo(vdupq_laneq_u64(x0, 1), vld1q_u64(c->reduce)),
+		      vcombine_u64(vcreate_u64(0), vget_low_u64(x0)));
+
+	/* Barrett: q = floor(T / P), crc = T - q * P */
+	k = vld1q_u64(c->barrett);
+	q = veorq_u64(pmull_lo(vdupq_laneq_u64(t, 1), k),
+		      vdupq_laneq_u64(t, 1));
+	t = veorq_u64(t, pmull_hi(vdupq_laneq_u64(q, 1), k));
+
+	return crc64_be_slice8(vgetq_lane_u64(t, 0), p, len);
+}
+
+#endif
+
+static u64 (*crc64_be_impl)(u64, const void *, size_t) = crc64_be_slice8;
+
+__attribute__((constructor))
+static void crc64_init(void)
+{
+	unsigned i, j;
+
+	for (j = 0; j < 256; j++)
+		crc64_slice8[0][j] = crc64table[j];
+
+	for (i = 1; i < 8; i++)
+		for (j = 0; j < 256; j++) {
+			u64 v = crc64_slice8[i - 1][j];
+
+			crc64_slice8[i][j] = crc64table[v >> 56] ^ (v << 8);
+		}
+
+	crc64_fold_consts_init(&crc64_consts);
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("vpclmulqdq") &&
+	    __builtin_cpu_supports("avx512bw"))
+		crc64_be_impl = crc64_be_vpclmul;
+	else if (__builtin_cpu_supports("pclmul") &&
+		 __builtin_cpu_supports("ssse3"))
+		crc64_be_impl = crc64_be_pclmul;
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_PMULL)
+		crc64_be_impl = crc64_be_pmull;
+#endif
+}
+
 /**
  * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
  * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
@@ -42,15 +436,6 @@ MODULE_LICENSE("GPL v2");
  */
 u64 __pure crc64_be(u64 crc, const void *p, size_t len)
 {
-	size_t i, t;
-
-	const unsigned char *_p = p;
-
-	for (i = 0; i < len; i++) {
-		t = ((crc >> 56) ^ (*_p++)) & 0xFF;
-		crc = crc64table[t] ^ (crc << 8);
-	}
-
-	return crc;
+	return crc64_be_impl(crc, p, len);
 }
 EXPORT_SYMBOL_GPL(crc64_be);
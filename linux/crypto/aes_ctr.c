@@ -0,0 +1,396 @@
+/*
+ * AES in counter mode - "ctr(aes)" - as in the kernel: the IV is the initial
+ * counter block, incremented as a 128 bit big endian integer.
+ *
+ * libsodium only has AES as part of its AES-GCM AEAD construction, so this is
+ * standalone: a portable implementation, and AES-NI and VAES (AVX-512)
+ * versions picked at startup.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <linux/byteorder.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+
+#include <linux/crypto.h>
+#include <crypto/aes.h>
+#include <crypto/algapi.h>
+#include <crypto/skcipher.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+struct aes_ctx {
+	u8			rk[AES_MAX_ROUNDS + 1][AES_BLOCK_SIZE] __aligned(16);
+	unsigned		nr;
+};
+
+/* The counter block, as a native integer: */
+struct aes_ctr {
+	u64			hi;
+	u64			lo;
+};
+
+static inline void aes_ctr_inc(struct aes_ctr *ctr)
+{
+	if (!++ctr->lo)
+		ctr->hi++;
+}
+
+static const u8 ____cacheline_aligned aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/*
+ * FIPS-197 key expansion; the round keys are kept as bytes, which is also the
+ * layout the AES instructions want:
+ */
+static int aes_expandkey(struct aes_ctx *ctx, const u8 *key, unsigned keylen)
+{
+	u8 *w = &ctx->rk[0][0];
+	unsigned nk = keylen / 4, i, j;
+	u8 rcon = 1;
+
+	if (keylen != AES_KEYSIZE_128 &&
+	    keylen != AES_KEYSIZE_192 &&
+	    keylen != AES_KEYSIZE_256)
+		return -EINVAL;
+
+	ctx->nr = nk + 6;
+	memcpy(w, key, keylen);
+
+	for (i = nk; i < 4 * (ctx->nr + 1); i++) {
+		u8 t[4];
+
+		memcpy(t, w + (i - 1) * 4, 4);
+
+		if (i % nk == 0) {
+			u8 t0 = t[0];
+
+			t[0] = aes_sbox[t[1]] ^ rcon;
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[t0];
+			rcon = (rcon << 1) ^ ((rcon >> 7) * 0x1b);
+		} else if (nk > 6 && i % nk == 4) {
+			for (j = 0; j < 4; j++)
+				t[j] = aes_sbox[t[j]];
+		}
+
+		for (j = 0; j < 4; j++)
+			w[i * 4 + j] = w[(i - nk) * 4 + j] ^ t[j];
+	}
+
+	return 0;
+}
+
+static inline u8 aes_xtime(u8 x)
+{
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void aes_encrypt_block_generic(const struct aes_ctx *ctx, u8 *out, const u8 *in)
+{
+	u8 s[AES_BLOCK_SIZE], t[AES_BLOCK_SIZE];
+	unsigned r, c, i;
+
+	for (i = 0; i < AES_BLOCK_SIZE; i++)
+		s[i] = in[i] ^ ctx->rk[0][i];
+
+	for (r = 1; r <= ctx->nr; r++) {
+		/* SubBytes and ShiftRows: */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[c * 4 + i] = aes_sbox[s[((c + i) & 3) * 4 + i]];
+
+		if (r == ctx->nr) {
+			memcpy(s, t, sizeof(s));
+		} else {
+			/* MixColumns: */
+			for (c = 0; c < 4; c++) {
+				u8 *a = t + c * 4, x = a[0] ^ a[1] ^ a[2] ^ a[3];
+
+				s[c * 4 + 0] = a[0] ^ x ^ aes_xtime(a[0] ^ a[1]);
+				s[c * 4 + 1] = a[1] ^ x ^ aes_xtime(a[1] ^ a[2]);
+				s[c * 4 + 2] = a[2] ^ x ^ aes_xtime(a[2] ^ a[3]);
+				s[c * 4 + 3] = a[3] ^ x ^ aes_xtime(a[3] ^ a[0]);
+			}
+		}
+
+		for (i = 0; i < AES_BLOCK_SIZE; i++)
+			s[i] ^= ctx->rk[r][i];
+	}
+
+	memcpy(out, s, sizeof(s));
+}
+
+static inline void aes_ctr_block(struct aes_ctr *ctr, u8 *block)
+{
+	put_unaligned_be64(ctr->hi, block);
+	put_unaligned_be64(ctr->lo, block + 8);
+	aes_ctr_inc(ctr);
+}
+
+static void aes_ctr_generic(const struct aes_ctx *ctx, u8 *dst, const u8 *src,
+			    size_t len, struct aes_ctr *ctr)
+{
+	u8 ks[AES_BLOCK_SIZE];
+	unsigned i, n;
+
+	while (len) {
+		aes_ctr_block(ctr, ks);
+		aes_encrypt_block_generic(ctx, ks, ks);
+
+		n = min_t(size_t, len, AES_BLOCK_SIZE);
+		for (i = 0; i < n; i++)
+			dst[i] = src[i] ^ ks[i];
+
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
+
+#if defined(__x86_64__)
+
+#define AESNI_TARGET	"aes,ssse3"
+
+/* Eight blocks at a time, to cover the latency of aesenc: */
+#define AESNI_STRIDE	8
+
+/*
+ * The bulk loops keep the counter in a vector register, as the native 128 bit
+ * integer, and byte swap it to get the counter block; they only add to the low
+ * half, so they fall back to aes_ctr_inc() when that's about to wrap.
+ */
+__attribute__((target(AESNI_TARGET)))
+static inline __m128i aesni_bswap_mask(void)
+{
+	return _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			    8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+__attribute__((target(AESNI_TARGET)))
+static inline __m128i aesni_encrypt(const __m128i *k, unsigned nr, __m128i b)
+{
+	unsigned r;
+
+	b = _mm_xor_si128(b, k[0]);
+	for (r = 1; r < nr; r++)
+		b = _mm_aesenc_si128(b, k[r]);
+	return _mm_aesenclast_si128(b, k[nr]);
+}
+
+__attribute__((target(AESNI_TARGET)))
+static void aes_ctr_aesni(const struct aes_ctx *ctx, u8 *dst, const u8 *src,
+			  size_t len, struct aes_ctr *ctr)
+{
+	const __m128i bswap = aesni_bswap_mask();
+	__m128i k[AES_MAX_ROUNDS + 1], b[AESNI_STRIDE];
+	unsigned nr = ctx->nr, r, i;
+
+	for (r = 0; r <= nr; r++)
+		k[r] = _mm_loadu_si128((const __m128i *) ctx->rk[r]);
+
+	while (len >= sizeof(b) && ctr->lo <= U64_MAX - AESNI_STRIDE) {
+		__m128i c = _mm_set_epi64x(ctr->hi, ctr->lo);
+
+#pragma GCC unroll 8
+		for (i = 0; i < AESNI_STRIDE; i++)
+			b[i] = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(c,
+						_mm_set_epi64x(0, i)), bswap), k[0]);
+
+		for (r = 1; r < nr; r++)
+#pragma GCC unroll 8
+			for (i = 0; i < AESNI_STRIDE; i++)
+				b[i] = _mm_aesenc_si128(b[i], k[r]);
+
+#pragma GCC unroll 8
+		for (i = 0; i < AESNI_STRIDE; i++)
+			_mm_storeu_si128((__m128i *) dst + i,
+				_mm_xor_si128(_mm_aesenclast_si128(b[i], k[nr]),
+					      _mm_loadu_si128((const __m128i *) src + i)));
+
+		ctr->lo	+= AESNI_STRIDE;
+		dst	+= sizeof(b);
+		src	+= sizeof(b);
+		len	-= sizeof(b);
+	}
+
+	while (len) {
+		u8 ks[AES_BLOCK_SIZE];
+		unsigned n = min_t(size_t, len, AES_BLOCK_SIZE);
+
+		b[0] = _mm_shuffle_epi8(_mm_set_epi64x(ctr->hi, ctr->lo), bswap);
+		aes_ctr_inc(ctr);
+		_mm_storeu_si128((__m128i *) ks, aesni_encrypt(k, nr, b[0]));
+
+		for (i = 0; i < n; i++)
+			dst[i] = src[i] ^ ks[i];
+
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
+
+#define VAES_TARGET	"vaes,avx512f,avx512bw," AESNI_TARGET
+
+/* Four 512 bit vectors of four blocks each: */
+#define VAES_STRIDE	4
+#define VAES_BLOCKS	(VAES_STRIDE * 4)
+
+__attribute__((target(VAES_TARGET)))
+static void aes_ctr_vaes(const struct aes_ctx *ctx, u8 *dst, const u8 *src,
+			 size_t len, struct aes_ctr *ctr)
+{
+	const __m512i bswap = _mm512_broadcast_i32x4(aesni_bswap_mask());
+	__m512i k[AES_MAX_ROUNDS + 1], b[VAES_STRIDE];
+	unsigned nr = ctx->nr, r, i;
+
+	for (r = 0; r <= nr; r++)
+		k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) ctx->rk[r]));
+
+	while (len >= sizeof(b) && ctr->lo <= U64_MAX - VAES_BLOCKS) {
+		__m512i c = _mm512_set_epi64(ctr->hi, ctr->lo + 3,
+					     ctr->hi, ctr->lo + 2,
+					     ctr->hi, ctr->lo + 1,
+					     ctr->hi, ctr->lo);
+
+#pragma GCC unroll 4
+		for (i = 0; i < VAES_STRIDE; i++)
+			b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(_mm512_add_epi64(c,
+					_mm512_set_epi64(0, i * 4, 0, i * 4,
+							 0, i * 4, 0, i * 4)), bswap), k[0]);
+
+		for (r = 1; r < nr; r++)
+#pragma GCC unroll 4
+			for (i = 0; i < VAES_STRIDE; i++)
+				b[i] = _mm512_aesenc_epi128(b[i], k[r]);
+
+#pragma GCC unroll 4
+		for (i = 0; i < VAES_STRIDE; i++)
+			_mm512_storeu_si512(dst + i * sizeof(b[i]),
+				_mm512_xor_si512(_mm512_aesenclast_epi128(b[i], k[nr]),
+						 _mm512_loadu_si512(src + i * sizeof(b[i]))));
+
+		ctr->lo	+= VAES_BLOCKS;
+		dst	+= sizeof(b);
+		src	+= sizeof(b);
+		len	-= sizeof(b);
+	}
+
+	aes_ctr_aesni(ctx, dst, src, len, ctr);
+}
+
+#endif
+
+static void (*aes_ctr_crypt)(const struct aes_ctx *, u8 *, const u8 *,
+			     size_t, struct aes_ctr *) = aes_ctr_generic;
+
+static struct skcipher_alg alg;
+
+struct aes_ctr_tfm {
+	struct crypto_skcipher	tfm;
+	struct aes_ctx		ctx;
+};
+
+static int crypto_aes_ctr_setkey(struct crypto_skcipher *tfm, const u8 *key,
+				 unsigned int keysize)
+{
+	struct aes_ctr_tfm *ctx =
+		container_of(tfm, struct aes_ctr_tfm, tfm);
+
+	return aes_expandkey(&ctx->ctx, key, keysize);
+}
+
+static int crypto_aes_ctr_crypt(struct skcipher_request *req)
+{
+	struct aes_ctr_tfm *ctx =
+		container_of(req->tfm, struct aes_ctr_tfm, tfm.base);
+	struct scatterlist *sg = req->src;
+	unsigned nbytes = req->cryptlen;
+	struct aes_ctr ctr = {
+		.hi = get_unaligned_be64(req->iv),
+		.lo = get_unaligned_be64(req->iv + 8),
+	};
+
+	BUG_ON(req->src != req->dst);
+
+	while (1) {
+		aes_ctr_crypt(&ctx->ctx, sg_virt(sg), sg_virt(sg),
+			      sg->length, &ctr);
+
+		nbytes -= sg->length;
+
+		if (sg_is_last(sg))
+			break;
+
+		BUG_ON(sg->length % AES_BLOCK_SIZE);
+		sg = sg_next(sg);
+	};
+
+	BUG_ON(nbytes);
+
+	return 0;
+}
+
+static void *crypto_aes_ctr_alloc_tfm(void)
+{
+	struct aes_ctr_tfm *tfm = kzalloc(sizeof(*tfm), GFP_KERNEL);
+
+	if (!tfm)
+		return NULL;
+
+	tfm->tfm.base.alg	= &alg.base;
+	tfm->tfm.setkey		= crypto_aes_ctr_setkey;
+	tfm->tfm.encrypt	= crypto_aes_ctr_crypt;
+	tfm->tfm.decrypt	= crypto_aes_ctr_crypt;
+	tfm->tfm.ivsize		= AES_BLOCK_SIZE;
+	tfm->tfm.keysize	= AES_KEYSIZE_256;
+
+	return tfm;
+}
+
+static struct skcipher_alg alg = {
+	.base.cra_name		= "ctr(aes)",
+	.base.alloc_tfm		= crypto_aes_ctr_alloc_tfm,
+};
+
+__attribute__((constructor(110)))
+static int aes_ctr_mod_init(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("aes") &&
+	    __builtin_cpu_supports("ssse3"))
+		aes_ctr_crypt = aes_ctr_aesni;
+	if (aes_ctr_crypt == aes_ctr_aesni &&
+	    __builtin_cpu_supports("vaes") &&
+	    __builtin_cpu_supports("avx512bw"))
+		aes_ctr_crypt = aes_ctr_vaes;
+#endif
+	return crypto_register_skcipher(&alg);
+}
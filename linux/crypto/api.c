@@ -19,8 +19,12 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 
+#include "tools-util.h"
+
 #include <crypto/algapi.h>
 
+#include <sodium/core.h>
+
 static LIST_HEAD(crypto_alg_list);
 static DECLARE_RWSEM(crypto_alg_sem);
 
@@ -39,21 +43,20 @@ int crypto_register_alg(struct crypto_alg *alg)
 static void *crypto_alloc_tfm(const char *name,
 			      const struct crypto_type *type)
 {
-	struct crypto_alg *alg;
+	struct crypto_alg *alg, *best = NULL;
 
+	/* Like the kernel, prefer the highest priority implementation: */
 	down_read(&crypto_alg_sem);
 	list_for_each_entry(alg, &crypto_alg_list, cra_list)
-		if (alg->cra_type == type && !strcmp(alg->cra_name, name))
-			goto found;
-
-	alg = ERR_PTR(-ENOENT);
-found:
+		if (alg->cra_type == type && !strcmp(alg->cra_name, name) &&
+		    (!best || alg->cra_priority > best->cra_priority))
+			best = alg;
 	up_read(&crypto_alg_sem);
 
-	if (IS_ERR(alg))
-		return ERR_CAST(alg);
+	if (!best)
+		return ERR_PTR(-ENOENT);
 
-	return alg->alloc_tfm() ?: ERR_PTR(-ENOMEM);
+	return best->alloc_tfm() ?: ERR_PTR(-ENOMEM);
 }
 
 /* skcipher: */
@@ -112,3 +115,15 @@ int crypto_register_shash(struct shash_alg *alg)
 
 	return crypto_register_alg(&alg->base);
 }
+
+/*
+ * libsodium only switches from its portable reference code to the SIMD
+ * implementations (SSSE3/AVX2 ChaCha20, SSE2 Poly1305, SHA-256 etc.) - chosen
+ * by cpuid - in sodium_init(); run it before the algorithms are registered:
+ */
+__attribute__((constructor(109)))
+static void crypto_api_init(void)
+{
+	if (sodium_init() < 0)
+		die("error initializing libsodium");
+}
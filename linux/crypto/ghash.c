@@ -0,0 +1,394 @@
+/*
+ * GHASH, the universal hash of GCM (NIST SP 800-38D), as the kernel's "ghash"
+ * shash: the key is the hash subkey H, and final() zero pads a partial block.
+ *
+ * A portable bit at a time implementation, a PCLMULQDQ version which
+ * aggregates eight blocks per reduction, and a VPCLMULQDQ (AVX-512) version
+ * which does sixteen, four per vector.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <linux/byteorder.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <asm/unaligned.h>
+
+#include <linux/crypto.h>
+#include <crypto/ghash.h>
+#include <crypto/hash.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define GHASH_STRIDE		8
+#define GHASH_STRIDE_VPCLMUL	16
+
+struct ghash_key {
+	/* H, as a big endian 128 bit integer: */
+	u64			h[2];
+	/* H^1..H^16, byte reflected, for the PCLMULQDQ versions: */
+	u8			pow[GHASH_STRIDE_VPCLMUL][GHASH_BLOCK_SIZE] __aligned(16);
+};
+
+struct ghash_desc_ctx {
+	u8			acc[GHASH_BLOCK_SIZE];
+	u8			buf[GHASH_BLOCK_SIZE];
+	unsigned		bytes;
+};
+
+/* x = x * y in GF(2^128), with GCM's bit order: */
+static void gf128_mul(u64 *x, const u64 *y)
+{
+	u64 zh = 0, zl = 0, vh = y[0], vl = y[1];
+	unsigned i;
+
+	for (i = 0; i < 128; i++) {
+		u64 bit = -((x[i / 64] >> (63 - i % 64)) & 1);
+		u64 lsb = -(vl & 1);
+
+		zh ^= vh & bit;
+		zl ^= vl & bit;
+
+		vl = (vl >> 1) | (vh << 63);
+		vh = (vh >> 1) ^ (lsb & 0xe100000000000000ULL);
+	}
+
+	x[0] = zh;
+	x[1] = zl;
+}
+
+static void ghash_blocks_generic(const struct ghash_key *key, u8 *acc,
+				 const u8 *src, size_t nr)
+{
+	u64 x[2] = { get_unaligned_be64(acc), get_unaligned_be64(acc + 8) };
+
+	while (nr--) {
+		x[0] ^= get_unaligned_be64(src);
+		x[1] ^= get_unaligned_be64(src + 8);
+		gf128_mul(x, key->h);
+		src += GHASH_BLOCK_SIZE;
+	}
+
+	put_unaligned_be64(x[0], acc);
+	put_unaligned_be64(x[1], acc + 8);
+}
+
+#if defined(__x86_64__)
+
+#define PCLMUL_TARGET	"pclmul,ssse3"
+
+/*
+ * Carry-less multiplication of byte reflected operands, per Intel's "Carry-Less
+ * Multiplication and Its Usage for Computing the GCM Mode": the product is left
+ * unreduced, so that several can be summed before one reduction.
+ */
+__attribute__((target(PCLMUL_TARGET)))
+static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+	__m128i l = _mm_clmulepi64_si128(a, b, 0x00);
+	__m128i h = _mm_clmulepi64_si128(a, b, 0x11);
+	__m128i m = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+				  _mm_clmulepi64_si128(a, b, 0x01));
+
+	*lo = _mm_xor_si128(*lo, _mm_xor_si128(l, _mm_slli_si128(m, 8)));
+	*hi = _mm_xor_si128(*hi, _mm_xor_si128(h, _mm_srli_si128(m, 8)));
+}
+
+/* Shift the 256 bit product left by one (for the reflection), and reduce: */
+__attribute__((target(PCLMUL_TARGET)))
+static inline __m128i gf128_reduce(__m128i lo, __m128i hi)
+{
+	__m128i t7, t8, t9, t2, t4, t5;
+
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(hi, t8);
+	hi = _mm_or_si128(hi, t9);
+
+	t7 = _mm_slli_epi32(lo, 31);
+	t8 = _mm_slli_epi32(lo, 30);
+	t9 = _mm_slli_epi32(lo, 25);
+	t7 = _mm_xor_si128(t7, _mm_xor_si128(t8, t9));
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	lo = _mm_xor_si128(lo, t7);
+
+	t2 = _mm_srli_epi32(lo, 1);
+	t4 = _mm_srli_epi32(lo, 2);
+	t5 = _mm_srli_epi32(lo, 7);
+	t2 = _mm_xor_si128(t2, _mm_xor_si128(t4, t5));
+	t2 = _mm_xor_si128(t2, t8);
+	lo = _mm_xor_si128(lo, t2);
+
+	return _mm_xor_si128(hi, lo);
+}
+
+__attribute__((target(PCLMUL_TARGET)))
+static inline __m128i gf128_mul_pclmul(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+	clmul_acc(a, b, &lo, &hi);
+	return gf128_reduce(lo, hi);
+}
+
+__attribute__((target(PCLMUL_TARGET)))
+static inline __m128i ghash_load(const u8 *p, __m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+__attribute__((target(PCLMUL_TARGET)))
+static void ghash_setkey_pclmul(struct ghash_key *key, const u8 *h)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i h1 = ghash_load(h, bswap), hn = h1;
+	unsigned i;
+
+	for (i = 0; i < GHASH_STRIDE_VPCLMUL; i++) {
+		_mm_storeu_si128((__m128i *) key->pow[i], hn);
+		hn = gf128_mul_pclmul(hn, h1);
+	}
+}
+
+__attribute__((target(PCLMUL_TARGET)))
+static void ghash_blocks_pclmul(const struct ghash_key *key, u8 *acc,
+				const u8 *src, size_t nr)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i h1 = _mm_loadu_si128((const __m128i *) key->pow[0]);
+	__m128i y = ghash_load(acc, bswap);
+	unsigned i;
+
+	/* y = (y + x0) * H^8 + x1 * H^7 + ... + x7 * H */
+	for (; nr >= GHASH_STRIDE; nr -= GHASH_STRIDE) {
+		__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+		y = _mm_xor_si128(y, ghash_load(src, bswap));
+
+#pragma GCC unroll 8
+		for (i = 0; i < GHASH_STRIDE; i++)
+			clmul_acc(i ? ghash_load(src + i * GHASH_BLOCK_SIZE, bswap) : y,
+				  _mm_loadu_si128((const __m128i *)
+						 key->pow[GHASH_STRIDE - 1 - i]),
+				  &lo, &hi);
+
+		y = gf128_reduce(lo, hi);
+		src += GHASH_STRIDE * GHASH_BLOCK_SIZE;
+	}
+
+	for (; nr; --nr) {
+		y = gf128_mul_pclmul(_mm_xor_si128(y, ghash_load(src, bswap)), h1);
+		src += GHASH_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i *) acc, _mm_shuffle_epi8(y, bswap));
+}
+
+#define VPCLMUL_TARGET	"vpclmulqdq,avx512f,avx512bw," PCLMUL_TARGET
+
+__attribute__((target(VPCLMUL_TARGET)))
+static inline void clmul_acc_x4(__m512i a, __m512i b, __m512i *lo, __m512i *hi)
+{
+	__m512i l = _mm512_clmulepi64_epi128(a, b, 0x00);
+	__m512i h = _mm512_clmulepi64_epi128(a, b, 0x11);
+	__m512i m = _mm512_xor_si512(_mm512_clmulepi64_epi128(a, b, 0x10),
+				     _mm512_clmulepi64_epi128(a, b, 0x01));
+
+	*lo = _mm512_xor_si512(*lo, _mm512_xor_si512(l, _mm512_bslli_epi128(m, 8)));
+	*hi = _mm512_xor_si512(*hi, _mm512_xor_si512(h, _mm512_bsrli_epi128(m, 8)));
+}
+
+__attribute__((target(VPCLMUL_TARGET)))
+static inline __m128i xor_lanes(__m512i v)
+{
+	__m256i t = _mm256_xor_si256(_mm512_castsi512_si256(v),
+				     _mm512_extracti64x4_epi64(v, 1));
+
+	return _mm_xor_si128(_mm256_castsi256_si128(t),
+			     _mm256_extracti128_si256(t, 1));
+}
+
+__attribute__((target(VPCLMUL_TARGET)))
+static void ghash_blocks_vpclmul(const struct ghash_key *key, u8 *acc,
+				 const u8 *src, size_t nr)
+{
+	const __m512i bswap = _mm512_broadcast_i32x4(
+			_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				     8, 9, 10, 11, 12, 13, 14, 15));
+	__m512i k[GHASH_STRIDE_VPCLMUL / 4];
+	__m128i y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) acc),
+				     _mm512_castsi512_si128(bswap));
+	unsigned i, j;
+
+	/* k[i] holds H^(16 - 4i)..H^(13 - 4i), for blocks 4i..4i+3: */
+	for (i = 0; i < ARRAY_SIZE(k); i++) {
+		const u8 *p = key->pow[GHASH_STRIDE_VPCLMUL - 1 - 4 * i];
+
+		k[i] = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *) p));
+		for (j = 1; j < 4; j++)
+			k[i] = _mm512_mask_broadcast_i32x4(k[i], 0xf << (j * 4),
+				_mm_loadu_si128((const __m128i *) (p - j * GHASH_BLOCK_SIZE)));
+	}
+
+	for (; nr >= GHASH_STRIDE_VPCLMUL; nr -= GHASH_STRIDE_VPCLMUL) {
+		__m512i lo = _mm512_setzero_si512(), hi = _mm512_setzero_si512();
+
+#pragma GCC unroll 4
+		for (j = 0; j < ARRAY_SIZE(k); j++) {
+			__m512i x = _mm512_shuffle_epi8(_mm512_loadu_si512(src + j * 64),
+							bswap);
+
+			if (!j)
+				x = _mm512_xor_si512(x, _mm512_zextsi128_si512(y));
+			clmul_acc_x4(x, k[j], &lo, &hi);
+		}
+
+		y = gf128_reduce(xor_lanes(lo), xor_lanes(hi));
+		src += GHASH_STRIDE_VPCLMUL * GHASH_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i *) acc,
+			 _mm_shuffle_epi8(y, _mm512_castsi512_si128(bswap)));
+	ghash_blocks_pclmul(key, acc, src, nr);
+}
+
+#endif
+
+static void (*ghash_blocks)(const struct ghash_key *, u8 *,
+			    const u8 *, size_t) = ghash_blocks_generic;
+
+static struct shash_alg ghash_alg;
+
+struct ghash_tfm {
+	struct crypto_shash	tfm;
+	struct ghash_key	key;
+};
+
+static inline struct ghash_key *ghash_desc_key(struct shash_desc *desc)
+{
+	return &container_of(desc->tfm, struct ghash_tfm, tfm)->key;
+}
+
+static int ghash_setkey(struct crypto_shash *tfm, const u8 *h,
+			unsigned int keylen)
+{
+	struct ghash_key *key = &container_of(tfm, struct ghash_tfm, tfm)->key;
+
+	if (keylen != GHASH_BLOCK_SIZE)
+		return -EINVAL;
+
+	key->h[0] = get_unaligned_be64(h);
+	key->h[1] = get_unaligned_be64(h + 8);
+
+#if defined(__x86_64__)
+	if (ghash_blocks != ghash_blocks_generic)
+		ghash_setkey_pclmul(key, h);
+#endif
+	return 0;
+}
+
+static int ghash_init(struct shash_desc *desc)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+
+	memset(dctx, 0, sizeof(*dctx));
+	return 0;
+}
+
+static int ghash_update(struct shash_desc *desc, const u8 *src, unsigned len)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+	struct ghash_key *key = ghash_desc_key(desc);
+
+	if (dctx->bytes) {
+		unsigned n = min(len, GHASH_BLOCK_SIZE - dctx->bytes);
+
+		memcpy(dctx->buf + dctx->bytes, src, n);
+		dctx->bytes += n;
+		src += n;
+		len -= n;
+
+		if (dctx->bytes < GHASH_BLOCK_SIZE)
+			return 0;
+
+		ghash_blocks(key, dctx->acc, dctx->buf, 1);
+		dctx->bytes = 0;
+	}
+
+	ghash_blocks(key, dctx->acc, src, len / GHASH_BLOCK_SIZE);
+	src += round_down(len, GHASH_BLOCK_SIZE);
+	len %= GHASH_BLOCK_SIZE;
+
+	memcpy(dctx->buf, src, len);
+	dctx->bytes = len;
+	return 0;
+}
+
+static int ghash_final(struct shash_desc *desc, u8 *out)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+
+	if (dctx->bytes) {
+		memset(dctx->buf + dctx->bytes, 0, GHASH_BLOCK_SIZE - dctx->bytes);
+		ghash_blocks(ghash_desc_key(desc), dctx->acc, dctx->buf, 1);
+	}
+
+	memcpy(out, dctx->acc, GHASH_DIGEST_SIZE);
+	memzero_explicit(dctx, sizeof(*dctx));
+	return 0;
+}
+
+static void *ghash_alloc_tfm(void)
+{
+	struct ghash_tfm *tfm = kzalloc(sizeof(*tfm), GFP_KERNEL);
+
+	if (!tfm)
+		return NULL;
+
+	tfm->tfm.base.alg = &ghash_alg.base;
+	tfm->tfm.descsize = sizeof(struct ghash_desc_ctx);
+	return tfm;
+}
+
+static struct shash_alg ghash_alg = {
+	.digestsize		= GHASH_DIGEST_SIZE,
+	.setkey			= ghash_setkey,
+	.init			= ghash_init,
+	.update			= ghash_update,
+	.final			= ghash_final,
+	.descsize		= sizeof(struct ghash_desc_ctx),
+	.base.cra_name		= "ghash",
+	.base.alloc_tfm		= ghash_alloc_tfm,
+};
+
+__attribute__((constructor(110)))
+static int __init ghash_mod_init(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("ssse3"))
+		ghash_blocks = ghash_blocks_pclmul;
+	if (ghash_blocks == ghash_blocks_pclmul &&
+	    __builtin_cpu_supports("vpclmulqdq") &&
+	    __builtin_cpu_supports("avx512bw"))
+		ghash_blocks = ghash_blocks_vpclmul;
+#endif
+	return crypto_register_shash(&ghash_alg);
+}
@@ -0,0 +1,303 @@
+/*
+ * SHA-256, using the x86 SHA extensions (SHA-NI) or the ARMv8 crypto
+ * extensions.
+ *
+ * libsodium's SHA-256 is portable C only; when the CPU has SHA instructions,
+ * we register this implementation with a higher priority than
+ * sha256_generic.c, and crypto_alloc_shash("sha256") picks it.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <asm/unaligned.h>
+
+#include <linux/crypto.h>
+#include <crypto/hash.h>
+#include <crypto/sha2.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2		(1 << 6)
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+static const u32 ____cacheline_aligned sha256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#endif
+
+#if defined(__x86_64__)
+
+#define SHA_NI_TARGET	"sha,sse4.1,ssse3"
+
+/*
+ * Four rounds, with message words w0; if w0 is not one of the first four
+ * words, it's computed from the previous 16 (w0 itself holds W[t - 16]):
+ */
+#define SHA_NI_ROUNDS(i, w0, w1, w2, w3)					\
+do {										\
+	if (i >= 4)								\
+		w0 = _mm_sha256msg2_epu32(					\
+			_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1),		\
+				      _mm_alignr_epi8(w3, w2, 4)), w3);		\
+										\
+	msg = _mm_add_epi32(w0, _mm_loadu_si128((__m128i *) &sha256_K[i * 4]));\
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);			\
+	msg = _mm_shuffle_epi32(msg, 0x0e);					\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);			\
+} while (0)
+
+__attribute__((target(SHA_NI_TARGET)))
+static void sha256_blocks_ni(u32 *state, const u8 *data, size_t nr)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, save0, save1, msg, m0, m1, m2, m3, tmp;
+
+	/* rnds2 wants the state as ABEF and CDGH: */
+	tmp	= _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[0]), 0xb1);
+	state1	= _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[4]), 0x1b);
+	state0	= _mm_alignr_epi8(tmp, state1, 8);
+	state1	= _mm_blend_epi16(state1, tmp, 0xf0);
+
+	while (nr--) {
+		save0 = state0;
+		save1 = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data +  0)), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 48)), bswap);
+
+		SHA_NI_ROUNDS( 0, m0, m1, m2, m3);
+		SHA_NI_ROUNDS( 1, m1, m2, m3, m0);
+		SHA_NI_ROUNDS( 2, m2, m3, m0, m1);
+		SHA_NI_ROUNDS( 3, m3, m0, m1, m2);
+		SHA_NI_ROUNDS( 4, m0, m1, m2, m3);
+		SHA_NI_ROUNDS( 5, m1, m2, m3, m0);
+		SHA_NI_ROUNDS( 6, m2, m3, m0, m1);
+		SHA_NI_ROUNDS( 7, m3, m0, m1, m2);
+		SHA_NI_ROUNDS( 8, m0, m1, m2, m3);
+		SHA_NI_ROUNDS( 9, m1, m2, m3, m0);
+		SHA_NI_ROUNDS(10, m2, m3, m0, m1);
+		SHA_NI_ROUNDS(11, m3, m0, m1, m2);
+		SHA_NI_ROUNDS(12, m0, m1, m2, m3);
+		SHA_NI_ROUNDS(13, m1, m2, m3, m0);
+		SHA_NI_ROUNDS(14, m2, m3, m0, m1);
+		SHA_NI_ROUNDS(15, m3, m0, m1, m2);
+
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp	= _mm_shuffle_epi32(state0, 0x1b);
+	state1	= _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#elif defined(__aarch64__)
+
+#define SHA2_CE_TARGET	"+crypto"
+
+/* Four rounds, and the message words for the four rounds 16 later: */
+#define SHA2_CE_ROUNDS(i, w0, w1, w2, w3)					\
+do {										\
+	uint32x4_t t = vaddq_u32(w0, vld1q_u32(&sha256_K[i * 4]));		\
+										\
+	if (i < 12)								\
+		w0 = vsha256su1q_u32(vsha256su0q_u32(w0, w1), w2, w3);		\
+										\
+	save = state0;								\
+	state0 = vsha256hq_u32(state0, state1, t);				\
+	state1 = vsha256h2q_u32(state1, save, t);				\
+} while (0)
+
+__attribute__((target(SHA2_CE_TARGET)))
+static void sha256_blocks_ce(u32 *state, const u8 *data, size_t nr)
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+	uint32x4_t save, save0, save1, m0, m1, m2, m3;
+
+	while (nr--) {
+		save0 = state0;
+		save1 = state1;
+
+		m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data +  0)));
+		m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+		m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+		m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+		SHA2_CE_ROUNDS( 0, m0, m1, m2, m3);
+		SHA2_CE_ROUNDS( 1, m1, m2, m3, m0);
+		SHA2_CE_ROUNDS( 2, m2, m3, m0, m1);
+		SHA2_CE_ROUNDS( 3, m3, m0, m1, m2);
+		SHA2_CE_ROUNDS( 4, m0, m1, m2, m3);
+		SHA2_CE_ROUNDS( 5, m1, m2, m3, m0);
+		SHA2_CE_ROUNDS( 6, m2, m3, m0, m1);
+		SHA2_CE_ROUNDS( 7, m3, m0, m1, m2);
+		SHA2_CE_ROUNDS( 8, m0, m1, m2, m3);
+		SHA2_CE_ROUNDS( 9, m1, m2, m3, m0);
+		SHA2_CE_ROUNDS(10, m2, m3, m0, m1);
+		SHA2_CE_ROUNDS(11, m3, m0, m1, m2);
+		SHA2_CE_ROUNDS(12, m0, m1, m2, m3);
+		SHA2_CE_ROUNDS(13, m1, m2, m3, m0);
+		SHA2_CE_ROUNDS(14, m2, m3, m0, m1);
+		SHA2_CE_ROUNDS(15, m3, m0, m1, m2);
+
+		state0 = vaddq_u32(state0, save0);
+		state1 = vaddq_u32(state1, save1);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+#endif
+
+static void (*sha256_blocks)(u32 *, const u8 *, size_t);
+
+static struct shash_alg sha256_accel_alg;
+
+static int sha256_accel_init(struct shash_desc *desc)
+{
+	struct sha256_state *sctx = (void *) desc->ctx;
+
+	sctx->state[0]	= SHA256_H0;
+	sctx->state[1]	= SHA256_H1;
+	sctx->state[2]	= SHA256_H2;
+	sctx->state[3]	= SHA256_H3;
+	sctx->state[4]	= SHA256_H4;
+	sctx->state[5]	= SHA256_H5;
+	sctx->state[6]	= SHA256_H6;
+	sctx->state[7]	= SHA256_H7;
+	sctx->count	= 0;
+	return 0;
+}
+
+static int sha256_accel_update(struct shash_desc *desc, const u8 *data,
+			       unsigned int len)
+{
+	struct sha256_state *sctx = (void *) desc->ctx;
+	unsigned partial = sctx->count % SHA256_BLOCK_SIZE;
+
+	sctx->count += len;
+
+	if (partial + len >= SHA256_BLOCK_SIZE) {
+		if (partial) {
+			unsigned n = SHA256_BLOCK_SIZE - partial;
+
+			memcpy(sctx->buf + partial, data, n);
+			sha256_blocks(sctx->state, sctx->buf, 1);
+			data	+= n;
+			len	-= n;
+			partial	= 0;
+		}
+
+		sha256_blocks(sctx->state, data, len / SHA256_BLOCK_SIZE);
+		data	+= round_down(len, SHA256_BLOCK_SIZE);
+		len	%= SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(sctx->buf + partial, data, len);
+	return 0;
+}
+
+static int sha256_accel_final(struct shash_desc *desc, u8 *out)
+{
+	struct sha256_state *sctx = (void *) desc->ctx;
+	unsigned partial = sctx->count % SHA256_BLOCK_SIZE;
+	unsigned i;
+
+	sctx->buf[partial++] = 0x80;
+
+	if (partial > SHA256_BLOCK_SIZE - sizeof(u64)) {
+		memset(sctx->buf + partial, 0, SHA256_BLOCK_SIZE - partial);
+		sha256_blocks(sctx->state, sctx->buf, 1);
+		partial = 0;
+	}
+
+	memset(sctx->buf + partial, 0, SHA256_BLOCK_SIZE - sizeof(u64) - partial);
+	put_unaligned_be64(sctx->count << 3,
+			   sctx->buf + SHA256_BLOCK_SIZE - sizeof(u64));
+	sha256_blocks(sctx->state, sctx->buf, 1);
+
+	for (i = 0; i < ARRAY_SIZE(sctx->state); i++)
+		put_unaligned_be32(sctx->state[i], out + i * sizeof(u32));
+
+	memzero_explicit(sctx, sizeof(*sctx));
+	return 0;
+}
+
+static void *sha256_accel_alloc_tfm(void)
+{
+	struct crypto_shash *tfm = kzalloc(sizeof(*tfm), GFP_KERNEL);
+
+	if (!tfm)
+		return NULL;
+
+	tfm->base.alg = &sha256_accel_alg.base;
+	tfm->descsize = sizeof(struct sha256_state);
+	return tfm;
+}
+
+static struct shash_alg sha256_accel_alg = {
+	.digestsize		= SHA256_DIGEST_SIZE,
+	.init			= sha256_accel_init,
+	.update			= sha256_accel_update,
+	.final			= sha256_accel_final,
+	.descsize		= sizeof(struct sha256_state),
+	.base.cra_name		= "sha256",
+	.base.cra_priority	= 300,
+	.base.alloc_tfm		= sha256_accel_alloc_tfm,
+};
+
+__attribute__((constructor(110)))
+static int __init sha256_accel_mod_init(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sha") &&
+	    __builtin_cpu_supports("sse4.1"))
+		sha256_blocks = sha256_blocks_ni;
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+		sha256_blocks = sha256_blocks_ce;
+#endif
+	if (!sha256_blocks)
+		return 0;
+
+	return crypto_register_shash(&sha256_accel_alg);
+}
@@ -65,13 +65,14 @@ static void *sha256_alloc_tfm(void)
 }
 
 static struct shash_alg sha256_alg = {
-	.digestsize	= crypto_hash_sha256_BYTES,
-	.init		= sha256_init,
-	.update		= sha256_update,
-	.final		= sha256_final,
-	.descsize	= sizeof(crypto_hash_sha256_state),
-	.base.cra_name	= "sha256",
-	.base.alloc_tfm	= sha256_alloc_tfm,
+	.digestsize		= crypto_hash_sha256_BYTES,
+	.init			= sha256_init,
+	.update			= sha256_update,
+	.final			= sha256_final,
+	.descsize		= sizeof(crypto_hash_sha256_state),
+	.base.cra_name		= "sha256",
+	.base.cra_priority	= 100,
+	.base.alloc_tfm		= sha256_alloc_tfm,
 };
 
 __attribute__((constructor(110)))
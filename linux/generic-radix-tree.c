@@ -4,6 +4,7 @@
 #include <linux/generic-radix-tree.h>
 #include <linux/gfp.h>
 #include <linux/kmemleak.h>
+#include <linux/spinlock.h>
 
 #define GENRADIX_ARY		(PAGE_SIZE / sizeof(struct genradix_node *))
 #define GENRADIX_ARY_SHIFT	ilog2(GENRADIX_ARY)
@@ -77,11 +78,79 @@ void *__genradix_ptr(struct __genradix *radix, size_t offset)
 }
 EXPORT_SYMBOL(__genradix_ptr);
 
+/*
+ * Nodes are single pages, and a big genradix (stripes, gc_stripes) allocated
+ * one page at a time ends up scattered over the heap, where walking it is
+ * mostly TLB misses. So nodes are carved out of hugepage-backed chunks
+ * instead; freed nodes go on a freelist for reuse, and chunks are never freed.
+ *
+ * BCACHEFS_GENRADIX_HUGEPAGES=0 in the environment allocates each node
+ * separately, as before.
+ */
+#define GENRADIX_CHUNK_SIZE	HPAGE_SIZE
+
+static bool genradix_hugepages = true;
+static DEFINE_SPINLOCK(genradix_chunk_lock);
+static void *genradix_freelist;
+static void *genradix_chunk, *genradix_chunk_end;
+
+__attribute__((constructor(110)))
+static void genradix_hugepages_init(void)
+{
+	const char *v = getenv("BCACHEFS_GENRADIX_HUGEPAGES");
+
+	if (v && !strcmp(v, "0"))
+		genradix_hugepages = false;
+}
+
+static void *genradix_chunk_alloc(gfp_t gfp_mask)
+{
+	void *p = NULL;
+
+	spin_lock(&genradix_chunk_lock);
+	if (genradix_freelist) {
+		p = genradix_freelist;
+		genradix_freelist = *((void **) p);
+	} else {
+		if (genradix_chunk == genradix_chunk_end) {
+			void *chunk;
+
+			if (posix_memalign(&chunk, GENRADIX_CHUNK_SIZE,
+					   GENRADIX_CHUNK_SIZE))
+				goto out;
+#ifdef MADV_HUGEPAGE
+			madvise(chunk, GENRADIX_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+			genradix_chunk		= chunk;
+			genradix_chunk_end	= chunk + GENRADIX_CHUNK_SIZE;
+		}
+
+		p = genradix_chunk;
+		genradix_chunk += PAGE_SIZE;
+	}
+out:
+	spin_unlock(&genradix_chunk_lock);
+
+	if (p && (gfp_mask & __GFP_ZERO))
+		memset(p, 0, PAGE_SIZE);
+	return p;
+}
+
+static void genradix_chunk_free(void *p)
+{
+	spin_lock(&genradix_chunk_lock);
+	*((void **) p) = genradix_freelist;
+	genradix_freelist = p;
+	spin_unlock(&genradix_chunk_lock);
+}
+
 static inline struct genradix_node *genradix_alloc_node(gfp_t gfp_mask)
 {
 	struct genradix_node *node;
 
-	node = (struct genradix_node *)__get_free_page(gfp_mask|__GFP_ZERO);
+	node = genradix_hugepages
+		? genradix_chunk_alloc(gfp_mask|__GFP_ZERO)
+		: (struct genradix_node *)__get_free_page(gfp_mask|__GFP_ZERO);
 
 	/*
 	 * We're using pages (not slab allocations) directly for kernel data
@@ -95,7 +164,10 @@ static inline struct genradix_node *genradix_alloc_node(gfp_t gfp_mask)
 static inline void genradix_free_node(struct genradix_node *node)
 {
 	kmemleak_free(node);
-	free_page((unsigned long)node);
+	if (genradix_hugepages)
+		genradix_chunk_free(node);
+	else
+		free_page((unsigned long)node);
 }
 
 /*
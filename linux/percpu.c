@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/math.h>
+#include <linux/mutex.h>
+#include <linux/page.h>
+#include <linux/percpu.h>
+
+#include "tools-util.h"
+
+/*
+ * Percpu allocator:
+ *
+ * We reserve (but don't commit) PCPU_UNIT_SIZE of address space per CPU, and
+ * allocate from the CPU 0 unit: the other CPUs' copies are at fixed offsets
+ * from there. Units are made accessible in PCPU_MAP_CHUNK increments as the
+ * allocator grows.
+ *
+ * Small allocations come from power of two size classes, each carved out of
+ * whole pages and kept on freelists; larger allocations get runs of pages.
+ */
+
+#define PCPU_MAP_CHUNK		(1UL << 20)
+#define PCPU_NR_PAGES		(PCPU_UNIT_SIZE >> PAGE_SHIFT)
+
+#define PCPU_MIN_SHIFT		3
+#define PCPU_NR_CLASSES		(PAGE_SHIFT - PCPU_MIN_SHIFT)
+#define PCPU_CLASS_LARGE	U8_MAX
+
+unsigned nr_cpu_ids = 1;
+
+static DEFINE_MUTEX(pcpu_lock);
+static void		*pcpu_base;
+static unsigned long	pcpu_mapped;
+
+static DECLARE_BITMAP(pcpu_pages_used, PCPU_NR_PAGES);
+static u8		pcpu_page_class[PCPU_NR_PAGES];
+static unsigned		pcpu_page_nr[PCPU_NR_PAGES];
+
+/* Freelists are linked through the CPU 0 copy of each free object: */
+static void		*pcpu_freelist[PCPU_NR_CLASSES];
+
+__attribute__((constructor(101)))
+static void percpu_init(void)
+{
+	nr_cpu_ids = max(get_nprocs_conf(), 1);
+}
+
+static void *pcpu_unit(unsigned cpu)
+{
+	return pcpu_base + ((unsigned long) cpu << PCPU_UNIT_SHIFT);
+}
+
+static int pcpu_map(unsigned long end)
+{
+	unsigned long new_mapped;
+	unsigned cpu;
+
+	if (!pcpu_base) {
+		void *p = mmap(NULL, (unsigned long) nr_cpu_ids << PCPU_UNIT_SHIFT,
+			       PROT_NONE,
+			       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+			return -ENOMEM;
+		pcpu_base = p;
+	}
+
+	if (end <= pcpu_mapped)
+		return 0;
+
+	new_mapped = round_up(end, PCPU_MAP_CHUNK);
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		if (mprotect(pcpu_unit(cpu) + pcpu_mapped,
+			     new_mapped - pcpu_mapped,
+			     PROT_READ|PROT_WRITE))
+			return -ENOMEM;
+
+	pcpu_mapped = new_mapped;
+	return 0;
+}
+
+static void *pcpu_alloc_pages(unsigned nr)
+{
+	unsigned long start = 0, end;
+
+	while (1) {
+		start = find_next_zero_bit(pcpu_pages_used, PCPU_NR_PAGES, start);
+		if (start + nr > PCPU_NR_PAGES)
+			return NULL;
+
+		end = find_next_bit(pcpu_pages_used, start + nr, start);
+		if (end >= start + nr)
+			break;
+		start = end;
+	}
+
+	if (pcpu_map((start + nr) << PAGE_SHIFT))
+		return NULL;
+
+	for (end = start; end < start + nr; end++)
+		__set_bit(end, pcpu_pages_used);
+	pcpu_page_nr[start] = nr;
+
+	return pcpu_base + (start << PAGE_SHIFT);
+}
+
+static void *pcpu_alloc_small(unsigned class)
+{
+	unsigned size = 1U << (class + PCPU_MIN_SHIFT);
+	void *p, *obj;
+
+	if (!pcpu_freelist[class]) {
+		p = pcpu_alloc_pages(1);
+		if (!p)
+			return NULL;
+
+		pcpu_page_class[(p - pcpu_base) >> PAGE_SHIFT] = class;
+
+		for (obj = p + PAGE_SIZE - size; obj >= p; obj -= size) {
+			*((void **) obj) = pcpu_freelist[class];
+			pcpu_freelist[class] = obj;
+		}
+	}
+
+	p = pcpu_freelist[class];
+	pcpu_freelist[class] = *((void **) p);
+	return p;
+}
+
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	unsigned cpu;
+	void *p;
+
+	size = max_t(size_t, max(size, align), 1UL << PCPU_MIN_SHIFT);
+
+	mutex_lock(&pcpu_lock);
+	if (size <= PAGE_SIZE / 2) {
+		p = pcpu_alloc_small(order_base_2(size) - PCPU_MIN_SHIFT);
+	} else {
+		p = pcpu_alloc_pages(DIV_ROUND_UP(size, PAGE_SIZE));
+		if (p)
+			pcpu_page_class[(p - pcpu_base) >> PAGE_SHIFT] =
+				PCPU_CLASS_LARGE;
+	}
+	mutex_unlock(&pcpu_lock);
+
+	if (!p)
+		return NULL;
+
+	/* Freed objects aren't zeroed, and the freelist link is in CPU 0's copy: */
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		memset(per_cpu_ptr(p, cpu), 0, size);
+
+	return p;
+}
+
+void free_percpu(void __percpu *ptr)
+{
+	unsigned long page, i;
+	unsigned class;
+
+	if (!ptr)
+		return;
+
+	page = (ptr - pcpu_base) >> PAGE_SHIFT;
+	BUG_ON(ptr < pcpu_base || page >= PCPU_NR_PAGES);
+
+	mutex_lock(&pcpu_lock);
+	class = pcpu_page_class[page];
+
+	if (class == PCPU_CLASS_LARGE) {
+		for (i = page; i < page + pcpu_page_nr[page]; i++)
+			__clear_bit(i, pcpu_pages_used);
+	} else {
+		*((void **) ptr) = pcpu_freelist[class];
+		pcpu_freelist[class] = ptr;
+	}
+	mutex_unlock(&pcpu_lock);
+}
@@ -1,5 +1,8 @@
 #include <pthread.h>
+#include <stdlib.h>
 
+#include "linux/cache.h"
+#include "linux/cpumask.h"
 #include "linux/preempt.h"
 
 /*
@@ -10,28 +13,65 @@
  * various code paths, critically including the percpu system as it allows for
  * non-atomic reads and writes to CPU-local data structures.
  *
- * The high performance userspace equivalent would be to use thread local
- * storage to replace percpu data, but that would be complicated. It should be
- * correct to instead guarantee mutual exclusion for the critical sections.
+ * We emulate that by having preempt_disable() claim a CPU slot: while
+ * preemption is disabled, smp_processor_id() returns the claimed slot, and no
+ * other thread can claim it. We prefer the CPU we're actually running on, but
+ * since slots are only used for indexing percpu data, any free slot will do.
  */
 
-static pthread_mutex_t preempt_lock;
+__thread unsigned preempt_count;
+__thread unsigned preempt_cpu;
 
-__attribute__((constructor))
-static void preempt_init(void) {
-	pthread_mutexattr_t attr;
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&preempt_lock, &attr);
-	pthread_mutexattr_destroy(&attr);
+struct preempt_slot {
+	pthread_mutex_t		lock;
+} ____cacheline_aligned;
+
+static struct preempt_slot *preempt_slots;
+
+__attribute__((constructor(102)))
+static void preempt_init(void)
+{
+	unsigned cpu;
+
+	preempt_slots = aligned_alloc(SMP_CACHE_BYTES,
+				      sizeof(preempt_slots[0]) * nr_cpu_ids);
+	if (!preempt_slots)
+		abort();
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		pthread_mutex_init(&preempt_slots[cpu].lock, NULL);
 }
 
 void preempt_disable(void)
 {
-	pthread_mutex_lock(&preempt_lock);
+	unsigned cpu, i;
+
+	if (preempt_count) {
+		preempt_count++;
+		return;
+	}
+
+	cpu = raw_smp_processor_id();
+
+	for (i = 0; i < nr_cpu_ids; i++) {
+		unsigned slot = (cpu + i) % nr_cpu_ids;
+
+		if (!pthread_mutex_trylock(&preempt_slots[slot].lock)) {
+			cpu = slot;
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock(&preempt_slots[cpu].lock);
+out:
+	preempt_cpu = cpu;
+	preempt_count = 1;
 }
 
 void preempt_enable(void)
 {
-	pthread_mutex_unlock(&preempt_lock);
+	if (--preempt_count)
+		return;
+
+	pthread_mutex_unlock(&preempt_slots[preempt_cpu].lock);
 }
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/timer.h>
+
+/*
+ * kfree_rcu():
+ *
+ * Pointers are collected into per-CPU batches, which are handed to call_rcu()
+ * when full or after KFREE_RCU_DELAY - so that we pay for one callback per
+ * batch, and so that freeing lots of objects doesn't flood liburcu's callback
+ * queues. Since we batch pointers, the rcu_head in the object isn't used.
+ */
+
+#define KFREE_RCU_BATCH		254
+#define KFREE_RCU_DELAY		msecs_to_jiffies(10)
+
+struct kfree_rcu_batch {
+	struct rcu_head		rcu;
+	unsigned		nr;
+	void			*ptrs[KFREE_RCU_BATCH];
+};
+
+struct kfree_rcu_cpu {
+	struct mutex		lock;
+	struct kfree_rcu_batch	*batch;
+	struct timer_list	timer;
+} ____cacheline_aligned;
+
+static struct kfree_rcu_cpu *kfree_rcu_cpus;
+
+static void kfree_rcu_batch_free(struct rcu_head *rcu)
+{
+	struct kfree_rcu_batch *b = container_of(rcu, struct kfree_rcu_batch, rcu);
+	unsigned i;
+
+	for (i = 0; i < b->nr; i++)
+		kfree(b->ptrs[i]);
+	kfree(b);
+}
+
+/* Called with krc->lock held: */
+static void kfree_rcu_flush(struct kfree_rcu_cpu *krc)
+{
+	struct kfree_rcu_batch *b = krc->batch;
+
+	if (b) {
+		krc->batch = NULL;
+		call_rcu(&b->rcu, kfree_rcu_batch_free);
+	}
+}
+
+static void kfree_rcu_timer_fn(struct timer_list *timer)
+{
+	struct kfree_rcu_cpu *krc = container_of(timer, struct kfree_rcu_cpu, timer);
+
+	mutex_lock(&krc->lock);
+	kfree_rcu_flush(krc);
+	mutex_unlock(&krc->lock);
+}
+
+void __kfree_rcu(void *p)
+{
+	struct kfree_rcu_cpu *krc;
+	struct kfree_rcu_batch *b;
+
+	if (!p)
+		return;
+
+	krc = kfree_rcu_cpus + raw_smp_processor_id();
+
+	mutex_lock(&krc->lock);
+	b = krc->batch;
+	if (!b) {
+		/*
+		 * Not kmalloc(): we don't want to run shrinkers, which may
+		 * themselves call kfree_rcu(), with krc->lock held:
+		 */
+		b = malloc(sizeof(*b));
+		if (!b) {
+			mutex_unlock(&krc->lock);
+			synchronize_rcu();
+			kfree(p);
+			return;
+		}
+
+		b->nr = 0;
+		krc->batch = b;
+		mod_timer(&krc->timer, jiffies + KFREE_RCU_DELAY);
+	}
+
+	b->ptrs[b->nr++] = p;
+	if (b->nr == KFREE_RCU_BATCH)
+		kfree_rcu_flush(krc);
+	mutex_unlock(&krc->lock);
+}
+
+__attribute__((constructor(104)))
+static void kfree_rcu_init(void)
+{
+	unsigned cpu;
+
+	kfree_rcu_cpus = aligned_alloc(SMP_CACHE_BYTES,
+				       sizeof(kfree_rcu_cpus[0]) * nr_cpu_ids);
+	if (!kfree_rcu_cpus)
+		abort();
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		struct kfree_rcu_cpu *krc = kfree_rcu_cpus + cpu;
+
+		mutex_init(&krc->lock);
+		krc->batch = NULL;
+		timer_setup(&krc->timer, kfree_rcu_timer_fn, 0);
+	}
+}
@@ -24,6 +24,7 @@
 #include <linux/rhashtable.h>
 #include <linux/err.h>
 #include <linux/export.h>
+#include <linux/jiffies.h>
 
 #define HASH_DEFAULT_SIZE	64UL
 #define HASH_MIN_SIZE		4U
@@ -218,10 +219,10 @@ static struct bucket_table *rhashtable_last_table(struct rhashtable *ht,
 }
 
 static int rhashtable_rehash_one(struct rhashtable *ht,
+				 struct bucket_table *old_tbl,
 				 struct rhash_lock_head __rcu **bkt,
 				 unsigned int old_hash)
 {
-	struct bucket_table *old_tbl = rht_dereference(ht->tbl, ht);
 	struct bucket_table *new_tbl = rhashtable_last_table(ht, old_tbl);
 	int err = -EAGAIN;
 	struct rhash_head *head, *next, *entry;
@@ -278,7 +279,7 @@ static int rhashtable_rehash_chain(struct rhashtable *ht,
 		return 0;
 	rht_lock(old_tbl, bkt);
 
-	while (!(err = rhashtable_rehash_one(ht, bkt, old_hash)))
+	while (!(err = rhashtable_rehash_one(ht, old_tbl, bkt, old_hash)))
 		;
 
 	if (err == -ENOENT)
@@ -298,6 +299,8 @@ static int rhashtable_rehash_attach(struct rhashtable *ht,
 	 * rcu_assign_pointer().
 	 */
 
+	new_tbl->resize_start = local_clock();
+
 	if (cmpxchg((struct bucket_table **)&old_tbl->future_tbl, NULL,
 		    new_tbl) != NULL)
 		return -EEXIST;
@@ -305,6 +308,30 @@ static int rhashtable_rehash_attach(struct rhashtable *ht,
 	return 0;
 }
 
+/*
+ * Inserts while a resize is in progress have already locked the bucket in the
+ * old table they hash to: move that chain to the new table while we have it,
+ * so that the worker has less to do and lookups stop walking both tables for
+ * this bucket sooner.
+ */
+static void rhashtable_rehash_lazy(struct rhashtable *ht,
+				   struct bucket_table *tbl,
+				   struct rhash_lock_head __rcu **bkt,
+				   unsigned int hash)
+{
+	int err;
+
+	if (tbl != rcu_access_pointer(ht->tbl) ||
+	    rht_is_a_nulls(rht_ptr(bkt, tbl, hash)))
+		return;
+
+	while (!(err = rhashtable_rehash_one(ht, tbl, bkt, hash)))
+		;
+
+	if (err == -ENOENT)
+		atomic_inc(&ht->nr_rehash_lazy);
+}
+
 static int rhashtable_rehash_table(struct rhashtable *ht)
 {
 	struct bucket_table *old_tbl = rht_dereference(ht->tbl, ht);
@@ -327,6 +354,14 @@ static int rhashtable_rehash_table(struct rhashtable *ht)
 	/* Publish the new table pointer. */
 	rcu_assign_pointer(ht->tbl, new_tbl);
 
+	if (new_tbl->resize_start) {
+		u64 duration = local_clock() - new_tbl->resize_start;
+
+		ht->nr_resizes++;
+		ht->resize_time_total += duration;
+		ht->resize_time_max = max(ht->resize_time_max, duration);
+	}
+
 	spin_lock(&ht->lock);
 	list_for_each_entry(walker, &old_tbl->walkers, list)
 		walker->tbl = NULL;
@@ -611,6 +646,9 @@ static void *rhashtable_try_insert(struct rhashtable *ht, const void *key,
 			if (PTR_ERR(new_tbl) != -EEXIST)
 				data = ERR_CAST(new_tbl);
 
+			if (!IS_ERR_OR_NULL(new_tbl))
+				rhashtable_rehash_lazy(ht, tbl, bkt, hash);
+
 			rht_unlock(tbl, bkt);
 		}
 	} while (!IS_ERR_OR_NULL(new_tbl));
@@ -1167,6 +1205,51 @@ void rhashtable_destroy(struct rhashtable *ht)
 }
 EXPORT_SYMBOL_GPL(rhashtable_destroy);
 
+/**
+ * rhashtable_stats_to_text - print resize and chain length statistics
+ * @out:	printbuf to print to
+ * @ht:		the hash table
+ *
+ * Walks every bucket of the current table, under RCU.
+ */
+void rhashtable_stats_to_text(struct printbuf *out, struct rhashtable *ht)
+{
+	struct bucket_table *tbl;
+	struct rhash_head *pos;
+	unsigned int i, len, max_len = 0, used = 0, nr = 0, resizing;
+	unsigned int hist[4] = { 0 };
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->tbl);
+	resizing = rcu_access_pointer(tbl->future_tbl) != NULL;
+
+	for (i = 0; i < tbl->size; i++) {
+		len = 0;
+		rht_for_each_rcu(pos, tbl, i)
+			len++;
+
+		max_len	 = max(max_len, len);
+		used	+= len != 0;
+		nr	+= len;
+		hist[min_t(unsigned int, ilog2(len + 1), ARRAY_SIZE(hist) - 1)]++;
+	}
+	rcu_read_unlock();
+
+	prt_printf(out, "buckets:\t\t%u%s\n", tbl->size, resizing ? " (resizing)" : "");
+	prt_printf(out, "elements:\t\t%u\n", atomic_read(&ht->nelems));
+	prt_printf(out, "buckets used:\t\t%u\n", used);
+	prt_printf(out, "mean chain length:\t%u.%02u\n",
+		   nr / max(used, 1U), nr * 100 / max(used, 1U) % 100);
+	prt_printf(out, "max chain length:\t%u\n", max_len);
+	prt_printf(out, "chain lengths 0/1-2/3-6/7+:\t%u/%u/%u/%u\n",
+		   hist[0], hist[1], hist[2], hist[3]);
+	prt_printf(out, "resizes:\t\t%u\n", ht->nr_resizes);
+	prt_printf(out, "resize time total:\t%llu us\n", ht->resize_time_total / NSEC_PER_USEC);
+	prt_printf(out, "resize time max:\t%llu us\n", ht->resize_time_max / NSEC_PER_USEC);
+	prt_printf(out, "lazy chain rehashes:\t%u\n", atomic_read(&ht->nr_rehash_lazy));
+}
+EXPORT_SYMBOL_GPL(rhashtable_stats_to_text);
+
 struct rhash_lock_head __rcu **__rht_bucket_nested(
 	const struct bucket_table *tbl, unsigned int hash)
 {
@@ -1,4 +1,5 @@
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -14,20 +15,30 @@
 
 __thread struct task_struct *current;
 
+static void free_task_struct_rcu(struct rcu_head *rcu)
+{
+	free(container_of(rcu, struct task_struct, rcu));
+}
+
 void __put_task_struct(struct task_struct *t)
 {
 	pthread_join(t->thread, NULL);
-	free(t);
+	call_rcu(&t->rcu, free_task_struct_rcu);
 }
 
 /* returns true if process was woken up, false if it was already running */
 int wake_up_process(struct task_struct *p)
 {
-	int ret = p->state != TASK_RUNNING;
-
-	p->state = TASK_RUNNING;
-	futex(&p->state, FUTEX_WAKE|FUTEX_PRIVATE_FLAG,
-	      INT_MAX, NULL, NULL, 0);
+	/*
+	 * If the task was already running it isn't (and won't be, without
+	 * rechecking its wait condition) in FUTEX_WAIT, so we can skip the
+	 * syscall - this is the common case when waking an optimistic spinner:
+	 */
+	int ret = xchg(&p->state, TASK_RUNNING) != TASK_RUNNING;
+
+	if (ret)
+		futex(&p->state, FUTEX_WAKE|FUTEX_PRIVATE_FLAG,
+		      INT_MAX, NULL, NULL, 0);
 	return ret;
 }
 
@@ -37,9 +48,14 @@ void schedule(void)
 
 	rcu_quiescent_state();
 
+	if (READ_ONCE(current->state) == TASK_RUNNING)
+		return;
+
+	WRITE_ONCE(current->on_cpu, false);
 	while ((v = READ_ONCE(current->state)) != TASK_RUNNING)
 		futex(&current->state, FUTEX_WAIT|FUTEX_PRIVATE_FLAG,
 		      v, NULL, NULL, 0);
+	WRITE_ONCE(current->on_cpu, true);
 }
 
 struct process_timer {
@@ -101,21 +117,54 @@ out:
 	return timeout < 0 ? 0 : timeout;
 }
 
-__attribute__((constructor(101)))
-static void sched_init(void)
+static pthread_key_t sched_thread_key;
+
+static struct task_struct *sched_alloc_task(void)
 {
 	struct task_struct *p = malloc(sizeof(*p));
 
 	memset(p, 0, sizeof(*p));
 
 	p->state	= TASK_RUNNING;
+	p->on_cpu	= true;
 	atomic_set(&p->usage, 1);
 	init_completion(&p->exited);
+	return p;
+}
+
+static void sched_thread_exit(void *data)
+{
+	struct task_struct *p = data;
 
-	current = p;
+	current = NULL;
+	call_rcu(&p->rcu, free_task_struct_rcu);
+	rcu_unregister_thread();
+}
+
+/*
+ * For threads we didn't create with kthread_create(), e.g. a library's worker
+ * threads calling back into us: gives the thread a task_struct and registers
+ * it with RCU, both undone when the thread exits.
+ */
+void sched_thread_init(void)
+{
+	if (current)
+		return;
+
+	current = sched_alloc_task();
+	rcu_register_thread();
+	pthread_setspecific(sched_thread_key, current);
+}
+
+__attribute__((constructor(101)))
+static void sched_init(void)
+{
+	current = sched_alloc_task();
 
 	rcu_init();
 	rcu_register_thread();
+
+	pthread_key_create(&sched_thread_key, sched_thread_exit);
 }
 
 #ifndef SYS_getrandom
@@ -1,43 +1,108 @@
-
 #include <stdio.h>
 
+#include <linux/atomic.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/sched.h>
 #include <linux/shrinker.h>
 
 #include "tools-util.h"
 
+/*
+ * Memory pressure is sampled by a background thread while any shrinkers are
+ * registered; the allocation path only checks shrinker_want_shrink, instead
+ * of parsing /proc/meminfo on every allocation.
+ */
+#define SHRINKER_SAMPLE_MS	100
+
+long shrinker_want_shrink;
+
 static LIST_HEAD(shrinker_list);
 static DEFINE_MUTEX(shrinker_lock);
+static struct task_struct *shrinker_task;
 
-int register_shrinker(struct shrinker *shrinker, const char *fmt, ...)
+static u64 parse_meminfo_line(const char *line)
 {
-	mutex_lock(&shrinker_lock);
-	list_add_tail(&shrinker->list, &shrinker_list);
-	mutex_unlock(&shrinker_lock);
-	return 0;
+	u64 v;
+
+	if (sscanf(line, " %llu kB", &v) < 1)
+		die("sscanf error");
+	return v << 10;
 }
 
-void unregister_shrinker(struct shrinker *shrinker)
+/*
+ * Our cgroup v2 directory, i.e. /sys/fs/cgroup + the "0::" line from
+ * /proc/self/cgroup:
+ */
+static char *cgroup_dir(void)
 {
-	mutex_lock(&shrinker_lock);
-	list_del(&shrinker->list);
-	mutex_unlock(&shrinker_lock);
+	static char *dir;
+	static bool initialized;
+	size_t n = 0;
+	char *line = NULL;
+	const char *v;
+	FILE *f;
+
+	if (initialized)
+		return dir;
+	initialized = true;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return NULL;
+
+	while (getline(&line, &n, f) != -1)
+		if ((v = strcmp_prefix(line, "0::"))) {
+			dir = mprintf("/sys/fs/cgroup%s", v);
+			strim(dir);
+			break;
+		}
+
+	fclose(f);
+	free(line);
+	return dir;
 }
 
-struct meminfo {
-	u64		total;
-	u64		available;
-};
+/* Returns U64_MAX for "max", or if the file doesn't exist: */
+static u64 cgroup_read_u64(const char *dir, const char *file)
+{
+	char *path = mprintf("%s/%s", dir, file);
+	u64 v = U64_MAX;
+	FILE *f = fopen(path, "r");
+
+	if (f) {
+		if (fscanf(f, "%llu", &v) != 1)
+			v = U64_MAX;
+		fclose(f);
+	}
 
-static u64 parse_meminfo_line(const char *line)
+	free(path);
+	return v;
+}
+
+/* Clamp to our cgroup's memory limit, if we have one: */
+static void cgroup_meminfo(struct sysinfo *val)
 {
-	u64 v;
+	const char *dir = cgroup_dir();
+	u64 limit, usage;
 
-	if (sscanf(line, " %llu kB", &v) < 1)
-		die("sscanf error");
-	return v << 10;
+	if (!dir)
+		return;
+
+	limit = min(cgroup_read_u64(dir, "memory.high"),
+		    cgroup_read_u64(dir, "memory.max"));
+	if (limit == U64_MAX)
+		return;
+
+	usage = cgroup_read_u64(dir, "memory.current");
+	if (usage == U64_MAX)
+		return;
+
+	val->totalram	= min_t(u64, val->totalram ?: U64_MAX, limit);
+	val->freeram	= min_t(u64, val->freeram ?: U64_MAX,
+				limit > usage ? limit - usage : 1);
 }
 
 void si_meminfo(struct sysinfo *val)
@@ -64,6 +129,67 @@ void si_meminfo(struct sysinfo *val)
 
 	fclose(f);
 	free(line);
+
+	cgroup_meminfo(val);
+}
+
+static long memory_pressure(void)
+{
+	struct sysinfo info;
+
+	si_meminfo(&info);
+
+	/* If we weren't able to read /proc/meminfo, we must be pretty low: */
+	if (!info.totalram || !info.freeram)
+		return 8 << 20;
+
+	return max_t(s64, (info.totalram >> 2) - info.freeram, 0);
+}
+
+static int shrinker_thread(void *arg)
+{
+	while (!kthread_should_stop()) {
+		WRITE_ONCE(shrinker_want_shrink, memory_pressure());
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule_timeout(msecs_to_jiffies(SHRINKER_SAMPLE_MS));
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+int register_shrinker(struct shrinker *shrinker, const char *fmt, ...)
+{
+	mutex_lock(&shrinker_lock);
+	list_add_tail(&shrinker->list, &shrinker_list);
+
+	if (!shrinker_task) {
+		struct task_struct *p = kthread_run(shrinker_thread, NULL,
+						    "shrinker");
+		if (!IS_ERR(p))
+			shrinker_task = p;
+	}
+	mutex_unlock(&shrinker_lock);
+	return 0;
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	struct task_struct *p = NULL;
+
+	mutex_lock(&shrinker_lock);
+	list_del(&shrinker->list);
+	if (list_empty(&shrinker_list))
+		swap(p, shrinker_task);
+	mutex_unlock(&shrinker_lock);
+
+	if (p) {
+		kthread_stop(p);
+		WRITE_ONCE(shrinker_want_shrink, 0);
+	}
 }
 
 static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
@@ -83,15 +209,11 @@ static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
 	mutex_unlock(&shrinker_lock);
 }
 
-void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
+void __run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
 {
 	struct shrinker *shrinker;
-	struct sysinfo info;
 	s64 want_shrink;
 
-	if (!(gfp_mask & GFP_KERNEL))
-		return;
-
 	/* Fast out if there are no shrinkers to run. */
 	if (list_empty(&shrinker_list))
 		return;
@@ -101,19 +223,13 @@ void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
 		return;
 	}
 
-	si_meminfo(&info);
-
-	if (info.totalram && info.freeram) {
-		want_shrink = (info.totalram >> 2) - info.freeram;
-
-		if (want_shrink <= 0)
-			return;
-	} else {
-		/* If we weren't able to read /proc/meminfo, we must be pretty
-		 * low: */
-
-		want_shrink = 8 << 20;
-	}
+	/*
+	 * Consume the sampled pressure, so that we only shrink once per
+	 * sample instead of on every allocation until the next one:
+	 */
+	want_shrink = xchg(&shrinker_want_shrink, 0);
+	if (want_shrink <= 0)
+		return;
 
 	mutex_lock(&shrinker_lock);
 	list_for_each_entry(shrinker, &shrinker_list, list) {
@@ -4,6 +4,7 @@
 #include <linux/log2.h>
 #include <linux/percpu.h>
 #include <linux/preempt.h>
+#include <linux/printbuf.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/sched/clock.h>
@@ -337,6 +338,30 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 	return true;
 }
 
+/*
+ * Global contention statistics, so that lock spinning can be evaluated on real
+ * workloads; these are only touched in the slowpath:
+ */
+static struct {
+	atomic64_t		slowpath;
+	atomic64_t		spin;
+	atomic64_t		spin_acquired;
+	atomic64_t		sleep;
+} six_contention;
+
+void six_lock_contention_to_text(struct printbuf *out)
+{
+	prt_printf(out, "six lock slowpath:\t%llu\n",
+		   (u64) atomic64_read(&six_contention.slowpath));
+	prt_printf(out, "optimistic spins:\t%llu\n",
+		   (u64) atomic64_read(&six_contention.spin));
+	prt_printf(out, "acquired spinning:\t%llu\n",
+		   (u64) atomic64_read(&six_contention.spin_acquired));
+	prt_printf(out, "slept:\t\t\t%llu\n",
+		   (u64) atomic64_read(&six_contention.sleep));
+}
+EXPORT_SYMBOL_GPL(six_lock_contention_to_text);
+
 #ifdef CONFIG_LOCK_SPIN_ON_OWNER
 
 static inline bool six_optimistic_spin(struct six_lock *lock,
@@ -386,10 +411,68 @@ static inline bool six_optimistic_spin(struct six_lock *lock,
 
 #else /* CONFIG_LOCK_SPIN_ON_OWNER */
 
+/*
+ * Userspace version: task->on_cpu only tells us whether the owner is blocked
+ * in schedule() - we can't see it being preempted or blocking on a pthread
+ * primitive, and we don't have need_resched(), so the spin is bounded by time.
+ * The pause between checks backs off exponentially to reduce cacheline
+ * traffic on the lock.
+ */
+#define SIX_SPIN_MAX_NS		(20 * NSEC_PER_USEC)
+#define SIX_SPIN_MAX_RELAX	64
+
 static inline bool six_optimistic_spin(struct six_lock *lock,
 				       struct six_lock_waiter *wait)
 {
-	return false;
+	struct task_struct *owner;
+	unsigned relax = 1, i;
+	u64 end;
+
+	switch (wait->lock_want) {
+	case SIX_LOCK_read:
+		break;
+	case SIX_LOCK_intent:
+		if (lock->wait_list.next != &wait->list)
+			return false;
+		break;
+	case SIX_LOCK_write:
+		return false;
+	}
+
+	if (num_online_cpus() < 2)
+		return false;
+
+	atomic64_inc(&six_contention.spin);
+	end = local_clock() + SIX_SPIN_MAX_NS;
+
+	rcu_read_lock();
+	owner = READ_ONCE(lock->owner);
+
+	while (owner && lock->owner == owner) {
+		/*
+		 * Ensure we emit the owner->on_cpu, dereference _after_
+		 * checking lock->owner still matches owner; task_structs are
+		 * freed via call_rcu(), so it stays valid while we're in the
+		 * read side critical section:
+		 */
+		barrier();
+
+		if (READ_ONCE(wait->lock_acquired) ||
+		    !READ_ONCE(owner->on_cpu) ||
+		    time_after64(local_clock(), end))
+			break;
+
+		for (i = 0; i < relax; i++)
+			cpu_relax();
+		relax = min_t(unsigned, relax << 1, SIX_SPIN_MAX_RELAX);
+	}
+	rcu_read_unlock();
+
+	if (!READ_ONCE(wait->lock_acquired))
+		return false;
+
+	atomic64_inc(&six_contention.spin_acquired);
+	return true;
 }
 
 #endif
@@ -448,6 +531,8 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 		ret = 0;
 	}
 
+	atomic64_inc(&six_contention.slowpath);
+
 	if (six_optimistic_spin(lock, wait))
 		goto out;
 
@@ -469,6 +554,7 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 			break;
 		}
 
+		atomic64_inc(&six_contention.sleep);
 		schedule();
 	}
 
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
+#include <linux/printbuf.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * Object caches:
+ *
+ * Objects are still individually malloc()ed - so that kfree() on a cache
+ * object keeps working, as it does in the kernel - but freed objects are
+ * recycled instead of going back to malloc. Each CPU has a magazine of free
+ * objects, accessed with preemption disabled; magazines are refilled from and
+ * flushed to a per cache depot, which is bounded in size and emptied by a
+ * shrinker under memory pressure.
+ */
+
+#define KMEM_MAG_SIZE		32
+#define KMEM_MAG_BATCH		(KMEM_MAG_SIZE / 2)
+#define KMEM_DEPOT_MAX_BYTES	(1UL << 20)
+
+struct kmem_cache_cpu {
+	unsigned		nr;
+	void			*objs[KMEM_MAG_SIZE];
+
+	u64			nr_alloc;
+	u64			nr_free;
+};
+
+struct kmem_cache {
+	struct list_head	list;
+	const char		*name;
+	size_t			obj_size;
+	size_t			align;
+	void			(*ctor)(void *);
+
+	struct kmem_cache_cpu __percpu *cpu;
+
+	struct mutex		lock;
+	void			*depot;
+	unsigned		depot_nr;
+	unsigned		depot_max;
+
+	atomic_long_t		nr_objs;
+};
+
+static LIST_HEAD(slab_caches);
+static DEFINE_MUTEX(slab_lock);
+static struct shrinker slab_shrinker;
+static bool slab_shrinker_registered;
+
+/* Free objects in the depot are linked through their first word: */
+static void depot_free_list(void *p)
+{
+	while (p) {
+		void *next = *((void **) p);
+
+		free(p);
+		p = next;
+	}
+}
+
+static void kmem_cache_refill(struct kmem_cache *s, struct kmem_cache_cpu *c)
+{
+	mutex_lock(&s->lock);
+	while (s->depot && c->nr < KMEM_MAG_BATCH) {
+		void *p = s->depot;
+
+		s->depot = *((void **) p);
+		s->depot_nr--;
+		c->objs[c->nr++] = p;
+	}
+	mutex_unlock(&s->lock);
+}
+
+static void kmem_cache_flush(struct kmem_cache *s, struct kmem_cache_cpu *c,
+			     unsigned nr)
+{
+	void *to_free = NULL;
+
+	mutex_lock(&s->lock);
+	while (nr--) {
+		void *p = c->objs[--c->nr];
+
+		if (s->depot_nr < s->depot_max) {
+			*((void **) p) = s->depot;
+			s->depot = p;
+			s->depot_nr++;
+		} else {
+			*((void **) p) = to_free;
+			to_free = p;
+		}
+	}
+	mutex_unlock(&s->lock);
+
+	depot_free_list(to_free);
+}
+
+static void *kmem_cache_alloc_new(struct kmem_cache *s, gfp_t gfp)
+{
+	unsigned i = 0;
+	void *p;
+
+	do {
+		run_shrinkers(gfp, i != 0);
+
+		if (posix_memalign(&p, s->align, s->obj_size))
+			p = NULL;
+	} while (!p && i++ < 10);
+
+	if (p) {
+		atomic_long_inc(&s->nr_objs);
+		if (s->ctor)
+			s->ctor(p);
+	}
+	return p;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t gfp)
+{
+	struct kmem_cache_cpu *c;
+	void *p = NULL;
+
+	preempt_disable();
+	c = this_cpu_ptr(s->cpu);
+	if (!c->nr)
+		kmem_cache_refill(s, c);
+	if (c->nr) {
+		p = c->objs[--c->nr];
+		c->nr_alloc++;
+	}
+	preempt_enable();
+
+	if (!p) {
+		p = kmem_cache_alloc_new(s, gfp);
+		if (!p)
+			return NULL;
+		this_cpu_inc(s->cpu->nr_alloc);
+	}
+
+	if (gfp & __GFP_ZERO)
+		memset(p, 0, s->obj_size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *s, void *p)
+{
+	struct kmem_cache_cpu *c;
+
+	if (!p)
+		return;
+
+	preempt_disable();
+	c = this_cpu_ptr(s->cpu);
+	if (c->nr == KMEM_MAG_SIZE)
+		kmem_cache_flush(s, c, KMEM_MAG_BATCH);
+	c->objs[c->nr++] = p;
+	c->nr_free++;
+	preempt_enable();
+}
+
+static unsigned long kmem_cache_depot_shrink(struct kmem_cache *s)
+{
+	void *p;
+	unsigned nr;
+
+	mutex_lock(&s->lock);
+	p = s->depot;
+	nr = s->depot_nr;
+	s->depot = NULL;
+	s->depot_nr = 0;
+	mutex_unlock(&s->lock);
+
+	depot_free_list(p);
+	atomic_long_sub(nr, &s->nr_objs);
+	return nr;
+}
+
+int kmem_cache_shrink(struct kmem_cache *s)
+{
+	kmem_cache_depot_shrink(s);
+	return 0;
+}
+
+static unsigned long slab_shrinker_count(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct kmem_cache *s;
+	unsigned long nr = 0;
+
+	mutex_lock(&slab_lock);
+	list_for_each_entry(s, &slab_caches, list)
+		nr += READ_ONCE(s->depot_nr);
+	mutex_unlock(&slab_lock);
+
+	return nr;
+}
+
+static unsigned long slab_shrinker_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct kmem_cache *s;
+	unsigned long freed = 0;
+
+	mutex_lock(&slab_lock);
+	list_for_each_entry(s, &slab_caches, list)
+		freed += kmem_cache_depot_shrink(s);
+	mutex_unlock(&slab_lock);
+
+	return freed;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *s = kzalloc(sizeof(*s), GFP_KERNEL);
+	bool register_shrinker_now;
+
+	if (!s)
+		return NULL;
+
+	s->cpu = alloc_percpu(struct kmem_cache_cpu);
+	if (!s->cpu) {
+		kfree(s);
+		return NULL;
+	}
+
+	/* Freed objects have to be able to hold the depot freelist link: */
+	s->obj_size	= max(size, sizeof(void *));
+	s->align	= max(align, sizeof(void *));
+	if (flags & SLAB_HWCACHE_ALIGN)
+		s->align = max_t(size_t, s->align, SMP_CACHE_BYTES);
+	s->name		= name;
+	s->ctor		= ctor;
+	s->depot_max	= max(KMEM_DEPOT_MAX_BYTES / s->obj_size,
+			      (unsigned long) KMEM_MAG_SIZE);
+	mutex_init(&s->lock);
+
+	mutex_lock(&slab_lock);
+	list_add_tail(&s->list, &slab_caches);
+	register_shrinker_now = !slab_shrinker_registered;
+	slab_shrinker_registered = true;
+	mutex_unlock(&slab_lock);
+
+	/*
+	 * Not under slab_lock, since the shrinker is called with the shrinker
+	 * lock held and takes slab_lock:
+	 */
+	if (register_shrinker_now) {
+		slab_shrinker.count_objects	= slab_shrinker_count;
+		slab_shrinker.scan_objects	= slab_shrinker_scan;
+		slab_shrinker.seeks		= 1;
+		register_shrinker(&slab_shrinker, "slab");
+	}
+
+	return s;
+}
+
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+	unsigned cpu;
+
+	if (!s)
+		return;
+
+	mutex_lock(&slab_lock);
+	list_del(&s->list);
+	mutex_unlock(&slab_lock);
+
+	for_each_possible_cpu(cpu) {
+		struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu, cpu);
+
+		while (c->nr)
+			free(c->objs[--c->nr]);
+	}
+
+	depot_free_list(s->depot);
+	free_percpu(s->cpu);
+	kfree(s);
+}
+
+void slabinfo_to_text(struct printbuf *out)
+{
+	struct kmem_cache *s;
+	unsigned cpu;
+
+	prt_printf(out, "%-24s %10s %10s %8s %14s %14s\n",
+		   "name", "objs", "free", "objsize", "allocs", "frees");
+
+	mutex_lock(&slab_lock);
+	list_for_each_entry(s, &slab_caches, list) {
+		u64 nr_alloc = 0, nr_free = 0;
+		unsigned long nr_cached = READ_ONCE(s->depot_nr);
+
+		for_each_possible_cpu(cpu) {
+			struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu, cpu);
+
+			nr_cached	+= READ_ONCE(c->nr);
+			nr_alloc	+= READ_ONCE(c->nr_alloc);
+			nr_free		+= READ_ONCE(c->nr_free);
+		}
+
+		prt_printf(out, "%-24s %10li %10lu %8zu %14llu %14llu\n",
+			   s->name, atomic_long_read(&s->nr_objs), nr_cached,
+			   s->obj_size, nr_alloc, nr_free);
+	}
+	mutex_unlock(&slab_lock);
+}
@@ -62,6 +62,23 @@ size_t strlcpy(char *dest, const char *src, size_t size)
 	return ret;
 }
 
+ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+	size_t len = strnlen(src, count);
+
+	if (!count)
+		return -E2BIG;
+
+	if (len == count) {
+		memcpy(dest, src, count - 1);
+		dest[count - 1] = '\0';
+		return -E2BIG;
+	}
+
+	memcpy(dest, src, len + 1);
+	return len;
+}
+
 void memzero_explicit(void *s, size_t count)
 {
 	memset(s, 0, count);
@@ -3,8 +3,12 @@
 #include <signal.h>
 #include <time.h>
 
+#include <linux/bitmap.h>
+#include <linux/cpumask.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/list.h>
 #include <linux/timer.h>
 
 /**
@@ -23,307 +27,425 @@ static struct timespec timespec_add_ns(struct timespec a, u64 ns)
 	return a;
 }
 
-#define DECLARE_HEAP(type)						\
-struct {								\
-	size_t size, used;						\
-	type *data;							\
-}
+/*
+ * Timer wheel, as in kernel/time/timer.c:
+ *
+ * Timers are hashed into LVL_DEPTH levels of LVL_SIZE buckets, by how far in
+ * the future they expire; each level's buckets have LVL_CLK_DIV times the
+ * granularity of the previous level. Timers are never cascaded down levels -
+ * instead, far out timers expire late by up to 1/LVL_CLK_DIV of their timeout.
+ * mod_timer() and del_timer() are O(1), and cancelling a timer doesn't update
+ * next_expiry: the timer thread just recomputes it if it wakes up early.
+ *
+ * Timers are sharded by address across several independent bases, each with
+ * its own lock and thread, started on first use.
+ */
 
-#define heap_init(heap, _size)						\
-({									\
-	size_t _bytes;							\
-	(heap)->used = 0;						\
-	(heap)->size = (_size);						\
-	_bytes = (heap)->size * sizeof(*(heap)->data);			\
-	(heap)->data = malloc(_bytes);					\
-	(heap)->data;							\
-})
-
-#define heap_free(heap)							\
-do {									\
-	kvfree((heap)->data);						\
-	(heap)->data = NULL;						\
-} while (0)
-
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
-
-#define heap_sift(h, i, cmp)						\
-do {									\
-	size_t _r, _j = i;						\
-									\
-	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
-		_r = _j * 2 + 1;					\
-		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
-			_r++;						\
-									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
-			break;						\
-		heap_swap(h, _r, _j);					\
-	}								\
-} while (0)
-
-#define heap_sift_down(h, i, cmp)					\
-do {									\
-	while (i) {							\
-		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
-			break;						\
-		heap_swap(h, i, p);					\
-		i = p;							\
-	}								\
-} while (0)
-
-#define heap_add(h, d, cmp)						\
-({									\
-	bool _r = !heap_full(h);					\
-	if (_r) {							\
-		size_t _i = (h)->used++;				\
-		(h)->data[_i] = d;					\
-									\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_del(h, i, cmp)						\
-do {									\
-	size_t _i = (i);						\
-									\
-	BUG_ON(_i >= (h)->used);					\
-	(h)->used--;							\
-	if ((_i) < (h)->used) {						\
-		heap_swap(h, _i, (h)->used);				\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-} while (0)
-
-#define heap_pop(h, d, cmp)						\
-({									\
-	bool _r = (h)->used;						\
-	if (_r) {							\
-		(d) = (h)->data[0];					\
-		heap_del(h, 0, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_peek(h)	((h)->used ? &(h)->data[0] : NULL)
-#define heap_full(h)	((h)->used == (h)->size)
-#define heap_empty(h)	((h)->used == 0)
-
-#define heap_resort(heap, cmp)						\
-do {									\
-	ssize_t _i;							\
-	for (_i = (ssize_t) (heap)->used / 2 -  1; _i >= 0; --_i)	\
-		heap_sift(heap, _i, cmp);				\
-} while (0)
-
-struct pending_timer {
-	struct timer_list	*timer;
-	unsigned long		expires;
-};
-
-static inline bool pending_timer_cmp(struct pending_timer a,
-				     struct pending_timer b)
-{
-	return a.expires < b.expires;
-}
+#define LVL_CLK_SHIFT	3
+#define LVL_CLK_DIV	(1UL << LVL_CLK_SHIFT)
+#define LVL_CLK_MASK	(LVL_CLK_DIV - 1)
+#define LVL_SHIFT(n)	((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)	(1UL << LVL_SHIFT(n))
+#define LVL_START(n)	((LVL_SIZE - 1) << (((n) - 1) * LVL_CLK_SHIFT))
+
+#define LVL_BITS	6
+#define LVL_SIZE	(1UL << LVL_BITS)
+#define LVL_MASK	(LVL_SIZE - 1)
+#define LVL_OFFS(n)	((n) * LVL_SIZE)
+
+#define LVL_DEPTH	9
+#define WHEEL_SIZE	(LVL_SIZE * LVL_DEPTH)
+
+#define WHEEL_TIMEOUT_CUTOFF	(LVL_START(LVL_DEPTH))
+#define WHEEL_TIMEOUT_MAX	(WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(LVL_DEPTH - 1))
+#define NEXT_TIMER_MAX_DELTA	((1UL << 30) - 1)
+
+#define TIMER_BASES_MAX	16
+
+struct timer_base {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_cond_t		running_cond;
+
+	struct task_struct	*task;
+	bool			stop;
+
+	struct timer_list	*running_timer;
+	unsigned long		running_seq;
 
-static DECLARE_HEAP(struct pending_timer) pending_timers;
+	unsigned long		clk;
+	unsigned long		next_expiry;
+	bool			timers_pending;
 
-static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t	timer_running_cond = PTHREAD_COND_INITIALIZER;
-static unsigned long	timer_seq;
+	DECLARE_BITMAP(pending_map, WHEEL_SIZE);
+	struct list_head	vectors[WHEEL_SIZE];
+} ____cacheline_aligned;
 
-static inline bool timer_running(void)
+static struct timer_base timer_bases[TIMER_BASES_MAX];
+static unsigned nr_timer_bases = 1;
+
+static struct timer_base *timer_base(struct timer_list *timer)
 {
-	return timer_seq & 1;
+	return timer_bases + hash_ptr(timer, 32) % nr_timer_bases;
 }
 
-static ssize_t timer_idx(struct timer_list *timer)
+static inline unsigned calc_index(unsigned long expires, unsigned lvl,
+				  unsigned long *bucket_expiry)
 {
-	size_t i;
-
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
-
-	return -1;
+	/*
+	 * Round up, so that timers never expire early - and since the current
+	 * bucket's been (or is being) processed, level 0 timers go in the next
+	 * bucket:
+	 */
+	expires = (expires >> LVL_SHIFT(lvl)) + 1;
+	*bucket_expiry = expires << LVL_SHIFT(lvl);
+	return LVL_OFFS(lvl) + (expires & LVL_MASK);
 }
 
-int del_timer(struct timer_list *timer)
+static unsigned calc_wheel_index(unsigned long expires, unsigned long clk,
+				 unsigned long *bucket_expiry)
 {
-	ssize_t idx;
+	unsigned long delta = expires - clk;
+	unsigned lvl;
 
-	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
+	if ((long) delta < 0) {
+		*bucket_expiry = clk;
+		return clk & LVL_MASK;
+	}
 
-	timer->pending = false;
-	pthread_mutex_unlock(&timer_lock);
+	if (delta >= WHEEL_TIMEOUT_CUTOFF)
+		expires = clk + WHEEL_TIMEOUT_MAX;
+
+	for (lvl = 0; lvl < LVL_DEPTH - 1; lvl++)
+		if (delta < LVL_START(lvl + 1))
+			break;
 
-	return idx >= 0;
+	return calc_index(expires, lvl, bucket_expiry);
 }
 
-void flush_timers(void)
+/* If the base has been idle, bring its clock up to date: */
+static void forward_timer_base(struct timer_base *base)
 {
-	unsigned long seq;
+	unsigned long now = jiffies;
 
-	pthread_mutex_lock(&timer_lock);
-	seq = timer_seq;
-	while (timer_running() && seq == timer_seq)
-		pthread_cond_wait(&timer_running_cond, &timer_lock);
+	if ((long) (now - base->clk) < 1)
+		return;
 
-	pthread_mutex_unlock(&timer_lock);
+	if (time_after(base->next_expiry, now))
+		base->clk = now;
+	else if (time_after(base->next_expiry, base->clk))
+		base->clk = base->next_expiry;
 }
 
-int del_timer_sync(struct timer_list *timer)
+static void detach_timer(struct timer_base *base, struct timer_list *timer)
 {
-	unsigned long seq;
-	ssize_t idx;
-
-	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
-
+	list_del(&timer->entry);
+	if (list_empty(base->vectors + timer->idx))
+		__clear_bit(timer->idx, base->pending_map);
 	timer->pending = false;
+}
 
-	seq = timer_seq;
-	while (timer_running() && seq == timer_seq)
-		pthread_cond_wait(&timer_running_cond, &timer_lock);
-	pthread_mutex_unlock(&timer_lock);
-
-	return idx >= 0;
+static void enqueue_timer(struct timer_base *base, struct timer_list *timer,
+			  unsigned idx, unsigned long bucket_expiry)
+{
+	list_add_tail(&timer->entry, base->vectors + idx);
+	__set_bit(idx, base->pending_map);
+	timer->idx	= idx;
+	timer->pending	= true;
+
+	if (!base->timers_pending ||
+	    time_before(bucket_expiry, base->next_expiry)) {
+		base->next_expiry	= bucket_expiry;
+		base->timers_pending	= true;
+		pthread_cond_signal(&base->cond);
+	}
 }
 
-int mod_timer(struct timer_list *timer, unsigned long expires)
+static int next_pending_bucket(struct timer_base *base, unsigned offset,
+			       unsigned clk)
 {
-	ssize_t idx;
+	unsigned pos, start = offset + clk;
+	unsigned end = offset + LVL_SIZE;
 
-	pthread_mutex_lock(&timer_lock);
-	timer->expires = expires;
-	timer->pending = true;
-	idx = timer_idx(timer);
+	pos = find_next_bit(base->pending_map, end, start);
+	if (pos < end)
+		return pos - start;
 
-	if (idx >= 0 &&
-	    pending_timers.data[idx].expires == expires)
-		goto out;
+	pos = find_next_bit(base->pending_map, start, offset);
+	return pos < start ? pos + LVL_SIZE - start : -1;
+}
+
+static unsigned long next_timer_interrupt(struct timer_base *base)
+{
+	unsigned long clk, next, adj;
+	unsigned lvl, offset = 0;
+
+	next = base->clk + NEXT_TIMER_MAX_DELTA;
+	clk = base->clk;
+	for (lvl = 0; lvl < LVL_DEPTH; lvl++, offset += LVL_SIZE) {
+		int pos = next_pending_bucket(base, offset, clk & LVL_MASK);
+		unsigned long lvl_clk = clk & LVL_CLK_MASK;
+
+		if (pos >= 0) {
+			unsigned long tmp = clk + (unsigned long) pos;
+
+			tmp <<= LVL_SHIFT(lvl);
+			if (time_before(tmp, next))
+				next = tmp;
+
+			/*
+			 * If the next expiration happens before we reach the
+			 * next level, no need to check further:
+			 */
+			if (pos <= ((LVL_CLK_DIV - lvl_clk) & LVL_CLK_MASK))
+				break;
+		}
 
-	if (idx >= 0) {
-		pending_timers.data[idx].expires = expires;
+		/*
+		 * The next level's clock is rounded up if this level's clock
+		 * isn't a multiple of LVL_CLK_DIV, since its current bucket
+		 * has already been collected:
+		 */
+		adj = lvl_clk ? 1 : 0;
+		clk >>= LVL_CLK_SHIFT;
+		clk += adj;
+	}
 
-		heap_sift_down(&pending_timers, idx, pending_timer_cmp);
-		heap_sift(&pending_timers, idx, pending_timer_cmp);
-	} else {
-		if (heap_full(&pending_timers)) {
-			pending_timers.size *= 2;
-			pending_timers.data =
-				realloc(pending_timers.data,
-					pending_timers.size *
-					sizeof(struct pending_timer));
+	base->timers_pending = next != base->clk + NEXT_TIMER_MAX_DELTA;
+	return next;
+}
 
-			BUG_ON(!pending_timers.data);
+static unsigned collect_expired_timers(struct timer_base *base,
+				       struct list_head *heads)
+{
+	unsigned long clk = base->clk;
+	unsigned i, idx, levels = 0;
+
+	for (i = 0; i < LVL_DEPTH; i++) {
+		idx = (clk & LVL_MASK) + i * LVL_SIZE;
+
+		if (__test_and_clear_bit(idx, base->pending_map)) {
+			INIT_LIST_HEAD(heads);
+			list_splice(base->vectors + idx, heads);
+			INIT_LIST_HEAD(base->vectors + idx);
+			heads++;
+			levels++;
 		}
 
-		heap_add(&pending_timers,
-			 ((struct pending_timer) {
-				.timer = timer,
-				.expires = expires,
-			 }),
-			 pending_timer_cmp);
+		/* Is it time to look at the next level? */
+		if (clk & LVL_CLK_MASK)
+			break;
+		clk >>= LVL_CLK_SHIFT;
 	}
 
-	pthread_cond_signal(&timer_cond);
-out:
-	pthread_mutex_unlock(&timer_lock);
-
-	return idx >= 0;
+	return levels;
 }
 
-static bool timer_thread_stop = false;
+static void expire_timers(struct timer_base *base, struct list_head *head)
+{
+	while (!list_empty(head)) {
+		struct timer_list *timer =
+			list_first_entry(head, struct timer_list, entry);
+
+		list_del(&timer->entry);
+		timer->pending = false;
+		base->running_timer = timer;
+
+		pthread_mutex_unlock(&base->lock);
+		timer->function(timer);
+		pthread_mutex_lock(&base->lock);
+
+		base->running_timer = NULL;
+		base->running_seq++;
+		pthread_cond_broadcast(&base->running_cond);
+	}
+}
 
 static int timer_thread(void *arg)
 {
-	struct pending_timer *p;
+	struct timer_base *base = arg;
+	struct list_head heads[LVL_DEPTH];
 	struct timespec ts;
 	unsigned long now;
+	unsigned levels;
 	int ret;
 
-	pthread_mutex_lock(&timer_lock);
+	pthread_mutex_lock(&base->lock);
 
-	while (!timer_thread_stop) {
+	while (!base->stop) {
 		now = jiffies;
-		p = heap_peek(&pending_timers);
 
-		if (!p) {
-			pthread_cond_wait(&timer_cond, &timer_lock);
+		if (!base->timers_pending) {
+			pthread_cond_wait(&base->cond, &base->lock);
 			continue;
 		}
 
-		if (time_after_eq(now, p->expires)) {
-			struct timer_list *timer = p->timer;
+		if (time_before(now, base->next_expiry)) {
+			ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+			BUG_ON(ret);
 
-			heap_del(&pending_timers, 0, pending_timer_cmp);
-			BUG_ON(!timer_pending(timer));
-			timer->pending = false;
+			ts = timespec_add_ns(ts,
+				jiffies_to_nsecs(base->next_expiry - now));
 
-			timer_seq++;
-			BUG_ON(!timer_running());
-
-			pthread_mutex_unlock(&timer_lock);
-			timer->function(timer);
-			pthread_mutex_lock(&timer_lock);
-
-			timer_seq++;
-			pthread_cond_broadcast(&timer_running_cond);
+			pthread_cond_timedwait(&base->cond, &base->lock, &ts);
 			continue;
 		}
 
+		/* Nothing is pending before next_expiry, skip ahead: */
+		if (time_after(base->next_expiry, base->clk))
+			base->clk = base->next_expiry;
 
-		ret = clock_gettime(CLOCK_REALTIME, &ts);
-		BUG_ON(ret);
-
-		ts = timespec_add_ns(ts, jiffies_to_nsecs(p->expires - now));
+		levels = collect_expired_timers(base, heads);
+		base->clk++;
+		base->next_expiry = next_timer_interrupt(base);
 
-		pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+		while (levels--)
+			expire_timers(base, heads + levels);
 	}
 
-	pthread_mutex_unlock(&timer_lock);
+	pthread_mutex_unlock(&base->lock);
 
 	return 0;
 }
 
-struct task_struct *timer_task;
+/* Called with base->lock held: */
+static void timer_base_start(struct timer_base *base)
+{
+	struct task_struct *p;
+
+	if (likely(base->task))
+		return;
+
+	base->clk = base->next_expiry = jiffies;
+
+	p = kthread_run(timer_thread, base, "timers/%zu", base - timer_bases);
+	BUG_ON(IS_ERR(p));
+	base->task = p;
+}
+
+int del_timer(struct timer_list *timer)
+{
+	struct timer_base *base = timer_base(timer);
+	int ret;
+
+	pthread_mutex_lock(&base->lock);
+	ret = timer->pending;
+	if (ret)
+		detach_timer(base, timer);
+	pthread_mutex_unlock(&base->lock);
+
+	return ret;
+}
+
+void flush_timers(void)
+{
+	struct timer_base *base;
+	unsigned long seq;
+
+	for (base = timer_bases; base < timer_bases + nr_timer_bases; base++) {
+		pthread_mutex_lock(&base->lock);
+		seq = base->running_seq;
+		while (base->running_timer && seq == base->running_seq)
+			pthread_cond_wait(&base->running_cond, &base->lock);
+		pthread_mutex_unlock(&base->lock);
+	}
+}
+
+int del_timer_sync(struct timer_list *timer)
+{
+	struct timer_base *base = timer_base(timer);
+	int ret;
+
+	pthread_mutex_lock(&base->lock);
+	/*
+	 * Wait for the callback before detaching, so that it can't rearm the
+	 * timer after we return:
+	 */
+	while (base->running_timer == timer)
+		pthread_cond_wait(&base->running_cond, &base->lock);
+
+	ret = timer->pending;
+	if (ret)
+		detach_timer(base, timer);
+	pthread_mutex_unlock(&base->lock);
+
+	return ret;
+}
+
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	struct timer_base *base = timer_base(timer);
+	unsigned long bucket_expiry;
+	unsigned idx;
+	int ret;
+
+	pthread_mutex_lock(&base->lock);
+	ret = timer->pending;
+
+	if (ret && timer->expires == expires)
+		goto out;
+
+	timer_base_start(base);
+	forward_timer_base(base);
+
+	idx = calc_wheel_index(expires, base->clk, &bucket_expiry);
+	timer->expires = expires;
+
+	/* Still in the same bucket? Then we're done: */
+	if (ret && idx == timer->idx)
+		goto out;
+
+	if (ret)
+		detach_timer(base, timer);
+	enqueue_timer(base, timer, idx, bucket_expiry);
+out:
+	pthread_mutex_unlock(&base->lock);
+
+	return ret;
+}
 
 __attribute__((constructor(103)))
 static void timers_init(void)
 {
-	heap_init(&pending_timers, 64);
-	BUG_ON(!pending_timers.data);
+	struct timer_base *base;
+	pthread_condattr_t attr;
+	unsigned i;
+
+	nr_timer_bases = clamp_t(unsigned, nr_cpu_ids, 1, TIMER_BASES_MAX);
 
-	timer_task = kthread_run(timer_thread, NULL, "timers");
-	BUG_ON(IS_ERR(timer_task));
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	for (base = timer_bases; base < timer_bases + nr_timer_bases; base++) {
+		pthread_mutex_init(&base->lock, NULL);
+		pthread_cond_init(&base->cond, &attr);
+		pthread_cond_init(&base->running_cond, NULL);
+
+		for (i = 0; i < WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(base->vectors + i);
+	}
+
+	pthread_condattr_destroy(&attr);
 }
 
 __attribute__((destructor(103)))
 static void timers_cleanup(void)
 {
-	get_task_struct(timer_task);
+	struct timer_base *base;
 
-	pthread_mutex_lock(&timer_lock);
-	timer_thread_stop = true;
-	pthread_cond_signal(&timer_cond);
-	pthread_mutex_unlock(&timer_lock);
+	for (base = timer_bases; base < timer_bases + nr_timer_bases; base++) {
+		struct task_struct *p;
 
-	int ret = kthread_stop(timer_task);
-	BUG_ON(ret);
+		pthread_mutex_lock(&base->lock);
+		p = base->task;
+		base->stop = true;
+		pthread_cond_signal(&base->cond);
+		pthread_mutex_unlock(&base->lock);
 
-	put_task_struct(timer_task);
-	timer_task = NULL;
+		if (p) {
+			get_task_struct(p);
+			BUG_ON(kthread_stop(p));
+			put_task_struct(p);
+		}
+	}
 }
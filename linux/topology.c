@@ -0,0 +1,106 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/topology.h>
+
+#define NODE_SYSFS	"/sys/devices/system/node"
+
+static unsigned		nr_node_ids;
+static int		*cpu_node;
+static cpu_set_t	*node_cpus;
+static pthread_once_t	topology_once = PTHREAD_ONCE_INIT;
+
+/* Parse a sysfs cpulist, e.g. "0-3,8-11": */
+static void cpulist_parse(FILE *f, cpu_set_t *set)
+{
+	unsigned start, end;
+	int c;
+
+	CPU_ZERO(set);
+
+	while (fscanf(f, "%u", &start) == 1) {
+		end = start;
+		if ((c = fgetc(f)) == '-') {
+			if (fscanf(f, "%u", &end) != 1)
+				break;
+			c = fgetc(f);
+		}
+
+		for (; start <= end && start < CPU_SETSIZE; start++)
+			CPU_SET(start, set);
+
+		if (c != ',')
+			break;
+	}
+}
+
+static void topology_init(void)
+{
+	unsigned cpu, node, nr = 0;
+	struct dirent *d;
+	DIR *dir;
+
+	cpu_node = calloc(nr_cpu_ids, sizeof(*cpu_node));
+	BUG_ON(!cpu_node);
+
+	dir = opendir(NODE_SYSFS);
+	while (dir && (d = readdir(dir)))
+		if (sscanf(d->d_name, "node%u", &node) == 1)
+			nr = max(nr, node + 1);
+
+	nr_node_ids = max(nr, 1U);
+	node_cpus = calloc(nr_node_ids, sizeof(*node_cpus));
+	BUG_ON(!node_cpus);
+
+	for (node = 0; dir && node < nr_node_ids; node++) {
+		char path[64];
+		FILE *f;
+
+		snprintf(path, sizeof(path), NODE_SYSFS "/node%u/cpulist", node);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		cpulist_parse(f, &node_cpus[node]);
+		fclose(f);
+
+		for (cpu = 0; cpu < nr_cpu_ids && cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &node_cpus[node]))
+				cpu_node[cpu] = node;
+	}
+
+	if (dir)
+		closedir(dir);
+}
+
+unsigned num_online_nodes(void)
+{
+	pthread_once(&topology_once, topology_init);
+
+	return nr_node_ids;
+}
+
+int cpu_to_node(unsigned cpu)
+{
+	pthread_once(&topology_once, topology_init);
+
+	return cpu < nr_cpu_ids ? cpu_node[cpu] : 0;
+}
+
+/* Bind @p to the CPUs of @node, not a cpumask because ours are stubs: */
+int set_cpus_allowed_node(struct task_struct *p, int node)
+{
+	pthread_once(&topology_once, topology_init);
+
+	if (nr_node_ids <= 1 ||
+	    node < 0 || node >= nr_node_ids ||
+	    !CPU_COUNT(&node_cpus[node]))
+		return 0;
+
+	return -pthread_setaffinity_np(p->thread, sizeof(node_cpus[node]),
+				       &node_cpus[node]);
+}
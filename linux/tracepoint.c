@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math.h>
+#include <linux/string.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Per thread ring buffers for tracepoints:
+ *
+ * Each thread writes its events into its own buffer, so tracing doesn't take
+ * locks or bounce cachelines. When a buffer is full the oldest records are
+ * dropped: head and tail are byte offsets that only increase, and the writer
+ * advances tail past whole records before overwriting them, so a reader can
+ * copy [tail, head) while the writer runs and then discard whatever tail has
+ * since moved past.
+ *
+ * Records never wrap; the space left at the end of the buffer is filled with
+ * a padding record instead.
+ *
+ * Set BCACHEFS_TRACE=file to enable tracing and write the buffers out at exit;
+ * BCACHEFS_TRACE_EVENTS=event,event,... enables only some events, and
+ * BCACHEFS_TRACE_BUF sets the size of each buffer (default 1M).
+ */
+
+struct trace_buf {
+	struct trace_buf	*next;
+	pid_t			tid;
+	unsigned		pending;
+	u64			head;
+	u64			tail;
+	u8			data[];
+};
+
+static struct trace_event	*trace_events;
+static unsigned			trace_events_nr;
+
+static size_t			trace_buf_size = 1 << 20;
+static struct trace_buf		*trace_bufs;
+static __thread struct trace_buf *trace_buf;
+
+static char			*trace_path;
+
+struct trace_event *trace_event_first(void)
+{
+	return trace_events;
+}
+
+struct trace_event *trace_event_find(const char *name)
+{
+	struct trace_event *e;
+
+	for (e = trace_events; e; e = e->next)
+		if (!strcmp(e->name, name))
+			return e;
+	return NULL;
+}
+
+/* Called from constructors, before any threads exist: */
+void trace_event_register(struct trace_event *e)
+{
+	e->id	= ++trace_events_nr;
+	e->next	= trace_events;
+	trace_events = e;
+}
+
+static noinline struct trace_buf *trace_buf_alloc(void)
+{
+	struct trace_buf *b = calloc(1, sizeof(*b) + trace_buf_size), *old;
+
+	if (!b)
+		return NULL;
+
+	b->tid = syscall(SYS_gettid);
+
+	do {
+		old = READ_ONCE(trace_bufs);
+		b->next = old;
+	} while (cmpxchg(&trace_bufs, old, b) != old);
+
+	trace_buf = b;
+	return b;
+}
+
+static inline struct trace_entry *trace_buf_entry(struct trace_buf *b, u64 pos)
+{
+	return (void *) b->data + (pos & (trace_buf_size - 1));
+}
+
+/* Drop the oldest records until there's room for @len bytes: */
+static void trace_buf_make_room(struct trace_buf *b, unsigned len)
+{
+	u64 tail = b->tail;
+
+	if (b->head + len - tail <= trace_buf_size)
+		return;
+
+	while (b->head + len - tail > trace_buf_size)
+		tail += trace_buf_entry(b, tail)->len;
+
+	WRITE_ONCE(b->tail, tail);
+	/* Readers must see the new tail before we overwrite what it covered: */
+	smp_wmb();
+}
+
+void *trace_event_reserve(struct trace_event *event, unsigned size)
+{
+	struct trace_buf *b = trace_buf ?: trace_buf_alloc();
+	unsigned len = round_up(sizeof(struct trace_entry) + size,
+				TRACE_ENTRY_ALIGN);
+	size_t pos, pad;
+	struct trace_entry *e;
+
+	if (!b || len > min_t(size_t, U16_MAX, trace_buf_size / 2))
+		return NULL;
+
+	pos = b->head & (trace_buf_size - 1);
+	pad = trace_buf_size - pos;
+
+	if (pad < len) {
+		trace_buf_make_room(b, pad);
+
+		e = trace_buf_entry(b, b->head);
+		e->event	= 0;
+		e->len		= pad;
+		smp_store_release(&b->head, b->head + pad);
+	}
+
+	trace_buf_make_room(b, len);
+
+	e = trace_buf_entry(b, b->head);
+	e->time		= local_clock();
+	e->event	= event->id;
+	e->len		= len;
+
+	b->pending = len;
+	return e + 1;
+}
+
+void trace_event_commit(void)
+{
+	struct trace_buf *b = trace_buf;
+
+	smp_store_release(&b->head, b->head + b->pending);
+}
+
+/**
+ * trace_events_enable - enable events by name
+ *
+ * @events is a comma separated list of event names, or "all".
+ */
+int trace_events_enable(const char *events)
+{
+	char *s = strdup(events), *p = s, *name;
+	struct trace_event *e;
+	int ret = 0;
+
+	if (!s)
+		return -ENOMEM;
+
+	while ((name = strsep(&p, ","))) {
+		if (!*name)
+			continue;
+
+		if (!strcmp(name, "all")) {
+			for (e = trace_events; e; e = e->next)
+				WRITE_ONCE(e->enabled, true);
+			continue;
+		}
+
+		e = trace_event_find(name);
+		if (!e) {
+			fprintf(stderr, "unknown trace event %s\n", name);
+			ret = -EINVAL;
+			continue;
+		}
+
+		WRITE_ONCE(e->enabled, true);
+	}
+
+	free(s);
+	return ret;
+}
+
+static int trace_buf_dump(FILE *f, struct trace_buf *b, void *copy)
+{
+	struct trace_file_buf hdr = { .tid = b->tid };
+	u64 head = smp_load_acquire(&b->head);
+	u64 tail = READ_ONCE(b->tail), pos, tail2;
+	size_t start;
+
+	/* Copy [tail, head) out in order, then see what was overwritten: */
+	for (pos = tail; pos < head; pos += start) {
+		size_t off = pos & (trace_buf_size - 1);
+
+		start = min_t(u64, head - pos, trace_buf_size - off);
+		memcpy(copy + (pos - tail), b->data + off, start);
+	}
+
+	smp_rmb();
+	tail2 = READ_ONCE(b->tail);
+
+	if (tail2 >= head)
+		return 0;
+
+	start = tail2 > tail ? tail2 - tail : 0;
+
+	for (pos = start; pos < head - tail;) {
+		struct trace_entry *e = copy + pos;
+
+		if (!e->len)
+			break;
+
+		if (e->event)
+			hdr.bytes += e->len;
+		pos += e->len;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		return -EIO;
+
+	for (pos = start; pos < head - tail;) {
+		struct trace_entry *e = copy + pos;
+
+		if (!e->len)
+			break;
+
+		if (e->event && fwrite(e, e->len, 1, f) != 1)
+			return -EIO;
+		pos += e->len;
+	}
+
+	return 0;
+}
+
+/**
+ * trace_dump - write every thread's trace buffer to @path
+ *
+ * Decoded by "bcachefs trace"; only meaningful to the binary that wrote it,
+ * since event layouts aren't versioned.
+ */
+int trace_dump(const char *path)
+{
+	struct trace_file_hdr hdr = {
+		.magic		= TRACE_FILE_MAGIC,
+		.version	= TRACE_FILE_VERSION,
+		.nr_events	= trace_events_nr,
+	};
+	struct trace_event *e;
+	struct trace_buf *b;
+	void *copy;
+	FILE *f;
+	int ret = 0;
+
+	copy = malloc(trace_buf_size);
+	if (!copy)
+		return -ENOMEM;
+
+	f = fopen(path, "w");
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		ret = -EIO;
+
+	for (e = trace_events; e && !ret; e = e->next) {
+		struct trace_file_event fe = {
+			.id	= e->id,
+			.size	= e->size,
+		};
+
+		strlcpy(fe.name, e->name, sizeof(fe.name));
+		if (fwrite(&fe, sizeof(fe), 1, f) != 1)
+			ret = -EIO;
+	}
+
+	for (b = READ_ONCE(trace_bufs); b && !ret; b = b->next)
+		ret = trace_buf_dump(f, b, copy);
+
+	if (fclose(f) && !ret)
+		ret = -errno;
+out:
+	free(copy);
+	return ret;
+}
+
+static void trace_exit(void)
+{
+	int ret = trace_dump(trace_path);
+
+	if (ret)
+		fprintf(stderr, "error writing trace to %s: %s\n",
+			trace_path, strerror(-ret));
+}
+
+/* After the events have registered themselves: */
+__attribute__((constructor(111)))
+static void trace_init(void)
+{
+	const char *size = getenv("BCACHEFS_TRACE_BUF");
+	const char *events = getenv("BCACHEFS_TRACE_EVENTS");
+
+	trace_path = getenv("BCACHEFS_TRACE");
+	if (!trace_path || !*trace_path)
+		return;
+
+	if (size) {
+		char *end;
+		unsigned long v = strtoul(size, &end, 0);
+
+		switch (*end) {
+		case 'k': case 'K':
+			v <<= 10;
+			break;
+		case 'm': case 'M':
+			v <<= 20;
+			break;
+		}
+
+		trace_buf_size = roundup_pow_of_two(max(v, 64UL << 10));
+	}
+
+	trace_events_enable(events ?: "all");
+	atexit(trace_exit);
+}
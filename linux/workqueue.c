@@ -1,21 +1,56 @@
 #include <pthread.h>
 
+#include <linux/cpumask.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
 #include <linux/workqueue.h>
 
+/*
+ * Each workqueue has its own lock, and a pool of workers with its own pending
+ * list per NUMA node; workers are started on demand, up to a limit derived
+ * from max_active, and bound to their node's CPUs. Work is queued on the
+ * node it was queued from, and idle workers take work from other nodes before
+ * going to sleep. Ordered workqueues, and those with fewer workers than nodes,
+ * have a single unbound pool.
+ *
+ * Like the kernel, a given work item never runs concurrently with itself on
+ * the same workqueue.
+ */
+
 static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	work_finished = PTHREAD_COND_INITIALIZER;
 static LIST_HEAD(wq_list);
 
+struct worker_pool {
+	struct list_head	pending_work;
+	struct list_head	idle_workers;
+	unsigned		nr_workers;
+	unsigned		max_workers;
+	int			node;
+};
+
+struct worker {
+	struct list_head	list;
+	struct list_head	idle;
+	struct task_struct	*task;
+	struct workqueue_struct	*wq;
+	struct worker_pool	*pool;
+	struct work_struct	*current_work;
+};
+
 struct workqueue_struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work_finished;
+	unsigned		nr_waiters;
+
 	struct list_head	list;
 
-	struct work_struct	*current_work;
-	struct list_head	pending_work;
+	struct list_head	workers;
 
-	struct task_struct	*worker;
 	char			name[24];
+
+	unsigned		nr_pools;
+	struct worker_pool	pools[];
 };
 
 enum {
@@ -37,24 +72,118 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+static int worker_thread(void *arg);
+
+static void wq_wake_waiters(struct workqueue_struct *wq)
+{
+	if (wq->nr_waiters)
+		pthread_cond_broadcast(&wq->work_finished);
+}
+
+static void wq_wait(struct workqueue_struct *wq)
+{
+	wq->nr_waiters++;
+	pthread_cond_wait(&wq->work_finished, &wq->lock);
+	wq->nr_waiters--;
+}
+
+static int start_worker(struct workqueue_struct *wq, struct worker_pool *pool)
+{
+	/* called with wq->lock held - don't recurse into the shrinkers: */
+	struct worker *worker = kzalloc(sizeof(*worker), GFP_NOWAIT);
+	struct task_struct *task;
+
+	if (!worker)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&worker->idle);
+	worker->wq	= wq;
+	worker->pool	= pool;
+
+	task = pool->node == NUMA_NO_NODE
+		? kthread_create(worker_thread, worker, "%s/%u",
+				 wq->name, pool->nr_workers)
+		: kthread_create(worker_thread, worker, "%s/%u:%u",
+				 wq->name, pool->node, pool->nr_workers);
+	if (IS_ERR(task)) {
+		kfree(worker);
+		return PTR_ERR(task);
+	}
+
+	set_cpus_allowed_node(task, pool->node);
+
+	worker->task = task;
+	list_add_tail(&worker->list, &wq->workers);
+	pool->nr_workers++;
+
+	wake_up_process(task);
+	return 0;
+}
+
+static bool wake_idle_worker(struct worker_pool *pool)
+{
+	struct worker *worker =
+		list_first_entry_or_null(&pool->idle_workers, struct worker, idle);
+
+	if (worker) {
+		list_del_init(&worker->idle);
+		wake_up_process(worker->task);
+	}
+
+	return worker != NULL;
+}
+
+/*
+ * Wake a single idle worker, or start a new one if we're allowed to - failing
+ * that, an idle worker on another node, so that work isn't stuck behind a
+ * node's busy workers:
+ */
+static void wake_worker(struct workqueue_struct *wq, struct worker_pool *pool)
+{
+	unsigned i;
+
+	if (wake_idle_worker(pool))
+		return;
+
+	if (pool->nr_workers < pool->max_workers) {
+		start_worker(wq, pool);
+		return;
+	}
+
+	for (i = 0; i < wq->nr_pools; i++)
+		if (&wq->pools[i] != pool &&
+		    wake_idle_worker(&wq->pools[i]))
+			return;
+}
+
+static struct worker_pool *local_pool(struct workqueue_struct *wq)
+{
+	return wq->nr_pools > 1
+		? &wq->pools[numa_node_id() % wq->nr_pools]
+		: &wq->pools[0];
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
+	struct worker_pool *pool = local_pool(wq);
+
 	BUG_ON(!work_pending(work));
 	BUG_ON(!list_empty(&work->entry));
 
-	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	WRITE_ONCE(work->wq, wq);
+	list_add_tail(&work->entry, &pool->pending_work);
+	wake_worker(wq, pool);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	if ((ret = set_work_pending(work)))
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -63,10 +192,11 @@ void delayed_work_timer_fn(struct timer_list *timer)
 {
 	struct delayed_work *dwork =
 		container_of(timer, struct delayed_work, timer);
+	struct workqueue_struct *wq = dwork->wq;
 
-	pthread_mutex_lock(&wq_lock);
-	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
+	__queue_work(wq, &dwork->work);
+	pthread_mutex_unlock(&wq->lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -84,6 +214,7 @@ static void __queue_delayed_work(struct workqueue_struct *wq,
 		__queue_work(wq, &dwork->work);
 	} else {
 		dwork->wq = wq;
+		WRITE_ONCE(work->wq, wq);
 		timer->expires = jiffies + delay;
 		add_timer(timer);
 	}
@@ -96,19 +227,46 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
-static bool grab_pending(struct work_struct *work, bool is_dwork)
+/*
+ * Lock the workqueue @work was last queued on: returns NULL if it's never
+ * been queued.
+ */
+static struct workqueue_struct *work_lock_wq(struct work_struct *work)
 {
+	struct workqueue_struct *wq;
+
+	while ((wq = READ_ONCE(work->wq))) {
+		pthread_mutex_lock(&wq->lock);
+		if (READ_ONCE(work->wq) == wq)
+			break;
+		pthread_mutex_unlock(&wq->lock);
+	}
+
+	return wq;
+}
+
+/*
+ * Steal the pending bit for @work, removing it from its workqueue or timer
+ * if it was queued; returns with the workqueue @work is on locked, if any:
+ */
+static bool grab_pending(struct work_struct *work, bool is_dwork,
+			 struct workqueue_struct **wqp)
+{
+	struct workqueue_struct *wq;
 retry:
+	wq = work_lock_wq(work);
+
 	if (set_work_pending(work)) {
 		BUG_ON(!list_empty(&work->entry));
+		*wqp = wq;
 		return false;
 	}
 
@@ -117,29 +275,37 @@ retry:
 
 		if (likely(del_timer(&dwork->timer))) {
 			BUG_ON(!list_empty(&work->entry));
+			*wqp = wq;
 			return true;
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
+	if (wq && READ_ONCE(work->wq) == wq &&
+	    !list_empty(&work->entry)) {
 		list_del_init(&work->entry);
+		*wqp = wq;
 		return true;
 	}
 
-	BUG_ON(!is_dwork);
-
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/*
+	 * Either the timer is firing, or the work is in the middle of being
+	 * queued on a different workqueue:
+	 */
+	if (wq)
+		pthread_mutex_unlock(&wq->lock);
+	if (is_dwork)
+		flush_timers();
+	else
+		sched_yield();
 	goto retry;
 }
 
-static bool work_running(struct work_struct *work)
+static bool work_running(struct workqueue_struct *wq, struct work_struct *work)
 {
-	struct workqueue_struct *wq;
+	struct worker *worker;
 
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
+	list_for_each_entry(worker, &wq->workers, list)
+		if (worker->current_work == work)
 			return true;
 
 	return false;
@@ -147,40 +313,55 @@ static bool work_running(struct work_struct *work)
 
 bool flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq = work_lock_wq(work);
 	bool ret = false;
 
-	pthread_mutex_lock(&wq_lock);
-	while (work_pending(work) || work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	while ((work_pending(work) && READ_ONCE(work->wq) == wq) ||
+	       work_running(wq, work)) {
+		wq_wait(wq);
 		ret = true;
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
-static bool __flush_work(struct work_struct *work)
+static bool __flush_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret = false;
 
-	while (work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	while (work_running(wq, work)) {
+		wq_wait(wq);
 		ret = true;
 	}
 
 	return ret;
 }
 
+static void release_pending(struct workqueue_struct *wq,
+			    struct work_struct *work, bool flush)
+{
+	if (flush)
+		__flush_work(wq, work);
+	clear_work_pending(work);
+
+	if (wq)
+		pthread_mutex_unlock(&wq->lock);
+}
+
 bool cancel_work_sync(struct work_struct *work)
 {
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, false);
-
-	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	ret = grab_pending(work, false, &wq);
+	release_pending(wq, work, true);
 
 	return ret;
 }
@@ -190,13 +371,19 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 		      unsigned long delay)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *old_wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	ret = grab_pending(work, true, &old_wq);
+
+	if (old_wq != wq) {
+		if (old_wq)
+			pthread_mutex_unlock(&old_wq->lock);
+		pthread_mutex_lock(&wq->lock);
+	}
 
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -204,13 +391,11 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
-
-	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	ret = grab_pending(work, true, &wq);
+	release_pending(wq, work, false);
 
 	return ret;
 }
@@ -218,65 +403,136 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
-
-	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	ret = grab_pending(work, true, &wq);
+	release_pending(wq, work, true);
 
 	return ret;
 }
 
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	struct worker *worker;
+	unsigned i;
+	bool busy;
+
+	pthread_mutex_lock(&wq->lock);
+	do {
+		busy = false;
+		for (i = 0; i < wq->nr_pools; i++)
+			busy |= !list_empty(&wq->pools[i].pending_work);
+
+		list_for_each_entry(worker, &wq->workers, list)
+			busy |= worker->current_work != NULL;
+
+		if (busy)
+			wq_wait(wq);
+	} while (busy);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * Find the first pending work item that isn't already running on another
+ * worker - work items must not run concurrently with themselves; look at our
+ * own node first:
+ */
+static struct work_struct *pool_next_work(struct workqueue_struct *wq,
+					  struct worker_pool *pool)
+{
+	struct work_struct *work;
+
+	list_for_each_entry(work, &pool->pending_work, entry)
+		if (!work_running(wq, work))
+			return work;
+
+	return NULL;
+}
+
+static struct work_struct *next_work(struct workqueue_struct *wq,
+				     struct worker_pool *pool)
+{
+	struct work_struct *work = pool_next_work(wq, pool);
+	unsigned i;
+
+	for (i = 0; !work && i < wq->nr_pools; i++)
+		if (&wq->pools[i] != pool)
+			work = pool_next_work(wq, &wq->pools[i]);
+
+	return work;
+}
+
+static bool pool_has_work(struct worker_pool *pool)
+{
+	return !list_empty(&pool->pending_work);
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
+	struct worker_pool *pool = worker->pool;
 	struct work_struct *work;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+		work = next_work(wq, pool);
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(work);
 			break;
 		}
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
+			list_add(&worker->idle, &pool->idle_workers);
+			pthread_mutex_unlock(&wq->lock);
 			schedule();
-			pthread_mutex_lock(&wq_lock);
+			pthread_mutex_lock(&wq->lock);
+			list_del_init(&worker->idle);
 			continue;
 		}
 
+		__set_current_state(TASK_RUNNING);
+
 		BUG_ON(!work_pending(work));
 		list_del_init(&work->entry);
 		clear_work_pending(work);
+		worker->current_work = work;
 
-		pthread_mutex_unlock(&wq_lock);
+		/* more work than we can handle? */
+		if (pool_has_work(pool))
+			wake_worker(wq, pool);
+
+		pthread_mutex_unlock(&wq->lock);
 		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_lock(&wq->lock);
 
-		pthread_cond_broadcast(&work_finished);
+		worker->current_work = NULL;
+		wq_wake_waiters(wq);
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return 0;
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	struct worker *worker, *n;
 
 	pthread_mutex_lock(&wq_lock);
 	list_del(&wq->list);
 	pthread_mutex_unlock(&wq_lock);
 
+	/* Workers are only started with wq->lock held, so this is stable: */
+	list_for_each_entry_safe(worker, n, &wq->workers, list) {
+		kthread_stop(worker->task);
+		kfree(worker);
+	}
+
+	pthread_cond_destroy(&wq->work_finished);
+	pthread_mutex_destroy(&wq->lock);
 	kfree(wq);
 }
 
@@ -285,25 +541,57 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 					 int max_active,
 					 ...)
 {
+	unsigned nr_cpus = num_possible_cpus();
+	unsigned nr_nodes = num_online_nodes();
+	unsigned i, nr_pools, max_workers;
 	va_list args;
 	struct workqueue_struct *wq;
 
-	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
+	/*
+	 * As in the kernel, max_active is per cpu for bound workqueues; cap the
+	 * number of threads at what unbound workqueues would get:
+	 */
+	if (!max_active)
+		max_active = WQ_DFL_ACTIVE;
+	if (!(flags & WQ_UNBOUND))
+		max_active *= nr_cpus;
+
+	max_workers = flags & __WQ_ORDERED
+		? 1
+		: clamp_t(unsigned, max_active, 1,
+			  nr_cpus * WQ_MAX_UNBOUND_PER_CPU);
+	nr_pools = max_workers >= nr_nodes ? nr_nodes : 1;
+
+	wq = kzalloc(struct_size(wq, pools, nr_pools), GFP_KERNEL);
 	if (!wq)
 		return NULL;
 
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->work_finished, NULL);
 	INIT_LIST_HEAD(&wq->list);
-	INIT_LIST_HEAD(&wq->pending_work);
+	INIT_LIST_HEAD(&wq->workers);
+
+	wq->nr_pools = nr_pools;
+	for (i = 0; i < nr_pools; i++) {
+		struct worker_pool *pool = &wq->pools[i];
+
+		INIT_LIST_HEAD(&pool->pending_work);
+		INIT_LIST_HEAD(&pool->idle_workers);
+		pool->max_workers	= DIV_ROUND_UP(max_workers, nr_pools);
+		pool->node		= nr_pools > 1 ? i : NUMA_NO_NODE;
+	}
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
+	pthread_mutex_lock(&wq->lock);
+	if (start_worker(wq, local_pool(wq))) {
+		pthread_mutex_unlock(&wq->lock);
 		kfree(wq);
 		return NULL;
 	}
+	pthread_mutex_unlock(&wq->lock);
 
 	pthread_mutex_lock(&wq_lock);
 	list_add(&wq->list, &wq_list);
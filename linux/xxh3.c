@@ -0,0 +1,940 @@
+/*
+ * XXH3 - 64 and 128 bit variants of xxHash, for modern CPUs
+ * Copyright (C) 2019-2021, Yann Collet.
+ *
+ * BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 as published by the
+ * Free Software Foundation. This program is dual-licensed; you may select
+ * either version 2 of the GNU General Public License ("GPL") or BSD license
+ * ("BSD").
+ *
+ * You can contact the author at:
+ * - xxHash homepage: https://cyan4973.github.io/xxHash/
+ * - xxHash source repository: https://github.com/Cyan4973/xxHash
+ */
+
+/*
+ * This produces the same hashes as XXH3_64bits_withSeed() and
+ * XXH3_128bits_withSeed() from xxHash 0.8.
+ *
+ * Inputs of up to 240 bytes are hashed with scalar code. Longer inputs are
+ * consumed in 64 byte stripes by eight 64 bit accumulators; that inner loop
+ * (accumulate and scramble) has SSE2, AVX2 and NEON versions, picked at
+ * startup.
+ */
+
+#include <asm/unaligned.h>
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/xxhash.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define PRIME32_1	0x9E3779B1U
+#define PRIME32_2	0x85EBCA77U
+#define PRIME32_3	0xC2B2AE3DU
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+#define PRIME_MX1	0x165667919E3779F9ULL
+#define PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define XXH3_STRIPE_LEN		64
+#define XXH3_SECRET_CONSUME_RATE 8
+#define XXH3_ACC_NB		8
+#define XXH3_SECRET_SIZE_MIN	136
+#define XXH3_MIDSIZE_MAX	240
+#define XXH3_MIDSIZE_STARTOFFSET 3
+#define XXH3_MIDSIZE_LASTOFFSET	17
+#define XXH3_SECRET_LASTACC_START 7
+#define XXH3_SECRET_MERGEACCS_START 11
+
+#define XXH3_STRIPES_PER_BLOCK						\
+	((XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / XXH3_SECRET_CONSUME_RATE)
+#define XXH3_BLOCK_LEN		(XXH3_STRIPE_LEN * XXH3_STRIPES_PER_BLOCK)
+#define XXH3_BUFFER_STRIPES	(XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN)
+
+static const uint8_t xxh3_ksecret[XXH3_SECRET_SIZE] __aligned(64) = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static const uint64_t xxh3_init_acc[XXH3_ACC_NB] = {
+	PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+	PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+};
+
+/*-*************************************
+ * Utils
+ ***************************************/
+#define xxh_rotl32(x, r) ((x << r) | (x >> (32 - r)))
+#define xxh_rotl64(x, r) ((x << r) | (x >> (64 - r)))
+
+static inline uint64_t xxh_read64(const void *p)
+{
+	return get_unaligned_le64(p);
+}
+
+static inline uint32_t xxh_read32(const void *p)
+{
+	return get_unaligned_le32(p);
+}
+
+static inline uint64_t xxh_mult32to64(uint32_t a, uint32_t b)
+{
+	return (uint64_t) a * b;
+}
+
+static inline struct xxh128_hash xxh_mult64to128(uint64_t a, uint64_t b)
+{
+	unsigned __int128 p = (unsigned __int128) a * b;
+
+	return (struct xxh128_hash) {
+		.low64	= (uint64_t) p,
+		.high64	= (uint64_t) (p >> 64),
+	};
+}
+
+static inline uint64_t xxh_mul128_fold64(uint64_t a, uint64_t b)
+{
+	struct xxh128_hash p = xxh_mult64to128(a, b);
+
+	return p.low64 ^ p.high64;
+}
+
+static inline uint64_t xxh_xorshift64(uint64_t v, unsigned shift)
+{
+	return v ^ (v >> shift);
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+	h = xxh_xorshift64(h, 37);
+	h *= PRIME_MX1;
+	h = xxh_xorshift64(h, 32);
+	return h;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= xxh_rotl64(h, 49) ^ xxh_rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return xxh_xorshift64(h, 28);
+}
+
+/*-*************************************
+ * Short inputs, 64 bit
+ ***************************************/
+static uint64_t xxh3_len_1to3_64b(const uint8_t *input, size_t len,
+				  const uint8_t *secret, uint64_t seed)
+{
+	uint8_t c1 = input[0];
+	uint8_t c2 = input[len >> 1];
+	uint8_t c3 = input[len - 1];
+	uint32_t combined = ((uint32_t) c1 << 16) | ((uint32_t) c2 << 24) |
+			    ((uint32_t) c3 << 0) | ((uint32_t) len << 8);
+	uint64_t bitflip = (xxh_read32(secret) ^ xxh_read32(secret + 4)) + seed;
+
+	return xxh64_avalanche((uint64_t) combined ^ bitflip);
+}
+
+static uint64_t xxh3_len_4to8_64b(const uint8_t *input, size_t len,
+				  const uint8_t *secret, uint64_t seed)
+{
+	uint32_t input1, input2;
+	uint64_t bitflip, input64;
+
+	seed ^= (uint64_t) swab32((uint32_t) seed) << 32;
+
+	input1	= xxh_read32(input);
+	input2	= xxh_read32(input + len - 4);
+	bitflip	= (xxh_read64(secret + 8) ^ xxh_read64(secret + 16)) - seed;
+	input64	= input2 + ((uint64_t) input1 << 32);
+
+	return xxh3_rrmxmx(input64 ^ bitflip, len);
+}
+
+static uint64_t xxh3_len_9to16_64b(const uint8_t *input, size_t len,
+				   const uint8_t *secret, uint64_t seed)
+{
+	uint64_t bitflip1 = (xxh_read64(secret + 24) ^ xxh_read64(secret + 32)) + seed;
+	uint64_t bitflip2 = (xxh_read64(secret + 40) ^ xxh_read64(secret + 48)) - seed;
+	uint64_t input_lo = xxh_read64(input) ^ bitflip1;
+	uint64_t input_hi = xxh_read64(input + len - 8) ^ bitflip2;
+	uint64_t acc = len + swab64(input_lo) + input_hi +
+		xxh_mul128_fold64(input_lo, input_hi);
+
+	return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_len_0to16_64b(const uint8_t *input, size_t len,
+				   const uint8_t *secret, uint64_t seed)
+{
+	if (len > 8)
+		return xxh3_len_9to16_64b(input, len, secret, seed);
+	if (len >= 4)
+		return xxh3_len_4to8_64b(input, len, secret, seed);
+	if (len)
+		return xxh3_len_1to3_64b(input, len, secret, seed);
+	return xxh64_avalanche(seed ^ (xxh_read64(secret + 56) ^
+				       xxh_read64(secret + 64)));
+}
+
+static inline uint64_t xxh3_mix16b(const uint8_t *input, const uint8_t *secret,
+				   uint64_t seed)
+{
+	uint64_t input_lo = xxh_read64(input);
+	uint64_t input_hi = xxh_read64(input + 8);
+
+	return xxh_mul128_fold64(input_lo ^ (xxh_read64(secret) + seed),
+				 input_hi ^ (xxh_read64(secret + 8) - seed));
+}
+
+static uint64_t xxh3_len_17to128_64b(const uint8_t *input, size_t len,
+				     const uint8_t *secret, uint64_t seed)
+{
+	uint64_t acc = len * PRIME64_1;
+
+	if (len > 32) {
+		if (len > 64) {
+			if (len > 96) {
+				acc += xxh3_mix16b(input + 48, secret + 96, seed);
+				acc += xxh3_mix16b(input + len - 64, secret + 112, seed);
+			}
+			acc += xxh3_mix16b(input + 32, secret + 64, seed);
+			acc += xxh3_mix16b(input + len - 48, secret + 80, seed);
+		}
+		acc += xxh3_mix16b(input + 16, secret + 32, seed);
+		acc += xxh3_mix16b(input + len - 32, secret + 48, seed);
+	}
+	acc += xxh3_mix16b(input + 0, secret + 0, seed);
+	acc += xxh3_mix16b(input + len - 16, secret + 16, seed);
+
+	return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_len_129to240_64b(const uint8_t *input, size_t len,
+				      const uint8_t *secret, uint64_t seed)
+{
+	unsigned i, nr_rounds = len / 16;
+	uint64_t acc = len * PRIME64_1;
+
+	for (i = 0; i < 8; i++)
+		acc += xxh3_mix16b(input + 16 * i, secret + 16 * i, seed);
+	acc = xxh3_avalanche(acc);
+
+	for (i = 8; i < nr_rounds; i++)
+		acc += xxh3_mix16b(input + 16 * i,
+				   secret + 16 * (i - 8) + XXH3_MIDSIZE_STARTOFFSET,
+				   seed);
+
+	acc += xxh3_mix16b(input + len - 16,
+			   secret + XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LASTOFFSET,
+			   seed);
+	return xxh3_avalanche(acc);
+}
+
+/*-*************************************
+ * Short inputs, 128 bit
+ ***************************************/
+static struct xxh128_hash xxh3_len_1to3_128b(const uint8_t *input, size_t len,
+					     const uint8_t *secret, uint64_t seed)
+{
+	uint8_t c1 = input[0];
+	uint8_t c2 = input[len >> 1];
+	uint8_t c3 = input[len - 1];
+	uint32_t combinedl = ((uint32_t) c1 << 16) | ((uint32_t) c2 << 24) |
+			     ((uint32_t) c3 << 0) | ((uint32_t) len << 8);
+	uint32_t combinedh = swab32(combinedl);
+	uint64_t bitflipl = (xxh_read32(secret) ^ xxh_read32(secret + 4)) + seed;
+	uint64_t bitfliph = (xxh_read32(secret + 8) ^ xxh_read32(secret + 12)) - seed;
+
+	combinedh = xxh_rotl32(combinedh, 13);
+
+	return (struct xxh128_hash) {
+		.low64	= xxh64_avalanche((uint64_t) combinedl ^ bitflipl),
+		.high64	= xxh64_avalanche((uint64_t) combinedh ^ bitfliph),
+	};
+}
+
+static struct xxh128_hash xxh3_len_4to8_128b(const uint8_t *input, size_t len,
+					     const uint8_t *secret, uint64_t seed)
+{
+	uint32_t input_lo, input_hi;
+	uint64_t input_64, bitflip;
+	struct xxh128_hash m128;
+
+	seed ^= (uint64_t) swab32((uint32_t) seed) << 32;
+
+	input_lo = xxh_read32(input);
+	input_hi = xxh_read32(input + len - 4);
+	input_64 = input_lo + ((uint64_t) input_hi << 32);
+	bitflip	 = (xxh_read64(secret + 16) ^ xxh_read64(secret + 24)) + seed;
+
+	m128 = xxh_mult64to128(input_64 ^ bitflip, PRIME64_1 + (len << 2));
+
+	m128.high64 += (m128.low64 << 1);
+	m128.low64  ^= (m128.high64 >> 3);
+
+	m128.low64   = xxh_xorshift64(m128.low64, 35);
+	m128.low64  *= PRIME_MX2;
+	m128.low64   = xxh_xorshift64(m128.low64, 28);
+	m128.high64  = xxh3_avalanche(m128.high64);
+	return m128;
+}
+
+static struct xxh128_hash xxh3_len_9to16_128b(const uint8_t *input, size_t len,
+					      const uint8_t *secret, uint64_t seed)
+{
+	uint64_t bitflipl = (xxh_read64(secret + 32) ^ xxh_read64(secret + 40)) - seed;
+	uint64_t bitfliph = (xxh_read64(secret + 48) ^ xxh_read64(secret + 56)) + seed;
+	uint64_t input_lo = xxh_read64(input);
+	uint64_t input_hi = xxh_read64(input + len - 8);
+	struct xxh128_hash m128, h128;
+
+	m128 = xxh_mult64to128(input_lo ^ input_hi ^ bitflipl, PRIME64_1);
+	m128.low64 += (uint64_t) (len - 1) << 54;
+	input_hi ^= bitfliph;
+	m128.high64 += input_hi + xxh_mult32to64((uint32_t) input_hi, PRIME32_2 - 1);
+	m128.low64 ^= swab64(m128.high64);
+
+	h128 = xxh_mult64to128(m128.low64, PRIME64_2);
+	h128.high64 += m128.high64 * PRIME64_2;
+
+	h128.low64  = xxh3_avalanche(h128.low64);
+	h128.high64 = xxh3_avalanche(h128.high64);
+	return h128;
+}
+
+static struct xxh128_hash xxh3_len_0to16_128b(const uint8_t *input, size_t len,
+					      const uint8_t *secret, uint64_t seed)
+{
+	if (len > 8)
+		return xxh3_len_9to16_128b(input, len, secret, seed);
+	if (len >= 4)
+		return xxh3_len_4to8_128b(input, len, secret, seed);
+	if (len)
+		return xxh3_len_1to3_128b(input, len, secret, seed);
+
+	return (struct xxh128_hash) {
+		.low64	= xxh64_avalanche(seed ^ xxh_read64(secret + 64) ^
+					  xxh_read64(secret + 72)),
+		.high64	= xxh64_avalanche(seed ^ xxh_read64(secret + 80) ^
+					  xxh_read64(secret + 88)),
+	};
+}
+
+static inline struct xxh128_hash xxh3_mix32b(struct xxh128_hash acc,
+					     const uint8_t *input_1,
+					     const uint8_t *input_2,
+					     const uint8_t *secret, uint64_t seed)
+{
+	acc.low64  += xxh3_mix16b(input_1, secret + 0, seed);
+	acc.low64  ^= xxh_read64(input_2) + xxh_read64(input_2 + 8);
+	acc.high64 += xxh3_mix16b(input_2, secret + 16, seed);
+	acc.high64 ^= xxh_read64(input_1) + xxh_read64(input_1 + 8);
+	return acc;
+}
+
+static struct xxh128_hash xxh3_mid_128b_final(struct xxh128_hash acc,
+					      size_t len, uint64_t seed)
+{
+	struct xxh128_hash h128;
+
+	h128.low64  = acc.low64 + acc.high64;
+	h128.high64 = (acc.low64 * PRIME64_1) + (acc.high64 * PRIME64_4) +
+		((len - seed) * PRIME64_2);
+	h128.low64  = xxh3_avalanche(h128.low64);
+	h128.high64 = (uint64_t) 0 - xxh3_avalanche(h128.high64);
+	return h128;
+}
+
+static struct xxh128_hash xxh3_len_17to128_128b(const uint8_t *input, size_t len,
+						const uint8_t *secret, uint64_t seed)
+{
+	struct xxh128_hash acc = { .low64 = len * PRIME64_1 };
+
+	if (len > 32) {
+		if (len > 64) {
+			if (len > 96)
+				acc = xxh3_mix32b(acc, input + 48, input + len - 64,
+						  secret + 96, seed);
+			acc = xxh3_mix32b(acc, input + 32, input + len - 48,
+					  secret + 64, seed);
+		}
+		acc = xxh3_mix32b(acc, input + 16, input + len - 32,
+				  secret + 32, seed);
+	}
+	acc = xxh3_mix32b(acc, input, input + len - 16, secret, seed);
+
+	return xxh3_mid_128b_final(acc, len, seed);
+}
+
+static struct xxh128_hash xxh3_len_129to240_128b(const uint8_t *input, size_t len,
+						 const uint8_t *secret, uint64_t seed)
+{
+	struct xxh128_hash acc = { .low64 = len * PRIME64_1 };
+	unsigned i, nr_rounds = len / 32;
+
+	for (i = 0; i < 4; i++)
+		acc = xxh3_mix32b(acc, input + 32 * i, input + 32 * i + 16,
+				  secret + 32 * i, seed);
+	acc.low64  = xxh3_avalanche(acc.low64);
+	acc.high64 = xxh3_avalanche(acc.high64);
+
+	for (i = 4; i < nr_rounds; i++)
+		acc = xxh3_mix32b(acc, input + 32 * i, input + 32 * i + 16,
+				  secret + XXH3_MIDSIZE_STARTOFFSET + 32 * (i - 4),
+				  seed);
+
+	acc = xxh3_mix32b(acc, input + len - 16, input + len - 32,
+			  secret + XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LASTOFFSET - 16,
+			  (uint64_t) 0 - seed);
+
+	return xxh3_mid_128b_final(acc, len, seed);
+}
+
+/*-*************************************
+ * Long inputs: accumulate and scramble
+ ***************************************/
+
+/*
+ * Accumulate @nr_stripes 64 byte stripes into @acc; the secret advances by
+ * XXH3_SECRET_CONSUME_RATE bytes per stripe:
+ */
+typedef void (*xxh3_accumulate_fn)(uint64_t *, const uint8_t *,
+				   const uint8_t *, size_t);
+typedef void (*xxh3_scramble_fn)(uint64_t *, const uint8_t *);
+
+static void __maybe_unused xxh3_accumulate_scalar(uint64_t *acc, const uint8_t *input,
+				   const uint8_t *secret, size_t nr_stripes)
+{
+	size_t n;
+	unsigned i;
+
+	for (n = 0; n < nr_stripes; n++) {
+		const uint8_t *in = input + n * XXH3_STRIPE_LEN;
+		const uint8_t *key = secret + n * XXH3_SECRET_CONSUME_RATE;
+
+		for (i = 0; i < XXH3_ACC_NB; i++) {
+			uint64_t data_val = xxh_read64(in + 8 * i);
+			uint64_t data_key = data_val ^ xxh_read64(key + 8 * i);
+
+			acc[i ^ 1] += data_val;
+			acc[i] += xxh_mult32to64(data_key, data_key >> 32);
+		}
+	}
+}
+
+static void __maybe_unused xxh3_scramble_scalar(uint64_t *acc, const uint8_t *secret)
+{
+	unsigned i;
+
+	for (i = 0; i < XXH3_ACC_NB; i++) {
+		uint64_t a = xxh_xorshift64(acc[i], 47);
+
+		a ^= xxh_read64(secret + 8 * i);
+		acc[i] = a * PRIME32_1;
+	}
+}
+
+#if defined(__x86_64__)
+
+static void xxh3_accumulate_sse2(uint64_t *acc, const uint8_t *input,
+				 const uint8_t *secret, size_t nr_stripes)
+{
+	__m128i a[4];
+	size_t n;
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
+		a[i] = _mm_loadu_si128((const __m128i *) acc + i);
+
+	for (n = 0; n < nr_stripes; n++) {
+		const __m128i *in = (const __m128i *) (input + n * XXH3_STRIPE_LEN);
+		const __m128i *key = (const __m128i *)
+			(secret + n * XXH3_SECRET_CONSUME_RATE);
+
+		for (i = 0; i < 4; i++) {
+			__m128i data_vec = _mm_loadu_si128(in + i);
+			__m128i data_key = _mm_xor_si128(data_vec,
+						_mm_loadu_si128(key + i));
+			__m128i product	 = _mm_mul_epu32(data_key,
+						_mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+			__m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, data_swap));
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i *) acc + i, a[i]);
+}
+
+static void xxh3_scramble_sse2(uint64_t *acc, const uint8_t *secret)
+{
+	const __m128i prime32 = _mm_set1_epi32(PRIME32_1);
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i *) acc + i);
+		__m128i data_key;
+
+		a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+		data_key = _mm_xor_si128(a,
+				_mm_loadu_si128((const __m128i *) secret + i));
+
+		a = _mm_add_epi64(_mm_mul_epu32(data_key, prime32),
+				  _mm_slli_epi64(_mm_mul_epu32(
+					_mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)),
+					prime32), 32));
+		_mm_storeu_si128((__m128i *) acc + i, a);
+	}
+}
+
+__attribute__((target("avx2")))
+static void xxh3_accumulate_avx2(uint64_t *acc, const uint8_t *input,
+				 const uint8_t *secret, size_t nr_stripes)
+{
+	__m256i a0 = _mm256_loadu_si256((const __m256i *) acc);
+	__m256i a1 = _mm256_loadu_si256((const __m256i *) acc + 1);
+	size_t n;
+
+	for (n = 0; n < nr_stripes; n++) {
+		const __m256i *in = (const __m256i *) (input + n * XXH3_STRIPE_LEN);
+		const __m256i *key = (const __m256i *)
+			(secret + n * XXH3_SECRET_CONSUME_RATE);
+		__m256i d0 = _mm256_loadu_si256(in);
+		__m256i d1 = _mm256_loadu_si256(in + 1);
+		__m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256(key));
+		__m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256(key + 1));
+
+		a0 = _mm256_add_epi64(a0, _mm256_add_epi64(
+				_mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)),
+				_mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+		a1 = _mm256_add_epi64(a1, _mm256_add_epi64(
+				_mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)),
+				_mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+	}
+
+	_mm256_storeu_si256((__m256i *) acc, a0);
+	_mm256_storeu_si256((__m256i *) acc + 1, a1);
+}
+
+__attribute__((target("avx2")))
+static void xxh3_scramble_avx2(uint64_t *acc, const uint8_t *secret)
+{
+	const __m256i prime32 = _mm256_set1_epi32(PRIME32_1);
+	unsigned i;
+
+	for (i = 0; i < 2; i++) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) acc + i);
+		__m256i data_key;
+
+		a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+		data_key = _mm256_xor_si256(a,
+				_mm256_loadu_si256((const __m256i *) secret + i));
+
+		a = _mm256_add_epi64(_mm256_mul_epu32(data_key, prime32),
+				     _mm256_slli_epi64(_mm256_mul_epu32(
+					_mm256_srli_epi64(data_key, 32),
+					prime32), 32));
+		_mm256_storeu_si256((__m256i *) acc + i, a);
+	}
+}
+
+static xxh3_accumulate_fn xxh3_accumulate = xxh3_accumulate_sse2;
+static xxh3_scramble_fn xxh3_scramble = xxh3_scramble_sse2;
+
+#elif defined(__aarch64__)
+
+static void xxh3_accumulate_neon(uint64_t *acc, const uint8_t *input,
+				 const uint8_t *secret, size_t nr_stripes)
+{
+	uint64x2_t a[4];
+	size_t n;
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
+		a[i] = vld1q_u64(acc + 2 * i);
+
+	for (n = 0; n < nr_stripes; n++) {
+		const uint8_t *in = input + n * XXH3_STRIPE_LEN;
+		const uint8_t *key = secret + n * XXH3_SECRET_CONSUME_RATE;
+
+		for (i = 0; i < 4; i++) {
+			uint64x2_t data_vec = vreinterpretq_u64_u8(vld1q_u8(in + 16 * i));
+			uint64x2_t data_key = veorq_u64(data_vec,
+					vreinterpretq_u64_u8(vld1q_u8(key + 16 * i)));
+			uint32x2_t lo = vmovn_u64(data_key);
+			uint32x2_t hi = vshrn_n_u64(data_key, 32);
+
+			a[i] = vaddq_u64(a[i], vextq_u64(data_vec, data_vec, 1));
+			a[i] = vmlal_u32(a[i], lo, hi);
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		vst1q_u64(acc + 2 * i, a[i]);
+}
+
+static void xxh3_scramble_neon(uint64_t *acc, const uint8_t *secret)
+{
+	const uint32x2_t prime32 = vdup_n_u32(PRIME32_1);
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		uint64x2_t a = vld1q_u64(acc + 2 * i);
+		uint64x2_t data_key;
+		uint64x2_t prod_hi;
+
+		a = veorq_u64(a, vshrq_n_u64(a, 47));
+		data_key = veorq_u64(a,
+				vreinterpretq_u64_u8(vld1q_u8(secret + 16 * i)));
+
+		prod_hi = vmull_u32(vshrn_n_u64(data_key, 32), prime32);
+		a = vmlal_u32(vshlq_n_u64(prod_hi, 32),
+			      vmovn_u64(data_key), prime32);
+		vst1q_u64(acc + 2 * i, a);
+	}
+}
+
+static xxh3_accumulate_fn xxh3_accumulate = xxh3_accumulate_neon;
+static xxh3_scramble_fn xxh3_scramble = xxh3_scramble_neon;
+
+#else
+
+static xxh3_accumulate_fn xxh3_accumulate = xxh3_accumulate_scalar;
+static xxh3_scramble_fn xxh3_scramble = xxh3_scramble_scalar;
+
+#endif
+
+static void xxh3_hash_long_loop(uint64_t *acc, const uint8_t *input, size_t len,
+				const uint8_t *secret)
+{
+	size_t nr_blocks = (len - 1) / XXH3_BLOCK_LEN;
+	size_t n;
+
+	for (n = 0; n < nr_blocks; n++) {
+		xxh3_accumulate(acc, input + n * XXH3_BLOCK_LEN, secret,
+				XXH3_STRIPES_PER_BLOCK);
+		xxh3_scramble(acc, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+	}
+
+	xxh3_accumulate(acc, input + nr_blocks * XXH3_BLOCK_LEN, secret,
+			((len - 1) - XXH3_BLOCK_LEN * nr_blocks) / XXH3_STRIPE_LEN);
+
+	/* last stripe */
+	xxh3_accumulate(acc, input + len - XXH3_STRIPE_LEN,
+			secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN -
+			XXH3_SECRET_LASTACC_START, 1);
+}
+
+static uint64_t xxh3_merge_accs(const uint64_t *acc, const uint8_t *secret,
+				uint64_t start)
+{
+	uint64_t result = start;
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
+		result += xxh_mul128_fold64(acc[2 * i] ^ xxh_read64(secret + 16 * i),
+					    acc[2 * i + 1] ^ xxh_read64(secret + 16 * i + 8));
+
+	return xxh3_avalanche(result);
+}
+
+static uint64_t xxh3_merge_accs_64b(const uint64_t *acc, const uint8_t *secret,
+				    uint64_t len)
+{
+	return xxh3_merge_accs(acc, secret + XXH3_SECRET_MERGEACCS_START,
+			       len * PRIME64_1);
+}
+
+static struct xxh128_hash xxh3_merge_accs_128b(const uint64_t *acc,
+					       const uint8_t *secret,
+					       uint64_t len)
+{
+	return (struct xxh128_hash) {
+		.low64	= xxh3_merge_accs(acc,
+					  secret + XXH3_SECRET_MERGEACCS_START,
+					  len * PRIME64_1),
+		.high64	= xxh3_merge_accs(acc,
+					  secret + XXH3_SECRET_SIZE -
+					  XXH3_STRIPE_LEN - XXH3_SECRET_MERGEACCS_START,
+					  ~(len * PRIME64_2)),
+	};
+}
+
+static void xxh3_init_custom_secret(uint8_t *secret, uint64_t seed)
+{
+	unsigned i;
+
+	for (i = 0; i < XXH3_SECRET_SIZE / 16; i++) {
+		put_unaligned_le64(xxh_read64(xxh3_ksecret + 16 * i) + seed,
+				   secret + 16 * i);
+		put_unaligned_le64(xxh_read64(xxh3_ksecret + 16 * i + 8) - seed,
+				   secret + 16 * i + 8);
+	}
+}
+
+/*-*************************************
+ * One shot
+ ***************************************/
+uint64_t xxh3_64(const void *_input, size_t len, uint64_t seed)
+{
+	const uint8_t *input = _input;
+	const uint8_t *secret = xxh3_ksecret;
+	uint8_t custom_secret[XXH3_SECRET_SIZE] __aligned(64);
+	uint64_t acc[XXH3_ACC_NB] __aligned(64);
+
+	if (len <= 16)
+		return xxh3_len_0to16_64b(input, len, secret, seed);
+	if (len <= 128)
+		return xxh3_len_17to128_64b(input, len, secret, seed);
+	if (len <= XXH3_MIDSIZE_MAX)
+		return xxh3_len_129to240_64b(input, len, secret, seed);
+
+	if (seed) {
+		xxh3_init_custom_secret(custom_secret, seed);
+		secret = custom_secret;
+	}
+
+	memcpy(acc, xxh3_init_acc, sizeof(acc));
+	xxh3_hash_long_loop(acc, input, len, secret);
+	return xxh3_merge_accs_64b(acc, secret, len);
+}
+EXPORT_SYMBOL(xxh3_64);
+
+struct xxh128_hash xxh3_128(const void *_input, size_t len, uint64_t seed)
+{
+	const uint8_t *input = _input;
+	const uint8_t *secret = xxh3_ksecret;
+	uint8_t custom_secret[XXH3_SECRET_SIZE] __aligned(64);
+	uint64_t acc[XXH3_ACC_NB] __aligned(64);
+
+	if (len <= 16)
+		return xxh3_len_0to16_128b(input, len, secret, seed);
+	if (len <= 128)
+		return xxh3_len_17to128_128b(input, len, secret, seed);
+	if (len <= XXH3_MIDSIZE_MAX)
+		return xxh3_len_129to240_128b(input, len, secret, seed);
+
+	if (seed) {
+		xxh3_init_custom_secret(custom_secret, seed);
+		secret = custom_secret;
+	}
+
+	memcpy(acc, xxh3_init_acc, sizeof(acc));
+	xxh3_hash_long_loop(acc, input, len, secret);
+	return xxh3_merge_accs_128b(acc, secret, len);
+}
+EXPORT_SYMBOL(xxh3_128);
+
+/*-*************************************
+ * Streaming
+ ***************************************/
+static inline const uint8_t *xxh3_state_secret(const struct xxh3_state *state)
+{
+	return state->seed ? state->secret : xxh3_ksecret;
+}
+
+void xxh3_reset(struct xxh3_state *state, uint64_t seed)
+{
+	memcpy(state->acc, xxh3_init_acc, sizeof(state->acc));
+	state->total_len	= 0;
+	state->seed		= seed;
+	state->buffered		= 0;
+	state->nr_stripes	= 0;
+
+	if (seed)
+		xxh3_init_custom_secret(state->secret, seed);
+}
+EXPORT_SYMBOL(xxh3_reset);
+
+static void xxh3_consume_stripes(uint64_t *acc, uint32_t *nr_stripes_so_far,
+				 const uint8_t *input, size_t nr_stripes,
+				 const uint8_t *secret)
+{
+	size_t to_end = XXH3_STRIPES_PER_BLOCK - *nr_stripes_so_far;
+
+	if (to_end <= nr_stripes) {
+		xxh3_accumulate(acc, input,
+				secret + *nr_stripes_so_far * XXH3_SECRET_CONSUME_RATE,
+				to_end);
+		xxh3_scramble(acc, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+		xxh3_accumulate(acc, input + to_end * XXH3_STRIPE_LEN, secret,
+				nr_stripes - to_end);
+		*nr_stripes_so_far = nr_stripes - to_end;
+	} else {
+		xxh3_accumulate(acc, input,
+				secret + *nr_stripes_so_far * XXH3_SECRET_CONSUME_RATE,
+				nr_stripes);
+		*nr_stripes_so_far += nr_stripes;
+	}
+}
+
+int xxh3_update(struct xxh3_state *state, const void *_input, size_t len)
+{
+	const uint8_t *input = _input;
+	const uint8_t *secret = xxh3_state_secret(state);
+
+	if (input == NULL)
+		return -EINVAL;
+
+	state->total_len += len;
+
+	if (len <= XXH3_BUFFER_SIZE - state->buffered) {
+		memcpy(state->buffer + state->buffered, input, len);
+		state->buffered += len;
+		return 0;
+	}
+
+	/*
+	 * We always keep at least one byte buffered, so that the last stripe
+	 * is done by the digest:
+	 */
+	if (state->buffered) {
+		size_t load = XXH3_BUFFER_SIZE - state->buffered;
+
+		memcpy(state->buffer + state->buffered, input, load);
+		input	+= load;
+		len	-= load;
+
+		xxh3_consume_stripes(state->acc, &state->nr_stripes,
+				     state->buffer, XXH3_BUFFER_STRIPES, secret);
+		state->buffered = 0;
+	}
+
+	if (len > XXH3_BUFFER_SIZE) {
+		do {
+			xxh3_consume_stripes(state->acc, &state->nr_stripes,
+					     input, XXH3_BUFFER_STRIPES, secret);
+			input	+= XXH3_BUFFER_SIZE;
+			len	-= XXH3_BUFFER_SIZE;
+		} while (len > XXH3_BUFFER_SIZE);
+
+		/* the digest may need the end of the last stripe: */
+		memcpy(state->buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN,
+		       input - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+	}
+
+	memcpy(state->buffer, input, len);
+	state->buffered = len;
+	return 0;
+}
+EXPORT_SYMBOL(xxh3_update);
+
+static void xxh3_digest_long(uint64_t *acc, const struct xxh3_state *state,
+			     const uint8_t *secret)
+{
+	uint8_t last_stripe[XXH3_STRIPE_LEN];
+	const uint8_t *last_stripe_p;
+
+	memcpy(acc, state->acc, sizeof(state->acc));
+
+	if (state->buffered >= XXH3_STRIPE_LEN) {
+		uint32_t nr_stripes_so_far = state->nr_stripes;
+
+		xxh3_consume_stripes(acc, &nr_stripes_so_far, state->buffer,
+				     (state->buffered - 1) / XXH3_STRIPE_LEN,
+				     secret);
+		last_stripe_p = state->buffer + state->buffered - XXH3_STRIPE_LEN;
+	} else {
+		size_t catchup = XXH3_STRIPE_LEN - state->buffered;
+
+		memcpy(last_stripe, state->buffer + XXH3_BUFFER_SIZE - catchup,
+		       catchup);
+		memcpy(last_stripe + catchup, state->buffer, state->buffered);
+		last_stripe_p = last_stripe;
+	}
+
+	xxh3_accumulate(acc, last_stripe_p,
+			secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN -
+			XXH3_SECRET_LASTACC_START, 1);
+}
+
+uint64_t xxh3_64_digest(const struct xxh3_state *state)
+{
+	const uint8_t *secret = xxh3_state_secret(state);
+	uint64_t acc[XXH3_ACC_NB] __aligned(64);
+
+	if (state->total_len <= XXH3_MIDSIZE_MAX)
+		return xxh3_64(state->buffer, state->total_len, state->seed);
+
+	xxh3_digest_long(acc, state, secret);
+	return xxh3_merge_accs_64b(acc, secret, state->total_len);
+}
+EXPORT_SYMBOL(xxh3_64_digest);
+
+struct xxh128_hash xxh3_128_digest(const struct xxh3_state *state)
+{
+	const uint8_t *secret = xxh3_state_secret(state);
+	uint64_t acc[XXH3_ACC_NB] __aligned(64);
+
+	if (state->total_len <= XXH3_MIDSIZE_MAX)
+		return xxh3_128(state->buffer, state->total_len, state->seed);
+
+	xxh3_digest_long(acc, state, secret);
+	return xxh3_merge_accs_128b(acc, secret, state->total_len);
+}
+EXPORT_SYMBOL(xxh3_128_digest);
+
+__attribute__((constructor(110)))
+static void xxh3_init(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) {
+		xxh3_accumulate	= xxh3_accumulate_avx2;
+		xxh3_scramble	= xxh3_scramble_avx2;
+	}
+#endif
+}
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("xxh3 hash");
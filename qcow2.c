@@ -3,6 +3,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <zlib.h>
+
 #include "qcow2.h"
 #include "tools-util.h"
 
@@ -31,31 +33,103 @@ struct qcow2_hdr {
 	u64			snapshots_offset;
 };
 
+/* Compressed clusters: */
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+
+/* Source reads, and buffered output: */
+#define QCOW2_IO_SIZE		(1U << 20)
+
 struct qcow2_image {
 	int			fd;
+	bool			stream;
 	u32			block_size;
 	u64			*l1_table;
-	u64			l1_offset;
 	u32			l1_index;
 	u64			*l2_table;
-	u64			offset;
+
+	/*
+	 * Everything but the header is appended sequentially, so it all goes
+	 * through one buffer - which also means we can write to a pipe:
+	 */
+	char			*buf;
+	size_t			buf_used;
+	u64			buf_offset;
+
+	bool			compress;
+	unsigned		csize_shift;
+	z_stream		zstream;
+	void			*zbuf;
 };
 
+static void img_flush(struct qcow2_image *img)
+{
+	char *p = img->buf;
+	size_t len = img->buf_used;
+
+	if (!img->stream)
+		xpwrite(img->fd, p, len, img->buf_offset, "qcow2 image");
+	else
+		while (len) {
+			ssize_t r = write(img->fd, p, len);
+
+			if (r < 0)
+				die("error writing qcow2 image: %m");
+			p	+= r;
+			len	-= r;
+		}
+
+	img->buf_offset	+= img->buf_used;
+	img->buf_used	= 0;
+}
+
+/* Append @len bytes from @data, or zeroes if @data is NULL: */
+static void img_append(struct qcow2_image *img, const void *data, size_t len)
+{
+	while (len) {
+		size_t n = min_t(size_t, len, QCOW2_IO_SIZE - img->buf_used);
+
+		if (data) {
+			memcpy(img->buf + img->buf_used, data, n);
+			data += n;
+		} else {
+			memset(img->buf + img->buf_used, 0, n);
+		}
+
+		img->buf_used	+= n;
+		len		-= n;
+
+		if (img->buf_used == QCOW2_IO_SIZE)
+			img_flush(img);
+	}
+}
+
+static u64 img_offset(struct qcow2_image *img)
+{
+	return img->buf_offset + img->buf_used;
+}
+
+/* Compressed clusters are byte aligned, everything else is cluster aligned: */
+static u64 img_align(struct qcow2_image *img)
+{
+	u64 offset = img_offset(img);
+
+	img_append(img, NULL, round_up(offset, img->block_size) - offset);
+	return img_offset(img);
+}
+
 static void flush_l2(struct qcow2_image *img)
 {
 	if (img->l1_index != -1) {
 		img->l1_table[img->l1_index] =
-			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
-		xpwrite(img->fd, img->l2_table, img->block_size, img->offset,
-			"qcow2 l2 table");
-		img->offset += img->block_size;
+			cpu_to_be64(img_align(img)|QCOW_OFLAG_COPIED);
+		img_append(img, img->l2_table, img->block_size);
 
 		memset(img->l2_table, 0, img->block_size);
 		img->l1_index = -1;
 	}
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void add_l2(struct qcow2_image *img, u64 src_blk, u64 entry)
 {
 	unsigned l2_size = img->block_size / sizeof(u64);
 	u64 l1_index = src_blk / l2_size;
@@ -66,69 +140,244 @@ static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
 		img->l1_index = l1_index;
 	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	img->l2_table[l2_index] = cpu_to_be64(entry);
+}
+
+static bool cluster_is_zero(const void *data, unsigned len)
+{
+	const u64 *p = data, *end = data + len;
+
+	for (; p < end; p++)
+		if (*p)
+			return false;
+	return true;
+}
+
+/* Returns compressed size, or 0 if it didn't compress: */
+static unsigned compress_cluster(struct qcow2_image *img, const void *data)
+{
+	z_stream *z = &img->zstream;
+
+	deflateReset(z);
+	z->next_in	= (void *) data;
+	z->avail_in	= img->block_size;
+	z->next_out	= img->zbuf;
+	z->avail_out	= img->block_size - 1;
+
+	return deflate(z, Z_FINISH) == Z_STREAM_END
+		? img->block_size - 1 - z->avail_out
+		: 0;
+}
+
+static void write_cluster(struct qcow2_image *img, u64 src_blk, const void *data)
+{
+	unsigned len;
+	u64 offset;
+
+	/* Clusters we don't allocate read as zeroes: */
+	if (cluster_is_zero(data, img->block_size))
+		return;
+
+	if (img->compress &&
+	    (len = compress_cluster(img, data))) {
+		offset = img_offset(img);
+		img_append(img, img->zbuf, len);
+
+		add_l2(img, src_blk, offset|QCOW_OFLAG_COMPRESSED|
+		       ((((offset + len - 1) >> 9) - (offset >> 9)) << img->csize_shift));
+		return;
+	}
+
+	offset = img_align(img);
+	img_append(img, data, img->block_size);
+
+	add_l2(img, src_blk, offset|QCOW_OFLAG_COPIED);
+}
+
+static void qcow2_hdr_init(void *buf, unsigned block_size, u64 image_size,
+			   u32 l1_size, u64 l1_offset)
+{
+	struct qcow2_hdr hdr = { 0 };
+
+	hdr.magic		= cpu_to_be32(QCOW_MAGIC);
+	hdr.version		= cpu_to_be32(QCOW_VERSION);
+	hdr.block_bits		= cpu_to_be32(ilog2(block_size));
+	hdr.size		= cpu_to_be64(image_size);
+	hdr.l1_size		= cpu_to_be32(l1_size);
+	hdr.l1_table_offset	= cpu_to_be64(l1_offset);
+
+	memset(buf, 0, block_size);
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+static void qcow2_write_seekable(struct qcow2_image *img, int infd,
+				 ranges *data, u64 image_size, u32 l1_size,
+				 void *buf)
+{
+	unsigned block_size = img->block_size;
+	struct range *r;
+	u64 src_offset, l1_offset;
+	size_t len, i;
+
+	/* The header goes in the first cluster, once we know where L1 is: */
+	img->buf_offset = block_size;
+
+	darray_for_each(*data, r)
+		for (src_offset = r->start;
+		     src_offset < r->end;
+		     src_offset += len) {
+			len = min_t(u64, r->end - src_offset, QCOW2_IO_SIZE);
+			xpread(infd, buf, len, src_offset);
+
+			for (i = 0; i < len; i += block_size)
+				write_cluster(img, (src_offset + i) / block_size,
+					      buf + i);
+		}
+
+	flush_l2(img);
+
+	l1_offset = img_align(img);
+	img_append(img, img->l1_table, l1_size * sizeof(u64));
+	img_flush(img);
+
+	qcow2_hdr_init(buf, block_size, image_size, l1_size, l1_offset);
+	xpwrite(img->fd, buf, block_size, 0, "qcow2 header");
+}
+
+/*
+ * Writing to a pipe, the header and L1 table have to come first, so the layout
+ * has to be known before we read any data: each L2 table is followed by every
+ * cluster it maps, with no compression and no zero cluster detection - those
+ * are better done by whatever's on the other end of the pipe.
+ */
+static void stream_l2(struct qcow2_image *img, ranges *data,
+		      struct range *r, u64 src_offset, u64 offset)
+{
+	unsigned block_size = img->block_size;
+	unsigned l2_size = block_size / sizeof(u64);
+	u64 l1_index = src_offset / block_size / l2_size;
+
+	BUG_ON(offset != img_offset(img));
+
+	for (; r < data->data + data->nr; r++) {
+		for (src_offset = max(src_offset, r->start);
+		     src_offset < r->end;
+		     src_offset += block_size) {
+			u64 src_blk = src_offset / block_size;
+
+			if (src_blk / l2_size != l1_index)
+				goto out;
+
+			offset += block_size;
+			img->l2_table[src_blk & (l2_size - 1)] =
+				cpu_to_be64(offset|QCOW_OFLAG_COPIED);
+		}
+	}
+out:
+	img_append(img, img->l2_table, block_size);
+	memset(img->l2_table, 0, block_size);
+}
+
+static void qcow2_write_stream(struct qcow2_image *img, int infd,
+			       ranges *data, u64 image_size, u32 l1_size,
+			       void *buf)
+{
+	unsigned block_size = img->block_size;
+	unsigned l2_size = block_size / sizeof(u64);
+	u32 *nr = xcalloc(l1_size, sizeof(u32));
+	u64 l1_index = U64_MAX, src_offset, offset;
+	struct range *r;
+	size_t len;
+	unsigned i;
+
+	darray_for_each(*data, r)
+		for (src_offset = r->start;
+		     src_offset < r->end;
+		     src_offset += block_size)
+			nr[src_offset / block_size / l2_size]++;
+
+	offset = block_size + round_up(l1_size * sizeof(u64), block_size);
+
+	for (i = 0; i < l1_size; i++)
+		if (nr[i]) {
+			img->l1_table[i] = cpu_to_be64(offset|QCOW_OFLAG_COPIED);
+			offset += (u64) block_size * (1 + nr[i]);
+		}
+
+	qcow2_hdr_init(buf, block_size, image_size, l1_size, block_size);
+	img_append(img, buf, block_size);
+	img_append(img, img->l1_table, l1_size * sizeof(u64));
+	img_align(img);
+
+	darray_for_each(*data, r)
+		for (src_offset = r->start;
+		     src_offset < r->end;
+		     src_offset += len) {
+			u64 region = src_offset / block_size / l2_size;
+
+			if (region != l1_index) {
+				l1_index = region;
+				stream_l2(img, data, r, src_offset,
+					  be64_to_cpu(img->l1_table[l1_index]) &
+					  ~QCOW_OFLAG_COPIED);
+			}
+
+			len = min_t(u64, r->end - src_offset, QCOW2_IO_SIZE);
+			len = min_t(u64, len, (region + 1) * l2_size * block_size -
+				    src_offset);
+
+			xpread(infd, buf, len, src_offset);
+			img_append(img, buf, len);
+		}
+
+	img_flush(img);
+	free(nr);
 }
 
 void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+		       unsigned block_size, bool compress)
 {
 	u64 image_size = get_size(NULL, infd);
 	unsigned l2_size = block_size / sizeof(u64);
 	unsigned l1_size = DIV_ROUND_UP(image_size, (u64) block_size * l2_size);
-	struct qcow2_hdr hdr = { 0 };
 	struct qcow2_image img = {
 		.fd		= outfd,
+		.stream		= lseek(outfd, 0, SEEK_CUR) < 0 && errno == ESPIPE,
 		.block_size	= block_size,
 		.l2_table	= xcalloc(l2_size, sizeof(u64)),
 		.l1_table	= xcalloc(l1_size, sizeof(u64)),
 		.l1_index	= -1,
-		.offset		= round_up(sizeof(hdr), block_size),
+		.buf		= xmalloc(QCOW2_IO_SIZE),
+		.compress	= compress,
+		.csize_shift	= 62 - (ilog2(block_size) - 8),
 	};
-	struct range *r;
-	char *buf = xmalloc(block_size);
-	u64 src_offset, dst_offset;
+	char *buf = xmalloc(max_t(unsigned, block_size, QCOW2_IO_SIZE));
 
 	assert(is_power_of_2(block_size));
 
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
-	/* Write data: */
-	darray_for_each(*data, r)
-		for (src_offset = r->start;
-		     src_offset < r->end;
-		     src_offset += block_size) {
-			dst_offset = img.offset;
-			img.offset += img.block_size;
-
-			xpread(infd, buf, block_size, src_offset);
-			xpwrite(outfd, buf, block_size, dst_offset,
-				"qcow2 data");
-
-			add_l2(&img, src_offset / block_size, dst_offset);
+	if (!img.stream) {
+		if (compress) {
+			/* qcow2 compressed clusters are raw deflate, 4k window: */
+			if (deflateInit2(&img.zstream, Z_DEFAULT_COMPRESSION,
+					 Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+				die("error initializing zlib");
+			img.zbuf = xmalloc(block_size);
 		}
 
-	flush_l2(&img);
+		qcow2_write_seekable(&img, infd, data, image_size, l1_size, buf);
 
-	/* Write L1 table: */
-	dst_offset		= img.offset;
-	img.offset		+= round_up(l1_size * sizeof(u64), block_size);
-	xpwrite(img.fd, img.l1_table, l1_size * sizeof(u64), dst_offset,
-		"qcow2 l1 table");
-
-	/* Write header: */
-	hdr.magic		= cpu_to_be32(QCOW_MAGIC);
-	hdr.version		= cpu_to_be32(QCOW_VERSION);
-	hdr.block_bits		= cpu_to_be32(ilog2(block_size));
-	hdr.size		= cpu_to_be64(image_size);
-	hdr.l1_size		= cpu_to_be32(l1_size);
-	hdr.l1_table_offset	= cpu_to_be64(dst_offset);
-
-	memset(buf, 0, block_size);
-	memcpy(buf, &hdr, sizeof(hdr));
-	xpwrite(img.fd, buf, block_size, 0,
-		"qcow2 header");
+		if (compress) {
+			deflateEnd(&img.zstream);
+			free(img.zbuf);
+		}
+	} else {
+		qcow2_write_stream(&img, infd, data, image_size, l1_size, buf);
+	}
 
+	free(img.buf);
 	free(img.l2_table);
 	free(img.l1_table);
 	free(buf);
@@ -4,6 +4,6 @@
 #include <linux/types.h>
 #include "tools-util.h"
 
-void qcow2_write_image(int, int, ranges *, unsigned);
+void qcow2_write_image(int, int, ranges *, unsigned, bool);
 
 #endif /* _QCOW2_H */
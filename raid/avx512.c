@@ -0,0 +1,418 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "internal.h"
+#include "gf.h"
+
+/*
+ * AVX-512 implementations, processing a whole 64 byte cache block per zmm
+ * register.
+ *
+ * Unlike x86.c these use intrinsics instead of inline assembly, with the
+ * instruction set enabled per function with the target attribute: that lets
+ * a single template serve every parity level, with the compiler allocating
+ * the registers once the number of parities is known.
+ *
+ * The AVX512BW versions multiply with two vpshufb lookups on nibbles, as the
+ * SSSE3/AVX2 ones do. With GFNI, multiplications by a constant are a single
+ * vgf2p8affineqb: multiplying by a constant in GF(2^8) is linear over GF(2),
+ * so it's an 8x8 bit matrix, whatever the polynomial. Note that we can't use
+ * vgf2p8mulb, which is hardwired to the AES polynomial 0x11b instead of our
+ * 0x11d.
+ */
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AVX512BW)
+
+#include <immintrin.h>
+
+#define AVX512BW_TARGET "avx512f,avx512bw"
+#define GFNI_TARGET AVX512BW_TARGET ",gfni"
+
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+__m512i avx512_load(const uint8_t *p)
+{
+	return _mm512_loadu_si512((const void *)p);
+}
+
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+void avx512_store(uint8_t *p, __m512i v)
+{
+	_mm512_storeu_si512((void *)p, v);
+}
+
+/*
+ * Multiply each byte by 2.
+ */
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+__m512i avx512_x2(__m512i v, __m512i poly)
+{
+	__mmask64 m = _mm512_movepi8_mask(v);
+
+	return _mm512_xor_si512(_mm512_add_epi8(v, v),
+		_mm512_maskz_mov_epi8(m, poly));
+}
+
+/*
+ * Multiply each byte by the constant of the specified pshufb tables.
+ */
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+__m512i avx512_mul(__m512i v, const uint8_t *lo, const uint8_t *hi, __m512i low4)
+{
+	__m512i tlo = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)lo));
+	__m512i thi = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)hi));
+
+	return _mm512_xor_si512(
+		_mm512_shuffle_epi8(tlo, _mm512_and_si512(v, low4)),
+		_mm512_shuffle_epi8(thi, _mm512_and_si512(_mm512_srli_epi16(v, 4), low4)));
+}
+
+/*
+ * GEN1 (RAID5 with xor) AVX512BW implementation
+ */
+__attribute__((target(AVX512BW_TARGET)))
+void raid_gen1_avx512bw(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+
+	for (i = 0; i < size; i += 64) {
+		__m512i p0 = avx512_load(&v[l][i]);
+
+		for (d = l - 1; d >= 0; --d)
+			p0 = _mm512_xor_si512(p0, avx512_load(&v[d][i]));
+
+		avx512_store(&p[i], p0);
+	}
+}
+
+/*
+ * GEN2..6 (RAID6 with powers of 2, and Cauchy matrix for the following
+ * parities) AVX512BW template
+ *
+ * The second parity uses powers of 2, computed with the Horner method
+ * starting from the last disk, like the other implementations.
+ */
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+void raid_genN_avx512bw(int np, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	const __m512i low4 = _mm512_set1_epi8(0x0f);
+	const __m512i poly = _mm512_set1_epi8(0x1d);
+	__m512i p[RAID_PARITY_MAX];
+	int d, j, l;
+	size_t i;
+
+	l = nd - 1;
+
+	for (i = 0; i < size; i += 64) {
+		/* last disk without the by two multiplication */
+		__m512i b = avx512_load(&v[l][i]);
+
+		p[0] = b;
+		p[1] = b;
+#pragma GCC unroll 4
+		for (j = 2; j < np; ++j)
+			p[j] = avx512_mul(b, gfgenpshufb[l][j - 2][0], gfgenpshufb[l][j - 2][1], low4);
+
+		for (d = l - 1; d >= 0; --d) {
+			b = avx512_load(&v[d][i]);
+
+			p[0] = _mm512_xor_si512(p[0], b);
+			p[1] = _mm512_xor_si512(avx512_x2(p[1], poly), b);
+#pragma GCC unroll 4
+			for (j = 2; j < np; ++j)
+				p[j] = _mm512_xor_si512(p[j],
+					avx512_mul(b, gfgenpshufb[d][j - 2][0], gfgenpshufb[d][j - 2][1], low4));
+		}
+
+#pragma GCC unroll 6
+		for (j = 0; j < np; ++j)
+			avx512_store(&v[nd + j][i], p[j]);
+	}
+}
+
+#define RAID_GEN_AVX512BW(np)						\
+__attribute__((target(AVX512BW_TARGET)))				\
+void raid_gen##np##_avx512bw(int nd, size_t size, void **vv)		\
+{									\
+	raid_genN_avx512bw(np, nd, size, vv);				\
+}
+
+RAID_GEN_AVX512BW(2)
+RAID_GEN_AVX512BW(3)
+RAID_GEN_AVX512BW(4)
+RAID_GEN_AVX512BW(5)
+RAID_GEN_AVX512BW(6)
+
+/*
+ * RAID recovering template
+ *
+ * Like raid_recX_avx2(), computes the delta parity with the generation
+ * functions, and then solves the linear system with the inverted matrix.
+ */
+static __always_inline void raid_recN_setup(int N, int *id, int *ip, int nd,
+	size_t size, void **vv, uint8_t *V, uint8_t **p, uint8_t **pa)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t G[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	int j, k;
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+}
+
+static __always_inline __attribute__((target(AVX512BW_TARGET)))
+void raid_recN_avx512bw(int N, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	const __m512i low4 = _mm512_set1_epi8(0x0f);
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	__m512i delta[RAID_PARITY_MAX];
+	size_t i;
+	int j, k;
+
+	/* if it's RAID5 uses the faster function */
+	if (N == 1 && ip[0] == 0) {
+		raid_rec1of1(id, nd, size, vv);
+		return;
+	}
+
+	raid_recN_setup(N, id, ip, nd, size, vv, V, p, pa);
+
+	for (i = 0; i < size; i += 64) {
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j)
+			delta[j] = _mm512_xor_si512(avx512_load(&p[j][i]),
+						    avx512_load(&pa[j][i]));
+
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j) {
+			__m512i b = _mm512_setzero_si512();
+
+#pragma GCC unroll 6
+			for (k = 0; k < N; ++k) {
+				uint8_t m = V[j * N + k];
+
+				b = _mm512_xor_si512(b, avx512_mul(delta[k],
+					gfmulpshufb[m][0], gfmulpshufb[m][1], low4));
+			}
+
+			avx512_store(&pa[j][i], b);
+		}
+	}
+}
+
+/*
+ * The number of failures is known only at runtime: dispatch to a version of
+ * the template specialized for it.
+ */
+#define RAID_REC_DISPATCH(fn, nr, ...)					\
+do {									\
+	switch (nr) {							\
+	case 1: fn(1, __VA_ARGS__); break;				\
+	case 2: fn(2, __VA_ARGS__); break;				\
+	case 3: fn(3, __VA_ARGS__); break;				\
+	case 4: fn(4, __VA_ARGS__); break;				\
+	case 5: fn(5, __VA_ARGS__); break;				\
+	case 6: fn(6, __VA_ARGS__); break;				\
+	default: BUG_ON(1);						\
+	}								\
+} while (0)
+
+__attribute__((target(AVX512BW_TARGET)))
+void raid_rec1_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 1 */
+
+	raid_recN_avx512bw(1, id, ip, nd, size, vv);
+}
+
+__attribute__((target(AVX512BW_TARGET)))
+void raid_rec2_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 2 */
+
+	raid_recN_avx512bw(2, id, ip, nd, size, vv);
+}
+
+__attribute__((target(AVX512BW_TARGET)))
+void raid_recX_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	RAID_REC_DISPATCH(raid_recN_avx512bw, nr, id, ip, nd, size, vv);
+}
+
+#ifdef CONFIG_GFNI
+/*
+ * Matrices for vgf2p8affineqb, multiplying by each GF(2^8) value.
+ *
+ * Bit i of the result is the parity of (x & byte[7 - i] of the matrix).
+ */
+static uint64_t gfaffine[256] __aligned(64);
+
+void raid_gfaffine_init(void)
+{
+	int c, i, j;
+
+	for (c = 0; c < 256; ++c) {
+		uint64_t m = 0;
+
+		for (i = 0; i < 8; ++i) {
+			uint8_t row = 0;
+
+			for (j = 0; j < 8; ++j)
+				if (mul(c, 1 << j) & (1 << i))
+					row |= 1 << j;
+
+			m |= (uint64_t)row << ((7 - i) * 8);
+		}
+
+		gfaffine[c] = m;
+	}
+}
+
+static __always_inline __attribute__((target(GFNI_TARGET)))
+__m512i gfni_mul(__m512i v, uint8_t c)
+{
+	return _mm512_gf2p8affine_epi64_epi8(v, _mm512_set1_epi64(gfaffine[c]), 0);
+}
+
+/*
+ * GEN2..6 GFNI template
+ *
+ * Every coefficient is a single affine transformation, so there's no need for
+ * the Horner method.
+ */
+static __always_inline __attribute__((target(GFNI_TARGET)))
+void raid_genN_gfni(int np, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	__m512i p[RAID_PARITY_MAX];
+	int d, j, l;
+	size_t i;
+
+	l = nd - 1;
+
+	for (i = 0; i < size; i += 64) {
+		__m512i b = avx512_load(&v[l][i]);
+
+		p[0] = b;
+#pragma GCC unroll 5
+		for (j = 1; j < np; ++j)
+			p[j] = gfni_mul(b, gfcauchy[j][l]);
+
+		for (d = l - 1; d >= 0; --d) {
+			b = avx512_load(&v[d][i]);
+
+			p[0] = _mm512_xor_si512(p[0], b);
+#pragma GCC unroll 5
+			for (j = 1; j < np; ++j)
+				p[j] = _mm512_xor_si512(p[j], gfni_mul(b, gfcauchy[j][d]));
+		}
+
+#pragma GCC unroll 6
+		for (j = 0; j < np; ++j)
+			avx512_store(&v[nd + j][i], p[j]);
+	}
+}
+
+#define RAID_GEN_GFNI(np)						\
+__attribute__((target(GFNI_TARGET)))					\
+void raid_gen##np##_gfni(int nd, size_t size, void **vv)		\
+{									\
+	raid_genN_gfni(np, nd, size, vv);				\
+}
+
+RAID_GEN_GFNI(2)
+RAID_GEN_GFNI(3)
+RAID_GEN_GFNI(4)
+RAID_GEN_GFNI(5)
+RAID_GEN_GFNI(6)
+
+static __always_inline __attribute__((target(GFNI_TARGET)))
+void raid_recN_gfni(int N, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	__m512i delta[RAID_PARITY_MAX];
+	size_t i;
+	int j, k;
+
+	if (N == 1 && ip[0] == 0) {
+		raid_rec1of1(id, nd, size, vv);
+		return;
+	}
+
+	raid_recN_setup(N, id, ip, nd, size, vv, V, p, pa);
+
+	for (i = 0; i < size; i += 64) {
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j)
+			delta[j] = _mm512_xor_si512(avx512_load(&p[j][i]),
+						    avx512_load(&pa[j][i]));
+
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j) {
+			__m512i b = gfni_mul(delta[0], V[j * N]);
+
+#pragma GCC unroll 5
+			for (k = 1; k < N; ++k)
+				b = _mm512_xor_si512(b, gfni_mul(delta[k], V[j * N + k]));
+
+			avx512_store(&pa[j][i], b);
+		}
+	}
+}
+
+__attribute__((target(GFNI_TARGET)))
+void raid_rec1_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 1 */
+
+	raid_recN_gfni(1, id, ip, nd, size, vv);
+}
+
+__attribute__((target(GFNI_TARGET)))
+void raid_rec2_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 2 */
+
+	raid_recN_gfni(2, id, ip, nd, size, vv);
+}
+
+__attribute__((target(GFNI_TARGET)))
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	RAID_REC_DISPATCH(raid_recN_gfni, nr, id, ip, nd, size, vv);
+}
+#endif /* CONFIG_GFNI */
+
+#endif
@@ -212,6 +212,26 @@ static inline int raid_cpu_has_avx512bw(void)
 		(3 << 1) | (7 << 5)); /* OS saves XMM, YMM and ZMM registers */
 }
 
+static inline int raid_cpu_has_gfni(void)
+{
+	uint32_t reg[4];
+
+	/*
+	 * Intel Architecture Instruction Set Extensions Programming Reference
+	 * 319433-037 May 2019
+	 *
+	 * 1.3 Detection of Future Instructions
+	 * GFNI is indicated by CPUID.(EAX=07H, ECX=0H):ECX.GFNI[bit 8].
+	 *
+	 * We only use it with 512 bit registers, so also require AVX512BW.
+	 */
+	if (!raid_cpu_has_avx512bw())
+		return 0;
+
+	raid_cpuid(7, 0, reg);
+	return (reg[2] & (1 << 8)) != 0;
+}
+
 /**
  * Check if it's an Intel Atom CPU.
  */
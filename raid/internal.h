@@ -53,6 +53,12 @@
 #if HAVE_AVX2
 #define CONFIG_AVX2 1
 #endif
+#if HAVE_AVX512BW
+#define CONFIG_AVX512BW 1
+#endif
+#if HAVE_GFNI
+#define CONFIG_GFNI 1
+#endif
 
 #else /* if HAVE_CONFIG_H is not defined */
 
@@ -73,6 +79,18 @@
 #define CONFIG_SSSE3 1
 #define CONFIG_AVX2 1
 #endif
+
+/* AVX-512 and GFNI are only for x64, and need a compiler supporting them */
+#if defined(CONFIG_X86_64) && defined(__GNUC__) && (__GNUC__ >= 9 || defined(__clang__))
+#define CONFIG_AVX512BW 1
+#define CONFIG_GFNI 1
+#endif
+#endif
+
+/* NEON is always present on ARMv8, and needs no assembler support */
+#if defined(__aarch64__)
+#define CONFIG_ARM64 1
+#define CONFIG_NEON 1
 #endif
 
 /*
@@ -170,6 +188,33 @@ void raid_recX_ssse3(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec1_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec2_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_gen1_avx512bw(int nd, size_t size, void **vv);
+void raid_gen2_avx512bw(int nd, size_t size, void **vv);
+void raid_gen3_avx512bw(int nd, size_t size, void **vv);
+void raid_gen4_avx512bw(int nd, size_t size, void **vv);
+void raid_gen5_avx512bw(int nd, size_t size, void **vv);
+void raid_gen6_avx512bw(int nd, size_t size, void **vv);
+void raid_rec1_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_rec2_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_gfaffine_init(void);
+void raid_gen2_gfni(int nd, size_t size, void **vv);
+void raid_gen3_gfni(int nd, size_t size, void **vv);
+void raid_gen4_gfni(int nd, size_t size, void **vv);
+void raid_gen5_gfni(int nd, size_t size, void **vv);
+void raid_gen6_gfni(int nd, size_t size, void **vv);
+void raid_rec1_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_rec2_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_gen1_neon(int nd, size_t size, void **vv);
+void raid_gen2_neon(int nd, size_t size, void **vv);
+void raid_gen3_neon(int nd, size_t size, void **vv);
+void raid_gen4_neon(int nd, size_t size, void **vv);
+void raid_gen5_neon(int nd, size_t size, void **vv);
+void raid_gen6_neon(int nd, size_t size, void **vv);
+void raid_rec1_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_rec2_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 
 /*
  * Internal naming.
@@ -110,8 +110,58 @@ void raid_init(void)
 		raid_rec_ptr[5] = raid_recX_avx2;
 	}
 #endif
+
+#ifdef CONFIG_AVX512BW
+	if (raid_cpu_has_avx512bw()) {
+		raid_gen_ptr[0] = raid_gen1_avx512bw;
+		raid_gen_ptr[1] = raid_gen2_avx512bw;
+		raid_gen3_ptr = raid_gen3_avx512bw;
+		raid_gen_ptr[3] = raid_gen4_avx512bw;
+		raid_gen_ptr[4] = raid_gen5_avx512bw;
+		raid_gen_ptr[5] = raid_gen6_avx512bw;
+		raid_rec_ptr[0] = raid_rec1_avx512bw;
+		raid_rec_ptr[1] = raid_rec2_avx512bw;
+		raid_rec_ptr[2] = raid_recX_avx512bw;
+		raid_rec_ptr[3] = raid_recX_avx512bw;
+		raid_rec_ptr[4] = raid_recX_avx512bw;
+		raid_rec_ptr[5] = raid_recX_avx512bw;
+	}
+#endif
+
+#ifdef CONFIG_GFNI
+	if (raid_cpu_has_gfni()) {
+		raid_gfaffine_init();
+
+		raid_gen_ptr[1] = raid_gen2_gfni;
+		raid_gen3_ptr = raid_gen3_gfni;
+		raid_gen_ptr[3] = raid_gen4_gfni;
+		raid_gen_ptr[4] = raid_gen5_gfni;
+		raid_gen_ptr[5] = raid_gen6_gfni;
+		raid_rec_ptr[0] = raid_rec1_gfni;
+		raid_rec_ptr[1] = raid_rec2_gfni;
+		raid_rec_ptr[2] = raid_recX_gfni;
+		raid_rec_ptr[3] = raid_recX_gfni;
+		raid_rec_ptr[4] = raid_recX_gfni;
+		raid_rec_ptr[5] = raid_recX_gfni;
+	}
+#endif
 #endif /* CONFIG_X86 */
 
+#ifdef CONFIG_NEON
+	raid_gen_ptr[0] = raid_gen1_neon;
+	raid_gen_ptr[1] = raid_gen2_neon;
+	raid_gen3_ptr = raid_gen3_neon;
+	raid_gen_ptr[3] = raid_gen4_neon;
+	raid_gen_ptr[4] = raid_gen5_neon;
+	raid_gen_ptr[5] = raid_gen6_neon;
+	raid_rec_ptr[0] = raid_rec1_neon;
+	raid_rec_ptr[1] = raid_rec2_neon;
+	raid_rec_ptr[2] = raid_recX_neon;
+	raid_rec_ptr[3] = raid_recX_neon;
+	raid_rec_ptr[4] = raid_recX_neon;
+	raid_rec_ptr[5] = raid_recX_neon;
+#endif
+
 	/* set the default mode */
 	raid_mode(RAID_MODE_CAUCHY);
 }
@@ -0,0 +1,236 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "internal.h"
+#include "gf.h"
+
+/*
+ * ARMv8 NEON implementations.
+ *
+ * tbl on a 16 byte table is the same lookup as pshufb, so these use the same
+ * nibble tables as the SSSE3 code. Two 16 byte vectors are processed at a
+ * time, to hide the latency of the lookups.
+ */
+
+#if defined(CONFIG_NEON)
+
+#include <arm_neon.h>
+
+/*
+ * Multiply each byte by 2.
+ */
+static __always_inline uint8x16_t neon_x2(uint8x16_t v, uint8x16_t poly)
+{
+	uint8x16_t m = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+
+	return veorq_u8(vshlq_n_u8(v, 1), vandq_u8(m, poly));
+}
+
+/*
+ * Multiply each byte by the constant of the specified pshufb tables.
+ */
+static __always_inline uint8x16_t neon_mul(uint8x16_t v, uint8x16_t tlo, uint8x16_t thi)
+{
+	return veorq_u8(vqtbl1q_u8(tlo, vandq_u8(v, vdupq_n_u8(0x0f))),
+			vqtbl1q_u8(thi, vshrq_n_u8(v, 4)));
+}
+
+/*
+ * GEN1 (RAID5 with xor) NEON implementation
+ */
+void raid_gen1_neon(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+
+	for (i = 0; i < size; i += 32) {
+		uint8x16_t p0 = vld1q_u8(&v[l][i]);
+		uint8x16_t p1 = vld1q_u8(&v[l][i + 16]);
+
+		for (d = l - 1; d >= 0; --d) {
+			p0 = veorq_u8(p0, vld1q_u8(&v[d][i]));
+			p1 = veorq_u8(p1, vld1q_u8(&v[d][i + 16]));
+		}
+
+		vst1q_u8(&p[i], p0);
+		vst1q_u8(&p[i + 16], p1);
+	}
+}
+
+/*
+ * GEN2..6 (RAID6 with powers of 2, and Cauchy matrix for the following
+ * parities) NEON template
+ */
+static __always_inline void raid_genN_neon(int np, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	const uint8x16_t poly = vdupq_n_u8(0x1d);
+	uint8x16_t p[RAID_PARITY_MAX], q[RAID_PARITY_MAX];
+	int d, j, l;
+	size_t i;
+
+	l = nd - 1;
+
+	for (i = 0; i < size; i += 32) {
+		/* last disk without the by two multiplication */
+		uint8x16_t a = vld1q_u8(&v[l][i]);
+		uint8x16_t b = vld1q_u8(&v[l][i + 16]);
+
+		p[0] = p[1] = a;
+		q[0] = q[1] = b;
+#pragma GCC unroll 4
+		for (j = 2; j < np; ++j) {
+			uint8x16_t tlo = vld1q_u8(gfgenpshufb[l][j - 2][0]);
+			uint8x16_t thi = vld1q_u8(gfgenpshufb[l][j - 2][1]);
+
+			p[j] = neon_mul(a, tlo, thi);
+			q[j] = neon_mul(b, tlo, thi);
+		}
+
+		for (d = l - 1; d >= 0; --d) {
+			a = vld1q_u8(&v[d][i]);
+			b = vld1q_u8(&v[d][i + 16]);
+
+			p[0] = veorq_u8(p[0], a);
+			q[0] = veorq_u8(q[0], b);
+			p[1] = veorq_u8(neon_x2(p[1], poly), a);
+			q[1] = veorq_u8(neon_x2(q[1], poly), b);
+#pragma GCC unroll 4
+			for (j = 2; j < np; ++j) {
+				uint8x16_t tlo = vld1q_u8(gfgenpshufb[d][j - 2][0]);
+				uint8x16_t thi = vld1q_u8(gfgenpshufb[d][j - 2][1]);
+
+				p[j] = veorq_u8(p[j], neon_mul(a, tlo, thi));
+				q[j] = veorq_u8(q[j], neon_mul(b, tlo, thi));
+			}
+		}
+
+#pragma GCC unroll 6
+		for (j = 0; j < np; ++j) {
+			vst1q_u8(&v[nd + j][i], p[j]);
+			vst1q_u8(&v[nd + j][i + 16], q[j]);
+		}
+	}
+}
+
+#define RAID_GEN_NEON(np)						\
+void raid_gen##np##_neon(int nd, size_t size, void **vv)		\
+{									\
+	raid_genN_neon(np, nd, size, vv);				\
+}
+
+RAID_GEN_NEON(2)
+RAID_GEN_NEON(3)
+RAID_GEN_NEON(4)
+RAID_GEN_NEON(5)
+RAID_GEN_NEON(6)
+
+/*
+ * RAID recovering template
+ *
+ * Like raid_recX_avx2(), computes the delta parity with the generation
+ * functions, and then solves the linear system with the inverted matrix.
+ */
+static __always_inline void raid_recN_neon(int N, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t G[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8x16_t da[RAID_PARITY_MAX], db[RAID_PARITY_MAX];
+	size_t i;
+	int j, k;
+
+	/* if it's RAID5 uses the faster function */
+	if (N == 1 && ip[0] == 0) {
+		raid_rec1of1(id, nd, size, vv);
+		return;
+	}
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	for (i = 0; i < size; i += 32) {
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j) {
+			da[j] = veorq_u8(vld1q_u8(&p[j][i]), vld1q_u8(&pa[j][i]));
+			db[j] = veorq_u8(vld1q_u8(&p[j][i + 16]), vld1q_u8(&pa[j][i + 16]));
+		}
+
+#pragma GCC unroll 6
+		for (j = 0; j < N; ++j) {
+			uint8x16_t a = vdupq_n_u8(0);
+			uint8x16_t b = vdupq_n_u8(0);
+
+#pragma GCC unroll 6
+			for (k = 0; k < N; ++k) {
+				uint8_t m = V[j * N + k];
+				uint8x16_t tlo = vld1q_u8(gfmulpshufb[m][0]);
+				uint8x16_t thi = vld1q_u8(gfmulpshufb[m][1]);
+
+				a = veorq_u8(a, neon_mul(da[k], tlo, thi));
+				b = veorq_u8(b, neon_mul(db[k], tlo, thi));
+			}
+
+			vst1q_u8(&pa[j][i], a);
+			vst1q_u8(&pa[j][i + 16], b);
+		}
+	}
+}
+
+void raid_rec1_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 1 */
+
+	raid_recN_neon(1, id, ip, nd, size, vv);
+}
+
+void raid_rec2_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	(void)nr; /* unused, it's always 2 */
+
+	raid_recN_neon(2, id, ip, nd, size, vv);
+}
+
+void raid_recX_neon(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	switch (nr) {
+	case 1: raid_recN_neon(1, id, ip, nd, size, vv); break;
+	case 2: raid_recN_neon(2, id, ip, nd, size, vv); break;
+	case 3: raid_recN_neon(3, id, ip, nd, size, vv); break;
+	case 4: raid_recN_neon(4, id, ip, nd, size, vv); break;
+	case 5: raid_recN_neon(5, id, ip, nd, size, vv); break;
+	case 6: raid_recN_neon(6, id, ip, nd, size, vv); break;
+	default: BUG_ON(1);
+	}
+}
+
+#endif
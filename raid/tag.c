@@ -74,6 +74,39 @@ static struct raid_func {
 	{ "avx2e", raid_gen5_avx2ext },
 	{ "avx2e", raid_gen6_avx2ext },
 #endif
+#ifdef CONFIG_AVX512BW
+	{ "avx512bw", raid_gen1_avx512bw },
+	{ "avx512bw", raid_gen2_avx512bw },
+	{ "avx512bw", raid_gen3_avx512bw },
+	{ "avx512bw", raid_gen4_avx512bw },
+	{ "avx512bw", raid_gen5_avx512bw },
+	{ "avx512bw", raid_gen6_avx512bw },
+	{ "avx512bw", raid_rec1_avx512bw },
+	{ "avx512bw", raid_rec2_avx512bw },
+	{ "avx512bw", raid_recX_avx512bw },
+#endif
+#ifdef CONFIG_GFNI
+	{ "gfni", raid_gen2_gfni },
+	{ "gfni", raid_gen3_gfni },
+	{ "gfni", raid_gen4_gfni },
+	{ "gfni", raid_gen5_gfni },
+	{ "gfni", raid_gen6_gfni },
+	{ "gfni", raid_rec1_gfni },
+	{ "gfni", raid_rec2_gfni },
+	{ "gfni", raid_recX_gfni },
+#endif
+#endif
+
+#ifdef CONFIG_NEON
+	{ "neon", raid_gen1_neon },
+	{ "neon", raid_gen2_neon },
+	{ "neon", raid_gen3_neon },
+	{ "neon", raid_gen4_neon },
+	{ "neon", raid_gen5_neon },
+	{ "neon", raid_gen6_neon },
+	{ "neon", raid_rec1_neon },
+	{ "neon", raid_rec2_neon },
+	{ "neon", raid_recX_neon },
 #endif
 	{ 0, 0 }
 };
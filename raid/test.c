@@ -145,7 +145,7 @@ int raid_test_sort(void)
 
 int raid_test_rec(int mode, int nd, size_t size)
 {
-	void (*f[RAID_PARITY_MAX][4])(
+	void (*f[RAID_PARITY_MAX][8])(
 		int nr, int *id, int *ip, int nd, size_t size, void **vbuf);
 	void *v_alloc;
 	void **v;
@@ -208,6 +208,17 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_rec1_avx2;
 #endif
+#ifdef CONFIG_AVX512BW
+			if (raid_cpu_has_avx512bw())
+				f[i][nf[i]++] = raid_rec1_avx512bw;
+#endif
+#ifdef CONFIG_GFNI
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_rec1_gfni;
+#endif
+#endif
+#ifdef CONFIG_NEON
+			f[i][nf[i]++] = raid_rec1_neon;
 #endif
 		} else if (i == 1) {
 			f[i][nf[i]++] = raid_rec2_int8;
@@ -220,6 +231,17 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_rec2_avx2;
 #endif
+#ifdef CONFIG_AVX512BW
+			if (raid_cpu_has_avx512bw())
+				f[i][nf[i]++] = raid_rec2_avx512bw;
+#endif
+#ifdef CONFIG_GFNI
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_rec2_gfni;
+#endif
+#endif
+#ifdef CONFIG_NEON
+			f[i][nf[i]++] = raid_rec2_neon;
 #endif
 		} else {
 			f[i][nf[i]++] = raid_recX_int8;
@@ -232,6 +254,17 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_recX_avx2;
 #endif
+#ifdef CONFIG_AVX512BW
+			if (raid_cpu_has_avx512bw())
+				f[i][nf[i]++] = raid_recX_avx512bw;
+#endif
+#ifdef CONFIG_GFNI
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_recX_gfni;
+#endif
+#endif
+#ifdef CONFIG_NEON
+			f[i][nf[i]++] = raid_recX_neon;
 #endif
 		}
 	}
@@ -365,8 +398,25 @@ int raid_test_par(int mode, int nd, size_t size)
 		f[nf++] = raid_gen2_avx2;
 	}
 #endif
+
+#ifdef CONFIG_AVX512BW
+	if (raid_cpu_has_avx512bw()) {
+		f[nf++] = raid_gen1_avx512bw;
+		f[nf++] = raid_gen2_avx512bw;
+	}
+#endif
+
+#ifdef CONFIG_GFNI
+	if (raid_cpu_has_gfni())
+		f[nf++] = raid_gen2_gfni;
+#endif
 #endif /* CONFIG_X86 */
 
+#ifdef CONFIG_NEON
+	f[nf++] = raid_gen1_neon;
+	f[nf++] = raid_gen2_neon;
+#endif
+
 	if (mode == RAID_MODE_CAUCHY) {
 		f[nf++] = raid_gen3_int8;
 		f[nf++] = raid_gen4_int8;
@@ -399,7 +449,32 @@ int raid_test_par(int mode, int nd, size_t size)
 		}
 #endif
 #endif
+
+#ifdef CONFIG_AVX512BW
+		if (raid_cpu_has_avx512bw()) {
+			f[nf++] = raid_gen3_avx512bw;
+			f[nf++] = raid_gen4_avx512bw;
+			f[nf++] = raid_gen5_avx512bw;
+			f[nf++] = raid_gen6_avx512bw;
+		}
+#endif
+
+#ifdef CONFIG_GFNI
+		if (raid_cpu_has_gfni()) {
+			f[nf++] = raid_gen3_gfni;
+			f[nf++] = raid_gen4_gfni;
+			f[nf++] = raid_gen5_gfni;
+			f[nf++] = raid_gen6_gfni;
+		}
+#endif
 #endif /* CONFIG_X86 */
+
+#ifdef CONFIG_NEON
+		f[nf++] = raid_gen3_neon;
+		f[nf++] = raid_gen4_neon;
+		f[nf++] = raid_gen5_neon;
+		f[nf++] = raid_gen6_neon;
+#endif
 	} else {
 		f[nf++] = raid_genz_int32;
 		f[nf++] = raid_genz_int64;
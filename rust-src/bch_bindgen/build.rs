@@ -36,6 +36,7 @@ fn main() {
 		.allowlist_function("bio_.*")
 		.allowlist_function("bch2_super_write_fd")
 		.allowlist_function("derive_passphrase")
+		.allowlist_function("derive_passphrase_cached")
 		.allowlist_function("request_key")
 		.allowlist_function("add_key")
 		.allowlist_function("keyctl_search")
@@ -159,6 +159,20 @@ use bch_bindgen::bcachefs;
 use std::collections::HashMap;
 use uuid::Uuid;
 
+/// Superblock read on a probe thread; the handle is owned by exactly one thread
+/// at a time, it's only created on the probe thread and then moved back.
+struct ProbeResult(usize, PathBuf, std::io::Result<std::io::Result<(Uuid, bcachefs::bch_sb_handle)>>);
+unsafe impl Send for ProbeResult {}
+
+/// Whether udev's own (blkid) probe says this can't be a bcachefs member: if
+/// it's already identified the device as something else, don't read it again.
+fn udev_skip_device(dev: &udev::Device) -> bool {
+	match dev.property_value("ID_FS_TYPE") {
+		Some(fstype) => fstype != "bcachefs",
+		None => false,
+	}
+}
+
 #[tracing_attributes::instrument]
 pub fn probe_filesystems() -> anyhow::Result<HashMap<Uuid, FileSystem>> {
 	tracing::trace!("enumerating udev devices");
@@ -167,13 +181,50 @@ pub fn probe_filesystems() -> anyhow::Result<HashMap<Uuid, FileSystem>> {
 	udev.match_subsystem("block")?; // find kernel block devices
 
 	let mut fs_map = HashMap::new();
-	let devresults = 
+	let devresults: Vec<PathBuf> =
 			udev.scan_devices()?
 			.into_iter()
-			.filter_map(|dev| dev.devnode().map(ToOwned::to_owned));
-	
-	for pathbuf in devresults {
-		match get_super_block_uuid(&pathbuf)? {
+			.filter(|dev| !udev_skip_device(dev))
+			.filter_map(|dev| dev.devnode().map(ToOwned::to_owned))
+			.collect();
+
+	/*
+	 * Reading superblocks is dominated by device latency (spinning disks
+	 * spinning up, slow USB/SAN devices), so read them concurrently:
+	 */
+	let nr_threads = std::thread::available_parallelism()
+		.map(|n| n.get())
+		.unwrap_or(1)
+		.max(4)
+		.min(devresults.len().max(1));
+	let next = std::sync::atomic::AtomicUsize::new(0);
+
+	let mut results: Vec<ProbeResult> = std::thread::scope(|s| {
+		let workers: Vec<_> = (0..nr_threads)
+			.map(|_| s.spawn(|| {
+				let mut ret = Vec::new();
+				loop {
+					let i = next.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+					let pathbuf = match devresults.get(i) {
+						Some(p) => p,
+						None => break,
+					};
+					ret.push(ProbeResult(i, pathbuf.clone(), get_super_block_uuid(pathbuf)));
+				}
+				ret
+			}))
+			.collect();
+
+		workers.into_iter()
+			.flat_map(|w| w.join().expect("superblock probe thread panicked"))
+			.collect()
+	});
+
+	// keep member device order stable, same as the udev enumeration order
+	results.sort_by_key(|r| r.0);
+
+	for ProbeResult(_, pathbuf, result) in results {
+		match result? {
 
 				Ok((uuid_key, superblock)) => {
 					let fs = fs_map.entry(uuid_key).or_insert_with(|| {
@@ -29,7 +29,7 @@ fn wait_for_key(uuid: &uuid::Uuid) -> anyhow::Result<()> {
 
 const BCH_KEY_MAGIC: &str = "bch**key";
 use crate::filesystem::FileSystem;
-fn ask_for_key(fs: &FileSystem) -> anyhow::Result<()> {
+fn ask_for_key(fs: &FileSystem, kdf_cache_ttl: u32) -> anyhow::Result<()> {
 	use anyhow::anyhow;
 	use byteorder::{LittleEndian, ReadBytesExt};
 	use bch_bindgen::bcachefs::{self, bch2_chacha_encrypt_key, bch_encrypted_key, bch_key};
@@ -45,9 +45,11 @@ fn ask_for_key(fs: &FileSystem) -> anyhow::Result<()> {
 	let pass = rpassword::read_password_from_tty(Some("Enter passphrase: "))?;
 	let pass = std::ffi::CString::new(pass.trim_end())?; // bind to keep the CString alive
 	let mut output: bch_key = unsafe {
-		bcachefs::derive_passphrase(
-			crypt as *const _ as *mut _,
+		bcachefs::derive_passphrase_cached(
+			fs.sb().sb() as *const _ as *mut _,
 			pass.as_c_str().to_bytes_with_nul().as_ptr() as *const _,
+			bch_bindgen::keyutils::KEY_SPEC_USER_KEYRING,
+			kdf_cache_ttl,
 		)
 	};
 
@@ -84,7 +86,7 @@ fn ask_for_key(fs: &FileSystem) -> anyhow::Result<()> {
 }
 
 #[tracing_attributes::instrument]
-pub fn prepare_key(fs: &FileSystem, password: crate::KeyLocation) -> anyhow::Result<()> {
+pub fn prepare_key(fs: &FileSystem, password: crate::KeyLocation, kdf_cache_ttl: u32) -> anyhow::Result<()> {
 	use crate::KeyLocation::*;
 	use anyhow::anyhow;
 
@@ -92,6 +94,6 @@ pub fn prepare_key(fs: &FileSystem, password: crate::KeyLocation) -> anyhow::Res
 	match password {
 		Fail => Err(anyhow!("no key available")),
 		Wait => Ok(wait_for_key(fs.uuid())?),
-		Ask => ask_for_key(fs),
+		Ask => ask_for_key(fs, kdf_cache_ttl),
 	}
 }
@@ -72,6 +72,12 @@ pub struct Options {
 	#[structopt(short, long, default_value = "")]
 	pub key_location: KeyLoc,
 
+	/// Cache the key derived from the passphrase in the user keyring for this
+	/// many seconds, so that mounting other filesystems with the same
+	/// passphrase doesn't rerun the key derivation function. 0 disables it.
+	#[structopt(long, default_value = "0")]
+	pub kdf_cache_ttl: u32,
+
 	/// External UUID of the bcachefs filesystem
 	pub uuid: uuid::Uuid,
 
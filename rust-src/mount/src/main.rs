@@ -41,7 +41,7 @@ pub fn main_inner() -> anyhow::Result<()> {
 			.0
 			.ok_or_else(|| anyhow::anyhow!("no keyoption specified for locked filesystem"))?;
 
-		key::prepare_key(&fs, key)?;
+		key::prepare_key(&fs, key, opt.kdf_cache_ttl)?;
 	}
 
 	let mountpoint = opt
@@ -0,0 +1,325 @@
+#!/usr/bin/python3
+#
+# Filesystem level benchmarks, for tracking performance across releases.
+#
+# Formats a scratch image (on tmpfs, if /dev/shm is available, so that we
+# measure bcachefs and not the backing device), and times the CLI commands and
+# - when built with fuse support - I/O and metadata operations through a fuse
+# mount. Results are written as JSON, along with the git revision they were
+# taken at:
+#
+#   python3 -m tests.bench [-o results.json] [benchmarks...]
+
+import argparse
+import contextlib
+import json
+import os
+import platform
+import random
+import shutil
+import sys
+import tempfile
+import time
+
+from pathlib import Path
+from tests import util
+
+BLOCK = 4096
+
+class Bench:
+    '''State shared by the benchmarks: the scratch directory and options.'''
+
+    def __init__(self, tmpdir, size, file_size, nr_files):
+        self.tmpdir = Path(tmpdir)
+        self.size = size
+        self.file_size = file_size
+        self.nr_files = nr_files
+        self.results = {}
+        self.seq_dev = None
+        self.pop_dev = None
+
+    def device(self, name='dev'):
+        path = self.tmpdir / name
+        if path.exists():
+            path.unlink()
+        return util.sparse_file(path, self.size)
+
+    def format(self, name='dev'):
+        dev = self.device(name)
+        util.run_bch('format', '-q', dev, check=True)
+        return dev
+
+    def populated_dev(self):
+        '''A filesystem with nr_files files, for fsck/list/dump.
+
+        Without fuse support there's no way to populate it, so those then run
+        on an empty filesystem.
+        '''
+        if not self.pop_dev:
+            if util.have_fuse():
+                self.pop_dev = with_fuse(self,
+                        lambda mnt: populated(self, mnt), 'populated')
+            else:
+                self.pop_dev = self.format('populated')
+        return self.pop_dev
+
+    def record(self, name, secs, nr=None, unit='ops'):
+        r = { 'secs': secs }
+        if nr is not None:
+            r[unit] = nr
+            r[unit + '_per_sec'] = nr / secs if secs else 0
+        self.results[name] = r
+        print('{:<24} {:10.3f}s'.format(name, secs) +
+              ('  {:14.1f} {}/sec'.format(r[unit + '_per_sec'], unit)
+               if nr is not None else ''))
+
+class Timer:
+    def __enter__(self):
+        self.start = time.perf_counter()
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.secs = time.perf_counter() - self.start
+
+def timed_bch(*args):
+    with Timer() as t:
+        util.run_bch(*args, check=True)
+    return t.secs
+
+def populated(b, mnt):
+    '''Fill a directory tree with nr_files small files.'''
+    buf = os.urandom(BLOCK)
+    for i in range(b.nr_files):
+        d = mnt / 'd{}'.format(i % 64)
+        d.mkdir(exist_ok=True)
+        with open(d / 'f{}'.format(i), 'wb') as f:
+            f.write(buf[:random.randrange(1, BLOCK)])
+
+def with_fuse(b, fn, name='dev'):
+    '''Run fn on a fresh fuse mount; returns the device, unmounted.'''
+    dev = b.format(name)
+    mnt = b.tmpdir / 'mnt'
+    mnt.mkdir(exist_ok=True)
+
+    fuse = util.BFuse(dev, mnt)
+    fuse.mount()
+    try:
+        fn(mnt)
+    finally:
+        fuse.unmount(timeout=60.0)
+    return dev
+
+# CLI benchmarks:
+
+def bench_format(b):
+    dev = b.device()
+    b.record('format', timed_bch('format', '-q', dev))
+
+def bench_fsck(b):
+    dev = b.populated_dev()
+    b.record('fsck', timed_bch('fsck', '-n', dev))
+
+def bench_list(b):
+    dev = b.populated_dev()
+    b.record('list', timed_bch('list', '-b', 'extents', dev))
+
+def bench_dump(b):
+    dev = b.populated_dev()
+    b.record('dump', timed_bch('dump', '-f', '-o', b.tmpdir / 'dump', dev))
+    for f in b.tmpdir.glob('dump*'):
+        f.unlink()
+
+def bench_migrate(b):
+    '''Migrate an ext4 loop mount in place: needs root and mkfs.ext4.'''
+    if os.geteuid() != 0 or not shutil.which('mkfs.ext4'):
+        print('migrate: skipped, needs root and mkfs.ext4')
+        return
+
+    dev = b.device('ext4')
+    mnt = b.tmpdir / 'ext4-mnt'
+    mnt.mkdir(exist_ok=True)
+
+    util.run('mkfs.ext4', '-q', '-F', dev, check=True)
+    util.run('mount', '-o', 'loop', dev, mnt, check=True)
+    try:
+        populated(b, mnt)
+        b.record('migrate', timed_bch('migrate', '-f', mnt, '-F'),
+                 b.nr_files, 'files')
+    finally:
+        util.run('umount', mnt)
+
+# Benchmarks through a fuse mount:
+
+def bench_seq_write(b):
+    secs = 0
+    def fn(mnt):
+        nonlocal secs
+        buf = os.urandom(1 << 20)
+        with Timer() as t:
+            fd = os.open(mnt / 'seq', os.O_CREAT|os.O_WRONLY, 0o600)
+            for off in range(0, b.file_size, len(buf)):
+                os.pwrite(fd, buf, off)
+            os.fsync(fd)
+            os.close(fd)
+        secs = t.secs
+    b.seq_dev = with_fuse(b, fn, 'seq')
+    b.record('seq_write', secs, b.file_size >> 20, 'MiB')
+
+def read_file(b, offsets, bs):
+    '''Read a file from bench_seq_write() back, on a fresh mount.'''
+    secs = 0
+    def fn(mnt):
+        nonlocal secs
+        fd = os.open(mnt / 'seq', os.O_RDONLY)
+        with Timer() as t:
+            for off in offsets:
+                os.pread(fd, bs, off)
+        os.close(fd)
+        secs = t.secs
+
+    if not b.seq_dev:
+        bench_seq_write(b)
+
+    mnt = b.tmpdir / 'mnt'
+    fuse = util.BFuse(b.seq_dev, mnt)
+    fuse.mount()
+    try:
+        fn(mnt)
+    finally:
+        fuse.unmount(timeout=60.0)
+    return secs
+
+def bench_seq_read(b):
+    bs = 1 << 20
+    secs = read_file(b, range(0, b.file_size, bs), bs)
+    b.record('seq_read', secs, b.file_size >> 20, 'MiB')
+
+def bench_rand_read(b):
+    nr = b.file_size // BLOCK // 4
+    offsets = [random.randrange(b.file_size // BLOCK) * BLOCK
+               for i in range(nr)]
+    b.record('rand_read', read_file(b, offsets, BLOCK), nr)
+
+def bench_rand_write(b):
+    nr = b.file_size // BLOCK // 4
+    secs = 0
+    def fn(mnt):
+        nonlocal secs
+        buf = os.urandom(BLOCK)
+        fd = os.open(mnt / 'rand', os.O_CREAT|os.O_WRONLY, 0o600)
+        os.truncate(fd, b.file_size)
+        with Timer() as t:
+            for i in range(nr):
+                os.pwrite(fd, buf,
+                          random.randrange(b.file_size // BLOCK) * BLOCK)
+            os.fsync(fd)
+        os.close(fd)
+        secs = t.secs
+    with_fuse(b, fn)
+    b.record('rand_write', secs, nr)
+
+def bench_metadata(b):
+    '''create/stat/unlink storm, each phase timed separately.'''
+    secs = {}
+    def fn(mnt):
+        paths = [mnt / 'f{}'.format(i) for i in range(b.nr_files)]
+        for name, op in [
+                ('create', lambda p: os.close(os.open(p, os.O_CREAT, 0o600))),
+                ('stat',   os.stat),
+                ('unlink', os.unlink)]:
+            with Timer() as t:
+                for p in paths:
+                    op(p)
+            secs[name] = t.secs
+    with_fuse(b, fn)
+    for name, s in secs.items():
+        b.record(name, s, b.nr_files)
+
+CLI_BENCHMARKS = {
+    'format':		bench_format,
+    'fsck':		bench_fsck,
+    'list':		bench_list,
+    'dump':		bench_dump,
+    'migrate':		bench_migrate,
+}
+
+FUSE_BENCHMARKS = {
+    'seq_write':	bench_seq_write,
+    'seq_read':		bench_seq_read,
+    'rand_read':	bench_rand_read,
+    'rand_write':	bench_rand_write,
+    'metadata':		bench_metadata,
+}
+
+def git_revision():
+    res = util.run('git', '-C', util.BASE_PATH, 'describe',
+                   '--always', '--dirty')
+    return res.stdout.strip() if res.returncode == 0 else None
+
+def parse_size(s):
+    units = { 'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30 }
+    if s[-1:].lower() in units:
+        return int(s[:-1]) * units[s[-1:].lower()]
+    return int(s)
+
+def main():
+    p = argparse.ArgumentParser(description='bcachefs benchmarks')
+    p.add_argument('-o', '--output', help='write results as JSON to file')
+    p.add_argument('-d', '--dir', help='scratch directory '
+                   '(default: /dev/shm if available)')
+    p.add_argument('-s', '--size', default='2G', type=parse_size,
+                   help='image size (default 2G)')
+    p.add_argument('-f', '--file-size', default='256M', type=parse_size,
+                   help='file size for the I/O benchmarks (default 256M)')
+    p.add_argument('-n', '--nr-files', default=10000, type=int,
+                   help='number of files for metadata benchmarks')
+    p.add_argument('benchmarks', nargs='*',
+                   help='benchmarks to run (default: all)')
+    args = p.parse_args()
+
+    fuse = util.have_fuse()
+    avail = dict(CLI_BENCHMARKS)
+    if fuse:
+        avail.update(FUSE_BENCHMARKS)
+
+    names = args.benchmarks or list(avail)
+    for n in names:
+        if n not in CLI_BENCHMARKS and n not in FUSE_BENCHMARKS:
+            sys.exit('unknown benchmark {}'.format(n))
+        if n not in avail:
+            sys.exit('{}: bcachefs not built with fuse support'.format(n))
+
+    scratch = args.dir or ('/dev/shm' if os.path.isdir('/dev/shm') else None)
+
+    # util.run() logs to stdout; keep that clear for the JSON:
+    with tempfile.TemporaryDirectory(dir=scratch) as tmpdir, \
+         contextlib.redirect_stdout(sys.stderr):
+        b = Bench(tmpdir, args.size, args.file_size, args.nr_files)
+        for n in names:
+            avail[n](b)
+
+    out = {
+        'revision':	git_revision(),
+        'time':		time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'host':		platform.node(),
+        'kernel':	platform.release(),
+        'fuse':		fuse,
+        'config': {
+            'size':		args.size,
+            'file_size':	args.file_size,
+            'nr_files':		args.nr_files,
+            'scratch':		scratch,
+        },
+        'results':	b.results,
+    }
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(out, f, indent=2)
+            f.write('\n')
+    else:
+        json.dump(out, sys.stdout, indent=2)
+        print()
+
+if __name__ == '__main__':
+    main()
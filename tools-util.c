@@ -211,6 +211,27 @@ unsigned get_blocksize(const char *path, int fd)
 	return ret;
 }
 
+/*
+ * Discard an entire device, or punch out an entire file; returns false if the
+ * device doesn't support it:
+ */
+bool discard_device(const char *path, int fd, u64 size, bool secure)
+{
+	struct stat statbuf = xfstat(fd);
+	u64 range[2] = { 0, size };
+
+	if (!S_ISBLK(statbuf.st_mode))
+		return !fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				  0, size);
+
+	if (!ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, &range))
+		return true;
+
+	if (errno != EOPNOTSUPP && errno != ENOTTY)
+		die("error discarding %s: %m", path);
+	return false;
+}
+
 /* Open a block device, do magic blkid stuff to probe for existing filesystems: */
 int open_for_format(const char *dev, bool force)
 {
@@ -326,25 +347,60 @@ void ranges_rounddown(ranges *r, unsigned block_size)
 	}
 }
 
+static void fiemap_iter_resize(struct fiemap_iter *iter, unsigned nr)
+{
+	iter->f = xrealloc(iter->f, sizeof(*iter->f) +
+			   nr * sizeof(iter->f->fm_extents[0]));
+	iter->f->fm_extent_count = nr;
+}
+
+void fiemap_iter_init(struct fiemap_iter *iter, int fd)
+{
+	memset(iter, 0, sizeof(*iter));
+	iter->f = xcalloc(1, sizeof(*iter->f));
+	fiemap_iter_resize(iter, FIEMAP_ITER_MIN_EXTENTS);
+
+	iter->f->fm_length	= FIEMAP_MAX_OFFSET;
+	iter->fd		= fd;
+}
+
+void fiemap_iter_exit(struct fiemap_iter *iter)
+{
+	free(iter->f);
+	iter->f = NULL;
+}
+
 struct fiemap_extent fiemap_iter_next(struct fiemap_iter *iter)
 {
+	struct fiemap *f = iter->f;
 	struct fiemap_extent e;
 
-	BUG_ON(iter->idx > iter->f.fm_mapped_extents);
+	BUG_ON(iter->idx > f->fm_mapped_extents);
+
+	if (iter->idx == f->fm_mapped_extents) {
+		/* Don't go back for more after the extent flagged as last: */
+		if (iter->last)
+			return (struct fiemap_extent) { .fe_length = 0 };
+
+		if (f->fm_mapped_extents == f->fm_extent_count &&
+		    f->fm_extent_count < FIEMAP_ITER_MAX_EXTENTS) {
+			fiemap_iter_resize(iter, f->fm_extent_count * 2);
+			f = iter->f;
+		}
 
-	if (iter->idx == iter->f.fm_mapped_extents) {
-		xioctl(iter->fd, FS_IOC_FIEMAP, &iter->f);
+		xioctl(iter->fd, FS_IOC_FIEMAP, f);
 
-		if (!iter->f.fm_mapped_extents)
+		if (!f->fm_mapped_extents)
 			return (struct fiemap_extent) { .fe_length = 0 };
 
 		iter->idx = 0;
 	}
 
-	e = iter->f.fm_extents[iter->idx++];
+	e = f->fm_extents[iter->idx++];
 	BUG_ON(!e.fe_length);
 
-	iter->f.fm_start = e.fe_logical + e.fe_length;
+	iter->last = e.fe_flags & FIEMAP_EXTENT_LAST;
+	f->fm_start = e.fe_logical + e.fe_length;
 
 	return e;
 }
@@ -358,6 +414,30 @@ char *strcmp_prefix(char *a, const char *a_prefix)
 	return *a_prefix ? NULL : a;
 }
 
+void json_escape(FILE *out, const char *s)
+{
+	for (; *s; s++)
+		switch (*s) {
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			if ((unsigned char) *s < 0x20)
+				fprintf(out, "\\u%04x", *s);
+			else
+				putc(*s, out);
+		}
+}
+
 /* crc32c */
 
 static u32 crc32c_default(u32 crc, const void *buf, size_t size)
@@ -438,8 +518,67 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 
 #include <linux/compiler.h>
 
+/*
+ * crc32c_shift() - crc32c(crc, len zero bytes), in O(log len):
+ *
+ * that's multiplication by x^(8 * len) mod P. Polynomials are bit reflected, as
+ * the crc is: bit 31 is x^0, bit 0 is x^31.
+ */
+#define CRC32C_POLY		0x82F63B78
+
+static u32 crc32c_multmodp(u32 a, u32 b)
+{
+	u32 m = 1U << 31, p = 0;
+
+	/* a must be nonzero: */
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = (b >> 1) ^ ((b & 1) ? CRC32C_POLY : 0);
+	}
+
+	return p;
+}
+
+static u32 crc32c_shift(u32 crc, size_t len)
+{
+	u32 p = 1U << 23;	/* x^8 */
+	u32 xn = 1U << 31;	/* x^0 */
+
+	for (; len; len >>= 1) {
+		if (len & 1)
+			xn = crc32c_multmodp(p, xn);
+		p = crc32c_multmodp(p, p);
+	}
+
+	return crc32c_multmodp(xn, crc);
+}
+
+/*
+ * Given crc1 = crc32c(seed, A) and crc2 = crc32c(0, B), returns
+ * crc32c(seed, A || B), where len2 is the length of B:
+ */
+u32 crc32c_combine(u32 crc1, u32 crc2, size_t len2)
+{
+	return crc32c_shift(crc1, len2) ^ crc2;
+}
+
+/*
+ * The crc32 instructions have a latency of 3 cycles, but a throughput of one
+ * per cycle: for big buffers we checksum three independent blocks at once, then
+ * combine their crcs. Blocks are CRC32C_LONG or CRC32C_SHORT bytes:
+ */
+#define CRC32C_LONG		8192
+#define CRC32C_SHORT		256
+
 #ifdef __x86_64__
 
+#include <immintrin.h>
+
 #ifdef CONFIG_X86_64
 #define REX_PRE "0x48, "
 #else
@@ -475,13 +614,137 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
+/*
+ * Combining is done with pclmul, as in the kernel's crc32c-pcl-intel: with
+ * crc0 and crc1 the crcs of the first two blocks, and crc2 the crc of the last
+ * block minus its last word w, the crc of all three blocks is
+ *
+ *   crc32q(crc2, w ^ clmul(crc0, K2) ^ clmul(crc1, K1))
+ *
+ * where K1 = x^(8 * len - 33) mod P, K2 = x^(16 * len - 33) mod P: crc32q of a
+ * 64 bit word multiplies it by x^32, and a reflected clmul by x^1.
+ */
+#define CRC32C_K1_LONG		0x54A86326
+#define CRC32C_K2_LONG		0x1DC403CC
+#define CRC32C_K1_SHORT		0xB9E02B86
+#define CRC32C_K2_SHORT		0xDD7E3B0C
+
+__attribute__((target("sse4.2,pclmul")))
+static __always_inline u32 crc32c_3way(u32 crc, const u8 *p, size_t len,
+				       u32 k1, u32 k2)
+{
+	const u64 *a = (const u64 *) p;
+	const u64 *b = (const u64 *) (p + len);
+	const u64 *c = (const u64 *) (p + len * 2);
+	u64 crc0 = crc, crc1 = 0, crc2 = 0;
+	size_t i, nr = len / sizeof(u64) - 1;
+	__m128i fold;
+
+	for (i = 0; i < nr; i++) {
+		crc0 = _mm_crc32_u64(crc0, a[i]);
+		crc1 = _mm_crc32_u64(crc1, b[i]);
+		crc2 = _mm_crc32_u64(crc2, c[i]);
+	}
+
+	crc0 = _mm_crc32_u64(crc0, a[nr]);
+	crc1 = _mm_crc32_u64(crc1, b[nr]);
+
+	fold = _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi32_si128(crc0),
+						  _mm_cvtsi32_si128(k2), 0),
+			     _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc1),
+						  _mm_cvtsi32_si128(k1), 0));
+
+	return _mm_crc32_u64(crc2, c[nr] ^ _mm_cvtsi128_si64(fold));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_pclmul(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size >= CRC32C_LONG * 3) {
+		crc = crc32c_3way(crc, p, CRC32C_LONG,
+				  CRC32C_K1_LONG, CRC32C_K2_LONG);
+		p	+= CRC32C_LONG * 3;
+		size	-= CRC32C_LONG * 3;
+	}
+
+	while (size >= CRC32C_SHORT * 3) {
+		crc = crc32c_3way(crc, p, CRC32C_SHORT,
+				  CRC32C_K1_SHORT, CRC32C_K2_SHORT);
+		p	+= CRC32C_SHORT * 3;
+		size	-= CRC32C_SHORT * 3;
+	}
+
+	return crc32c_sse42(crc, p, size);
+}
+
+#endif
+
+#ifdef __aarch64__
+
+#include <arm_acle.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32		(1 << 7)
+#endif
+
+/*
+ * No pclmul equivalent without the crypto extensions, so combine in software:
+ * that's two crc32c_multmodp() calls, which only pays for itself on long
+ * blocks. X1 = x^(8 * CRC32C_LONG) mod P, X2 = x^(16 * CRC32C_LONG) mod P.
+ */
+#define CRC32C_X1_LONG		0x28461564
+#define CRC32C_X2_LONG		0xBF455269
+
+__attribute__((target("+crc")))
+static u32 crc32c_armv8(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size >= CRC32C_LONG * 3) {
+		const u64 *a = (const u64 *) p;
+		const u64 *b = (const u64 *) (p + CRC32C_LONG);
+		const u64 *c = (const u64 *) (p + CRC32C_LONG * 2);
+		u32 crc1 = 0, crc2 = 0;
+		size_t i;
+
+		for (i = 0; i < CRC32C_LONG / sizeof(u64); i++) {
+			crc  = __crc32cd(crc,  a[i]);
+			crc1 = __crc32cd(crc1, b[i]);
+			crc2 = __crc32cd(crc2, c[i]);
+		}
+
+		crc = crc32c_multmodp(CRC32C_X2_LONG, crc) ^
+		      crc32c_multmodp(CRC32C_X1_LONG, crc1) ^ crc2;
+		p	+= CRC32C_LONG * 3;
+		size	-= CRC32C_LONG * 3;
+	}
+
+	for (; size >= sizeof(u64); p += sizeof(u64), size -= sizeof(u64))
+		crc = __crc32cd(crc, *((const u64 *) p));
+
+	while (size--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
 #endif
 
 static void *resolve_crc32c(void)
 {
 #ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul"))
+		return crc32c_pclmul;
 	if (__builtin_cpu_supports("sse4.2"))
 		return crc32c_sse42;
+#endif
+#ifdef __aarch64__
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return crc32c_armv8;
 #endif
 	return crc32c_default;
 }
@@ -515,6 +778,97 @@ u32 crc32c(u32 crc, const void *buf, size_t size)
 
 #endif /* HAVE_WORKING_IFUNC */
 
+/*
+ * crc32c_x3() - checksum three independent buffers of the same length at once
+ *
+ * For callers with several small buffers to checksum: interleaving their crc
+ * chains hides the latency of the crc32 instruction without needing to combine
+ * crcs, which isn't worth it for short buffers.
+ */
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static void crc32c_x3_sse42(u32 crc[3], const void * const buf[3], size_t len)
+{
+	const u8 *a = buf[0], *b = buf[1], *c = buf[2];
+	u64 crc0 = crc[0], crc1 = crc[1], crc2 = crc[2];
+	size_t i;
+
+	for (i = 0; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		crc0 = _mm_crc32_u64(crc0, *((const u64 *) (a + i)));
+		crc1 = _mm_crc32_u64(crc1, *((const u64 *) (b + i)));
+		crc2 = _mm_crc32_u64(crc2, *((const u64 *) (c + i)));
+	}
+
+	for (; i < len; i++) {
+		crc0 = _mm_crc32_u8(crc0, a[i]);
+		crc1 = _mm_crc32_u8(crc1, b[i]);
+		crc2 = _mm_crc32_u8(crc2, c[i]);
+	}
+
+	crc[0] = crc0;
+	crc[1] = crc1;
+	crc[2] = crc2;
+}
+#endif
+
+#ifdef __aarch64__
+__attribute__((target("+crc")))
+static void crc32c_x3_armv8(u32 crc[3], const void * const buf[3], size_t len)
+{
+	const u8 *a = buf[0], *b = buf[1], *c = buf[2];
+	u32 crc0 = crc[0], crc1 = crc[1], crc2 = crc[2];
+	size_t i;
+
+	for (i = 0; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		crc0 = __crc32cd(crc0, *((const u64 *) (a + i)));
+		crc1 = __crc32cd(crc1, *((const u64 *) (b + i)));
+		crc2 = __crc32cd(crc2, *((const u64 *) (c + i)));
+	}
+
+	for (; i < len; i++) {
+		crc0 = __crc32cb(crc0, a[i]);
+		crc1 = __crc32cb(crc1, b[i]);
+		crc2 = __crc32cb(crc2, c[i]);
+	}
+
+	crc[0] = crc0;
+	crc[1] = crc1;
+	crc[2] = crc2;
+}
+#endif
+
+static void crc32c_x3_default(u32 crc[3], const void * const buf[3], size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < 3; i++)
+		crc[i] = crc32c(crc[i], buf[i], len);
+}
+
+static void *resolve_crc32c_x3(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_x3_sse42;
+#endif
+#ifdef __aarch64__
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return crc32c_x3_armv8;
+#endif
+	return crc32c_x3_default;
+}
+
+void crc32c_x3(u32 crc[3], const void * const buf[3], size_t len)
+{
+	static void (*real_crc32c_x3)(u32 *, const void * const *, size_t);
+
+	if (unlikely(!real_crc32c_x3))
+		real_crc32c_x3 = resolve_crc32c_x3();
+
+	real_crc32c_x3(crc, buf, len);
+}
+
 char *dev_to_name(dev_t dev)
 {
 	char *line = NULL, *name = NULL;
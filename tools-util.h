@@ -62,6 +62,7 @@ ssize_t read_string_list_or_die(const char *, const char * const[],
 
 u64 get_size(const char *, int);
 unsigned get_blocksize(const char *, int);
+bool discard_device(const char *, int, u64, bool);
 int open_for_format(const char *, bool);
 
 bool ask_yn(void);
@@ -112,31 +113,37 @@ static inline struct range hole_iter_next(struct hole_iter *iter)
 
 #include <linux/fiemap.h>
 
+/*
+ * The extent array starts out small, and grows each time FS_IOC_FIEMAP fills
+ * it, so that small files take one ioctl and very fragmented ones don't take
+ * thousands:
+ */
+#define FIEMAP_ITER_MIN_EXTENTS		32
+#define FIEMAP_ITER_MAX_EXTENTS		(1U << 14)
+
 struct fiemap_iter {
-	struct fiemap		f;
-	struct fiemap_extent	fe[1024];
+	struct fiemap		*f;
 	unsigned		idx;
+	bool			last;
 	int			fd;
 };
 
-static inline void fiemap_iter_init(struct fiemap_iter *iter, int fd)
-{
-	memset(iter, 0, sizeof(*iter));
-
-	iter->f.fm_extent_count	= ARRAY_SIZE(iter->fe);
-	iter->f.fm_length	= FIEMAP_MAX_OFFSET;
-	iter->fd		= fd;
-}
-
+void fiemap_iter_init(struct fiemap_iter *, int);
+void fiemap_iter_exit(struct fiemap_iter *);
 struct fiemap_extent fiemap_iter_next(struct fiemap_iter *);
 
+/* call fiemap_iter_exit() when breaking out of the loop early: */
 #define fiemap_for_each(fd, iter, extent)				\
 	for (fiemap_iter_init(&iter, fd);				\
-	     (extent = fiemap_iter_next(&iter)).fe_length;)
+	     (extent = fiemap_iter_next(&iter)).fe_length ||		\
+	     (fiemap_iter_exit(&iter), false);)
 
 char *strcmp_prefix(char *, const char *);
+void json_escape(FILE *, const char *);
 
 u32 crc32c(u32, const void *, size_t);
+u32 crc32c_combine(u32, u32, size_t);
+void crc32c_x3(u32[3], const void * const[3], size_t);
 
 char *dev_to_name(dev_t);
 char *dev_to_path(dev_t);